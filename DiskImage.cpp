@@ -5,8 +5,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
 
 #include "DiskImage.h"
+#include "crc.h"
 
 #define ERR_OPEN        "Error: can't open source file"
 #define ERR_GETLEN      "Error: can't get file length!"
@@ -70,14 +72,29 @@ struct VGFIND_SECTOR
 };
 
 
+// Address mark offsets of the sectors of a track, in the order FindSector
+// meets them from the track start. Built on the first lookup of the track.
+#define VGINDEX_NONE 0xFFFFFFFF
+
+struct VGSECTOR_INDEX
+{
+	unsigned char *TrackPointer;  // the track it was built for
+	unsigned int TrackLength;
+	unsigned int MarkedOffsetADM[256];
+};
+
+
 class TDiskImage
 {
 	unsigned int FTrackLength[256][256];
 	unsigned char* FTracksPtr[256][256][2];
+	VGSECTOR_INDEX* FSectorIndex[256][2];
 
 	TDiskImageType FType;
 
 	unsigned short MakeVGCRC(unsigned char *data, unsigned long length);
+	VGSECTOR_INDEX *GetSectorIndex(unsigned char CYL, unsigned char SIDE);
+	void FreeSectorIndex();
 public:
 	bool Changed;
 
@@ -803,18 +820,6 @@ static const unsigned char sbootimage[] = {
 
 TRDOS_DIR_ELEMENT sbootdir = { {'b','o','o','t',' ',' ',' ',' '}, 'B', 0xB4, 0xB4, (sizeof(sbootimage)+255)/256, 0, 0 };
 
-long CalcCRC32(long CRC, unsigned char Symbol)
-{
-	long temp;
-	CRC ^= -1l ^ Symbol;
-	for (int k = 8; k--;)
-	{
-		temp = -(CRC & 1), CRC >>= 1, CRC ^= 0xEDB88320ul & temp;
-	}
-	CRC ^= -1l;
-	return CRC;
-}
-
 long filelength(int hfile)
 {
 	long ret = lseek(hfile, 0, SEEK_END);
@@ -833,6 +838,12 @@ TDiskImage::TDiskImage()
 			FTracksPtr[t][s][1] = NULL;
 		}
 
+	for (int t = 0; t < 256; t++)
+	{
+		FSectorIndex[t][0] = NULL;
+		FSectorIndex[t][1] = NULL;
+	}
+
 	DiskPresent = false;
 	ReadOnly = true;
 	Changed = false;
@@ -857,21 +868,67 @@ TDiskImage::~TDiskImage()
 			if (FTracksPtr[t][s][1]) delete FTracksPtr[t][s][1];
 			FTracksPtr[t][s][1] = NULL;
 		}
+
+	FreeSectorIndex();
 }
 //-----------------------------------------------------------------------------
 unsigned short TDiskImage::MakeVGCRC(unsigned char *data, unsigned long length)
 {
-	unsigned short CRC = 0xFFFF;
-	for (unsigned int i = 0; i < length; i++)
+	return crc16_ccitt(0xFFFF, data, length);          // H<-->L !!!
+}
+//-----------------------------------------------------------------------------
+void TDiskImage::FreeSectorIndex()
+{
+	for (int t = 0; t < 256; t++)
+		for (int s = 0; s < 2; s++)
+		{
+			if (FSectorIndex[t][s]) delete FSectorIndex[t][s];
+			FSectorIndex[t][s] = NULL;
+		}
+}
+//-----------------------------------------------------------------------------
+//
+// Walks the address marks once like FindSector does, so a lookup from the
+// track start goes straight to the mark FindSector would stop at. Only the
+// offsets are kept: CRC of the sector and its data are checked on lookup,
+// ApplySectorCRC and writes to sector data don't move the marks.
+//
+VGSECTOR_INDEX *TDiskImage::GetSectorIndex(unsigned char CYL, unsigned char SIDE)
+{
+	if (SIDE > 1) return NULL;
+
+	VGSECTOR_INDEX *idx = FSectorIndex[CYL][SIDE];
+	if (idx && idx->TrackPointer == FTracksPtr[CYL][SIDE][0] && idx->TrackLength == FTrackLength[CYL][SIDE]) return idx;
+
+	if (!idx) idx = FSectorIndex[CYL][SIDE] = new VGSECTOR_INDEX;
+	idx->TrackPointer = FTracksPtr[CYL][SIDE][0];
+	idx->TrackLength = FTrackLength[CYL][SIDE];
+	for (int i = 0; i < 256; i++) idx->MarkedOffsetADM[i] = VGINDEX_NONE;
+
+	VGFIND_ADM vgfa;
+	unsigned int TrackOffset = 0;
+	bool FirstFind = true;
+	unsigned int FirstPos = 0;
+
+	while (FindADMark(CYL, SIDE, TrackOffset, &vgfa))
 	{
-		CRC ^= data[i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
+		unsigned char sect = vgfa.TrackPointer[(vgfa.OffsetADM + 2) % vgfa.TrackLength];
+		if (idx->MarkedOffsetADM[sect] == VGINDEX_NONE) idx->MarkedOffsetADM[sect] = vgfa.MarkedOffsetADM;
+
+		if (!FirstFind)
 		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
+			if (vgfa.OffsetEndADM == FirstPos) break;
 		}
+		else
+		{
+			FirstPos = vgfa.OffsetEndADM;
+			FirstFind = false;
+		}
+
+		TrackOffset = vgfa.OffsetEndADM;
 	}
-	return CRC;          // H<-->L !!!
+
+	return idx;
 }
 //-----------------------------------------------------------------------------
 void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
@@ -889,26 +946,8 @@ void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
 	unsigned int len2 = 0;
 	if (len1 < len) len2 = len - len1;
 
-	unsigned int i;
-	unsigned short CRC = 0xFFFF;
-	for (i = 0; i < len1; i++)
-	{
-		CRC ^= TrackPtr[off1 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
-	for (i = 0; i < len2; i++)
-	{
-		CRC ^= TrackPtr[off2 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
+	unsigned short CRC = crc16_ccitt(0xFFFF, TrackPtr + off1, len1);
+	CRC = crc16_ccitt(CRC, TrackPtr + off2, len2);
 	unsigned int crcoff = (off1 + len1) % TrackLen;
 	if (len2) crcoff = (off2 + len2) % TrackLen;
 
@@ -1015,7 +1054,16 @@ bool TDiskImage::FindSector(unsigned char CYL, unsigned char SIDE,
 
 	// Поиск адресной метки требуемого сектора...
 	bool ADFOUND = false;
-	for (;;)
+	VGSECTOR_INDEX *idx = FromOffset ? NULL : GetSectorIndex(CYL, SIDE);
+	if (idx)
+	{
+		if (idx->MarkedOffsetADM[SECT] == VGINDEX_NONE ||
+			!FindADMark(CYL, SIDE, idx->MarkedOffsetADM[SECT], &(vgfs->vgfa)))
+			return false;          // ERROR: No ADMARK of the sector on track
+
+		ADFOUND = true;
+	}
+	else for (;;)
 	{
 		if (!FindADMark(CYL, SIDE, TrackOffset, &(vgfs->vgfa)))
 			return false;          // ERROR: No ADMARK found on track
@@ -1133,6 +1181,7 @@ void TDiskImage::Open(const char *filename, bool ROnly)
 
 	if (!((FType == DIT_HOB) && (typ == DIT_HOB)))     // if not hobeta clear disk...
 	{
+		FreeSectorIndex();
 		ReadOnly = true;
 		DiskPresent = false;
 		Changed = false;
@@ -1183,6 +1232,8 @@ void TDiskImage::formatTRDOS(unsigned int Tcount, unsigned int Scount)
 
 	unsigned short TotalSecs = Tcount*Scount * 16 - 16;
 
+	FreeSectorIndex();
+
 	// форматирование нового диска под TR-DOS (16 x 256bytes sector per track)...
 	unsigned int ptrcrc;
 	unsigned int r;
@@ -1444,8 +1495,8 @@ void TDiskImage::readUDI(int hfile, bool ronly)
 				udiOFF++;
 			}
 		}
-	long CRC = -1l;
-	for (unsigned int i = 0; i < udiOFF; i++) CRC = CalcCRC32(CRC, ptr[i]);
+	// UDI keeps the CRC32 register un-inverted at the start
+	long CRC = crc32_update(0xFFFFFFFF, ptr, udiOFF);
 
 
 	if (udiOFF < rsize)
@@ -2424,7 +2475,6 @@ void TDiskImage::readHOB(int hfile)
 }
 //-----------------------------------------------------------------------------
 bool unpack_td0(unsigned char *data, long &size);
-unsigned short TD0CRC(unsigned char *buf, unsigned int len);
 
 #define WORD2(a,b) ((a)+(b)*0x100)
 
@@ -2466,7 +2516,7 @@ void TDiskImage::readTD0(int hfile, bool readonly)
 		ShowError(ERR_FORMAT" TD0!");
 		return;
 	}
-	if (TD0CRC(ptr, 10) != td0hdr->CRC) // CRC bad...
+	if (crc16_td0(0, ptr, 10) != td0hdr->CRC) // CRC bad...
 	{
 		delete ptr;
 		ShowError(ERR_FILECRC" TD0!");
@@ -2711,7 +2761,6 @@ void TDiskImage::ShowError(const char *str)
 
 //-----------------------------------------------------------------------------
 // convert packed td0 to unpacked
-unsigned short TD0CRC(unsigned char *buf, unsigned int len);
 unsigned unpack_lzh(unsigned char *src, unsigned size, unsigned char *buf);
 unsigned char *td0_dst, *td0_src;
 
@@ -2728,7 +2777,7 @@ bool unpack_td0(unsigned char *data, long &size)
 	if (size < 12) return false;
 	if ((*(short*)data != WORD2('T', 'D')) && (*(short*)data != WORD2('t', 'd')))
 		return false;             // non TD0
-	if (TD0CRC(data, 10) != *((unsigned short*)(data + 0x0A)))
+	if (crc16_td0(0, data, 10) != *((unsigned short*)(data + 0x0A)))
 		return false;             // CRC bad...
 	if (data[4] > 21)
 		return false;             // version > 2.1...
@@ -2754,7 +2803,7 @@ bool unpack_td0(unsigned char *data, long &size)
 	{
 		unsigned short *cs = (unsigned short*)(snbuf + 12 + 2);
 
-		if (TD0CRC(snbuf + 12 + 2, 8 + *cs) != cs[-1])
+		if (crc16_td0(0, snbuf + 12 + 2, 8 + *cs) != cs[-1])
 		{
 			delete snbuf;
 			return false;
@@ -2829,54 +2878,6 @@ bool unpack_td0(unsigned char *data, long &size)
 //
 // TD0 CRC - table&proc grabed from TDCHECK.EXE by Alex Makeev
 //
-unsigned char tbltd0crc[512] = {
-	0x00,0x00,0xA0,0x97,0xE1,0xB9,0x41,0x2E,0x63,0xE5,0xC3,0x72,0x82,0x5C,0x22,0xCB,
-	0xC7,0xCA,0x67,0x5D,0x26,0x73,0x86,0xE4,0xA4,0x2F,0x04,0xB8,0x45,0x96,0xE5,0x01,
-	0x2F,0x03,0x8F,0x94,0xCE,0xBA,0x6E,0x2D,0x4C,0xE6,0xEC,0x71,0xAD,0x5F,0x0D,0xC8,
-	0xE8,0xC9,0x48,0x5E,0x09,0x70,0xA9,0xE7,0x8B,0x2C,0x2B,0xBB,0x6A,0x95,0xCA,0x02,
-	0x5E,0x06,0xFE,0x91,0xBF,0xBF,0x1F,0x28,0x3D,0xE3,0x9D,0x74,0xDC,0x5A,0x7C,0xCD,
-	0x99,0xCC,0x39,0x5B,0x78,0x75,0xD8,0xE2,0xFA,0x29,0x5A,0xBE,0x1B,0x90,0xBB,0x07,
-	0x71,0x05,0xD1,0x92,0x90,0xBC,0x30,0x2B,0x12,0xE0,0xB2,0x77,0xF3,0x59,0x53,0xCE,
-	0xB6,0xCF,0x16,0x58,0x57,0x76,0xF7,0xE1,0xD5,0x2A,0x75,0xBD,0x34,0x93,0x94,0x04,
-	0xBC,0x0C,0x1C,0x9B,0x5D,0xB5,0xFD,0x22,0xDF,0xE9,0x7F,0x7E,0x3E,0x50,0x9E,0xC7,
-	0x7B,0xC6,0xDB,0x51,0x9A,0x7F,0x3A,0xE8,0x18,0x23,0xB8,0xB4,0xF9,0x9A,0x59,0x0D,
-	0x93,0x0F,0x33,0x98,0x72,0xB6,0xD2,0x21,0xF0,0xEA,0x50,0x7D,0x11,0x53,0xB1,0xC4,
-	0x54,0xC5,0xF4,0x52,0xB5,0x7C,0x15,0xEB,0x37,0x20,0x97,0xB7,0xD6,0x99,0x76,0x0E,
-	0xE2,0x0A,0x42,0x9D,0x03,0xB3,0xA3,0x24,0x81,0xEF,0x21,0x78,0x60,0x56,0xC0,0xC1,
-	0x25,0xC0,0x85,0x57,0xC4,0x79,0x64,0xEE,0x46,0x25,0xE6,0xB2,0xA7,0x9C,0x07,0x0B,
-	0xCD,0x09,0x6D,0x9E,0x2C,0xB0,0x8C,0x27,0xAE,0xEC,0x0E,0x7B,0x4F,0x55,0xEF,0xC2,
-	0x0A,0xC3,0xAA,0x54,0xEB,0x7A,0x4B,0xED,0x69,0x26,0xC9,0xB1,0x88,0x9F,0x28,0x08,
-	0xD8,0x8F,0x78,0x18,0x39,0x36,0x99,0xA1,0xBB,0x6A,0x1B,0xFD,0x5A,0xD3,0xFA,0x44,
-	0x1F,0x45,0xBF,0xD2,0xFE,0xFC,0x5E,0x6B,0x7C,0xA0,0xDC,0x37,0x9D,0x19,0x3D,0x8E,
-	0xF7,0x8C,0x57,0x1B,0x16,0x35,0xB6,0xA2,0x94,0x69,0x34,0xFE,0x75,0xD0,0xD5,0x47,
-	0x30,0x46,0x90,0xD1,0xD1,0xFF,0x71,0x68,0x53,0xA3,0xF3,0x34,0xB2,0x1A,0x12,0x8D,
-	0x86,0x89,0x26,0x1E,0x67,0x30,0xC7,0xA7,0xE5,0x6C,0x45,0xFB,0x04,0xD5,0xA4,0x42,
-	0x41,0x43,0xE1,0xD4,0xA0,0xFA,0x00,0x6D,0x22,0xA6,0x82,0x31,0xC3,0x1F,0x63,0x88,
-	0xA9,0x8A,0x09,0x1D,0x48,0x33,0xE8,0xA4,0xCA,0x6F,0x6A,0xF8,0x2B,0xD6,0x8B,0x41,
-	0x6E,0x40,0xCE,0xD7,0x8F,0xF9,0x2F,0x6E,0x0D,0xA5,0xAD,0x32,0xEC,0x1C,0x4C,0x8B,
-	0x64,0x83,0xC4,0x14,0x85,0x3A,0x25,0xAD,0x07,0x66,0xA7,0xF1,0xE6,0xDF,0x46,0x48,
-	0xA3,0x49,0x03,0xDE,0x42,0xF0,0xE2,0x67,0xC0,0xAC,0x60,0x3B,0x21,0x15,0x81,0x82,
-	0x4B,0x80,0xEB,0x17,0xAA,0x39,0x0A,0xAE,0x28,0x65,0x88,0xF2,0xC9,0xDC,0x69,0x4B,
-	0x8C,0x4A,0x2C,0xDD,0x6D,0xF3,0xCD,0x64,0xEF,0xAF,0x4F,0x38,0x0E,0x16,0xAE,0x81,
-	0x3A,0x85,0x9A,0x12,0xDB,0x3C,0x7B,0xAB,0x59,0x60,0xF9,0xF7,0xB8,0xD9,0x18,0x4E,
-	0xFD,0x4F,0x5D,0xD8,0x1C,0xF6,0xBC,0x61,0x9E,0xAA,0x3E,0x3D,0x7F,0x13,0xDF,0x84,
-	0x15,0x86,0xB5,0x11,0xF4,0x3F,0x54,0xA8,0x76,0x63,0xD6,0xF4,0x97,0xDA,0x37,0x4D,
-	0xD2,0x4C,0x72,0xDB,0x33,0xF5,0x93,0x62,0xB1,0xA9,0x11,0x3E,0x50,0x10,0xF0,0x87,
-};
-unsigned short TD0CRC(unsigned char *buf, unsigned int len)
-{
-	unsigned short CRC = 0;
-	int j;
-	for (unsigned int i = 0; i < len; i++)
-	{
-		CRC ^= *buf++;
-		j = CRC & 0xFF;
-		CRC &= 0xFF00;
-		CRC = (CRC << 8) | (CRC >> 8);
-		CRC ^= ((unsigned short*)tbltd0crc)[j];
-	}
-	return (CRC << 8) | (CRC >> 8);
-}
 // ----------------------------------------------------------------------------
 
 unsigned char *packed_ptr, *packed_end;
@@ -3312,6 +3313,140 @@ static void write_data_field(uint8_t *page)
 	write_byte(0xEB);
 }
 
+//--------------------------------------------------------------------------
+// Converted images are kept in /tmp (RAM), keyed by the source file and the
+// converter version, so mounting the same image again just copies the result
+// into the vdsk instead of converting once more. Bump CONV_CACHE_VERSION when
+// the output of a converter changes.
+#define CONV_CACHE_DIR     "/tmp/conv_cache"
+#define CONV_CACHE_VERSION 1
+#define CONV_CACHE_FILES   16
+
+// path gets the cached image, key the text identifying the source
+static int conv_cache_key(const char *name, const char *conv, char *path, char *key, int keylen)
+{
+	const char *full = getFullPath(name);
+	struct stat64 st;
+	if (stat64(full, &st)) return 0;
+
+	snprintf(key, keylen, "%s:%d\n%s\n%llu\n%llu\n", conv, CONV_CACHE_VERSION, full,
+		(unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	sprintf(path, CONV_CACHE_DIR "/%08x", crc32_update(0, key, strlen(key)));
+	return 1;
+}
+
+static int conv_copy(int src, int dst)
+{
+	static uint8_t buf[64 * 1024];
+	while (1)
+	{
+		int len = read(src, buf, sizeof(buf));
+		if (!len) return 1;
+		if (len < 0 || write(dst, buf, len) != len) return 0;
+	}
+}
+
+static int conv_cache_load(const char *path, const char *key, fileTYPE *f)
+{
+	char kpath[64], kbuf[1200] = {};
+	sprintf(kpath, "%s.key", path);
+
+	int fd = open(kpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	int len = read(fd, kbuf, sizeof(kbuf) - 1);
+	close(fd);
+	if (len <= 0 || strcmp(kbuf, key)) return 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	if (!FileOpenEx(f, "vdsk", -1))
+	{
+		close(fd);
+		return 0;
+	}
+
+	fflush(f->filp);
+	int ok = conv_copy(fd, fileno(f->filp));
+	close(fd);
+
+	if (!ok)
+	{
+		FileClose(f);
+		return 0;
+	}
+
+	f->size = FileGetSize(f);
+	FileSeekLBA(f, 0);
+	return 1;
+}
+
+static void conv_cache_evict()
+{
+	DIR *d = opendir(CONV_CACHE_DIR);
+	if (!d) return;
+
+	char oldest[300] = {};
+	time_t oldest_time = 0;
+	int cnt = 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		int len = strlen(de->d_name);
+		if (len < 4 || strcmp(de->d_name + len - 4, ".key")) continue;
+
+		char kpath[300];
+		snprintf(kpath, sizeof(kpath), CONV_CACHE_DIR "/%s", de->d_name);
+
+		struct stat st;
+		if (stat(kpath, &st)) continue;
+		if (!cnt++ || st.st_mtime < oldest_time)
+		{
+			oldest_time = st.st_mtime;
+			strcpy(oldest, kpath);
+		}
+	}
+	closedir(d);
+
+	if (cnt >= CONV_CACHE_FILES)
+	{
+		unlink(oldest);
+		oldest[strlen(oldest) - 4] = 0;
+		unlink(oldest);
+	}
+}
+
+static void conv_cache_store(const char *path, const char *key, fileTYPE *f)
+{
+	mkdir(CONV_CACHE_DIR, 0755);
+	conv_cache_evict();
+
+	char tmp[64];
+	sprintf(tmp, "%s.tmp", path);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	fflush(f->filp);
+	int src = fileno(f->filp);
+	int ok = lseek(src, 0, SEEK_SET) == 0 && conv_copy(src, fd);
+	close(fd);
+	FileSeekLBA(f, 0);
+
+	if (ok) ok = !rename(tmp, path);
+	else unlink(tmp);
+	if (!ok) return;
+
+	// the key goes last, an entry without it is never used
+	sprintf(tmp, "%s.key", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+	ok = write(fd, key, strlen(key)) == (int)strlen(key);
+	close(fd);
+	if (!ok) unlink(tmp);
+}
+
 int dsk2nib(const char *name, fileTYPE *f)
 {
 	int len = strlen(name);
@@ -3326,6 +3461,14 @@ int dsk2nib(const char *name, fileTYPE *f)
 		return 0;
 	}
 
+	char cache_path[64], cache_key[1200];
+	int cacheable = conv_cache_key(name, "dsk2nib", cache_path, cache_key, sizeof(cache_key));
+	if (cacheable && conv_cache_load(cache_path, cache_key, f))
+	{
+		printf("dsk2nib: cached vdsk size=%llu.\n", f->size);
+		return 1;
+	}
+
 	static uint8_t dos_track[SECTORS * SECTOR_SIZE]; // , pro_track[SECTORS * SECTOR_SIZE];
 	static uint8_t raw_track[RAW_TRACK_uint8_tS];
 
@@ -3385,12 +3528,22 @@ int dsk2nib(const char *name, fileTYPE *f)
 	FileSeekLBA(f, 0);
 	printf("dsk2nib: vdsk size=%llu.\n", f->size);
 
+	if (cacheable) conv_cache_store(cache_path, cache_key, f);
+
 	return 1;
 }
 
 //--------------------------------------------------------------------------
 int x2trd(const char *name, fileTYPE *f)
 {
+	char cache_path[64], cache_key[1200];
+	int cacheable = conv_cache_key(name, "x2trd", cache_path, cache_key, sizeof(cache_key));
+	if (cacheable && conv_cache_load(cache_path, cache_key, f))
+	{
+		printf("x2trd: cached vdsk size=%llu.\n", f->size);
+		return 1;
+	}
+
 	TDiskImage *img = new TDiskImage;
 	img->Open(getFullPath(name), true);
 
@@ -3408,6 +3561,8 @@ int x2trd(const char *name, fileTYPE *f)
 	FileSeekLBA(f, 0);
 	printf("x2trd: vdsk size=%llu.\n", f->size);
 
+	if (cacheable) conv_cache_store(cache_path, cache_key, f);
+
 	return 1;
 }
 
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "memtrack.h"
+
+#define ARENA_BLOCK (256 * 1024)
+#define ARENA_ALIGN 16
+#define POOL_SLAB   (256 * 1024)
+#define POOL_SIZES  8
+
+struct arena_block_t
+{
+	arena_block_t *next;   // older block
+	size_t size;           // usable bytes after the header
+};
+
+#define BLOCK_HDR ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block_t *block_new(size_t size)
+{
+	void *p = mmap(NULL, BLOCK_HDR + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+
+	arena_block_t *b = (arena_block_t *)p;
+	b->next = NULL;
+	b->size = size;
+	mem_account(MEM_ARENA, BLOCK_HDR + size);
+	return b;
+}
+
+static void block_free(arena_block_t *b)
+{
+	mem_account(MEM_ARENA, -(int64_t)(BLOCK_HDR + b->size));
+	munmap(b, BLOCK_HDR + b->size);
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!size) size = ARENA_ALIGN;
+
+	uint8_t *p;
+	if (a->head && a->used + size <= a->head->size)
+	{
+		p = (uint8_t *)a->head + BLOCK_HDR + a->used;
+		a->used += size;
+	}
+	else if (a->head && size > ARENA_BLOCK / 4)
+	{
+		// Big ones get a block of their own behind head, the space left in head stays in use
+		arena_block_t *b = block_new(size);
+		if (!b) return NULL;
+		b->next = a->head->next;
+		a->head->next = b;
+		p = (uint8_t *)b + BLOCK_HDR;
+	}
+	else
+	{
+		arena_block_t *b = block_new(size > ARENA_BLOCK ? size : ARENA_BLOCK);
+		if (!b) return NULL;
+		b->next = a->head;
+		a->head = b;
+		a->used = size;
+		p = (uint8_t *)b + BLOCK_HDR;
+	}
+
+	a->size += size;
+	if (a->size > a->peak) a->peak = a->size;
+	return p;
+}
+
+void *arena_memdup(arena_t *a, const void *data, size_t size)
+{
+	void *p = arena_alloc(a, size);
+	if (p) memcpy(p, data, size);
+	return p;
+}
+
+char *arena_strndup(arena_t *a, const char *str, size_t max)
+{
+	size_t len = strnlen(str, max);
+	char *p = (char *)arena_alloc(a, len + 1);
+	if (p)
+	{
+		memcpy(p, str, len);
+		p[len] = 0;
+	}
+	return p;
+}
+
+void arena_reset(arena_t *a)
+{
+	arena_block_t *keep = NULL;
+	arena_block_t *b = a->head;
+	while (b)
+	{
+		arena_block_t *next = b->next;
+		if (!next && b->size == ARENA_BLOCK) keep = b;
+		else block_free(b);
+		b = next;
+	}
+
+	if (keep) keep->next = NULL;
+	a->head = keep;
+	a->used = 0;
+	a->size = 0;
+}
+
+void arena_release(arena_t *a)
+{
+	arena_reset(a);
+	if (a->head) block_free(a->head);
+	a->head = NULL;
+}
+
+struct mem_pool_t
+{
+	size_t size;
+	void *free;      // buffers linked through their first word
+	uint32_t count;
+	uint32_t idle;
+};
+
+static mem_pool_t pools[POOL_SIZES] = {};
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mem_pool_t *pool_find(size_t size, int create)
+{
+	for (int i = 0; i < POOL_SIZES; i++)
+	{
+		if (pools[i].size == size) return &pools[i];
+		if (!pools[i].size)
+		{
+			if (!create) return NULL;
+			pools[i].size = size;
+			return &pools[i];
+		}
+	}
+	return NULL;
+}
+
+// Carves a slab into buffers for the free list
+static int pool_grow(mem_pool_t *p)
+{
+	uint32_t n = (p->size < POOL_SLAB) ? POOL_SLAB / p->size : 1;
+	uint8_t *slab = (uint8_t *)mmap(NULL, n * p->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED) return 0;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		void *buf = slab + i * p->size;
+		*(void **)buf = p->free;
+		p->free = buf;
+	}
+
+	p->count += n;
+	p->idle += n;
+	mem_account(MEM_POOL, n * p->size);
+	return 1;
+}
+
+void *mem_pool_get(size_t size)
+{
+	if (size < sizeof(void *)) size = sizeof(void *);
+
+	pthread_mutex_lock(&pool_lock);
+	void *buf = NULL;
+	mem_pool_t *p = pool_find(size, 1);
+	if (!p)
+	{
+		printf("mem_pool: no pool left for %u byte buffers.\n", (uint32_t)size);
+		buf = malloc(size);
+	}
+	else if (p->free || pool_grow(p))
+	{
+		buf = p->free;
+		p->free = *(void **)buf;
+		p->idle--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return buf;
+}
+
+void mem_pool_put(void *buf, size_t size)
+{
+	if (!buf) return;
+	if (size < sizeof(void *)) size = sizeof(void *);
+
+	pthread_mutex_lock(&pool_lock);
+	mem_pool_t *p = pool_find(size, 0);
+	if (!p) free(buf);
+	else
+	{
+		*(void **)buf = p->free;
+		p->free = buf;
+		p->idle++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory for data that lives as long as the load that made it (the cheat
+// list of a game, the buffers of a mounted image) and goes away with it.
+//
+// An arena hands out memory from mmap'ed blocks by bumping a pointer, there
+// is no free of single allocations. arena_reset() drops everything in one
+// step and keeps the first block, so the next load reuses the same pages
+// instead of leaving holes in the heap.
+//
+// Pools keep buffers of one size (CD sector windows, CHD hunks) on a free
+// list. Buffers put back stay in the pool for the next mount.
+
+struct arena_block_t;
+
+struct arena_t
+{
+	const char *name;
+	arena_block_t *head;   // block allocations come from, chained to the older ones
+	size_t used;           // in head
+	size_t size;           // handed out since the last reset
+	size_t peak;
+};
+
+#define ARENA_INIT(name) { name, NULL, 0, 0, 0 }
+
+// 16 byte aligned, NULL if out of memory.
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_memdup(arena_t *a, const void *data, size_t size);
+char *arena_strndup(arena_t *a, const char *str, size_t max);
+
+// Frees everything allocated, keeps the first block.
+void arena_reset(arena_t *a);
+
+// Frees all blocks.
+void arena_release(arena_t *a);
+
+// Buffer of size bytes from the pool of that size, NULL if out of memory.
+// Thread safe.
+void *mem_pool_get(size_t size);
+void mem_pool_put(void *buf, size_t size);
+
+#endif
@@ -17,6 +17,7 @@
 #include "file_io.h"
 #include "menu.h"
 #include "audio.h"
+#include "table_cache.h"
 
 static uint8_t vol_att = 0;
 static uint8_t corevol_att = 0;
@@ -26,93 +27,77 @@ static int has_filter = 0;
 static char filter_cfg_path[1024] = {};
 static char filter_cfg[1024] = {};
 
-static void setFilter()
+static void parse_filter(fileTextReader *reader, int, std::vector<uint16_t> &words)
 {
-	fileTYPE f = {};
+	const char *st;
+	int line = 0;
+	while (line < 9 && (st = FileReadLine(reader)))
+	{
+		if (line == 0)
+		{
+			printf("version: %s\n", st);
+			if (strncasecmp(st, "v1", 2)) break;
+			line++;
+		}
+		else if (line == 1 || line == 3 || line == 4 || line == 5)
+		{
+			int val = 0;
+			int n = sscanf(st, "%d", &val);
+			printf("got %d values: %d\n", n, val);
+			if (n == 1)
+			{
+				words.push_back((uint16_t)val);
+				if (line == 1) words.push_back((uint16_t)(val >> 16));
+				line++;
+			}
+		}
+		else if (line == 2)
+		{
+			double val = 0;
+			int n = sscanf(st, "%lg", &val);
+			printf("got %d values: %g\n", n, val);
+			if (n == 1)
+			{
+				int64_t coeff = 0x8000000000 * val;
+				printf("  -> converted to: %lld\n", coeff);
+				words.push_back((uint16_t)coeff);
+				words.push_back((uint16_t)(coeff >> 16));
+				words.push_back((uint16_t)(coeff >> 32));
+				line++;
+			}
+		}
+		else
+		{
+			double val = 0;
+			int n = sscanf(st, "%lg", &val);
+			printf("got %d values: %g\n", n, val);
+			if (n == 1)
+			{
+				int32_t coeff = 0x200000 * val;
+				printf("  -> converted to: %d\n", coeff);
+				words.push_back((uint16_t)coeff);
+				words.push_back((uint16_t)(coeff >> 16));
+				line++;
+			}
+		}
+	}
+}
 
+static void setFilter()
+{
 	has_filter = spi_uio_cmd(UIO_SET_AFILTER);
 	if (!has_filter) return;
 
 	snprintf(filter_cfg_path, sizeof(filter_cfg_path), AFILTER_DIR"/%s", filter_cfg + 1);
 	if(filter_cfg[0]) printf("\nLoading audio filter: %s\n", filter_cfg_path);
 
-	if (filter_cfg[0] && FileExists(filter_cfg_path) && FileOpen(&f, filter_cfg_path))
+	const std::vector<uint16_t> *flt = filter_cfg[0] ? table_get(filter_cfg_path, 0, parse_filter) : NULL;
+	if (flt)
 	{
-		char *buf = (char*)malloc(f.size + 1);
-		if (buf)
-		{
-			memset(buf, 0, f.size + 1);
-			int size;
-			if ((size = FileReadAdv(&f, buf, f.size)))
-			{
-				int line = 0;
-				spi_uio_cmd_cont(UIO_SET_AFILTER);
-				spi_w((uint8_t)get_core_volume());
-
-				char *end = buf + size;
-				char *pos = buf;
-				while (pos < end && line < 9)
-				{
-					char *st = pos;
-					while ((pos < end) && *pos && (*pos != 10)) pos++;
-					*pos = 0;
-					while (*st == ' ' || *st == '\t' || *st == 13) st++;
-					if (*st == '#' || *st == ';' || !*st) pos++;
-					else
-					{
-						if (line == 0)
-						{
-							printf("version: %s\n", st);
-							if (strncasecmp(st, "v1", 2)) break;
-							line++;
-						}
-						else if (line == 1 || line == 3 || line == 4 || line == 5)
-						{
-							int val = 0;
-							int n = sscanf(st, "%d", &val);
-							printf("got %d values: %d\n", n, val);
-							if (n == 1)
-							{
-								spi_w((uint16_t)val);
-								if (line == 1) spi_w((uint16_t)(val >> 16));
-								line++;
-							}
-						}
-						else if (line == 2)
-						{
-							double val = 0;
-							int n = sscanf(st, "%lg", &val);
-							printf("got %d values: %g\n", n, val);
-							if (n == 1)
-							{
-								int64_t coeff = 0x8000000000 * val;
-								printf("  -> converted to: %lld\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
-								spi_w((uint16_t)(coeff >> 32));
-								line++;
-							}
-						}
-						else
-						{
-							double val = 0;
-							int n = sscanf(st, "%lg", &val);
-							printf("got %d values: %g\n", n, val);
-							if (n == 1)
-							{
-								int32_t coeff = 0x200000 * val;
-								printf("  -> converted to: %d\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
-								line++;
-							}
-						}
-					}
-				}
-				DisableIO();
-			}
-			free(buf);
-		}
+		spi_uio_cmd_cont(UIO_SET_AFILTER);
+		spi_w((uint8_t)get_core_volume());
+		table_send(flt);
+		DisableIO();
 	}
 	else
 	{
@@ -64,7 +64,7 @@ int getBattery(int quick, struct battery_data_t *data)
 	// don't try to check if no battery device is present
 	if (i2c_handle == -2) return 0;
 
-	i2c_handle = i2c_open(0x0B, 1);
+	if (i2c_handle < 0) i2c_handle = i2c_open(0x0B, 1);
 	if (i2c_handle < 0)
 	{
 		printf("No battery found.\n");
@@ -9,6 +9,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "offload.h"
 
 
 extern int xml_load(const char *xml);
@@ -117,42 +126,143 @@ char* loadLastcore()
 
 }
 
-char *findCore(const char *name, char *coreName, int indent)
+// Index of the files in the _ folders (walked the same way as findCore()
+// did, first match wins), kept in the config folder. It's checked by the
+// mtimes of the folders it covers, so booting the last core only walks the
+// folders again after cores were added, removed or renamed.
+#define CORE_INDEX_NAME "cores.idx"
+
+struct core_index_t
 {
-	DIR *dir;
-	struct dirent *entry;
+	std::string root;
+	std::vector<std::pair<std::string, time_t>> dirs; // relative to root, "" for root itself
+	std::vector<std::string> files;                    // relative paths in walk order
+	std::unordered_map<std::string, uint32_t> names;   // file name -> first in files
+};
 
-	if (!(dir = opendir(name)))
+static void core_index_walk(core_index_t *idx, const std::string &rel)
+{
+	std::string full = rel.empty() ? idx->root : idx->root + "/" + rel;
+
+	struct stat st;
+	DIR *dir = opendir(full.c_str());
+	if (!dir || fstat(dirfd(dir), &st))
 	{
-		return NULL;
+		if (dir) closedir(dir);
+		return;
 	}
+	idx->dirs.push_back({ rel, st.st_mtime });
 
-
-	char *indir;
-	char* path = new char[256];
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_type == DT_DIR) {
-			if (entry->d_name[0] != '_')
-				continue;
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			indir = findCore(path, coreName, indent + 2);
-			if (indir != NULL)
-			{
-				closedir(dir);
-				delete[] path;
-				return indir;
-			}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		std::string path = rel.empty() ? entry->d_name : rel + "/" + entry->d_name;
+		if (entry->d_type == DT_DIR)
+		{
+			if (entry->d_name[0] == '_') core_index_walk(idx, path);
 		}
-		else if (!strcmp(entry->d_name, coreName))
+		else
 		{
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			closedir(dir);
-			return path;
+			idx->names.emplace(entry->d_name, idx->files.size());
+			idx->files.push_back(path);
 		}
 	}
 	closedir(dir);
-	delete[] path;
-	return NULL;
+}
+
+static std::string core_index_path(const char *root)
+{
+	return std::string(root) + "/" CONFIG_DIR "/" CORE_INDEX_NAME;
+}
+
+// Lines: "R\t<root>", then "D\t<mtime>\t<dir>" and "F\t<file>" in walk order
+static bool core_index_load(core_index_t *idx, const char *root)
+{
+	FILE *fd = fopen(core_index_path(root).c_str(), "r");
+	if (!fd) return false;
+
+	bool ok = true;
+	char line[1024];
+	while (ok && fgets(line, sizeof(line), fd))
+	{
+		int len = strlen(line);
+		if (len && line[len - 1] == '\n') line[--len] = 0;
+		if (len < 2 || line[1] != '\t') continue;
+
+		if (line[0] == 'R') ok = !strcmp(line + 2, root);
+		else if (line[0] == 'F')
+		{
+			const char *name = strrchr(line + 2, '/');
+			idx->names.emplace(name ? name + 1 : line + 2, idx->files.size());
+			idx->files.push_back(line + 2);
+		}
+		else if (line[0] == 'D')
+		{
+			char *end;
+			time_t mtime = strtoll(line + 2, &end, 10);
+			if (*end == '\t') idx->dirs.push_back({ end + 1, mtime });
+		}
+	}
+	fclose(fd);
+	if (!ok || idx->dirs.empty()) return false;
+
+	// any change in the covered folders, including new _ folders, changes one of these
+	for (auto &d : idx->dirs)
+	{
+		struct stat st;
+		std::string full = d.first.empty() ? std::string(root) : std::string(root) + "/" + d.first;
+		if (stat(full.c_str(), &st) || st.st_mtime != d.second) return false;
+	}
+
+	idx->root = root;
+	return true;
+}
+
+static void core_index_save(const core_index_t *idx)
+{
+	std::string data = "R\t" + idx->root + "\n";
+	for (auto &d : idx->dirs) data += "D\t" + std::to_string((long long)d.second) + "\t" + d.first + "\n";
+	for (auto &f : idx->files) data += "F\t" + f + "\n";
+
+	std::string path = core_index_path(idx->root.c_str());
+	offload_add_work([path, data]
+	{
+		std::string tmp = path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) return;
+		bool ok = write(fd, data.c_str(), data.length()) == (ssize_t)data.length();
+		close(fd);
+		if (ok) rename(tmp.c_str(), path.c_str());
+		else unlink(tmp.c_str());
+	});
+}
+
+static const core_index_t *core_index_get(const char *root)
+{
+	static core_index_t idx;
+	if (!idx.root.empty() && idx.root == root) return &idx;
+
+	idx = core_index_t();
+	if (core_index_load(&idx, root)) return &idx;
+
+	printf("bootcore: indexing cores in %s\n", root);
+	idx = core_index_t();
+	idx.root = root;
+	core_index_walk(&idx, "");
+	core_index_save(&idx);
+	return &idx;
+}
+
+char *findCore(const char *name, char *coreName, int /*indent*/)
+{
+	const core_index_t *idx = core_index_get(name);
+
+	auto it = idx->names.find(coreName);
+	if (it == idx->names.end()) return NULL;
+
+	char* path = new char[256];
+	snprintf(path, 256, "%s/%s", name, idx->files[it->second].c_str());
+	return path;
 }
 
 void bootcore_init(const char *path)
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <atomic>
+
+#include "capture.h"
+#include "scaler.h"
+#include "file_io.h"
+#include "user_io.h"
+#include "profiling.h"
+
+#define CAPTURE_QUEUE 6
+
+struct capture_frame_t
+{
+	uint8_t *data;
+	int size;
+	int width, height;
+};
+
+enum
+{
+	CAP_IDLE = 0,
+	CAP_RUNNING,
+	CAP_STOPPING
+};
+
+static capture_frame_t cap_queue[CAPTURE_QUEUE];
+static uint32_t cap_head, cap_tail;
+static int cap_grab_done;
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cap_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cap_grab_thread;
+static std::atomic<int> cap_state(CAP_IDLE);
+
+static int cap_fps;
+static char cap_base[1024];
+static uint32_t cap_written, cap_dropped;
+
+static void *capture_grab(void *)
+{
+	trace_thread_name("capture");
+
+	mister_scaler *ms = mister_scaler_init();
+	if (!ms)
+	{
+		printf("capture: scaler not compatible\n");
+		cap_state = CAP_STOPPING;
+	}
+
+	const long period = 1000000000L / cap_fps;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (cap_state == CAP_RUNNING)
+	{
+		next.tv_nsec += period;
+		if (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// Don't try to catch up after a stall, just continue from now
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec + 1) next = now;
+
+		if (mister_scaler_update(ms) || ms->width < 2 || ms->height < 2) continue;
+
+		pthread_mutex_lock(&cap_lock);
+		int full = (cap_head - cap_tail) == CAPTURE_QUEUE;
+		pthread_mutex_unlock(&cap_lock);
+
+		if (full)
+		{
+			cap_dropped++;
+			continue;
+		}
+
+		// The head slot belongs to this thread until cap_head moves
+		capture_frame_t *f = &cap_queue[cap_head % CAPTURE_QUEUE];
+		int w = ms->width & ~1;
+		int h = ms->height & ~1;
+		int size = w * h * 3 / 2;
+		if (f->size < size)
+		{
+			free(f->data);
+			f->data = (uint8_t*)malloc(size);
+			f->size = f->data ? size : 0;
+		}
+
+		{
+			TRACE_SCOPE("capture_grab");
+			if (!f->data || mister_scaler_read_yuv420(ms, f->data, f->data + w * h, f->data + w * h + w * h / 4))
+			{
+				cap_dropped++;
+				continue;
+			}
+		}
+
+		f->width = w;
+		f->height = h;
+
+		pthread_mutex_lock(&cap_lock);
+		cap_head++;
+		pthread_cond_signal(&cap_cond);
+		pthread_mutex_unlock(&cap_lock);
+	}
+
+	if (ms) mister_scaler_free(ms);
+
+	pthread_mutex_lock(&cap_lock);
+	cap_grab_done = 1;
+	pthread_cond_signal(&cap_cond);
+	pthread_mutex_unlock(&cap_lock);
+	return NULL;
+}
+
+static FILE *capture_open(int segment, int width, int height)
+{
+	char path[1100];
+	if (segment) snprintf(path, sizeof(path), "%s_%d.y4m", cap_base, segment + 1);
+	else snprintf(path, sizeof(path), "%s.y4m", cap_base);
+
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+	{
+		printf("capture: cannot create %s\n", path);
+		return NULL;
+	}
+
+	fprintf(fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A0:0 C420jpeg XCOLORRANGE=LIMITED\n", width, height, cap_fps);
+	printf("capture: %dx%d to %s\n", width, height, path);
+	return fp;
+}
+
+static void *capture_write(void *)
+{
+	FILE *fp = NULL;
+	int fw = 0, fh = 0, segment = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&cap_lock);
+		while (cap_head == cap_tail && !cap_grab_done) pthread_cond_wait(&cap_cond, &cap_lock);
+		int empty = (cap_head == cap_tail);
+		pthread_mutex_unlock(&cap_lock);
+		if (empty) break;
+
+		capture_frame_t *f = &cap_queue[cap_tail % CAPTURE_QUEUE];
+		if (cap_state == CAP_RUNNING && (!fp || f->width != fw || f->height != fh))
+		{
+			if (fp) fclose(fp);
+			fp = capture_open(segment++, f->width, f->height);
+			fw = f->width;
+			fh = f->height;
+			if (!fp) cap_state = CAP_STOPPING;
+		}
+
+		if (fp)
+		{
+			TRACE_SCOPE("capture_write");
+			int size = f->width * f->height * 3 / 2;
+			if (fputs("FRAME\n", fp) < 0 || (int)fwrite(f->data, 1, size, fp) != size)
+			{
+				printf("capture: write error\n");
+				fclose(fp);
+				fp = NULL;
+				cap_state = CAP_STOPPING;
+			}
+			else cap_written++;
+		}
+
+		pthread_mutex_lock(&cap_lock);
+		cap_tail++;
+		pthread_mutex_unlock(&cap_lock);
+	}
+
+	if (fp) fclose(fp);
+	pthread_join(cap_grab_thread, NULL);
+
+	for (int i = 0; i < CAPTURE_QUEUE; i++)
+	{
+		free(cap_queue[i].data);
+		cap_queue[i].data = NULL;
+		cap_queue[i].size = 0;
+	}
+
+	printf("capture: stopped, %u frames written, %u dropped\n", cap_written, cap_dropped);
+	cap_state = CAP_IDLE;
+	return NULL;
+}
+
+int capture_start(int fps, const char *dir)
+{
+	if (cap_state != CAP_IDLE)
+	{
+		printf("capture: already running\n");
+		return 0;
+	}
+
+	if (fps < 1) fps = 1;
+	if (fps > 60) fps = 60;
+
+	char path[1024];
+	if (dir && *dir) snprintf(path, sizeof(path), "%s", dir);
+	else snprintf(path, sizeof(path), "%s/video", isUSBMounted() ? getStorageDir(1) : getRootDir());
+
+	if (mkdir(path, 0777) && errno != EEXIST)
+	{
+		printf("capture: cannot create %s\n", path);
+		return 0;
+	}
+
+	char stamp[32];
+	time_t t = time(NULL);
+	struct tm tm;
+	strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime_r(&t, &tm));
+	snprintf(cap_base, sizeof(cap_base), "%s/%s_%s", path, user_io_get_core_name(), stamp);
+
+	cap_fps = fps;
+	cap_head = cap_tail = 0;
+	cap_grab_done = 0;
+	cap_written = cap_dropped = 0;
+	cap_state = CAP_RUNNING;
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	int ok = 0;
+	if (!pthread_create(&cap_grab_thread, &attr, capture_grab, NULL))
+	{
+		pthread_t writer;
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (!pthread_create(&writer, &attr, capture_write, NULL)) ok = 1;
+		else
+		{
+			cap_state = CAP_STOPPING;
+			pthread_join(cap_grab_thread, NULL);
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	if (!ok)
+	{
+		cap_state = CAP_IDLE;
+		return 0;
+	}
+
+	printf("capture: recording at %d fps\n", fps);
+	return 1;
+}
+
+void capture_stop(int wait)
+{
+	int running = CAP_RUNNING;
+	cap_state.compare_exchange_strong(running, CAP_STOPPING);
+
+	if (wait)
+	{
+		while (cap_state != CAP_IDLE) usleep(1000);
+	}
+}
+
+int capture_active()
+{
+	return cap_state == CAP_RUNNING;
+}
@@ -0,0 +1,18 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Video recording from the scaler buffer.
+// Frames are grabbed and converted to YUV 4:2:0 by a capture thread and written
+// as raw YUV4MPEG2 by a writer thread, with a small bounded queue in between.
+// Frames are dropped when the storage can't keep up, the main loop never waits.
+// A new file is started when the resolution changes.
+
+// fps 1..60, dir NULL for <USB storage or root>/video. Returns 0 on error.
+int capture_start(int fps, const char *dir);
+
+// Stops the recording, wait to block until the last frame is written.
+void capture_stop(int wait = 0);
+
+int capture_active();
+
+#endif
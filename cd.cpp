@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+#include "cd.h"
+#include "file_io.h"
+#include "crc.h"
+#include "cd_ram.h"
+#include "support/chd/mister_chd.h"
+
+// Byte window of a format inside a stored sector
+static int cd_format_window(const cd_source_t *src, cd_read_format_t format, int *offset)
+{
+	bool cooked = (src->sector_size == 2048);
+
+	*offset = 0;
+	switch (format)
+	{
+	case CD_READ_AUDIO:
+		return 2352;
+
+	case CD_READ_MODE1:
+		if (!cooked) *offset = 16;
+		return 2048;
+
+	case CD_READ_MODE2:
+		if (!cooked) *offset = 24;
+		return 2048;
+
+	case CD_READ_SUBCODE:
+		if (!src->chd_f) return 0;
+		*offset = CD_MAX_SECTOR_DATA;
+		return 96;
+
+	case CD_READ_RAW:
+	default:
+		return src->chd_f ? (cooked ? 2048 : 2352) : src->sector_size;
+	}
+}
+
+int cd_format_size(const cd_source_t *src, cd_read_format_t format)
+{
+	int offset;
+	return cd_format_window(src, format, &offset);
+}
+
+void cd_swap16(void *buf, int len)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+#ifdef __ARM_NEON
+	for (; len >= 16; len -= 16, p += 16) vst1q_u8(p, vrev16q_u8(vld1q_u8(p)));
+#endif
+
+	for (; len >= 2; len -= 2, p += 2)
+	{
+		uint8_t t = p[0];
+		p[0] = p[1];
+		p[1] = t;
+	}
+}
+
+void cd_xor(uint8_t *buf, const uint8_t *pattern, int len)
+{
+#ifdef __ARM_NEON
+	for (; len >= 16; len -= 16, buf += 16, pattern += 16) vst1q_u8(buf, veorq_u8(vld1q_u8(buf), vld1q_u8(pattern)));
+#endif
+
+	for (; len > 0; len--) *buf++ ^= *pattern++;
+}
+
+void cd_subcode_symbols(const uint8_t *subc, uint8_t *out)
+{
+	// Transpose 8x8 bit blocks: channel j of byte k becomes bit 7-j of 8 symbols
+	for (int k = 0; k < 12; k++, out += 8)
+	{
+		uint64_t x = 0;
+		for (int j = 0; j < 8; j++) x |= (uint64_t)subc[j * 12 + k] << (56 - j * 8);
+
+		uint64_t t;
+		t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL; x ^= t ^ (t << 7);
+		t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x ^= t ^ (t << 14);
+		t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x ^= t ^ (t << 28);
+
+		for (int b = 0; b < 8; b++) out[b] = x >> (56 - b * 8);
+	}
+}
+
+void cd_subcode_interleave(const uint8_t *subc, uint16_t *out)
+{
+	uint8_t sym[96];
+	cd_subcode_symbols(subc, sym);
+	for (int i = 0; i < 48; i++) out[i] = sym[i * 2] | (sym[i * 2 + 1] << 8);
+}
+
+int cd_read_sectors(const cd_source_t *src, int lba, int count, cd_read_format_t format, uint8_t *dst, int stride)
+{
+	int offset;
+	int len = cd_format_window(src, format, &offset);
+	if (!len || count <= 0) return 0;
+	if (!stride) stride = len;
+
+	if (src->chd_f)
+	{
+		if (!cd_ram_read(src, lba, count, offset, len, dst, stride) &&
+			mister_chd_read_sectors(src->chd_f, lba, count, offset, len, dst, stride) != CHDERR_NONE) return 0;
+
+		// CHD keeps audio big endian
+		if (format == CD_READ_AUDIO)
+		{
+			if (stride == len) cd_swap16(dst, len * count);
+			else for (int i = 0; i < count; i++) cd_swap16(dst + i * stride, len);
+		}
+		return count;
+	}
+
+	if (cd_ram_read(src, lba, count, offset, len, dst, stride)) return count;
+	if (!src->f || !src->f->opened()) return 0;
+
+	__off64_t pos = src->offset + (__off64_t)lba * src->sector_size + offset;
+
+	// Whole sectors packed: one read for the run
+	if (len == src->sector_size && stride == len)
+	{
+		if (!FileSeek(src->f, pos, SEEK_SET)) return 0;
+		return FileReadAdv(src->f, dst, len * count) / len;
+	}
+
+	for (int i = 0; i < count; i++, pos += src->sector_size, dst += stride)
+	{
+		if (!FileSeek(src->f, pos, SEEK_SET) || FileReadAdv(src->f, dst, len) != len) return i;
+	}
+	return count;
+}
+
+int cd_use_sector(const cd_source_t *src, int lba, cd_read_format_t format, uint8_t *buf, cd_use_func use, void *ctx)
+{
+	int offset;
+	int len = cd_format_window(src, format, &offset);
+	if (!len) return 0;
+
+	if (!src->chd_f || format != CD_READ_AUDIO)
+	{
+		const uint8_t *data = cd_ram_peek(src, lba, offset, len);
+		if (data)
+		{
+			use(data, len, ctx);
+			return 1;
+		}
+
+		if (src->chd_f) return mister_chd_use_sector(src->chd_f, lba, offset, len, use, ctx) == CHDERR_NONE;
+	}
+
+	if (cd_read_sectors(src, lba, 1, format, buf) != 1) return 0;
+	use(buf, len, ctx);
+	return 1;
+}
+
+struct cd_send_t
+{
+	SendDataVFunc send;
+	const uint8_t *head;
+	int head_len;
+	int total;
+	uint8_t index;
+};
+
+static void cd_send_use(const uint8_t *data, int len, void *ctx)
+{
+	static const uint8_t zero[2352] = {};
+	cd_send_t *s = (cd_send_t *)ctx;
+
+	int pad = s->total - s->head_len - len;
+	if (pad > (int)sizeof(zero)) pad = sizeof(zero);
+
+	struct iovec iov[3] = {
+		{ (void *)s->head, (size_t)s->head_len },
+		{ (void *)data, (size_t)len },
+		{ (void *)zero, (size_t)(pad > 0 ? pad : 0) }
+	};
+	s->send(iov, (pad > 0) ? 3 : 2, s->index);
+}
+
+int cd_send_sector(const cd_source_t *src, int lba, cd_read_format_t format, const uint8_t *head, int head_len, int total, uint8_t *buf, SendDataVFunc send, uint8_t index)
+{
+	cd_send_t s = { send, head, head_len, total, index };
+	return cd_use_sector(src, lba, format, buf, cd_send_use, &s);
+}
+
+void cd_prefetch(const cd_source_t *src, int lba, int count)
+{
+	if (count <= 0) return;
+	if (lba < 0) lba = 0;
+
+	// Already in memory, otherwise the RAM copy goes there first
+	if (cd_ram_want(src, lba)) return;
+
+	if (src->chd_f)
+	{
+		mister_chd_prefetch(src->chd_f, lba, count);
+		return;
+	}
+
+	// The kernel reads it in while the seek time passes
+	if (src->f && src->f->filp)
+	{
+		posix_fadvise(fileno(src->f->filp), src->offset + (__off64_t)lba * src->sector_size, (__off64_t)count * src->sector_size, POSIX_FADV_WILLNEED);
+	}
+}
+
+#define CUE_CACHE_DIR     "/tmp/cue_cache"
+#define CUE_CACHE_VERSION 1
+#define CUE_CACHE_FILES   32
+
+static int cue_cache_key(const char *cue, const char *tag, char *path, char *key, int keylen)
+{
+	const char *full = getFullPath(cue);
+	struct stat64 st;
+	if (stat64(full, &st)) return 0;
+
+	snprintf(key, keylen, "%s:%d\n%s\n%llu\n%llu\n", tag, CUE_CACHE_VERSION, full,
+		(unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	sprintf(path, CUE_CACHE_DIR "/%08x", crc32_update(0, key, strlen(key)));
+	return 1;
+}
+
+int cd_cue_cache_get(const char *cue, const char *tag, void *data, int size)
+{
+	char path[64], key[1200], kbuf[1200];
+	if (!cue_cache_key(cue, tag, path, key, sizeof(key))) return 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	uint32_t klen = 0, dlen = 0;
+	int ok = read(fd, &klen, sizeof(klen)) == sizeof(klen) && klen == strlen(key) &&
+		read(fd, kbuf, klen) == (ssize_t)klen && !memcmp(kbuf, key, klen) &&
+		read(fd, &dlen, sizeof(dlen)) == sizeof(dlen) && dlen <= (uint32_t)size &&
+		read(fd, data, dlen) == (ssize_t)dlen;
+	close(fd);
+
+	return ok ? dlen : 0;
+}
+
+static void cue_cache_evict()
+{
+	DIR *d = opendir(CUE_CACHE_DIR);
+	if (!d) return;
+
+	char oldest[300] = {};
+	time_t oldest_time = 0;
+	int cnt = 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		char fpath[300];
+		snprintf(fpath, sizeof(fpath), CUE_CACHE_DIR "/%s", de->d_name);
+
+		struct stat st;
+		if (stat(fpath, &st)) continue;
+		if (!cnt++ || st.st_mtime < oldest_time)
+		{
+			oldest_time = st.st_mtime;
+			strcpy(oldest, fpath);
+		}
+	}
+	closedir(d);
+
+	if (cnt >= CUE_CACHE_FILES) unlink(oldest);
+}
+
+void cd_cue_cache_put(const char *cue, const char *tag, const void *data, int size)
+{
+	char path[64], tmp[80], key[1200];
+	if (!cue_cache_key(cue, tag, path, key, sizeof(key))) return;
+
+	mkdir(CUE_CACHE_DIR, 0777);
+	cue_cache_evict();
+
+	sprintf(tmp, "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return;
+
+	uint32_t klen = strlen(key), dlen = size;
+	int ok = write(fd, &klen, sizeof(klen)) == sizeof(klen) && write(fd, key, klen) == (ssize_t)klen &&
+		write(fd, &dlen, sizeof(dlen)) == sizeof(dlen) && write(fd, data, dlen) == (ssize_t)dlen;
+	close(fd);
+
+	if (!ok || rename(tmp, path)) unlink(tmp);
+}
+
+struct cue_track_rec_t
+{
+	int offset;
+	int pregap;
+	int start;
+	int end;
+	int type;
+	int sector_size;
+	int indexes[100];
+	int index_num;
+	int sbc_type;
+	int64_t size;
+	char path[1024];   // empty if the track has no file of its own
+};
+
+struct cue_toc_rec_t
+{
+	int end;
+	int last;
+	int sectorSize;
+	int extra;
+	int count;
+	int64_t sub_size;
+	char sub[1024];
+	cue_track_rec_t tracks[100];
+};
+
+static cue_toc_rec_t cue_rec;
+
+// Full path of an opened file, the parsers don't keep the names
+static int cue_file_rec(fileTYPE *f, char *path, int64_t *size)
+{
+	*path = 0;
+	*size = 0;
+	if (!f->opened()) return 1;
+	if (!f->filp) return 0; // zipped
+
+	char link[64];
+	sprintf(link, "/proc/self/fd/%d", fileno(f->filp));
+	int len = readlink(link, path, 1023);
+	if (len <= 0) return 0;
+
+	path[len] = 0;
+	*size = f->size;
+	return 1;
+}
+
+static int cue_file_open(fileTYPE *f, const char *path, int64_t size)
+{
+	if (!*path) return 1;
+	return FileOpen(f, path) && f->size == size;
+}
+
+int cd_cue_cache_load(const char *cue, const char *tag, toc_t *toc, int *extra)
+{
+	int len = cd_cue_cache_get(cue, tag, &cue_rec, sizeof(cue_rec));
+	if (len < (int)offsetof(cue_toc_rec_t, tracks) || cue_rec.count < 0 || cue_rec.count > 100 ||
+		len != (int)(offsetof(cue_toc_rec_t, tracks) + cue_rec.count * sizeof(cue_track_rec_t))) return 0;
+
+	int ok = cue_file_open(&toc->sub, cue_rec.sub, cue_rec.sub_size);
+	for (int i = 0; ok && i < cue_rec.count; i++)
+	{
+		cue_track_rec_t *rec = &cue_rec.tracks[i];
+		cd_track_t *trk = &toc->tracks[i];
+
+		trk->offset = rec->offset;
+		trk->pregap = rec->pregap;
+		trk->start = rec->start;
+		trk->end = rec->end;
+		trk->type = rec->type;
+		trk->sector_size = rec->sector_size;
+		memcpy(trk->indexes, rec->indexes, sizeof(trk->indexes));
+		trk->index_num = rec->index_num;
+		trk->sbc_type = (cd_subcode_types_t)rec->sbc_type;
+		ok = cue_file_open(&trk->f, rec->path, rec->size);
+	}
+
+	if (!ok)
+	{
+		// Something changed behind the sheet, parse it again
+		FileClose(&toc->sub);
+		for (int i = 0; i < cue_rec.count; i++)
+		{
+			cd_track_t *trk = &toc->tracks[i];
+			FileClose(&trk->f);
+			trk->offset = trk->pregap = trk->start = trk->end = trk->type = trk->sector_size = trk->index_num = 0;
+			memset(trk->indexes, 0, sizeof(trk->indexes));
+			trk->sbc_type = SUBCODE_NONE;
+		}
+		return 0;
+	}
+
+	toc->end = cue_rec.end;
+	toc->last = cue_rec.last;
+	toc->sectorSize = cue_rec.sectorSize;
+	if (extra) *extra = cue_rec.extra;
+
+	printf("CD: %s TOC of %s from the cache, %d tracks.\n", tag, cue, toc->last);
+	return 1;
+}
+
+void cd_cue_cache_save(const char *cue, const char *tag, toc_t *toc, int extra)
+{
+	if (toc->chd_f) return;
+
+	memset(&cue_rec, 0, sizeof(cue_rec));
+	cue_rec.end = toc->end;
+	cue_rec.last = toc->last;
+	cue_rec.sectorSize = toc->sectorSize;
+	cue_rec.extra = extra;
+	cue_rec.count = (toc->last < 99) ? toc->last + 1 : 100;
+	if (!cue_file_rec(&toc->sub, cue_rec.sub, &cue_rec.sub_size)) return;
+
+	for (int i = 0; i < cue_rec.count; i++)
+	{
+		cue_track_rec_t *rec = &cue_rec.tracks[i];
+		cd_track_t *trk = &toc->tracks[i];
+
+		rec->offset = trk->offset;
+		rec->pregap = trk->pregap;
+		rec->start = trk->start;
+		rec->end = trk->end;
+		rec->type = trk->type;
+		rec->sector_size = trk->sector_size;
+		memcpy(rec->indexes, trk->indexes, sizeof(rec->indexes));
+		rec->index_num = trk->index_num;
+		rec->sbc_type = trk->sbc_type;
+		if (!cue_file_rec(&trk->f, rec->path, &rec->size)) return;
+	}
+
+	cd_cue_cache_put(cue, tag, &cue_rec, offsetof(cue_toc_rec_t, tracks) + cue_rec.count * sizeof(cue_track_rec_t));
+}
+
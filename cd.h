@@ -1,6 +1,7 @@
 #ifndef CD_H
 #define CD_H
 
+#include <sys/uio.h>
 #include <libchdr/chd.h>
 #include "file_io.h"
 
@@ -63,5 +64,71 @@ typedef struct
 #define BCD(v)				 ((uint8_t)((((v)/10) << 4) | ((v)%10)))
 
 typedef int (*SendDataFunc) (uint8_t* buf, int len, uint8_t index);
+// Same as one transfer gathered from several pieces
+typedef int (*SendDataVFunc) (const struct iovec *iov, int cnt, uint8_t index);
+
+// Shared sector reader for CHD and BIN/CUE images.
+// The cores keep their own TOC layout and only describe where a run of
+// sectors is stored, reads go straight into the caller's buffer.
+
+typedef enum
+{
+	CD_READ_RAW = 0,   // sector as stored (sector_size bytes, 2352 for CHD)
+	CD_READ_AUDIO,     // 2352 bytes of little endian samples (CHD audio is swapped)
+	CD_READ_MODE1,     // 2048 bytes of user data, mode 1
+	CD_READ_MODE2,     // 2048 bytes of user data, mode 2 form 1
+	CD_READ_SUBCODE    // 96 bytes of subcode, CHD only
+} cd_read_format_t;
+
+typedef struct
+{
+	chd_file *chd_f;   // CHD image, lba is the frame number in the CHD
+	fileTYPE *f;       // otherwise sector lba is at offset + lba * sector_size in f
+	int64_t offset;
+	int sector_size;   // 2048 for cooked data tracks, 2352 for raw ones
+} cd_source_t;
+
+// Size in bytes of one sector of the given format
+int cd_format_size(const cd_source_t *src, cd_read_format_t format);
+
+// Read count sectors starting at lba. Sectors are stride bytes apart in
+// dst, 0 packs them. Returns number of sectors read.
+int cd_read_sectors(const cd_source_t *src, int lba, int count, cd_read_format_t format, uint8_t *dst, int stride = 0);
+
+// Calls use with sector lba in the given format without copying it when it's
+// in memory already (CD RAM copy, CHD hunk cache, which stays locked meanwhile:
+// use must be quick and must not read the image). Otherwise it's read into buf
+// (cd_format_size bytes) first. CHD audio is always read, it needs swapping.
+// Returns 0 if the sector can't be read, use isn't called then.
+typedef void (*cd_use_func)(const uint8_t *data, int len, void *ctx);
+int cd_use_sector(const cd_source_t *src, int lba, cd_read_format_t format, uint8_t *buf, cd_use_func use, void *ctx);
+
+// Sends head, sector lba and zeros up to total bytes as one transfer through
+// send, the sector straight from memory as cd_use_sector does (buf for a read).
+// Returns 0 if the sector can't be read, nothing is sent then.
+int cd_send_sector(const cd_source_t *src, int lba, cd_read_format_t format, const uint8_t *head, int head_len, int total, uint8_t *buf, SendDataVFunc send, uint8_t index);
+
+// Starts reading count sectors from lba in the background (CHD hunks are
+// decoded, BIN ranges brought into the page cache), for the time a core
+// emulates the seek there. Doesn't wait and doesn't read anything itself.
+void cd_prefetch(const cd_source_t *src, int lba, int count);
+
+// Parsed CUE sheets, cached in /tmp per parser (tag) and keyed by path, size
+// and mtime of the sheet, so a remount doesn't parse it and size every track
+// file again. The track files are still opened, each track needs its handle,
+// a track file with another size than cached makes the load fail.
+// extra: a core specific value stored along (e.g. a sector size it found).
+int cd_cue_cache_load(const char *cue, const char *tag, toc_t *toc, int *extra = NULL);
+void cd_cue_cache_save(const char *cue, const char *tag, toc_t *toc, int extra = 0);
+
+// Same for TOC layouts other than toc_t, data is stored as is. Returns the size read.
+int cd_cue_cache_get(const char *cue, const char *tag, void *data, int size);
+void cd_cue_cache_put(const char *cue, const char *tag, const void *data, int size);
+
+// Sector data helpers (NEON when available)
+void cd_swap16(void *buf, int len);                                  // swap bytes of 16 bit samples, len in bytes
+void cd_xor(uint8_t *buf, const uint8_t *pattern, int len);          // buf ^= pattern, e.g. (de)scrambling
+void cd_subcode_symbols(const uint8_t *subc, uint8_t *out);          // 96 byte P-W subcode to 96 symbols, P in bit 7
+void cd_subcode_interleave(const uint8_t *subc, uint16_t *out);      // same, two symbols per word (first in the low byte)
 
 #endif
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "cd_ram.h"
+#include "cfg.h"
+#include "profiling.h"
+#include "memtrack.h"
+#include "support/chd/mister_chd.h"
+
+#define CD_RAM_CHUNK     (1024 * 1024) // BIN bytes copied at a time
+#define CD_RAM_CHD_HUNKS 64            // CHD hunks decoded at a time
+#define CD_RAM_RESERVE   (64 * 1024)   // KB of memory left to everything else
+
+// One per image file: the CHD, or each distinct BIN file of the tracks
+struct cd_ram_region_t
+{
+	chd_file *chd_f;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	uint64_t size;
+	uint32_t chunk;            // bytes
+	uint32_t chunks;
+	uint32_t hunkbytes;
+	uint32_t hunks;
+	uint32_t frames_per_hunk;
+	uint8_t *data;
+	uint8_t *ready;            // per chunk, set by the worker once copied
+};
+
+// Set up by main while the worker doesn't run, read only until cd_ram_release()
+static cd_ram_region_t regions[100];
+static int region_cnt = 0;
+static const fileTYPE *track_file[100];
+static int track_region[100];
+static int track_cnt = 0;
+
+static pthread_t worker;
+static int running = 0;
+static int stop = 0;
+static int64_t want = -1;     // region << 32 | chunk the worker continues from
+
+static uint64_t mem_available()
+{
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (!f) return 0;
+
+	char line[128];
+	unsigned long long kb = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb;
+}
+
+static int cd_ram_load(cd_ram_region_t *r, uint32_t c)
+{
+	if (r->chd_f)
+	{
+		uint32_t first = c * CD_RAM_CHD_HUNKS;
+		uint32_t n = r->hunks - first;
+		if (n > CD_RAM_CHD_HUNKS) n = CD_RAM_CHD_HUNKS;
+		return mister_chd_read_hunks(r->chd_f, first, n, r->data + (uint64_t)first * r->hunkbytes) == CHDERR_NONE;
+	}
+
+	uint64_t pos = (uint64_t)c * r->chunk;
+	uint64_t len = r->size - pos;
+	if (len > r->chunk) len = r->chunk;
+
+	// pread leaves the FILE position main uses alone
+	while (len)
+	{
+		ssize_t ret = pread(r->fd, r->data + pos, len, pos);
+		if (ret <= 0) return 0;
+		pos += ret;
+		len -= ret;
+	}
+	return 1;
+}
+
+// First chunk not resident yet, from r/c on and wrapping around.
+static int cd_ram_next(int *r, uint32_t *c)
+{
+	for (int n = 0; n <= region_cnt; n++)
+	{
+		cd_ram_region_t *rg = &regions[*r];
+		for (; *c < rg->chunks; (*c)++)
+		{
+			if (!__atomic_load_n(&rg->ready[*c], __ATOMIC_RELAXED)) return 1;
+		}
+
+		*r = (*r + 1) % region_cnt;
+		*c = 0;
+	}
+	return 0;
+}
+
+static void *cd_ram_worker(void *)
+{
+	trace_thread_name("cd_ram");
+
+	uint64_t start = trace_now_us();
+	uint64_t bytes = 0;
+	int r = 0;
+	uint32_t c = 0;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+	{
+		int64_t w = __atomic_exchange_n(&want, -1, __ATOMIC_RELAXED);
+		if (w >= 0)
+		{
+			r = w >> 32;
+			c = (uint32_t)w;
+		}
+
+		if (!cd_ram_next(&r, &c))
+		{
+			uint64_t us = trace_now_us() - start;
+			printf("cd_ram: %llu MB resident after %llu ms\n", (unsigned long long)(bytes >> 20), (unsigned long long)(us / 1000));
+			break;
+		}
+
+		{
+			TRACE_SCOPE("cd_ram_load");
+			if (!cd_ram_load(&regions[r], c))
+			{
+				printf("cd_ram: read error, the rest stays on storage.\n");
+				break;
+			}
+		}
+
+		__atomic_store_n(&regions[r].ready[c], 1, __ATOMIC_RELEASE);
+		bytes += std::min<uint64_t>(regions[r].chunk, regions[r].size - (uint64_t)c * regions[r].chunk);
+		c++;
+	}
+
+	return NULL;
+}
+
+static int cd_ram_add_chd(chd_file *chd_f)
+{
+	const chd_header *hdr = chd_get_header(chd_f);
+	if (!hdr) return 0;
+
+	cd_ram_region_t *r = &regions[region_cnt++];
+	r->chd_f = chd_f;
+	r->fd = -1;
+	r->hunkbytes = hdr->hunkbytes;
+	r->hunks = hdr->totalhunks;
+	r->frames_per_hunk = hdr->hunkbytes / hdr->unitbytes;
+	r->size = (uint64_t)r->hunks * r->hunkbytes;
+	r->chunk = CD_RAM_CHD_HUNKS * r->hunkbytes;
+	return 1;
+}
+
+// Tracks in one BIN file share its region
+static int cd_ram_add_file(const fileTYPE *f)
+{
+	if (!f->filp) return 0;
+
+	struct stat64 st;
+	int fd = fileno(f->filp);
+	if (fstat64(fd, &st)) return 0;
+
+	int i = 0;
+	while (i < region_cnt && (regions[i].dev != st.st_dev || regions[i].ino != st.st_ino)) i++;
+	if (i == region_cnt)
+	{
+		cd_ram_region_t *r = &regions[region_cnt++];
+		r->fd = fd;
+		r->dev = st.st_dev;
+		r->ino = st.st_ino;
+		r->size = st.st_size;
+		r->chunk = CD_RAM_CHUNK;
+	}
+
+	track_file[track_cnt] = f;
+	track_region[track_cnt++] = i;
+	return 1;
+}
+
+void cd_ram_install(const toc_t *toc)
+{
+	cd_ram_release();
+	if (!cfg.cd_ram) return;
+
+	int ok = 1;
+	if (toc->chd_f) ok = cd_ram_add_chd(toc->chd_f);
+	else
+	{
+		for (int i = 0; ok && i < toc->last && i < 100; i++) ok = cd_ram_add_file(&toc->tracks[i].f);
+	}
+
+	uint64_t size = 0;
+	for (int i = 0; i < region_cnt; i++) size += regions[i].size;
+
+	uint64_t avail = mem_available();
+	if (!ok || !region_cnt || !size)
+	{
+		printf("cd_ram: image can't be installed (zipped track?).\n");
+	}
+	else if ((size >> 20) > cfg.cd_ram || (size >> 10) + CD_RAM_RESERVE > avail)
+	{
+		printf("cd_ram: %llu MB image doesn't fit (cd_ram=%u, %llu MB available).\n",
+			(unsigned long long)(size >> 20), cfg.cd_ram, (unsigned long long)(avail >> 10));
+		ok = 0;
+	}
+
+	for (int i = 0; ok && i < region_cnt; i++)
+	{
+		cd_ram_region_t *r = &regions[i];
+		r->chunks = (r->size + r->chunk - 1) / r->chunk;
+		r->ready = (uint8_t *)calloc(r->chunks, 1);
+		r->data = (uint8_t *)mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (r->data == MAP_FAILED) r->data = NULL;
+		if (r->data) mem_account(MEM_CD, r->size);
+		if (!r->ready || !r->data) ok = 0;
+	}
+
+	if (ok)
+	{
+		// Keep off core #1 since main runs there
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+		if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+		stop = 0;
+		want = -1;
+		running = !pthread_create(&worker, &attr, cd_ram_worker, NULL);
+		pthread_attr_destroy(&attr);
+		ok = running;
+	}
+
+	if (!ok)
+	{
+		cd_ram_release();
+		return;
+	}
+
+	printf("cd_ram: copying %llu MB image to memory.\n", (unsigned long long)(size >> 20));
+}
+
+void cd_ram_release()
+{
+	if (running)
+	{
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		pthread_join(worker, NULL);
+		running = 0;
+	}
+
+	for (int i = 0; i < region_cnt; i++)
+	{
+		if (regions[i].data)
+		{
+			munmap(regions[i].data, regions[i].size);
+			mem_account(MEM_CD, -(int64_t)regions[i].size);
+		}
+		free(regions[i].ready);
+	}
+
+	memset(regions, 0, sizeof(regions));
+	region_cnt = 0;
+	track_cnt = 0;
+}
+
+static cd_ram_region_t *cd_ram_region(const cd_source_t *src, int *idx)
+{
+	if (!region_cnt) return NULL;
+
+	if (src->chd_f)
+	{
+		*idx = 0;
+		return (regions[0].chd_f == src->chd_f) ? &regions[0] : NULL;
+	}
+
+	for (int i = 0; i < track_cnt; i++)
+	{
+		if (track_file[i] == src->f)
+		{
+			*idx = track_region[i];
+			return &regions[*idx];
+		}
+	}
+	return NULL;
+}
+
+// Byte position of the sector window in the region, -1 if it's outside.
+static int64_t cd_ram_pos(const cd_ram_region_t *r, const cd_source_t *src, int lba, int offset, int len)
+{
+	if (lba < 0) return -1;
+
+	uint64_t pos;
+	if (r->chd_f) pos = (uint64_t)(lba / r->frames_per_hunk) * r->hunkbytes + (lba % r->frames_per_hunk) * CD_FRAME_SIZE + offset;
+	else pos = src->offset + (uint64_t)lba * src->sector_size + offset;
+
+	return (pos + len <= r->size) ? (int64_t)pos : -1;
+}
+
+static int cd_ram_resident(const cd_ram_region_t *r, int64_t pos, int len)
+{
+	return __atomic_load_n(&r->ready[pos / r->chunk], __ATOMIC_ACQUIRE) &&
+		__atomic_load_n(&r->ready[(pos + len - 1) / r->chunk], __ATOMIC_ACQUIRE);
+}
+
+static void cd_ram_hint(int idx, const cd_ram_region_t *r, int64_t pos)
+{
+	if (running) __atomic_store_n(&want, ((int64_t)idx << 32) | (pos / r->chunk), __ATOMIC_RELAXED);
+}
+
+int cd_ram_read(const cd_source_t *src, int lba, int count, int offset, int len, uint8_t *dst, int stride)
+{
+	int idx;
+	cd_ram_region_t *r = cd_ram_region(src, &idx);
+	if (!r) return 0;
+
+	// Check the whole run first, a partial copy would be read again anyway
+	for (int i = 0; i < count; i++)
+	{
+		int64_t pos = cd_ram_pos(r, src, lba + i, offset, len);
+		if (pos < 0) return 0;
+		if (!cd_ram_resident(r, pos, len))
+		{
+			cd_ram_hint(idx, r, pos);
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < count; i++, dst += stride) memcpy(dst, r->data + cd_ram_pos(r, src, lba + i, offset, len), len);
+	return count;
+}
+
+const uint8_t *cd_ram_peek(const cd_source_t *src, int lba, int offset, int len)
+{
+	int idx;
+	cd_ram_region_t *r = cd_ram_region(src, &idx);
+	if (!r) return NULL;
+
+	int64_t pos = cd_ram_pos(r, src, lba, offset, len);
+	if (pos < 0) return NULL;
+	if (cd_ram_resident(r, pos, len)) return r->data + pos;
+
+	cd_ram_hint(idx, r, pos);
+	return NULL;
+}
+
+int cd_ram_want(const cd_source_t *src, int lba)
+{
+	int idx;
+	cd_ram_region_t *r = cd_ram_region(src, &idx);
+	if (!r) return 0;
+
+	int64_t pos = cd_ram_pos(r, src, lba, 0, 1);
+	if (pos < 0) return 0;
+	if (cd_ram_resident(r, pos, 1)) return 1;
+
+	cd_ram_hint(idx, r, pos);
+	return 0;
+}
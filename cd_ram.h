@@ -0,0 +1,29 @@
+#ifndef CD_RAM_H
+#define CD_RAM_H
+
+#include "cd.h"
+
+// Install-to-RAM for mounted CD images (cd_ram option, per core section).
+// After mount the whole image (CHD hunks or BIN track files) is copied into
+// memory by a worker thread kept off the main core. Sectors already resident
+// are read with a memcpy, the others still come from the image, and a read
+// that misses moves the copy there so the parts the game uses arrive first.
+// BIN tracks in zip files and images bigger than the limit stay on storage.
+
+// Starts copying the image of toc, replaces a previous one.
+void cd_ram_install(const toc_t *toc);
+
+// Stops the copy and frees the memory, needed before the image is closed.
+void cd_ram_release();
+
+// Serves the read from memory if all of it is resident, returns 0 otherwise.
+// Parameters as seen by cd_read_sectors: offset/len is the window inside a stored sector.
+int cd_ram_read(const cd_source_t *src, int lba, int count, int offset, int len, uint8_t *dst, int stride);
+
+// The sector window in memory if it's resident, NULL otherwise. Valid until cd_ram_release.
+const uint8_t *cd_ram_peek(const cd_source_t *src, int lba, int offset, int len);
+
+// The core is about to read there. Returns 1 if it's resident already.
+int cd_ram_want(const cd_source_t *src, int lba);
+
+#endif
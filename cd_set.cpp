@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+
+#include "cd_set.h"
+#include "file_io.h"
+#include "hardware.h"
+#include "support/chd/mister_chd.h"
+
+#define CD_SET_DISCS 8
+#define CD_SET_DELAY 3000 // ms after a mount before the other discs are opened
+#define CD_SET_PACE  200  // ms between two of them
+#define CD_SET_WARM  64   // sectors read ahead on a swap
+
+enum { DISC_NEW = 0, DISC_READY, DISC_MOUNTED, DISC_FAILED };
+
+struct cd_set_disc_t
+{
+	char path[1024];
+	int state;
+	int extra;
+	toc_t *toc;     // while ready
+};
+
+static struct
+{
+	int count;
+	cd_set_disc_t disc[CD_SET_DISCS];
+	cd_set_loader load;
+	unsigned long next;
+} set = {};
+
+static int is_m3u(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	return ext && !strcasecmp(ext, ".m3u");
+}
+
+static void toc_close(toc_t *toc)
+{
+	if (toc->chd_f) mister_chd_close(toc->chd_f);
+	for (int i = 0; i < toc->last; i++)
+	{
+		if (toc->tracks[i].f.opened()) FileClose(&toc->tracks[i].f);
+	}
+	if (toc->sub.opened()) FileClose(&toc->sub);
+}
+
+static void set_close()
+{
+	for (int i = 0; i < set.count; i++)
+	{
+		if (set.disc[i].toc)
+		{
+			toc_close(set.disc[i].toc);
+			free(set.disc[i].toc);
+		}
+	}
+	memset(&set, 0, sizeof(set));
+}
+
+// Full paths of the discs listed in m3u (full path too).
+static int m3u_parse(const char *m3u, cd_set_disc_t *disc, int max)
+{
+	static char text[16 * 1024];
+	int len = FileLoad(m3u, text, sizeof(text) - 1);
+	if (len <= 0) return 0;
+	text[len] = 0;
+
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s", m3u);
+	char *p = strrchr(dir, '/');
+	if (p) *p = 0;
+	else *dir = 0;
+
+	int cnt = 0;
+	char *save;
+	for (char *line = strtok_r(text, "\r\n", &save); line && cnt < max; line = strtok_r(NULL, "\r\n", &save))
+	{
+		while (*line == ' ' || *line == '\t') line++;
+		if (!*line || *line == '#') continue;
+
+		for (char *c = line; *c; c++) if (*c == '\\') *c = '/';
+		if (*line == '/') snprintf(disc[cnt].path, sizeof(disc[cnt].path), "%s", line);
+		else snprintf(disc[cnt].path, sizeof(disc[cnt].path), "%s/%s", dir, line);
+		cnt++;
+	}
+	return cnt;
+}
+
+static int set_find(const char *full)
+{
+	for (int i = 0; i < set.count; i++) if (!strcmp(set.disc[i].path, full)) return i;
+	return -1;
+}
+
+// Makes the set of the disc the current one, no set if it's in none.
+static void set_open(const char *full)
+{
+	if (set_find(full) >= 0) return;
+	set_close();
+
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s", full);
+	char *p = strrchr(dir, '/');
+	if (!p) return;
+	*p = 0;
+
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_type != DT_REG || !is_m3u(de->d_name)) continue;
+
+		char m3u[1024];
+		snprintf(m3u, sizeof(m3u), "%s/%s", dir, de->d_name);
+		set.count = m3u_parse(m3u, set.disc, CD_SET_DISCS);
+		if (set_find(full) >= 0)
+		{
+			printf("cd_set: %s, %d discs\n", m3u, set.count);
+			break;
+		}
+		memset(&set, 0, sizeof(set));
+	}
+	closedir(d);
+}
+
+const char *cd_set_disc(const char *name)
+{
+	if (!is_m3u(name)) return name;
+
+	static cd_set_disc_t disc[1];
+	char m3u[1024];
+	snprintf(m3u, sizeof(m3u), "%s", getFullPath(name));
+	return m3u_parse(m3u, disc, 1) ? disc[0].path : name;
+}
+
+int cd_set_take(const char *name, toc_t *toc, int *extra, cd_set_loader load)
+{
+	char full[1024];
+	snprintf(full, sizeof(full), "%s", getFullPath(name));
+	set_open(full);
+	set.load = load;
+
+	// the core closed it itself, opened again later
+	for (int i = 0; i < set.count; i++) if (set.disc[i].state == DISC_MOUNTED) set.disc[i].state = DISC_NEW;
+
+	int i = set_find(full);
+	if (i < 0 || set.disc[i].state != DISC_READY) return 0;
+
+	cd_set_disc_t *disc = &set.disc[i];
+	memcpy((void*)toc, disc->toc, sizeof(toc_t));
+	free(disc->toc);
+	disc->toc = NULL;
+	disc->state = DISC_MOUNTED;
+	if (extra) *extra = disc->extra;
+	set.next = GetTimer(CD_SET_DELAY);
+
+	// the system reads the start of the disc first
+	cd_source_t src = {};
+	src.chd_f = toc->chd_f;
+	src.f = &toc->tracks[0].f;
+	src.offset = toc->tracks[0].offset;
+	src.sector_size = toc->tracks[0].sector_size ? toc->tracks[0].sector_size : 2352;
+	cd_prefetch(&src, 0, CD_SET_WARM);
+
+	printf("cd_set: disc %d of %d swapped in\n", i + 1, set.count);
+	return 1;
+}
+
+void cd_set_mounted(const char *name, int extra)
+{
+	int i = set_find(getFullPath(name));
+	if (i < 0) return;
+
+	set.disc[i].state = DISC_MOUNTED;
+	set.disc[i].extra = extra;
+	set.next = GetTimer(CD_SET_DELAY);
+}
+
+int cd_set_unmount(toc_t *toc)
+{
+	for (int i = 0; i < set.count; i++)
+	{
+		cd_set_disc_t *disc = &set.disc[i];
+		if (disc->state != DISC_MOUNTED) continue;
+
+		disc->toc = (toc_t*)malloc(sizeof(toc_t));
+		if (!disc->toc)
+		{
+			disc->state = DISC_NEW;
+			return 0;
+		}
+
+		memcpy((void*)disc->toc, toc, sizeof(toc_t));
+		memset((void*)toc, 0, sizeof(toc_t));
+		disc->state = DISC_READY;
+		return 1;
+	}
+
+	return 0;
+}
+
+void cd_set_poll()
+{
+	if (!set.count || !set.load || !CheckTimer(set.next)) return;
+
+	for (int i = 0; i < set.count; i++)
+	{
+		cd_set_disc_t *disc = &set.disc[i];
+		if (disc->state != DISC_NEW) continue;
+
+		disc->toc = (toc_t*)calloc(1, sizeof(toc_t));
+		if (disc->toc && set.load(disc->path, disc->toc, &disc->extra) && disc->toc->last)
+		{
+			disc->state = DISC_READY;
+			printf("cd_set: disc %d of %d ready\n", i + 1, set.count);
+		}
+		else
+		{
+			if (disc->toc)
+			{
+				toc_close(disc->toc);
+				free(disc->toc);
+				disc->toc = NULL;
+			}
+			disc->state = DISC_FAILED;
+			printf("cd_set: cannot open %s\n", disc->path);
+		}
+
+		set.next = GetTimer(CD_SET_PACE);
+		return;
+	}
+}
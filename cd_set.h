@@ -0,0 +1,36 @@
+#ifndef CD_SET_H
+#define CD_SET_H
+
+#include "cd.h"
+
+// Multi-disc sets (PSX, Saturn, MegaCD, PCE-CD). A set is an .m3u playlist
+// listing the disc images, one per line, relative to the playlist. When a
+// disc of a set is mounted, the other discs are opened and their TOCs parsed
+// in the background of the poll loop through the core's own loader and kept
+// open, so a disc swap only moves a ready TOC into the core and warms up the
+// first sectors. The disc swapped out is kept the same way. The set closes
+// when a disc that's not in it is mounted.
+
+// Fills toc for the image (CUE parse, CHD open) as the core's mount does,
+// extra: core specific value (e.g. sector size). Returns 1 on success.
+typedef int (*cd_set_loader)(const char *name, toc_t *toc, int *extra);
+
+// Image to mount for name: the first disc when name is an .m3u, name otherwise.
+const char *cd_set_disc(const char *name);
+
+// Before the core loads name itself: moves the TOC in if the set has it
+// ready and returns 1, the disc counts as mounted then. load is what the
+// other discs of the set are opened with.
+int cd_set_take(const char *name, toc_t *toc, int *extra, cd_set_loader load);
+
+// The core loaded name itself.
+void cd_set_mounted(const char *name, int extra = 0);
+
+// Instead of closing the TOC of the mounted disc (after cd_ram_release):
+// returns 1 if the set keeps it, toc is cleared then. 0: the caller closes it.
+int cd_set_unmount(toc_t *toc);
+
+// Opens the next disc of the set, one per call.
+void cd_set_poll();
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "cdda_stream.h"
+#include "profiling.h"
+
+#define CDDA_SECTOR 2352
+#define CDDA_RING   128 // sectors, power of 2
+#define CDDA_BATCH  8   // sectors per read of the worker
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static int started = 0;
+static int running = 0;
+
+// Under lock
+static int busy = 0;       // worker is reading
+static int active = 0;     // worker reads ahead from next_lba
+static uint32_t gen = 0;   // changed on every restart, reads of an old position are dropped
+static int next_lba = 0;
+static int end_lba = 0;
+
+// Written by main only, while the worker isn't busy
+static cd_source_t src = {};
+
+// Ring: head written by the worker, tail by main
+static std::atomic<uint32_t> head(0);
+static std::atomic<uint32_t> tail(0);
+static int ring_lba[CDDA_RING];
+static uint8_t ring[CDDA_RING][CDDA_SECTOR];
+
+static int can_stream(const cd_source_t *s)
+{
+	if (s->chd_f) return 1;
+	return s->f && s->f->filp && s->sector_size == CDDA_SECTOR;
+}
+
+static int same_source(const cd_source_t *a, const cd_source_t *b)
+{
+	return a->chd_f == b->chd_f && a->f == b->f && a->offset == b->offset && a->sector_size == b->sector_size;
+}
+
+// BIN tracks are read with pread so the FILE position main uses stays untouched
+static int fetch(const cd_source_t *s, int lba, int count, uint8_t *dst)
+{
+	if (s->chd_f) return cd_read_sectors(s, lba, count, CD_READ_AUDIO, dst);
+
+	ssize_t ret = pread(fileno(s->f->filp), dst, count * CDDA_SECTOR, s->offset + (__off64_t)lba * CDDA_SECTOR);
+	return (ret > 0) ? ret / CDDA_SECTOR : 0;
+}
+
+static void *cdda_worker(void *)
+{
+	trace_thread_name("cdda_stream");
+
+	pthread_mutex_lock(&lock);
+	while (1)
+	{
+		if (!active || next_lba >= end_lba)
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		uint32_t h = head.load(std::memory_order_relaxed);
+		uint32_t room = CDDA_RING - (h - tail.load(std::memory_order_acquire));
+		if (!room)
+		{
+			// Main doesn't signal when it takes sectors, look again shortly
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 5000000;
+			if (ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_nsec -= 1000000000;
+				ts.tv_sec++;
+			}
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+
+		uint32_t idx = h % CDDA_RING;
+		int count = end_lba - next_lba;
+		if (count > (int)room) count = room;
+		if (count > (int)(CDDA_RING - idx)) count = CDDA_RING - idx;
+		if (count > CDDA_BATCH) count = CDDA_BATCH;
+
+		int lba = next_lba;
+		uint32_t cur = gen;
+		busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		int got;
+		{
+			TRACE_SCOPE("cdda_read");
+			got = fetch(&src, lba, count, ring[idx]);
+		}
+		for (int i = 0; i < got; i++) ring_lba[idx + i] = lba + i;
+
+		pthread_mutex_lock(&lock);
+		busy = 0;
+		if (cur == gen)
+		{
+			head.store(h + got, std::memory_order_release);
+			next_lba += got;
+			if (got < count) active = 0; // end of the image or read error
+		}
+		pthread_cond_broadcast(&cond);
+	}
+
+	return NULL;
+}
+
+static int cdda_start()
+{
+	if (started) return running;
+	started = 1;
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	running = !pthread_create(&worker, &attr, cdda_worker, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (!running) printf("cdda_stream: cannot start the worker, reading inline.\n");
+	return running;
+}
+
+// Waits for the worker to finish its read and empties the ring
+static void cdda_reset()
+{
+	pthread_mutex_lock(&lock);
+	gen++;
+	active = 0;
+	while (busy) pthread_cond_wait(&cond, &lock);
+	head.store(0, std::memory_order_relaxed);
+	tail.store(0, std::memory_order_relaxed);
+	pthread_mutex_unlock(&lock);
+}
+
+void cdda_stop()
+{
+	if (!running) return;
+
+	cdda_reset();
+	memset(&src, 0, sizeof(src));
+}
+
+int cdda_read(const cd_source_t *s, int lba, int end, uint8_t *dst, int count, int stride)
+{
+	if (!stride) stride = CDDA_SECTOR;
+	if (!can_stream(s) || !cdda_start()) return cd_read_sectors(s, lba, count, CD_READ_AUDIO, dst, stride);
+
+	int i = 0;
+	if (same_source(s, &src))
+	{
+		// Sectors before the wanted one are done with, the wanted one stays for a repeated read
+		uint32_t h = head.load(std::memory_order_acquire);
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		for (; i < count; i++)
+		{
+			while (t != h && ring_lba[t % CDDA_RING] < lba + i) t++;
+			if (t == h || ring_lba[t % CDDA_RING] != lba + i) break;
+			memcpy(dst + i * stride, ring[t % CDDA_RING], CDDA_SECTOR);
+		}
+		tail.store(t, std::memory_order_release);
+	}
+
+	if (i < count)
+	{
+		// Somewhere else: read here into the ring and let the worker go on behind it
+		cdda_reset();
+		src = *s;
+
+		int want = count - i;
+		if (want > CDDA_BATCH) want = CDDA_BATCH;
+		int got = fetch(s, lba + i, want, ring[0]);
+		for (int k = 0; k < got; k++)
+		{
+			ring_lba[k] = lba + i + k;
+			memcpy(dst + (i + k) * stride, ring[k], CDDA_SECTOR);
+		}
+		head.store(got, std::memory_order_release);
+		tail.store(got ? got - 1 : 0, std::memory_order_relaxed);
+		i += got;
+
+		pthread_mutex_lock(&lock);
+		next_lba = lba + i;
+		end_lba = end;
+		active = got > 0;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	trace_counter("cdda_fill", head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed));
+	return i;
+}
@@ -0,0 +1,23 @@
+#ifndef CDDA_STREAM_H
+#define CDDA_STREAM_H
+
+#include "cd.h"
+
+// CD audio read-ahead shared by the CD cores (PCE-CD, MegaCD/NeoGeo-CD, Saturn).
+// Audio sectors following the ones the core plays are read (and for CHD the
+// FLAC hunks decoded) on a worker thread kept off the main core, into a
+// single producer/single consumer ring. Reads of the play path then copy
+// ready sectors out of the ring and only go to the image when the core
+// jumps somewhere else, which also moves the read-ahead there.
+// BIN tracks in zip files aren't read ahead.
+
+// Reads count audio sectors (CD_READ_AUDIO) of src starting at lba into dst,
+// stride bytes apart (0 packs them). end is the first lba not to read ahead,
+// the end of the track. The last sector read stays available, reading it
+// again is served from the ring too. Returns number of sectors read.
+int cdda_read(const cd_source_t *src, int lba, int end, uint8_t *dst, int count = 1, int stride = 0);
+
+// Stops the read-ahead, needed before the image is closed.
+void cdda_stop();
+
+#endif
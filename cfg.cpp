@@ -8,12 +8,16 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "cfg.h"
 #include "debug.h"
 #include "file_io.h"
 #include "user_io.h"
 #include "video.h"
 #include "support/arcade/mra_loader.h"
+#include "crc.h"
 
 cfg_t cfg;
 static FILE *orig_stdout = NULL;
@@ -53,6 +57,7 @@ static const ini_var_t ini_vars[] =
 	{ "HDMI_LIMITED", (void*)(&(cfg.hdmi_limited)), UINT8, 0, 2 },
 	{ "KBD_NOMOUSE", (void*)(&(cfg.kbd_nomouse)), UINT8, 0, 1 },
 	{ "MOUSE_THROTTLE", (void*)(&(cfg.mouse_throttle)), UINT8, 1, 100 },
+	{ "MOUSE_RATE", (void*)(&(cfg.mouse_rate)), UINT16, 0, 1000 },
 	{ "BOOTSCREEN", (void*)(&(cfg.bootscreen)), UINT8, 0, 1 },
 	{ "VSCALE_MODE", (void*)(&(cfg.vscale_mode)), UINT8, 0, 5 },
 	{ "VSCALE_BORDER", (void*)(&(cfg.vscale_border)), UINT16, 0, 399 },
@@ -131,6 +136,14 @@ static const ini_var_t ini_vars[] =
 	{ "OSD_LOCK_TIME", (void*)(&(cfg.osd_lock_time)), UINT16, 0, 60 },
 	{ "DEBUG", (void *)(&(cfg.debug)), UINT8, 0, 1 },
 	{ "LOOKAHEAD", (void *)(&(cfg.lookahead)), UINT8, 0, 3 },
+	{ "IDE_CACHE_SIZE", (void *)(&(cfg.ide_cache_size)), UINT16, 0, 16384 },
+	{ "HDD_MMAP", (void *)(&(cfg.hdd_mmap)), UINT8, 0, 1 },
+	{ "SAVESTATE_HISTORY", (void *)(&(cfg.savestate_history)), UINT8, 0, 64 },
+	{ "MSU_BUFFER", (void *)(&(cfg.msu_buffer)), UINT16, 16, 8192 },
+	{ "CD_RAM", (void *)(&(cfg.cd_ram)), UINT16, 0, 1024 },
+	{ "REALTIME", (void *)(&(cfg.realtime)), UINT8, 0, 1 },
+	{ "STALL_WATCHDOG", (void *)(&(cfg.stall_watchdog)), UINT16, 0, 10000 },
+	{ "SENSOR_PERIOD", (void *)(&(cfg.sensor_period)), UINT16, 250, 60000 },
 	{ "MAIN", (void*)(&(cfg.main)), STRING, 0, sizeof(cfg.main) - 1 },
 	{"VFILTER_INTERLACE_DEFAULT", (void*)(&(cfg.vfilter_interlace_default)), STRING, 0, sizeof(cfg.vfilter_interlace_default) - 1 },
 };
@@ -428,12 +441,8 @@ static void ini_parse_var(char* buf)
 	}
 }
 
-static void ini_parse(int alt, const char *vmode)
+static void ini_stdout_init()
 {
-	static char line[INI_LINE_SIZE];
-	int section = 0;
-	int eof;
-
 	if (!orig_stdout) orig_stdout = stdout;
 	if (!dev_null)
 	{
@@ -445,6 +454,15 @@ static void ini_parse(int alt, const char *vmode)
 			stdout = dev_null;
 		}
 	}
+}
+
+static void ini_parse(int alt, const char *vmode)
+{
+	static char line[INI_LINE_SIZE];
+	int section = 0;
+	int eof;
+
+	ini_stdout_init();
 
 	ini_parser_debugf("Start INI parser for core \"%s\"(%s), video mode \"%s\".", user_io_get_core_name(0), user_io_get_core_name(1), vmode);
 
@@ -570,8 +588,113 @@ const char* cfg_get_label(uint8_t alt)
 	return label;
 }
 
+// The result of parsing is kept in /tmp for each combination of INI file,
+// core and video mode it depends on. A core load restarts the process, so it
+// then reads the config back in one go as long as the INI is unchanged.
+#define CFG_CACHE_DIR   "/tmp/cfg_cache"
+#define CFG_CACHE_MAGIC 0x31474643 // CFG1
+
+struct cfg_cache_key_t
+{
+	uint32_t magic;
+	uint32_t cfg_size;
+	char     ini[64];
+	int64_t  mtime;
+	int64_t  size;
+	char     core[2][64];
+	char     vmode[2][64];
+	uint8_t  arcade;
+	uint8_t  vertical;
+};
+
+struct cfg_cache_t
+{
+	cfg_cache_key_t key;
+	cfg_t cfg;
+	bool has_video_sections;
+	bool using_video_section;
+	int error_count;
+	char errors[CFG_ERRORS_MAX][CFG_ERRORS_STRLEN];
+};
+
+static bool cfg_cache_key(cfg_cache_key_t *key, char *path, size_t len)
+{
+	memset(key, 0, sizeof(*key));
+
+	const char *name = cfg_get_name(altcfg());
+	struct stat64 st;
+	if (!name[0] || stat64(getFullPath(name), &st)) return false;
+
+	key->magic = CFG_CACHE_MAGIC;
+	key->cfg_size = sizeof(cfg_t);
+	snprintf(key->ini, sizeof(key->ini), "%s", name);
+	key->mtime = st.st_mtime;
+	key->size = st.st_size;
+	snprintf(key->core[0], sizeof(key->core[0]), "%s", user_io_get_core_name(0));
+	snprintf(key->core[1], sizeof(key->core[1]), "%s", user_io_get_core_name(1));
+	snprintf(key->vmode[0], sizeof(key->vmode[0]), "%s", video_get_core_mode_name(0));
+	snprintf(key->vmode[1], sizeof(key->vmode[1]), "%s", video_get_core_mode_name(1));
+	key->arcade = is_arcade();
+	key->vertical = arcade_is_vertical();
+
+	snprintf(path, len, CFG_CACHE_DIR "/%08x.bin", crc32_update(0, key, sizeof(*key)));
+	return true;
+}
+
+static bool cfg_cache_load(const cfg_cache_key_t *key, const char *path)
+{
+	static cfg_cache_t cache;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	bool ok = read(fd, &cache, sizeof(cache)) == sizeof(cache) && !memcmp(&cache.key, key, sizeof(*key));
+	close(fd);
+	if (!ok) return false;
+
+	memcpy(&cfg, &cache.cfg, sizeof(cfg));
+	has_video_sections = cache.has_video_sections;
+	using_video_section = cache.using_video_section;
+	cfg_error_count = cache.error_count;
+	memcpy(cfg_errors, cache.errors, sizeof(cfg_errors));
+	for (int i = 0; i < cfg_error_count; i++) printf("ERROR CFG: %s\n", cfg_errors[i]);
+
+	// what parsing DEBUG would have done
+	ini_stdout_init();
+	stdout = cfg.debug ? orig_stdout : dev_null;
+	return true;
+}
+
+static void cfg_cache_save(const cfg_cache_key_t *key, const char *path)
+{
+	static cfg_cache_t cache;
+	memset(&cache, 0, sizeof(cache));
+	cache.key = *key;
+	memcpy(&cache.cfg, &cfg, sizeof(cfg));
+	cache.has_video_sections = has_video_sections;
+	cache.using_video_section = using_video_section;
+	cache.error_count = cfg_error_count;
+	memcpy(cache.errors, cfg_errors, sizeof(cfg_errors));
+
+	mkdir(CFG_CACHE_DIR, 0755);
+
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+	bool ok = write(fd, &cache, sizeof(cache)) == sizeof(cache);
+	close(fd);
+
+	if (ok) rename(tmp, path);
+	else unlink(tmp);
+}
+
 void cfg_parse()
 {
+	cfg_cache_key_t key;
+	char cache_path[64];
+	bool cacheable = cfg_cache_key(&key, cache_path, sizeof(cache_path));
+	if (cacheable && cfg_cache_load(&key, cache_path)) return;
+
 	memset(&cfg, 0, sizeof(cfg));
 	cfg.csync = 1;
 	cfg.bootscreen = 1;
@@ -583,6 +706,9 @@ void cfg_parse()
 	cfg.wheel_force = 50;
 	cfg.dvi_mode = 2;
 	cfg.lookahead = 2;
+	cfg.ide_cache_size = 1024;
+	cfg.msu_buffer = 512;
+	cfg.sensor_period = 2000;
 	cfg.hdr = 0;
 	cfg.hdr_max_nits = 1000;
 	cfg.hdr_avg_nits = 250;
@@ -615,6 +741,8 @@ void cfg_parse()
 			cfg.forced_scandoubler = 0;
 		}
 	}
+
+	if (cacheable) cfg_cache_save(&key, cache_path);
 }
 
 bool cfg_has_video_sections()
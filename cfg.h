@@ -27,6 +27,7 @@ typedef struct {
 	uint8_t vsync_adjust;
 	uint8_t kbd_nomouse;
 	uint8_t mouse_throttle;
+	uint16_t mouse_rate;
 	uint8_t bootscreen;
 	uint8_t vscale_mode;
 	uint16_t vscale_border;
@@ -99,6 +100,14 @@ typedef struct {
 	uint16_t osd_lock_time;
 	char debug;
 	uint8_t lookahead;
+	uint16_t ide_cache_size;
+	uint8_t hdd_mmap;
+	uint8_t savestate_history;
+	uint16_t msu_buffer;
+	uint16_t cd_ram;
+	uint8_t realtime;
+	uint16_t stall_watchdog;
+	uint16_t sensor_period;
 	char main[1024];
 	char vfilter_interlace_default[1023];
 } cfg_t;
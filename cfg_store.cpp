@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "cfg_store.h"
+#include "file_io.h"
+#include "hardware.h"
+#include "offload.h"
+
+struct cfg_entry_t
+{
+	std::vector<uint8_t> data;
+	uint32_t seq;        // bumped on every change
+	bool queued;         // a worker is going to write it
+	unsigned long idle;
+};
+
+// entries by full path
+static std::unordered_map<std::string, cfg_entry_t> entries;
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// held while a file is written, keeps writes of the same file in order
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cfg_store_key(const char *path, std::string &key)
+{
+	char full[1024];
+	key = getFullPath_r(path, full, sizeof(full));
+}
+
+static int cfg_store_write(const std::string &path, const std::vector<uint8_t> &data)
+{
+	std::string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("cfg_store: cannot create %s\n", tmp.c_str());
+		return 0;
+	}
+
+	int ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && !fsync(fd);
+	close(fd);
+
+	if (!ok || rename(tmp.c_str(), path.c_str()))
+	{
+		printf("cfg_store: cannot write %s\n", path.c_str());
+		unlink(tmp.c_str());
+		return 0;
+	}
+
+	return 1;
+}
+
+// Writes the entry if it's still at seq (any seq if seq is 0), drops it once written.
+static void cfg_store_commit(const std::string &path, uint32_t seq)
+{
+	pthread_mutex_lock(&write_lock);
+
+	pthread_mutex_lock(&entries_lock);
+	auto it = entries.find(path);
+	if (it == entries.end() || (seq && it->second.seq != seq))
+	{
+		// changed meanwhile, the poll queues it again
+		if (it != entries.end()) it->second.queued = false;
+		pthread_mutex_unlock(&entries_lock);
+		pthread_mutex_unlock(&write_lock);
+		return;
+	}
+
+	std::vector<uint8_t> data = it->second.data;
+	seq = it->second.seq;
+	pthread_mutex_unlock(&entries_lock);
+
+	cfg_store_write(path, data);
+
+	pthread_mutex_lock(&entries_lock);
+	it = entries.find(path);
+	if (it != entries.end())
+	{
+		if (it->second.seq == seq) entries.erase(it);
+		else it->second.queued = false;
+	}
+	pthread_mutex_unlock(&entries_lock);
+
+	pthread_mutex_unlock(&write_lock);
+}
+
+int cfg_store_save(const char *path, const void *data, int size)
+{
+	if (size < 0) return 0;
+
+	std::string key;
+	cfg_store_key(path, key);
+
+	pthread_mutex_lock(&entries_lock);
+	cfg_entry_t &e = entries[key];
+	e.data.assign((const uint8_t*)data, (const uint8_t*)data + size);
+	e.seq++;
+	if (!e.seq) e.seq++;
+	e.idle = GetTimer(CFG_STORE_IDLE);
+	pthread_mutex_unlock(&entries_lock);
+
+	return size;
+}
+
+int cfg_store_load(const char *path, void *data, int size)
+{
+	std::string key;
+	cfg_store_key(path, key);
+
+	int ret = -1;
+	pthread_mutex_lock(&entries_lock);
+	auto it = entries.find(key);
+	if (it != entries.end())
+	{
+		ret = it->second.data.size();
+		if (data)
+		{
+			if (size > 0 && ret > size) ret = size;
+			memcpy(data, it->second.data.data(), ret);
+		}
+	}
+	pthread_mutex_unlock(&entries_lock);
+
+	return ret;
+}
+
+void cfg_store_drop(const char *path)
+{
+	std::string key;
+	cfg_store_key(path, key);
+
+	pthread_mutex_lock(&write_lock);
+	pthread_mutex_lock(&entries_lock);
+	entries.erase(key);
+	pthread_mutex_unlock(&entries_lock);
+	pthread_mutex_unlock(&write_lock);
+}
+
+void cfg_store_poll()
+{
+	pthread_mutex_lock(&entries_lock);
+	for (auto &it : entries)
+	{
+		cfg_entry_t &e = it.second;
+		if (e.queued || !CheckTimer(e.idle)) continue;
+
+		e.queued = true;
+		std::string path = it.first;
+		uint32_t seq = e.seq;
+		offload_add_work([path, seq] { cfg_store_commit(path, seq); });
+	}
+	pthread_mutex_unlock(&entries_lock);
+}
+
+void cfg_store_flush()
+{
+	std::vector<std::string> paths;
+
+	pthread_mutex_lock(&entries_lock);
+	for (auto &it : entries) paths.push_back(it.first);
+	pthread_mutex_unlock(&entries_lock);
+
+	for (auto &path : paths) cfg_store_commit(path, 0);
+}
@@ -0,0 +1,29 @@
+#ifndef CFG_STORE_H
+#define CFG_STORE_H
+
+// Deferred writes of the small settings files (FileSaveConfig and the other
+// files a setting change writes). Only the latest contents of a file are
+// kept, and they're written by an offload worker once the file hasn't
+// changed for CFG_STORE_IDLE ms, so stepping through a setting writes the SD
+// card once. Pending files are written before a core change or reboot and
+// when the OSD opens. A file is written to <file>.tmp, synced and renamed.
+
+#define CFG_STORE_IDLE 1500 // ms
+
+// path as for FileSave (relative to the storage root or absolute).
+int cfg_store_save(const char *path, const void *data, int size);
+
+// Contents not written yet, as FileLoad returns them (data NULL: the size).
+// -1 if the file has nothing pending.
+int cfg_store_load(const char *path, void *data, int size);
+
+// Forgets what's pending for path, before it's deleted.
+void cfg_store_drop(const char *path);
+
+// Starts writing the files idle for long enough, called from the poll loop.
+void cfg_store_poll();
+
+// Writes everything pending and waits for it.
+void cfg_store_flush();
+
+#endif
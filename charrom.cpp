@@ -174,8 +174,31 @@ unsigned char charfont[256][8] =
 
 static unsigned char tempfont[2048];
 
+static unsigned char charfont_rot[256][8];
+static int charfont_rot_valid = 0;
+
+const unsigned char *charfont_rotated(unsigned char c)
+{
+	if (!charfont_rot_valid)
+	{
+		for (int ch = 0; ch < 256; ch++)
+		{
+			for (int b = 0; b < 8; b++)
+			{
+				unsigned char a = 0;
+				for (int i = 0; i < 8; i++) a = (a << 1) | ((charfont[ch][i] >> b) & 1);
+				charfont_rot[ch][b] = a;
+			}
+		}
+		charfont_rot_valid = 1;
+	}
+
+	return charfont_rot[c];
+}
+
 void LoadFont(char* name)
 {
+	charfont_rot_valid = 0;
 	memset(tempfont, 0, sizeof(tempfont));
 
 	int sz = FileLoad(name, tempfont, sizeof(tempfont));
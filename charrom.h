@@ -5,4 +5,8 @@ extern unsigned char charfont[256][8];
 
 void LoadFont(char* name);
 
+// Glyph turned by 90 degrees as drawn into the OSD side stripe.
+// All of them are rotated on first use and again after LoadFont().
+const unsigned char *charfont_rotated(unsigned char c);
+
 #endif
@@ -5,8 +5,11 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include <vector>
 #include <algorithm>
+#include <string>
+#include <unordered_map>
 
 #include "hardware.h"
 #include "file_io.h"
@@ -15,54 +18,34 @@
 #include "fpga_io.h"
 #include "miniz.h"
 #include "osd.h"
+#include "arena.h"
 #include "cheats.h"
 #include "support.h"
 
+// Cheat list, built once when the game is loaded. Names and codes of all
+// entries are kept in cheat_arena so toggling a cheat never goes back to the
+// zip, and the next game drops them in one step.
 struct cheat_rec_t
 {
+	const char *name;
+	const uint8_t *data;
+	int cheatSize;    // 0 if the codes couldn't be read
+	int fileSize;     // as found in the zip, for the error message
+	int slot;         // offset in the packed buffer, -1 when disabled
 	bool enabled;
-	char name[256];
-	int cheatSize;
-	char *cheatData;
-
-	cheat_rec_t()
-	{
-		this->enabled = false;
-		this->cheatData = NULL;
-		this->cheatSize = 0;
-		memset(name, 0, sizeof(name));
-	}
-
-	cheat_rec_t(const cheat_rec_t& other)
-	{
-		memcpy(this->name, other.name, sizeof(other.name));
-		this->enabled = other.enabled;
-		this->cheatSize = other.cheatSize;
-		if (other.cheatData)
-		{
-			this->cheatData = new char [this->cheatSize];
-			memcpy(this->cheatData, other.cheatData, this->cheatSize);
-		}
-		else
-		{
-			this->cheatData = nullptr;
-		}
-	}
-
-	~cheat_rec_t()
-	{
-		if (this->cheatData)
-		{
-			delete[] this->cheatData;
-		}
-	}
 };
 
 typedef std::vector<cheat_rec_t> CheatVector;
 static CheatVector cheats;
+static arena_t cheat_arena = ARENA_INIT("cheats");
 
 #define CHEAT_SIZE (128*16) // 128 codes max
 
+// Codes of the enabled cheats back to back, in the order they were enabled.
+// Only the entry toggled is added or cut out, so it's never rebuilt.
+static uint8_t packed[CHEAT_SIZE];
+static int packed_len = 0;
+
 static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 static int loaded = 0;
@@ -89,18 +72,40 @@ struct CheatComp
 
 static char cheat_zip[1024] = {};
 
-static int find_by_crc(uint32_t romcrc)
+// CRC -> cheat zip name of cheats/<core>, rebuilt when the folder changes
+struct cheat_crc_index_t
 {
-	if (!romcrc) return 0;
+	std::string dir;
+	time_t mtime;
+	std::unordered_map<uint32_t, std::string> files;
+};
 
-	sprintf(cheat_zip, "%s/cheats/%s", getRootDir(), CoreName2);
-	DIR *d = opendir(cheat_zip);
+static cheat_crc_index_t crc_index;
+
+static int crc_index_update(const char *dir)
+{
+	struct stat st;
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode))
+	{
+		printf("Couldn't open dir: %s\n", dir);
+		crc_index.dir.clear();
+		crc_index.files.clear();
+		return 0;
+	}
+
+	if (crc_index.dir == dir && crc_index.mtime == st.st_mtime) return 1;
+
+	DIR *d = opendir(dir);
 	if (!d)
 	{
-		printf("Couldn't open dir: %s\n", cheat_zip);
+		printf("Couldn't open dir: %s\n", dir);
 		return 0;
 	}
 
+	crc_index.dir = dir;
+	crc_index.mtime = st.st_mtime;
+	crc_index.files.clear();
+
 	struct dirent *de;
 	while ((de = readdir(d)))
 	{
@@ -112,20 +117,29 @@ static int find_by_crc(uint32_t romcrc)
 				uint32_t crc = 0;
 				if (sscanf(de->d_name + len - 14, "[%X].zip", &crc) == 1)
 				{
-					if (crc == romcrc)
-					{
-						strcat(cheat_zip, "/");
-						strcat(cheat_zip, de->d_name);
-						closedir(d);
-						return 1;
-					}
+					crc_index.files.emplace(crc, de->d_name);
 				}
 			}
 		}
 	}
 
 	closedir(d);
-	return 0;
+	return 1;
+}
+
+static int find_by_crc(uint32_t romcrc)
+{
+	if (!romcrc) return 0;
+
+	sprintf(cheat_zip, "%s/cheats/%s", getRootDir(), CoreName2);
+	if (!crc_index_update(cheat_zip)) return 0;
+
+	auto it = crc_index.files.find(romcrc);
+	if (it == crc_index.files.end()) return 0;
+
+	strcat(cheat_zip, "/");
+	strcat(cheat_zip, it->second.c_str());
+	return 1;
 }
 
 static int find_in_same_dir(const char *name)
@@ -191,10 +205,29 @@ bool cheat_init_psx(mz_zip_archive* _z, const char *rom_path)
 	return false;
 }
 
-void cheats_init_arcade(int unit_size, int max_active)
+static void cheats_clear()
 {
 	cheats.clear();
+	arena_reset(&cheat_arena);
+	packed_len = 0;
 	loaded = 0;
+}
+
+static void cheat_add(const char *name, const void *data, int size, int file_size)
+{
+	cheat_rec_t cheat = {};
+	cheat.name = arena_strndup(&cheat_arena, name, 255);
+	cheat.data = size ? (const uint8_t*)arena_memdup(&cheat_arena, data, size) : NULL;
+	cheat.cheatSize = cheat.data ? size : 0;
+	cheat.fileSize = file_size;
+	cheat.slot = -1;
+
+	if (cheat.name) cheats.push_back(cheat);
+}
+
+void cheats_init_arcade(int unit_size, int max_active)
+{
+	cheats_clear();
 	cheat_unit_size = unit_size > 0 ? unit_size : 16;
 	cheat_max_active = max_active > 0 ? max_active : 128;
 	if ((cheat_max_active * cheat_unit_size) > CHEAT_SIZE)
@@ -207,19 +240,13 @@ void cheats_init_arcade(int unit_size, int max_active)
 
 void cheats_add_arcade(const char *name, const char *cheatData, int cheatSize)
 {
-	cheat_rec_t cheat = {};
-
 	if ((cheatSize % cheat_unit_size) != 0)
 	{
 		printf("Arcade cheat \'%s\' has incorrect length %d -> skipping.\n", name, cheatSize);
 		return;
 	}
 
-	strcpyz(cheat.name, name);
-	cheat.cheatSize = cheatSize;
-	cheat.cheatData = new char [cheatSize];
-	memcpy(cheat.cheatData, cheatData, cheatSize);
-	cheats.push_back(cheat);
+	cheat_add(name, cheatData, cheatSize, cheatSize);
 }
 
 void cheats_finalize_arcade()
@@ -231,8 +258,7 @@ void cheats_finalize_arcade()
 
 void cheats_init(const char *rom_path, uint32_t romcrc)
 {
-	cheats.clear();
-	loaded = 0;
+	cheats_clear();
 	cheat_unit_size = 16;
 	cheat_max_active = 128;
 	cheat_zip[0] = 0;
@@ -302,18 +328,30 @@ void cheats_init(const char *rom_path, uint32_t romcrc)
 
 	printf("Using cheat file: %s\n", cheat_zip);
 
+	// Codes are small, read them all now while the zip is open
 	mz_zip_archive *z = new mz_zip_archive(_z);
 	for (size_t i = 0; i < mz_zip_reader_get_num_files(z); i++)
 	{
-		cheat_rec_t ch = {};
-		mz_zip_reader_get_filename(z, i, ch.name, sizeof(ch.name));
+		mz_zip_archive_file_stat st;
+		if (mz_zip_reader_is_file_a_directory(z, i) || !mz_zip_reader_file_stat(z, i, &st))
+		{
+			continue;
+		}
 
-		if (mz_zip_reader_is_file_a_directory(z, i))
+		int len = (st.m_uncomp_size > CHEAT_SIZE) ? 0 : (int)st.m_uncomp_size;
+		if (!len || (len % cheat_unit_size))
 		{
+			cheat_add(st.m_filename, NULL, 0, (int)st.m_uncomp_size);
 			continue;
 		}
 
-		cheats.push_back(ch);
+		uint8_t buf[CHEAT_SIZE];
+		if (!mz_zip_reader_extract_to_mem(z, i, buf, len, 0))
+		{
+			printf("Cannot read cheat file %s.\n", st.m_filename);
+			len = 0;
+		}
+		cheat_add(st.m_filename, buf, len, (int)st.m_uncomp_size);
 	}
 
 	mz_zip_reader_end(z);
@@ -476,119 +514,78 @@ void cheats_print()
 
 static void cheats_send()
 {
-	static uint8_t buff[CHEAT_SIZE];
-	int pos = 0;
-
-	for (int i = 0; i < cheats_available(); i++)
-	{
-		if (cheats[i].enabled)
-		{
-			if (cheats[i].cheatData)
-			{
-				memcpy(&buff[pos], cheats[i].cheatData, cheats[i].cheatSize);
-				pos += cheats[i].cheatSize;
-			}
-			else
-			{
-				printf("Consistency error, memory for cheat not allocated, but cheat was enabled -> disable.\n");
-				cheats[i].cheatSize = 0;
-				cheats[i].enabled = false;
-			}
-		}
-	}
-
-	loaded = pos / cheat_unit_size;
+	loaded = packed_len / cheat_unit_size;
 	printf("Cheat codes: %d\n", loaded);
 
 	if (is_n64())
 	{
-		n64_cheats_send(buff, loaded);
+		// The codes are used from the buffer in place, including their run state
+		n64_cheats_send(packed, loaded);
 	}
 	else
 	{
+		// The cores take the whole list in one download
 		user_io_set_index(255);
 		user_io_set_download(1);
-		user_io_file_tx_data(buff, pos ? pos : 2);
+		user_io_file_tx_data(packed, packed_len ? packed_len : 2);
 		user_io_set_download(0);
 	}
 }
 
-void cheats_toggle()
+static int cheat_enable(cheat_rec_t &cheat)
 {
-	bool changedCheats = false;
-
-	if (cheats[iSelectedEntry].enabled == true)
+	if (!cheat.cheatSize)
 	{
-		cheats[iSelectedEntry].enabled = false;
-		changedCheats = true;
+		printf("Cheat file %s/%s has incorrect length %d -> skipping.\n", cheat_zip, cheat.name, cheat.fileSize);
+		return 0;
 	}
-	else
+
+	if (((cheat.cheatSize / cheat_unit_size) + cheats_loaded()) > cheat_max_active)
 	{
-		/* enabled cheat, load data */
-		static char filename[1024];
-		fileTYPE f = {};
+		printf("No more room in current selection for cheat file %s.\n", cheat.name);
+		return 0;
+	}
 
-		/* lazy load cheat data */
-		if (cheats[iSelectedEntry].cheatData == NULL)
-		{
-			snprintf(filename, sizeof(filename), "%s/%s", cheat_zip, cheats[iSelectedEntry].name);
-			if (FileOpen(&f, filename))
-			{
-				int len = f.size;
-				if (!len || (len % cheat_unit_size))
-				{
-					printf("Cheat file %s has incorrect length %d -> skipping.\n", filename, len);
-				}
-				else if (((len / cheat_unit_size) + cheats_loaded()) <= cheat_max_active)
-				{
-					cheats[iSelectedEntry].cheatData = new char[len];
-					if (cheats[iSelectedEntry].cheatData)
-					{
-						if (FileReadAdv(&f, cheats[iSelectedEntry].cheatData, len) == len)
-						{
-							cheats[iSelectedEntry].cheatSize = len;
-							cheats[iSelectedEntry].enabled = true;
-							changedCheats = true;
-						}
-						else
-						{
-							printf("Cannot read cheat file %s.\n", filename);
-							delete[] cheats[iSelectedEntry].cheatData;
-							cheats[iSelectedEntry].cheatData = NULL;
-							cheats[iSelectedEntry].cheatSize = 0;
-						}
-					}
-					else
-					{
-						printf("Could not allocate required memory (%d) for cheat file %s.\n", len, filename);
-					}
-				}
-				else
-				{
-					printf("No more room in current selection for cheat file %s.\n", filename);
-				}
-				FileClose(&f);
-			}
-			else
-			{
-				printf("Cannot open cheat file %s.\n", filename);
-			}
-		}
+	memcpy(packed + packed_len, cheat.data, cheat.cheatSize);
+	cheat.slot = packed_len;
+	cheat.enabled = true;
+	packed_len += cheat.cheatSize;
+	return 1;
+}
 
-		if (cheats[iSelectedEntry].cheatData)
-		{
-			cheats[iSelectedEntry].enabled = true;
-			changedCheats = true;
-		}
-	}
+static void cheat_disable(cheat_rec_t &cheat)
+{
+	int end = cheat.slot + cheat.cheatSize;
+	memmove(packed + cheat.slot, packed + end, packed_len - end);
+	packed_len -= cheat.cheatSize;
 
-	if (changedCheats)
+	for (auto &other : cheats)
 	{
-		cheats_send();
+		if (other.enabled && other.slot > cheat.slot) other.slot -= cheat.cheatSize;
 	}
+
+	cheat.slot = -1;
+	cheat.enabled = false;
+}
+
+void cheats_toggle()
+{
+	cheat_rec_t &cheat = cheats[iSelectedEntry];
+
+	if (cheat.enabled) cheat_disable(cheat);
+	else if (!cheat_enable(cheat)) return;
+
+	cheats_send();
 }
 
 int cheats_loaded()
 {
 	return loaded;
 }
+
+void cheats_prewarm()
+{
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s/cheats/%s", getRootDir(), CoreName2);
+	if (PathIsDir(dir, 0)) crc_index_update(dir);
+}
@@ -8,6 +8,7 @@ void cheats_scroll_name();
 void cheats_print();
 void cheats_toggle();
 int cheats_loaded();
+void cheats_prewarm(); // reads the CRC index of cheats/<core>
 
 void cheats_init_arcade(int unit_size, int max_active);
 void cheats_add_arcade(const char *name, const char *cheatData, int cheatSize);
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "cmd_channel.h"
+#include "scheduler.h"
+#include "input.h"
+#include "user_io.h"
+#include "menu.h"
+#include "video.h"
+#include "audio.h"
+
+#define CMD_MAX_CLIENTS 4
+
+static int listen_fd = -1;
+static int clients[CMD_MAX_CLIENTS] = { -1, -1, -1, -1 };
+
+static void cmd_listen()
+{
+	unlink(CMD_CHANNEL_PATH);
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+	{
+		printf("cmd_channel: socket failed (%d)\n", errno);
+		return;
+	}
+
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, CMD_CHANNEL_PATH);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, CMD_MAX_CLIENTS) < 0)
+	{
+		printf("cmd_channel: cannot listen on %s (%d)\n", CMD_CHANNEL_PATH, errno);
+		close(listen_fd);
+		listen_fd = -1;
+		return;
+	}
+
+	chmod(CMD_CHANNEL_PATH, 0666);
+}
+
+static void cmd_accept()
+{
+	int fd;
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		int i = 0;
+		while (i < CMD_MAX_CLIENTS && clients[i] >= 0) i++;
+		if (i == CMD_MAX_CLIENTS)
+		{
+			printf("cmd_channel: too many clients\n");
+			close(fd);
+			continue;
+		}
+		clients[i] = fd;
+	}
+}
+
+// Text commands need a zero terminated copy, the payload isn't.
+static int cmd_text(const char *prefix, const uint8_t *data, int len)
+{
+	static char cmd[1024];
+	int plen = strlen(prefix);
+	if (plen + len >= (int)sizeof(cmd)) return CMD_ERR_LENGTH;
+
+	memcpy(cmd, prefix, plen);
+	memcpy(cmd + plen, data, len);
+	cmd[plen + len] = 0;
+	if (plen + len && cmd[plen + len - 1] == '\n') cmd[plen + len - 1] = 0;
+
+	return input_cmd_exec(cmd) ? CMD_OK : CMD_ERR_UNKNOWN;
+}
+
+static int cmd_run(uint16_t op, const uint8_t *data, int len, uint8_t *out, int out_max, int *out_len)
+{
+	*out_len = 0;
+
+	switch (op)
+	{
+	case CMD_OP_NOP:
+		return CMD_OK;
+
+	case CMD_OP_TEXT:
+		return cmd_text("", data, len);
+
+	case CMD_OP_FB:
+		return cmd_text("fb_cmd", data, len);
+
+	case CMD_OP_LOAD_CORE:
+		return cmd_text("load_core ", data, len);
+
+	case CMD_OP_VOLUME:
+		if (len != 1 || (data[0] > 7 && data[0] != 0x80 && data[0] != 0x81)) return CMD_ERR_LENGTH;
+		set_volume((data[0] & 0x80) ? data[0] : (0x40 | data[0]));
+		return CMD_OK;
+
+	case CMD_OP_STATUS:
+		{
+			if (out_max < (int)sizeof(cmd_status_t)) return CMD_ERR_LENGTH;
+
+			cmd_status_t *st = (cmd_status_t*)out;
+			memset(st, 0, sizeof(cmd_status_t));
+			st->version = CMD_CHANNEL_VERSION;
+			st->menu = is_menu();
+			st->fb = video_fb_state() ? 1 : 0;
+			st->osd = (user_io_osd_is_visible() || menu_present()) ? 1 : 0;
+			strncpy(st->core, user_io_get_core_name(), sizeof(st->core) - 1);
+			*out_len = sizeof(cmd_status_t);
+		}
+		return CMD_OK;
+	}
+
+	return CMD_ERR_UNKNOWN;
+}
+
+static void cmd_batch(int fd, const uint8_t *in, int len)
+{
+	static uint8_t out[CMD_CHANNEL_MAX];
+
+	if (len < (int)sizeof(cmd_batch_t)) return;
+
+	const cmd_batch_t *hdr = (const cmd_batch_t*)in;
+	if (hdr->magic != CMD_CHANNEL_MAGIC) return;
+
+	cmd_batch_t *rhdr = (cmd_batch_t*)out;
+	rhdr->magic = CMD_CHANNEL_MAGIC;
+	rhdr->version = CMD_CHANNEL_VERSION;
+	rhdr->seq = hdr->seq;
+	rhdr->count = 0;
+	int pos = sizeof(cmd_batch_t);
+	int opos = sizeof(cmd_batch_t);
+
+	for (int i = 0; i < hdr->count; i++)
+	{
+		if (opos + (int)sizeof(cmd_reply_t) > CMD_CHANNEL_MAX) break;
+		cmd_reply_t *rep = (cmd_reply_t*)(out + opos);
+		opos += sizeof(cmd_reply_t);
+		memset(rep, 0, sizeof(cmd_reply_t));
+		rhdr->count++;
+
+		if (hdr->version != CMD_CHANNEL_VERSION)
+		{
+			rep->status = CMD_ERR_VERSION;
+			break;
+		}
+
+		if (pos + (int)sizeof(cmd_rec_t) > len)
+		{
+			rep->status = CMD_ERR_LENGTH;
+			break;
+		}
+
+		const cmd_rec_t *rec = (const cmd_rec_t*)(in + pos);
+		pos += sizeof(cmd_rec_t);
+		rep->op = rec->op;
+		if (pos + rec->len > len)
+		{
+			rep->status = CMD_ERR_LENGTH;
+			break;
+		}
+
+		int out_len = 0;
+		rep->status = cmd_run(rec->op, in + pos, rec->len, out + opos, CMD_CHANNEL_MAX - opos, &out_len);
+		rep->len = out_len;
+		opos += (out_len + 3) & ~3;
+		pos += (rec->len + 3) & ~3;
+
+		// a batch may hold many commands, let input and FPGA servicing in between
+		scheduler_yield();
+	}
+
+	if (send(fd, out, opos, MSG_NOSIGNAL) < 0 && errno != EAGAIN) printf("cmd_channel: reply failed (%d)\n", errno);
+}
+
+void cmd_channel_task(void)
+{
+	static uint8_t in[CMD_CHANNEL_MAX];
+
+	cmd_listen();
+
+	for (;;)
+	{
+		if (listen_fd >= 0)
+		{
+			cmd_accept();
+
+			for (int i = 0; i < CMD_MAX_CLIENTS; i++)
+			{
+				if (clients[i] < 0) continue;
+
+				int len;
+				while ((len = recv(clients[i], in, sizeof(in), 0)) > 0)
+				{
+					scheduler_activity();
+					cmd_batch(clients[i], in, len);
+				}
+
+				if (!len || (errno != EAGAIN && errno != EWOULDBLOCK))
+				{
+					close(clients[i]);
+					clients[i] = -1;
+				}
+			}
+		}
+
+		scheduler_yield();
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef CMD_CHANNEL_H
+#define CMD_CHANNEL_H
+
+#include <inttypes.h>
+
+// Binary command channel for external frontends, next to the text FIFO.
+// SOCK_SEQPACKET socket at CMD_CHANNEL_PATH, every packet is one batch:
+// a cmd_batch_t header followed by count records. Each record is a
+// cmd_rec_t header and len bytes of payload, padded to 4 bytes.
+// Every batch gets one reply with the same seq and a cmd_reply_t
+// (plus payload) for each record, in order.
+// All values are little endian.
+
+#define CMD_CHANNEL_PATH    "/dev/MiSTer_cmd.sock"
+#define CMD_CHANNEL_MAGIC   0x444D434D // "MCMD"
+#define CMD_CHANNEL_VERSION 1
+#define CMD_CHANNEL_MAX     8192       // max packet size, both ways
+
+enum
+{
+	CMD_OP_NOP = 0,     // ping
+	CMD_OP_TEXT,        // any MiSTer_cmd text command, without newline
+	CMD_OP_FB,          // fb_cmd arguments, as for the text command
+	CMD_OP_LOAD_CORE,   // path of rbf/mra/mgl
+	CMD_OP_VOLUME,      // 1 byte: level 0-7 as "volume N", 0x80 unmute, 0x81 mute
+	CMD_OP_STATUS       // reply payload is cmd_status_t
+};
+
+enum
+{
+	CMD_OK = 0,
+	CMD_ERR_UNKNOWN = -1, // unknown op or text command
+	CMD_ERR_LENGTH = -2,  // payload too short/long or record past the end of the packet
+	CMD_ERR_VERSION = -3  // batch version not supported, nothing was run
+};
+
+struct cmd_batch_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	uint32_t seq;
+} __attribute__((packed));
+
+struct cmd_rec_t
+{
+	uint16_t op;
+	uint16_t len;
+} __attribute__((packed));
+
+struct cmd_reply_t
+{
+	uint16_t op;
+	int16_t  status;
+	uint16_t len;
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct cmd_status_t
+{
+	uint16_t version;
+	uint8_t  menu;       // menu core running
+	uint8_t  fb;         // linux framebuffer shown
+	uint8_t  osd;        // OSD visible
+	uint8_t  reserved[3];
+	char     core[32];
+} __attribute__((packed));
+
+// scheduler task, accepts clients and runs their batches
+void cmd_channel_task(void);
+
+#endif
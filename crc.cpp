@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+#include "profiling.h"
+#include "miniz.h"
+
+struct crc_tables
+{
+	uint32_t crc32[8][256];
+	uint32_t edc[8][256];
+	uint16_t ccitt[256];
+	uint16_t td0[256];
+
+	crc_tables()
+	{
+		reflected(crc32, 0xEDB88320);
+		reflected(edc, 0xD8018001);
+		msb16(ccitt, 0x1021);
+		msb16(td0, 0xA097);
+	}
+
+	static void reflected(uint32_t t[8][256], uint32_t poly)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? poly : 0);
+			t[0][i] = c;
+		}
+
+		for (int i = 0; i < 256; i++)
+		{
+			for (int k = 1; k < 8; k++) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+		}
+	}
+
+	static void msb16(uint16_t *t, uint16_t poly)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			uint16_t c = i << 8;
+			for (int j = 0; j < 8; j++) c = (c & 0x8000) ? ((c << 1) ^ poly) : (c << 1);
+			t[i] = c;
+		}
+	}
+};
+
+// Built on first use, thread safe
+static const crc_tables &tables()
+{
+	static const crc_tables t;
+	return t;
+}
+
+static uint32_t slice8(const uint32_t t[8][256], uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len && ((uintptr_t)p & 3); len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		// little endian words
+		uint32_t a, b;
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		a ^= crc;
+		crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF] ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24] ^
+			t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF] ^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+	}
+
+	for (; len; len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+static uint16_t table16(const uint16_t *t, uint16_t crc, const uint8_t *p, size_t len)
+{
+	for (; len; len--) crc = (crc << 8) ^ t[((crc >> 8) ^ *p++) & 0xFF];
+	return crc;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	return ~slice8(tables().crc32, ~crc, (const uint8_t*)buf, len);
+}
+
+uint32_t crc_edc(uint32_t crc, const void *buf, size_t len)
+{
+	return slice8(tables().edc, crc, (const uint8_t*)buf, len);
+}
+
+uint16_t crc16_ccitt(uint16_t crc, const void *buf, size_t len)
+{
+	return table16(tables().ccitt, crc, (const uint8_t*)buf, len);
+}
+
+uint16_t crc16_td0(uint16_t crc, const void *buf, size_t len)
+{
+	return table16(tables().td0, crc, (const uint8_t*)buf, len);
+}
+
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *p, size_t len, uint16_t poly)
+{
+	for (; len; len--)
+	{
+		crc ^= *p++ << 8;
+		for (int j = 0; j < 8; j++) crc = (crc & 0x8000) ? ((crc << 1) ^ poly) : (crc << 1);
+	}
+	return crc;
+}
+
+static uint32_t edc_bitwise(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len; len--)
+	{
+		crc ^= *p++;
+		for (int j = 0; j < 8; j++) crc = (crc >> 1) ^ ((crc & 1) ? 0xD8018001 : 0);
+	}
+	return crc;
+}
+
+void crc_benchmark()
+{
+	const size_t size = 4 * 1024 * 1024;
+	uint8_t *buf = (uint8_t*)malloc(size);
+	if (!buf) return;
+
+	uint32_t r = 0x43524331;
+	for (size_t i = 0; i < size; i++)
+	{
+		r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+		buf[i] = (uint8_t)r;
+	}
+
+	tables();
+
+	for (int test = 0; test < 8; test++)
+	{
+		static const char *names[] = { "crc32", "crc32_miniz", "edc", "edc_bitwise", "ccitt", "ccitt_bitwise", "td0", "td0_bitwise" };
+
+		// the bitwise versions are slow, use less data so the run stays short
+		size_t len = (test & 1) && test > 1 ? size / 8 : size;
+		uint64_t t = trace_now_us();
+		uint32_t res = 0;
+		switch (test)
+		{
+		case 0: res = crc32_update(0, buf, len); break;
+		case 1: res = mz_crc32(0, buf, len); break;
+		case 2: res = crc_edc(0, buf, len); break;
+		case 3: res = edc_bitwise(0, buf, len); break;
+		case 4: res = crc16_ccitt(0xFFFF, buf, len); break;
+		case 5: res = crc16_bitwise(0xFFFF, buf, len, 0x1021); break;
+		case 6: res = crc16_td0(0, buf, len); break;
+		case 7: res = crc16_bitwise(0, buf, len, 0xA097); break;
+		}
+		uint64_t us = trace_now_us() - t;
+		if (!us) us = 1;
+
+		// the reference must agree on the same data
+		uint32_t check = res;
+		if (test & 1)
+		{
+			switch (test)
+			{
+			case 1: check = crc32_update(0, buf, len); break;
+			case 3: check = crc_edc(0, buf, len); break;
+			case 5: check = crc16_ccitt(0xFFFF, buf, len); break;
+			case 7: check = crc16_td0(0, buf, len); break;
+			}
+		}
+
+		uint64_t rate = (uint64_t)len * 100 / us; // 0.01 MB/s
+		printf("CRC %-13s: %08X in %llu us, %llu.%02llu MB/s%s\n", names[test], res, us, rate / 100, rate % 100,
+			(check != res) ? " MISMATCH" : "");
+	}
+
+	free(buf);
+}
@@ -0,0 +1,25 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksums used for ROM, disk and CD image identification.
+// All of them can be chained: pass the previous result to continue over another buffer.
+
+// CRC32 (zlib/zip), slicing by 8. Start with 0.
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+// CD sector EDC (CRC32, polynomial 0xD8018001, no inversion), slicing by 8. Start with 0.
+uint32_t crc_edc(uint32_t crc, const void *buf, size_t len);
+
+// CRC16-CCITT (polynomial 0x1021, MSB first, no final xor). Floppy address/data marks start with 0xFFFF.
+uint16_t crc16_ccitt(uint16_t crc, const void *buf, size_t len);
+
+// Teledisk CRC16 (polynomial 0xA097, MSB first). Start with 0.
+uint16_t crc16_td0(uint16_t crc, const void *buf, size_t len);
+
+// Throughput against the plain implementations, run with "echo crc_bench > /dev/MiSTer_cmd".
+void crc_benchmark();
+
+#endif
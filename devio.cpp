@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <string>
+#include <deque>
+
+#include "devio.h"
+#include "profiling.h"
+
+struct devio_job_t
+{
+	std::string tag;
+	std::function<void()> work;
+};
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cond_idle = PTHREAD_COND_INITIALIZER;
+static std::deque<devio_job_t> jobs;
+static int busy = 0;
+static int started = 0;
+
+static void *devio_thread(void *)
+{
+	trace_thread_name("devio");
+
+	pthread_mutex_lock(&lock);
+	while (1)
+	{
+		while (jobs.empty()) pthread_cond_wait(&cond_work, &lock);
+
+		devio_job_t job = std::move(jobs.front());
+		jobs.pop_front();
+		busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		{
+			TRACE_SCOPE("devio");
+			job.work();
+		}
+
+		pthread_mutex_lock(&lock);
+		busy = 0;
+		if (jobs.empty()) pthread_cond_broadcast(&cond_idle);
+	}
+
+	return NULL;
+}
+
+static int devio_start()
+{
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	started = !pthread_create(&thread, &attr, devio_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (!started) printf("devio: cannot start the worker, device writes are done directly\n");
+	return started;
+}
+
+void devio_queue(const char *tag, std::function<void()> work)
+{
+	if (!started && !devio_start())
+	{
+		work();
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	bool replaced = false;
+	if (tag && tag[0])
+	{
+		for (auto &job : jobs)
+		{
+			if (job.tag == tag)
+			{
+				job.work = std::move(work);
+				replaced = true;
+				break;
+			}
+		}
+	}
+
+	if (!replaced)
+	{
+		jobs.push_back({ tag ? tag : "", std::move(work) });
+		pthread_cond_signal(&cond_work);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void devio_write_attr(const char *path, int value)
+{
+	std::string p = path;
+	devio_queue(path, [p, value]()
+	{
+		FILE *f = fopen(p.c_str(), "w");
+		if (f)
+		{
+			fprintf(f, "%d", value);
+			fclose(f);
+		}
+	});
+}
+
+void devio_sync()
+{
+	if (!started) return;
+
+	pthread_mutex_lock(&lock);
+	while (busy || !jobs.empty()) pthread_cond_wait(&cond_idle, &lock);
+	pthread_mutex_unlock(&lock);
+}
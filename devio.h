@@ -0,0 +1,22 @@
+#ifndef DEVIO_H
+#define DEVIO_H
+
+#include <functional>
+
+// Device I/O worker.
+// Writes to the input devices and their sysfs attributes (LEDs, rumble
+// effects, wheel range) can block for a while on USB and Bluetooth devices,
+// so the main thread queues them here. They run in order on one thread off
+// core #1. A job queued with the tag of one still waiting replaces it, so
+// only the latest state of a LED or rumble motor gets written.
+
+// tag: NULL or "" for a job that's never replaced.
+void devio_queue(const char *tag, std::function<void()> work);
+
+// Queues a write of the value ("%d") to the sysfs attribute at path.
+void devio_write_attr(const char *path, int value);
+
+// Waits until everything queued is done, needed before a device is closed.
+void devio_sync();
+
+#endif
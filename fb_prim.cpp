@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "fb_prim.h"
+
+void fbp_fill(uint32_t *dst, int count, uint32_t color)
+{
+#ifdef __ARM_NEON
+	uint32x4_t c = vdupq_n_u32(color);
+	while (count >= 16)
+	{
+		vst1q_u32(dst, c);
+		vst1q_u32(dst + 4, c);
+		vst1q_u32(dst + 8, c);
+		vst1q_u32(dst + 12, c);
+		dst += 16;
+		count -= 16;
+	}
+#endif
+
+	while (count-- > 0) *dst++ = color;
+}
+
+void fbp_fill_rect(uint32_t *dst, int stride, int width, int height, uint32_t color)
+{
+	if (width == stride)
+	{
+		fbp_fill(dst, width * height, color);
+		return;
+	}
+
+	for (int y = 0; y < height; y++) fbp_fill(dst + y * stride, width, color);
+}
+
+void fbp_copy(uint32_t *dst, const uint32_t *src, int count)
+{
+#ifdef __ARM_NEON
+	while (count >= 16)
+	{
+		uint32x4_t a = vld1q_u32(src);
+		uint32x4_t b = vld1q_u32(src + 4);
+		uint32x4_t c = vld1q_u32(src + 8);
+		uint32x4_t d = vld1q_u32(src + 12);
+		vst1q_u32(dst, a);
+		vst1q_u32(dst + 4, b);
+		vst1q_u32(dst + 8, c);
+		vst1q_u32(dst + 12, d);
+		src += 16;
+		dst += 16;
+		count -= 16;
+	}
+#endif
+
+	if (count > 0) memcpy(dst, src, count * 4);
+}
+
+void fbp_gray(uint32_t *dst, const uint8_t *gray, int count, uint32_t mask)
+{
+#ifdef __ARM_NEON
+	uint32x4_t m = vdupq_n_u32(mask);
+	while (count >= 8)
+	{
+		uint16x8_t g = vmovl_u8(vld1_u8(gray));
+		uint32x4_t lo = vmulq_n_u32(vmovl_u16(vget_low_u16(g)), 0x010101);
+		uint32x4_t hi = vmulq_n_u32(vmovl_u16(vget_high_u16(g)), 0x010101);
+		vst1q_u32(dst, vandq_u32(lo, m));
+		vst1q_u32(dst + 4, vandq_u32(hi, m));
+		gray += 8;
+		dst += 8;
+		count -= 8;
+	}
+#endif
+
+	while (count-- > 0) *dst++ = (*gray++ * 0x010101) & mask;
+}
+
+// (s * a + d * (255 - a) + 128) / 256 per color channel, alpha of dst stays
+static inline uint32_t blend_px(uint32_t d, uint32_t s)
+{
+	uint32_t a = s >> 24;
+	uint32_t ia = 255 - a;
+	uint32_t out = d & 0xFF000000;
+	for (int sh = 0; sh < 24; sh += 8)
+	{
+		out |= ((((s >> sh) & 0xFF) * a + ((d >> sh) & 0xFF) * ia + 128) >> 8) << sh;
+	}
+	return out;
+}
+
+void fbp_blend(uint32_t *dst, const uint32_t *src, int count)
+{
+#ifdef __ARM_NEON
+	while (count >= 8)
+	{
+		uint8x8x4_t s = vld4_u8((const uint8_t*)src);
+		uint8x8x4_t d = vld4_u8((const uint8_t*)dst);
+		uint8x8_t ia = vmvn_u8(s.val[3]);
+		for (int c = 0; c < 3; c++)
+		{
+			d.val[c] = vrshrn_n_u16(vmlal_u8(vmull_u8(s.val[c], s.val[3]), d.val[c], ia), 8);
+		}
+		vst4_u8((uint8_t*)dst, d);
+		src += 8;
+		dst += 8;
+		count -= 8;
+	}
+#endif
+
+	while (count-- > 0)
+	{
+		*dst = blend_px(*dst, *src++);
+		dst++;
+	}
+}
+
+void fbp_blend_color(uint32_t *dst, int count, uint32_t color)
+{
+#ifdef __ARM_NEON
+	uint8x8_t ia = vdup_n_u8(255 - (color >> 24));
+	uint16x8_t sa[3];
+	for (int c = 0; c < 3; c++) sa[c] = vdupq_n_u16(((color >> (c * 8)) & 0xFF) * (color >> 24));
+
+	while (count >= 8)
+	{
+		uint8x8x4_t d = vld4_u8((const uint8_t*)dst);
+		for (int c = 0; c < 3; c++) d.val[c] = vrshrn_n_u16(vmlal_u8(sa[c], d.val[c], ia), 8);
+		vst4_u8((uint8_t*)dst, d);
+		dst += 8;
+		count -= 8;
+	}
+#endif
+
+	while (count-- > 0)
+	{
+		*dst = blend_px(*dst, color);
+		dst++;
+	}
+}
+
+void fbp_scale_nearest(uint32_t *dst, int dst_stride, int dst_w, int dst_h,
+	const uint32_t *src, int src_stride, int src_w, int src_h)
+{
+	if (dst_w < 1 || dst_h < 1 || src_w < 1 || src_h < 1) return;
+
+	uint32_t *line = (uint32_t*)malloc(dst_w * 4);
+	if (!line) return;
+
+	uint32_t step_x = ((uint32_t)src_w << 16) / dst_w;
+	uint32_t step_y = ((uint32_t)src_h << 16) / dst_h;
+
+	uint32_t sy = step_y / 2;
+	const uint32_t *prev = 0;
+	for (int y = 0; y < dst_h; y++, sy += step_y)
+	{
+		const uint32_t *s = src + (sy >> 16) * src_stride;
+
+		// upscaled rows repeat
+		if (s != prev)
+		{
+			uint32_t sx = step_x / 2;
+			for (int x = 0; x < dst_w; x++, sx += step_x) line[x] = s[sx >> 16];
+			prev = s;
+		}
+
+		fbp_copy(dst + y * dst_stride, line, dst_w);
+	}
+
+	free(line);
+}
+
+// f is 0..256, two channels per multiply
+static inline uint32_t lerp_px(uint32_t a, uint32_t b, uint32_t f)
+{
+	uint32_t rb = ((((a & 0x00FF00FF) * (256 - f)) + ((b & 0x00FF00FF) * f)) >> 8) & 0x00FF00FF;
+	uint32_t ag = ((((a >> 8) & 0x00FF00FF) * (256 - f)) + (((b >> 8) & 0x00FF00FF) * f)) & 0xFF00FF00;
+	return rb | ag;
+}
+
+// sample positions at pixel centers, 24.8 fixed point
+static int bilinear_pos(int i, int src, int dst, int *frac)
+{
+	int p = (int)((((int64_t)i * 2 + 1) * src * 256) / (dst * 2)) - 128;
+	if (p < 0) p = 0;
+	if (p > (src - 1) * 256) p = (src - 1) * 256;
+	*frac = p & 0xFF;
+	return p >> 8;
+}
+
+void fbp_scale_bilinear(uint32_t *dst, int dst_stride, int dst_w, int dst_h,
+	const uint32_t *src, int src_stride, int src_w, int src_h)
+{
+	if (dst_w < 1 || dst_h < 1 || src_w < 1 || src_h < 1) return;
+
+	uint32_t *line = (uint32_t*)malloc(dst_w * 4 + dst_w * 2 * sizeof(int));
+	if (!line) return;
+
+	int *xs = (int*)(line + dst_w);
+	for (int x = 0; x < dst_w; x++) xs[x * 2] = bilinear_pos(x, src_w, dst_w, &xs[x * 2 + 1]);
+
+	for (int y = 0; y < dst_h; y++)
+	{
+		int fy;
+		int sy = bilinear_pos(y, src_h, dst_h, &fy);
+		const uint32_t *s0 = src + sy * src_stride;
+		const uint32_t *s1 = (sy + 1 < src_h) ? s0 + src_stride : s0;
+
+		for (int x = 0; x < dst_w; x++)
+		{
+			int sx = xs[x * 2];
+			int fx = xs[x * 2 + 1];
+			int sx1 = (sx + 1 < src_w) ? sx + 1 : sx;
+			uint32_t top = lerp_px(s0[sx], s0[sx1], fx);
+			uint32_t bot = lerp_px(s1[sx], s1[sx1], fx);
+			line[x] = lerp_px(top, bot, fy);
+		}
+
+		fbp_copy(dst + y * dst_stride, line, dst_w);
+	}
+
+	free(line);
+}
+
+void fbp_from_565(uint32_t *dst, const uint16_t *src, int count)
+{
+#ifdef __ARM_NEON
+	uint32x4_t a = vdupq_n_u32(0xFF000000);
+	while (count >= 4)
+	{
+		uint32x4_t c = vmovl_u16(vld1_u16(src));
+		uint32x4_t r = vshlq_n_u32(vandq_u32(c, vdupq_n_u32(0xF800)), 8);
+		uint32x4_t g = vshlq_n_u32(vandq_u32(c, vdupq_n_u32(0x07E0)), 5);
+		uint32x4_t b = vshlq_n_u32(vandq_u32(c, vdupq_n_u32(0x001F)), 3);
+		vst1q_u32(dst, vorrq_u32(vorrq_u32(a, r), vorrq_u32(g, b)));
+		src += 4;
+		dst += 4;
+		count -= 4;
+	}
+#endif
+
+	while (count-- > 0)
+	{
+		uint16_t c = *src++;
+		*dst++ = 0xFF000000 | ((c & 0xF800) << 8) | ((c & 0x07E0) << 5) | ((c & 0x001F) << 3);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef FB_PRIM_H
+#define FB_PRIM_H
+
+#include <stdint.h>
+
+// Pixel primitives for the HPS frame buffers and images drawn into them.
+// Pixels are 32-bit ARGB as Imlib2 keeps them, strides are in pixels. The
+// frame buffers are mapped uncached, so the loops store in wide bursts (NEON
+// where available) and patterns are better built in a cached line first and
+// then copied out.
+
+void fbp_fill(uint32_t *dst, int count, uint32_t color);
+void fbp_fill_rect(uint32_t *dst, int stride, int width, int height, uint32_t color);
+void fbp_copy(uint32_t *dst, const uint32_t *src, int count);
+
+// Gray levels to colors, each level goes to the channels set in mask
+// (0x0000FF blue, 0x00FF00 green, 0xFF0000 red).
+void fbp_gray(uint32_t *dst, const uint8_t *gray, int count, uint32_t mask);
+
+// Source over destination by the source alpha.
+void fbp_blend(uint32_t *dst, const uint32_t *src, int count);
+void fbp_blend_color(uint32_t *dst, int count, uint32_t color);
+
+void fbp_scale_nearest(uint32_t *dst, int dst_stride, int dst_w, int dst_h,
+	const uint32_t *src, int src_stride, int src_w, int src_h);
+void fbp_scale_bilinear(uint32_t *dst, int dst_stride, int dst_w, int dst_h,
+	const uint32_t *src, int src_stride, int src_w, int src_h);
+
+// RGB565 (preview tiles) to opaque ARGB.
+void fbp_from_565(uint32_t *dst, const uint16_t *src, int count);
+
+#endif
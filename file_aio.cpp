@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#include "file_aio.h"
+#include "file_io.h"
+#include "profiling.h"
+
+#if defined(IORING_OFF_SQES) && defined(__NR_io_uring_setup)
+#define AIO_URING 1
+#endif
+
+#define AIO_ENTRIES 64
+
+static int aio_init_done = 0;
+
+#ifdef AIO_URING
+
+struct aio_ring_t
+{
+	int fd = -1;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned cq_entries;
+	struct io_uring_cqe *cqes;
+	unsigned inflight;   // submitted and not reaped yet
+	unsigned unsubmitted; // in the SQ ring, not taken by the kernel yet
+};
+
+static aio_ring_t ring;
+
+static int ring_setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = syscall(__NR_io_uring_setup, AIO_ENTRIES, &p);
+	if (fd < 0) return 0;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cq_size > sq_size) sq_size = cq_size;
+
+	uint8_t *sq = (uint8_t *)mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+
+	uint8_t *cq = sq;
+	if (!single)
+	{
+		cq = (uint8_t *)mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+		{
+			munmap(sq, sq_size);
+			close(fd);
+			return 0;
+		}
+	}
+
+	void *sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		if (!single) munmap(cq, cq_size);
+		munmap(sq, sq_size);
+		close(fd);
+		return 0;
+	}
+
+	ring.fd = fd;
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.sqes = (struct io_uring_sqe *)sqes;
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cq_entries = p.cq_entries;
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 1;
+}
+
+static int ring_enter(unsigned submit, unsigned wait)
+{
+	int ret = syscall(__NR_io_uring_enter, ring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0) return -errno;
+	return ret;
+}
+
+// hands the queued entries to the kernel, some may stay if it's busy
+static void ring_flush()
+{
+	if (!ring.unsubmitted) return;
+	int ret = ring_enter(ring.unsubmitted, 0);
+	if (ret > 0) ring.unsubmitted -= ((unsigned)ret > ring.unsubmitted) ? ring.unsubmitted : ret;
+}
+
+static void ring_reap()
+{
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) return;
+
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		file_aio_t *req = (file_aio_t *)(uintptr_t)cqe->user_data;
+		req->result = cqe->res;
+		req->state = FILE_AIO_DONE;
+		ring.inflight--;
+		head++;
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int ring_submit(file_aio_t *req, int fd, uint64_t pos, int write)
+{
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring.sq_tail;
+	if (tail - head >= ring.sq_entries || ring.inflight >= ring.cq_entries) return 0;
+
+	unsigned idx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+	sqe->len = 1;
+	sqe->off = pos;
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	ring.sq_array[idx] = idx;
+
+	req->state = FILE_AIO_PENDING;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.inflight++;
+	ring.unsubmitted++;
+	ring_flush();
+	return 1;
+}
+
+#endif
+
+static void aio_init()
+{
+	if (aio_init_done) return;
+	aio_init_done = 1;
+#ifdef AIO_URING
+	if (!ring_setup()) printf("file_aio: io_uring not available, using threads.\n");
+#endif
+}
+
+const char *file_aio_backend()
+{
+	aio_init();
+#ifdef AIO_URING
+	if (ring.fd >= 0) return "io_uring";
+#endif
+	return "threads";
+}
+
+static int aio_submit(file_aio_t *req, int fd, void *buf, uint32_t size, uint64_t pos, int write)
+{
+	if (fd < 0 || req->state == FILE_AIO_PENDING) return 0;
+	aio_init();
+
+	req->iov.iov_base = buf;
+	req->iov.iov_len = size;
+	req->result = 0;
+	req->job = OffloadHandle();
+
+#ifdef AIO_URING
+	if (ring.fd >= 0 && ring_submit(req, fd, pos, write)) return 1;
+#endif
+
+	// no io_uring or its ring is full
+	req->job = offload_try_submit([req, fd, buf, size, pos, write]()
+	{
+		TRACE_SCOPE("file_aio");
+		ssize_t ret = write ? pwrite(fd, buf, size, pos) : pread(fd, buf, size, pos);
+		req->result = (ret < 0) ? -errno : ret;
+	});
+
+	if (!req->job.valid()) return 0;
+	req->state = FILE_AIO_PENDING;
+	return 1;
+}
+
+int file_aio_read(file_aio_t *req, int fd, void *buf, uint32_t size, uint64_t pos)
+{
+	return aio_submit(req, fd, buf, size, pos, 0);
+}
+
+int file_aio_write(file_aio_t *req, int fd, const void *buf, uint32_t size, uint64_t pos)
+{
+	return aio_submit(req, fd, (void *)buf, size, pos, 1);
+}
+
+static int file_plain(fileTYPE *f)
+{
+	return f->filp && !f->zip && !f->zst && !f->ovl;
+}
+
+int FileReadAsync(file_aio_t *req, fileTYPE *f, void *buf, uint32_t size, uint64_t pos)
+{
+	if (!file_plain(f)) return 0;
+	return file_aio_read(req, fileno(f->filp), buf, size, pos);
+}
+
+int FileWriteAsync(file_aio_t *req, fileTYPE *f, const void *buf, uint32_t size, uint64_t pos)
+{
+	if (!file_plain(f) || f->mode == O_RDONLY) return 0;
+
+	// stdio may hold data of its own for the file
+	fflush(f->filp);
+	return file_aio_write(req, fileno(f->filp), buf, size, pos);
+}
+
+int file_aio_done(file_aio_t *req)
+{
+	if (req->state != FILE_AIO_PENDING) return 1;
+
+	if (req->job.valid())
+	{
+		if (!req->job.done()) return 0;
+		req->job = OffloadHandle();
+		req->state = FILE_AIO_DONE;
+		return 1;
+	}
+
+#ifdef AIO_URING
+	ring_flush();
+	ring_reap();
+#endif
+	return req->state != FILE_AIO_PENDING;
+}
+
+int file_aio_wait(file_aio_t *req)
+{
+	if (req->state == FILE_AIO_IDLE) return 0;
+
+	if (req->job.valid())
+	{
+		req->job.wait();
+		req->job = OffloadHandle();
+	}
+#ifdef AIO_URING
+	else
+	{
+		while (req->state == FILE_AIO_PENDING)
+		{
+			ring_flush();
+			ring_reap();
+			if (req->state != FILE_AIO_PENDING) break;
+
+			int ret = ring_enter(ring.unsubmitted, 1);
+			if (ret >= 0) ring.unsubmitted -= ((unsigned)ret > ring.unsubmitted) ? ring.unsubmitted : ret;
+			else if (ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+			{
+				printf("file_aio: io_uring_enter failed (%d).\n", ret);
+				req->result = ret;
+				break;
+			}
+		}
+	}
+#endif
+
+	req->state = FILE_AIO_IDLE;
+	return req->result;
+}
+
+void file_aio_poll()
+{
+#ifdef AIO_URING
+	if (ring.fd < 0 || !ring.inflight) return;
+	ring_flush();
+	ring_reap();
+#endif
+}
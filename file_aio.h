@@ -0,0 +1,53 @@
+#ifndef FILE_AIO_H
+#define FILE_AIO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "offload.h"
+
+struct fileTYPE;
+
+// Asynchronous positional reads and writes. Requests run in the background
+// through io_uring where the kernel has it, on the offload workers otherwise.
+// Submits, polls and waits are for the main thread (and its coroutines) only.
+// A request must stay in place until it's done or waited for, the buffer
+// belongs to it meanwhile.
+
+enum
+{
+	FILE_AIO_IDLE = 0,
+	FILE_AIO_PENDING,
+	FILE_AIO_DONE
+};
+
+struct file_aio_t
+{
+	int state;
+	int result;         // bytes transferred or -errno, once done
+	struct iovec iov;
+	OffloadHandle job;  // without io_uring
+};
+
+// Returns 0 if the request couldn't be submitted.
+int file_aio_read(file_aio_t *req, int fd, void *buf, uint32_t size, uint64_t pos);
+int file_aio_write(file_aio_t *req, int fd, const void *buf, uint32_t size, uint64_t pos);
+
+// The same on an open file, 0 if it isn't a plain file (zip, zst, overlay),
+// its FileReadAdv/FileWriteAdv and offset stay as they are.
+int FileReadAsync(file_aio_t *req, fileTYPE *f, void *buf, uint32_t size, uint64_t pos);
+int FileWriteAsync(file_aio_t *req, fileTYPE *f, const void *buf, uint32_t size, uint64_t pos);
+
+// Never blocks.
+int file_aio_done(file_aio_t *req);
+// Blocks until the request is done and returns its result (0 for an idle
+// request), the request is idle again after it.
+int file_aio_wait(file_aio_t *req);
+
+// Collects finished requests, called from the scheduler.
+void file_aio_poll();
+
+// "io_uring" or "threads"
+const char *file_aio_backend();
+
+#endif
@@ -14,11 +14,17 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/inotify.h>
 #include <linux/magic.h>
 #include <algorithm>
 #include <vector>
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <atomic>
 #include "lib/miniz/miniz.h"
 #include "osd.h"
 #include "fpga_io.h"
@@ -32,13 +38,19 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "memtrack.h"
+#include "watchdog.h"
+#include "hardware.h"
+#include "offload.h"
+#include "cfg_store.h"
+#include "zstd.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
 typedef std::vector<direntext_t> DirentVector;
 typedef std::set<std::string> DirNameSet;
 
-static const size_t YieldIterations = 128;
+static const size_t YieldIterations = 32; // budget is checked every N items
 
 DirentVector DirItem;
 DirNameSet DirNames;
@@ -47,23 +59,266 @@ DirNameSet DirNames;
 // Directory scanning can cause the same zip file to be opened multiple times
 // due to testing file types to adjust the path
 // (and the fact the code path is shared with regular files)
-// cache the opened mz_zip_archive so we only open it once
-// this has the extra benefit that if a user is navigating through multiple directories
-// in a zip archive, the zip will only be opened once and things will be more responsive
+// Opened archives with their parsed central directory are kept in a small LRU
+// and shared by directory queries and opened files (arcade parent/clone zips,
+// cheats next to a ROM zip), so a zip is only parsed again if it changed.
+// Archives are read with pread(), so a shared archive can be read from
+// several threads.
 // ** We have to open the file outselves with open() so we can set O_CLOEXEC to prevent
 // leaking the file descriptor when the user changes cores
 
-static mz_zip_archive last_zip_archive = {};
-static int last_zip_fd = -1;
-static FILE *last_zip_cfile = NULL;
-static char last_zip_fname[256] = {};
+#define ZIP_CACHE_SIZE 4
+
+struct ZipCacheEntry
+{
+	mz_zip_archive archive;
+	int fd;
+	std::string fname;
+	time_t mtime;
+	off_t size;
+	uint32_t last_use;
+	int refs;
+	bool stale;                                  // file changed, drop when unreferenced
+	std::unordered_map<std::string, int> names;  // lowercase name -> index, built on first lookup
+	std::unordered_map<uint32_t, int> crcs;      // crc32 -> index, built on first lookup
+};
+
+static std::vector<ZipCacheEntry*> zip_cache;
+static pthread_mutex_t zip_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t zip_cache_tick = 0;
+static thread_local mz_zip_error zip_cache_error = MZ_ZIP_NO_ERROR;
+
+static size_t zip_cache_read(void *opaque, mz_uint64 ofs, void *buf, size_t n)
+{
+	ZipCacheEntry *entry = (ZipCacheEntry*)opaque;
+	ssize_t ret = pread(entry->fd, buf, n, ofs);
+	return (ret < 0) ? 0 : ret;
+}
+
+// miniz allocations of the cached archives (central directory, inflate iterators)
+// carry their size in front so they can be accounted.
+#define ZIP_ALLOC_HDR 16
+
+static void *zip_alloc(void *, size_t items, size_t size)
+{
+	size_t len = items * size;
+	uint8_t *p = (uint8_t*)malloc(len + ZIP_ALLOC_HDR);
+	if (!p) return nullptr;
+	*(size_t*)p = len;
+	mem_account(MEM_ZIP, len);
+	return p + ZIP_ALLOC_HDR;
+}
+
+static void zip_free(void *, void *address)
+{
+	if (!address) return;
+	uint8_t *p = (uint8_t*)address - ZIP_ALLOC_HDR;
+	mem_account(MEM_ZIP, -(int64_t)*(size_t*)p);
+	free(p);
+}
+
+static void *zip_realloc(void *, void *address, size_t items, size_t size)
+{
+	if (!address) return zip_alloc(nullptr, items, size);
+
+	size_t len = items * size;
+	uint8_t *p = (uint8_t*)address - ZIP_ALLOC_HDR;
+	size_t old = *(size_t*)p;
+	p = (uint8_t*)realloc(p, len + ZIP_ALLOC_HDR);
+	if (!p) return nullptr;
+	*(size_t*)p = len;
+	mem_account(MEM_ZIP, (int64_t)len - (int64_t)old);
+	return p + ZIP_ALLOC_HDR;
+}
+
+static void zip_cache_free(ZipCacheEntry *entry)
+{
+	mz_zip_reader_end(&entry->archive);
+	if (entry->fd >= 0) close(entry->fd);
+	delete entry;
+}
+
+// zip_cache_lock must be held
+static void zip_cache_trim()
+{
+	int unused = 0;
+	for (ZipCacheEntry *entry : zip_cache) if (!entry->refs) unused++;
+
+	while (unused > ZIP_CACHE_SIZE)
+	{
+		int lru = -1;
+		for (size_t i = 0; i < zip_cache.size(); i++)
+		{
+			if (!zip_cache[i]->refs && (lru < 0 || zip_cache[i]->last_use < zip_cache[lru]->last_use)) lru = i;
+		}
+
+		zip_cache_free(zip_cache[lru]);
+		zip_cache.erase(zip_cache.begin() + lru);
+		unused--;
+	}
+}
+
+// Get a referenced archive, opening it if not cached (or changed since)
+static ZipCacheEntry *zip_cache_open(const char *path, int flags)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0)
+	{
+		zip_cache_error = MZ_ZIP_FILE_NOT_FOUND;
+		return nullptr;
+	}
+
+	pthread_mutex_lock(&zip_cache_lock);
+
+	for (size_t i = 0; i < zip_cache.size(); i++)
+	{
+		ZipCacheEntry *entry = zip_cache[i];
+		if (entry->stale || strcasecmp(entry->fname.c_str(), path)) continue;
+
+		if (entry->mtime == st.st_mtime && entry->size == st.st_size)
+		{
+			entry->refs++;
+			entry->last_use = ++zip_cache_tick;
+			pthread_mutex_unlock(&zip_cache_lock);
+			return entry;
+		}
+
+		// Changed on disk
+		if (entry->refs)
+		{
+			entry->stale = true;
+		}
+		else
+		{
+			zip_cache_free(entry);
+			zip_cache.erase(zip_cache.begin() + i);
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&zip_cache_lock);
+
+	ZipCacheEntry *entry = new ZipCacheEntry();
+	mz_zip_zero_struct(&entry->archive);
+	entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (entry->fd < 0)
+	{
+		zip_cache_error = MZ_ZIP_FILE_OPEN_FAILED;
+		delete entry;
+		return nullptr;
+	}
+
+	entry->archive.m_pRead = zip_cache_read;
+	entry->archive.m_pIO_opaque = entry;
+	entry->archive.m_pAlloc = zip_alloc;
+	entry->archive.m_pFree = zip_free;
+	entry->archive.m_pRealloc = zip_realloc;
+	if (!mz_zip_reader_init(&entry->archive, st.st_size, flags))
+	{
+		zip_cache_error = mz_zip_get_last_error(&entry->archive);
+		zip_cache_free(entry);
+		return nullptr;
+	}
+
+	entry->fname = path;
+	entry->mtime = st.st_mtime;
+	entry->size = st.st_size;
+	entry->refs = 1;
+	entry->stale = false;
+
+	pthread_mutex_lock(&zip_cache_lock);
+	entry->last_use = ++zip_cache_tick;
+	zip_cache.push_back(entry);
+	zip_cache_trim();
+	pthread_mutex_unlock(&zip_cache_lock);
+
+	return entry;
+}
+
+static void zip_cache_release(ZipCacheEntry *entry)
+{
+	if (!entry) return;
+
+	pthread_mutex_lock(&zip_cache_lock);
+	if (!--entry->refs)
+	{
+		if (entry->stale)
+		{
+			zip_cache.erase(std::find(zip_cache.begin(), zip_cache.end(), entry));
+			zip_cache_free(entry);
+		}
+		else
+		{
+			zip_cache_trim();
+		}
+	}
+	pthread_mutex_unlock(&zip_cache_lock);
+}
+
+// mz_zip_reader_locate_file() through the name hash
+static int zip_cache_locate(ZipCacheEntry *entry, const char *name)
+{
+	std::string key = name;
+	for (char &c : key) c = tolower(c);
+
+	pthread_mutex_lock(&zip_cache_lock);
+	if (entry->names.empty())
+	{
+		mz_uint count = mz_zip_reader_get_num_files(&entry->archive);
+		entry->names.reserve(count);
+		for (mz_uint i = 0; i < count; i++)
+		{
+			char fname[1024];
+			if (!mz_zip_reader_get_filename(&entry->archive, i, fname, sizeof(fname))) continue;
+
+			std::string n = fname;
+			for (char &c : n) c = tolower(c);
+			entry->names.emplace(n, i);
+		}
+	}
+
+	auto it = entry->names.find(key);
+	int index = (it != entry->names.end()) ? it->second : -1;
+	pthread_mutex_unlock(&zip_cache_lock);
+
+	// Fall back to miniz for anything the plain lookup doesn't cover
+	if (index < 0) index = mz_zip_reader_locate_file(&entry->archive, name, NULL, 0);
+	return index;
+}
+
+static int zip_cache_locate_crc(ZipCacheEntry *entry, uint32_t crc32)
+{
+	pthread_mutex_lock(&zip_cache_lock);
+	if (entry->crcs.empty())
+	{
+		mz_uint count = mz_zip_reader_get_num_files(&entry->archive);
+		entry->crcs.reserve(count);
+		for (mz_uint i = 0; i < count; i++)
+		{
+			mz_zip_archive_file_stat s;
+			if (mz_zip_reader_file_stat(&entry->archive, i, &s) && !s.m_is_directory) entry->crcs.emplace(s.m_crc32, i);
+		}
+	}
+
+	auto it = entry->crcs.find(crc32);
+	int index = (it != entry->crcs.end()) ? it->second : -1;
+	pthread_mutex_unlock(&zip_cache_lock);
+	return index;
+}
+
+static const char *zip_cache_error_string()
+{
+	return mz_zip_get_error_string(zip_cache_error);
+}
+
 static char scanned_path[1024] = {};
 static int scanned_opts = 0;
 
 static int iSelectedEntry = 0;       // selected entry index
 static int iFirstEntry = 0;
 
-static char full_path[2100];
+// Per thread, so path helpers can be used off the main thread
+static thread_local char full_path[2100];
 uint8_t loadbuf[LOADBUF_SZ];
 
 fileTYPE::fileTYPE()
@@ -72,8 +327,15 @@ fileTYPE::fileTYPE()
 	mode = 0;
 	type = 0;
 	zip = 0;
+	zst = 0;
+	ovl = 0;
 	size = 0;
 	offset = 0;
+	map = 0;
+	map_offset = 0;
+	map_hint = 0;
+	map_size = 0;
+	once = -1;
 }
 
 fileTYPE::~fileTYPE()
@@ -83,1314 +345,3429 @@ fileTYPE::~fileTYPE()
 
 int fileTYPE::opened()
 {
-	return filp || zip;
+	return filp || zip || zst || ovl;
 }
 
+struct ZipStream;
+struct fileZstdArchive;
+struct fileOverlay;
+
 struct fileZipArchive
 {
-	mz_zip_archive                    archive;
+	ZipCacheEntry*                    entry;
+	mz_zip_archive*                   archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+	ZipStream*                        stream;
+};
+
+// Streaming inflate for big zipped files.
+// A worker inflates ahead into a ring buffer and keeps copies of the
+// decompressor state (checkpoints) along the way, so seeking restarts from
+// the closest checkpoint instead of the start of the file.
+
+#define ZIP_STREAM_MIN_SIZE    (1024 * 1024)
+#define ZIP_STREAM_RING        (1024 * 1024)
+#define ZIP_STREAM_CHUNK       (64 * 1024)
+#define ZIP_STREAM_CHECKPOINT  (1024 * 1024)  // initial distance, doubles when the list is full
+#define ZIP_STREAM_CHECKPOINTS 16     // each holds ~100KB of decompressor state
+
+struct ZipCheckpoint
+{
+	__off64_t offset;
+	mz_zip_reader_extract_iter_state *iter;
 };
 
+struct ZipStream
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	uint8_t *ring;
+	__off64_t size;
+	__off64_t ring_start, ring_end;   // data in the ring
+	__off64_t read_pos;               // consumer position
+	__off64_t target;                 // reposition target
+	std::atomic<uint32_t> req_gen;    // bumped by consumer to request reposition
+	uint32_t gen;                     // last completed reposition
+	bool error;
+	bool quit;
+
+	// Worker only
+	mz_zip_reader_extract_iter_state *iter;
+	__off64_t iter_pos;
+	std::vector<ZipCheckpoint> checkpoints;
+	__off64_t checkpoint_step;
+};
 
-static int OpenZipfileCached(char *path, int flags)
+static mz_zip_reader_extract_iter_state *zip_iter_clone(const mz_zip_reader_extract_iter_state *src)
 {
-  if (last_zip_fname[0] && !strcasecmp(path, last_zip_fname))
-  {
-    return 1;
-  }
+	mz_zip_archive *z = src->pZip;
+	mz_zip_reader_extract_iter_state *dst = (mz_zip_reader_extract_iter_state*)z->m_pAlloc(z->m_pAlloc_opaque, 1, sizeof(*dst));
+	if (!dst) return nullptr;
 
-  mz_zip_reader_end(&last_zip_archive);
-  mz_zip_zero_struct(&last_zip_archive);
-  if (last_zip_cfile)
-  {
-    fclose(last_zip_cfile);
-    last_zip_cfile = nullptr;
-  }
+	memcpy(dst, src, sizeof(*dst));
+	dst->pRead_buf = nullptr;
+	dst->pWrite_buf = nullptr;
 
-  last_zip_fname[0] = '\0';
-  last_zip_fd = open(path, O_RDONLY|O_CLOEXEC);
-  if (last_zip_fd < 0)
-  {
-    return 0;
-  }
+	if (src->pRead_buf && src->read_buf_size)
+	{
+		dst->pRead_buf = z->m_pAlloc(z->m_pAlloc_opaque, 1, (size_t)src->read_buf_size);
+		if (!dst->pRead_buf)
+		{
+			mz_zip_reader_extract_iter_free(dst);
+			return nullptr;
+		}
+		memcpy(dst->pRead_buf, src->pRead_buf, (size_t)src->read_buf_size);
+	}
 
-  last_zip_cfile = fdopen(last_zip_fd, "r");
-  if (!last_zip_cfile)
-  {
-    close(last_zip_fd);
-    last_zip_fd = -1;
-    return 0;
-  }
+	if (src->pWrite_buf)
+	{
+		dst->pWrite_buf = z->m_pAlloc(z->m_pAlloc_opaque, 1, TINFL_LZ_DICT_SIZE);
+		if (!dst->pWrite_buf)
+		{
+			mz_zip_reader_extract_iter_free(dst);
+			return nullptr;
+		}
+		memcpy(dst->pWrite_buf, src->pWrite_buf, TINFL_LZ_DICT_SIZE);
+	}
 
-  int mz_ret = mz_zip_reader_init_cfile(&last_zip_archive, last_zip_cfile, 0, flags);
-  if (mz_ret)
-  {
-    strncpy(last_zip_fname, path, sizeof(last_zip_fname));
-  }
-  return mz_ret;
+	return dst;
 }
 
-
-static int FileIsZipped(char* path, char** zip_path, char** file_path)
+static void zip_stream_checkpoint(ZipStream *zs)
 {
-	char* z = strcasestr(path, ".zip");
-	if (z)
-	{
-		z += 4;
-		if (!z[0]) z[1] = 0;
-		*z++ = 0;
+	if (zs->iter_pos >= zs->size) return;
+	if (zs->iter_pos < zs->checkpoints.back().offset + zs->checkpoint_step) return;
 
-		if (zip_path) *zip_path = path;
-		if (file_path) *file_path = z;
-		return 1;
+	mz_zip_reader_extract_iter_state *iter = zip_iter_clone(zs->iter);
+	if (!iter) return;
+	zs->checkpoints.push_back({ zs->iter_pos, iter });
+
+	if (zs->checkpoints.size() > ZIP_STREAM_CHECKPOINTS)
+	{
+		// Thin out, keeping the one at the start
+		std::vector<ZipCheckpoint> kept;
+		for (size_t i = 0; i < zs->checkpoints.size(); i++)
+		{
+			if (i & 1) mz_zip_reader_extract_iter_free(zs->checkpoints[i].iter);
+			else kept.push_back(zs->checkpoints[i]);
+		}
+		zs->checkpoints.swap(kept);
+		zs->checkpoint_step *= 2;
 	}
+}
 
-	return 0;
+// Inflate into buf from the worker iterator
+static size_t zip_stream_inflate(ZipStream *zs, void *buf, size_t len)
+{
+	size_t ret = mz_zip_reader_extract_iter_read(zs->iter, buf, len);
+	zs->iter_pos += ret;
+	zip_stream_checkpoint(zs);
+	return ret;
 }
 
-static char* make_fullpath(const char *path, int mode = 0)
+// Move worker iterator to target, 1 on success, 0 on error, -1 if superseded
+static int zip_stream_reposition(ZipStream *zs, __off64_t target, uint32_t gen, uint8_t *chunk)
 {
-	if (path[0] != '/')
+	const ZipCheckpoint *best = &zs->checkpoints[0];
+	for (const ZipCheckpoint &cp : zs->checkpoints)
 	{
-		sprintf(full_path, "%s/%s", (mode == -1) ? "" : getRootDir(), path);
+		if (cp.offset <= target) best = &cp;
 	}
-	else
+
+	if (target < zs->iter_pos || best->offset > zs->iter_pos)
 	{
-		sprintf(full_path, "%s",path);
+		mz_zip_reader_extract_iter_state *iter = zip_iter_clone(best->iter);
+		if (!iter) return 0;
+
+		mz_zip_reader_extract_iter_free(zs->iter);
+		zs->iter = iter;
+		zs->iter_pos = best->offset;
 	}
 
-	return full_path;
-}
+	while (zs->iter_pos < target)
+	{
+		if (zs->req_gen != gen) return -1;
 
-static int get_stmode(const char *path)
-{
-	struct stat64 st;
-	return (stat64(path, &st) < 0) ? 0 : st.st_mode;
-}
+		size_t len = MIN((__off64_t)ZIP_STREAM_CHUNK, target - zs->iter_pos);
+		if (zip_stream_inflate(zs, chunk, len) < len) return 0;
+	}
 
-struct stat64* getPathStat(const char *path)
-{
-	make_fullpath(path);
-	static struct stat64 st;
-	return (stat64(full_path, &st) >= 0) ? &st : NULL;
+	return 1;
 }
 
-static int isPathDirectory(const char *path, int use_zip = 1)
+static void *zip_stream_thread(void *arg)
 {
-	make_fullpath(path);
+	ZipStream *zs = (ZipStream*)arg;
+	uint8_t *chunk = (uint8_t*)malloc(ZIP_STREAM_CHUNK);
+	if (chunk) mem_account(MEM_ZIP, ZIP_STREAM_CHUNK);
 
-	char *zip_path, *file_path;
-	if (use_zip && FileIsZipped(full_path, &zip_path, &file_path))
+	pthread_mutex_lock(&zs->lock);
+	if (!chunk) zs->error = true;
+
+	while (!zs->quit)
 	{
-		if (!*file_path)
+		if (zs->req_gen != zs->gen)
 		{
-			return 1;
+			uint32_t gen = zs->req_gen;
+			__off64_t target = zs->target;
+			pthread_mutex_unlock(&zs->lock);
+
+			int ret = zip_stream_reposition(zs, target, gen, chunk);
+
+			pthread_mutex_lock(&zs->lock);
+			if (ret >= 0 && zs->req_gen == gen)
+			{
+				zs->gen = gen;
+				zs->ring_start = zs->ring_end = target;
+				zs->error = !ret;
+				pthread_cond_broadcast(&zs->cond);
+			}
+			continue;
 		}
 
-		if (!OpenZipfileCached(full_path, 0))
+		// Fill up to a ring ahead of the consumer
+		__off64_t len = MIN((__off64_t)ZIP_STREAM_CHUNK, zs->size - zs->ring_end);
+		len = MIN(len, zs->read_pos + ZIP_STREAM_RING - zs->ring_end);
+		if (zs->error || len <= 0)
 		{
-			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
-				mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
-			return 0;
+			pthread_cond_wait(&zs->cond, &zs->lock);
+			continue;
 		}
 
-		// Folder names always end with a slash in the zip
-		// file central directory.
-		strcat(file_path, "/");
+		uint32_t gen = zs->gen;
+		pthread_mutex_unlock(&zs->lock);
 
-		// Some zip files don't have directory entries
-		// Use the locate_file call to try and find the directory entry first, since
-		// this is a binary search (usually) If that fails then scan for the first
-		// entry that starts with file_path
+		size_t ret = zip_stream_inflate(zs, chunk, len);
 
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index))
-		{
-			return 1;
-		}
+		pthread_mutex_lock(&zs->lock);
+		if (zs->req_gen != gen) continue;
 
-		for (size_t i = 0; i < mz_zip_reader_get_num_files(&last_zip_archive); i++)
-		{
-			char zip_fname[256];
-			mz_zip_reader_get_filename(&last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
-			if (strcasestr(zip_fname, file_path))
-			{
-				return 1;
-			}
-		}
-		return 0;
-	}
-	else
-	{
-		int stmode = get_stmode(full_path);
-		if (!stmode)
+		if (ret < (size_t)len)
 		{
-			//printf("isPathDirectory(stat) path: %s, error: %s.\n", full_path, strerror(errno));
-			return 0;
+			printf("ZipStream: Failed to inflate, error:%s\n", mz_zip_get_error_string(mz_zip_get_last_error(zs->iter->pZip)));
+			zs->error = true;
 		}
 
-		if (stmode & S_IFDIR) return 1;
+		size_t pos = zs->ring_end % ZIP_STREAM_RING;
+		size_t part = MIN(ret, (size_t)(ZIP_STREAM_RING - pos));
+		memcpy(zs->ring + pos, chunk, part);
+		memcpy(zs->ring, chunk + part, ret - part);
+
+		zs->ring_end += ret;
+		if (zs->ring_end - zs->ring_start > ZIP_STREAM_RING) zs->ring_start = zs->ring_end - ZIP_STREAM_RING;
+		pthread_cond_broadcast(&zs->cond);
 	}
 
-	return 0;
+	pthread_mutex_unlock(&zs->lock);
+	if (chunk) mem_account(MEM_ZIP, -ZIP_STREAM_CHUNK);
+	free(chunk);
+	return nullptr;
 }
 
-static int isPathRegularFile(const char *path, int use_zip = 1)
+// Takes over the iterator of zip (which must be at the start)
+static ZipStream *zip_stream_start(fileZipArchive *zip, __off64_t size)
 {
-	make_fullpath(path);
-
-	char *zip_path, *file_path;
-	if (use_zip && FileIsZipped(full_path, &zip_path, &file_path))
+	ZipStream *zs = new ZipStream();
+	zs->ring = (uint8_t*)malloc(ZIP_STREAM_RING);
+	mz_zip_reader_extract_iter_state *start = zs->ring ? zip_iter_clone(zip->iter) : nullptr;
+	if (!start)
 	{
-		//If there's no path into the zip file, don't bother opening it, we're a "directory"
-		if (!*file_path)
-		{
-			return 0;
-		}
-		if (!OpenZipfileCached(full_path, 0))
-		{
-			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-			//       mz_zip_get_error_string(mz_zip_get_last_error(&z)));
-			return 0;
-		}
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index < 0)
-		{
-			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
-			//		 zip_path, file_path,
-			//		 mz_zip_get_error_string(mz_zip_get_last_error(&z)));
-			return 0;
-		}
-
-		if (!mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index) && mz_zip_reader_is_file_supported(&last_zip_archive, file_index))
-		{
-			return 1;
-		}
+		free(zs->ring);
+		delete zs;
+		return nullptr;
 	}
-	else
+
+	pthread_mutex_init(&zs->lock, nullptr);
+	pthread_cond_init(&zs->cond, nullptr);
+	zs->size = size;
+	zs->req_gen = 0;
+	zs->gen = 0;
+	zs->iter = zip->iter;
+	zs->iter_pos = 0;
+	zs->checkpoints.push_back({ 0, start });
+	zs->checkpoint_step = ZIP_STREAM_CHECKPOINT;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// Keep inflating off core #1 since main runs there
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	int ret = pthread_create(&zs->thread, &attr, zip_stream_thread, zs);
+	pthread_attr_destroy(&attr);
+
+	if (ret)
 	{
-		if (get_stmode(full_path) & S_IFREG) return true;
+		mz_zip_reader_extract_iter_free(start);
+		pthread_mutex_destroy(&zs->lock);
+		pthread_cond_destroy(&zs->cond);
+		free(zs->ring);
+		delete zs;
+		return nullptr;
 	}
 
-	return 0;
+	zip->iter = nullptr;
+	mem_account(MEM_ZIP, ZIP_STREAM_RING);
+	return zs;
 }
 
-void FileClose(fileTYPE *file)
+static void zip_stream_stop(ZipStream *zs)
 {
-	if (file->zip)
-	{
-		if (file->zip->iter)
-		{
-			mz_zip_reader_extract_iter_free(file->zip->iter);
-		}
-		mz_zip_reader_end(&file->zip->archive);
+	pthread_mutex_lock(&zs->lock);
+	zs->quit = true;
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
+	pthread_join(zs->thread, nullptr);
+
+	mz_zip_reader_extract_iter_free(zs->iter);
+	for (ZipCheckpoint &cp : zs->checkpoints) mz_zip_reader_extract_iter_free(cp.iter);
+
+	pthread_mutex_destroy(&zs->lock);
+	pthread_cond_destroy(&zs->cond);
+	mem_account(MEM_ZIP, -ZIP_STREAM_RING);
+	free(zs->ring);
+	delete zs;
+}
 
-		delete file->zip;
-	}
+static void zip_stream_seek(ZipStream *zs, __off64_t offset)
+{
+	pthread_mutex_lock(&zs->lock);
 
-	if (file->filp)
+	// Data in the ring or coming soon doesn't need a restart
+	if (zs->req_gen != zs->gen || offset < zs->ring_start || offset > zs->ring_end + ZIP_STREAM_RING)
 	{
-		//printf("closing %p\n", file->filp);
-		fclose(file->filp);
-		if (file->type == 1)
-		{
-			if (file->name[0] == '/')
-			{
-				shm_unlink(file->name);
-			}
-			file->type = 0;
-		}
+		zs->target = offset;
+		zs->req_gen++;
 	}
 
-	file->zip = nullptr;
-	file->filp = nullptr;
-	file->size = 0;
+	zs->read_pos = offset;
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
 }
 
-static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
+static int zip_stream_read(ZipStream *zs, void *buf, int length)
 {
-	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
+	uint8_t *dst = (uint8_t*)buf;
+	int total = 0;
+
+	pthread_mutex_lock(&zs->lock);
+	while (length > 0 && zs->read_pos < zs->size)
 	{
-		mz_zip_archive_file_stat s;
-		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
+		if (zs->req_gen != zs->gen || zs->read_pos >= zs->ring_end)
 		{
-			if (s.m_crc32 == crc32)
-			{
-				return file_index;
-			}
+			if (zs->error && zs->req_gen == zs->gen) break;
+			pthread_cond_wait(&zs->cond, &zs->lock);
+			continue;
 		}
+
+		size_t pos = zs->read_pos % ZIP_STREAM_RING;
+		int len = MIN((__off64_t)length, zs->ring_end - zs->read_pos);
+		len = MIN(len, (int)(ZIP_STREAM_RING - pos));
+		memcpy(dst, zs->ring + pos, len);
+
+		dst += len;
+		total += len;
+		length -= len;
+		zs->read_pos += len;
+		pthread_cond_broadcast(&zs->cond);
 	}
+	pthread_mutex_unlock(&zs->lock);
 
-	return -1;
+	return total;
 }
 
-int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
+// Seekable zstd (.zst with the seek table of zstd's contrib/seekable_format):
+// independent frames, so any offset is reached by decoding only its frame.
+// Frames after the one read are decoded ahead on the offload workers while
+// the caller works on the current one. Files without a seek table open as
+// plain files.
+#define ZSTD_SEEKABLE_MAGIC  0x8F92EAB1
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_FRAME_MAX       (16 * 1024 * 1024) // larger frames are refused
+#define ZSTD_SLOTS           3                  // current frame and read-ahead
+#define ZSTD_AHEAD           2
+
+struct ZstdFrame
 {
-	make_fullpath(name);
-	FileClose(file);
-	file->mode = 0;
-	file->type = 0;
-
-	char *p = strrchr(full_path, '/');
-	strcpy(file->name, (p) ? p + 1 : full_path);
+	__off64_t comp_offset;
+	__off64_t offset;
+	uint32_t  comp_size;
+	uint32_t  size;
+};
 
-	char *zip_path, *file_path;
-	if (!FileIsZipped(full_path, &zip_path, &file_path))
+struct ZstdSlot
+{
+	int           frame;  // -1 if empty
+	int           ok;
+	uint32_t      used;
+	uint8_t      *data;
+	OffloadHandle job;
+};
+
+struct fileZstdArchive
+{
+	int                    fd;
+	std::vector<ZstdFrame> frames;
+	__off64_t              offset;
+	uint32_t               tick;
+	ZstdSlot               slot[ZSTD_SLOTS];
+};
+
+static uint32_t zstd_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Reads the seek table at the end of the file, 0 if there's none.
+static int zstd_seek_table(fileZstdArchive *z, __off64_t file_size, __off64_t *size)
+{
+	uint8_t footer[9];
+	if (file_size < 17 || pread64(z->fd, footer, 9, file_size - 9) != 9) return 0;
+	if (zstd_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & 0x7C)) return 0;
+
+	uint32_t count = zstd_le32(footer);
+	uint32_t entry = (footer[4] & 0x80) ? 12 : 8;
+	__off64_t table_size = (__off64_t)count * entry;
+	__off64_t table_start = file_size - 9 - table_size;
+	if (!count || table_start < 8) return 0;
+
+	uint8_t hdr[8];
+	if (pread64(z->fd, hdr, 8, table_start - 8) != 8) return 0;
+	if (zstd_le32(hdr) != ZSTD_SKIPPABLE_MAGIC || zstd_le32(hdr + 4) != table_size + 9) return 0;
+
+	std::vector<uint8_t> table(table_size);
+	if (pread64(z->fd, table.data(), table_size, table_start) != table_size) return 0;
+
+	z->frames.resize(count);
+	__off64_t comp = 0, offset = 0;
+	for (uint32_t i = 0; i < count; i++)
 	{
-		printf("FileOpenZip: %s, is not a zip.\n", full_path);
-		return 0;
+		ZstdFrame &f = z->frames[i];
+		f.comp_offset = comp;
+		f.offset = offset;
+		f.comp_size = zstd_le32(table.data() + i * entry);
+		f.size = zstd_le32(table.data() + i * entry + 4);
+		if (f.size > ZSTD_FRAME_MAX) return 0;
+		comp += f.comp_size;
+		offset += f.size;
 	}
 
-	file->zip = new fileZipArchive{};
-	if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+	if (comp != table_start - 8) return 0;
+	*size = offset;
+	return 1;
+}
+
+// Runs on the offload workers as well as on the caller.
+static int zstd_decode_frame(int fd, const ZstdFrame *f, uint8_t *out)
+{
+	static thread_local ZSTD_DCtx *dctx = nullptr;
+	static thread_local std::vector<uint8_t> comp;
+
+	if (!dctx) dctx = ZSTD_createDCtx();
+	if (!dctx) return 0;
+
+	comp.resize(f->comp_size);
+	if (pread64(fd, comp.data(), f->comp_size, f->comp_offset) != f->comp_size) return 0;
+
+	size_t ret = ZSTD_decompressDCtx(dctx, out, f->size, comp.data(), f->comp_size);
+	if (ZSTD_isError(ret) || ret != f->size)
 	{
-		printf("FileOpenZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+		printf("zstd: frame at %lld failed: %s\n", f->comp_offset, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
 		return 0;
 	}
+	return 1;
+}
 
-	file->zip->index = -1;
-	if (crc32) file->zip->index = zip_search_by_crc(&file->zip->archive, crc32);
-	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
-	if (file->zip->index < 0)
+static fileZstdArchive *zstd_open(int fd, __off64_t file_size, __off64_t *size)
+{
+	fileZstdArchive *z = new fileZstdArchive{};
+	z->fd = fd;
+	for (ZstdSlot &s : z->slot) s.frame = -1;
+
+	if (!zstd_seek_table(z, file_size, size))
 	{
-		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
-					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-		FileClose(file);
-		return 0;
+		delete z;
+		return nullptr;
 	}
 
-	mz_zip_archive_file_stat s;
-	if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+	return z;
+}
+
+static void zstd_close(fileZstdArchive *z)
+{
+	for (ZstdSlot &s : z->slot)
 	{
-		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
-					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-		FileClose(file);
-		return 0;
+		s.job.wait();
+		free(s.data);
 	}
-	file->size = s.m_uncomp_size;
+	close(z->fd);
+	delete z;
+}
 
-	file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
-	if (!file->zip->iter)
+// Slot to reuse for a new frame: an empty one or the least recently used,
+// never one holding a frame from first..last.
+static ZstdSlot *zstd_free_slot(fileZstdArchive *z, int first, int last)
+{
+	ZstdSlot *best = nullptr;
+	for (ZstdSlot &s : z->slot)
 	{
-		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
-					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-		FileClose(file);
-		return 0;
+		if (s.frame >= first && s.frame <= last) continue;
+		if (s.frame < 0) return &s;
+		if (!best || s.used < best->used) best = &s;
 	}
+	return best;
+}
 
-	file->zip->offset = 0;
-	file->offset = 0;
-	file->mode = O_RDONLY;
+static int zstd_slot_fill(ZstdSlot *s, int frame)
+{
+	s->job.wait();
+	s->job = OffloadHandle();
+	s->frame = -1;
+	s->ok = 0;
+
+	if (!s->data) s->data = (uint8_t*)malloc(ZSTD_FRAME_MAX);
+	if (!s->data) return 0;
+
+	s->frame = frame;
 	return 1;
 }
 
-int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zip)
+static ZstdSlot *zstd_get_frame(fileZstdArchive *z, int frame)
 {
-	make_fullpath((char*)name, mode);
-	FileClose(file);
-	file->mode = 0;
-	file->type = 0;
+	int count = z->frames.size();
 
-	char *p = strrchr(full_path, '/');
-	strcpy(file->name, (mode == -1) ? full_path : p + 1);
+	ZstdSlot *cur = nullptr;
+	for (ZstdSlot &s : z->slot) if (s.frame == frame) cur = &s;
 
-	char *zip_path, *file_path;
-	if (use_zip && (mode != -1) && FileIsZipped(full_path, &zip_path, &file_path))
+	if (cur)
 	{
-		if (mode & O_RDWR || mode & O_WRONLY)
-		{
-			if(!mute) printf("FileOpenEx(mode) Zip:%s, writing to zipped files is not supported.\n",
-					 full_path);
-			return 0;
-		}
+		cur->job.wait();
+	}
+	else
+	{
+		cur = zstd_free_slot(z, frame, frame);
+		if (!zstd_slot_fill(cur, frame)) return nullptr;
+		cur->ok = zstd_decode_frame(z->fd, &z->frames[frame], cur->data);
+	}
 
-		file->zip = new fileZipArchive{};
-		if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
-		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			return 0;
-		}
+	cur->used = ++z->tick;
+	if (!cur->ok)
+	{
+		cur->frame = -1;
+		return nullptr;
+	}
 
-		file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
-		if (file->zip->index < 0)
+	// decode the next frames meanwhile
+	for (int next = frame + 1; next <= frame + ZSTD_AHEAD && next < count; next++)
+	{
+		int have = 0;
+		for (ZstdSlot &s : z->slot) if (s.frame == next) have = 1;
+		if (have) continue;
+
+		ZstdSlot *s = zstd_free_slot(z, frame, next);
+		if (!s || !zstd_slot_fill(s, next)) break;
+
+		s->used = z->tick;
+		int fd = z->fd;
+		const ZstdFrame *f = &z->frames[next];
+		s->job = offload_try_submit([s, fd, f]() { s->ok = zstd_decode_frame(fd, f, s->data); }, OFFLOAD_PRIO_DECODE);
+		if (!s->job.valid())
 		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
-					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			FileClose(file);
-			return 0;
+			s->frame = -1;
+			break;
 		}
+	}
 
-		mz_zip_archive_file_stat s;
-		if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
-		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
-					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			FileClose(file);
-			return 0;
-		}
-		file->size = s.m_uncomp_size;
+	return cur;
+}
 
-		file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
-		if (!file->zip->iter)
-		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
-					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			FileClose(file);
-			return 0;
-		}
-		file->zip->offset = 0;
-		file->offset = 0;
-		file->mode = mode;
-	}
-	else
+static int zstd_read(fileZstdArchive *z, void *buf, int length)
+{
+	int total = 0;
+	while (length > 0)
 	{
-		int fd = (mode == -1) ? shm_open("/vdsk", O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0777) : open(full_path, mode | O_CLOEXEC, 0777);
-		if (fd <= 0)
-		{
-			if(!mute) printf("FileOpenEx(open) File:%s, error: %s.\n", full_path, strerror(errno));
-			return 0;
-		}
-		const char *fmode = mode & O_RDWR ? "w+" : "r";
-		file->filp = fdopen(fd, fmode);
-		if (!file->filp)
-		{
-			if(!mute) printf("FileOpenEx(fdopen) File:%s, error: %s.\n", full_path, strerror(errno));
-			close(fd);
-			return 0;
-		}
+		// frame holding the offset
+		auto it = std::upper_bound(z->frames.begin(), z->frames.end(), z->offset,
+			[](__off64_t off, const ZstdFrame &f) { return off < f.offset; });
+		if (it == z->frames.begin()) break;
+		int frame = (it - z->frames.begin()) - 1;
+
+		const ZstdFrame &f = z->frames[frame];
+		if (z->offset >= f.offset + f.size) break;
+
+		ZstdSlot *s = zstd_get_frame(z, frame);
+		if (!s) break;
+
+		uint32_t pos = z->offset - f.offset;
+		int len = MIN((__off64_t)length, (__off64_t)(f.size - pos));
+		memcpy((uint8_t*)buf + total, s->data + pos, len);
+		total += len;
+		length -= len;
+		z->offset += len;
+	}
 
-		if (mode == -1)
-		{
-			file->type = 1;
-			file->size = 0;
-			file->offset = 0;
-			file->mode = O_CREAT | O_RDWR | O_TRUNC;
-		}
-		else
-		{
-			struct stat64 st;
-			int ret = fstat64(fileno(file->filp), &st);
-			if (ret < 0)
-			{
-				if (!mute) printf("FileOpenEx(fstat) File:%s, error: %d.\n", full_path, ret);
-				FileClose(file);
-				return 0;
-			}
+	return total;
+}
 
-			file->size = st.st_size;
-			if (st.st_rdev && !st.st_size)  //for special files we need an ioctl call to get the correct size
-			{
-				unsigned long long blksize;
-				int ret = ioctl(fd, BLKGETSIZE64, &blksize);
-				if (ret < 0)
-				{
-					if (!mute) printf("FileOpenEx(ioctl) File:%s, error: %d.\n", full_path, ret);
-					FileClose(file);
-					return 0;
-				}
-				file->size = blksize;
-			}
+// Copy-on-write overlay (.ovl in the name, e.g. disk.ovl.vhd): a sparse delta
+// of a read-only base image. Blocks written once are copied into the overlay
+// and read from there, the others fall through to the base. The header names
+// the base and the block map follows it, data blocks are appended after the
+// map. A block is written before its map entry, so an interrupted write
+// leaves the old contents.
+#define OVL_MAGIC   0x4C564F4D // "MOVL"
+#define OVL_VERSION 1
+#define OVL_HEADER  4096
+#define OVL_BLOCK   (16 * 1024)
+#define OVL_COPY    (256 * 1024)
+
+struct OvlHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t block_size;
+	uint32_t blocks;
+	uint64_t base_size;
+	uint64_t base_mtime;      // base must not change under the overlay
+	uint64_t map_offset;
+	uint64_t data_offset;
+	char     base[1024];      // as given at creation, relative to the root or absolute
+};
 
-			file->offset = 0;
-			file->mode = mode;
-		}
-	}
+struct fileOverlay
+{
+	int                   fd;
+	int                   base_fd;
+	uint32_t              block_size;
+	uint32_t              used;     // data blocks in the overlay
+	__off64_t             map_offset;
+	__off64_t             data_offset;
+	__off64_t             size;
+	__off64_t             offset;
+	std::vector<uint32_t> map;      // data block + 1, 0 if in the base
+	uint8_t              *block;
+};
 
-	//printf("opened %s, size %llu\n", full_path, file->size);
-	return 1;
+static int ovl_header(int fd, OvlHeader *hdr)
+{
+	return pread(fd, hdr, sizeof(OvlHeader), 0) == sizeof(OvlHeader) && hdr->magic == OVL_MAGIC &&
+		hdr->version == OVL_VERSION && hdr->block_size >= 512 && !(hdr->block_size & 511) &&
+		hdr->base[sizeof(hdr->base) - 1] == 0;
 }
 
-__off64_t FileGetSize(fileTYPE *file)
+static void ovl_close(fileOverlay *o)
 {
-	if (file->filp)
-	{
-		struct stat64 st;
-		if (fstat64(fileno(file->filp), &st) < 0) return 0;
+	close(o->fd);
+	if (o->base_fd >= 0) close(o->base_fd);
+	mem_account(MEM_CACHE, -(int64_t)(o->map.size() * sizeof(uint32_t) + o->block_size));
+	free(o->block);
+	delete o;
+}
 
-		if (st.st_rdev && !st.st_size)  //for special files we need an ioctl call to get the correct size
-		{
-			unsigned long long blksize;
-			int ret = ioctl(fileno(file->filp), BLKGETSIZE64, &blksize);
-			if (ret < 0) return 0;
-			return blksize;
-		}
+static fileOverlay *ovl_open(int fd)
+{
+	OvlHeader hdr;
+	if (!ovl_header(fd, &hdr)) return nullptr;
+
+	fileOverlay *o = new fileOverlay();
+	o->fd = fd;
+	o->base_fd = open(getFullPath(hdr.base), O_RDONLY | O_CLOEXEC);
+	o->block_size = hdr.block_size;
+	o->map_offset = hdr.map_offset;
+	o->data_offset = hdr.data_offset;
+	o->size = hdr.base_size;
+	o->map.resize(hdr.blocks);
+	o->block = (uint8_t *)malloc(o->block_size);
+	mem_account(MEM_CACHE, o->map.size() * sizeof(uint32_t) + o->block_size);
 
-		return st.st_size;
+	struct stat64 st;
+	if (o->base_fd < 0 || fstat64(o->base_fd, &st) || (uint64_t)st.st_size != hdr.base_size || (uint64_t)st.st_mtime != hdr.base_mtime)
+	{
+		printf("overlay: base %s is missing or was changed.\n", hdr.base);
+		o->fd = -1;
+		ovl_close(o);
+		return nullptr;
 	}
-	else if (file->zip)
+
+	ssize_t len = (ssize_t)hdr.blocks * sizeof(uint32_t);
+	if (!o->block || pread(fd, o->map.data(), len, o->map_offset) != len)
 	{
-		return file->size;
+		o->fd = -1;
+		ovl_close(o);
+		return nullptr;
 	}
-	return 0;
-}
 
-int FileOpen(fileTYPE *file, const char *name, char mute)
-{
-	return FileOpenEx(file, name, O_RDONLY, mute);
+	for (uint32_t idx : o->map) if (idx > o->used) o->used = idx;
+	return o;
 }
 
-int FileSeek(fileTYPE *file, __off64_t offset, int origin)
+static int ovl_read(fileOverlay *o, void *buf, int length)
 {
-	if (file->filp)
+	uint8_t *p = (uint8_t *)buf;
+	if (o->offset + length > o->size) length = (o->offset < o->size) ? o->size - o->offset : 0;
+
+	int done = 0;
+	while (done < length)
 	{
-		__off64_t res = fseeko64(file->filp, offset, origin);
-		if (res < 0)
-		{
-			printf("Fail to seek the file: offset=%lld, %s.\n", offset, file->name);
-			return 0;
-		}
-		offset = ftello64(file->filp);
+		uint32_t b = o->offset / o->block_size;
+		uint32_t within = o->offset % o->block_size;
+		int n = MIN((uint32_t)(length - done), o->block_size - within);
+
+		ssize_t ret;
+		if (o->map[b]) ret = pread(o->fd, p + done, n, o->data_offset + (__off64_t)(o->map[b] - 1) * o->block_size + within);
+		else ret = pread(o->base_fd, p + done, n, o->offset);
+		if (ret <= 0) break;
+
+		done += ret;
+		o->offset += ret;
 	}
-	else if (file->zip)
+
+	return done;
+}
+
+static int ovl_write(fileOverlay *o, const void *buf, int length)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	if (o->offset + length > o->size) length = (o->offset < o->size) ? o->size - o->offset : 0;
+
+	int done = 0;
+	while (done < length)
 	{
-		if (origin == SEEK_CUR)
-		{
-			offset = file->zip->offset + offset;
-		}
-		else if (origin == SEEK_END)
+		uint32_t b = o->offset / o->block_size;
+		uint32_t within = o->offset % o->block_size;
+		int n = MIN((uint32_t)(length - done), o->block_size - within);
+
+		if (o->map[b])
 		{
-			offset = file->size - offset;
+			if (pwrite(o->fd, p + done, n, o->data_offset + (__off64_t)(o->map[b] - 1) * o->block_size + within) != n) break;
 		}
-
-		if (offset < file->zip->offset)
+		else
 		{
-			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
-			if (!iter)
+			// First write of the block: copy it from the base
+			if ((uint32_t)n < o->block_size)
 			{
-				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-				return 0;
+				memset(o->block, 0, o->block_size);
+				if (pread(o->base_fd, o->block, o->block_size, (__off64_t)b * o->block_size) < 0) break;
 			}
+			memcpy(o->block + within, p + done, n);
 
-			mz_zip_reader_extract_iter_free(file->zip->iter);
-			file->zip->iter = iter;
-			file->zip->offset = 0;
-		}
+			uint32_t idx = o->used + 1;
+			if (pwrite(o->fd, o->block, o->block_size, o->data_offset + (__off64_t)o->used * o->block_size) != (ssize_t)o->block_size ||
+				pwrite(o->fd, &idx, sizeof(idx), o->map_offset + (__off64_t)b * sizeof(idx)) != sizeof(idx)) break;
 
-		static char buf[4*1024];
-		while (file->zip->offset < offset)
-		{
-			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
-			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
-			file->zip->offset += read_len;
-			if (read_len < want_len)
-			{
-				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-				return 0;
-			}
+			o->map[b] = idx;
+			o->used++;
 		}
+
+		done += n;
+		o->offset += n;
 	}
-	else
+
+	return done;
+}
+
+int FileOverlayCreate(const char *overlay, const char *base)
+{
+	struct stat64 st;
+	if (stat64(getFullPath(base), &st) || !S_ISREG(st.st_mode) || strlen(base) >= sizeof(OvlHeader::base))
 	{
+		printf("overlay: cannot use %s as base.\n", base);
 		return 0;
 	}
 
-	file->offset = offset;
-	return 1;
+	OvlHeader hdr = {};
+	hdr.magic = OVL_MAGIC;
+	hdr.version = OVL_VERSION;
+	hdr.block_size = OVL_BLOCK;
+	hdr.blocks = (st.st_size + OVL_BLOCK - 1) / OVL_BLOCK;
+	hdr.base_size = st.st_size;
+	hdr.base_mtime = st.st_mtime;
+	hdr.map_offset = OVL_HEADER;
+	hdr.data_offset = (OVL_HEADER + (uint64_t)hdr.blocks * sizeof(uint32_t) + OVL_BLOCK - 1) & ~(uint64_t)(OVL_BLOCK - 1);
+	strcpy(hdr.base, base);
+
+	// The map starts as a hole, all blocks in the base
+	int fd = open(getFullPath(overlay), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return 0;
+	int ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && !ftruncate(fd, hdr.data_offset) && !fsync(fd);
+	close(fd);
+	return ok;
 }
 
-int FileSeekLBA(fileTYPE *file, uint32_t offset)
+int FileOverlayReset(const char *overlay)
 {
-	__off64_t off64 = offset;
-	off64 <<= 9;
-	return FileSeek(file, off64, SEEK_SET);
+	int fd = open(getFullPath(overlay), O_RDWR | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	// Cutting the file back to the header turns map and data into holes
+	OvlHeader hdr;
+	int ok = ovl_header(fd, &hdr) && !ftruncate(fd, hdr.map_offset) && !ftruncate(fd, hdr.data_offset) && !fsync(fd);
+	close(fd);
+	return ok;
 }
 
-// Read with offset advancing
-int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+int FileOverlaySnapshot(const char *overlay, const char *copy)
 {
-	ssize_t ret = 0;
+	int in = open(getFullPath(overlay), O_RDONLY | O_CLOEXEC);
+	if (in < 0) return 0;
 
-	if (file->filp)
+	OvlHeader hdr;
+	int out = ovl_header(in, &hdr) ? open(getFullPath(copy), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
+	if (out < 0)
 	{
-		ret = fread(pBuffer, 1, length, file->filp);
-		if (ret < 0)
-		{
-			printf("FileReadAdv error(%d).\n", ret);
-			return failres;
-		}
+		close(in);
+		return 0;
 	}
-	else if (file->zip)
+
+	// Only the written blocks take room, holes of the map stay holes
+	struct stat64 st;
+	fstat64(in, &st);
+	__off64_t pos = 0;
+	uint8_t *buf = (uint8_t *)malloc(OVL_COPY);
+	int ok = buf != nullptr;
+	while (ok && pos < st.st_size)
 	{
-		ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
-		if (!ret)
+		__off64_t data = lseek64(in, pos, SEEK_DATA);
+		if (data < 0) break;
+		__off64_t hole = lseek64(in, data, SEEK_HOLE);
+		if (hole < 0) hole = st.st_size;
+
+		for (pos = data; ok && pos < hole; )
 		{
-			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
-			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			return failres;
+			int n = MIN((__off64_t)OVL_COPY, hole - pos);
+			ok = pread(in, buf, n, pos) == n && pwrite(out, buf, n, pos) == n;
+			pos += n;
 		}
-		file->zip->offset += ret;
-	}
-	else
-	{
-		printf("FileReadAdv error(unknown file type).\n");
-		return failres;
 	}
 
-	file->offset += ret;
-	return ret;
+	ok = ok && !ftruncate(out, st.st_size) && !fsync(out);
+	free(buf);
+	close(in);
+	close(out);
+	return ok;
 }
 
-int FileReadSec(fileTYPE *file, void *pBuffer)
+// Archive of the last directory/file query of the thread, released when the thread ends
+struct LastZip
 {
-	return FileReadAdv(file, pBuffer, 512);
-}
+	ZipCacheEntry *entry = nullptr;
+	~LastZip() { zip_cache_release(entry); }
+};
+static thread_local LastZip last_zip;
 
-// Write with offset advancing
-int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+static mz_zip_archive *OpenZipfileCached(char *path, int flags)
 {
-	int ret;
-
-	if (file->filp)
+	if (last_zip.entry && !last_zip.entry->stale && !strcasecmp(path, last_zip.entry->fname.c_str()))
 	{
-		ret = fwrite(pBuffer, 1, length, file->filp);
-		fflush(file->filp);
+		return &last_zip.entry->archive;
+	}
 
-		if (ret < 0)
-		{
-			printf("FileWriteAdv error(%d).\n", ret);
-			return failres;
-		}
+	ZipCacheEntry *entry = zip_cache_open(path, flags);
+	zip_cache_release(last_zip.entry);
+	last_zip.entry = entry;
 
-		file->offset += ret;
-		if (file->offset > file->size) file->size = FileGetSize(file);
-		return ret;
-	}
-	else if (file->zip)
-	{
-		printf("FileWriteAdv error(not supported for zip).\n");
-		return failres;
-	}
-	else
-	{
-		printf("FileWriteAdv error(unknown file type).\n");
-		return failres;
-	}
+	return entry ? &entry->archive : nullptr;
 }
 
-int FileWriteSec(fileTYPE *file, void *pBuffer)
-{
-	return FileWriteAdv(file, pBuffer, 512);
-}
 
-int FileSave(const char *name, void *pBuffer, int size)
+static int FileIsZipped(char* path, char** zip_path, char** file_path)
 {
-	make_fullpath(name);
-
-	int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRWXU | S_IRWXG | S_IRWXO);
-	if (fd < 0)
+	char* z = strcasestr(path, ".zip");
+	if (z)
 	{
-		printf("FileSave(open) File:%s, error: %d.\n", full_path, fd);
-		return 0;
-	}
-
-	int ret = write(fd, pBuffer, size);
-	close(fd);
+		z += 4;
+		if (!z[0]) z[1] = 0;
+		*z++ = 0;
 
-	if (ret < 0)
-	{
-		printf("FileSave(write) File:%s, error: %d.\n", full_path, ret);
-		return 0;
+		if (zip_path) *zip_path = path;
+		if (file_path) *file_path = z;
+		return 1;
 	}
 
-	return ret;
+	return 0;
 }
 
-int FileDelete(const char *name)
+// Network mounts
+// Every stat on a CIFS/NFS share is a round trip to the server, and browsing
+// probes a lot of paths that aren't there (previews, savestates). Paths on
+// network mounts get a short lived stat cache, and a folder probed more than
+// once is listed in one go so the rest of its probes are answered locally.
+// Changes made through file_io drop what they affect, changes made by others
+// show up after the TTL.
+
+#define NET_STAT_TTL     3000  // ms
+#define NET_DIR_TTL      10000
+#define NET_STAT_MAX     8192
+#define NET_DIRS_MAX     256
+#define NET_DIR_NAMES    16384 // bigger folders aren't listed
+#define NET_DIR_PROBES   2     // uncached probes in a folder before it's listed
+#define NET_PREFETCH_MAX (64 * 1024 * 1024)
+
+struct NetMount
 {
-	make_fullpath(name);
-	printf("delete %s\n", full_path);
-	return !unlink(full_path);
-}
+	std::string dir;
+	bool net;
+};
 
-int DirDelete(const char *name)
+struct NetStat
 {
-	make_fullpath(name);
-	printf("rmdir %s\n", full_path);
-	return !rmdir(full_path);
-}
+	int ok;
+	struct stat64 st;
+	unsigned long expire;
+};
 
-const char* GetNameFromPath(char *path)
+struct NetDir
 {
-	static char res[32];
+	std::unordered_map<std::string, uint8_t> names; // d_type
+	bool listed;
+	int probes;
+	unsigned long expire;
+};
 
-	char* p = strrchr(path, '/');
-	if (!p) p = path;
-	else p++;
+static pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<NetMount> net_mounts;
+static std::unordered_map<std::string, NetStat> net_stats;
+static std::unordered_map<std::string, NetDir> net_dirs;
+static int net_mountinfo = -1;
 
-	if (strlen(p) < 19) strcpy(res, p);
-	else
+static bool net_fstype(const char *t)
+{
+	return !strncmp(t, "nfs", 3) || !strcmp(t, "cifs") || !strncmp(t, "smb", 3) || !strncmp(t, "fuse", 4);
+}
+
+// mountinfo escapes blanks as \040
+static void net_unescape(char *s)
+{
+	char *d = s;
+	while (*s)
 	{
-		strncpy(res, p, 19);
-		res[19] = 0;
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7')
+		{
+			*d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+			s += 4;
+		}
+		else *d++ = *s++;
 	}
-
-	return res;
+	*d = 0;
 }
 
-int FileLoad(const char *name, void *pBuffer, int size)
+// net_lock must be held. The mount table is read again when it changes.
+static bool net_mounts_update()
 {
-	fileTYPE f;
-	if (!FileOpen(&f, name)) return 0;
+	if (net_mountinfo < 0)
+	{
+		net_mountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (net_mountinfo < 0) return false;
+	}
+	else
+	{
+		struct pollfd pfd = { net_mountinfo, POLLPRI, 0 };
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLPRI | POLLERR))) return true;
+	}
 
-	int ret = f.size;
-	if (pBuffer) ret = FileReadAdv(&f, pBuffer, size ? size : f.size);
+	int fd = dup(net_mountinfo);
+	FILE *f = (fd < 0) ? NULL : fdopen(fd, "r");
+	if (!f)
+	{
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	rewind(f);
 
-	FileClose(&f);
-	return ret;
-}
+	std::vector<NetMount> mounts;
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		// id parent major:minor root mount options ... - fstype source
+		char dir[512], fstype[32];
+		char *sep = strstr(line, " - ");
+		if (!sep || sscanf(line, "%*s %*s %*s %*s %511s", dir) != 1 || sscanf(sep + 3, "%31s", fstype) != 1) continue;
+		net_unescape(dir);
+
+		bool net = net_fstype(fstype);
+		if (net && !strncmp(dir, "/media/", 7))
+		{
+			bool known = false;
+			for (auto &m : net_mounts) known = known || (m.net && m.dir == dir);
+			if (!known) printf("file_io: %s is a network mount (%s), caching its metadata.\n", dir, fstype);
+		}
 
-int FileLoadConfig(const char *name, void *pBuffer, int size)
-{
-	char path[256] = { CONFIG_DIR"/" };
-	strcat(path, name);
-	return FileLoad(path, pBuffer, size);
+		// the last mount on a point is the one seen there
+		mounts.erase(std::remove_if(mounts.begin(), mounts.end(), [&](const NetMount &m) { return m.dir == dir; }), mounts.end());
+		mounts.push_back({ dir, net });
+	}
+	fclose(f);
+
+	net_mounts = std::move(mounts);
+	net_stats.clear();
+	net_dirs.clear();
+	return true;
 }
 
-int FileSaveConfig(const char *name, void *pBuffer, int size)
+bool is_network_fs(const char *path)
 {
-	char path[256] = { CONFIG_DIR };
-	const char *p;
-	while ((p = strchr(name, '/')))
+	pthread_mutex_lock(&net_lock);
+	if (net_mounts_update())
 	{
-		strcat(path, "/");
-		strncat(path, name, p - name);
-		name = ++p;
-		FileCreatePath(path);
+		size_t best = 0;
+		bool net = false;
+		for (auto &m : net_mounts)
+		{
+			size_t len = m.dir.size();
+			if (len == 1) len = 0; // "/"
+			if (len < best || strncmp(path, m.dir.c_str(), len) || (path[len] && path[len] != '/')) continue;
+			best = len;
+			net = m.net;
+		}
+		pthread_mutex_unlock(&net_lock);
+		return net;
 	}
+	pthread_mutex_unlock(&net_lock);
 
-	strcat(path, "/");
-	strcat(path, name);
-	return FileSave(path, pBuffer, size);
+	struct statfs fs;
+	if (statfs(path, &fs)) return true;
+
+	switch ((uint32_t)fs.f_type)
+	{
+	case 0x6969:     // NFS
+	case 0x517B:     // SMB
+	case 0xFF534D42: // CIFS
+	case 0xFE534D42: // SMB2
+	case 0x65735546: // FUSE (sshfs etc.)
+		return true;
+	}
+	return false;
 }
 
-int FileDeleteConfig(const char *name)
+static std::string net_parent(const std::string &path, std::string *name)
 {
-	char path[256] = { CONFIG_DIR"/" };
-	strcat(path, name);
-	return FileDelete(path);
+	size_t p = path.rfind('/');
+	if (p == std::string::npos) p = 0;
+	if (name) *name = path.substr(p ? p + 1 : 0);
+	return path.substr(0, p);
 }
 
-int FileExists(const char *name, int use_zip)
+static void net_put(const std::string &path, int ok, const struct stat64 *st)
 {
-	return isPathRegularFile(name, use_zip);
+	if (net_stats.size() >= NET_STAT_MAX) net_stats.clear();
+	NetStat &e = net_stats[path];
+	e.ok = ok;
+	if (ok) e.st = *st;
+	e.expire = GetTimer(NET_STAT_TTL);
 }
 
-int PathIsDir(const char *name, int use_zip)
+// One readdir of the folder instead of a stat per probe
+static bool net_list(const std::string &dir, std::unordered_map<std::string, uint8_t> &names)
 {
-	return isPathDirectory(name, use_zip);
+	DIR *d = opendir(dir.c_str());
+	if (!d) return false;
+
+	struct dirent64 *de;
+	bool ok = true;
+	while ((de = readdir64(d)))
+	{
+		if (names.size() >= NET_DIR_NAMES)
+		{
+			ok = false;
+			break;
+		}
+		names[de->d_name] = de->d_type;
+	}
+	closedir(d);
+	return ok;
 }
 
-int FileCanWrite(const char *name)
+// stat64 for full paths, cached on network mounts. mode_only: just st_mode is used.
+static int net_stat(const char *path, struct stat64 *st, int mode_only)
 {
-	make_fullpath(name);
+	if (!is_network_fs(path)) return stat64(path, st);
 
-	if (FileIsZipped(full_path, nullptr, nullptr))
+	std::string key = path;
+	std::string name;
+	std::string dir = net_parent(key, &name);
+
+	pthread_mutex_lock(&net_lock);
+	auto it = net_stats.find(key);
+	if (it != net_stats.end() && !CheckTimer(it->second.expire))
 	{
-		return 0;
+		int ok = it->second.ok;
+		if (ok) *st = it->second.st;
+		pthread_mutex_unlock(&net_lock);
+		if (ok) return 0;
+		errno = ENOENT;
+		return -1;
 	}
 
-	struct stat64 st;
-	int ret = stat64(full_path, &st);
-	if (ret < 0)
+	if (net_dirs.size() >= NET_DIRS_MAX) net_dirs.clear();
+	NetDir *d = &net_dirs[dir];
+	if (CheckTimer(d->expire))
 	{
-		printf("FileCanWrite(stat) File:%s, error: %d.\n", full_path, ret);
-		return 0;
+		d->names.clear();
+		d->listed = false;
+		d->probes = 0;
+		d->expire = GetTimer(NET_DIR_TTL);
 	}
 
-	//printf("FileCanWrite: mode=%04o.\n", st.st_mode);
-	return ((st.st_mode & S_IWUSR) != 0);
-}
-
-void create_path(const char *base_dir, const char* sub_dir)
-{
-	make_fullpath(base_dir);
-	mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
-	strcat(full_path, "/");
-	strcat(full_path, sub_dir);
-	mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
-}
+	bool list = !d->listed && ++d->probes == NET_DIR_PROBES;
+	pthread_mutex_unlock(&net_lock);
 
-int FileCreatePath(const char *dir)
-{
-	int res = 1;
-	if (!isPathDirectory(dir)) {
-		make_fullpath(dir);
-		res = !mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (list)
+	{
+		std::unordered_map<std::string, uint8_t> names;
+		bool ok = net_list(dir, names);
+
+		pthread_mutex_lock(&net_lock);
+		d = &net_dirs[dir];
+		d->names = std::move(names);
+		d->listed = ok;
+		d->expire = GetTimer(NET_DIR_TTL);
+		pthread_mutex_unlock(&net_lock);
 	}
-	return res;
-}
 
-void FileGenerateScreenshotName(const char *name, char *out_name, int buflen)
-{
-	// If the name ends with .png then don't modify it
-	if( !strcasecmp(name + strlen(name) - 4, ".png") )
+	pthread_mutex_lock(&net_lock);
+	d = &net_dirs[dir];
+	if (d->listed && !name.empty())
 	{
-		const char *p = strrchr(name, '/');
-		make_fullpath(SCREENSHOT_DIR);
-		if( p )
+		auto n = d->names.find(name);
+		if (n == d->names.end())
 		{
-			snprintf(out_name, buflen, "%s%s", SCREENSHOT_DIR, p);
+			net_put(key, 0, NULL);
+			pthread_mutex_unlock(&net_lock);
+			errno = ENOENT;
+			return -1;
 		}
-		else
+
+		if (mode_only && (n->second == DT_REG || n->second == DT_DIR))
 		{
-			snprintf(out_name, buflen, "%s/%s", SCREENSHOT_DIR, name);
+			memset(st, 0, sizeof(*st));
+			st->st_mode = (n->second == DT_DIR) ? S_IFDIR : S_IFREG;
+			pthread_mutex_unlock(&net_lock);
+			return 0;
 		}
 	}
-	else
-	{
-		create_path(SCREENSHOT_DIR, CoreName2);
+	pthread_mutex_unlock(&net_lock);
 
-		time_t t = time(NULL);
-		struct tm tm = *localtime(&t);
-		char datecode[32] = {};
-		if (tm.tm_year >= 119) // 2019 or up considered valid time
-		{
-			strftime(datecode, 31, "%Y%m%d_%H%M%S", &tm);
-			snprintf(out_name, buflen, "%s/%s/%s-%s.png", SCREENSHOT_DIR, CoreName2, datecode, name[0] ? name : SCREENSHOT_DEFAULT);
-		}
-		else
-		{
-			for (int i = 1; i < 10000; i++)
-			{
-				snprintf(out_name, buflen, "%s/%s/NODATE-%s_%04d.png", SCREENSHOT_DIR, CoreName2, name[0] ? name : SCREENSHOT_DEFAULT, i);
-				if (!getFileType(out_name)) return;
-			}
-		}
+	int ret = stat64(path, st);
+	int err = errno;
+
+	pthread_mutex_lock(&net_lock);
+	if (!ret || err == ENOENT || err == ENOTDIR) net_put(key, !ret, st);
+	pthread_mutex_unlock(&net_lock);
+
+	errno = err;
+	return ret;
+}
+
+// The path was created, changed or removed through file_io
+static void net_forget(const char *path)
+{
+	pthread_mutex_lock(&net_lock);
+	if (!net_stats.empty() || !net_dirs.empty())
+	{
+		std::string key = path;
+		std::string dir = net_parent(key, NULL);
+		net_stats.erase(key);
+		net_stats.erase(dir);
+		net_dirs.erase(key);
+		net_dirs.erase(dir);
 	}
+	pthread_mutex_unlock(&net_lock);
 }
 
-void FileGenerateSavePath(const char *name, char* out_name, int ext_replace)
+// Larger kernel read-ahead, smaller files are fetched whole in the background
+static void net_prefetch(int fd, const char *path, __off64_t size)
 {
-	create_path(SAVE_DIR, CoreName2);
+	if (!is_network_fs(path)) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (size > NET_PREFETCH_MAX) return;
 
-	sprintf(out_name, "%s/%s/", SAVE_DIR, CoreName2);
-	char *fname = out_name + strlen(out_name);
+	int pfd = dup(fd);
+	if (pfd < 0) return;
 
-	const char *p = strrchr(name, '/');
-	if (p)
-	{
-		strcat(fname, p+1);
-	}
-	else
+	OffloadHandle h = offload_try_submit([pfd]()
 	{
-		strcat(fname, name);
-	}
+		posix_fadvise(pfd, 0, 0, POSIX_FADV_WILLNEED);
+		close(pfd);
+	}, OFFLOAD_PRIO_BACKGROUND);
+	if (!h.valid()) close(pfd);
+}
 
-	char *e = strrchr(fname, '.');
-	if (ext_replace && e)
+static char* make_fullpath(const char *path, int mode = 0)
+{
+	if (path[0] != '/')
 	{
-		strcpy(e,".sav");
+		sprintf(full_path, "%s/%s", (mode == -1) ? "" : getRootDir(), path);
 	}
 	else
 	{
-		strcat(fname, ".sav");
+		sprintf(full_path, "%s",path);
 	}
 
-	printf("SavePath=%s\n", out_name);
+	return full_path;
 }
 
-void FileGenerateSavestatePath(const char *name, char* out_name, int sufx)
+static int get_stmode(const char *path)
 {
-	const char *subdir = is_arcade() ? "Arcade" : CoreName2;
-
-	create_path(SAVESTATE_DIR, subdir);
-
-	sprintf(out_name, "%s/%s/", SAVESTATE_DIR, subdir);
-	char *fname = out_name + strlen(out_name);
-
-	const char *p = strrchr(name, '/');
-	if (p)
-	{
-		strcat(fname, p + 1);
-	}
-	else
-	{
-		strcat(fname, name);
-	}
-
-	char *e = strrchr(fname, '.');
-	if (e) e[0] = 0;
-
-	if(sufx) sprintf(e, "_%d.ss", sufx);
-	else strcat(e, ".ss");
+	struct stat64 st;
+	return (net_stat(path, &st, 1) < 0) ? 0 : st.st_mode;
 }
 
-uint32_t getFileType(const char *name)
+struct stat64* getPathStat(const char *path)
 {
-	make_fullpath(name);
-
-	struct stat64 st;
-	if (stat64(full_path, &st)) return 0;
-
-	return st.st_mode;
+	make_fullpath(path);
+	static thread_local struct stat64 st;
+	return (net_stat(full_path, &st, 0) >= 0) ? &st : NULL;
 }
 
-int findPrefixDir(char *dir, size_t dir_len)
+static int isPathDirectory(const char *path, int use_zip = 1)
 {
-	// Searches for the core's folder in the following order:
-	// /media/usb<0..5>
-	// /media/usb<0..5>/games
-	// /media/network
-	// /media/network/games
-	// /media/fat/cifs
-	// /media/fat/cifs/games
-	// /media/fat
-	// /media/fat/games/
-	// if the core folder is not found anywhere,
-	// it will be created in /media/fat/games/<dir>
-	static char temp_dir[1024];
+	make_fullpath(path);
 
-	// Usb<0..5>
-	for (int x = 0; x < 6; x++) {
-		snprintf(temp_dir, 1024, "%s%d/%s", "../usb", x, dir);
-		if (isPathDirectory(temp_dir)) {
-			printf("Found USB dir: %s\n", temp_dir);
-			strncpy(dir, temp_dir, dir_len);
+	char *zip_path, *file_path;
+	if (use_zip && FileIsZipped(full_path, &zip_path, &file_path))
+	{
+		if (!*file_path)
+		{
 			return 1;
 		}
 
-		snprintf(temp_dir, 1024, "%s%d/%s/%s", "../usb", x, GAMES_DIR, dir);
-		if (isPathDirectory(temp_dir)) {
-			printf("Found USB dir: %s\n", temp_dir);
-			strncpy(dir, temp_dir, dir_len);
+		mz_zip_archive *z = OpenZipfileCached(full_path, 0);
+		if (!z)
+		{
+			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path, zip_cache_error_string());
+			return 0;
+		}
+
+		// Folder names always end with a slash in the zip
+		// file central directory.
+		strcat(file_path, "/");
+
+		// Some zip files don't have directory entries
+		// Use the locate_file call to try and find the directory entry first, since
+		// this is a binary search (usually) If that fails then scan for the first
+		// entry that starts with file_path
+
+		const int file_index = zip_cache_locate(last_zip.entry, file_path);
+		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(z, file_index))
+		{
 			return 1;
 		}
-	}
 
-	// Network share in /media/network/
-	snprintf(temp_dir, 1024, "%s/%s", "../network", dir);
-	if (isPathDirectory(temp_dir)) {
-		printf("Found network dir: %s\n", temp_dir);
-		strncpy(dir, temp_dir, dir_len);
-		return 1;
+		for (size_t i = 0; i < mz_zip_reader_get_num_files(z); i++)
+		{
+			char zip_fname[256];
+			mz_zip_reader_get_filename(z, i, &zip_fname[0], sizeof(zip_fname));
+			if (strcasestr(zip_fname, file_path))
+			{
+				return 1;
+			}
+		}
+		return 0;
 	}
+	else
+	{
+		int stmode = get_stmode(full_path);
+		if (!stmode)
+		{
+			//printf("isPathDirectory(stat) path: %s, error: %s.\n", full_path, strerror(errno));
+			return 0;
+		}
 
-	// Network share in /media/network/games
-	snprintf(temp_dir, 1024, "%s/%s/%s", "../network", GAMES_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
-		printf("Found network dir: %s\n", temp_dir);
-		strncpy(dir, temp_dir, dir_len);
-		return 1;
+		if (stmode & S_IFDIR) return 1;
 	}
 
-	// CIFS_DIR directory in /media/fat/cifs
-	snprintf(temp_dir, 1024, "%s/%s", CIFS_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
-		printf("Found CIFS dir: %s\n", temp_dir);
-		strncpy(dir, temp_dir, dir_len);
-		return 1;
-	}
+	return 0;
+}
 
-	// CIFS_DIR/GAMES_DIR directory in /media/fat/cifs/games
-	snprintf(temp_dir, 1024, "%s/%s/%s", CIFS_DIR, GAMES_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
-		printf("Found CIFS dir: %s\n", temp_dir);
-		strncpy(dir, temp_dir, dir_len);
-		return 1;
-	}
+static int isPathRegularFile(const char *path, int use_zip = 1)
+{
+	make_fullpath(path);
 
-	// media/fat
-	if (isPathDirectory(dir)) {
-		printf("Found existing: %s\n", dir);
-		return 1;
-	}
+	char *zip_path, *file_path;
+	if (use_zip && FileIsZipped(full_path, &zip_path, &file_path))
+	{
+		//If there's no path into the zip file, don't bother opening it, we're a "directory"
+		if (!*file_path)
+		{
+			return 0;
+		}
+		mz_zip_archive *z = OpenZipfileCached(full_path, 0);
+		if (!z)
+		{
+			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
+			//       zip_cache_error_string());
+			return 0;
+		}
+		const int file_index = zip_cache_locate(last_zip.entry, file_path);
+		if (file_index < 0)
+		{
+			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
+			//		 zip_path, file_path,
+			//		 mz_zip_get_error_string(mz_zip_get_last_error(&z)));
+			return 0;
+		}
 
-	// media/fat/GAMES_DIR
-	snprintf(temp_dir, 1024, "%s/%s", GAMES_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
-		printf("Found dir: %s\n", temp_dir);
-		strncpy(dir, temp_dir, dir_len);
-		return 1;
+		if (!mz_zip_reader_is_file_a_directory(z, file_index) && mz_zip_reader_is_file_supported(z, file_index))
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		if (get_stmode(full_path) & S_IFREG) return true;
 	}
 
 	return 0;
 }
 
-void prefixGameDir(char *dir, size_t dir_len)
+void FileClose(fileTYPE *file)
 {
-	if (!findPrefixDir(dir, dir_len))
+	if (file->zip)
 	{
-		static char temp_dir[1024];
+		if (file->zip->stream)
+		{
+			zip_stream_stop(file->zip->stream);
+		}
+		if (file->zip->iter)
+		{
+			mz_zip_reader_extract_iter_free(file->zip->iter);
+		}
+		zip_cache_release(file->zip->entry);
 
-		//FileCreatePath(GAMES_DIR);
-		snprintf(temp_dir, 1024, "%s/%s", GAMES_DIR, dir);
-		strncpy(dir, temp_dir, dir_len);
-		printf("Prefixed dir to %s\n", temp_dir);
+		delete file->zip;
 	}
-}
 
-static int device = 0;
-static int usbnum = 0;
-const char *getStorageDir(int dev)
-{
-	static char path[32];
-	if (!dev) return "/media/fat";
-	sprintf(path, "/media/usb%d", usbnum);
-	return path;
-}
+	if (file->zst)
+	{
+		zstd_close(file->zst);
+	}
 
-const char *getRootDir()
-{
-	return getStorageDir(device);
-}
+	if (file->ovl)
+	{
+		ovl_close(file->ovl);
+	}
 
-const char *getFullPath(const char *name)
-{
-	make_fullpath(name);
-	return full_path;
-}
+	if (file->map)
+	{
+		munmap(file->map, file->map_size);
+		file->map = nullptr;
+	}
 
-void setStorage(int dev)
-{
-	device = 0;
-	FileSave(CONFIG_DIR"/device.bin", &dev, sizeof(int));
-	fpga_load_rbf("menu.rbf");
-}
+	if (file->filp)
+	{
+		//printf("closing %p\n", file->filp);
+		if (file->once >= 0) posix_fadvise(fileno(file->filp), file->once, 0, POSIX_FADV_DONTNEED);
+		fclose(file->filp);
+		if (file->type == 1)
+		{
+			if (file->name[0] == '/')
+			{
+				shm_unlink(file->name);
+			}
+			file->type = 0;
+		}
+	}
 
-static int orig_device = 0;
-int getStorage(int from_setting)
-{
-	return from_setting ? orig_device : device;
+	file->zip = nullptr;
+	file->zst = nullptr;
+	file->ovl = nullptr;
+	file->filp = nullptr;
+	file->size = 0;
+	file->once = -1;
 }
 
-int isPathMounted(int n)
+int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 {
-	char path[32];
-	sprintf(path, "/media/usb%d", n);
+	make_fullpath(name);
+	FileClose(file);
+	file->mode = 0;
+	file->type = 0;
 
-	struct stat file_stat;
-	struct stat parent_stat;
+	char *p = strrchr(full_path, '/');
+	strcpy(file->name, (p) ? p + 1 : full_path);
 
-	if (-1 == stat(path, &file_stat))
+	char *zip_path, *file_path;
+	if (!FileIsZipped(full_path, &zip_path, &file_path))
 	{
-		printf("failed to stat %s\n", path);
+		printf("FileOpenZip: %s, is not a zip.\n", full_path);
 		return 0;
 	}
 
-	if (!(file_stat.st_mode & S_IFDIR))
+	file->zip = new fileZipArchive{};
+	file->zip->entry = zip_cache_open(zip_path, 0);
+	if (!file->zip->entry)
 	{
-		printf("%s is not a directory.\n", path);
+		printf("FileOpenZip(zip_cache_open) Zip:%s, error:%s\n", zip_path, zip_cache_error_string());
+		FileClose(file);
 		return 0;
 	}
+	file->zip->archive = &file->zip->entry->archive;
 
-	if (-1 == stat("/media", &parent_stat))
+	file->zip->index = -1;
+	if (crc32) file->zip->index = zip_cache_locate_crc(file->zip->entry, crc32);
+	if (file->zip->index < 0) file->zip->index = zip_cache_locate(file->zip->entry, file_path);
+	if (file->zip->index < 0)
 	{
-		printf("failed to stat /media\n");
+		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
+					zip_path, file_path,
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+		FileClose(file);
 		return 0;
 	}
 
-	if (file_stat.st_dev != parent_stat.st_dev ||
-		(file_stat.st_dev == parent_stat.st_dev &&
+	mz_zip_archive_file_stat s;
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
+	{
+		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
+					zip_path, file_path,
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+		FileClose(file);
+		return 0;
+	}
+	file->size = s.m_uncomp_size;
+
+	file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+	if (!file->zip->iter)
+	{
+		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
+					zip_path, file_path,
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+		FileClose(file);
+		return 0;
+	}
+
+	file->zip->offset = 0;
+	if (file->size >= ZIP_STREAM_MIN_SIZE) file->zip->stream = zip_stream_start(file->zip, file->size);
+	file->offset = 0;
+	file->mode = O_RDONLY;
+	return 1;
+}
+
+int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zip)
+{
+	WatchdogIo wd("open", name, 0, 0);
+	make_fullpath((char*)name, mode);
+	FileClose(file);
+	file->mode = 0;
+	file->type = 0;
+
+	char *p = strrchr(full_path, '/');
+	strcpy(file->name, (mode == -1) ? full_path : p + 1);
+
+	char *zip_path, *file_path;
+	if (use_zip && (mode != -1) && FileIsZipped(full_path, &zip_path, &file_path))
+	{
+		if (mode & O_RDWR || mode & O_WRONLY)
+		{
+			if(!mute) printf("FileOpenEx(mode) Zip:%s, writing to zipped files is not supported.\n",
+					 full_path);
+			return 0;
+		}
+
+		file->zip = new fileZipArchive{};
+		file->zip->entry = zip_cache_open(zip_path, 0);
+		if (!file->zip->entry)
+		{
+			if(!mute) printf("FileOpenEx(zip_cache_open) Zip:%s, error:%s\n", zip_path, zip_cache_error_string());
+			FileClose(file);
+			return 0;
+		}
+		file->zip->archive = &file->zip->entry->archive;
+
+		file->zip->index = zip_cache_locate(file->zip->entry, file_path);
+		if (file->zip->index < 0)
+		{
+			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
+					 zip_path, file_path,
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+			FileClose(file);
+			return 0;
+		}
+
+		mz_zip_archive_file_stat s;
+		if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
+		{
+			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
+					 zip_path, file_path,
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+			FileClose(file);
+			return 0;
+		}
+		file->size = s.m_uncomp_size;
+
+		file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+		if (!file->zip->iter)
+		{
+			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
+					 zip_path, file_path,
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+			FileClose(file);
+			return 0;
+		}
+		file->zip->offset = 0;
+		if (file->size >= ZIP_STREAM_MIN_SIZE) file->zip->stream = zip_stream_start(file->zip, file->size);
+		file->offset = 0;
+		file->mode = mode;
+	}
+	else
+	{
+		if (mode != -1 && (mode & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC))) net_forget(full_path);
+		int fd = (mode == -1) ? shm_open("/vdsk", O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0777) : open(full_path, mode | O_CLOEXEC, 0777);
+		if (fd <= 0)
+		{
+			if(!mute) printf("FileOpenEx(open) File:%s, error: %s.\n", full_path, strerror(errno));
+			return 0;
+		}
+		const char *fmode = mode & O_RDWR ? "w+" : "r";
+		file->filp = fdopen(fd, fmode);
+		if (!file->filp)
+		{
+			if(!mute) printf("FileOpenEx(fdopen) File:%s, error: %s.\n", full_path, strerror(errno));
+			close(fd);
+			return 0;
+		}
+
+		if (mode == -1)
+		{
+			file->type = 1;
+			file->size = 0;
+			file->offset = 0;
+			file->mode = O_CREAT | O_RDWR | O_TRUNC;
+		}
+		else
+		{
+			struct stat64 st;
+			int ret = fstat64(fileno(file->filp), &st);
+			if (ret < 0)
+			{
+				if (!mute) printf("FileOpenEx(fstat) File:%s, error: %d.\n", full_path, ret);
+				FileClose(file);
+				return 0;
+			}
+
+			file->size = st.st_size;
+			if (st.st_rdev && !st.st_size)  //for special files we need an ioctl call to get the correct size
+			{
+				unsigned long long blksize;
+				int ret = ioctl(fd, BLKGETSIZE64, &blksize);
+				if (ret < 0)
+				{
+					if (!mute) printf("FileOpenEx(ioctl) File:%s, error: %d.\n", full_path, ret);
+					FileClose(file);
+					return 0;
+				}
+				file->size = blksize;
+			}
+
+			file->offset = 0;
+			file->mode = mode;
+			if (!(mode & (O_RDWR | O_WRONLY)) && S_ISREG(st.st_mode)) net_prefetch(fd, full_path, file->size);
+
+			const char *ext = strrchr(file->name, '.');
+			if (!(mode & (O_RDWR | O_WRONLY)) && S_ISREG(st.st_mode) && ext && !strcasecmp(ext, ".zst"))
+			{
+				__off64_t size = 0;
+				int zfd = dup(fd);
+				if (zfd >= 0)
+				{
+					fcntl(zfd, F_SETFD, FD_CLOEXEC);
+					file->zst = zstd_open(zfd, file->size, &size);
+					if (file->zst)
+					{
+						fclose(file->filp);
+						file->filp = nullptr;
+						file->size = size;
+					}
+					else
+					{
+						close(zfd);
+					}
+				}
+			}
+			else if (S_ISREG(st.st_mode) && strcasestr(file->name, ".ovl"))
+			{
+				int ofd = dup(fd);
+				if (ofd >= 0)
+				{
+					fcntl(ofd, F_SETFD, FD_CLOEXEC);
+					file->ovl = ovl_open(ofd);
+					if (file->ovl)
+					{
+						fclose(file->filp);
+						file->filp = nullptr;
+						file->size = file->ovl->size;
+					}
+					else
+					{
+						close(ofd);
+						if (!mute) printf("FileOpenEx: %s is not a usable overlay.\n", file->name);
+						FileClose(file);
+						return 0;
+					}
+				}
+			}
+		}
+	}
+
+	//printf("opened %s, size %llu\n", full_path, file->size);
+	return 1;
+}
+
+__off64_t FileGetSize(fileTYPE *file)
+{
+	if (file->filp)
+	{
+		struct stat64 st;
+		if (fstat64(fileno(file->filp), &st) < 0) return 0;
+
+		if (st.st_rdev && !st.st_size)  //for special files we need an ioctl call to get the correct size
+		{
+			unsigned long long blksize;
+			int ret = ioctl(fileno(file->filp), BLKGETSIZE64, &blksize);
+			if (ret < 0) return 0;
+			return blksize;
+		}
+
+		return st.st_size;
+	}
+	else if (file->zip || file->zst || file->ovl)
+	{
+		return file->size;
+	}
+	return 0;
+}
+
+int FileOpen(fileTYPE *file, const char *name, char mute)
+{
+	return FileOpenEx(file, name, O_RDONLY, mute);
+}
+
+int FileSeek(fileTYPE *file, __off64_t offset, int origin)
+{
+	if (file->filp)
+	{
+		__off64_t res = fseeko64(file->filp, offset, origin);
+		if (res < 0)
+		{
+			printf("Fail to seek the file: offset=%lld, %s.\n", offset, file->name);
+			return 0;
+		}
+		offset = ftello64(file->filp);
+	}
+	else if (file->zst || file->ovl)
+	{
+		__off64_t *pos = file->zst ? &file->zst->offset : &file->ovl->offset;
+		if (origin == SEEK_CUR) offset += *pos;
+		else if (origin == SEEK_END) offset += file->size;
+
+		if (offset < 0 || offset > file->size)
+		{
+			printf("FileSeek: offset %lld is out of %s.\n", offset, file->name);
+			return 0;
+		}
+		*pos = offset;
+	}
+	else if (file->zip)
+	{
+		if (origin == SEEK_CUR)
+		{
+			offset = file->zip->offset + offset;
+		}
+		else if (origin == SEEK_END)
+		{
+			offset = file->size - offset;
+		}
+
+		if (file->zip->stream)
+		{
+			if (offset < 0 || offset > file->size)
+			{
+				printf("FileSeek: offset %lld is out of %s.\n", offset, file->name);
+				return 0;
+			}
+
+			zip_stream_seek(file->zip->stream, offset);
+			file->zip->offset = offset;
+		}
+		else if (offset < file->zip->offset)
+		{
+			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+			if (!iter)
+			{
+				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+				return 0;
+			}
+
+			mz_zip_reader_extract_iter_free(file->zip->iter);
+			file->zip->iter = iter;
+			file->zip->offset = 0;
+		}
+
+		static thread_local char buf[4*1024];
+		while (!file->zip->stream && file->zip->offset < offset)
+		{
+			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
+			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
+			file->zip->offset += read_len;
+			if (read_len < want_len)
+			{
+				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+				return 0;
+			}
+		}
+	}
+	else
+	{
+		return 0;
+	}
+
+	file->offset = offset;
+	return 1;
+}
+
+int FileSeekLBA(fileTYPE *file, uint32_t offset)
+{
+	__off64_t off64 = offset;
+	off64 <<= 9;
+	return FileSeek(file, off64, SEEK_SET);
+}
+
+// Read with offset advancing
+#define FILE_ONCE_STEP (2 * 1024 * 1024) // dropped at once
+
+// pages up to end are consumed
+static void file_drop_read(fileTYPE *file, __off64_t end)
+{
+	end &= ~(__off64_t)4095;
+	if (end < file->once) file->once = end; // seeked back
+	if (end - file->once < FILE_ONCE_STEP) return;
+
+	posix_fadvise(fileno(file->filp), file->once, end - file->once, POSIX_FADV_DONTNEED);
+	file->once = end;
+}
+
+void FileReadOnce(fileTYPE *file)
+{
+	if (!file->filp || (file->mode & (O_RDWR | O_WRONLY)) || file->size < FILE_ONCE_MIN) return;
+
+	int fd = fileno(file->filp);
+	struct stat64 st;
+	if (fstat64(fd, &st) || !S_ISREG(st.st_mode)) return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	file->once = file->offset & ~(__off64_t)4095;
+}
+
+int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	WatchdogIo wd("read", file->name, file->offset, length);
+	ssize_t ret = 0;
+
+	if (file->filp)
+	{
+		ret = fread(pBuffer, 1, length, file->filp);
+		if (ret < 0)
+		{
+			printf("FileReadAdv error(%d).\n", ret);
+			return failres;
+		}
+		if (file->once >= 0) file_drop_read(file, file->offset + ret);
+	}
+	else if (file->zip)
+	{
+		if (file->zip->stream) ret = zip_stream_read(file->zip->stream, pBuffer, length);
+		else ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
+		if (!ret)
+		{
+			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
+			       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+			return failres;
+		}
+		file->zip->offset += ret;
+	}
+	else if (file->zst)
+	{
+		ret = zstd_read(file->zst, pBuffer, length);
+		if (!ret && length)
+		{
+			printf("FileReadAdv(zstd) Failed to read %s at %lld.\n", file->name, file->zst->offset);
+			return failres;
+		}
+	}
+	else if (file->ovl)
+	{
+		ret = ovl_read(file->ovl, pBuffer, length);
+		if (!ret && length)
+		{
+			printf("FileReadAdv(overlay) Failed to read %s at %lld.\n", file->name, file->ovl->offset);
+			return failres;
+		}
+	}
+	else
+	{
+		printf("FileReadAdv error(unknown file type).\n");
+		return failres;
+	}
+
+	file->offset += ret;
+	return ret;
+}
+
+#define FILE_MAP_WINDOW (16 * 1024 * 1024)
+#define FILE_MAP_HINT   (1024 * 1024)
+
+const void *FileMapRead(fileTYPE *file, __off64_t offset, int length)
+{
+	if (!file->filp || length <= 0 || length > FILE_MAP_WINDOW / 2 || offset < 0 || offset + length > file->size) return NULL;
+
+	if (!file->map || offset < file->map_offset || offset + length > file->map_offset + file->map_size)
+	{
+		if (file->map) munmap(file->map, file->map_size);
+		file->map = nullptr;
+
+		// Windows overlap by half, so any request fits into one
+		__off64_t start = offset & ~(__off64_t)(FILE_MAP_WINDOW / 2 - 1);
+		uint32_t size = (file->size - start < FILE_MAP_WINDOW) ? (uint32_t)(file->size - start) : FILE_MAP_WINDOW;
+
+		void *map = mmap64(NULL, size, PROT_READ, MAP_SHARED, fileno(file->filp), start);
+		if (map == MAP_FAILED)
+		{
+			printf("FileMapRead(mmap) File:%s, error: %s.\n", file->name, strerror(errno));
+			return NULL;
+		}
+
+		madvise(map, size, MADV_SEQUENTIAL);
+		file->map = map;
+		file->map_offset = start;
+		file->map_hint = start;
+		file->map_size = size;
+	}
+
+	// Ask for the pages ahead, once per hint block
+	if (offset + length + FILE_MAP_HINT / 2 > file->map_hint)
+	{
+		__off64_t hint = (offset > file->map_hint) ? (offset & ~(__off64_t)4095) : file->map_hint;
+		__off64_t end = file->map_offset + file->map_size;
+		__off64_t len = (end - hint < FILE_MAP_HINT) ? end - hint : FILE_MAP_HINT;
+		if (len > 0) madvise((uint8_t*)file->map + (hint - file->map_offset), len, MADV_WILLNEED);
+		file->map_hint = hint + len;
+	}
+
+	return (uint8_t*)file->map + (offset - file->map_offset);
+}
+
+int FileReadSec(fileTYPE *file, void *pBuffer)
+{
+	return FileReadAdv(file, pBuffer, 512);
+}
+
+// Write with offset advancing
+int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	WatchdogIo wd("write", file->name, file->offset, length);
+	int ret;
+
+	if (file->filp)
+	{
+		ret = fwrite(pBuffer, 1, length, file->filp);
+		fflush(file->filp);
+
+		if (ret < 0)
+		{
+			printf("FileWriteAdv error(%d).\n", ret);
+			return failres;
+		}
+
+		file->offset += ret;
+		if (file->offset > file->size) file->size = FileGetSize(file);
+		return ret;
+	}
+	else if (file->ovl)
+	{
+		ret = ovl_write(file->ovl, pBuffer, length);
+		if (ret < length)
+		{
+			printf("FileWriteAdv(overlay) Failed to write %s at %lld: %s.\n", file->name, file->ovl->offset, strerror(errno));
+			if (!ret) return failres;
+		}
+
+		file->offset += ret;
+		return ret;
+	}
+	else if (file->zip || file->zst)
+	{
+		printf("FileWriteAdv error(not supported for zip/zst).\n");
+		return failres;
+	}
+	else
+	{
+		printf("FileWriteAdv error(unknown file type).\n");
+		return failres;
+	}
+}
+
+int FileSync(fileTYPE *file)
+{
+	if (file->ovl) return !fdatasync(file->ovl->fd);
+	if (!file->filp) return 0;
+
+	fflush(file->filp);
+	if (fsync(fileno(file->filp)) < 0)
+	{
+		printf("FileSync error: %s.\n", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+int FileWriteSec(fileTYPE *file, void *pBuffer)
+{
+	return FileWriteAdv(file, pBuffer, 512);
+}
+
+int FileSave(const char *name, void *pBuffer, int size)
+{
+	make_fullpath(name);
+
+	int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("FileSave(open) File:%s, error: %d.\n", full_path, fd);
+		return 0;
+	}
+
+	int ret = write(fd, pBuffer, size);
+	close(fd);
+
+	if (ret < 0)
+	{
+		printf("FileSave(write) File:%s, error: %d.\n", full_path, ret);
+		return 0;
+	}
+
+	return ret;
+}
+
+int FileDelete(const char *name)
+{
+	make_fullpath(name);
+	printf("delete %s\n", full_path);
+	net_forget(full_path);
+	return !unlink(full_path);
+}
+
+int DirDelete(const char *name)
+{
+	make_fullpath(name);
+	printf("rmdir %s\n", full_path);
+	net_forget(full_path);
+	return !rmdir(full_path);
+}
+
+const char* GetNameFromPath(char *path)
+{
+	static thread_local char res[32];
+
+	char* p = strrchr(path, '/');
+	if (!p) p = path;
+	else p++;
+
+	if (strlen(p) < 19) strcpy(res, p);
+	else
+	{
+		strncpy(res, p, 19);
+		res[19] = 0;
+	}
+
+	return res;
+}
+
+int FileLoad(const char *name, void *pBuffer, int size)
+{
+	fileTYPE f;
+	if (!FileOpen(&f, name)) return 0;
+
+	int ret = f.size;
+	if (pBuffer) ret = FileReadAdv(&f, pBuffer, size ? size : f.size);
+
+	FileClose(&f);
+	return ret;
+}
+
+int FileLoadConfig(const char *name, void *pBuffer, int size)
+{
+	char path[256] = { CONFIG_DIR"/" };
+	strcat(path, name);
+
+	int ret = cfg_store_load(path, pBuffer, size);
+	return (ret >= 0) ? ret : FileLoad(path, pBuffer, size);
+}
+
+int FileSaveConfig(const char *name, void *pBuffer, int size)
+{
+	char path[256] = { CONFIG_DIR };
+	const char *p;
+	while ((p = strchr(name, '/')))
+	{
+		strcat(path, "/");
+		strncat(path, name, p - name);
+		name = ++p;
+		FileCreatePath(path);
+	}
+
+	strcat(path, "/");
+	strcat(path, name);
+	return cfg_store_save(path, pBuffer, size);
+}
+
+int FileDeleteConfig(const char *name)
+{
+	char path[256] = { CONFIG_DIR"/" };
+	strcat(path, name);
+	cfg_store_drop(path);
+	return FileDelete(path);
+}
+
+int FileExists(const char *name, int use_zip)
+{
+	return isPathRegularFile(name, use_zip);
+}
+
+int PathIsDir(const char *name, int use_zip)
+{
+	return isPathDirectory(name, use_zip);
+}
+
+int FileCanWrite(const char *name)
+{
+	make_fullpath(name);
+
+	if (FileIsZipped(full_path, nullptr, nullptr))
+	{
+		return 0;
+	}
+
+	struct stat64 st;
+	int ret = net_stat(full_path, &st, 0);
+	if (ret < 0)
+	{
+		printf("FileCanWrite(stat) File:%s, error: %d.\n", full_path, ret);
+		return 0;
+	}
+
+	//printf("FileCanWrite: mode=%04o.\n", st.st_mode);
+	return ((st.st_mode & S_IWUSR) != 0);
+}
+
+void create_path(const char *base_dir, const char* sub_dir)
+{
+	make_fullpath(base_dir);
+	net_forget(full_path);
+	mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+	strcat(full_path, "/");
+	strcat(full_path, sub_dir);
+	net_forget(full_path);
+	mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+}
+
+int FileCreatePath(const char *dir)
+{
+	int res = 1;
+	if (!isPathDirectory(dir)) {
+		make_fullpath(dir);
+		net_forget(full_path);
+		res = !mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+	}
+	return res;
+}
+
+void FileGenerateScreenshotName(const char *name, char *out_name, int buflen)
+{
+	// If the name ends with .png then don't modify it
+	if( !strcasecmp(name + strlen(name) - 4, ".png") )
+	{
+		const char *p = strrchr(name, '/');
+		make_fullpath(SCREENSHOT_DIR);
+		if( p )
+		{
+			snprintf(out_name, buflen, "%s%s", SCREENSHOT_DIR, p);
+		}
+		else
+		{
+			snprintf(out_name, buflen, "%s/%s", SCREENSHOT_DIR, name);
+		}
+	}
+	else
+	{
+		create_path(SCREENSHOT_DIR, CoreName2);
+
+		time_t t = time(NULL);
+		struct tm tm = *localtime(&t);
+		char datecode[32] = {};
+		if (tm.tm_year >= 119) // 2019 or up considered valid time
+		{
+			strftime(datecode, 31, "%Y%m%d_%H%M%S", &tm);
+			snprintf(out_name, buflen, "%s/%s/%s-%s.png", SCREENSHOT_DIR, CoreName2, datecode, name[0] ? name : SCREENSHOT_DEFAULT);
+		}
+		else
+		{
+			for (int i = 1; i < 10000; i++)
+			{
+				snprintf(out_name, buflen, "%s/%s/NODATE-%s_%04d.png", SCREENSHOT_DIR, CoreName2, name[0] ? name : SCREENSHOT_DEFAULT, i);
+				if (!getFileType(out_name)) return;
+			}
+		}
+	}
+}
+
+void FileGenerateSavePath(const char *name, char* out_name, int ext_replace)
+{
+	create_path(SAVE_DIR, CoreName2);
+
+	sprintf(out_name, "%s/%s/", SAVE_DIR, CoreName2);
+	char *fname = out_name + strlen(out_name);
+
+	const char *p = strrchr(name, '/');
+	if (p)
+	{
+		strcat(fname, p+1);
+	}
+	else
+	{
+		strcat(fname, name);
+	}
+
+	char *e = strrchr(fname, '.');
+	if (ext_replace && e)
+	{
+		strcpy(e,".sav");
+	}
+	else
+	{
+		strcat(fname, ".sav");
+	}
+
+	printf("SavePath=%s\n", out_name);
+}
+
+void FileGenerateSavestatePath(const char *name, char* out_name, int sufx)
+{
+	const char *subdir = is_arcade() ? "Arcade" : CoreName2;
+
+	create_path(SAVESTATE_DIR, subdir);
+
+	sprintf(out_name, "%s/%s/", SAVESTATE_DIR, subdir);
+	char *fname = out_name + strlen(out_name);
+
+	const char *p = strrchr(name, '/');
+	if (p)
+	{
+		strcat(fname, p + 1);
+	}
+	else
+	{
+		strcat(fname, name);
+	}
+
+	char *e = strrchr(fname, '.');
+	if (e) e[0] = 0;
+
+	if(sufx) sprintf(e, "_%d.ss", sufx);
+	else strcat(e, ".ss");
+}
+
+uint32_t getFileType(const char *name)
+{
+	make_fullpath(name);
+
+	struct stat64 st;
+	if (net_stat(full_path, &st, 0)) return 0;
+
+	return st.st_mode;
+}
+
+int findPrefixDir(char *dir, size_t dir_len)
+{
+	// Searches for the core's folder in the following order:
+	// /media/usb<0..5>
+	// /media/usb<0..5>/games
+	// /media/network
+	// /media/network/games
+	// /media/fat/cifs
+	// /media/fat/cifs/games
+	// /media/fat
+	// /media/fat/games/
+	// if the core folder is not found anywhere,
+	// it will be created in /media/fat/games/<dir>
+	char temp_dir[1024];
+
+	// Usb<0..5>
+	for (int x = 0; x < 6; x++) {
+		snprintf(temp_dir, 1024, "%s%d/%s", "../usb", x, dir);
+		if (isPathDirectory(temp_dir)) {
+			printf("Found USB dir: %s\n", temp_dir);
+			strncpy(dir, temp_dir, dir_len);
+			return 1;
+		}
+
+		snprintf(temp_dir, 1024, "%s%d/%s/%s", "../usb", x, GAMES_DIR, dir);
+		if (isPathDirectory(temp_dir)) {
+			printf("Found USB dir: %s\n", temp_dir);
+			strncpy(dir, temp_dir, dir_len);
+			return 1;
+		}
+	}
+
+	// Network share in /media/network/
+	snprintf(temp_dir, 1024, "%s/%s", "../network", dir);
+	if (isPathDirectory(temp_dir)) {
+		printf("Found network dir: %s\n", temp_dir);
+		strncpy(dir, temp_dir, dir_len);
+		return 1;
+	}
+
+	// Network share in /media/network/games
+	snprintf(temp_dir, 1024, "%s/%s/%s", "../network", GAMES_DIR, dir);
+	if (isPathDirectory(temp_dir)) {
+		printf("Found network dir: %s\n", temp_dir);
+		strncpy(dir, temp_dir, dir_len);
+		return 1;
+	}
+
+	// CIFS_DIR directory in /media/fat/cifs
+	snprintf(temp_dir, 1024, "%s/%s", CIFS_DIR, dir);
+	if (isPathDirectory(temp_dir)) {
+		printf("Found CIFS dir: %s\n", temp_dir);
+		strncpy(dir, temp_dir, dir_len);
+		return 1;
+	}
+
+	// CIFS_DIR/GAMES_DIR directory in /media/fat/cifs/games
+	snprintf(temp_dir, 1024, "%s/%s/%s", CIFS_DIR, GAMES_DIR, dir);
+	if (isPathDirectory(temp_dir)) {
+		printf("Found CIFS dir: %s\n", temp_dir);
+		strncpy(dir, temp_dir, dir_len);
+		return 1;
+	}
+
+	// media/fat
+	if (isPathDirectory(dir)) {
+		printf("Found existing: %s\n", dir);
+		return 1;
+	}
+
+	// media/fat/GAMES_DIR
+	snprintf(temp_dir, 1024, "%s/%s", GAMES_DIR, dir);
+	if (isPathDirectory(temp_dir)) {
+		printf("Found dir: %s\n", temp_dir);
+		strncpy(dir, temp_dir, dir_len);
+		return 1;
+	}
+
+	return 0;
+}
+
+void prefixGameDir(char *dir, size_t dir_len)
+{
+	if (!findPrefixDir(dir, dir_len))
+	{
+		char temp_dir[1024];
+
+		//FileCreatePath(GAMES_DIR);
+		snprintf(temp_dir, 1024, "%s/%s", GAMES_DIR, dir);
+		strncpy(dir, temp_dir, dir_len);
+		printf("Prefixed dir to %s\n", temp_dir);
+	}
+}
+
+static int device = 0;
+static int usbnum = 0;
+const char *getStorageDir(int dev)
+{
+	static thread_local char path[32];
+	if (!dev) return "/media/fat";
+	sprintf(path, "/media/usb%d", usbnum);
+	return path;
+}
+
+const char *getRootDir()
+{
+	return getStorageDir(device);
+}
+
+const char *getFullPath(const char *name)
+{
+	make_fullpath(name);
+	return full_path;
+}
+
+const char *getFullPath_r(const char *name, char *buf, size_t size)
+{
+	if (name[0] != '/') snprintf(buf, size, "%s/%s", getRootDir(), name);
+	else snprintf(buf, size, "%s", name);
+	return buf;
+}
+
+void setStorage(int dev)
+{
+	device = 0;
+	FileSave(CONFIG_DIR"/device.bin", &dev, sizeof(int));
+	fpga_load_rbf("menu.rbf");
+}
+
+static int orig_device = 0;
+int getStorage(int from_setting)
+{
+	return from_setting ? orig_device : device;
+}
+
+// Mount table read from /proc/self/mountinfo. The kernel flags the open file
+// (POLLPRI) on every mount and unmount, only then it's read again, so
+// checking the USB drives is a lookup and waiting for one is a poll().
+struct mount_entry_t
+{
+	std::string dir;
+	std::string fstype;
+};
+
+static std::vector<mount_entry_t> mounts;
+static int mounts_fd = -1;
+static bool mounts_valid = false;
+
+static void mounts_read()
+{
+	std::string buf;
+	char chunk[4096];
+	int len;
+
+	lseek(mounts_fd, 0, SEEK_SET);
+	while ((len = read(mounts_fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, len);
+
+	mounts.clear();
+	size_t pos = 0;
+	while (pos < buf.length())
+	{
+		size_t eol = buf.find('\n', pos);
+		if (eol == std::string::npos) eol = buf.length();
+		std::string line = buf.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		// id parent major:minor root mount_point options [optional fields] - fstype source super_options
+		char dir[1024], fstype[64];
+		size_t sep = line.find(" - ");
+		if (sep == std::string::npos) continue;
+		if (sscanf(line.c_str(), "%*s %*s %*s %*s %1023s", dir) != 1) continue;
+		if (sscanf(line.c_str() + sep + 3, "%63s", fstype) != 1) continue;
+
+		// spaces and such are octal escaped
+		mount_entry_t m;
+		for (char *c = dir; *c; c++)
+		{
+			if (c[0] == '\\' && c[1] >= '0' && c[1] <= '3' && c[2] >= '0' && c[2] <= '7' && c[3] >= '0' && c[3] <= '7')
+			{
+				m.dir += (char)(((c[1] - '0') << 6) | ((c[2] - '0') << 3) | (c[3] - '0'));
+				c += 3;
+			}
+			else m.dir += *c;
+		}
+		m.fstype = fstype;
+		mounts.push_back(m);
+	}
+
+	mounts_valid = true;
+}
+
+// Reads the table again if it changed, waiting up to timeout_ms for a change.
+// Returns 1 if it was read, -1 without /proc (the mount points are checked instead).
+static int mounts_update(int timeout_ms)
+{
+	if (mounts_fd < 0)
+	{
+		mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (mounts_fd < 0)
+		{
+			if (timeout_ms) usleep(timeout_ms * 1000);
+			return -1;
+		}
+		mounts_valid = false;
+	}
+
+	if (mounts_valid)
+	{
+		struct pollfd pfd = { mounts_fd, POLLPRI, 0 };
+		if (poll(&pfd, 1, timeout_ms) <= 0 || !(pfd.revents & (POLLPRI | POLLERR))) return 0;
+	}
+
+	mounts_read();
+	return 1;
+}
+
+static int isPathMountedStat(int n)
+{
+	char path[32];
+	sprintf(path, "/media/usb%d", n);
+
+	struct stat file_stat;
+	struct stat parent_stat;
+
+	if (-1 == stat(path, &file_stat))
+	{
+		printf("failed to stat %s\n", path);
+		return 0;
+	}
+
+	if (!(file_stat.st_mode & S_IFDIR))
+	{
+		printf("%s is not a directory.\n", path);
+		return 0;
+	}
+
+	if (-1 == stat("/media", &parent_stat))
+	{
+		printf("failed to stat /media\n");
+		return 0;
+	}
+
+	if (file_stat.st_dev != parent_stat.st_dev ||
+		(file_stat.st_dev == parent_stat.st_dev &&
 			file_stat.st_ino == parent_stat.st_ino))
 	{
-		printf("%s IS a mountpoint.\n", path);
-		struct statfs fs_stat;
-		if (!statfs(path, &fs_stat))
+		printf("%s IS a mountpoint.\n", path);
+		struct statfs fs_stat;
+		if (!statfs(path, &fs_stat))
+		{
+			printf("%s is FS: 0x%08X\n", path, fs_stat.f_type);
+			if (fs_stat.f_type != EXT4_SUPER_MAGIC)
+			{
+				printf("%s is not EXT2/3/4.\n", path);
+				return 1;
+			}
+		}
+	}
+
+	printf("%s is NOT a VFAT mountpoint.\n", path);
+	return 0;
+}
+
+int isPathMounted(int n)
+{
+	if (mounts_update(0) < 0) return isPathMountedStat(n);
+
+	char path[32];
+	sprintf(path, "/media/usb%d", n);
+
+	// the last mount on a point is the one seen there
+	const mount_entry_t *m = NULL;
+	for (auto &e : mounts) if (e.dir == path) m = &e;
+
+	// the same as the statfs() check: anything but ext2/3/4
+	return m && strncmp(m->fstype.c_str(), "ext", 3);
+}
+
+int isUSBMounted()
+{
+	for (int i = 0; i < 4; i++)
+	{
+		if (isPathMounted(i))
+		{
+			usbnum = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void FindStorage(void)
+{
+	char str[128];
+	printf("Looking for root device...\n");
+	device = 0;
+	FileLoad(CONFIG_DIR"/device.bin", &device, sizeof(int));
+	orig_device = device;
+
+	if(device && !isUSBMounted())
+	{
+		uint8_t core_type = (fpga_core_id() & 0xFF);
+		if (core_type == CORE_TYPE_8BIT)
+		{
+			user_io_read_confstr();
+			user_io_read_core_name();
+		}
+
+		int saveddev = device;
+		device = 0;
+		cfg_parse();
+		device = saveddev;
+		video_init();
+		user_io_send_buttons(1);
+
+		printf("Waiting for USB...\n");
+		int btn = 0;
+		int done = 0;
+
+		OsdWrite(16, "", 1);
+		OsdWrite(17, "       www.MiSTerFPGA.org       ", 1);
+		OsdWrite(18, "", 1);
+
+		for (int i = 30; i >= 0; i--)
+		{
+			sprintf(str, "\n     Waiting for USB...\n\n             %d   \n\n\n  OSD/USER or ESC to cancel", i);
+			InfoMessage(str);
+			if (isUSBMounted())
+			{
+				done = 1;
+				break;
+			}
+
+			for (int i = 0; i < 10; i++)
+			{
+				btn = fpga_get_buttons();
+				if (!btn) btn = input_poll(1);
+				if (btn)
+				{
+					printf("Button has been pressed %d\n", btn);
+					InfoMessage("\n\n         Canceled!\n");
+					usleep(500000);
+					setStorage(0);
+					break;
+				}
+
+				// a mount wakes this up right away instead of at the next count
+				if (mounts_update(100) > 0 && isUSBMounted())
+				{
+					done = 1;
+					break;
+				}
+			}
+			if (done) break;
+		}
+
+		if (!done)
+		{
+			InfoMessage("\n\n     No USB storage found\n   Falling back to SD card\n");
+			usleep(2000000);
+			setStorage(0);
+		}
+	}
+
+	if (device)
+	{
+		printf("Using USB as a root device\n");
+	}
+	else
+	{
+		printf("Using SD card as a root device\n");
+	}
+
+	sprintf(full_path, "%s/" CONFIG_DIR, getRootDir());
+	DIR* dir = opendir(full_path);
+	if (dir) closedir(dir);
+	else if (ENOENT == errno) mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+}
+
+// Sort key: ".." first, then folders, then files, each by display name
+// folded to lower case with digit runs compared by value ("Disk 2" before
+// "Disk 10"). A 3 letter extension of the display name is left out.
+// Digit runs are stored as '0', run length, digits without leading zeros,
+// so they still sort where a digit would. Returns the full key length,
+// the key is cut at size and zero padded.
+static int make_sort_key(const direntext_t *dext, uint8_t *key, int size)
+{
+	int n = 0;
+	key[n++] = (dext->de.d_type != DT_DIR) ? 2 : strcmp(dext->altname, "..") ? 1 : 0;
+
+	const char *name = dext->altname;
+	int len = strlen(name);
+	if ((len > 4) && (name[len - 4] == '.')) len -= 4;
+
+	for (int i = 0; i < len; i++)
+	{
+		uint8_t c = name[i];
+		if (c >= '0' && c <= '9')
 		{
-			printf("%s is FS: 0x%08X\n", path, fs_stat.f_type);
-			if (fs_stat.f_type != EXT4_SUPER_MAGIC)
+			while (i < len - 1 && name[i] == '0' && name[i + 1] >= '0' && name[i + 1] <= '9') i++;
+
+			int run = 0;
+			while (i + run < len && name[i + run] >= '0' && name[i + run] <= '9') run++;
+
+			if (n < size) key[n] = '0';
+			n++;
+			if (n < size) key[n] = '0' + MIN(run, 0xCF);
+			n++;
+			for (int j = 0; j < run; j++, n++) if (n < size) key[n] = name[i + j];
+			i += run - 1;
+		}
+		else
+		{
+			if (n < size) key[n] = tolower(c);
+			n++;
+		}
+	}
+
+	if (n < size) memset(key + n, 0, size - n);
+	return n;
+}
+
+static void set_sort_key(direntext_t *dext)
+{
+	make_sort_key(dext, dext->sortkey, sizeof(dext->sortkey));
+}
+
+static bool sort_less(const direntext_t &de1, const direntext_t &de2)
+{
+	int ret = memcmp(de1.sortkey, de2.sortkey, sizeof(de1.sortkey));
+	if (!ret)
+	{
+		// Long common prefix, compare the complete keys
+		uint8_t key1[640], key2[640];
+		int len1 = make_sort_key(&de1, key1, sizeof(key1));
+		int len2 = make_sort_key(&de2, key2, sizeof(key2));
+		ret = memcmp(key1, key2, MIN(len1, len2));
+		if (!ret) ret = len1 - len2;
+		if (!ret) ret = strcasecmp(de1.datecode, de2.datecode);
+	}
+
+	return ret < 0;
+}
+
+struct SortRef
+{
+	uint64_t prefix;
+	uint32_t index;
+};
+
+// Sorts compact references with the first 8 key bytes as an integer, most
+// compares never touch the entries, and moves every entry only once.
+static void flist_sort(DirentVector &items)
+{
+	std::vector<SortRef> refs(items.size());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		uint64_t prefix = 0;
+		for (int j = 0; j < 8; j++) prefix = (prefix << 8) | items[i].sortkey[j];
+		refs[i] = { prefix, (uint32_t)i };
+	}
+
+	size_t iterations = 0;
+	std::sort(refs.begin(), refs.end(), [&](const SortRef &a, const SortRef &b)
+	{
+#ifdef USE_SCHEDULER
+		if (++iterations % YieldIterations == 0)
+		{
+			scheduler_checkpoint();
+		}
+#endif
+		if (a.prefix != b.prefix) return a.prefix < b.prefix;
+		return sort_less(items[a.index], items[b.index]);
+	});
+
+	DirentVector sorted;
+	sorted.reserve(items.size());
+	for (auto &ref : refs) sorted.push_back(items[ref.index]);
+	items.swap(sorted);
+}
+
+void AdjustDirectory(char *path)
+{
+	if (!FileExists(path)) return;
+
+	char *p = strrchr(path, '/');
+	if (p)
+	{
+		*p = 0;
+	}
+	else
+	{
+		path[0] = 0;
+	}
+}
+
+static const char *GetRelativeFileName(const char *folder, const char *path)
+{
+	if (!*folder) return path;
+	if (strcasestr(path, folder) == path)
+	{
+		const char *subpath = path + strlen(folder);
+		if (*subpath == '/') return subpath + 1;
+	}
+	return NULL;
+}
+
+static bool IsInSameFolder(const char *folder, const char *path)
+{
+	const char *p = strrchr(path, '/');
+	size_t len = p ? p - path : 0;
+	return (strlen(folder) == len) && !strncasecmp(path, folder, len);
+}
+
+static int names_loaded = 0;
+static void get_display_name(direntext_t *dext, const char *ext, int options)
+{
+	static char *names = 0;
+	memcpy(dext->altname, dext->de.d_name, sizeof(dext->altname));
+	if (dext->de.d_type == DT_DIR) return;
+
+	int len = strlen(dext->altname);
+	int xml = (len > 4 && (!strcasecmp(dext->altname + len - 4, ".mgl") || !strcasecmp(dext->altname + len - 4, ".mra")));
+	int rbf = (len > 4 && !strcasecmp(dext->altname + len - 4, ".rbf"));
+	if (rbf || xml)
+	{
+		dext->altname[len - 4] = 0;
+		if (rbf)
+		{
+			char *p = strstr(dext->altname, "_20");
+			if (p) if (strlen(p + 3) < 6) p = 0;
+			if (p)
 			{
-				printf("%s is not EXT2/3/4.\n", path);
-				return 1;
+				*p = 0;
+				strncpy(dext->datecode, p + 3, 15);
+				dext->datecode[15] = 0;
+			}
+			else
+			{
+				strcpy(dext->datecode, "------");
+			}
+		}
+
+		if (!names_loaded)
+		{
+			if (names)
+			{
+				free(names);
+				names = 0;
+			}
+
+			int size = FileLoad("names.txt", 0, 0);
+			if (size)
+			{
+				names = (char*)malloc(size + 1);
+				if (names)
+				{
+					names[0] = 0;
+					FileLoad("names.txt", names, 0);
+					names[size] = 0;
+				}
+			}
+			names_loaded = 1;
+		}
+
+		if (names)
+		{
+			strcat(dext->altname, ":");
+			len = strlen(dext->altname);
+			char *transl = strstr(names, dext->altname);
+			if (transl)
+			{
+				int copy = 0;
+				transl += len;
+				len = 0;
+				while (*transl && len < (int)sizeof(dext->altname) - 1)
+				{
+					if (!copy && *transl <= 32)
+					{
+						transl++;
+						continue;
+					}
+
+					if (copy && *transl < 32) break;
+
+					copy = 1;
+					dext->altname[len++] = *transl++;
+				}
+				len++;
+			}
+
+			dext->altname[len - 1] = 0;
+		}
+		return;
+	}
+
+	//do not remove ext if core supplies more than 1 extension and it's not list of cores
+	if (!(options & SCANO_CORES) && strlen(ext) > 3) return;
+	if (strchr(ext, '*') || strchr(ext, '?')) return;
+
+	/* find the extension on the end of the name*/
+	char *fext = strrchr(dext->altname, '.');
+	if (fext) *fext = 0;
+}
+
+// Listings of real directories are kept in a small LRU so going back into a
+// folder doesn't read, stat and translate every entry again. Local storage is
+// watched with inotify. Network shares don't report remote changes that way,
+// so the directory mtime is compared there instead.
+#define DIR_CACHE_ENTRIES 8
+#define DIR_CACHE_ITEMS   16384
+
+struct DirCacheEntry
+{
+	std::string key;
+	DirentVector items;
+	int wd;
+	struct timespec mtime;
+	uint64_t used;
+	bool valid;
+};
+
+struct DirCacheState
+{
+	int wd;
+	struct timespec mtime;
+};
+
+static std::vector<DirCacheEntry> dir_cache;
+static int dir_cache_fd = -1;
+static uint64_t dir_cache_tick;
+
+static void dir_cache_unwatch(int wd)
+{
+	if (wd < 0) return;
+	for (auto &e : dir_cache) if (e.wd == wd) return;
+	inotify_rm_watch(dir_cache_fd, wd);
+}
+
+static void dir_cache_remove(size_t n)
+{
+	int wd = dir_cache[n].wd;
+	dir_cache.erase(dir_cache.begin() + n);
+	dir_cache_unwatch(wd);
+}
+
+static void dir_cache_drain()
+{
+	if (dir_cache_fd < 0) return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1)
+	{
+		int len = read(dir_cache_fd, buf, sizeof(buf));
+		if (len <= 0) break;
+
+		for (int i = 0; i < len;)
+		{
+			struct inotify_event *ev = (struct inotify_event *)(buf + i);
+			for (auto &e : dir_cache)
+			{
+				if (e.wd >= 0 && (e.wd == ev->wd || (ev->mask & IN_Q_OVERFLOW))) e.valid = false;
 			}
+			i += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+// Called before the directory is read, so changes made during the scan
+// invalidate the new entry instead of being lost.
+static void dir_cache_prepare(const char *path, DirCacheState *st)
+{
+	st->wd = -1;
+	st->mtime = {};
+
+	if (!is_network_fs(path))
+	{
+		if (dir_cache_fd < 0) dir_cache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (dir_cache_fd >= 0)
+		{
+			st->wd = inotify_add_watch(dir_cache_fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+				IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_ONLYDIR);
+		}
+	}
+
+	struct stat s;
+	if (st->wd < 0 && !stat(path, &s)) st->mtime = s.st_mtim;
+}
+
+static DirCacheEntry *dir_cache_get(const std::string &key, const char *path)
+{
+	dir_cache_drain();
+
+	for (size_t i = 0; i < dir_cache.size(); i++)
+	{
+		DirCacheEntry &e = dir_cache[i];
+		if (e.key != key) continue;
+
+		if (e.valid && e.wd < 0)
+		{
+			struct stat s;
+			e.valid = !stat(path, &s) && s.st_mtim.tv_sec == e.mtime.tv_sec && s.st_mtim.tv_nsec == e.mtime.tv_nsec;
+		}
+
+		if (!e.valid)
+		{
+			dir_cache_remove(i);
+			return NULL;
+		}
+
+		e.used = ++dir_cache_tick;
+		return &e;
+	}
+
+	return NULL;
+}
+
+static void dir_cache_put(const std::string &key, const DirCacheState *st, const DirentVector &items)
+{
+	for (size_t i = 0; i < dir_cache.size(); i++)
+	{
+		if (dir_cache[i].key == key)
+		{
+			dir_cache_remove(i);
+			break;
 		}
 	}
 
-	printf("%s is NOT a VFAT mountpoint.\n", path);
-	return 0;
-}
+	if (items.size() > DIR_CACHE_ITEMS || (st->wd < 0 && !st->mtime.tv_sec))
+	{
+		dir_cache_unwatch(st->wd);
+		return;
+	}
 
-int isUSBMounted()
-{
-	for (int i = 0; i < 4; i++)
+	while (!dir_cache.empty())
 	{
-		if (isPathMounted(i))
+		size_t total = items.size();
+		size_t lru = 0;
+		for (size_t i = 0; i < dir_cache.size(); i++)
 		{
-			usbnum = i;
-			return 1;
+			total += dir_cache[i].items.size();
+			if (dir_cache[i].used < dir_cache[lru].used) lru = i;
 		}
+
+		if (dir_cache.size() < DIR_CACHE_ENTRIES && total <= DIR_CACHE_ITEMS) break;
+		dir_cache_remove(lru);
 	}
-	return 0;
+
+	DirCacheEntry e;
+	e.key = key;
+	e.items = items;
+	e.wd = st->wd;
+	e.mtime = st->mtime;
+	e.used = ++dir_cache_tick;
+	e.valid = true;
+	dir_cache.push_back(std::move(e));
 }
 
-void FindStorage(void)
+// row < 0 puts the entry in the middle of the page, otherwise on that row
+static void flist_select_name(const char *name, int row = -1)
 {
-	char str[128];
-	printf("Looking for root device...\n");
-	device = 0;
-	FileLoad(CONFIG_DIR"/device.bin", &device, sizeof(int));
-	orig_device = device;
-
-	if(device && !isUSBMounted())
+	int pos = -1;
+	for (int i = 0; i < flist_nDirEntries(); i++)
 	{
-		uint8_t core_type = (fpga_core_id() & 0xFF);
-		if (core_type == CORE_TYPE_8BIT)
+		if (!strcmp(name, DirItem[i].de.d_name))
 		{
-			user_io_read_confstr();
-			user_io_read_core_name();
+			pos = i;
+			break;
+		}
+		else if (!strcasecmp(name, DirItem[i].de.d_name))
+		{
+			pos = i;
 		}
+	}
 
-		int saveddev = device;
-		device = 0;
-		cfg_parse();
-		device = saveddev;
-		video_init();
-		user_io_send_buttons(1);
+	if(pos>=0)
+	{
+		iSelectedEntry = pos;
+		if (row >= 0) iFirstEntry = std::min(iSelectedEntry - row, flist_nDirEntries() - OsdGetSize());
+		else if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
+		else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
+		if (iFirstEntry < 0) iFirstEntry = 0;
+	}
+}
 
-		printf("Waiting for USB...\n");
-		int btn = 0;
-		int done = 0;
+// Everything a directory entry is checked against, kept together so a
+// scan can be continued later from the background task.
+struct ScanCtx
+{
+	char path[1024];
+	char full_path[1024];
+	int path_len;
+	char extension[1024];
+	int extlen;
+	int options;
+	int has_trd;
+	char prefix[256];
+	char filter[256];
+	bool has_prefix;
+	bool has_filter;
+	const char *zip_folder;
+};
 
-		OsdWrite(16, "", 1);
-		OsdWrite(17, "       www.MiSTerFPGA.org       ", 1);
-		OsdWrite(18, "", 1);
+static void scan_entry(ScanCtx *ctx, struct dirent64 *de, mz_zip_archive *z, size_t i, DirentVector &items)
+{
+	const char *path = ctx->path;
+	char *full_path = ctx->full_path;
+	int path_len = ctx->path_len;
+	const char *extension = ctx->extension;
+	int extlen = ctx->extlen;
+	int options = ctx->options;
+	int has_trd = ctx->has_trd;
+	const char *prefix = ctx->has_prefix ? ctx->prefix : NULL;
+	const char *filter = ctx->has_filter ? ctx->filter : NULL;
+	int filterlen = strlen(ctx->filter);
+	const char *file_path_in_zip = ctx->zip_folder;
+
+		struct dirent64 _de = {};
+		int isZip = 0;
 
-		for (int i = 30; i >= 0; i--)
+		if (z)
 		{
-			sprintf(str, "\n     Waiting for USB...\n\n             %d   \n\n\n  OSD/USER or ESC to cancel", i);
-			InfoMessage(str);
-			if (isUSBMounted())
+			mz_zip_reader_get_filename(z, i, &_de.d_name[0], sizeof(_de.d_name));
+			const char *rname = GetRelativeFileName(file_path_in_zip, _de.d_name);
+			if (rname)
 			{
-				done = 1;
-				break;
+				const char *fslash = strchr(rname, '/');
+				if (fslash)
+				{
+					char dirname[256] = {};
+					strncpy(dirname, rname, fslash - rname);
+					if (rname[0] != '/' && !(DirNames.find(dirname) != DirNames.end()))
+					{
+						direntext_t dirext;
+						memset(&dirext, 0, sizeof(dirext));
+						strncpy(dirext.de.d_name, rname, fslash - rname);
+						dirext.de.d_type = DT_DIR;
+						memcpy(dirext.altname, dirext.de.d_name, sizeof(dirext.de.d_name));
+						set_sort_key(&dirext);
+						items.push_back(dirext);
+						DirNames.insert(dirname);
+					}
+				}
 			}
 
-			for (int i = 0; i < 10; i++)
+			if (!IsInSameFolder(file_path_in_zip, _de.d_name))
 			{
-				btn = fpga_get_buttons();
-				if (!btn) btn = input_poll(1);
-				if (btn)
+				return;
+			}
+
+			// Remove leading folders.
+			const char *subpath = _de.d_name + strlen(file_path_in_zip);
+			if (*subpath == '/') subpath++;
+			strcpy(_de.d_name, subpath);
+
+			de = &_de;
+
+			_de.d_type = mz_zip_reader_is_file_a_directory(z, i) ? DT_DIR : DT_REG;
+			if (_de.d_type == DT_DIR) {
+				// Remove trailing slash.
+				if (DirNames.find(_de.d_name) != DirNames.end())
 				{
-					printf("Button has been pressed %d\n", btn);
-					InfoMessage("\n\n         Canceled!\n");
-					usleep(500000);
-					setStorage(0);
-					break;
+					DirNames.insert(_de.d_name);
+					_de.d_name[strlen(_de.d_name) - 1] = '\0';
+				}
+				else
+				{
+					return;
 				}
-				usleep(100000);
 			}
-			if (done) break;
 		}
-
-		if (!done)
+		// Handle (possible) symbolic link type in the directory entry
+		else if (de->d_type == DT_LNK || de->d_type == DT_REG)
 		{
-			InfoMessage("\n\n     No USB storage found\n   Falling back to SD card\n");
-			usleep(2000000);
-			setStorage(0);
+			sprintf(full_path + path_len, "/%s", de->d_name);
+
+			struct stat entrystat;
+
+			if (!stat(full_path, &entrystat))
+			{
+				if (S_ISREG(entrystat.st_mode))
+				{
+					de->d_type = DT_REG;
+				}
+				else if (S_ISDIR(entrystat.st_mode))
+				{
+					de->d_type = DT_DIR;
+				}
+			}
 		}
-	}
 
-	if (device)
-	{
-		printf("Using USB as a root device\n");
-	}
-	else
-	{
-		printf("Using SD card as a root device\n");
-	}
+            if (filter)
+		{
+                bool passes_filter = false;
 
-	sprintf(full_path, "%s/" CONFIG_DIR, getRootDir());
-	DIR* dir = opendir(full_path);
-	if (dir) closedir(dir);
-	else if (ENOENT == errno) mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
-}
+                for(const char *str = de->d_name; *str; str++)
+			{
+                    if (strncasecmp(str, filter, filterlen) == 0)
+				{
+                        passes_filter = true;
+                        break;
+                    }
+                }
 
-struct DirentComp
-{
-	bool operator()(const direntext_t& de1, const direntext_t& de2)
-	{
+                if (!passes_filter) return;
+            }
 
-#ifdef USE_SCHEDULER
-		if (++iterations % YieldIterations == 0)
+
+		if (options & SCANO_NEOGEO)
 		{
-			scheduler_yield();
-		}
-#endif
+			if (de->d_type == DT_REG && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip"))
+			{
+				de->d_type = DT_DIR;
+			}
+
+			if (strcasecmp(de->d_name + strlen(de->d_name) - 4, ".neo"))
+			{
+				if (de->d_type != DT_DIR) return;
+			}
+
+			if (!strcmp(de->d_name, ".."))
+			{
+				if (!strlen(path)) return;
+			}
+			else
+			{
+				// skip hidden folders
+				if (!strncasecmp(de->d_name, ".", 1)) return;
+			}
 
-		if ((de1.de.d_type == DT_DIR) && !strcmp(de1.altname, "..")) return true;
-		if ((de2.de.d_type == DT_DIR) && !strcmp(de2.altname, "..")) return false;
+			direntext_t dext;
+			memset(&dext, 0, sizeof(dext));
+			memcpy(&dext.de, de, sizeof(dext.de));
+			memcpy(dext.altname, de->d_name, sizeof(dext.altname));
+			if (!strcasecmp(dext.altname + strlen(dext.altname) - 4, ".zip")) dext.altname[strlen(dext.altname) - 4] = 0;
 
-		if ((de1.de.d_type == DT_DIR) && (de2.de.d_type != DT_DIR)) return true;
-		if ((de1.de.d_type != DT_DIR) && (de2.de.d_type == DT_DIR)) return false;
+			full_path[path_len] = 0;
+			char *altname = neogeo_get_altname(full_path, dext.de.d_name, dext.altname);
+			if (altname)
+			{
+				if (altname == (char*)-1) return;
 
-		int len1 = strlen(de1.altname);
-		int len2 = strlen(de2.altname);
-		if ((len1 > 4) && (de1.altname[len1 - 4] == '.')) len1 -= 4;
-		if ((len2 > 4) && (de2.altname[len2 - 4] == '.')) len2 -= 4;
+				dext.de.d_type = DT_REG;
+				memcpy(dext.altname, altname, sizeof(dext.altname));
+			}
 
-		int len = (len1 < len2) ? len1 : len2;
-		int ret = strncasecmp(de1.altname, de2.altname, len);
-		if (!ret)
+			set_sort_key(&dext);
+			items.push_back(dext);
+		}
+		else
 		{
-			if(len1 != len2)
+			if (de->d_type == DT_DIR)
+			{
+				// skip System Volume Information folder
+				if (!strcmp(de->d_name, "System Volume Information")) return;
+				if (!strcmp(de->d_name, ".."))
+				{
+					if (!strlen(path)) return;
+				}
+				else
+				{
+					// skip hidden folder
+					if (!strncasecmp(de->d_name, ".", 1)) return;
+				}
+
+				if (!(options & SCANO_DIR))
+				{
+					if (de->d_name[0] != '_' && strcmp(de->d_name, "..")) return;
+					if (!(options & SCANO_CORES)) return;
+				}
+			}
+			else if (de->d_type == DT_REG)
+			{
+				// skip hidden files
+				if (!strncasecmp(de->d_name, ".", 1)) return;
+				//skip non-selectable files
+				if (!strcasecmp(de->d_name, "menu.rbf")) return;
+				if (!strncasecmp(de->d_name, "menu_20", 7)) return;
+				if (!strcasecmp(de->d_name, "boot.rom")) return;
+
+				//check the prefix if given
+				if (prefix && strncasecmp(prefix, de->d_name, strlen(prefix))) return;
+
+				if (extlen > 0)
+				{
+					const char *ext = extension;
+					int found = (has_trd && x2trd_ext_supp(de->d_name));
+					if (!found && !(options & SCANO_NOZIP) && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip") && (options & SCANO_DIR))
+					{
+						// Fake that zip-file is a directory.
+						de->d_type = DT_DIR;
+						isZip = 1;
+						found = 1;
+					}
+					if (!found && is_minimig() && !memcmp(extension, "HDF", 3))
+					{
+						found = !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".iso");
+					}
+
+					char *fext = strrchr(de->d_name, '.');
+					if (fext) fext++;
+					while (!found && *ext && fext)
+					{
+						char e[4];
+						memcpy(e, ext, 3);
+						if (e[2] == ' ')
+						{
+							e[2] = 0;
+							if (e[1] == ' ') e[1] = 0;
+						}
+
+						e[3] = 0;
+						found = 1;
+						for (int i = 0; i < 4; i++)
+						{
+							if (e[i] == '*') break;
+							if (e[i] == '?' && fext[i]) continue;
+
+							if (tolower(e[i]) != tolower(fext[i])) found = 0;
+
+							if (!e[i] || !found) break;
+						}
+						if (found) break;
+
+						if (strlen(ext) < 3) break;
+						ext += 3;
+					}
+					if (!found) return;
+				}
+			}
+			else
 			{
-				return len1 < len2;
+				return;
 			}
-			ret = strcasecmp(de1.datecode, de2.datecode);
+
+        {
+		      direntext_t dext;
+			    memset(&dext, 0, sizeof(dext));
+			    memcpy(&dext.de, de, sizeof(dext.de));
+			    if (isZip)
+			        dext.flags |= DT_EXT_ZIP;
+			    get_display_name(&dext, extension, options);
+			    set_sort_key(&dext);
+			    items.push_back(dext);
+        }
 		}
+}
 
-		return ret < 0;
+static void scan_ctx_init(ScanCtx *ctx, const char *path, const char *extension, int options, const char *prefix, const char *filter)
+{
+	snprintf(ctx->path, sizeof(ctx->path), "%s", path);
+	snprintf(ctx->full_path, sizeof(ctx->full_path), "%s/%s", getRootDir(), path);
+	ctx->path_len = strlen(ctx->full_path);
+
+	snprintf(ctx->extension, sizeof(ctx->extension), "%s", extension);
+	ctx->extlen = strlen(ctx->extension);
+	ctx->options = options;
+
+	ctx->has_trd = 0;
+	for (const char *ext = ctx->extension; *ext; ext += 3)
+	{
+		if (!strncasecmp(ext, "TRD", 3)) ctx->has_trd = 1;
+		if (strlen(ext) < 3) break;
 	}
 
-	size_t iterations = 0;
+	snprintf(ctx->prefix, sizeof(ctx->prefix), "%s", prefix ? prefix : "");
+	snprintf(ctx->filter, sizeof(ctx->filter), "%s", filter ? filter : "");
+	ctx->has_prefix = prefix != NULL;
+	ctx->has_filter = filter != NULL;
+	ctx->zip_folder = "";
+}
+
+// Streaming scans (SCANO_STREAM): once a page worth of entries is read and
+// the folder turns out to be slow, ScanDirectory returns with what it has and
+// the background task reads and sorts the rest. The complete list replaces
+// the partial one in a single step, keeping the selected entry on its row.
+#define SCAN_STREAM_MS 50
+
+struct ScanJob
+{
+	ScanCtx ctx;
+	DIR *d;
+	DirentVector items;
+	bool use_cache;
+	std::string cache_key;
+	DirCacheState cache_state;
+	char select[1024];
+	bool abort;
+	bool prewarm;
 };
 
-void AdjustDirectory(char *path)
+static ScanJob *scan_job;     // scan still running for the current listing
+static ScanJob *scan_running; // job the background task is working on
+static int scan_updated = 0;
+
+// Folders flist_prewarm() asked for, read by the background task when it has
+// nothing else to do. Only the listing cache gets the result.
+struct ScanPrewarm
 {
-	if (!FileExists(path)) return;
+	std::string path, extension;
+	int options;
+};
 
-	char *p = strrchr(path, '/');
-	if (p)
-	{
-		*p = 0;
-	}
-	else
+static std::vector<ScanPrewarm> scan_prewarm;
+
+static std::string dir_cache_key(const char *full_path, const char *extension, int options, const char *prefix, const char *filter)
+{
+	char opts[16];
+	snprintf(opts, sizeof(opts), "%d", options & ~SCANO_STREAM);
+	return std::string(full_path) + '\n' + extension + '\n' + opts + '\n' + (prefix ? prefix : "") + '\n' + (filter ? filter : "");
+}
+
+static void scan_job_free(ScanJob *job)
+{
+	if (job->d) closedir(job->d);
+	if (job->use_cache) dir_cache_unwatch(job->cache_state.wd);
+	delete job;
+}
+
+static void scan_job_cancel()
+{
+	if (!scan_job) return;
+
+	// The background task drops the job at its next step
+	if (scan_job == scan_running) scan_job->abort = true;
+	else scan_job_free(scan_job);
+	scan_job = NULL;
+}
+
+static void scan_job_finish()
+{
+	while (scan_job)
 	{
-		path[0] = 0;
+		scheduler_activity();
+		scheduler_yield();
 	}
 }
 
-static const char *GetRelativeFileName(const char *folder, const char *path)
+static void scan_job_publish(ScanJob *job)
 {
-	if (!*folder) return path;
-	if (strcasestr(path, folder) == path)
+	char name[sizeof(job->select)] = {};
+	int row = -1;
+	if (job->select[0])
 	{
-		const char *subpath = path + strlen(folder);
-		if (*subpath == '/') return subpath + 1;
+		strcpy(name, job->select);
 	}
-	return NULL;
+	else if (flist_nDirEntries())
+	{
+		strcpy(name, DirItem[iSelectedEntry].de.d_name);
+		row = iSelectedEntry - iFirstEntry;
+	}
+
+	if (job->use_cache) dir_cache_put(job->cache_key, &job->cache_state, job->items);
+	job->use_cache = false;
+
+	DirItem = std::move(job->items);
+	iSelectedEntry = 0;
+	iFirstEntry = 0;
+	if (name[0]) flist_select_name(name, row);
+
+	printf("Got %d dir entries\n", flist_nDirEntries());
+	scan_updated = 1;
+	menu_wake();
 }
 
-static bool IsInSameFolder(const char *folder, const char *path)
+void flist_prewarm(const char *path, const char *extension, int options)
 {
-	const char *p = strrchr(path, '/');
-	size_t len = p ? p - path : 0;
-	return (strlen(folder) == len) && !strncasecmp(path, folder, len);
+	for (auto &w : scan_prewarm) if (w.path == path && w.extension == extension && w.options == options) return;
+	scan_prewarm.push_back({ path, extension, options });
 }
 
-static int names_loaded = 0;
-static void get_display_name(direntext_t *dext, const char *ext, int options)
+// Job for the next prewarm request, NULL if its folder is cached already or can't be read
+static ScanJob *scan_prewarm_job()
 {
-	static char *names = 0;
-	memcpy(dext->altname, dext->de.d_name, sizeof(dext->altname));
-	if (dext->de.d_type == DT_DIR) return;
+	ScanPrewarm w = scan_prewarm.front();
+	scan_prewarm.erase(scan_prewarm.begin());
+
+	ScanJob *job = new ScanJob();
+	scan_ctx_init(&job->ctx, w.path.c_str(), w.extension.c_str(), w.options, NULL, NULL);
+	job->use_cache = false;
+	job->abort = false;
+	job->prewarm = true;
+	job->select[0] = 0;
+	job->d = nullptr;
+	job->cache_key = dir_cache_key(job->ctx.full_path, w.extension.c_str(), w.options, NULL, NULL);
+
+	if (strcasestr(job->ctx.full_path, ".zip") || (w.options & SCANO_NEOGEO) || dir_cache_get(job->cache_key, job->ctx.full_path) ||
+		!(job->d = opendir(job->ctx.full_path)))
+	{
+		delete job;
+		return NULL;
+	}
 
-	int len = strlen(dext->altname);
-	int xml = (len > 4 && (!strcasecmp(dext->altname + len - 4, ".mgl") || !strcasecmp(dext->altname + len - 4, ".mra")));
-	int rbf = (len > 4 && !strcasecmp(dext->altname + len - 4, ".rbf"));
-	if (rbf || xml)
+	job->use_cache = true;
+	dir_cache_prepare(job->ctx.full_path, &job->cache_state);
+	printf("Prewarm dir: %s\n", job->ctx.full_path);
+	return job;
+}
+
+void flist_scan_task(void)
+{
+	for (;;)
 	{
-		dext->altname[len - 4] = 0;
-		if (rbf)
+		ScanJob *job = scan_job;
+		if (!job && !scan_prewarm.empty()) job = scan_prewarm_job();
+		if (!job)
 		{
-			char *p = strstr(dext->altname, "_20");
-			if (p) if (strlen(p + 3) < 6) p = 0;
-			if (p)
-			{
-				*p = 0;
-				strncpy(dext->datecode, p + 3, 15);
-				dext->datecode[15] = 0;
-			}
-			else
-			{
-				strcpy(dext->datecode, "------");
-			}
+			scheduler_yield();
+			continue;
 		}
 
-		if (!names_loaded)
+		scan_running = job;
+
+		struct dirent64 *de;
+		for (size_t i = 0; !job->abort && (de = readdir64(job->d)); i++)
 		{
-			if (names)
+			scan_entry(&job->ctx, de, nullptr, 0, job->items);
+			if (i % YieldIterations == 0)
 			{
-				free(names);
-				names = 0;
-			}
+				// keep the poll loop from going idle while there is work
+				scheduler_activity();
+				scheduler_checkpoint();
 
-			int size = FileLoad("names.txt", 0, 0);
-			if (size)
-			{
-				names = (char*)malloc(size + 1);
-				if (names)
-				{
-					names[0] = 0;
-					FileLoad("names.txt", names, 0);
-					names[size] = 0;
-				}
+				// a listing the user waits for goes first, the prewarm starts over after it
+				if (job->prewarm && scan_job) job->abort = true;
 			}
-			names_loaded = 1;
 		}
 
-		if (names)
+		if (!job->abort) flist_sort(job->items);
+		if (job->prewarm)
 		{
-			strcat(dext->altname, ":");
-			len = strlen(dext->altname);
-			char *transl = strstr(names, dext->altname);
-			if (transl)
-			{
-				int copy = 0;
-				transl += len;
-				len = 0;
-				while (*transl && len < (int)sizeof(dext->altname) - 1)
-				{
-					if (!copy && *transl <= 32)
-					{
-						transl++;
-						continue;
-					}
-
-					if (copy && *transl < 32) break;
-
-					copy = 1;
-					dext->altname[len++] = *transl++;
-				}
-				len++;
-			}
-
-			dext->altname[len - 1] = 0;
+			if (job->abort) flist_prewarm(job->ctx.path, job->ctx.extension, job->ctx.options);
+			else dir_cache_put(job->cache_key, &job->cache_state, job->items);
+			job->use_cache = job->abort;
 		}
-		return;
+		else if (!job->abort)
+		{
+			scan_job_publish(job);
+		}
+
+		scan_running = NULL;
+		if (scan_job == job) scan_job = NULL;
+		scan_job_free(job);
 	}
+}
 
-	//do not remove ext if core supplies more than 1 extension and it's not list of cores
-	if (!(options & SCANO_CORES) && strlen(ext) > 3) return;
-	if (strchr(ext, '*') || strchr(ext, '?')) return;
+int flist_scanning()
+{
+	return scan_job != NULL;
+}
 
-	/* find the extension on the end of the name*/
-	char *fext = strrchr(dext->altname, '.');
-	if (fext) *fext = 0;
+int flist_scan_update()
+{
+	int ret = scan_updated;
+	scan_updated = 0;
+	return ret;
 }
 
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
 	static char file_name[1024];
-	static char full_path[1024];
-
-	int has_trd = 0;
-	const char *ext = extension;
-	while (*ext)
-	{
-		if (!strncasecmp(ext, "TRD", 3)) has_trd = 1;
-		ext += 3;
-	}
+	static ScanCtx ctx;
+	char *full_path = ctx.full_path;
 
-	int extlen = strlen(extension);
-    int filterlen = filter ? strlen(filter) : 0;
 	//printf("scan dir\n");
 
 	if (mode == SCANF_INIT)
 	{
+		scan_job_cancel();
+		scan_updated = 0;
+
 		iFirstEntry = 0;
 		iSelectedEntry = 0;
 		DirItem.clear();
@@ -1419,8 +3796,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 		if (options & SCANO_NEOGEO) neogeo_scan_xml(path);
 
-		sprintf(full_path, "%s/%s", getRootDir(), path);
-		int path_len = strlen(full_path);
+		scan_ctx_init(&ctx, path, extension, options, prefix, filter);
 
 		const char* is_zipped = strcasestr(full_path, ".zip");
 		if (is_zipped && strcasestr(is_zipped + 4, ".zip"))
@@ -1432,19 +3808,40 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		printf("Start to scan %sdir: %s\n", is_zipped ? "zipped " : "", full_path);
 		printf("Position on item: %s\n", file_name);
 
+		// NeoGeo listings depend on the romset XML, zips are already cached by the zip cache
+		int use_cache = !is_zipped && !(options & SCANO_NEOGEO);
+		std::string cache_key;
+		DirCacheState cache_state;
+		if (use_cache)
+		{
+			cache_key = dir_cache_key(full_path, extension, options, prefix, filter);
+
+			DirCacheEntry *cached = dir_cache_get(cache_key, full_path);
+			if (cached)
+			{
+				DirItem = cached->items;
+				printf("Got %d dir entries (cached)\n", flist_nDirEntries());
+				if (!flist_nDirEntries()) return 0;
+
+				if (file_name[0]) flist_select_name(file_name);
+				return flist_nDirEntries();
+			}
+		}
+
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
+		ctx.zip_folder = file_path_in_zip;
 
 		DIR *d = nullptr;
 		mz_zip_archive *z = nullptr;
 		if (is_zipped)
 		{
-			if (!OpenZipfileCached(full_path, 0))
+			z = OpenZipfileCached(full_path, 0);
+			if (!z)
 			{
-				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				printf("Couldn't open zip file %s: %s\n", full_path, zip_cache_error_string());
 				return 0;
 			}
-			z = &last_zip_archive;
 		}
 		else
 		{
@@ -1454,8 +3851,15 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 				printf("Couldn't open dir: %s\n", full_path);
 				return 0;
 			}
+
+			if (use_cache) dir_cache_prepare(full_path, &cache_state);
 		}
 
+		int streaming = 0;
+#ifdef USE_SCHEDULER
+		uint32_t stream_timer = ((options & SCANO_STREAM) && d && !(options & SCANO_NEOGEO)) ? GetTimer(SCAN_STREAM_MS) : 0;
+#endif
+
 		struct dirent64 *de = nullptr;
 		for (size_t i = 0; (d && (de = readdir64(d)))
 				 || (z && i < mz_zip_reader_get_num_files(z)); i++)
@@ -1463,235 +3867,31 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 #ifdef USE_SCHEDULER
 			if (0 < i && i % YieldIterations == 0)
 			{
-				scheduler_yield();
+				scheduler_checkpoint();
 			}
 #endif
-			struct dirent64 _de = {};
-			int isZip = 0;
-
-			if (z)
-			{
-				mz_zip_reader_get_filename(z, i, &_de.d_name[0], sizeof(_de.d_name));
-				const char *rname = GetRelativeFileName(file_path_in_zip, _de.d_name);
-				if (rname)
-				{
-					const char *fslash = strchr(rname, '/');
-					if (fslash)
-					{
-						char dirname[256] = {};
-						strncpy(dirname, rname, fslash - rname);
-						if (rname[0] != '/' && !(DirNames.find(dirname) != DirNames.end()))
-						{
-							direntext_t dirext;
-							memset(&dirext, 0, sizeof(dirext));
-							strncpy(dirext.de.d_name, rname, fslash - rname);
-							dirext.de.d_type = DT_DIR;
-							memcpy(dirext.altname, dirext.de.d_name, sizeof(dirext.de.d_name));
-							DirItem.push_back(dirext);
-							DirNames.insert(dirname);
-						}
-					}
-				}
-
-				if (!IsInSameFolder(file_path_in_zip, _de.d_name))
-				{
-					continue;
-				}
-
-				// Remove leading folders.
-				const char *subpath = _de.d_name + strlen(file_path_in_zip);
-				if (*subpath == '/') subpath++;
-				strcpy(_de.d_name, subpath);
-
-				de = &_de;
-
-				_de.d_type = mz_zip_reader_is_file_a_directory(z, i) ? DT_DIR : DT_REG;
-				if (_de.d_type == DT_DIR) {
-					// Remove trailing slash.
-					if (DirNames.find(_de.d_name) != DirNames.end())
-					{
-						DirNames.insert(_de.d_name);
-						_de.d_name[strlen(_de.d_name) - 1] = '\0';
-					}
-					else
-					{
-						continue;
-					}
-				}
-			}
-			// Handle (possible) symbolic link type in the directory entry
-			else if (de->d_type == DT_LNK || de->d_type == DT_REG)
-			{
-				sprintf(full_path + path_len, "/%s", de->d_name);
-
-				struct stat entrystat;
-
-				if (!stat(full_path, &entrystat))
-				{
-					if (S_ISREG(entrystat.st_mode))
-					{
-						de->d_type = DT_REG;
-					}
-					else if (S_ISDIR(entrystat.st_mode))
-					{
-						de->d_type = DT_DIR;
-					}
-				}
-			}
-
-            if (filter)
-			{
-                bool passes_filter = false;
-
-                for(const char *str = de->d_name; *str; str++)
-				{
-                    if (strncasecmp(str, filter, filterlen) == 0)
-					{
-                        passes_filter = true;
-                        break;
-                    }
-                }
-
-                if (!passes_filter) continue;
-            }
-
-
-			if (options & SCANO_NEOGEO)
-			{
-				if (de->d_type == DT_REG && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip"))
-				{
-					de->d_type = DT_DIR;
-				}
-
-				if (strcasecmp(de->d_name + strlen(de->d_name) - 4, ".neo"))
-				{
-					if (de->d_type != DT_DIR) continue;
-				}
-
-				if (!strcmp(de->d_name, ".."))
-				{
-					if (!strlen(path)) continue;
-				}
-				else
-				{
-					// skip hidden folders
-					if (!strncasecmp(de->d_name, ".", 1)) continue;
-				}
-
-				direntext_t dext;
-				memset(&dext, 0, sizeof(dext));
-				memcpy(&dext.de, de, sizeof(dext.de));
-				memcpy(dext.altname, de->d_name, sizeof(dext.altname));
-				if (!strcasecmp(dext.altname + strlen(dext.altname) - 4, ".zip")) dext.altname[strlen(dext.altname) - 4] = 0;
-
-				full_path[path_len] = 0;
-				char *altname = neogeo_get_altname(full_path, dext.de.d_name, dext.altname);
-				if (altname)
-				{
-					if (altname == (char*)-1) continue;
+			scan_entry(&ctx, de, z, i, DirItem);
 
-					dext.de.d_type = DT_REG;
-					memcpy(dext.altname, altname, sizeof(dext.altname));
-				}
-
-				DirItem.push_back(dext);
-			}
-			else
+#ifdef USE_SCHEDULER
+			if (stream_timer && (int)DirItem.size() >= OsdGetSize() && CheckTimer(stream_timer))
 			{
-				if (de->d_type == DT_DIR)
-				{
-					// skip System Volume Information folder
-					if (!strcmp(de->d_name, "System Volume Information")) continue;
-					if (!strcmp(de->d_name, ".."))
-					{
-						if (!strlen(path)) continue;
-					}
-					else
-					{
-						// skip hidden folder
-						if (!strncasecmp(de->d_name, ".", 1)) continue;
-					}
-
-					if (!(options & SCANO_DIR))
-					{
-						if (de->d_name[0] != '_' && strcmp(de->d_name, "..")) continue;
-						if (!(options & SCANO_CORES)) continue;
-					}
-				}
-				else if (de->d_type == DT_REG)
-				{
-					// skip hidden files
-					if (!strncasecmp(de->d_name, ".", 1)) continue;
-					//skip non-selectable files
-					if (!strcasecmp(de->d_name, "menu.rbf")) continue;
-					if (!strncasecmp(de->d_name, "menu_20", 7)) continue;
-					if (!strcasecmp(de->d_name, "boot.rom")) continue;
-
-					//check the prefix if given
-					if (prefix && strncasecmp(prefix, de->d_name, strlen(prefix))) continue;
-
-					if (extlen > 0)
-					{
-						const char *ext = extension;
-						int found = (has_trd && x2trd_ext_supp(de->d_name));
-						if (!found && !(options & SCANO_NOZIP) && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip") && (options & SCANO_DIR))
-						{
-							// Fake that zip-file is a directory.
-							de->d_type = DT_DIR;
-							isZip = 1;
-							found = 1;
-						}
-						if (!found && is_minimig() && !memcmp(extension, "HDF", 3))
-						{
-							found = !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".iso");
-						}
-
-						char *fext = strrchr(de->d_name, '.');
-						if (fext) fext++;
-						while (!found && *ext && fext)
-						{
-							char e[4];
-							memcpy(e, ext, 3);
-							if (e[2] == ' ')
-							{
-								e[2] = 0;
-								if (e[1] == ' ') e[1] = 0;
-							}
-
-							e[3] = 0;
-							found = 1;
-							for (int i = 0; i < 4; i++)
-							{
-								if (e[i] == '*') break;
-								if (e[i] == '?' && fext[i]) continue;
-
-								if (tolower(e[i]) != tolower(fext[i])) found = 0;
-
-								if (!e[i] || !found) break;
-							}
-							if (found) break;
-
-							if (strlen(ext) < 3) break;
-							ext += 3;
-						}
-						if (!found) continue;
-					}
-				}
-				else
-				{
-					continue;
-				}
-
-        {
-			      direntext_t dext;
-				    memset(&dext, 0, sizeof(dext));
-				    memcpy(&dext.de, de, sizeof(dext.de));
-				    if (isZip)
-				        dext.flags |= DT_EXT_ZIP;
-				    get_display_name(&dext, extension, options);
-				    DirItem.push_back(dext);
-        }
+				ScanJob *job = new ScanJob();
+				job->ctx = ctx;
+				job->d = d;
+				job->items = DirItem;
+				job->use_cache = use_cache;
+				job->cache_key = cache_key;
+				job->cache_state = cache_state;
+				strcpy(job->select, file_name);
+				job->abort = false;
+				job->prewarm = false;
+				scan_job = job;
+
+				d = nullptr;
+				streaming = 1;
+				break;
 			}
+#endif
 		}
 
 		if (z)
@@ -1703,6 +3903,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			dext.de.d_type = DT_DIR;
 			strcpy(dext.de.d_name, "..");
 			get_display_name(&dext, extension, options);
+			set_sort_key(&dext);
 			DirItem.push_back(dext);
 		}
 
@@ -1711,38 +3912,26 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			closedir(d);
 		}
 
-		printf("Got %d dir entries\n", flist_nDirEntries());
-		if (!flist_nDirEntries()) return 0;
+		printf("Got %d dir entries%s\n", flist_nDirEntries(), streaming ? " so far, reading the rest in background" : "");
 
-		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
-		if (file_name[0])
-		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if (!strcmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-					break;
-				}
-				else if (!strcasecmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-				}
-			}
+		flist_sort(DirItem);
+		if (use_cache && !streaming) dir_cache_put(cache_key, &cache_state, DirItem);
+		if (!flist_nDirEntries()) return 0;
 
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
-		}
+		if (file_name[0]) flist_select_name(file_name);
 		return flist_nDirEntries();
 	}
 	else
 	{
+#ifdef USE_SCHEDULER
+		if (scan_job)
+		{
+			// Moving around works on the entries read so far, searches need all of them
+			if (mode == SCANF_NEXT || mode == SCANF_PREV || mode == SCANF_NEXT_PAGE || mode == SCANF_PREV_PAGE) scan_job->select[0] = 0;
+			else scan_job_finish();
+		}
+#endif
+
 		if (flist_nDirEntries() == 0) // directory is empty so there is no point in searching for any entry
 			return 0;
 
@@ -2062,7 +4251,7 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 	}
 
 	int len = (p) ? p - path : strlen(path);
-	if (strncasecmp(scanned_path, path, len) || (scanned_opts & SCANO_DIR)) ScanDirectory(path, SCANF_INIT, ext, 0);
+	if (strncasecmp(scanned_path, path, len) || (scanned_opts & SCANO_DIR) || scan_job) ScanDirectory(path, SCANF_INIT, ext, 0);
 
 	if (!DirItem.size()) return NULL;
 	if (p) ScanDirectory(path, next ? SCANF_NEXT : SCANF_PREV, "", 0);
@@ -2082,18 +4271,149 @@ int isXmlName(const char *path)
 	return 0;
 }
 
+#define TEXT_CACHE_FILES    16
+#define TEXT_CACHE_FILE_MAX (4 * 1024 * 1024)
+#define TEXT_CACHE_MAX      (8 * 1024 * 1024)
+
+#define IS_NEWLINE(c) (((c) == '\r') || ((c) == '\n'))
+#define IS_WHITESPACE(c) (IS_NEWLINE(c) || ((c) == ' ') || ((c) == '\t'))
+
+// Lines FileReadLine() returns (without comments, empty lines and leading
+// blanks), each terminated, and where each starts in text.
+struct fileTextCache
+{
+	std::string path;
+	time_t mtime;
+	off_t size;
+	uint32_t used;
+	int refs;
+	bool stale; // replaced by a newer version, freed by the last reader
+	std::vector<char> text;
+	std::vector<uint32_t> lines;
+};
+
+static std::vector<fileTextCache*> text_cache;
+static size_t text_cache_bytes = 0;
+static uint32_t text_cache_tick = 0;
+static pthread_mutex_t text_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void text_cache_release(fileTextCache *c)
+{
+	pthread_mutex_lock(&text_cache_lock);
+	if (!--c->refs && c->stale) delete c;
+	pthread_mutex_unlock(&text_cache_lock);
+}
+
+// Under lock
+static void text_cache_drop(size_t n)
+{
+	fileTextCache *c = text_cache[n];
+	text_cache.erase(text_cache.begin() + n);
+	text_cache_bytes -= c->text.size();
+	if (c->refs) c->stale = true;
+	else delete c;
+}
+
+// The file is mapped, only the lines are copied out
+static fileTextCache *text_cache_load(const char *full_path, const struct stat64 *st)
+{
+	int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	const char *map = st->st_size ? (const char*)mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (map == MAP_FAILED || !map) return NULL;
+
+	fileTextCache *c = new fileTextCache();
+	c->text.reserve(st->st_size + 1);
+
+	const char *end = map + st->st_size;
+	const char *p = map;
+	while (p < end)
+	{
+		const char *st_line = p;
+		while (p < end && *p && !IS_NEWLINE(*p)) p++;
+		while (st_line < p && IS_WHITESPACE(*st_line)) st_line++;
+
+		if (st_line < p && *st_line != '#' && *st_line != ';')
+		{
+			c->lines.push_back(c->text.size());
+			c->text.insert(c->text.end(), st_line, p);
+			c->text.push_back(0);
+		}
+		p++;
+	}
+	if (c->text.empty()) c->text.push_back(0);
+
+	munmap((void*)map, st->st_size);
+	return c;
+}
+
+static fileTextCache *text_cache_get(const char *filename)
+{
+	const char *full_path = getFullPath(filename);
+
+	struct stat64 st;
+	if (stat64(full_path, &st) || !S_ISREG(st.st_mode) || !st.st_size || st.st_size > TEXT_CACHE_FILE_MAX) return NULL;
+
+	pthread_mutex_lock(&text_cache_lock);
+	for (size_t i = 0; i < text_cache.size(); i++)
+	{
+		fileTextCache *c = text_cache[i];
+		if (c->path != full_path) continue;
+
+		if (c->mtime == st.st_mtime && c->size == st.st_size)
+		{
+			c->used = ++text_cache_tick;
+			c->refs++;
+			pthread_mutex_unlock(&text_cache_lock);
+			return c;
+		}
+
+		text_cache_drop(i);
+		break;
+	}
+	pthread_mutex_unlock(&text_cache_lock);
+
+	std::string path = full_path;
+	fileTextCache *c = text_cache_load(path.c_str(), &st);
+	if (!c) return NULL;
+
+	c->path = path;
+	c->mtime = st.st_mtime;
+	c->size = st.st_size;
+	c->refs = 1;
+
+	pthread_mutex_lock(&text_cache_lock);
+	c->used = ++text_cache_tick;
+	text_cache.push_back(c);
+	text_cache_bytes += c->text.size();
+	while (text_cache.size() > TEXT_CACHE_FILES || text_cache_bytes > TEXT_CACHE_MAX)
+	{
+		size_t lru = 0;
+		for (size_t i = 1; i < text_cache.size(); i++) if (text_cache[i]->used < text_cache[lru]->used) lru = i;
+		if (text_cache[lru] == c) break;
+		text_cache_drop(lru);
+	}
+	pthread_mutex_unlock(&text_cache_lock);
+	return c;
+}
+
 fileTextReader::fileTextReader()
 {
 	buffer = nullptr;
+	cache = nullptr;
 }
 
 fileTextReader::~fileTextReader()
 {
-	if( buffer != nullptr )
+	if (cache) text_cache_release(cache);
+	else if (buffer != nullptr)
 	{
 		free(buffer);
 	}
 	buffer = nullptr;
+	cache = nullptr;
 }
 
 bool FileOpenTextReader( fileTextReader *reader, const char *filename )
@@ -2103,6 +4423,17 @@ bool FileOpenTextReader( fileTextReader *reader, const char *filename )
 	// ensure buffer is freed if the reader is being reused
 	reader->~fileTextReader();
 
+	fileTextCache *c = text_cache_get(filename);
+	if (c)
+	{
+		reader->cache = c;
+		reader->buffer = c->text.data();
+		reader->size = c->text.size();
+		reader->pos = reader->buffer;
+		return true;
+	}
+
+	// inside zips and the like
 	if (FileOpen(&f, filename))
 	{
 		char *buf = (char*)malloc(f.size+1);
@@ -2117,16 +4448,31 @@ bool FileOpenTextReader( fileTextReader *reader, const char *filename )
 				reader->pos = reader->buffer;
 				return true;
 			}
+			free(buf);
 		}
 	}
 	return false;
 }
 
-#define IS_NEWLINE(c) (((c) == '\r') || ((c) == '\n'))
-#define IS_WHITESPACE(c) (IS_NEWLINE(c) || ((c) == ' ') || ((c) == '\t'))
-
 const char *FileReadLine(fileTextReader *reader)
 {
+	if (reader->cache)
+	{
+		// next line starting after pos, pos may have been set back to an earlier line's end
+		const std::vector<uint32_t> &lines = reader->cache->lines;
+		uint32_t off = reader->pos - reader->buffer;
+		auto it = (reader->pos == reader->buffer) ? lines.begin() : std::upper_bound(lines.begin(), lines.end(), off);
+		if (it == lines.end())
+		{
+			reader->pos = reader->buffer + reader->size;
+			return nullptr;
+		}
+
+		const char *st = reader->buffer + *it;
+		reader->pos = (char*)st + strlen(st);
+		return st;
+	}
+
 	const char *end = reader->buffer + reader->size;
 	while (reader->pos < end)
 	{
@@ -9,6 +9,8 @@
 #include "spi.h"
 
 struct fileZipArchive;
+struct fileZstdArchive;
+struct fileOverlay;
 
 struct fileTYPE
 {
@@ -20,8 +22,15 @@ struct fileTYPE
 	int             mode;
 	int             type;
 	fileZipArchive *zip;
+	fileZstdArchive *zst;        // seekable .zst, read only
+	fileOverlay    *ovl;        // copy-on-write overlay of a base image
 	__off64_t       size;
 	__off64_t       offset;
+	void           *map;        // FileMapRead window
+	__off64_t       map_offset;
+	__off64_t       map_hint;
+	uint32_t        map_size;
+	__off64_t       once;       // FileReadOnce: pages before it were dropped, -1 if not set
 	char            path[1024];
 	char            name[261];
 };
@@ -34,8 +43,15 @@ struct direntext_t
 	unsigned int flags;
 	char datecode[16];
 	char altname[256];
+	uint8_t sortkey[64]; // see make_sort_key()
 };
 
+struct fileTextCache;
+
+// Files opened with FileOpenTextReader() are kept in a process wide cache
+// (checked against size and mtime on each open) with their lines already
+// split, the reader then only points into it. Readers filled by hand own
+// their buffer and get split by FileReadLine() as they are read.
 struct fileTextReader
 {
 	fileTextReader();
@@ -44,6 +60,7 @@ struct fileTextReader
 	size_t size;
 	char *buffer;
 	char *pos;
+	fileTextCache *cache; // shared read-only lines, buffer is its text then
 };
 
 int flist_nDirEntries();
@@ -55,6 +72,15 @@ direntext_t* flist_SelectedItem();
 char* flist_Path();
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next);
 
+// Background part of SCANO_STREAM scans, runs as a scheduler task.
+void flist_scan_task(void);
+int flist_scanning();
+// Returns 1 once after a background scan replaced the listing.
+int flist_scan_update();
+// Queues a read of the folder into the listing cache, done by the background
+// task while no scan is running. Arguments as for ScanDirectory.
+void flist_prewarm(const char *path, const char *extension, int options);
+
 // scanning flags
 #define SCANF_INIT       0 // start search from beginning of directory
 #define SCANF_NEXT       1 // find next file in directory
@@ -76,6 +102,7 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 #define SCANO_NOZIP      0b001000000
 #define SCANO_CLEAR      0b010000000 // allow backspace key, clear FC option
 #define SCANO_SAVES      0b100000000
+#define SCANO_STREAM     0b1000000000 // return after the first page on slow folders, read the rest in background
 
 void FindStorage();
 int  getStorage(int from_setting);
@@ -94,14 +121,32 @@ int FileSeekLBA(fileTYPE *file, uint32_t offset);
 
 int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
 int FileReadSec(fileTYPE *file, void *pBuffer);
+
+// The file is read once from here on (a big ROM streamed to the core): pages
+// are dropped from the page cache as they are consumed so the menu's hot files
+// stay cached. Only for plain files opened read only and FILE_ONCE_MIN or more.
+#define FILE_ONCE_MIN (8 * 1024 * 1024)
+void FileReadOnce(fileTYPE *file);
+
+// Zero-copy read access through a mapped window of the file (not for zip).
+// Returns NULL if the range can't be mapped, data stays valid until the next call.
+const void *FileMapRead(fileTYPE *file, __off64_t offset, int length);
 int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
 int FileWriteSec(fileTYPE *file, void *pBuffer);
+int FileSync(fileTYPE *file); // flush to the storage device
 int FileCreatePath(const char *dir);
 
+// Copy-on-write overlays: files with ".ovl" in the name open as their base image
+// with the writes kept in the overlay (e.g. disk.ovl.vhd, so the core's browser lists it).
+int FileOverlayCreate(const char *overlay, const char *base);
+int FileOverlayReset(const char *overlay);                     // back to the base, instantly
+int FileOverlaySnapshot(const char *overlay, const char *copy); // copies only the written blocks
+
 int FileExists(const char *name, int use_zip = 1);
 int FileCanWrite(const char *name);
 int PathIsDir(const char *name, int use_zip = 1);
 struct stat64* getPathStat(const char *path);
+bool is_network_fs(const char *path); // full path, true for NFS/SMB/FUSE mounts which inotify can't watch
 
 #define SAVE_DIR "saves"
 void FileGenerateSavePath(const char *name, char* out_name, int ext_replace = 1);
@@ -131,9 +176,15 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 void prefixGameDir(char *dir, size_t dir_len);
 int findPrefixDir(char *dir, size_t dir_len);
 
+// Path helpers return per-thread buffers, valid until the next call on the
+// same thread, and the zip archive cache is shared under a lock, so fileTYPE
+// and the path API can be used from worker threads (one fileTYPE per thread).
+// getFullPath_r fills the caller's buffer when two paths are needed at once.
+// The directory scan (ScanDirectory, flist_*) stays main thread only.
 const char *getStorageDir(int dev);
 const char *getRootDir();
 const char *getFullPath(const char *name);
+const char *getFullPath_r(const char *name, char *buf, size_t size);
 
 uint32_t getFileType(const char *name);
 int isXmlName(const char *path); // 1 - MRA, 2 - MGL
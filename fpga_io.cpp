@@ -6,16 +6,30 @@
 #include <signal.h>
 #include <ctype.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <atomic>
 
 #include "fpga_io.h"
+#include "spi.h"
 #include "file_io.h"
 #include "input.h"
 #include "osd.h"
 #include "menu.h"
 #include "shmem.h"
 #include "offload.h"
+#include "ide.h"
+#include "profiling.h"
+#include "user_io.h"
+#include "capture.h"
+#include "save_cache.h"
+#include "cfg_store.h"
+#include "load_times.h"
+#include "support/minimig/minimig_fdd.h"
+#include "support/n64/n64.h"
+#include "support/arcade/mra_loader.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
@@ -340,41 +354,6 @@ static int fpgamgr_program_poll_usermode(void)
 	return 0;
 }
 
-/*
-* FPGA Manager to program the FPGA. This is the interface used by FPGA driver.
-* Return 0 for sucess, non-zero for error.
-*/
-static int socfpga_load(const void *rbf_data, size_t rbf_size)
-{
-	unsigned long status;
-
-	if ((uint32_t)rbf_data & 0x3) {
-		printf("FPGA: Unaligned data, realign to 32bit boundary.\n");
-		return -EINVAL;
-	}
-
-	/* Initialize the FPGA Manager */
-	status = fpgamgr_program_init();
-	if (status)
-		return status;
-
-	/* Write the RBF data to FPGA Manager */
-	fpgamgr_program_write(rbf_data, rbf_size);
-
-	/* Ensure the FPGA entering config done */
-	status = fpgamgr_program_poll_cd();
-	if (status)
-		return status;
-
-	/* Ensure the FPGA entering init phase */
-	status = fpgamgr_program_poll_initphase();
-	if (status)
-		return status;
-
-	/* Ensure the FPGA entering user mode */
-	return fpgamgr_program_poll_usermode();
-}
-
 static void do_bridge(uint32_t enable)
 {
 	if (enable)
@@ -423,6 +402,120 @@ static int make_env(const char *name, const char *cfg)
 	return 0;
 }
 
+static void rbf_path(const char *name, char *path, size_t len)
+{
+	if (name[0] == '/') snprintf(path, len, "%s", name);
+	else snprintf(path, len, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+}
+
+void fpga_rbf_prefetch(const char *name)
+{
+	static char last[1024] = {};
+	char path[1024];
+
+	rbf_path(name, path, sizeof(path));
+	if (!strcmp(path, last)) return;
+	strcpy(last, path);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+// The bitstream is read on a worker in chunks while the part already read is
+// sent to the FPGA manager, so the SD read and the configuration overlap.
+#define RBF_CHUNK (512 * 1024) // multiple of 32, the write loop granularity
+
+struct rbf_stream_t
+{
+	int fd;
+	uint8_t *buf;
+	size_t size;
+	std::atomic<size_t> ready;
+	std::atomic<int> error;
+};
+
+static void rbf_read_job(rbf_stream_t *st)
+{
+	size_t pos = st->ready.load();
+	while (pos < st->size)
+	{
+		size_t len = st->size - pos;
+		if (len > RBF_CHUNK) len = RBF_CHUNK;
+
+		ssize_t ret = pread(st->fd, st->buf + pos, len, pos);
+		if (ret <= 0)
+		{
+			st->error = 1;
+			return;
+		}
+
+		pos += ret;
+		st->ready.store(pos, std::memory_order_release);
+	}
+}
+
+// Blocks until at least want bytes are read. Returns what's there, 0 on a read error.
+static size_t rbf_wait(rbf_stream_t *st, size_t want)
+{
+	while (1)
+	{
+		size_t ready = st->ready.load(std::memory_order_acquire);
+		if (ready >= want || ready == st->size) return ready;
+		if (st->error) return 0;
+		usleep(200);
+	}
+}
+
+/*
+* FPGA Manager to program the FPGA, written as the data arrives.
+* Return 0 for sucess, non-zero for error.
+*/
+static int socfpga_load_stream(rbf_stream_t *st, size_t offset, size_t rbf_size, int *read_error)
+{
+	unsigned long status;
+	*read_error = 0;
+
+	/* Initialize the FPGA Manager */
+	status = fpgamgr_program_init();
+	if (status)
+		return status;
+
+	/* Write the RBF data to FPGA Manager */
+	size_t pos = 0;
+	while (pos < rbf_size)
+	{
+		size_t ready = rbf_wait(st, offset + pos + RBF_CHUNK);
+		if (!ready)
+		{
+			*read_error = 1;
+			return -EIO;
+		}
+
+		size_t len = ready - offset - pos;
+		if (len > rbf_size - pos) len = rbf_size - pos;
+		else if (pos + len < rbf_size) len &= ~31;
+		if (!len) continue;
+
+		fpgamgr_program_write(st->buf + offset + pos, len);
+		pos += len;
+	}
+
+	/* Ensure the FPGA entering config done */
+	status = fpgamgr_program_poll_cd();
+	if (status)
+		return status;
+
+	/* Ensure the FPGA entering init phase */
+	status = fpgamgr_program_poll_initphase();
+	if (status)
+		return status;
+
+	/* Ensure the FPGA entering user mode */
+	return fpgamgr_program_poll_usermode();
+}
+
 int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 {
 	OsdDisable();
@@ -439,16 +532,21 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 
 	printf("Loading RBF: %s\n", name);
 
-	if(name[0] == '/') strcpy(path, name);
-	else sprintf(path, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+	// the record goes on in the new process, or ends here if the load fails
+	LOAD_SCOPE("rbf", name);
+	uint64_t t = trace_now_us();
+
+	rbf_path(name, path, sizeof(path));
 
 	int rbf = open(path, O_RDONLY);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
 	if (rbf < 0)
 	{
 		char error[4096];
 		snprintf(error,4096,"%s\nNot Found", name);
 		printf("Couldn't open file %s\n", path);
 		Info(error,5000);
+		load_failed();
 		return -1;
 	}
 	else
@@ -463,41 +561,70 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 		{
 			printf("Bitstream size: %lld bytes\n", st.st_size);
 
-			void *buf = malloc(st.st_size);
-			if (!buf)
+			posix_fadvise(rbf, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+			rbf_stream_t stream;
+			stream.fd = rbf;
+			stream.size = st.st_size;
+			stream.ready = 0;
+			stream.error = 0;
+			stream.buf = (uint8_t*)malloc(st.st_size + 4);
+			if (!stream.buf)
 			{
 				printf("Couldn't allocate %llu bytes.\n", st.st_size);
 				ret = -1;
 			}
+			else if (st.st_size < 16 || pread(rbf, stream.buf, 16, 0) != 16)
+			{
+				printf("Couldn't read file %s\n", name);
+				ret = -1;
+				free(stream.buf);
+			}
 			else
 			{
-				fpga_core_reset(1);
-				if (read(rbf, buf, st.st_size)<st.st_size)
+				stream.ready = 16;
+
+				size_t offset = 0;
+				size_t sz = st.st_size;
+				if (!memcmp(stream.buf, "MiSTer", 6))
 				{
-					printf("Couldn't read file %s\n", name);
-					ret = -1;
+					sz = *(uint32_t*)(stream.buf + 12);
+					offset = 16;
+					if (sz > st.st_size - offset) sz = st.st_size - offset;
 				}
-				else
+
+				OffloadHandle reader = offload_submit([&stream]() { rbf_read_job(&stream); });
+
+				t = trace_now_us();
+				fpga_core_reset(1);
+				do_bridge(0);
+
+				int read_error;
+				ret = socfpga_load_stream(&stream, offset, sz, &read_error);
+				load_phase_add(LOAD_RBF, trace_now_us() - t);
+				load_bytes(sz);
+
+				t = trace_now_us();
+				reader.wait();
+				load_phase_add(LOAD_READ, trace_now_us() - t);
+				free(stream.buf);
+
+				if (ret)
 				{
-					void *p = buf;
-					__off64_t sz = st.st_size;
-					if (!memcmp(buf, "MiSTer", 6))
-					{
-						sz = *(uint32_t*)(((uint8_t*)buf) + 12);
-						p = (void*)(((uint8_t*)buf) + 16);
-					}
-					do_bridge(0);
-					ret = socfpga_load(p, sz);
-					if (ret)
-					{
-						printf("Error %d while loading %s\n", ret, path);
-					}
-					else
+					printf("Error %d while loading %s\n", ret, path);
+					load_failed();
+
+					// The FPGA is half configured by now, the menu core has to come up instead
+					if (read_error && strcasecmp(name, "menu.rbf"))
 					{
-						do_bridge(1);
+						close(rbf);
+						return fpga_load_rbf("menu.rbf");
 					}
 				}
-				free(buf);
+				else
+				{
+					do_bridge(1);
+				}
 			}
 		}
 	}
@@ -580,8 +707,26 @@ int fpga_get_io_type()
 	return (fpga_gpi_read() >> 28) & 1;
 }
 
+static void save_profiling_stats()
+{
+#ifdef PROFILING
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/profiling_stats.txt", getRootDir());
+	profiling_stats_save(path);
+#endif
+}
+
 void reboot(int cold)
 {
+	ide_cache_flush();
+	n64_save_flush();
+	save_cache_flush();
+	cfg_store_flush();
+	arcade_nvm_flush();
+	FlushFloppies();
+	fpga_io_trace_stop();
+	capture_stop(1);
+	save_profiling_stats();
 	sync();
 	fpga_core_reset(1);
 
@@ -614,8 +759,19 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
+	uint64_t t = trace_now_us();
+	ide_cache_flush();
+	n64_save_flush();
+	save_cache_flush();
+	cfg_store_flush();
+	arcade_nvm_flush();
+	fpga_io_trace_stop();
+	capture_stop(1);
+	save_profiling_stats();
 	sync();
 	fpga_core_reset(1);
+	load_phase_add(LOAD_POST, trace_now_us() - t);
+	load_handoff();
 
 	input_switch(0);
 	input_uinp_destroy();
@@ -649,10 +805,194 @@ int is_fpga_ready(int quick)
 #define SSPI_STROBE  (1<<17)
 #define SSPI_ACK     SSPI_STROBE
 
+// I/O trace, see fpga_io.h for the file layout
+#define FIO_TRACE_BUF (1024 * 1024)
+
+struct fio_trace_hdr_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t start_us;
+	char core[32];
+};
+
+struct fio_trace_rec_t
+{
+	uint8_t type;
+	uint8_t arg8;
+	uint16_t dt_us;
+	uint32_t arg32;
+};
+
+static int fio_trace_on = 0;
+static FILE *fio_trace_file = NULL;
+static uint8_t *fio_trace_data[2];
+static uint32_t fio_trace_used;
+static int fio_trace_cur;
+static uint64_t fio_trace_last_us;
+static uint64_t fio_trace_total;
+static OffloadHandle fio_trace_pending;
+
+static void fio_trace_flush()
+{
+	// Only one buffer is written in the background at a time
+	fio_trace_pending.wait();
+
+	FILE *f = fio_trace_file;
+	uint8_t *data = fio_trace_data[fio_trace_cur];
+	uint32_t len = fio_trace_used;
+	fio_trace_pending = offload_submit([f, data, len]() { fwrite(data, 1, len, f); }, OFFLOAD_PRIO_IO);
+
+	fio_trace_total += len;
+	fio_trace_cur ^= 1;
+	fio_trace_used = 0;
+}
+
+static void fio_trace_put(const void *data, uint32_t len)
+{
+	const uint8_t *src = (const uint8_t*)data;
+	while (len)
+	{
+		uint32_t n = FIO_TRACE_BUF - fio_trace_used;
+		if (n > len) n = len;
+
+		memcpy(fio_trace_data[fio_trace_cur] + fio_trace_used, src, n);
+		fio_trace_used += n;
+		src += n;
+		len -= n;
+
+		if (fio_trace_used == FIO_TRACE_BUF) fio_trace_flush();
+	}
+}
+
+static void fio_trace_rec(uint8_t type, uint8_t arg8, uint32_t arg32)
+{
+	uint64_t now = trace_now_us();
+	uint64_t dt = now - fio_trace_last_us;
+	fio_trace_last_us = now;
+
+	if (dt > 0xFFFF)
+	{
+		fio_trace_rec_t t = { FIO_TR_TIME, 0, 0, (uint32_t)((dt > 0xFFFFFFFF) ? 0xFFFFFFFF : dt) };
+		fio_trace_put(&t, sizeof(t));
+		dt = 0;
+	}
+
+	fio_trace_rec_t r = { type, arg8, (uint16_t)dt, arg32 };
+	fio_trace_put(&r, sizeof(r));
+}
+
+static void fio_trace_block(uint8_t kind, const void *data, uint32_t bytes)
+{
+	fio_trace_rec(FIO_TR_BLOCK, kind, bytes);
+	if (data)
+	{
+		static const uint8_t pad[4] = {};
+		fio_trace_put(data, bytes);
+		if (bytes & 3) fio_trace_put(pad, 4 - (bytes & 3));
+	}
+}
+
+int fpga_io_trace_start(const char *path)
+{
+	if (fio_trace_on) return 1;
+	if (!path || !*path) path = "/tmp/fpga_io.trace";
+
+	if (!fio_trace_data[0])
+	{
+		fio_trace_data[0] = (uint8_t*)malloc(FIO_TRACE_BUF);
+		fio_trace_data[1] = (uint8_t*)malloc(FIO_TRACE_BUF);
+		if (!fio_trace_data[0] || !fio_trace_data[1])
+		{
+			free(fio_trace_data[0]);
+			free(fio_trace_data[1]);
+			fio_trace_data[0] = fio_trace_data[1] = NULL;
+			return 0;
+		}
+	}
+
+	fio_trace_file = fopen(path, "wb");
+	if (!fio_trace_file)
+	{
+		printf("fpga_io_trace: cannot create %s\n", path);
+		return 0;
+	}
+
+	fio_trace_cur = 0;
+	fio_trace_used = 0;
+	fio_trace_total = 0;
+	fio_trace_last_us = trace_now_us();
+
+	fio_trace_hdr_t hdr = {};
+	memcpy(hdr.magic, FIO_TRACE_MAGIC, 8);
+	hdr.version = FIO_TRACE_VERSION;
+	hdr.start_us = (uint32_t)fio_trace_last_us;
+	snprintf(hdr.core, sizeof(hdr.core), "%s", user_io_get_core_name());
+	fio_trace_put(&hdr, sizeof(hdr));
+
+	printf("fpga_io_trace: recording to %s\n", path);
+	fio_trace_on = 1;
+	return 1;
+}
+
+void fpga_io_trace_stop()
+{
+	if (!fio_trace_on) return;
+	fio_trace_on = 0;
+
+	fio_trace_flush();
+	fio_trace_pending.wait();
+	fio_trace_pending = OffloadHandle();
+
+	printf("fpga_io_trace: stopped, %llu bytes\n", fio_trace_total);
+	fclose(fio_trace_file);
+	fio_trace_file = NULL;
+}
+
+// Bus use (spi.h): the open transaction, -1 if none, SPI_TAGS until its
+// first word tells the subsystem.
+static int spi_stat_tag = -1;
+static uint32_t spi_stat_mask;
+static uint64_t spi_stat_start;
+
+static inline uint64_t spi_stat_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void spi_stat_words(int word, uint32_t n)
+{
+	if (spi_stat_tag == SPI_TAGS)
+	{
+		spi_stat_tag = spi_classify(spi_stat_mask, word);
+		spi_stats[spi_stat_tag].xfers++;
+	}
+	if (spi_stat_tag >= 0) spi_stats[spi_stat_tag].words += n;
+}
+
 void fpga_spi_en(uint32_t mask, uint32_t en)
 {
 	uint32_t gpo = fpga_gpo_read() | 0x80000000;
 	fpga_gpo_write(en ? gpo | mask : gpo & ~mask);
+	if (fio_trace_on) fio_trace_rec(FIO_TR_EN, en ? 1 : 0, mask);
+
+	if (en)
+	{
+		if (spi_stat_tag < 0)
+		{
+			spi_stat_tag = SPI_TAGS;
+			spi_stat_mask = mask;
+			spi_stat_start = spi_stat_ns();
+		}
+	}
+	else if (spi_stat_tag >= 0)
+	{
+		spi_stat_words(-1, 0);
+		spi_stats[spi_stat_tag].busy_ns += spi_stat_ns() - spi_stat_start;
+		spi_stat_tag = -1;
+	}
 }
 
 void fpga_wait_to_reset()
@@ -701,6 +1041,8 @@ uint16_t fpga_spi(uint16_t word)
 		}
 	} while (gpi & SSPI_ACK);
 
+	if (fio_trace_on) fio_trace_rec(FIO_TR_WORD, 0, word | (gpi << 16));
+	spi_stat_words(word, 1);
 	return (uint16_t)gpi;
 }
 
@@ -710,16 +1052,93 @@ uint16_t fpga_spi_fast(uint16_t word)
 	fpga_gpo_write(gpo);
 	fpga_gpo_write(gpo | SSPI_STROBE);
 	fpga_gpo_write(gpo);
-	return (uint16_t)fpga_gpi_read();
+	uint16_t res = (uint16_t)fpga_gpi_read();
+
+	if (fio_trace_on) fio_trace_rec(FIO_TR_WORD, 0, word | (res << 16));
+	spi_stat_words(word, 1);
+	return res;
 }
 
 void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 {
+	spi_stat_words(length ? buf[0] : -1, length);
+	if (fio_trace_on) fio_trace_block(FIO_TR_WRITE16, NULL, length * 2);
+
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
+	uint32_t rem = length % 16;
+	length /= 16;
 
-	// should be optimized for speed by compiler automatically
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
 	while (length--)
+	{
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	while (rem--)
 	{
 		gpo = gpoH | *buf++;
 		fpga_gpo_writeN(gpo);
@@ -730,6 +1149,8 @@ void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 {
+	spi_stat_words(-1, length);
+	const uint32_t count = length;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -809,10 +1230,15 @@ void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 		fpga_gpo_writeN(gpo);
 		*buf++ = (uint16_t)fpga_gpi_read();
 	}
+
+	if (fio_trace_on) fio_trace_block(FIO_TR_READ16, buf - count, count * 2);
 }
 
 void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 {
+	spi_stat_words(length ? buf[0] : -1, length);
+	if (fio_trace_on) fio_trace_block(FIO_TR_WRITE8, NULL, length);
+
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 	uint32_t rem = length % 16;
@@ -899,6 +1325,8 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 {
+	spi_stat_words(-1, length);
+	const uint32_t count = length;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -978,19 +1406,91 @@ void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 		fpga_gpo_writeN(gpo);
 		*buf++ = (uint8_t)fpga_gpi_read();
 	}
+
+	if (fio_trace_on) fio_trace_block(FIO_TR_READ8, buf - count, count);
 }
 
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
 {
+	spi_stat_words(length ? buf[0] : -1, length);
+	if (fio_trace_on) fio_trace_block(FIO_TR_WRITE16_BE, NULL, length * 2);
+
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
+	uint32_t rem = length % 16;
+	length /= 16;
 
-	// should be optimized for speed by compiler automatically
+	// byte swap is done on the fly, no separate pass over the buffer
 	while (length--)
 	{
-		uint16_t tmp = *buf++;
-		tmp = (tmp << 8) | (tmp >> 8);
-		gpo = gpoH | tmp;
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	while (rem--)
+	{
+		gpo = gpoH | __builtin_bswap16(*buf++);
 		fpga_gpo_writeN(gpo);
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 	}
@@ -999,14 +1499,126 @@ void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
 {
+	spi_stat_words(-1, length);
+	const uint32_t count = length;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t rem = length % 16;
+	length /= 16;
 
-	// should be optimized for speed by compiler automatically
 	while (length--)
 	{
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 		fpga_gpo_writeN(gpo);
-		uint16_t tmp = (uint16_t)fpga_gpi_read();
-		*buf++ = (tmp << 8) | (tmp >> 8);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+	}
+
+	while (rem--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
 	}
+
+	if (fio_trace_on) fio_trace_block(FIO_TR_READ16_BE, buf - count, count * 2);
+}
+
+// Transfer rate of the block functions, with no device selected.
+// Run with "echo spi_bench > /dev/MiSTer_cmd".
+void fpga_spi_benchmark()
+{
+	static uint16_t buf[32 * 1024];
+	static const char *names[] = { "write", "read", "write_8", "read_8", "write_be", "read_be" };
+	const int loops = 16;
+
+	uint32_t gpo = fpga_gpo_read();
+	fpga_gpo_write(gpo & ~(7 << 18)); // FPGA/OSD/IO enables (spi.cpp)
+
+	for (int mode = 0; mode < 6; mode++)
+	{
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		for (int i = 0; i < loops; i++)
+		{
+			switch (mode)
+			{
+			case 0: fpga_spi_fast_block_write(buf, sizeof(buf) / 2); break;
+			case 1: fpga_spi_fast_block_read(buf, sizeof(buf) / 2); break;
+			case 2: fpga_spi_fast_block_write_8((uint8_t*)buf, sizeof(buf)); break;
+			case 3: fpga_spi_fast_block_read_8((uint8_t*)buf, sizeof(buf)); break;
+			case 4: fpga_spi_fast_block_write_be(buf, sizeof(buf) / 2); break;
+			case 5: fpga_spi_fast_block_read_be(buf, sizeof(buf) / 2); break;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		uint64_t us = (t1.tv_sec - t0.tv_sec) * 1000000ull + (t1.tv_nsec - t0.tv_nsec) / 1000;
+		if (!us) us = 1;
+
+		uint64_t bytes = (uint64_t)sizeof(buf) * loops;
+		uint64_t rate = bytes * 100 / us; // 0.01 MB/s
+		printf("SPI %-8s: %llu KB in %llu us, %llu.%02llu MB/s\n", names[mode], bytes / 1024, us, rate / 100, rate % 100);
+	}
+
+	fpga_gpo_write(gpo);
 }
@@ -19,6 +19,41 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length);
+void fpga_spi_benchmark();
+
+// Recording of all SPI traffic (chip selects, words and block transfers) for
+// offline analysis and replay. File layout, little endian:
+//   header: "MFIOTRC" + NUL, u32 version, u32 start time (us), char core[32]
+//   records of 8 bytes: u8 type, u8 arg8, u16 time since last record (us), u32 arg32
+//     FIO_TR_TIME:  arg32 = time since last record when it doesn't fit in 16 bits
+//     FIO_TR_EN:    arg8 = enable, arg32 = chip select mask
+//     FIO_TR_WORD:  arg32 = word sent | word received << 16
+//     FIO_TR_BLOCK: arg8 = FIO_TR_READ* / FIO_TR_WRITE*, arg32 = bytes;
+//                   reads are followed by the received data, padded to 4 bytes.
+//                   Written data is not stored, it comes from the HPS side anyway.
+#define FIO_TRACE_MAGIC   "MFIOTRC"
+#define FIO_TRACE_VERSION 1
+
+enum
+{
+	FIO_TR_TIME = 0,
+	FIO_TR_EN,
+	FIO_TR_WORD,
+	FIO_TR_BLOCK
+};
+
+enum
+{
+	FIO_TR_WRITE16 = 0,
+	FIO_TR_READ16,
+	FIO_TR_WRITE8,
+	FIO_TR_READ8,
+	FIO_TR_WRITE16_BE,
+	FIO_TR_READ16_BE
+};
+
+int fpga_io_trace_start(const char *path); // NULL for /tmp/fpga_io.trace
+void fpga_io_trace_stop();
 
 void fpga_set_led(uint32_t on);
 int  fpga_get_buttons();
@@ -34,6 +69,8 @@ int fpga_get_fio_size();
 int fpga_get_io_version();
 
 int fpga_load_rbf(const char *name, const char *cfg = 0, const char *xml = 0);
+// Hint that the core may be loaded soon, starts reading it into the page cache.
+void fpga_rbf_prefetch(const char *name);
 
 void reboot(int cold);
 void app_restart(const char *path, const char *xml = 0, const char *exe = 0);
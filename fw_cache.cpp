@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "fw_cache.h"
+#include "file_io.h"
+#include "crc.h"
+#include "profiling.h"
+
+#define FW_CACHE_DIR     "/tmp/fw_cache"
+#define FW_CACHE_VERSION 1
+
+struct fw_head_t
+{
+	uint32_t version;
+	uint32_t klen;
+	uint32_t size;
+	uint32_t crc;
+};
+
+static int fw_cache_key(const char *name, char *path, char *key, int keylen)
+{
+	const char *full = getFullPath(name);
+	struct stat64 st;
+	if (stat64(full, &st) || !S_ISREG(st.st_mode)) return 0;
+
+	snprintf(key, keylen, "%s\n%llu\n%llu\n", full, (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	sprintf(path, FW_CACHE_DIR "/%08x", crc32_update(0, full, strlen(full)));
+	return 1;
+}
+
+static uint8_t *fw_cache_get(const char *path, const char *key, uint32_t *size, uint32_t max)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	fw_head_t head;
+	char kbuf[1200];
+	uint8_t *data = NULL;
+	if (read(fd, &head, sizeof(head)) == sizeof(head) && head.version == FW_CACHE_VERSION &&
+		head.klen == strlen(key) && head.klen < sizeof(kbuf) && head.size <= max &&
+		read(fd, kbuf, head.klen) == (ssize_t)head.klen && !memcmp(kbuf, key, head.klen))
+	{
+		data = (uint8_t*)malloc(head.size ? head.size : 1);
+		if (data && (read(fd, data, head.size) != (ssize_t)head.size || crc32_update(0, data, head.size) != head.crc))
+		{
+			printf("fw_cache: %s is damaged\n", path);
+			free(data);
+			data = NULL;
+		}
+	}
+	close(fd);
+
+	if (!data) return NULL;
+
+	// most recently used
+	utime(path, NULL);
+	*size = head.size;
+	return data;
+}
+
+// Drops the least recently used entries until size more bytes fit.
+static void fw_cache_evict(uint32_t size)
+{
+	DIR *d = opendir(FW_CACHE_DIR);
+	if (!d) return;
+
+	struct entry_t { char name[16]; time_t mtime; off_t size; };
+	entry_t entries[64];
+	int cnt = 0;
+	uint64_t total = size;
+
+	struct dirent *de;
+	while ((de = readdir(d)) && cnt < (int)(sizeof(entries) / sizeof(entries[0])))
+	{
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(entries[0].name)) continue;
+
+		char fpath[300];
+		snprintf(fpath, sizeof(fpath), FW_CACHE_DIR "/%s", de->d_name);
+
+		struct stat st;
+		if (stat(fpath, &st)) continue;
+
+		strcpy(entries[cnt].name, de->d_name);
+		entries[cnt].mtime = st.st_mtime;
+		entries[cnt].size = st.st_size;
+		total += st.st_size;
+		cnt++;
+	}
+	closedir(d);
+
+	while (total > FW_CACHE_SIZE && cnt)
+	{
+		int oldest = 0;
+		for (int i = 1; i < cnt; i++) if (entries[i].mtime < entries[oldest].mtime) oldest = i;
+
+		char fpath[300];
+		snprintf(fpath, sizeof(fpath), FW_CACHE_DIR "/%s", entries[oldest].name);
+		unlink(fpath);
+
+		total -= entries[oldest].size;
+		entries[oldest] = entries[--cnt];
+	}
+}
+
+static void fw_cache_put(const char *path, const char *key, const uint8_t *data, uint32_t size)
+{
+	if (size > FW_CACHE_SIZE / 4) return;
+
+	mkdir(FW_CACHE_DIR, 0755);
+	fw_cache_evict(size);
+
+	char tmp[80];
+	sprintf(tmp, "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	fw_head_t head = { FW_CACHE_VERSION, (uint32_t)strlen(key), size, crc32_update(0, data, size) };
+	int ok = write(fd, &head, sizeof(head)) == sizeof(head) && write(fd, key, head.klen) == (ssize_t)head.klen &&
+		write(fd, data, size) == (ssize_t)size;
+	close(fd);
+
+	if (!ok || rename(tmp, path)) unlink(tmp);
+}
+
+uint8_t *fw_cache_load(const char *name, uint32_t *size, uint32_t max)
+{
+	TRACE_SCOPE("fw_cache_load");
+
+	// files inside zips have no mtime to check, they're just read
+	char path[64], key[1200];
+	int keyed = fw_cache_key(name, path, key, sizeof(key));
+	if (keyed)
+	{
+		uint8_t *data = fw_cache_get(path, key, size, max);
+		if (data) return data;
+	}
+
+	fileTYPE f = {};
+	if (!FileOpen(&f, name, 1)) return NULL;
+	if (f.size > max)
+	{
+		FileClose(&f);
+		return NULL;
+	}
+
+	uint32_t len = f.size;
+	uint8_t *data = (uint8_t*)malloc(len ? len : 1);
+	int ok = data && FileReadAdv(&f, data, len) == (int)len;
+	FileClose(&f);
+
+	if (!ok)
+	{
+		free(data);
+		return NULL;
+	}
+
+	if (keyed) fw_cache_put(path, key, data, len);
+	*size = len;
+	return data;
+}
+
+static void fw_cache_derived_key(const char *tag, const void *src, uint32_t src_size, char *path, char *key, int keylen)
+{
+	snprintf(key, keylen, "%s\n%u\n%08x\n", tag, src_size, crc32_update(0, src, src_size));
+	sprintf(path, FW_CACHE_DIR "/%08x", crc32_update(0, key, strlen(key)));
+}
+
+uint8_t *fw_cache_derived_get(const char *tag, const void *src, uint32_t src_size, uint32_t *size, uint32_t max)
+{
+	char path[64], key[128];
+	fw_cache_derived_key(tag, src, src_size, path, key, sizeof(key));
+	return fw_cache_get(path, key, size, max);
+}
+
+void fw_cache_derived_put(const char *tag, const void *src, uint32_t src_size, const uint8_t *data, uint32_t size)
+{
+	char path[64], key[128];
+	fw_cache_derived_key(tag, src, src_size, path, key, sizeof(key));
+	fw_cache_put(path, key, data, size);
+}
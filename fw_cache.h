@@ -0,0 +1,26 @@
+#ifndef FW_CACHE_H
+#define FW_CACHE_H
+
+#include <stdint.h>
+
+// Firmware and BIOS images (cd_bios.rom, Kickstart, TOS, PC BIOS) loaded on
+// every reset or launch of a core. A copy of each is kept in /tmp (RAM),
+// which outlives the restart of the binary on a core load, so the next
+// load of the same file is served from memory. An entry is named by the
+// full path and checked against the size and mtime of the file, its data
+// against the CRC stored with it. Least recently used entries go first once
+// the cache grows over FW_CACHE_SIZE.
+
+#define FW_CACHE_SIZE (24 * 1024 * 1024)
+
+// Whole file in a malloc'ed buffer, from the cache or from storage (and
+// cached then). NULL if it can't be read or is bigger than max.
+uint8_t *fw_cache_load(const char *name, uint32_t *size, uint32_t max);
+
+// Images converted from another format (T64 to D64), kept in the same cache
+// by content: tag names the conversion, src is the whole source file. Get
+// returns a malloc'ed copy of the result, NULL if there's none.
+uint8_t *fw_cache_derived_get(const char *tag, const void *src, uint32_t src_size, uint32_t *size, uint32_t max);
+void fw_cache_derived_put(const char *tag, const void *src, uint32_t src_size, const uint8_t *data, uint32_t size);
+
+#endif
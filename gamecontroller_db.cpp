@@ -2,11 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
 #include "input.h"
 #include "file_io.h"
 #include "user_io.h"
 #include "profiling.h"
+#include "offload.h"
 
 
 
@@ -470,39 +477,119 @@ static bool parse_mapping_string(char *map_str, char *guid, int dev_fd, uint32_t
 
 
 #define GCDB_DIR  "/media/fat/linux/gamecontrollerdb/"
+#define GCDB_USER_FILE GCDB_DIR "gamecontrollerdb_user.txt"
+#define GCDB_FILE      GCDB_DIR "gamecontrollerdb.txt"
 
 
-bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+// The db files are indexed once by GUID, only reloaded when they change.
+// Entries for other platforms are dropped, the mistercore: filter depends on
+// the running core so it's still applied per lookup.
+struct gcdb_index_t
+{
+	time_t mtime;
+	off_t size;
+	bool loaded;
+	std::unordered_map<std::string, std::vector<std::string>> entries; // lower case GUID -> lines after it
+};
+
+static gcdb_index_t gcdb_index[2];
+static std::mutex gcdb_index_lock; // gcdb_preload() builds them on a worker
+
+static std::string gcdb_guid_key(const char *guid, size_t len)
+{
+	std::string key(guid, len);
+	for (auto &c : key) c = tolower(c);
+	return key;
+}
+
+// Plain stdio, this runs on a worker at startup
+static void gcdb_build_index(gcdb_index_t *idx, const char *fname)
+{
+	TRACE_SCOPE("gcdb_index");
+
+	FILE *fp = fopen(fname, "r");
+	if (!fp) return;
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, fp)) >= 0)
+	{
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+		if (line[0] == '#') continue;
+		const char *gcom = strchr(line, ',');
+		if (!gcom) continue;
+
+		const char *pl_ptr = strcasestr(gcom, "platform:");
+		if (!pl_ptr) continue;
+		pl_ptr += strlen("platform:");
+		if (strncasecmp(pl_ptr, "Linux", 5) && strncasecmp(pl_ptr, "MiSTer", 6)) continue;
+
+		idx->entries[gcdb_guid_key(line, gcom - line)].push_back(gcom);
+	}
+
+	free(line);
+	fclose(fp);
+	printf("Gamecontrollerdb: indexed %d GUIDs of %s\n", (int)idx->entries.size(), fname);
+}
+
+// Caller holds gcdb_index_lock
+static gcdb_index_t *gcdb_get_index(int n, const char *fname)
+{
+	gcdb_index_t *idx = &gcdb_index[n];
+
+	struct stat st;
+	if (stat(fname, &st))
+	{
+		if (idx->loaded) memset(db_maps, 0, sizeof(db_maps));
+		idx->entries.clear();
+		idx->loaded = false;
+		return NULL;
+	}
+
+	if (idx->loaded && idx->mtime == st.st_mtime && idx->size == st.st_size) return idx;
+
+	// Cached maps may come from the old contents
+	if (idx->loaded) memset(db_maps, 0, sizeof(db_maps));
+
+	idx->entries.clear();
+	idx->mtime = st.st_mtime;
+	idx->size = st.st_size;
+	idx->loaded = true;
+
+	gcdb_build_index(idx, fname);
+	return idx;
+}
+
+static bool read_controller_map_from_file(int n, char *fname, char *guid, int dev_fd, uint32_t *fill_map)
 {
-	fileTextReader reader;
 	char matched[1024] = {};
-	char *map_start = NULL;
+	std::lock_guard<std::mutex> lock(gcdb_index_lock);
+
+	gcdb_index_t *idx = gcdb_get_index(n, fname);
+	if (!idx) return false;
+
+	auto it = idx->entries.find(gcdb_guid_key(guid, strlen(guid)));
+	if (it == idx->entries.end()) return false;
 
-	if (FileOpenTextReader(&reader, fname))
+	// the last matching entry of the file wins
+	for (auto &entry : it->second)
 	{
-		const char *line;
-		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, fname);
-		while ((line = FileReadLine(&reader)))
+		std::string str = entry;
+		char *gcom = &str[0];
+		if (cdb_entry_matches(gcom))
 		{
-			if (line[0] == '#') continue;
-			const char *gcom = strchr(line, ',');
-			if (!strncasecmp(line, guid, gcom-line))
+			char *map_start = strchr(gcom + 1, ',');
+			if (map_start)
 			{
-				if (cdb_entry_matches((char *)gcom))
-				{
-					map_start = strchr((char *)gcom+1, ',');
-					if (map_start)
-					{
-						strncpy(matched, map_start+1, sizeof(matched));
-					}
-				}
+				strncpy(matched, map_start + 1, sizeof(matched) - 1);
 			}
 		}
-
 	}
+
 	if (matched[0] != 0)
 	{
-		printf("Gamecontrollerdb: found match, using config %s\n", matched);
+		printf("Gamecontrollerdb: found match in %s, using config %s\n", fname, matched);
 		return parse_mapping_string(matched, guid, dev_fd, fill_map);
 	}
 
@@ -550,14 +637,12 @@ bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint1
 		}
 		sprintf(guid_str, "%04x0000%04x0000%04x0000%04x0000", (uint16_t)(bustype << 8 | bustype >> 8), (uint16_t)( vid << 8 |  vid >> 8), (uint16_t)(pid << 8 | pid >> 8), (uint16_t)(version << 8 | version >> 8));
 
-		char path[256] = {GCDB_DIR};
-		strcat(path, "gamecontrollerdb_user.txt");
+		char path[256] = {GCDB_USER_FILE};
 		bool found_entry = false;
-		if (!(found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map)))
+		if (!(found_entry = read_controller_map_from_file(0, path, guid_str, dev_fd, fill_map)))
 		{
-			strcpy(path, GCDB_DIR);
-			strcat(path, "gamecontrollerdb.txt");
-			found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map);
+			strcpy(path, GCDB_FILE);
+			found_entry = read_controller_map_from_file(1, path, guid_str, dev_fd, fill_map);
 		}
 
 
@@ -568,3 +653,12 @@ bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint1
 		}
 		return false;
 }
+
+void gcdb_preload()
+{
+	offload_submit([]() {
+		std::lock_guard<std::mutex> lock(gcdb_index_lock);
+		gcdb_get_index(0, GCDB_USER_FILE);
+		gcdb_get_index(1, GCDB_FILE);
+	}, OFFLOAD_PRIO_BACKGROUND);
+}
@@ -11,6 +11,9 @@
 
 bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version, int dev_fd, uint32_t *fill_map);
 void gcdb_show_string_for_ctrl_map(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version,int dev_fd, const char *name, uint32_t *cur_map);
+
+// Indexes the db files on a worker so the first controller doesn't wait for it.
+void gcdb_preload();
 #endif
 
 
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hash_stream.h"
+#include "profiling.h"
+#include "crc.h"
+#include "swap_prim.h"
+#include "lib/md5/md5.h"
+
+#define HASH_STREAM_SLOTS 4
+
+struct hash_stream
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int threaded;
+	int closing;
+
+	int types;
+	uint32_t skip;
+	uint32_t crc;
+	MD5Context md5;
+
+	uint32_t head, tail;
+	uint32_t len[HASH_STREAM_SLOTS];
+	uint8_t *buf;
+	uint8_t *swap;
+};
+
+static void hash_data(hash_stream *hs, const uint8_t *data, uint32_t len)
+{
+	if (hs->types & HASH_MD5) MD5Update(&hs->md5, data, len);
+	if (!(hs->types & (HASH_CRC32 | HASH_CRC32_SWAP16))) return;
+
+	if (hs->skip >= len)
+	{
+		hs->skip -= len;
+		return;
+	}
+
+	data += hs->skip;
+	len -= hs->skip;
+	hs->skip = 0;
+
+	if (hs->types & HASH_CRC32_SWAP16)
+	{
+		swap16(hs->swap, data, len);
+		data = hs->swap;
+	}
+
+	hs->crc = crc32_update(hs->crc, data, len);
+}
+
+static void *hash_stream_thread(void *arg)
+{
+	hash_stream *hs = (hash_stream*)arg;
+	trace_thread_name("hash_stream");
+
+	while (1)
+	{
+		pthread_mutex_lock(&hs->lock);
+		while (hs->head == hs->tail && !hs->closing) pthread_cond_wait(&hs->cond, &hs->lock);
+		int empty = (hs->head == hs->tail);
+		uint32_t slot = hs->tail % HASH_STREAM_SLOTS;
+		pthread_mutex_unlock(&hs->lock);
+		if (empty) break;
+
+		{
+			TRACE_SCOPE("hash_stream");
+			hash_data(hs, hs->buf + slot * HASH_STREAM_CHUNK, hs->len[slot]);
+		}
+
+		pthread_mutex_lock(&hs->lock);
+		hs->tail++;
+		pthread_cond_broadcast(&hs->cond);
+		pthread_mutex_unlock(&hs->lock);
+	}
+
+	return NULL;
+}
+
+hash_stream *hash_stream_open(int types, uint32_t skip)
+{
+	hash_stream *hs = (hash_stream*)calloc(1, sizeof(hash_stream));
+	if (!hs) return NULL;
+
+	hs->buf = (uint8_t*)malloc(HASH_STREAM_SLOTS * HASH_STREAM_CHUNK);
+	hs->swap = (types & HASH_CRC32_SWAP16) ? (uint8_t*)malloc(HASH_STREAM_CHUNK) : NULL;
+	if (!hs->buf || ((types & HASH_CRC32_SWAP16) && !hs->swap))
+	{
+		free(hs->buf);
+		free(hs->swap);
+		free(hs);
+		return NULL;
+	}
+
+	hs->types = types;
+	hs->skip = skip;
+	MD5Init(&hs->md5);
+	pthread_mutex_init(&hs->lock, NULL);
+	pthread_cond_init(&hs->cond, NULL);
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	hs->threaded = !pthread_create(&hs->thread, &attr, hash_stream_thread, hs);
+	pthread_attr_destroy(&attr);
+
+	if (!hs->threaded) printf("hash_stream: cannot start worker, hashing inline.\n");
+	return hs;
+}
+
+uint8_t *hash_stream_buffer(hash_stream *hs)
+{
+	if (hs->threaded)
+	{
+		pthread_mutex_lock(&hs->lock);
+		while ((hs->head - hs->tail) == HASH_STREAM_SLOTS) pthread_cond_wait(&hs->cond, &hs->lock);
+		pthread_mutex_unlock(&hs->lock);
+	}
+
+	return hs->buf + (hs->head % HASH_STREAM_SLOTS) * HASH_STREAM_CHUNK;
+}
+
+void hash_stream_push(hash_stream *hs, uint32_t len)
+{
+	uint32_t slot = hs->head % HASH_STREAM_SLOTS;
+	if (len > HASH_STREAM_CHUNK) len = HASH_STREAM_CHUNK;
+
+	if (!hs->threaded)
+	{
+		hash_data(hs, hs->buf + slot * HASH_STREAM_CHUNK, len);
+		hs->head++;
+		return;
+	}
+
+	pthread_mutex_lock(&hs->lock);
+	hs->len[slot] = len;
+	hs->head++;
+	pthread_cond_broadcast(&hs->cond);
+	pthread_mutex_unlock(&hs->lock);
+}
+
+void hash_stream_add(hash_stream *hs, const void *data, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	while (len)
+	{
+		uint32_t chunk = (len > HASH_STREAM_CHUNK) ? HASH_STREAM_CHUNK : len;
+		memcpy(hash_stream_buffer(hs), p, chunk);
+		hash_stream_push(hs, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+void hash_stream_close(hash_stream *hs, hash_result *res)
+{
+	if (!hs) return;
+
+	if (hs->threaded)
+	{
+		pthread_mutex_lock(&hs->lock);
+		hs->closing = 1;
+		pthread_cond_broadcast(&hs->cond);
+		pthread_mutex_unlock(&hs->lock);
+		pthread_join(hs->thread, NULL);
+	}
+
+	if (res)
+	{
+		res->crc = hs->crc;
+		MD5Final(res->md5, &hs->md5);
+	}
+
+	pthread_cond_destroy(&hs->cond);
+	pthread_mutex_destroy(&hs->lock);
+	free(hs->buf);
+	free(hs->swap);
+	free(hs);
+}
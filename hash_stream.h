@@ -0,0 +1,41 @@
+#ifndef HASH_STREAM_H
+#define HASH_STREAM_H
+
+#include <stdint.h>
+
+// Hashing stage for file transfers.
+// Data pushed into a stream is hashed in order by a worker thread kept off the
+// main core, so the transfer loop only reads and sends while CRC32/MD5 are
+// computed on the other core. The result is ready when the stream is closed.
+// If the worker can't be started the data is hashed inline on push.
+
+#define HASH_CRC32        1
+#define HASH_MD5          2
+#define HASH_CRC32_SWAP16 4 // CRC32 of the data with every 16-bit word byte swapped
+
+#define HASH_STREAM_CHUNK (64 * 1024)
+
+struct hash_result
+{
+	uint32_t crc;
+	uint8_t md5[16];
+};
+
+struct hash_stream;
+
+// skip: number of leading bytes left out of the CRC32 (headers). MD5 always covers everything.
+// Returns NULL if out of memory.
+hash_stream *hash_stream_open(int types, uint32_t skip = 0);
+
+// Buffer of HASH_STREAM_CHUNK bytes to read the next chunk into, zero copy.
+// After hash_stream_push it stays readable until the next hash_stream_buffer call.
+uint8_t *hash_stream_buffer(hash_stream *hs);
+void hash_stream_push(hash_stream *hs, uint32_t len);
+
+// Copies data of any size into the stream.
+void hash_stream_add(hash_stream *hs, const void *data, uint32_t len);
+
+// Waits until everything is hashed and frees the stream. res can be NULL.
+void hash_stream_close(hash_stream *hs, hash_result *res);
+
+#endif
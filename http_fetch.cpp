@@ -0,0 +1,464 @@
+#include "http_fetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define HTTP_BUF_SIZE   16384
+#define HTTP_DRAIN_MAX  (64 * 1024)  // Bigger error bodies close the connection instead
+
+#define DNS_CACHE_SIZE  8
+#define DNS_MAX_ADDR    4
+#define DNS_TTL_OK      300          // seconds
+#define DNS_TTL_FAIL    10
+
+struct HttpReader
+{
+	int fd;
+	char buf[HTTP_BUF_SIZE];
+	int pos, len;
+	int got_data;
+};
+
+void http_conn_init(HttpConn *conn, int timeout)
+{
+	memset(conn, 0, sizeof(HttpConn));
+	conn->fd = -1;
+	conn->timeout = timeout;
+}
+
+void http_conn_close(HttpConn *conn)
+{
+	if (conn->fd >= 0) close(conn->fd);
+	conn->fd = -1;
+	conn->host[0] = 0;
+}
+
+static int parse_url(const char *url, char *host, int host_len, int *port, const char **path)
+{
+	if (strncasecmp(url, "http://", 7)) return -1;
+	url += 7;
+
+	const char *end = url + strcspn(url, ":/");
+	if (end == url || end - url >= host_len) return -1;
+
+	memcpy(host, url, end - url);
+	host[end - url] = 0;
+
+	*port = 80;
+	if (*end == ':')
+	{
+		*port = strtol(end + 1, (char**)&end, 10);
+		if (*port <= 0 || *port > 65535) return -1;
+	}
+
+	*path = (*end == '/') ? end : "/";
+	return 0;
+}
+
+// Resolved addresses per host and port, shared by all connections.
+// Failures are kept too, so an offline box doesn't wait on the resolver
+// for every request.
+struct DnsAddr
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+};
+
+struct DnsEntry
+{
+	char host[256];
+	int port;
+	int count;            // 0 = lookup failed
+	DnsAddr addr[DNS_MAX_ADDR];
+	time_t expires;
+};
+
+static DnsEntry dns_cache[DNS_CACHE_SIZE];
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t dns_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static DnsEntry *dns_find(const char *host, int port)
+{
+	for (int i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		if (dns_cache[i].host[0] && dns_cache[i].port == port && !strcasecmp(dns_cache[i].host, host)) return &dns_cache[i];
+	}
+	return NULL;
+}
+
+// Copies the addresses of host into out, returns their count.
+static int dns_lookup(const char *host, int port, DnsAddr *out)
+{
+	pthread_mutex_lock(&dns_mutex);
+	DnsEntry *e = dns_find(host, port);
+	if (e && e->expires > dns_now())
+	{
+		int count = e->count;
+		memcpy(out, e->addr, sizeof(DnsAddr) * count);
+		pthread_mutex_unlock(&dns_mutex);
+		return count;
+	}
+	pthread_mutex_unlock(&dns_mutex);
+
+	// Resolve unlocked, other hosts stay usable meanwhile
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+
+	struct addrinfo hints = {}, *res = NULL;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int count = 0;
+	if (!getaddrinfo(host, service, &hints, &res))
+	{
+		for (struct addrinfo *ai = res; ai && count < DNS_MAX_ADDR; ai = ai->ai_next)
+		{
+			if (ai->ai_addrlen > sizeof(out[count].addr)) continue;
+			memcpy(&out[count].addr, ai->ai_addr, ai->ai_addrlen);
+			out[count].len = ai->ai_addrlen;
+			count++;
+		}
+	}
+	if (res) freeaddrinfo(res);
+
+	pthread_mutex_lock(&dns_mutex);
+	e = dns_find(host, port);
+	if (!e)
+	{
+		// Replace the entry expiring first
+		e = &dns_cache[0];
+		for (int i = 1; i < DNS_CACHE_SIZE; i++) if (dns_cache[i].expires < e->expires) e = &dns_cache[i];
+		snprintf(e->host, sizeof(e->host), "%s", host);
+		e->port = port;
+	}
+	e->count = count;
+	memcpy(e->addr, out, sizeof(DnsAddr) * count);
+	e->expires = dns_now() + (count ? DNS_TTL_OK : DNS_TTL_FAIL);
+	pthread_mutex_unlock(&dns_mutex);
+
+	return count;
+}
+
+// Addresses that didn't connect are looked up again next time
+static void dns_forget(const char *host, int port)
+{
+	pthread_mutex_lock(&dns_mutex);
+	DnsEntry *e = dns_find(host, port);
+	if (e) e->host[0] = 0;
+	pthread_mutex_unlock(&dns_mutex);
+}
+
+int http_resolve(const char *host, int port)
+{
+	DnsAddr addr[DNS_MAX_ADDR];
+	return dns_lookup(host, port, addr) ? 0 : -1;
+}
+
+static int http_connect(HttpConn *conn, const char *host, int port)
+{
+	http_conn_close(conn);
+
+	DnsAddr addr[DNS_MAX_ADDR];
+	int count = dns_lookup(host, port, addr);
+	if (!count) return -1;
+
+	int fd = -1;
+	for (int i = 0; i < count && fd < 0; i++)
+	{
+		fd = socket(addr[i].addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) continue;
+
+		// Non-blocking connect, so the timeout applies
+		int flags = fcntl(fd, F_GETFL, 0);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+		int ret = connect(fd, (struct sockaddr*)&addr[i].addr, addr[i].len);
+		if (ret < 0 && errno == EINPROGRESS)
+		{
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (poll(&pfd, 1, conn->timeout * 1000) == 1 && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err) ret = 0;
+		}
+
+		if (ret < 0)
+		{
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		fcntl(fd, F_SETFL, flags);
+	}
+
+	if (fd < 0)
+	{
+		dns_forget(host, port);
+		return -1;
+	}
+
+	struct timeval tv = { conn->timeout, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	conn->fd = fd;
+	snprintf(conn->host, sizeof(conn->host), "%s", host);
+	conn->port = port;
+	return 0;
+}
+
+static int send_all(int fd, const char *data, int len)
+{
+	while (len > 0)
+	{
+		int ret = send(fd, data, len, MSG_NOSIGNAL);
+		if (ret <= 0)
+		{
+			if (ret < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int reader_fill(HttpReader *rd)
+{
+	while (1)
+	{
+		int ret = recv(rd->fd, rd->buf, sizeof(rd->buf), 0);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return -1;
+
+		rd->pos = 0;
+		rd->len = ret;
+		rd->got_data = 1;
+		return 0;
+	}
+}
+
+static int read_line(HttpReader *rd, char *line, int size)
+{
+	int n = 0;
+	while (1)
+	{
+		if (rd->pos >= rd->len && reader_fill(rd)) return -1;
+
+		char c = rd->buf[rd->pos++];
+		if (c == '\n') break;
+		if (c != '\r' && n < size - 1) line[n++] = c;
+	}
+	line[n] = 0;
+	return n;
+}
+
+// Pass body bytes to fd (or drop them if fd < 0)
+static int read_body(HttpReader *rd, int64_t len, int fd, volatile int *cancel)
+{
+	while (len > 0)
+	{
+		if (cancel && *cancel) return -2;
+		if (rd->pos >= rd->len && reader_fill(rd)) return -1;
+
+		int chunk = rd->len - rd->pos;
+		if (chunk > len) chunk = len;
+		if (fd >= 0 && write(fd, rd->buf + rd->pos, chunk) != chunk) return -1;
+
+		rd->pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int read_chunked(HttpReader *rd, int fd, int64_t limit, volatile int *cancel)
+{
+	char line[128];
+	int64_t total = 0;
+
+	while (1)
+	{
+		if (read_line(rd, line, sizeof(line)) < 0) return -1;
+		int64_t len = strtoll(line, NULL, 16);
+		if (len < 0) return -1;
+		if (!len) break;
+
+		total += len;
+		if (limit && total > limit) return -1;
+
+		int ret = read_body(rd, len, fd, cancel);
+		if (ret) return ret;
+		if (read_line(rd, line, sizeof(line)) < 0) return -1;
+	}
+
+	// Trailers
+	while (1)
+	{
+		int n = read_line(rd, line, sizeof(line));
+		if (n < 0) return -1;
+		if (!n) break;
+	}
+	return 0;
+}
+
+static int http_request(HttpConn *conn, const char *host, const char *path, const char *save_path, int64_t resume,
+	volatile int *cancel, HttpReader *rd)
+{
+	char req[2048];
+	int len = snprintf(req, sizeof(req),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: MiSTer\r\n"
+		"Connection: keep-alive\r\n",
+		path, host);
+
+	if (resume) len += snprintf(req + len, sizeof(req) - len, "Range: bytes=%lld-\r\n", (long long)resume);
+	len += snprintf(req + len, sizeof(req) - len, "\r\n");
+	if (len >= (int)sizeof(req)) return -1;
+
+	if (send_all(conn->fd, req, len)) return -1;
+
+	rd->fd = conn->fd;
+	rd->pos = rd->len = 0;
+	rd->got_data = 0;
+
+	char line[1024];
+	int status;
+	do
+	{
+		if (read_line(rd, line, sizeof(line)) < 0) return -1;
+		if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) return -1;
+
+		// Skip interim responses
+		if (status >= 100 && status < 200)
+		{
+			while (read_line(rd, line, sizeof(line)) > 0) {}
+		}
+	} while (status >= 100 && status < 200);
+
+	int64_t content_length = -1;
+	int chunked = 0;
+	int keep_alive = 1;
+
+	while (1)
+	{
+		int n = read_line(rd, line, sizeof(line));
+		if (n < 0) return -1;
+		if (!n) break;
+
+		char *value = strchr(line, ':');
+		if (!value) continue;
+		*value++ = 0;
+		while (*value == ' ') value++;
+
+		if (!strcasecmp(line, "Content-Length")) content_length = strtoll(value, NULL, 10);
+		else if (!strcasecmp(line, "Transfer-Encoding") && strcasestr(value, "chunked")) chunked = 1;
+		else if (!strcasecmp(line, "Connection") && strcasestr(value, "close")) keep_alive = 0;
+	}
+
+	int ret = 0;
+	if (status == 200 || (status == 206 && resume))
+	{
+		char part_path[1024];
+		snprintf(part_path, sizeof(part_path), "%s.part", save_path);
+
+		int fd = open(part_path, O_WRONLY | O_CREAT | O_CLOEXEC | ((status == 206) ? O_APPEND : O_TRUNC), 0644);
+		if (fd < 0)
+		{
+			ret = -1;
+		}
+		else
+		{
+			if (chunked) ret = read_chunked(rd, fd, 0, cancel);
+			else if (content_length >= 0) ret = read_body(rd, content_length, fd, cancel);
+			else
+			{
+				// Body ends with the connection
+				while (!(ret = read_body(rd, HTTP_BUF_SIZE, fd, cancel))) {}
+				ret = (ret == -2) ? -2 : 0;
+				keep_alive = 0;
+			}
+			close(fd);
+
+			if (!ret && rename(part_path, save_path)) ret = -1;
+		}
+	}
+	else
+	{
+		// Drain small error bodies to keep the connection usable
+		if (chunked) ret = read_chunked(rd, -1, HTTP_DRAIN_MAX, cancel);
+		else if (content_length >= 0 && content_length <= HTTP_DRAIN_MAX) ret = read_body(rd, content_length, -1, cancel);
+		else keep_alive = 0;
+	}
+
+	if (ret || !keep_alive) http_conn_close(conn);
+	return ret ? ret : status;
+}
+
+int http_get_file(HttpConn *conn, const char *url, const char *save_path, volatile int *cancel)
+{
+	char host[256];
+	int port;
+	const char *path;
+
+	if (parse_url(url, host, sizeof(host), &port, &path))
+	{
+		printf("http: unsupported url %s\n", url);
+		return -1;
+	}
+
+	char part_path[1024];
+	snprintf(part_path, sizeof(part_path), "%s.part", save_path);
+
+	struct stat st;
+	int64_t resume = (!stat(part_path, &st) && S_ISREG(st.st_mode)) ? st.st_size : 0;
+
+	HttpReader *rd = (HttpReader*)malloc(sizeof(HttpReader));
+	if (!rd) return -1;
+
+	int ret = -1;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (cancel && *cancel)
+		{
+			ret = -2;
+			break;
+		}
+
+		int reused = (conn->fd >= 0 && conn->port == port && !strcasecmp(conn->host, host));
+		if (!reused && http_connect(conn, host, port)) break;
+
+		ret = http_request(conn, host, path, save_path, resume, cancel, rd);
+		if (ret < 0) http_conn_close(conn);
+
+		// Server may have dropped the idle connection, retry once on a new one
+		if (ret != -1 || !reused || rd->got_data) break;
+	}
+
+	free(rd);
+
+	if (ret == 416)
+	{
+		// Stale partial file
+		unlink(part_path);
+	}
+
+	return ret;
+}
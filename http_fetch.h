@@ -0,0 +1,30 @@
+#ifndef HTTP_FETCH_H
+#define HTTP_FETCH_H
+
+#include <inttypes.h>
+
+// Minimal in-process HTTP/1.1 client (plain http only).
+// A connection is kept alive between requests to the same host, so one
+// connection per thread is enough for batch downloads.
+
+struct HttpConn
+{
+	int fd;
+	char host[256];
+	int port;
+	int timeout;          // seconds, for connect and every read/write
+};
+
+void http_conn_init(HttpConn *conn, int timeout);
+void http_conn_close(HttpConn *conn);
+
+// Host lookups go through a small DNS cache (results are kept for minutes,
+// failures for seconds). Returns 0 if the host resolves.
+int http_resolve(const char *host, int port);
+
+// Download url into save_path.
+// Partial data from an earlier attempt (save_path + ".part") is resumed.
+// Returns HTTP status (200/206 on success), -1 on connection error, -2 if cancelled.
+int http_get_file(HttpConn *conn, const char *url, const char *save_path, volatile int *cancel);
+
+#endif
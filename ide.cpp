@@ -5,11 +5,15 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <ios>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <map>
+#include <vector>
 #include <sys/stat.h>
 
 #include "support/x86/x86.h"
@@ -20,6 +24,9 @@
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
+#include "scheduler.h"
+#include "cfg.h"
+#include "profiling.h"
 #include "ide.h"
 
 #if 0
@@ -410,6 +417,297 @@ static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt)
 	}
 }
 
+struct ide_async_t
+{
+	pthread_t thread;
+	int started;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// Under lock
+	std::function<void()> job;
+	int done;
+
+	// Main thread only
+	std::function<void(ide_config *)> finish;
+};
+
+static ide_async_t ide_async_inst[2];
+
+// Whole READ (MULTIPLE) commands and CD reads land here, one per channel
+static uint8_t ide_burst[2][256 * 512];
+
+uint8_t *ide_async_buf(ide_config *ide)
+{
+	return ide_burst[ide - ide_inst];
+}
+
+static void *ide_worker(void *arg)
+{
+	ide_async_t *a = (ide_async_t *)arg;
+	trace_thread_name((a == ide_async_inst) ? "ide0" : "ide1");
+
+	pthread_mutex_lock(&a->lock);
+	while (1)
+	{
+		if (!a->job)
+		{
+			pthread_cond_wait(&a->cond, &a->lock);
+			continue;
+		}
+
+		std::function<void()> job = std::move(a->job);
+		a->job = nullptr;
+		pthread_mutex_unlock(&a->lock);
+
+		job();
+
+		pthread_mutex_lock(&a->lock);
+		a->done = 1;
+		pthread_cond_broadcast(&a->cond);
+	}
+
+	return NULL;
+}
+
+static int ide_async_start(ide_async_t *a)
+{
+	if (a->started) return a->running;
+	a->started = 1;
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	a->running = !pthread_create(&a->thread, &attr, ide_worker, a);
+	pthread_attr_destroy(&attr);
+
+	if (!a->running) printf("IDE: cannot start the channel worker, reading inline.\n");
+	return a->running;
+}
+
+void ide_async(ide_config *ide, std::function<void()> job, std::function<void(ide_config *)> finish)
+{
+	ide_async_t *a = &ide_async_inst[ide - ide_inst];
+	if (!ide_async_start(a))
+	{
+		job();
+		finish(ide);
+		return;
+	}
+
+	a->finish = std::move(finish);
+	ide->state = IDE_STATE_WAIT_IO;
+
+	pthread_mutex_lock(&a->lock);
+	a->done = 0;
+	a->job = std::move(job);
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+int ide_async_finish(ide_config *ide, int wait)
+{
+	if (ide->state != IDE_STATE_WAIT_IO) return 1;
+
+	ide_async_t *a = &ide_async_inst[ide - ide_inst];
+	pthread_mutex_lock(&a->lock);
+	while (wait && !a->done) pthread_cond_wait(&a->cond, &a->lock);
+	int done = a->done;
+	pthread_mutex_unlock(&a->lock);
+	if (!done) return 0;
+
+	ide->state = IDE_STATE_IDLE;
+	std::function<void(ide_config *)> finish = std::move(a->finish);
+	a->finish = nullptr;
+	finish(ide);
+	return 1;
+}
+
+int ide_async_pending()
+{
+	return ide_inst[0].state == IDE_STATE_WAIT_IO || ide_inst[1].state == IDE_STATE_WAIT_IO;
+}
+
+#define WCACHE_FLUSH_DELAY 1000 // ms after the first dirty sector
+#define WCACHE_BATCH       128  // max sectors per write on flush
+
+struct ide_wcache_t
+{
+	std::map<uint32_t, uint32_t> map; // image sector -> slot
+	uint8_t *buf;
+	uint8_t *batch;
+	uint32_t slots;
+	uint32_t used;
+	uint32_t timer;
+	fileTYPE *f; // image of the caches made by ide_wcache_write()
+};
+
+// Caches of other disks, flushed along with the IDE ones
+static std::vector<ide_wcache_t*> ext_wcache;
+
+static ide_wcache_t *wcache_get(ide_wcache_t **pwc)
+{
+	if (!*pwc && cfg.ide_cache_size)
+	{
+		uint32_t slots = cfg.ide_cache_size * 2;
+		uint8_t *buf = (uint8_t*)malloc((slots + WCACHE_BATCH) * 512);
+		if (!buf) return NULL;
+
+		ide_wcache_t *wc = new ide_wcache_t;
+		wc->buf = buf;
+		wc->batch = buf + slots * 512;
+		wc->slots = slots;
+		wc->used = 0;
+		wc->timer = 0;
+		wc->f = NULL;
+		*pwc = wc;
+	}
+
+	return *pwc;
+}
+
+// Write dirty sectors back to the image, adjacent ones in one go.
+static int wcache_flush(ide_wcache_t *wc, fileTYPE *f)
+{
+	if (!wc || !wc->used) return 1;
+
+	int ok = 1;
+	auto it = wc->map.begin();
+	while (it != wc->map.end())
+	{
+		uint32_t start = it->first;
+		uint32_t cnt = 0;
+		while (it != wc->map.end() && it->first == start + cnt && cnt < WCACHE_BATCH)
+		{
+			memcpy(wc->batch + cnt * 512, wc->buf + it->second * 512, 512);
+			cnt++;
+			it++;
+		}
+
+		if (!FileSeekLBA(f, start) || FileWriteAdv(f, wc->batch, cnt * 512, -1) != (int)(cnt * 512))
+		{
+			printf("IDE: failed to write %u sectors at %u\n", cnt, start);
+			ok = 0;
+		}
+	}
+
+	wc->map.clear();
+	wc->used = 0;
+	wc->timer = 0;
+	return ok;
+}
+
+static int wcache_put(ide_wcache_t *wc, fileTYPE *f, uint32_t lba, const uint8_t *data, uint32_t cnt)
+{
+	int ok = 1;
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		auto it = wc->map.find(lba + i);
+		if (it == wc->map.end())
+		{
+			if (wc->used == wc->slots && !wcache_flush(wc, f)) ok = 0;
+			it = wc->map.emplace(lba + i, wc->used++).first;
+		}
+
+		memcpy(wc->buf + it->second * 512, data + i * 512, 512);
+	}
+
+	if (!wc->timer) wc->timer = GetTimer(WCACHE_FLUSH_DELAY);
+	return ok;
+}
+
+// Copy the cached sectors of the range over data read from the image.
+static void wcache_overlay(ide_wcache_t *wc, uint32_t lba, uint8_t *data, uint32_t cnt)
+{
+	if (!wc || !wc->used) return;
+	for (auto it = wc->map.lower_bound(lba); it != wc->map.end() && it->first < lba + cnt; it++)
+	{
+		memcpy(data + (it->first - lba) * 512, wc->buf + it->second * 512, 512);
+	}
+}
+
+// Flush the write-back cache and make it durable.
+// With sync the image is synced even if nothing was cached (FLUSH CACHE command).
+static int hdd_flush(drive_t *drive, int sync)
+{
+	ide_wcache_t *wc = drive->wcache;
+	if (!sync && (!wc || !wc->used)) return 1;
+
+	int ok = wcache_flush(wc, drive->f);
+	if (drive->f && drive->f->filp && !FileSync(drive->f)) ok = 0;
+	return ok;
+}
+
+// lba is the image sector, data in ide_buf
+static int writehdd(drive_t *drive, uint32_t lba, uint32_t cnt)
+{
+	ide_wcache_t *wc = wcache_get(&drive->wcache);
+	if (!wc) return FileWriteAdv(drive->f, ide_buf, cnt * 512, -1) > 0;
+
+	return wcache_put(wc, drive->f, lba, ide_buf, cnt);
+}
+
+int ide_wcache_write(ide_wcache_t **pwc, fileTYPE *f, uint32_t lba, const void *data, uint32_t cnt)
+{
+	ide_wcache_t *wc = *pwc;
+	if (!wc && wcache_get(pwc))
+	{
+		wc = *pwc;
+		ext_wcache.push_back(wc);
+	}
+
+	if (!wc) return FileSeekLBA(f, lba) && FileWriteAdv(f, (void*)data, cnt * 512, -1) == (int)(cnt * 512);
+
+	if (wc->f != f)
+	{
+		wcache_flush(wc, wc->f);
+		wc->f = f;
+	}
+	return wcache_put(wc, f, lba, (const uint8_t*)data, cnt);
+}
+
+void ide_wcache_read(ide_wcache_t *wc, uint32_t lba, void *data, uint32_t cnt)
+{
+	wcache_overlay(wc, lba, (uint8_t*)data, cnt);
+}
+
+void ide_wcache_close(ide_wcache_t **pwc)
+{
+	ide_wcache_t *wc = *pwc;
+	if (!wc) return;
+
+	if (wc->used)
+	{
+		wcache_flush(wc, wc->f);
+		if (wc->f && wc->f->filp) FileSync(wc->f);
+	}
+
+	for (size_t i = 0; i < ext_wcache.size(); i++)
+	{
+		if (ext_wcache[i] == wc)
+		{
+			ext_wcache.erase(ext_wcache.begin() + i);
+			break;
+		}
+	}
+
+	free(wc->buf);
+	delete wc;
+	*pwc = NULL;
+}
+
 void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, int offset, int type)
 {
 	int drv = (drvnum & 1);
@@ -420,6 +718,9 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 	ide_inst[port].base = port ? IDE1_BASE : IDE0_BASE;
 	ide_inst[port].drive[drv].drvnum = drvnum;
 
+	ide_async_finish(&ide_inst[port], 1);
+	hdd_flush(drive, 0);
+
 	if (drive->f && (f != drive->f) && drive->f->opened())
 	{
 		FileClose(drive->f);
@@ -751,31 +1052,59 @@ inline uint16_t get_cnt(ide_config *ide)
 	return cnt;
 }
 
-inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
+// Returns the sector data (mapped image or buf), NULL on error
+static const uint8_t *readhdd(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf = ide_buf)
 {
 	if (lba < drive->offset)
 	{
+		if (buf != ide_buf) return NULL;
 		if (!drive->type) fill_fake_rdb(drive, lba, cnt);
 		else memset(ide_buf, 0, sizeof(ide_buf));
-		return 1;
+		return ide_buf;
 	}
-	else
+
+	lba -= drive->offset;
+
+	// Cache with sectors of this range not written back yet
+	ide_wcache_t *wc = (drive->wcache && drive->wcache->used) ? drive->wcache : NULL;
+	if (wc)
 	{
-		return FileReadAdv(drive->f, ide_buf, cnt * 512, -1);
+		auto it = wc->map.lower_bound(lba);
+		if (it == wc->map.end() || it->first >= lba + cnt) wc = NULL;
 	}
+
+	if (cfg.hdd_mmap && !wc)
+	{
+		const void *data = FileMapRead(drive->f, (__off64_t)lba << 9, cnt * 512);
+		if (data) return (const uint8_t*)data;
+	}
+
+	if (drive->f->offset != ((__off64_t)lba << 9) && !FileSeekLBA(drive->f, lba)) return NULL;
+	if (FileReadAdv(drive->f, buf, cnt * 512, -1) <= 0) return NULL;
+
+	wcache_overlay(wc, lba, buf, cnt);
+	return buf;
 }
 
-static void process_read(ide_config *ide, int multi)
+const uint8_t *ide_read_direct(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf)
 {
-	uint32_t lba = get_lba(ide);
-	uint16_t ide_req = 0;
+	return readhdd(drive, lba, cnt, buf);
+}
 
-	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
+// Sends the DRQ blocks of a read command, burst holds all its sectors if
+// they could be read in one go, otherwise they are read per block.
+static void process_read_send(ide_config *ide, int multi, uint32_t lba, const uint8_t *burst)
+{
+	uint16_t ide_req = 0;
 
 	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-	if (ide->null) memset(ide_buf, 0, cnt * 512);
+	const uint8_t *buf = burst ? burst : readhdd(&ide->drive[ide->regs.drv], lba, cnt);
+	ide->null = !buf;
+	if (ide->null)
+	{
+		memset(ide_buf, 0, cnt * 512);
+		buf = ide_buf;
+	}
 
 	while (1)
 	{
@@ -790,11 +1119,11 @@ static void process_read(ide_config *ide, int multi)
 		if (ide->regs.io_fast)
 		{
 			ide_set_regs(ide);
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(buf, cnt * 256);
 		}
 		else
 		{
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(buf, cnt * 256);
 			ide->regs.status &= ~ATA_STATUS_RDP;
 			ide_set_regs(ide);
 		}
@@ -807,8 +1136,20 @@ static void process_read(ide_config *ide, int multi)
 		}
 
 		cnt = multi ? get_cnt(ide) : 1;
-		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * 512);
+		if (burst)
+		{
+			buf += ide->regs.io_size * 512;
+		}
+		else if (!ide->null)
+		{
+			buf = readhdd(&ide->drive[ide->regs.drv], lba, cnt);
+			ide->null = !buf;
+		}
+		if (ide->null)
+		{
+			memset(ide_buf, 0, cnt * 512);
+			buf = ide_buf;
+		}
 
 		ide_req = 0;
 		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
@@ -823,6 +1164,31 @@ static void process_read(ide_config *ide, int multi)
 	dbg2_printf("  finish\n");
 }
 
+static void process_read(ide_config *ide, int multi)
+{
+	uint32_t lba = get_lba(ide);
+	drive_t *drive = &ide->drive[ide->regs.drv];
+
+	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
+
+	// Sectors of all the DRQ blocks of the command are read in one go on the
+	// channel worker, the fake RDB area is made on the main thread.
+	uint32_t total = ide->regs.sector_count ? ide->regs.sector_count : 256;
+	if (lba < drive->offset)
+	{
+		process_read_send(ide, multi, lba, NULL);
+		return;
+	}
+
+	uint8_t *dst = ide_async_buf(ide);
+	static const uint8_t *burst[2];
+	const uint8_t **res = &burst[ide - ide_inst];
+
+	ide_async(ide,
+		[drive, lba, total, dst, res]() { *res = readhdd(drive, lba, total, dst); },
+		[multi, lba, res](ide_config *ide) { process_read_send(ide, multi, lba, *res); });
+}
+
 static void process_write(ide_config *ide, int multi)
 {
 	uint32_t lba = get_lba(ide);
@@ -864,7 +1230,7 @@ static void process_write(ide_config *ide, int multi)
 		}
 		else
 		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
+			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : !writehdd(&ide->drive[ide->regs.drv], lba - ide->drive[ide->regs.drv].offset, cnt);
 			lba += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
@@ -919,6 +1285,13 @@ static int handle_hdd(ide_config *ide)
 		process_write(ide, 0);
 		break;
 
+	case 0xE7: // flush cache
+	case 0xEA: // flush cache ext
+		if (!hdd_flush(&ide->drive[ide->regs.drv], 1)) return 1;
+		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
+		ide_set_regs(ide);
+		break;
+
 	case 0xC6: // set multople
 		if (ide->regs.sector_count > ide_io_max_size)
 		{
@@ -967,6 +1340,11 @@ void ide_io(int num, int req)
 
 	//printf("req: %d, disk: %d\n", req, num);
 
+	if (req) scheduler_activity();
+
+	// The core waits for the running read, except for a reset
+	if (!ide_async_finish(ide, req != 0)) return;
+
 	if (req == 0) // no request
 	{
 		if (ide->state == IDE_STATE_RESET)
@@ -1061,6 +1439,8 @@ int ide_is_placeholder(int num)
 
 void ide_reset(uint8_t hotswap[4])
 {
+	ide_cache_flush();
+
 	ide_inst[0].drive[0].placeholder = 0;
 	ide_inst[0].drive[1].placeholder = 0;
 	ide_inst[1].drive[0].placeholder = 0;
@@ -1093,6 +1473,10 @@ int ide_open(uint8_t unit, const char* filename)
 	static fileTYPE hdd_file[4] = {};
 	chs_t chs = {};
 
+	// hdd_file is reopened below
+	ide_async_finish(&ide_inst[unit >> 1], 1);
+	hdd_flush(&ide_inst[unit >> 1].drive[unit & 1], 0);
+
 	if (!is_minimig() || ((minimig_config.ide_cfg & 1) && minimig_config.hardfile[unit].cfg))
 	{
 		printf("\nChecking HDD %d\n", unit);
@@ -1133,3 +1517,41 @@ int ide_open(uint8_t unit, const char* filename)
 	FileClose(&hdd_file[unit]);
 	return 0;
 }
+
+void ide_cache_flush()
+{
+	for (int port = 0; port < 2; port++)
+	{
+		ide_async_finish(&ide_inst[port], 1);
+		for (int drv = 0; drv < 2; drv++) hdd_flush(&ide_inst[port].drive[drv], 0);
+	}
+
+	for (auto wc : ext_wcache)
+	{
+		if (!wc->used) continue;
+		wcache_flush(wc, wc->f);
+		if (wc->f && wc->f->filp) FileSync(wc->f);
+	}
+}
+
+void ide_cache_poll()
+{
+	for (int port = 0; port < 2; port++)
+	{
+		// The worker may be reading these images
+		if (ide_inst[port].state == IDE_STATE_WAIT_IO) continue;
+
+		for (int drv = 0; drv < 2; drv++)
+		{
+			drive_t *drive = &ide_inst[port].drive[drv];
+			if (drive->wcache && drive->wcache->used && CheckTimer(drive->wcache->timer)) hdd_flush(drive, 0);
+		}
+	}
+
+	for (auto wc : ext_wcache)
+	{
+		if (!wc->used || !CheckTimer(wc->timer)) continue;
+		wcache_flush(wc, wc->f);
+		if (wc->f && wc->f->filp) FileSync(wc->f);
+	}
+}
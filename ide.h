@@ -1,6 +1,8 @@
 #ifndef IDE_H
 #define IDE_H
 
+#include <functional>
+
 #include "support/chd/mister_chd.h"
 
 #define ATA_STATUS_BSY  0x80  // busy
@@ -31,6 +33,7 @@
 #define IDE_STATE_WAIT_PKT_RD   4
 #define IDE_STATE_WAIT_PKT_END  5
 #define IDE_STATE_WAIT_PKT_MODE 6
+#define IDE_STATE_WAIT_IO       7  // image read running on the channel worker
 
 struct regs_t
 {
@@ -69,6 +72,8 @@ struct track_t
 	int      chd_offset;
 };
 
+struct ide_wcache_t;
+
 struct drive_t
 {
 	fileTYPE *f;
@@ -106,10 +111,16 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
-	uint32_t  chd_last_partial_lba;
+	uint32_t  read_lba;          // next lba of the running CD read
+
+	// CD read-ahead window (image files)
+	uint8_t  *ra_buf;
+	track_t  *ra_track;
+	uint32_t  ra_lba;
+	uint32_t  ra_cnt;
+
+	ide_wcache_t *wcache;        // HDD write-back cache
 
 	uint16_t id[256];
 };
@@ -155,6 +166,34 @@ int ide_is_placeholder(int num);
 void ide_reset(uint8_t hotswap[4]);
 int ide_open(uint8_t unit, const char* filename);
 
+// Image reads of a channel run on its own worker thread so the other channel
+// is served meanwhile. job runs on the worker and must only touch the drive
+// images and ide_async_buf(), finish runs on the main thread afterwards (from
+// ide_io()) and talks to the core. Without the worker both run right away.
+void ide_async(ide_config *ide, std::function<void()> job, std::function<void(ide_config *)> finish);
+// Runs finish if the job is done, or waits for it with wait. Returns 0 if still running.
+int ide_async_finish(ide_config *ide, int wait);
+int ide_async_pending();
+uint8_t *ide_async_buf(ide_config *ide); // 256 sectors
+
+// HDD write-back cache
+void ide_cache_flush();
+void ide_cache_poll();
+
+// The same write-back cache for the images of other disks (ACSI and floppies
+// of the ST). It's made on the first write (*wc is NULL before) and written
+// back by ide_cache_poll()/ide_cache_flush() like the IDE ones. Without
+// ide_cache_size the sectors are written to the image right away.
+int ide_wcache_write(ide_wcache_t **wc, fileTYPE *f, uint32_t lba, const void *data, uint32_t cnt);
+// copies the sectors still in the cache over data read from the image
+void ide_wcache_read(ide_wcache_t *wc, uint32_t lba, void *data, uint32_t cnt);
+// writes back and frees the cache, before the image is closed
+void ide_wcache_close(ide_wcache_t **wc);
+
 void ide_io(int num, int req);
 
+// HDD sectors through the same read path as the READ commands, without the
+// core. Returns the data (mapped image or buf), NULL on error.
+const uint8_t *ide_read_direct(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf);
+
 #endif
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+
+#include "ide_bench.h"
+#include "ide.h"
+#include "file_io.h"
+#include "profiling.h"
+
+#define BENCH_HDD_INSTALL (256 * 1024 * 1024) // bytes read sequentially at most
+#define BENCH_HDD_BURST   256                 // sectors of a READ MULTIPLE
+#define BENCH_HDD_RAND    2000
+#define BENCH_HDD_SEEK    1000
+#define BENCH_CD_CMD      16                  // sectors of a READ(10)
+#define BENCH_CD_STREAM   8                   // seconds per speed
+#define BENCH_CD_SEEK     500
+#define BENCH_CD_SEQ      4096                // sectors
+
+static ide_config bench_ide;
+static uint32_t rnd_state;
+static uint32_t sink;
+
+static uint32_t bench_rand()
+{
+	// xorshift32, same sequence on every run
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void drop_caches()
+{
+	sync();
+	FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (f)
+	{
+		fputs("3", f);
+		fclose(f);
+	}
+}
+
+static FILE *json;
+static int json_count;
+
+// late: commands that missed the pace of a stream, -1 if not paced
+static void bench_result(const char *name, uint64_t bytes, uint64_t total_us, std::vector<uint32_t> &lat, int late)
+{
+	if (!total_us) total_us = 1;
+	std::sort(lat.begin(), lat.end());
+
+	uint32_t p50 = lat.empty() ? 0 : lat[lat.size() / 2];
+	uint32_t p99 = lat.empty() ? 0 : lat[(lat.size() * 99) / 100];
+	uint32_t max = lat.empty() ? 0 : lat.back();
+	uint64_t rate = bytes * 100 / total_us; // 0.01 MB/s
+
+	printf("ide_bench %-12s: %llu.%02llu MB/s, %u cmds, p50 %uus, p99 %uus, max %uus", name,
+		rate / 100, rate % 100, (uint32_t)lat.size(), p50, p99, max);
+	if (late >= 0) printf(", %d late", late);
+	printf("\n");
+
+	if (json)
+	{
+		fprintf(json, "%s\n    { \"name\": \"%s\", \"bytes\": %llu, \"us\": %llu, \"mb_s\": %llu.%02llu, \"cmds\": %u, \"p50_us\": %u, \"p99_us\": %u, \"max_us\": %u",
+			json_count ? "," : "", name, bytes, total_us, rate / 100, rate % 100, (uint32_t)lat.size(), p50, p99, max);
+		if (late >= 0) fprintf(json, ", \"late\": %d", late);
+		fprintf(json, " }");
+		json_count++;
+	}
+}
+
+// Every sector is touched like the transfer to the core would, mapped pages are faulted in
+static int hdd_cmd(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf)
+{
+	const uint8_t *data = ide_read_direct(drive, lba, cnt, buf);
+	if (!data) return 0;
+	for (int i = 0; i < cnt; i++) sink += data[i * 512];
+	return 1;
+}
+
+static void bench_hdd(const char *name)
+{
+	fileTYPE f;
+	if (!FileOpen(&f, name))
+	{
+		printf("ide_bench: cannot open %s\n", name);
+		return;
+	}
+
+	drive_t *drive = &bench_ide.drive[0];
+	drive->f = &f;
+	drive->present = 1;
+	drive->type = 1;
+	drive->offset = 0;
+	drive->wcache = NULL;
+	drive->total_sectors = f.size >> 9;
+
+	uint32_t total = drive->total_sectors;
+	uint8_t *buf = (uint8_t*)malloc(BENCH_HDD_BURST * 512);
+	if (!buf || total < BENCH_HDD_BURST * 2)
+	{
+		printf("ide_bench: image too small\n");
+		free(buf);
+		FileClose(&f);
+		return;
+	}
+
+	// sequential install: whole READ MULTIPLE bursts from the start
+	{
+		drop_caches();
+		std::vector<uint32_t> lat;
+		uint32_t end = std::min<uint64_t>(total, BENCH_HDD_INSTALL / 512);
+		uint64_t start = trace_now_us();
+		for (uint32_t lba = 0; lba + BENCH_HDD_BURST <= end; lba += BENCH_HDD_BURST)
+		{
+			uint64_t t = trace_now_us();
+			if (!hdd_cmd(drive, lba, BENCH_HDD_BURST, buf)) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		bench_result("hdd_install", (uint64_t)lat.size() * BENCH_HDD_BURST * 512, trace_now_us() - start, lat, -1);
+	}
+
+	// random 4K: aligned 8 sector reads all over the image
+	{
+		drop_caches();
+		std::vector<uint32_t> lat;
+		rnd_state = 0x49444530;
+		uint64_t start = trace_now_us();
+		for (int i = 0; i < BENCH_HDD_RAND; i++)
+		{
+			uint32_t lba = (bench_rand() % (total / 8)) * 8;
+			uint64_t t = trace_now_us();
+			if (!hdd_cmd(drive, lba, 8, buf)) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		bench_result("hdd_random4k", (uint64_t)lat.size() * 8 * 512, trace_now_us() - start, lat, -1);
+	}
+
+	// seek storm: single sectors alternating between the first and the last tenth
+	{
+		drop_caches();
+		std::vector<uint32_t> lat;
+		rnd_state = 0x53454B30;
+		uint32_t tenth = total / 10;
+		uint64_t start = trace_now_us();
+		for (int i = 0; i < BENCH_HDD_SEEK; i++)
+		{
+			uint32_t lba = bench_rand() % tenth;
+			if (i & 1) lba += total - tenth;
+			uint64_t t = trace_now_us();
+			if (!hdd_cmd(drive, lba, 1, buf)) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		bench_result("hdd_seek", (uint64_t)lat.size() * 512, trace_now_us() - start, lat, -1);
+	}
+
+	free(buf);
+	FileClose(&f);
+}
+
+// One READ(10), split into transfers the way cdrom_read does
+static int cd_cmd(uint32_t lba, uint32_t cnt, uint8_t *buf)
+{
+	ide_config *ide = &bench_ide;
+	ide->regs.pkt_cnt = cnt;
+	while (ide->regs.pkt_cnt)
+	{
+		uint32_t n = std::min<uint32_t>(ide->regs.pkt_cnt, ide_io_max_size / 4);
+		if (!cdrom_read_direct(ide, lba, n, buf)) return 0;
+		for (uint32_t i = 0; i < n; i++) sink += buf[i * 2048];
+		ide->regs.pkt_cnt -= n;
+		lba += n;
+	}
+	return 1;
+}
+
+static void bench_cd(const char *name)
+{
+	drive_t *drive = &bench_ide.drive[0];
+	bench_ide.regs.drv = 0;
+	bench_ide.null = 0;
+
+	if (!cdrom_open(drive, name))
+	{
+		printf("ide_bench: cannot open %s\n", name);
+		cdrom_open(drive, "");
+		return;
+	}
+
+	track_t *data = &drive->track[drive->data_num];
+	uint32_t first = data->start;
+	uint32_t sectors = data->length;
+	uint8_t *buf = (uint8_t*)malloc(ide_io_max_size / 4 * 2048);
+	if (!buf || sectors < BENCH_CD_SEQ * 2)
+	{
+		printf("ide_bench: data track too small\n");
+		free(buf);
+		cdrom_open(drive, "");
+		return;
+	}
+
+	// streaming: a command every interval, late if it takes longer than that
+	for (int speed = 1; speed <= 4; speed <<= 1)
+	{
+		drop_caches();
+		char test[32];
+		snprintf(test, sizeof(test), "cd_%dx", speed);
+
+		std::vector<uint32_t> lat;
+		uint64_t interval = 1000000ULL * BENCH_CD_CMD / (75 * speed);
+		int cmds = BENCH_CD_STREAM * 75 * speed / BENCH_CD_CMD;
+		uint32_t lba = first + (sectors / 4) * (speed >> 1); // other sectors for each speed
+		int late = 0;
+
+		uint64_t start = trace_now_us();
+		uint64_t next = start;
+		for (int i = 0; i < cmds && lba + BENCH_CD_CMD <= first + sectors; i++, lba += BENCH_CD_CMD)
+		{
+			uint64_t now = trace_now_us();
+			if (next > now) usleep(next - now);
+			next += interval;
+
+			uint64_t t = trace_now_us();
+			if (!cd_cmd(lba, BENCH_CD_CMD, buf)) break;
+			uint32_t us = trace_now_us() - t;
+			lat.push_back(us);
+			if (us > interval) late++;
+		}
+		bench_result(test, (uint64_t)lat.size() * BENCH_CD_CMD * 2048, trace_now_us() - start, lat, late);
+	}
+
+	// seek storm: random 8 sector commands over the data track
+	{
+		drop_caches();
+		std::vector<uint32_t> lat;
+		rnd_state = 0x43445330;
+		uint64_t start = trace_now_us();
+		for (int i = 0; i < BENCH_CD_SEEK; i++)
+		{
+			uint32_t lba = first + bench_rand() % (sectors - 8);
+			uint64_t t = trace_now_us();
+			if (!cd_cmd(lba, 8, buf)) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		bench_result("cd_seek", (uint64_t)lat.size() * 8 * 2048, trace_now_us() - start, lat, -1);
+	}
+
+	// sequential as fast as it goes
+	{
+		drop_caches();
+		std::vector<uint32_t> lat;
+		uint64_t start = trace_now_us();
+		for (uint32_t lba = first; lba < first + BENCH_CD_SEQ; lba += BENCH_CD_CMD)
+		{
+			uint64_t t = trace_now_us();
+			if (!cd_cmd(lba, BENCH_CD_CMD, buf)) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		bench_result("cd_seq", (uint64_t)lat.size() * BENCH_CD_CMD * 2048, trace_now_us() - start, lat, -1);
+	}
+
+	free(buf);
+	cdrom_open(drive, "");
+}
+
+int ide_bench_run(const char *image)
+{
+	if (!image || !*image)
+	{
+		printf("ide_bench: no image given\n");
+		return 0;
+	}
+
+	const char *ext = strrchr(image, '.');
+	int cd = ext && (!strcasecmp(ext, ".chd") || !strcasecmp(ext, ".cue") || !strcasecmp(ext, ".iso"));
+
+	char name[1024];
+	FileCreatePath("bench");
+	snprintf(name, sizeof(name), "%s/ide_bench.json", getFullPath("bench"));
+	json = fopen(name, "w");
+	json_count = 0;
+	if (json) fprintf(json, "{\n  \"image\": \"%s\",\n  \"results\": [", image);
+
+	printf("ide_bench: %s as %s\n", image, cd ? "CD" : "HDD");
+	if (cd) bench_cd(image);
+	else bench_hdd(image);
+
+	if (json)
+	{
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+		json = NULL;
+	}
+
+	printf("ide_bench: done\n");
+	return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef IDE_BENCH_H
+#define IDE_BENCH_H
+
+// IDE/CD workload benchmark: replays synthetic access patterns against an
+// image through the read paths of ide.cpp and ide_cdrom.cpp (read-ahead,
+// write-back cache overlay, mmap, CHD and cd_ram backends) on a private
+// channel, nothing is sent to the core. HDD images get a sequential install,
+// random 4K reads and a seek storm, CD images (chd, cue, iso) streaming at
+// 1x/2x/4x, a seek storm and an unpaced sequential read. Page cache is
+// dropped before every test, results go to bench/ide_bench.json.
+// Blocks the caller for up to a minute, run it with the OSD closed.
+int ide_bench_run(const char *image);
+
+#endif
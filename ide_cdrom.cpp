@@ -20,6 +20,7 @@
 #include "hardware.h"
 #include "cd.h"
 #include "ide.h"
+#include "arena.h"
 
 #if 0
 #define dbg_printf     printf
@@ -297,13 +298,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(tmpTOC.chd_hunksize);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -354,11 +348,69 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 }
 
 
+// Parsed track layout of a CUE sheet, the track files are opened again from their names
+#define CUE_CACHE_TRACKS (sizeof(((drive_t*)0)->track) / sizeof(track_t))
+static uint8_t cue_blob[1 + sizeof(((drive_t*)0)->track)];
+
+static const char* cue_data_track(drive_t *drv)
+{
+	for (uint8_t i = 0; i < drv->track_cnt; i++)
+	{
+		if (drv->track[i].attr == 0x40)
+		{
+			drv->data_num = i;
+			return drv->track[i].filename;
+		}
+	}
+
+	return 0;
+}
+
+static const char* load_cue_cached(drive_t *drv, const char *cuefile)
+{
+	int len = cd_cue_cache_get(cuefile, "ide_cdrom", cue_blob, sizeof(cue_blob));
+	if (len < 1 || cue_blob[0] > CUE_CACHE_TRACKS || len != (int)(1 + cue_blob[0] * sizeof(track_t))) return 0;
+
+	drv->track_cnt = cue_blob[0];
+	memcpy(drv->track, cue_blob + 1, drv->track_cnt * sizeof(track_t));
+
+	uint8_t opened = 0;
+	while (opened < drv->track_cnt && (!drv->track[opened].filename[0] || FileOpenEx(&drv->track[opened].f, drv->track[opened].filename, O_RDONLY))) opened++;
+
+	const char *data = (opened == drv->track_cnt) ? cue_data_track(drv) : 0;
+	if (data)
+	{
+		printf("cue: %d tracks of %s from the cache\n", drv->track_cnt, cuefile);
+		return data;
+	}
+
+	for (uint8_t i = 0; i < opened; i++) FileClose(&drv->track[i].f);
+	memset(drv->track, 0, sizeof(drv->track));
+	drv->track_cnt = 0;
+	return 0;
+}
+
+static void save_cue_cached(drive_t *drv, const char *cuefile)
+{
+	cue_blob[0] = drv->track_cnt;
+	for (uint8_t i = 0; i < drv->track_cnt; i++)
+	{
+		uint8_t *trk = cue_blob + 1 + i * sizeof(track_t);
+		memcpy(trk, &drv->track[i], sizeof(track_t));
+		memset(trk, 0, sizeof(fileTYPE)); // f comes first, handles aren't stored
+	}
+
+	cd_cue_cache_put(cuefile, "ide_cdrom", cue_blob, 1 + drv->track_cnt * sizeof(track_t));
+}
+
 static const char* load_cue_file(drive_t *drv, const char *cuefile)
 {
 	memset(drv->track, 0, sizeof(drv->track));
 	drv->track_cnt = 0;
 
+	const char *data = load_cue_cached(drv, cuefile);
+	if (data) return data;
+
 	track_t track = {};
 	uint32_t shift = 0;
 	uint32_t currPregap = 0;
@@ -508,16 +560,9 @@ static const char* load_cue_file(drive_t *drv, const char *cuefile)
 		return 0;
 	}
 
-	for (uint8_t i = 0; i < drv->track_cnt; i++)
-	{
-		if (drv->track[i].attr == 0x40)
-		{
-			drv->data_num = i;
-			return drv->track[i].filename;
-		}
-	}
-
-	return 0;
+	data = cue_data_track(drv);
+	if (data) save_cue_cached(drv, cuefile);
+	return data;
 }
 
 inline TMSF frames_to_msf(uint32_t frames)
@@ -991,29 +1036,105 @@ static void pkt_send(ide_config *ide, void *data, uint16_t size)
 	ide->state = IDE_STATE_WAIT_PKT_RD;
 }
 
-static void read_cd_sectors(ide_config *ide, track_t *track, int cnt)
+#define CD_READAHEAD_SECTORS 64   // raw sectors kept per drive
+#define CD_READAHEAD_MIN     16   // window for a non sequential read
+
+// Refill the read-ahead window of the drive at lba
+static int cd_readahead_fill(drive_t *drv, track_t *track, uint32_t lba, uint32_t want)
+{
+	if (!drv->ra_buf) drv->ra_buf = (uint8_t *)mem_pool_get(CD_READAHEAD_SECTORS * 2352);
+	if (!drv->ra_buf) return 0;
+
+	// Continue a sequential run with the full window
+	bool sequential = (drv->ra_track == track && lba == drv->ra_lba + drv->ra_cnt);
+	if (sequential || want < CD_READAHEAD_MIN) want = sequential ? CD_READAHEAD_SECTORS : CD_READAHEAD_MIN;
+	if (want > CD_READAHEAD_SECTORS) want = CD_READAHEAD_SECTORS;
+
+	drv->ra_track = NULL;
+	drv->ra_cnt = 0;
+
+	uint32_t pos = track->skip + (lba - track->start) * track->sectorSize;
+	if (!FileSeek(&track->f, pos, SEEK_SET)) return 0;
+
+	int ret = FileReadAdv(&track->f, drv->ra_buf, want * track->sectorSize, -1);
+	if (ret < track->sectorSize) return 0;
+
+	drv->ra_track = track;
+	drv->ra_lba = lba;
+	drv->ra_cnt = ret / track->sectorSize;
+	return 1;
+}
+
+static void read_cd_sectors(ide_config *ide, track_t *track, int cnt, uint8_t *dst)
 {
 	drive_t *drv = &ide->drive[ide->regs.drv];
-	uint32_t sz = drv->track[drv->data_num].sectorSize;
+	if (!track) ide->null = 1;
 
-	if (sz == 2048)
+	int left = cnt;
+	while (left > 0 && !ide->null)
 	{
-		if (!ide->null) ide->null = (FileReadAdv(&track->f, ide_buf, cnt * sz, -1) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * sz);
-		return;
+		uint32_t lba = drv->read_lba;
+		if (drv->ra_track != track || lba < drv->ra_lba || lba >= drv->ra_lba + drv->ra_cnt)
+		{
+			// Cover the rest of the whole transfer, not just this chunk
+			if (!cd_readahead_fill(drv, track, lba, ide->regs.pkt_cnt))
+			{
+				ide->null = 1;
+				break;
+			}
+		}
+
+		uint32_t sz = track->sectorSize;
+		uint32_t pre = (sz == 2048) ? 0 : track->mode2 ? 24 : 16;
+		uint32_t n = drv->ra_lba + drv->ra_cnt - lba;
+		if (n > (uint32_t)left) n = left;
+
+		const uint8_t *src = drv->ra_buf + (lba - drv->ra_lba) * sz;
+		if (sz == 2048)
+		{
+			memcpy(dst, src, n * 2048);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < n; i++) memcpy(dst + i * 2048, src + i * sz + pre, 2048);
+		}
+
+		dst += n * 2048;
+		left -= n;
+		drv->read_lba += n;
+	}
+
+	if (ide->null)
+	{
+		memset(dst, 0, left * 2048);
+		drv->read_lba += left;
 	}
+}
 
-	uint32_t pre = drv->track[drv->data_num].mode2 ? 24 : 16;
-	uint32_t post = sz - pre - 2048;
-	uint32_t off = 0;
+static void read_data(ide_config *ide, drive_t *drive, track_t *track, uint32_t cnt, uint8_t *dst)
+{
+	if (drive->chd_f)
+	{
+		cd_source_t src = {};
+		src.chd_f = drive->chd_f;
+		src.sector_size = drive->track[drive->data_num].sectorSize;
 
-	while (cnt--)
+		cd_read_format_t format = drive->track[drive->data_num].mode2 ? CD_READ_MODE2 : CD_READ_MODE1;
+		if (cd_read_sectors(&src, drive->read_lba + drive->track[drive->data_num].chd_offset, cnt, format, dst) < (int)cnt)
+		{
+			//I don't think anything else uses this, but set it just in case.
+			ide->null = 1;
+			memset(dst, 0, cnt * 2048);
+		}
+		else
+		{
+			ide->null = 0;
+		}
+		drive->read_lba += cnt;
+	}
+	else
 	{
-		if (!ide->null) ide->null = !FileSeek(&track->f, pre, SEEK_CUR);
-		if (!ide->null) ide->null = (FileReadAdv(&track->f, ide_buf + off, 2048, -1) <= 0);
-		if (ide->null) memset(ide_buf + off, 0, 2048);
-		if (!ide->null) ide->null = !FileSeek(&track->f, post, SEEK_CUR);
-		off += 2048;
+		read_cd_sectors(ide, track, cnt, dst);
 	}
 }
 
@@ -1040,55 +1161,39 @@ void cdrom_read(ide_config *ide)
 
 	track_t *track = get_track_from_lba(drive, ide->regs.pkt_lba, is_index0);
 
-	if (ide->state == IDE_STATE_INIT_RW && !drive->chd_f && track)
+	if (ide->state == IDE_STATE_INIT_RW)
 	{
-		uint32_t pos = track->skip + (ide->regs.pkt_lba - track->start) * track->sectorSize;
-		ide->null = (FileSeek(&track->f, pos, SEEK_SET) < 0);
+		drive->read_lba = ide->regs.pkt_lba;
+		ide->null = 0;
 	}
 
+	// Read on the channel worker, the other IDE channel is served meanwhile
+	uint8_t *dst = ide_async_buf(ide);
+	ide_async(ide, [ide, drive, track, cnt, dst]() { read_data(ide, drive, track, cnt, dst); },
+	[cnt, dst](ide_config *ide)
+	{
+		dbg_printf("\nsector:\n");
+		dbg_hexdump(dst, 512, 0);
 
-	if (drive->chd_f) {
-
-		uint32_t hdr = drive->track[drive->data_num].mode2 ? 24 : 16;
-		if (drive->track[drive->data_num].sectorSize == 2048)
-		{
-			hdr = 0;
-		}
-		uint32_t d_offset = 0;
-
-		if (ide->state == IDE_STATE_INIT_RW)
-		{
-			drive->chd_last_partial_lba = ide->regs.pkt_lba;
-		}
-
-		for (uint32_t i = 0; i < cnt; i++)
-		{
+		ide->regs.pkt_cnt -= cnt;
+		pkt_send(ide, dst, cnt * 2048);
+	});
+}
 
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
-			{
-				//I don't think anything else uses this, but set it just in case.
-				ide->null = 1;
-				memset(ide_buf + d_offset, 0, 2048);
-			}
-			else
-			{
-				ide->null = 0;
-			}
-			d_offset += 2048;
-			drive->chd_last_partial_lba++;
-		}
+int cdrom_read_direct(ide_config *ide, uint32_t lba, uint32_t cnt, uint8_t *dst)
+{
+	bool is_index0 = false;
+	drive_t *drive = &ide->drive[ide->regs.drv];
+	track_t *track = get_track_from_lba(drive, lba, is_index0);
 
-	}
-	else
+	if (lba != drive->read_lba || ide->null)
 	{
-		read_cd_sectors(ide, track, cnt);
+		drive->read_lba = lba;
+		ide->null = 0;
 	}
 
-	dbg_printf("\nsector:\n");
-	dbg_hexdump(ide_buf, 512, 0);
-
-	ide->regs.pkt_cnt -= cnt;
-	pkt_send(ide, ide_buf, cnt * 2048);
+	read_data(ide, drive, track, cnt, dst);
+	return !ide->null;
 }
 
 static int disc_info(drive_t *drv, uint16_t maxlen) 
@@ -1642,49 +1747,49 @@ void cdrom_close_chd(drive_t *drv)
 
 	if (drv->chd_f)
 	{
-		chd_close(drv->chd_f);
+		mister_chd_close(drv->chd_f);
 		drv->chd_f = NULL;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
-	}
-	drv->chd_hunknum = -1;
 }
 
-const char* cdrom_parse(uint32_t num, const char *filename)
+const char* cdrom_open(drive_t *drv, const char *filename)
 {
 	const char *res = 0;
 
-	int drv = num & 1;
-	num >>= 1;
-
 	//always close files and reset state. empty filename == unmounted cd from OSD
-	cdrom_close_chd(&ide_inst[num].drive[drv]);
-	for (uint8_t i = 0; i < sizeof(ide_inst[num].drive[drv].track) / sizeof(track_t); i++)
-	{
-		if (ide_inst[num].drive[drv].track[i].f.opened())
+	cdrom_close_chd(drv);
+	drv->ra_track = NULL;
+	drv->ra_cnt = 0;
+	mem_pool_put(drv->ra_buf, CD_READAHEAD_SECTORS * 2352);
+	drv->ra_buf = NULL;
+	for (uint8_t i = 0; i < sizeof(drv->track) / sizeof(track_t); i++)
+	{
+		if (drv->track[i].f.opened())
 		{
-			FileClose(&ide_inst[num].drive[drv].track[i].f);
+			FileClose(&drv->track[i].f);
 		}
 	}
-	ide_inst[num].drive[drv].mcr_flag = true;
-	ide_inst[num].drive[drv].playing = 0;
-	ide_inst[num].drive[drv].paused = 0;
-	ide_inst[num].drive[drv].play_start_lba = 0;
-	ide_inst[num].drive[drv].play_end_lba = 0;
+	drv->mcr_flag = true;
+	drv->playing = 0;
+	drv->paused = 0;
+	drv->play_start_lba = 0;
+	drv->play_end_lba = 0;
 	if (strlen(filename))
 	{
 		const char *path = getFullPath(filename);
-		res = load_chd_file(&ide_inst[num].drive[drv], path);
-		if (!res) res = load_cue_file(&ide_inst[num].drive[drv], path);
-		if (!res) res = load_iso_file(&ide_inst[num].drive[drv], path);
+		res = load_chd_file(drv, path);
+		if (!res) res = load_cue_file(drv, path);
+		if (!res) res = load_iso_file(drv, path);
 	}
 	return res;
 }
 
+const char* cdrom_parse(uint32_t num, const char *filename)
+{
+	return cdrom_open(&ide_inst[num >> 1].drive[num & 1], filename);
+}
+
 void ide_cdda_send_sector()
 {
 	bool is_index0 = false;
@@ -1708,6 +1813,9 @@ void ide_cdda_send_sector()
 
 	if (!drv || !ide) return;
 
+	// Image files may be shared with the data track being read
+	ide_async_finish(ide, 1);
+
 	bool needs_swap = false;
 	track_t *track = get_track_from_lba(drv, drv->play_start_lba, is_index0);
 
@@ -1715,7 +1823,11 @@ void ide_cdda_send_sector()
 	{
 		if (drv->chd_f)
 		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
+			// Swapped together with the volume below
+			cd_source_t src = {};
+			src.chd_f = drv->chd_f;
+			src.sector_size = BYTES_PER_RAW_REDBOOK_FRAME;
+			cd_read_sectors(&src, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 1, CD_READ_RAW, cdda_buf);
 			needs_swap = true;
 		}
 		else
@@ -9,5 +9,10 @@ void cdrom_mode_select(ide_config *ide);
 void ide_cdda_send_sector();
 
 const char* cdrom_parse(uint32_t num, const char *filename);
+const char* cdrom_open(drive_t *drv, const char *filename);
+
+// Data sectors (2048 bytes) through the same read path as cdrom_read, without
+// the core. Returns 0 on a read error, dst is zeroed then.
+int cdrom_read_direct(ide_config *ide, uint32_t lba, uint32_t cnt, uint8_t *dst);
 
 #endif
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_reduce.h"
+#include "miniz.h"
+
+#define PNG_MAX_PIXELS (64 * 1024 * 1024)
+
+struct png_t
+{
+	FILE *fp;
+	uint32_t width, height;
+	int depth, color, interlace;
+	int channels;
+	uint32_t pal[256];
+	int trns;           // tRNS chunk present
+	uint16_t trns_key[3]; // gray or RGB key for types 0 and 2
+	uint32_t idat_left; // bytes left in the current IDAT chunk
+	int idat_end;       // no more IDAT chunks
+};
+
+static uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int chunk_head(png_t *png, uint32_t *len, uint32_t *type)
+{
+	uint8_t hdr[8];
+	if (fread(hdr, 1, 8, png->fp) != 8) return 0;
+	*len = be32(hdr);
+	*type = be32(hdr + 4);
+	return *len < 0x80000000;
+}
+
+#define CHUNK(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// Reads up to the first IDAT chunk.
+static int png_header(png_t *png)
+{
+	static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	uint8_t buf[1024];
+	if (fread(buf, 1, 8, png->fp) != 8 || memcmp(buf, sig, 8)) return 0;
+
+	for (int i = 0; i < 256; i++) png->pal[i] = 0xFF000000;
+
+	uint32_t len, type;
+	int have_hdr = 0;
+	while (chunk_head(png, &len, &type))
+	{
+		if (type == CHUNK('I', 'D', 'A', 'T'))
+		{
+			png->idat_left = len;
+			return have_hdr;
+		}
+
+		if (type == CHUNK('I', 'E', 'N', 'D')) return 0;
+
+		if ((type == CHUNK('I', 'H', 'D', 'R') || type == CHUNK('P', 'L', 'T', 'E') || type == CHUNK('t', 'R', 'N', 'S')) && len <= sizeof(buf))
+		{
+			if (fread(buf, 1, len, png->fp) != len) return 0;
+			fseek(png->fp, 4, SEEK_CUR);
+
+			if (type == CHUNK('I', 'H', 'D', 'R'))
+			{
+				if (len < 13) return 0;
+				png->width = be32(buf);
+				png->height = be32(buf + 4);
+				png->depth = buf[8];
+				png->color = buf[9];
+				png->interlace = buf[12];
+				have_hdr = 1;
+			}
+			else if (type == CHUNK('P', 'L', 'T', 'E'))
+			{
+				for (uint32_t i = 0; i < len / 3 && i < 256; i++)
+				{
+					png->pal[i] = 0xFF000000 | (buf[i * 3] << 16) | (buf[i * 3 + 1] << 8) | buf[i * 3 + 2];
+				}
+			}
+			else
+			{
+				png->trns = 1;
+				if (png->color == 3)
+				{
+					for (uint32_t i = 0; i < len && i < 256; i++) png->pal[i] = (png->pal[i] & 0xFFFFFF) | (buf[i] << 24);
+				}
+				else
+				{
+					for (uint32_t i = 0; i < len / 2 && i < 3; i++) png->trns_key[i] = (buf[i * 2] << 8) | buf[i * 2 + 1];
+				}
+			}
+			continue;
+		}
+
+		if (fseek(png->fp, len + 4, SEEK_CUR)) return 0;
+	}
+
+	return 0;
+}
+
+static uint32_t idat_read(png_t *png, uint8_t *buf, uint32_t size)
+{
+	while (!png->idat_left && !png->idat_end)
+	{
+		uint32_t len, type;
+		fseek(png->fp, 4, SEEK_CUR); // CRC
+		if (!chunk_head(png, &len, &type) || type != CHUNK('I', 'D', 'A', 'T')) png->idat_end = 1;
+		else png->idat_left = len;
+	}
+
+	if (size > png->idat_left) size = png->idat_left;
+	size = fread(buf, 1, size, png->fp);
+	png->idat_left -= size;
+	if (!size) png->idat_end = 1;
+	return size;
+}
+
+static void unfilter(uint8_t *row, const uint8_t *prev, int len, int bpp, int type)
+{
+	switch (type)
+	{
+	case 1:
+		for (int i = bpp; i < len; i++) row[i] += row[i - bpp];
+		break;
+
+	case 2:
+		for (int i = 0; i < len; i++) row[i] += prev[i];
+		break;
+
+	case 3:
+		for (int i = 0; i < len; i++) row[i] += ((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1;
+		break;
+
+	case 4:
+		for (int i = 0; i < len; i++)
+		{
+			int a = (i >= bpp) ? row[i - bpp] : 0;
+			int b = prev[i];
+			int c = (i >= bpp) ? prev[i - bpp] : 0;
+			int p = a + b - c;
+			int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+			row[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+		}
+		break;
+	}
+}
+
+// unpacked sample x of a 1/2/4/8 bit row
+static int sample(const uint8_t *row, uint32_t x, int depth)
+{
+	if (depth == 8) return row[x];
+	uint32_t bit = x * depth;
+	return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+// one row of samples to ARGB
+static void png_expand(const png_t *png, const uint8_t *row, uint32_t *out, uint32_t count)
+{
+	int d = png->depth;
+	int s = (d == 16) ? 2 : 1; // bytes per sample
+
+	for (uint32_t x = 0; x < count; x++)
+	{
+		const uint8_t *p = row + x * png->channels * s;
+		uint32_t a = 0xFF, r, g, b;
+
+		switch (png->color)
+		{
+		case 0:
+			if (d < 8)
+			{
+				int v = sample(row, x, d);
+				r = g = b = v * 255 / ((1 << d) - 1);
+				if (png->trns && v == png->trns_key[0]) a = 0;
+			}
+			else
+			{
+				r = g = b = p[0];
+				if (png->trns && ((s == 2) ? ((p[0] << 8) | p[1]) : p[0]) == png->trns_key[0]) a = 0;
+			}
+			break;
+
+		case 2:
+			r = p[0];
+			g = p[s];
+			b = p[s * 2];
+			if (png->trns)
+			{
+				if (s == 2)
+				{
+					if (((p[0] << 8) | p[1]) == png->trns_key[0] && ((p[2] << 8) | p[3]) == png->trns_key[1] && ((p[4] << 8) | p[5]) == png->trns_key[2]) a = 0;
+				}
+				else if (p[0] == png->trns_key[0] && p[1] == png->trns_key[1] && p[2] == png->trns_key[2]) a = 0;
+			}
+			break;
+
+		case 3:
+			out[x] = png->pal[sample(row, x, d)];
+			continue;
+
+		case 4:
+			r = g = b = p[0];
+			a = p[s];
+			break;
+
+		default:
+			r = p[0];
+			g = p[s];
+			b = p[s * 2];
+			a = p[s * 3];
+			break;
+		}
+
+		out[x] = (a << 24) | (r << 16) | (g << 8) | b;
+	}
+}
+
+static uint32_t *png_load_reduced(png_t *png, int want_w, int want_h, int keep_aspect, int *width, int *height)
+{
+	uint32_t w = png->width, h = png->height;
+	if (!w || !h || (uint64_t)w * h > PNG_MAX_PIXELS || png->interlace) return NULL;
+
+	switch (png->color)
+	{
+	case 0: png->channels = 1; break;
+	case 2: png->channels = 3; break;
+	case 3: png->channels = 1; break;
+	case 4: png->channels = 2; break;
+	case 6: png->channels = 4; break;
+	default: return NULL;
+	}
+
+	int d = png->depth;
+	if (d != 1 && d != 2 && d != 4 && d != 8 && d != 16) return NULL;
+	if ((png->color == 3 && d == 16) || (png->color != 0 && png->color != 3 && d < 8)) return NULL;
+
+	// target size and the reduction factor
+	double tw = want_w, th = want_h;
+	if (keep_aspect)
+	{
+		double s = ((double)want_w / w < (double)want_h / h) ? (double)want_w / w : (double)want_h / h;
+		tw = w * s;
+		th = h * s;
+	}
+	uint32_t fx = (tw >= 1) ? (uint32_t)(w / tw) : w;
+	uint32_t fy = (th >= 1) ? (uint32_t)(h / th) : h;
+	uint32_t f = (fx < fy) ? fx : fy;
+	if (f < 1) f = 1;
+
+	uint32_t ow = w / f, oh = h / f;
+	uint32_t stride = (w * png->channels * d + 7) / 8;
+	int bpp = (png->channels * d + 7) / 8;
+
+	uint8_t *cur = (uint8_t*)malloc(stride + 1);
+	uint8_t *prev = (uint8_t*)calloc(1, stride);
+	uint32_t *line = (uint32_t*)malloc(w * 4);
+	uint32_t *acc = (uint32_t*)calloc(ow * 4, 4);
+	uint32_t *out = (uint32_t*)malloc((size_t)ow * oh * 4);
+	uint8_t *in = (uint8_t*)malloc(16384);
+
+	mz_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	int ok = cur && prev && line && acc && out && in && mz_inflateInit(&zs) == MZ_OK;
+
+	uint32_t y = 0, fill = 0;
+	uint32_t div = f * f;
+	while (ok && y < oh * f)
+	{
+		if (!zs.avail_in)
+		{
+			zs.next_in = in;
+			zs.avail_in = idat_read(png, in, 16384);
+		}
+
+		zs.next_out = cur + fill;
+		zs.avail_out = stride + 1 - fill;
+		int st = mz_inflate(&zs, MZ_SYNC_FLUSH);
+		fill = stride + 1 - zs.avail_out;
+
+		if (fill == stride + 1)
+		{
+			unfilter(cur + 1, prev, stride, bpp, cur[0]);
+			png_expand(png, cur + 1, line, ow * f);
+
+			for (uint32_t x = 0; x < ow * f; x++)
+			{
+				uint32_t c = line[x];
+				uint32_t *a = acc + (x / f) * 4;
+				a[0] += c >> 24;
+				a[1] += (c >> 16) & 0xFF;
+				a[2] += (c >> 8) & 0xFF;
+				a[3] += c & 0xFF;
+			}
+
+			if ((y % f) == f - 1)
+			{
+				uint32_t *o = out + (y / f) * ow;
+				for (uint32_t x = 0; x < ow; x++)
+				{
+					uint32_t *a = acc + x * 4;
+					o[x] = (((a[0] + div / 2) / div) << 24) | (((a[1] + div / 2) / div) << 16) | (((a[2] + div / 2) / div) << 8) | ((a[3] + div / 2) / div);
+				}
+				memset(acc, 0, ow * 16);
+			}
+
+			memcpy(prev, cur + 1, stride);
+			fill = 0;
+			y++;
+			continue;
+		}
+
+		if (st == MZ_STREAM_END || (st < 0 && st != MZ_BUF_ERROR) || (st == MZ_BUF_ERROR && !zs.avail_in && png->idat_end)) ok = 0;
+	}
+
+	if (zs.state) mz_inflateEnd(&zs);
+	free(cur);
+	free(prev);
+	free(line);
+	free(acc);
+	free(in);
+
+	if (!ok)
+	{
+		free(out);
+		return NULL;
+	}
+
+	*width = ow;
+	*height = oh;
+	return out;
+}
+
+uint32_t *image_reduce_load(const char *path, int want_w, int want_h, int keep_aspect, int *width, int *height, int *has_alpha)
+{
+	if (want_w < 1 || want_h < 1) return NULL;
+
+	png_t png;
+	memset(&png, 0, sizeof(png));
+	png.fp = fopen(path, "rb");
+	if (!png.fp) return NULL;
+
+	uint32_t *pixels = NULL;
+	if (png_header(&png))
+	{
+		pixels = png_load_reduced(&png, want_w, want_h, keep_aspect, width, height);
+		if (has_alpha) *has_alpha = png.trns || png.color == 4 || png.color == 6;
+	}
+
+	fclose(png.fp);
+	return pixels;
+}
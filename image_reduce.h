@@ -0,0 +1,15 @@
+#ifndef IMAGE_REDUCE_H
+#define IMAGE_REDUCE_H
+
+#include <stdint.h>
+
+// Decodes a picture already reduced for the size it's going to be shown at:
+// by the largest integer factor that still leaves it at least want_w x
+// want_h (with keep_aspect, at least the size it gets when fitted into that
+// box), box filtered. PNG is decoded row by row with the reduction done on
+// the way, so the full size picture is never in memory.
+// Returns malloc'ed ARGB pixels, NULL for anything else than a
+// non-interlaced PNG (left to Imlib2). No Imlib lock needed.
+uint32_t *image_reduce_load(const char *path, int want_w, int want_h, int keep_aspect, int *width, int *height, int *has_alpha);
+
+#endif
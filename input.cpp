@@ -18,20 +18,40 @@
 #include <stdarg.h>
 #include <math.h>
 
+#include <string>
+#include <vector>
+#include <unordered_map>
+
 #include "input.h"
 #include "user_io.h"
 #include "menu.h"
 #include "hardware.h"
+#include "scheduler.h"
 #include "cfg.h"
 #include "fpga_io.h"
+#include "spi.h"
 #include "osd.h"
 #include "video.h"
 #include "audio.h"
 #include "joymapping.h"
 #include "support.h"
 #include "profiling.h"
+#include "realtime.h"
+#include "memtrack.h"
+#include "load_times.h"
+#include "input_latency.h"
+#include "storage_probe.h"
 #include "gamecontroller_db.h"
 #include "str_util.h"
+#include "io_bench.h"
+#include "ide_bench.h"
+#include "rom_catalog.h"
+#include "crc.h"
+#include "capture.h"
+#include "input_queue.h"
+#include "proc_run.h"
+#include "offload.h"
+#include "devio.h"
 
 #define NUMDEV 30
 #define NUMPLAYERS 6
@@ -1101,6 +1121,17 @@ uint32_t get_archie_code(uint16_t key)
 	return ev2archie[key];
 }
 
+const int *get_kbd_table(int table)
+{
+	switch (table)
+	{
+	case KBD_TABLE_PS2_SET1: return ev2ps2_set1;
+	case KBD_TABLE_AMIGA: return ev2amiga;
+	case KBD_TABLE_ARCHIE: return ev2archie;
+	default: return ev2ps2;
+	}
+}
+
 static uint32_t modifier = 0;
 
 uint32_t get_key_mod()
@@ -1130,6 +1161,17 @@ enum QUIRK
 	QUIRK_WHEEL,
 };
 
+#define FAST_MAP_SIZE 256 // power of 2
+
+// Calibrated gun axis -> stick position, value = ((pos - mid) * mul) >> 16.
+// Rebuilt when the calibration or the stick range changes, see gun_xf().
+typedef struct
+{
+	int32_t min, max, mid;
+	int32_t mul;
+	int32_t range;
+} gun_xf_t;
+
 typedef struct
 {
 	uint16_t bustype, vid, pid, version;
@@ -1177,6 +1219,9 @@ typedef struct
 
 	int      lightgun_req;
 	int      lightgun;
+	gun_xf_t gunxf[2];
+	int      gun_pos[2];
+	int      gun_dirty;
 
 	int      has_rumble;
 	int      rumble_en;
@@ -1205,6 +1250,14 @@ typedef struct
 	float    max_range[2];
 
 	uint32_t deadzone;
+
+	// map[] and mmap[] compiled into code -> button masks and axis roles,
+	// see fast_map_build()
+	uint8_t  fast_valid;
+	uint16_t fast_code[FAST_MAP_SIZE];
+	uint64_t fast_mask[FAST_MAP_SIZE];
+	uint32_t fast_sys[FAST_MAP_SIZE];
+	uint8_t  fast_axis[256];
 } devInput;
 
 static devInput input[NUMDEV] = {};
@@ -1219,6 +1272,82 @@ static devInput player_pdsp[NUMPLAYERS] = {};
 
 #define BTN_NUM (sizeof(devInput::map) / sizeof(devInput::map[0]))
 
+// Open addressed, both sets of every button and the system buttons fit with the table at most half full
+#define FAST_MAP_HASH(code) (((code) * 0x9E37u >> 8) & (FAST_MAP_SIZE - 1))
+
+// fast_axis[] by ABS code: 1..4 for left X, left Y, right X, right Y (0 if not
+// a stick axis), FAST_AXIS_2WAY if both directions make digital directions
+#define FAST_AXIS_ROLE 0x07
+#define FAST_AXIS_2WAY 0x10
+
+static int fast_map_slot(devInput *inp, uint16_t code)
+{
+	uint32_t h = FAST_MAP_HASH(code);
+	while (inp->fast_code[h] && inp->fast_code[h] != code) h = (h + 1) & (FAST_MAP_SIZE - 1);
+	inp->fast_code[h] = code;
+	return h;
+}
+
+static void fast_map_build(int dev)
+{
+	devInput *inp = &input[dev];
+	memset(inp->fast_code, 0, sizeof(inp->fast_code));
+	memset(inp->fast_mask, 0, sizeof(inp->fast_mask));
+	memset(inp->fast_sys, 0, sizeof(inp->fast_sys));
+	memset(inp->fast_axis, 0, sizeof(inp->fast_axis));
+
+	for (uint i = 0; i < BTN_NUM; i++)
+	{
+		uint16_t codes[2] = { (uint16_t)(inp->map[i] & 0xFFFF), (uint16_t)(inp->map[i] >> 16) };
+		for (int set = 0; set < 2; set++)
+		{
+			uint16_t code = codes[set];
+			// a code in both sets only triggers the primary one
+			if (!code || (set && code == codes[0])) continue;
+			inp->fast_mask[fast_map_slot(inp, code)] |= (uint64_t)1 << (i + set * 32);
+		}
+	}
+
+	// mouse emulation and OSD buttons, whole entries are codes
+	for (int i = SYS_MS_RIGHT; i <= SYS_BTN_MENU_FUNC; i++)
+	{
+		if (inp->mmap[i] && inp->mmap[i] <= 0xFFFF) inp->fast_sys[fast_map_slot(inp, inp->mmap[i])] |= 1 << i;
+	}
+
+	// analog sticks in the order they're checked, the first one wins
+	int sticks[4] = { inp->stick_l[0], inp->stick_l[1], inp->stick_r[0], inp->stick_r[1] };
+	for (int n = 0; n < 4; n++)
+	{
+		uint16_t code = (uint16_t)inp->mmap[sticks[n]];
+		if (sticks[n] && code < 256 && !(inp->fast_axis[code] & FAST_AXIS_ROLE)) inp->fast_axis[code] |= n + 1;
+	}
+
+	for (int n = 0; n < 4; n++)
+	{
+		uint16_t code = inp->mmap[SYS_AXIS1_X + n] & 0xFFFF;
+		if (inp->mmap[SYS_AXIS1_X + n] && code < 256) inp->fast_axis[code] |= FAST_AXIS_2WAY;
+	}
+
+	inp->fast_valid = 1;
+}
+
+static int fast_map_find(devInput *inp, uint16_t code)
+{
+	uint32_t h = FAST_MAP_HASH(code);
+	while (inp->fast_code[h])
+	{
+		if (inp->fast_code[h] == code) return h;
+		h = (h + 1) & (FAST_MAP_SIZE - 1);
+	}
+	return -1;
+}
+
+static uint64_t fast_map_lookup(int dev, uint16_t code)
+{
+	int h = fast_map_find(&input[dev], code);
+	return (h < 0) ? 0 : input[dev].fast_mask[h];
+}
+
 int mfd = -1;
 int mwd = -1;
 
@@ -1246,6 +1375,9 @@ static int set_watch()
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
 
+static int hotplug_event(const char *name, int created);
+
+// Returns 1 if all devices have to be opened again
 static int check_devs()
 {
 	int result = 0;
@@ -1262,46 +1394,18 @@ static int check_devs()
 	while (i<length)
 	{
 		struct inotify_event *event = (struct inotify_event *) &buffer[i];
-		if (event->len)
+		if (event->len && (event->mask & (IN_CREATE | IN_DELETE)))
 		{
-			if (event->mask & IN_CREATE)
-			{
-				result = 1;
-				if (event->mask & IN_ISDIR)
-				{
-					printf("The directory %s was created.\n", event->name);
-				}
-				else
-				{
-					printf("The file %s was created.\n", event->name);
-				}
-			}
-			else if (event->mask & IN_DELETE)
+			int created = (event->mask & IN_CREATE) ? 1 : 0;
+			if (event->mask & IN_ISDIR)
 			{
-				result = 1;
-				if (event->mask & IN_ISDIR)
-				{
-					printf("The directory %s was deleted.\n", event->name);
-				}
-				else
-				{
-					printf("The file %s was deleted.\n", event->name);
-				}
+				printf("The directory %s was %s.\n", event->name, created ? "created" : "deleted");
 			}
-			/*
-			else if ( event->mask & IN_MODIFY )
+			else
 			{
-				result = 1;
-				if ( event->mask & IN_ISDIR )
-				{
-					printf( "The directory %s was modified.\n", event->name );
-				}
-				else
-				{
-					printf( "The file %s was modified.\n", event->name );
-				}
+				printf("The file %s was %s.\n", event->name, created ? "created" : "deleted");
+				if ((!strncmp(event->name, "event", 5) || !strncmp(event->name, "mouse", 5)) && !hotplug_event(event->name, created)) result = 1;
 			}
-			*/
 		}
 		i += EVENT_SIZE + event->len;
 	}
@@ -1364,12 +1468,86 @@ void sysled_enable(int en)
 }
 
 #define JOYMAP_DIR  "inputs/"
+
+// Map files in the config folder, names relative to it. Both folders the maps
+// are kept in are listed on first use, so looking up a device without own maps
+// needs no file I/O. A file is read when first asked for and kept, saves and
+// deletes go through here as well.
+struct map_file_t
+{
+	bool loaded;
+	std::vector<uint8_t> data;
+};
+
+static std::unordered_map<std::string, map_file_t> map_files;
+static bool map_files_listed = false;
+
+static void map_cache_list(const char *dir)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s", getFullPath(CONFIG_DIR), dir);
+
+	DIR *d = opendir(path);
+	if (!d) return;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		int len = strlen(de->d_name);
+		if (de->d_type != DT_DIR && len > 4 && !strcasecmp(de->d_name + len - 4, ".map"))
+		{
+			map_files[std::string(dir) + de->d_name] = map_file_t();
+		}
+	}
+	closedir(d);
+}
+
+static int map_cache_load(const char *name, void *pBuffer, int size)
+{
+	if (!map_files_listed)
+	{
+		map_cache_list("");
+		map_cache_list(JOYMAP_DIR);
+		map_files_listed = true;
+		printf("Map cache: %d map files.\n", (int)map_files.size());
+	}
+
+	auto it = map_files.find(name);
+	if (it == map_files.end()) return 0;
+
+	map_file_t &file = it->second;
+	if (!file.loaded)
+	{
+		int len = FileLoadConfig(name, NULL, 0);
+		if (len > 0 && len <= 65536)
+		{
+			file.data.resize(len);
+			len = FileLoadConfig(name, file.data.data(), len);
+			file.data.resize((len > 0) ? len : 0);
+		}
+		file.loaded = true;
+	}
+
+	int len = ((int)file.data.size() < size) ? (int)file.data.size() : size;
+	if (len) memcpy(pBuffer, file.data.data(), len);
+	return len;
+}
+
+static void map_cache_store(const char *name, const void *pBuffer, int size)
+{
+	if (!map_files_listed) return;
+
+	map_file_t &file = map_files[name];
+	file.data.assign((const uint8_t*)pBuffer, (const uint8_t*)pBuffer + size);
+	file.loaded = true;
+}
+
 static int load_map(const char *name, void *pBuffer, int size)
 {
 	char path[256] = { JOYMAP_DIR };
 	strcat(path, name);
-	int ret = FileLoadConfig(path, pBuffer, size);
-	if (!ret) return FileLoadConfig(name, pBuffer, size);
+	int ret = map_cache_load(path, pBuffer, size);
+	if (!ret) return map_cache_load(name, pBuffer, size);
 	return ret;
 }
 
@@ -1379,6 +1557,8 @@ static void delete_map(const char *name)
 	strcat(path, name);
 	FileDeleteConfig(name);
 	FileDeleteConfig(path);
+	map_files.erase(name);
+	map_files.erase(path);
 }
 
 static int save_map(const char *name, void *pBuffer, int size)
@@ -1386,7 +1566,12 @@ static int save_map(const char *name, void *pBuffer, int size)
 	char path[256] = { JOYMAP_DIR };
 	strcat(path, name);
 	FileDeleteConfig(name);
-	return FileSaveConfig(path, pBuffer, size);
+	map_files.erase(name);
+
+	int ret = FileSaveConfig(path, pBuffer, size);
+	if (ret) map_cache_store(path, pBuffer, size);
+	else map_files.erase(path);
+	return ret;
 }
 
 static int mapping = 0;
@@ -1406,6 +1591,28 @@ static int tmp_axis_n = 0;
 
 static int grabbed = 1;
 
+// map[] is edited in place while mapping, the tables are rebuilt afterwards
+static int fast_map_ready(int dev)
+{
+	if (mapping) input[dev].fast_valid = 0;
+	else if (!input[dev].fast_valid) fast_map_build(dev);
+	return input[dev].fast_valid;
+}
+
+// First of mmap[from..to] (system buttons) that is code, -1 if none.
+static int sys_find(int dev, uint16_t code, int from, int to)
+{
+	if (fast_map_ready(dev))
+	{
+		int h = fast_map_find(&input[dev], code);
+		uint32_t mask = (h < 0) ? 0 : input[dev].fast_sys[h] & (((2u << to) - 1) & ~((1u << from) - 1));
+		return mask ? __builtin_ctz(mask) : -1;
+	}
+
+	for (int i = from; i <= to; i++) if (code == input[dev].mmap[i]) return i;
+	return -1;
+}
+
 void start_map_setting(int cnt, int set)
 {
 	mapping_current_key = 0;
@@ -1545,11 +1752,11 @@ void input_lightgun_save(int idx, int32_t *cal)
 	memcpy(input[idx].guncal, cal, sizeof(input[idx].guncal));
 }
 
-static void input_lightgun_load(int idx)
+static void input_lightgun_load(devInput *dev)
 {
-	static char name[128];
-	sprintf(name, "%s_gun_cal_%04x_%04x_v2.cfg", user_io_get_core_name(), input[idx].vid, input[idx].pid);
-	FileLoadConfig(name, input[idx].guncal, 4 * sizeof(int32_t));
+	char name[128];
+	sprintf(name, "%s_gun_cal_%04x_%04x_v2.cfg", user_io_get_core_name(), dev->vid, dev->pid);
+	FileLoadConfig(name, dev->guncal, 4 * sizeof(int32_t));
 }
 
 int input_has_lightgun()
@@ -1565,6 +1772,21 @@ int input_has_lightgun()
 	return 0;
 }
 
+// Device assigned to the player (1 based), 0 if none.
+int input_player_dev(int player, uint16_t *vid, uint16_t *pid)
+{
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (pool[i].fd >= 0 && input[i].bind < 0 && input[i].num == player)
+		{
+			*vid = input[i].vid;
+			*pid = input[i].pid;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 uint16_t get_map_vid()
 {
 	return (mapping && mapping_dev >= 0) ? input[mapping_dev].vid : 0;
@@ -1646,9 +1868,11 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 
 static int kbd_toggle = 0;
 static uint64_t joy[NUMPLAYERS] = {};		// 0-31 primary mappings, 32-64 alternate
+static uint64_t joy_rx_us[NUMPLAYERS] = {};	// receive time of the oldest change not sent yet
 static uint64_t autofire[NUMPLAYERS] = {};	// 0-31 primary mappings, 32-64 alternate
 static uint32_t autofirecodes[NUMPLAYERS][BTN_NUM] = {};
 static int af_delay[NUMPLAYERS] = {};
+static uint64_t af_next_us = 0;                 // next autofire toggle of all players, 0: none
 
 static uint32_t crtgun_timeout[NUMDEV] = {};
 
@@ -1797,15 +2021,8 @@ static inline float boxradf(const float angle)
 	return 1.0f / fmaxf(fabsf(sinf(angle)), fabsf(cosf(angle)));
 }
 
-static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int stick) {
-	// Don't be fancy with such a small deadzone.
-	if (dev->deadzone <= 2) 
-	{
-		if (dev->deadzone && (abs((*x > *y) == (*x > -*y) ? *x : *y) <= dev->deadzone))
-			*x = *y = 0;
-		return;
-	}
-
+static void joy_deadzone_calc(int* x, int* y, const devInput* dev, const int stick)
+{
 	const float radius = hypotf(*x, *y);
 	if (radius <= (float)dev->deadzone)
 	{
@@ -1841,6 +2058,73 @@ static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int st
 	joy_clamp(y, min_range, INT8_MAX);
 }
 
+// Deadzone response per device and stick, filled in as positions come up.
+// It's the same in every quadrant, so it's kept for |x|, |y| up to 127 and
+// the signs put back (the output never has a larger magnitude, no clamping).
+// Cleared whenever the deadzone or the observed range changes.
+#define JOY_LUT_N    128
+#define JOY_LUT_NONE 0xFFFF
+
+struct joy_lut_t
+{
+	uint32_t deadzone;
+	int      max_cardinal;
+	float    max_range;
+	uint16_t r[JOY_LUT_N * JOY_LUT_N]; // (x << 8) | y
+};
+
+static joy_lut_t *joy_lut[NUMDEV][2] = {};
+
+static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int stick) {
+	// Don't be fancy with such a small deadzone.
+	if (dev->deadzone <= 2) 
+	{
+		if (dev->deadzone && (abs((*x > *y) == (*x > -*y) ? *x : *y) <= dev->deadzone))
+			*x = *y = 0;
+		return;
+	}
+
+	const int ax = abs(*x), ay = abs(*y);
+	const int idx = dev - input;
+	if (ax >= JOY_LUT_N || ay >= JOY_LUT_N || idx < 0 || idx >= NUMDEV)
+	{
+		joy_deadzone_calc(x, y, dev, stick);
+		return;
+	}
+
+	joy_lut_t *lut = joy_lut[idx][stick];
+	if (!lut)
+	{
+		lut = (joy_lut_t*)malloc(sizeof(joy_lut_t));
+		if (!lut)
+		{
+			joy_deadzone_calc(x, y, dev, stick);
+			return;
+		}
+		lut->deadzone = ~0u;
+		joy_lut[idx][stick] = lut;
+	}
+
+	if (lut->deadzone != dev->deadzone || lut->max_cardinal != dev->max_cardinal[stick] || lut->max_range != dev->max_range[stick])
+	{
+		lut->deadzone = dev->deadzone;
+		lut->max_cardinal = dev->max_cardinal[stick];
+		lut->max_range = dev->max_range[stick];
+		memset(lut->r, 0xFF, sizeof(lut->r));
+	}
+
+	uint16_t r = lut->r[ay * JOY_LUT_N + ax];
+	if (r == JOY_LUT_NONE)
+	{
+		int rx = ax, ry = ay;
+		joy_deadzone_calc(&rx, &ry, dev, stick);
+		r = lut->r[ay * JOY_LUT_N + ax] = (rx << 8) | ry;
+	}
+
+	*x = (*x < 0) ? -(r >> 8) : (r >> 8);
+	*y = (*y < 0) ? -(r & 0xFF) : (r & 0xFF);
+}
+
 static uint32_t osdbtn = 0;
 static void joy_digital(int jnum, uint64_t mask, uint32_t code, char press, int bnum, int dont_save = 0)
 {
@@ -2130,6 +2414,13 @@ static void joy_digital(int jnum, uint64_t mask, uint32_t code, char press, int
 		{
 			if (press) joy[num] |= mask;
 			else joy[num] &= ~mask;
+
+			if (!joy_rx_us[num])
+			{
+				joy_rx_us[num] = input_queue_rx_us();
+				if (!joy_rx_us[num]) joy_rx_us[num] = trace_now_us();
+			}
+			input_lat_joy(num);
 			
 			//user_io_digital_joystick(num, joy[num]);
 
@@ -2153,7 +2444,8 @@ static bool joy_dir_is_diagonal(const int x, const int y)
 		abs((x > y) == (x > -y) ? (float)y / x : (float)x / y) >= JOY_DIAG_THRESHOLD;
 }
 
-static void joy_analog(int dev, int axis, int offset, int stick = 0)
+// send = 0 only sets the axis, the next call sends both
+static void joy_analog(int dev, int axis, int offset, int stick = 0, int send = 1)
 {
 	int num = input[dev].num;
 	static int pos[2][NUMPLAYERS][2] = {};
@@ -2161,6 +2453,8 @@ static void joy_analog(int dev, int axis, int offset, int stick = 0)
 	if (grabbed && num > 0 && --num < NUMPLAYERS)
 	{
 		pos[stick][num][axis] = offset;
+		if (!send) return;
+
 		int x = pos[stick][num][0], y = pos[stick][num][1];
 
 		if (joy_dir_is_diagonal(x, y))
@@ -2202,6 +2496,55 @@ static void joy_analog(int dev, int axis, int offset, int stick = 0)
 	}
 }
 
+static int gun_xf(devInput *inp, int axis, int value, const input_absinfo *absinfo)
+{
+	gun_xf_t *xf = &inp->gunxf[axis];
+	int range = is_psx() ? 128 : 127;
+
+	if (xf->min != absinfo->minimum || xf->max != absinfo->maximum || xf->range != range || !xf->mul)
+	{
+		int hrange = (absinfo->maximum - absinfo->minimum) / 2;
+		xf->min = absinfo->minimum;
+		xf->max = absinfo->maximum;
+		xf->mid = (int32_t)(((int64_t)xf->min + xf->max) / 2);
+		xf->mul = hrange ? (int32_t)(((int64_t)range << 16) / hrange) : 0;
+		xf->range = range;
+	}
+
+	if (value < xf->min) value = xf->min;
+	else if (value > xf->max) value = xf->max;
+
+	value = (int)(((int64_t)(value - xf->mid) * xf->mul + 0x8000) >> 16);
+	if (value < -range) value = -range;
+	else if (value > 127) value = 127;
+	return value;
+}
+
+// Gun positions of a poll go to the core as one X/Y update, see gun_flush()
+static int gun_pending = 0;
+
+static void gun_queue(int dev, int axis, int value)
+{
+	input[dev].gun_pos[axis] = value;
+	input[dev].gun_dirty = 1;
+	gun_pending = 1;
+}
+
+static void gun_flush()
+{
+	if (!gun_pending) return;
+	gun_pending = 0;
+
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (!input[i].gun_dirty) continue;
+
+		joy_analog(i, 0, input[i].gun_pos[0], 0, 0);
+		joy_analog(i, 1, input[i].gun_pos[1]);
+		input[i].gun_dirty = 0;
+	}
+}
+
 static char* get_led_path(int dev, int add_id = 1)
 {
 	static char path[1024];
@@ -2221,19 +2564,15 @@ static char* get_led_path(int dev, int add_id = 1)
 	return NULL;
 }
 
+// The write is done by the device I/O worker
 static int set_led(char *base, const char *led, int brightness)
 {
 	static char path[1024];
 	snprintf(path, sizeof(path), "%s%s/brightness", base, led);
-	FILE* f = fopen(path, "w");
-	if (f)
-	{
-		fprintf(f, "%d", brightness);
-		fclose(f);
-		return 1;
-	}
+	if (access(path, W_OK)) return 0;
 
-	return 0;
+	devio_write_attr(path, brightness);
+	return 1;
 }
 
 static int get_led(char *base, const char *led)
@@ -2534,7 +2873,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 	{
 		if (!input[dev].has_kbdmap)
 		{
-			if (!FileLoadConfig(get_kbdmap_name(dev), &input[dev].kbdmap, sizeof(input[dev].kbdmap)))
+			if (!map_cache_load(get_kbdmap_name(dev), &input[dev].kbdmap, sizeof(input[dev].kbdmap)))
 			{
 				memset(input[dev].kbdmap, 0, sizeof(input[dev].kbdmap));
 			}
@@ -2612,10 +2951,12 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 			}
 		}
 		input[dev].has_mmap++;
+		input[dev].fast_valid = 0;
 	}
 
 	if (!input[dev].has_map)
 	{
+		input[dev].fast_valid = 0;
 		if (input[dev].quirk == QUIRK_PDSP || input[dev].quirk == QUIRK_MSSP)
 		{
 			memset(input[dev].map, 0, sizeof(input[dev].map));
@@ -3264,32 +3605,30 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					{
 						int use_analog = (input[dev].mmap[SYS_AXIS_MX] || input[dev].mmap[SYS_AXIS_MY]);
 
-						for (int i = (use_analog ? SYS_MS_BTN_L : SYS_MS_RIGHT); i <= SYS_MS_BTN_M; i++)
+						int i = sys_find(dev, ev->code, (use_analog ? SYS_MS_BTN_L : SYS_MS_RIGHT), SYS_MS_BTN_M);
+						if (i >= 0)
 						{
-							if (ev->code == input[dev].mmap[i])
+							switch (i)
 							{
-								switch (i)
-								{
-								case SYS_MS_RIGHT:
-									mouse_emu_x = ev->value ? 10 : 0;
-									break;
-								case SYS_MS_LEFT:
-									mouse_emu_x = ev->value ? -10 : 0;
-									break;
-								case SYS_MS_DOWN:
-									mouse_emu_y = ev->value ? 10 : 0;
-									break;
-								case SYS_MS_UP:
-									mouse_emu_y = ev->value ? -10 : 0;
-									break;
+							case SYS_MS_RIGHT:
+								mouse_emu_x = ev->value ? 10 : 0;
+								break;
+							case SYS_MS_LEFT:
+								mouse_emu_x = ev->value ? -10 : 0;
+								break;
+							case SYS_MS_DOWN:
+								mouse_emu_y = ev->value ? 10 : 0;
+								break;
+							case SYS_MS_UP:
+								mouse_emu_y = ev->value ? -10 : 0;
+								break;
 
-								default:
-									mouse_btn = ev->value ? mouse_btn | 1 << (i - SYS_MS_BTN_L) : mouse_btn & ~(1 << (i - SYS_MS_BTN_L));
-									mouse_btn_req();
-									break;
-								}
-								return;
+							default:
+								mouse_btn = ev->value ? mouse_btn | 1 << (i - SYS_MS_BTN_L) : mouse_btn & ~(1 << (i - SYS_MS_BTN_L));
+								mouse_btn_req();
+								break;
 							}
+							return;
 						}
 					}
 
@@ -3299,11 +3638,12 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 						input[dev].has_map = 1;
 					}
 					
-					for (uint i = 0; i < BTN_NUM; i++)
+					uint64_t masks = fast_map_ready(dev) ? fast_map_lookup(dev, ev->code) : ~(uint64_t)0;
+					for (uint i = 0; masks && i < BTN_NUM; masks &= ~((uint64_t)0x100000001 << i), i++)
 					{
 						uint64_t mask = 0;
-						if (ev->code == (input[dev].map[i] & 0xFFFF)) mask = (uint64_t)1 << i;
-						else if (ev->code == (input[dev].map[i] >> 16)) mask = (uint64_t)1 << (i + 32); // 1 is uint32_t. i spent hours realizing this.
+						if ((masks & ((uint64_t)1 << i)) && ev->code == (input[dev].map[i] & 0xFFFF)) mask = (uint64_t)1 << i;
+						else if ((masks & ((uint64_t)1 << (i + 32))) && ev->code == (input[dev].map[i] >> 16)) mask = (uint64_t)1 << (i + 32); // 1 is uint32_t. i spent hours realizing this.
 						if (mask) {
 							if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
 							if (ev->value <=1) joy_digital(input[dev].num, mask, origcode, ev->value, i, (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]));
@@ -3355,9 +3695,11 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 				{
 					if (!kbd_toggle)
 					{
-						for (uint i = 0; i < BTN_NUM; i++)
+						// first button with the key in the primary set
+						uint32_t masks = fast_map_ready(dev) ? (uint32_t)fast_map_lookup(dev, ev->code) : ~0u;
+						for (uint i = 0; masks && i < BTN_NUM; masks &= ~(1u << i), i++)
 						{
-							if (ev->code == (uint16_t)input[dev].map[i])
+							if ((masks & (1u << i)) && ev->code == (uint16_t)input[dev].map[i])
 							{
 								if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
 								if (ev->value <= 1) joy_digital((user_io_get_kbdemu() == EMU_JOY0) ? 1 : 2, 1 << i, origcode, ev->value, i);
@@ -3381,32 +3723,30 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 				{
 					if (kbd_mouse_emu)
 					{
-						for (int i = SYS_MS_RIGHT; i <= SYS_MS_BTN_M; i++)
+						int i = sys_find(dev, ev->code, SYS_MS_RIGHT, SYS_MS_BTN_M);
+						if (i >= 0)
 						{
-							if (ev->code == input[dev].mmap[i])
+							switch (i)
 							{
-								switch (i)
-								{
-								case SYS_MS_RIGHT:
-									mouse_emu_x = ev->value ? 10 : 0;
-									break;
-								case SYS_MS_LEFT:
-									mouse_emu_x = ev->value ? -10 : 0;
-									break;
-								case SYS_MS_DOWN:
-									mouse_emu_y = ev->value ? 10 : 0;
-									break;
-								case SYS_MS_UP:
-									mouse_emu_y = ev->value ? -10 : 0;
-									break;
+							case SYS_MS_RIGHT:
+								mouse_emu_x = ev->value ? 10 : 0;
+								break;
+							case SYS_MS_LEFT:
+								mouse_emu_x = ev->value ? -10 : 0;
+								break;
+							case SYS_MS_DOWN:
+								mouse_emu_y = ev->value ? 10 : 0;
+								break;
+							case SYS_MS_UP:
+								mouse_emu_y = ev->value ? -10 : 0;
+								break;
 
-								default:
-									mouse_btn = ev->value ? mouse_btn | 1 << (i - SYS_MS_BTN_L) : mouse_btn & ~(1 << (i - SYS_MS_BTN_L));
-									mouse_btn_req();
-									break;
-								}
-								return;
+							default:
+								mouse_btn = ev->value ? mouse_btn | 1 << (i - SYS_MS_BTN_L) : mouse_btn & ~(1 << (i - SYS_MS_BTN_L));
+								mouse_btn_req();
+								break;
 							}
+							return;
 						}
 
 						if (ev->code == input[dev].mmap[SYS_MS_BTN_EMU])
@@ -3436,6 +3776,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 
 				if (ev->code == KEY_HOMEPAGE) ev->code = KEY_MENU;
 				user_io_kbd(ev->code, ev->value);
+				input_lat_sent();
 				return;
 			}
 			break;
@@ -3459,17 +3800,24 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					break;
 				}
 
-				int hrange = (absinfo->maximum - absinfo->minimum) / 2;
+				if (ev->code <= 1 && input[dev].lightgun)
+				{
+					value = gun_xf(&input[dev], ev->code, value, absinfo);
+				}
+				else
+				{
+					int hrange = (absinfo->maximum - absinfo->minimum) / 2;
 
-				// normalize to -range/2...+range/2
-				value -= (absinfo->minimum + absinfo->maximum) / 2;
+					// normalize to -range/2...+range/2
+					value -= (absinfo->minimum + absinfo->maximum) / 2;
 
-				int range = is_psx() ? 128 : 127;
-				value = (value * range) / hrange;
+					int range = is_psx() ? 128 : 127;
+					value = (value * range) / hrange;
 
-				// final check to eliminate additive error
-				if (value < -range) value = -range;
-				else if (value > 127) value = 127;
+					// final check to eliminate additive error
+					if (value < -range) value = -range;
+					else if (value > 127) value = 127;
+				}
 
 				if (input[sub_dev].axis_pos[ev->code & 0xFF] == (int8_t)value) break;
 				input[sub_dev].axis_pos[ev->code & 0xFF] = (int8_t)value;
@@ -3530,18 +3878,20 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 							}
 						}
 					}
-					else if (ev->code == 0 && input[dev].lightgun)
-					{
-						joy_analog(dev, 0, value);
-					}
-					else if (ev->code == 1 && input[dev].lightgun)
+					else if (ev->code <= 1 && input[dev].lightgun)
 					{
-						joy_analog(dev, 1, value);
+						gun_queue(dev, ev->code, value);
 					}
 					else
 					{
 						int offset = (value < -1 || value > 1) ? value : 0;
-						if (input[dev].stick_l[0] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_l[0]])
+						if (fast_map_ready(dev))
+						{
+							// left X, left Y, right X, right Y
+							int role = (ev->code < 256) ? (input[dev].fast_axis[ev->code] & FAST_AXIS_ROLE) : 0;
+							if (role--) joy_analog(dev, role & 1, offset, role >> 1);
+						}
+						else if (input[dev].stick_l[0] && ev->code == (uint16_t)input[dev].mmap[input[dev].stick_l[0]])
 						{
 							joy_analog(dev, 0, offset, 0);
 						}
@@ -3595,22 +3945,199 @@ void send_map_cmd(int key)
 #define CMD_FIFO "/dev/MiSTer_cmd"
 #define LED_MONITOR "/sys/class/leds/hps_led0/brightness_hw_changed"
 
-// add sequential suffixes for non-merged devices
-void make_unique(uint16_t vid, uint16_t pid, int type)
+// Text commands of the MiSTer_cmd FIFO, also reachable through the binary channel.
+// Returns 0 if the command isn't known.
+int input_cmd_exec(char *cmd)
 {
-	int cnt = 0;
-	int lastmin = -1;
-	int min;
-
-	printf("make_unique(%04X,%04X,%d)\n", vid, pid, type);
+	if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
+	else if (!strncmp(cmd, "load_core ", 10))
+	{
+		if(isXmlName(cmd)) xml_load(cmd + 10);
+		else fpga_load_rbf(cmd + 10);
+	}
+	else if (!strncmp(cmd, "trace_dump", 10))
+	{
+		trace_dump(cmd[10] ? cmd + 11 : NULL);
+	}
+	else if (!strcmp(cmd, "profile_stats"))
+	{
+		static char stats[1024];
+		profiling_stats_text(stats, sizeof(stats), 14);
+		InfoMessage(stats, 10000, "Profiling");
+		profiling_stats_save("/tmp/profiling_stats.txt");
+	}
+	else if (!strcmp(cmd, "perf_stats"))
+	{
+		static char stats[1024];
+		profiling_perf_text(stats, sizeof(stats), 14);
+		InfoMessage(stats, 10000, "CPU counters");
+		profiling_stats_save("/tmp/profiling_stats.txt");
+	}
+	else if (!strcmp(cmd, "mem_report"))
+	{
+		static char report[512];
+		mem_report(report, sizeof(report), "/tmp/mem_report.txt");
+		InfoMessage(report, 10000, "Memory");
+	}
+	else if (!strncmp(cmd, "storage_probe", 13))
+	{
+		if (!strcmp(cmd + 13, " force")) storage_probe_start(1);
 
-	while(1)
+		static char report[512];
+		storage_report(report, sizeof(report), "/tmp/storage_report.txt");
+		InfoMessage(report, 10000, "Storage");
+	}
+	else if (!strcmp(cmd, "load_report"))
 	{
-		int idx = -1;
-		min = INT32_MAX;
-		for (int i = 0; i < NUMDEV; i++)
-		{
-			if ((!type && (input[i].vid == vid)) ||
+		static char report[512];
+		load_report(report, sizeof(report), 4);
+		InfoMessage(report, 10000, "Load times");
+	}
+	else if (!strncmp(cmd, "load_batch ", 11))
+	{
+		// "load_batch <list> [cold]", "load_batch stop"
+		char *list = cmd + 11;
+		if (!strcmp(list, "stop")) load_batch_stop();
+		else
+		{
+			char *opt = strrchr(list, ' ');
+			int cold = opt && !strcmp(opt, " cold");
+			if (cold) *opt = 0;
+			if (!load_batch_start(list, cold)) Info("No titles in the list!");
+		}
+	}
+	else if (!strncmp(cmd, "input_lat", 9))
+	{
+		// "input_lat start|stop|test [n]", no argument shows the histograms
+		static char report[512];
+		if (!strcmp(cmd + 9, " start")) input_lat_start();
+		else if (!strcmp(cmd + 9, " stop")) input_lat_stop();
+		else if (!strncmp(cmd + 9, " test", 5)) input_lat_test(atoi(cmd + 14));
+		else
+		{
+			input_lat_report(report, sizeof(report), INPUT_LAT_FILE);
+			InfoMessage(report, 10000, "Input latency");
+		}
+	}
+	else if (!strncmp(cmd, "rt_report", 9))
+	{
+		// "rt_report reset" starts a new measurement
+		static char report[512];
+		if (!strcmp(cmd + 9, " reset")) realtime_report_reset();
+		else
+		{
+			realtime_report(report, sizeof(report), "/tmp/rt_report.txt");
+			InfoMessage(report, 10000, "Poll latency");
+		}
+	}
+	else if (!strncmp(cmd, "spi_report", 10))
+	{
+		// "spi_report reset" starts a new measurement
+		static char report[512];
+		spi_report(report, sizeof(report), "/tmp/spi_report.txt", !strcmp(cmd + 10, " reset"));
+		InfoMessage(report, 10000, "SPI bus");
+	}
+	else if (!strcmp(cmd, "spi_bench"))
+	{
+		fpga_spi_benchmark();
+	}
+	else if (!strcmp(cmd, "crc_bench"))
+	{
+		crc_benchmark();
+	}
+	else if (!strncmp(cmd, "fio_trace ", 10))
+	{
+		if (!strncmp(cmd + 10, "start", 5)) fpga_io_trace_start(cmd[15] ? cmd + 16 : NULL);
+		else if (!strcmp(cmd + 10, "stop")) fpga_io_trace_stop();
+	}
+	else if (!strncmp(cmd, "capture ", 8))
+	{
+		if (!strncmp(cmd + 8, "start", 5))
+		{
+			char *dir = NULL;
+			int fps = strtol(cmd + 13, &dir, 10);
+			while (*dir == ' ') dir++;
+			capture_start(fps ? fps : 30, dir);
+		}
+		else if (!strcmp(cmd + 8, "stop")) capture_stop();
+	}
+	else if (!strncmp(cmd, "ss_rewind ", 10))
+	{
+		int slot = 1, back = 1;
+		sscanf(cmd + 10, "%d %d", &slot, &back);
+		process_ss_rewind(slot - 1, back);
+	}
+	else if (!strncmp(cmd, "io_bench", 8))
+	{
+		io_bench_run(cmd[8] ? cmd + 9 : NULL);
+	}
+	else if (!strncmp(cmd, "ide_bench ", 10))
+	{
+		ide_bench_run(cmd + 10);
+	}
+	else if (!strncmp(cmd, "catalog_bench", 13))
+	{
+		rom_catalog_bench(cmd[13] ? atoi(cmd + 14) * 1000 : 0);
+	}
+	else if (!strncmp(cmd, "screenshot", 10))
+	{
+		user_io_screenshot_cmd(cmd);
+	}
+	else if (!strncmp(cmd, "overlay_create ", 15))
+	{
+		// disk.vhd gets disk.ovl.vhd
+		static char ovl[1024];
+		const char *base = cmd + 15;
+		const char *ext = strrchr(base, '.');
+		if (!ext || strchr(ext, '/')) ext = base + strlen(base);
+		snprintf(ovl, sizeof(ovl), "%.*s.ovl%s", (int)(ext - base), base, ext);
+		if (!FileOverlayCreate(ovl, base)) printf("overlay_create: failed for %s\n", base);
+	}
+	else if (!strncmp(cmd, "overlay_reset ", 14))
+	{
+		// not while the overlay is mounted
+		if (!FileOverlayReset(cmd + 14)) printf("overlay_reset: failed for %s\n", cmd + 14);
+	}
+	else if (!strncmp(cmd, "overlay_snapshot ", 17))
+	{
+		// disk.ovl.vhd gets disk_<date>_<time>.ovl.vhd
+		static char copy[1024];
+		const char *ovl = cmd + 17;
+		const char *tag = strcasestr(ovl, ".ovl");
+		if (!tag) tag = ovl + strlen(ovl);
+		time_t t = time(NULL);
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&t));
+		snprintf(copy, sizeof(copy), "%.*s_%s%s", (int)(tag - ovl), ovl, stamp, tag);
+		if (!FileOverlaySnapshot(ovl, copy)) printf("overlay_snapshot: failed for %s\n", ovl);
+	}
+	else if (!strncmp(cmd, "volume ", 7))
+	{
+		if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
+		else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
+		else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
+	}
+	else return 0;
+
+	return 1;
+}
+
+// add sequential suffixes for non-merged devices
+void make_unique(uint16_t vid, uint16_t pid, int type)
+{
+	int cnt = 0;
+	int lastmin = -1;
+	int min;
+
+	printf("make_unique(%04X,%04X,%d)\n", vid, pid, type);
+
+	while(1)
+	{
+		int idx = -1;
+		min = INT32_MAX;
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			if ((!type && (input[i].vid == vid)) ||
 				(type > 0 && (input[i].vid == vid) && (input[i].pid == pid)) ||
 				(type < 0 && (input[i].vid == vid) && (input[i].pid != pid)))
 			{
@@ -4191,10 +4718,11 @@ static int vcs_proc(int dev, input_event *ev)
 	return 1;
 }
 
-void openfire_signal()
+void openfire_signal(int dev = -1)
 {
 	for (int i = 0; i < NUMDEV; i++)
 	{
+		if (dev >= 0 && dev != i) continue;
 		if (input[i].vid == 0xf143 && strstr(input[i].name, "OpenFIRE ") &&
 			strstr(input[i].devname, "mouse") == NULL)
 		{
@@ -4365,6 +4893,7 @@ int process_joycon(int dev, input_event *ev, input_absinfo *absinfo)
 			led_path = get_led_path(r); if (led_path) set_led(led_path, ":combo", id);
 
 			printf("Close all devices.\n");
+			devio_sync();
 			for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 			{
 				ioctl(pool[i].fd, EVIOCGRAB, 0);
@@ -4399,6 +4928,7 @@ static int get_rumble_device(int player)
 	return -1;
 }
 
+// Runs on the device I/O worker, which owns rumble_effect of the open devices
 static int rumble_input_device(int devnum, uint16_t strong_mag, uint16_t weak_mag, uint16_t duration = 500, uint16_t delay = 0)
 {
 	int ioret = 0;
@@ -4455,8 +4985,11 @@ static void set_rumble(int dev, uint16_t rumble_val)
 		strong_m = (rumble_val & 0xFF00) + (rumble_val >> 8);
 		weak_m = (rumble_val << 8) + (rumble_val & 0x00FF);
 
-		rumble_input_device(dev, strong_m, weak_m, 0x7FFF);
 		input[dev].last_rumble = rumble_val;
+
+		char tag[16];
+		sprintf(tag, "rumble%d", dev);
+		devio_queue(tag, [dev, strong_m, weak_m]() { rumble_input_device(dev, strong_m, weak_m, 0x7FFF); });
 	}
 }
 
@@ -4466,23 +4999,18 @@ static void set_wheel_range(int dev, int range)
 	if (range && input[dev].sysfs[0])
 	{
 		sprintf(path, "/sys%s/device/range", input[dev].sysfs);
-
-		FILE* f = fopen(path, "w");
-		if (f)
-		{
-			fprintf(f, "%d", range);
-			fclose(f);
-		}
+		devio_write_attr(path, range);
 	}
 }
 
-static void setup_wheels()
+// dev < 0: all devices
+static void setup_wheels(int dev = -1)
 {
 	if (cfg.wheel_force > 100) cfg.wheel_force = 100;
 
 	for (int i = 0; i < NUMDEV; i++)
 	{
-		if (pool[i].fd != -1)
+		if (pool[i].fd != -1 && (dev < 0 || dev == i))
 		{
 			// steering wheel axis
 			input[i].wh_steer = 0;
@@ -4653,6 +5181,529 @@ static void setup_wheels()
 	}
 }
 
+// Opens the evdev or mousedev node and identifies the device, 0 if it isn't used.
+// Only dev is filled in, hotplugged devices are probed on the offload workers.
+static int input_probe(devInput *dev, int *pfd, const char *name)
+{
+	memset(dev, 0, sizeof(*dev));
+	sprintf(dev->devname, "/dev/input/%s", name);
+	int fd = open(dev->devname, O_RDWR | O_CLOEXEC);
+	//printf("open(%s): %d\n", dev->devname, fd);
+	if (fd <= 0) return 0;
+
+	dev->mouse = !strncmp(name, "mouse", 5);
+
+	char uniq[32] = {};
+	if (!dev->mouse)
+	{
+		struct input_id id;
+		memset(&id, 0, sizeof(id));
+		ioctl(fd, EVIOCGID, &id);
+		dev->vid = id.vendor;
+		dev->pid = id.product;
+		dev->version = id.version;
+		dev->bustype = id.bustype;
+
+		ioctl(fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
+		ioctl(fd, EVIOCGNAME(sizeof(dev->name)), dev->name);
+		dev->led = has_led(fd);
+	}
+
+	//skip our virtual device
+	if (!strcmp(dev->name, UINPUT_NAME))
+	{
+		close(fd);
+
+		return 0;
+	}
+
+	dev->bind = -1;
+
+	int effects;
+	dev->has_rumble = false;
+	if (cfg.rumble)
+	{
+		if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
+		{
+			unsigned char ff_features[(FF_MAX + 7) / 8] = {};
+
+			if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
+			{
+				if (test_bit(FF_RUMBLE, ff_features)) {
+					dev->rumble_effect.id = -1;
+					dev->has_rumble = true;
+				}
+			}
+		}
+	}
+
+	// enable scroll wheel reading
+	if (dev->mouse)
+	{
+		unsigned char buffer[4];
+		static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
+		if (write(fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
+		{
+			printf("Cannot switch %s to ImPS/2 protocol(1)\n", dev->devname);
+		}
+		else if (read(fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
+		{
+			printf("Failed to switch %s to ImPS/2 protocol(2)\n", dev->devname);
+		}
+	}
+
+	// RasPad3 touchscreen
+	if (dev->vid == 0x222a && dev->pid == 1)
+	{
+		dev->quirk = QUIRK_TOUCHGUN;
+		dev->num = 1;
+		dev->map_shown = 1;
+
+		dev->lightgun = 0;
+		dev->guncal[0] = 0;
+		dev->guncal[1] = 16383;
+		dev->guncal[2] = 2047;
+		dev->guncal[3] = 14337;
+		input_lightgun_load(dev);
+	}
+
+	if (dev->vid == 0x054c)
+	{
+		if (strcasestr(dev->name, "Motion"))
+		{
+			// don't use Accelerometer
+			close(fd);
+			return 0;
+		}
+
+		if (dev->pid == 0x0268)  dev->quirk = QUIRK_DS3;
+		else if (dev->pid == 0x05c4 || dev->pid == 0x09cc || dev->pid == 0x0ba0 || dev->pid == 0x0ce6)
+		{
+			dev->quirk = QUIRK_DS4;
+			if (strcasestr(dev->name, "Touchpad"))
+			{
+				dev->quirk = QUIRK_DS4TOUCH;
+			}
+		}
+	}
+
+	if (dev->vid == 0x0079 && dev->pid == 0x1802)
+	{
+		dev->lightgun = 1;
+		dev->num = 2; // force mayflash mode 1/2 as second joystick.
+	}
+
+	if (dev->vid == 0x057e && (dev->pid == 0x0306 || dev->pid == 0x0330))
+	{
+		if (strcasestr(dev->name, "Accelerometer"))
+		{
+			// don't use Accelerometer
+			close(fd);
+			return 0;
+		}
+		else if (strcasestr(dev->name, "Motion Plus"))
+		{
+			// don't use Accelerometer
+			close(fd);
+			return 0;
+		}
+		else if (!strcasestr(dev->name, "Pro Controller"))
+		{
+			dev->quirk = QUIRK_WIIMOTE;
+			dev->guncal[0] = 0;
+			dev->guncal[1] = 767;
+			dev->guncal[2] = 1;
+			dev->guncal[3] = 1023;
+			input_lightgun_load(dev);
+		}
+	}
+
+	if (dev->vid == 0x057e)
+	{
+		if (strstr(dev->name, " IMU"))
+		{
+			// don't use Accelerometer
+			close(fd);
+			return 0;
+		}
+	}
+
+	if (dev->vid == 0x057e && dev->pid == 0x2006)
+	{
+		dev->misc_flags = 1 << 30;
+		dev->quirk = QUIRK_JOYCON;
+	}
+	if (dev->vid == 0x057e && dev->pid == 0x2007)
+	{
+		dev->misc_flags = 1 << 29;
+		dev->quirk = QUIRK_JOYCON;
+	}
+
+	//Ultimarc lightgun
+	if (dev->vid == 0xd209 && dev->pid == 0x1601)
+	{
+		dev->lightgun = 1;
+	}
+
+	//Namco Guncon via Arduino, RetroZord or Reflex Adapt
+	if (((dev->vid == 0x2341 || (dev->vid == 0x1209 && dev->pid == 0x595A)) && (strstr(uniq, "RZordPsGun") || strstr(dev->name, "RZordPsGun"))) ||
+		(dev->vid == 0x16D0 && dev->pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(dev->name, "ReflexPSGun"))))
+	{
+		dev->quirk = QUIRK_LIGHTGUN;
+		dev->lightgun = 1;
+		dev->guncal[0] = 0;
+		dev->guncal[1] = 32767;
+		dev->guncal[2] = 0;
+		dev->guncal[3] = 32767;
+		input_lightgun_load(dev);
+	}
+
+	//Namco GunCon 2
+	if (dev->vid == 0x0b9a && dev->pid == 0x016a)
+	{
+		dev->quirk = QUIRK_LIGHTGUN_CRT;
+		dev->lightgun = 1;
+		dev->guncal[0] = 25;
+		dev->guncal[1] = 245;
+		dev->guncal[2] = 145;
+		dev->guncal[3] = 700;
+		input_lightgun_load(dev);
+	}
+
+	//Namco GunCon 3
+	if (dev->vid == 0x0b9a && dev->pid == 0x0800)
+	{
+		dev->quirk = QUIRK_LIGHTGUN;
+		dev->lightgun = 1;
+		dev->guncal[0] = -32768;
+		dev->guncal[1] = 32767;
+		dev->guncal[2] = -32768;
+		dev->guncal[3] = 32767;
+		input_lightgun_load(dev);
+	}
+
+	//GUN4IR Lightgun
+	if (dev->vid == 0x2341 && dev->pid >= 0x8042 && dev->pid <= 0x8049)
+	{
+		dev->quirk = QUIRK_LIGHTGUN;
+		dev->lightgun = 1;
+		dev->guncal[0] = 0;
+		dev->guncal[1] = 32767;
+		dev->guncal[2] = 0;
+		dev->guncal[3] = 32767;
+		input_lightgun_load(dev);
+	}
+
+	//OpenFIRE Lightgun
+	//!Note that OF has a user-configurable PID, but the VID is reserved and every device name has the prefix "OpenFIRE"
+	if (dev->vid == 0xf143 && strstr(dev->name, "OpenFIRE "))
+	{
+		// OF generates 3 devices, so just focus on the one actual gamepad slot.
+		char *nameInit = dev->name;
+		if(memcmp(nameInit+strlen(dev->name)-5, "Mouse", 5) != 0 && memcmp(nameInit+strlen(dev->name)-8, "Keyboard", 8) != 0)
+		{
+			dev->quirk = QUIRK_LIGHTGUN;
+			dev->lightgun = 1;
+			dev->guncal[0] = -32767;
+			dev->guncal[1] = 32767;
+			dev->guncal[2] = -32767;
+			dev->guncal[3] = 32767;
+			input_lightgun_load(dev);
+		}
+	}
+
+	//Blamcon Lightgun
+	if (dev->vid == 0x3673 && ((dev->pid >= 0x0100 && dev->pid <= 0x0103) || (dev->pid >= 0x0200 && dev->pid <= 0x0203)))
+	{
+		dev->quirk = QUIRK_LIGHTGUN;
+		dev->lightgun = 1;
+		dev->guncal[0] = 0;
+		dev->guncal[1] = 32767;
+		dev->guncal[2] = 0;
+		dev->guncal[3] = 32767;
+		input_lightgun_load(dev);
+	}
+
+	//Retroshooter
+	if (dev->vid == 0x0483 && dev->pid >= 0x5750 && dev->pid <= 0x5753)
+	{
+		dev->quirk = QUIRK_LIGHTGUN_MOUSE;
+		dev->lightgun = 1;
+		dev->guncal[0] = 0;
+		dev->guncal[1] = 767;
+		dev->guncal[2] = 0;
+		dev->guncal[3] = 1023;
+		input_lightgun_load(dev);
+	}
+
+	//Sinden Lightgun (two different PIDs, four different PIDs depending on gun color/config)                                                                                                   
+	if ((dev->vid == 0x16c0 || dev->vid == 0x16d0) && (                             
+	            					dev->pid == 0x0f01 ||                             
+	            					dev->pid == 0x0f02 ||                             
+	            					dev->pid == 0x0f38 ||                             
+	            					dev->pid == 0x0f39))                             
+	{                             
+	    							dev->quirk = QUIRK_LIGHTGUN;                             
+	    							dev->lightgun = 1;                             
+	    							dev->guncal[0] = 0;                             
+	    							dev->guncal[1] = 65535;                             
+	    							dev->guncal[2] = 0;                             
+	    							dev->guncal[3] = 65535;                             
+	    							input_lightgun_load(dev);                             
+	} 
+
+	//Madcatz Arcade Stick 360
+	if (dev->vid == 0x0738 && dev->pid == 0x4758) dev->quirk = QUIRK_MADCATZ360;
+
+	// mr.Spinner
+	// 0x120  - Button
+	// Axis 7 - EV_REL is spinner
+	// Axis 8 - EV_ABS is Paddle
+	// Overlays on other existing gamepads
+	if (strstr(uniq, "MiSTer-S1")) dev->quirk = QUIRK_PDSP;
+	if (strstr(dev->name, "MiSTer-S1")) dev->quirk = QUIRK_PDSP;
+
+	// Arcade with spinner and/or paddle:
+	// Axis 7 - EV_REL is spinner
+	// Axis 8 - EV_ABS is Paddle
+	// Includes other buttons and axes, works as a full featured gamepad.
+	if (strstr(uniq, "MiSTer-A1")) dev->quirk = QUIRK_PDSP_ARCADE;
+	if (strstr(dev->name, "MiSTer-A1")) dev->quirk = QUIRK_PDSP_ARCADE;
+
+	//Jamma
+	if (cfg.jamma_vid && cfg.jamma_pid && dev->vid == cfg.jamma_vid && dev->pid == cfg.jamma_pid)
+	{
+		dev->quirk = QUIRK_JAMMA;
+	}
+
+	//Jamma2
+	if (cfg.jamma2_vid && cfg.jamma2_pid && dev->vid == cfg.jamma2_vid && dev->pid == cfg.jamma2_pid)
+	{
+		dev->quirk = QUIRK_JAMMA2;
+	}
+
+	//Atari VCS wireless joystick with spinner
+	if (dev->vid == 0x3250 && dev->pid == 0x1001)
+	{
+		dev->quirk = QUIRK_VCS;
+		dev->spinner_acc = -1;
+		dev->misc_flags = 0;
+	}
+
+	//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
+	//Reflex Adapt also uses the UNIQ field to differentiate between device modes
+	//RetroZord Adapter also uses the UNIQ field to differentiate between device modes
+	if ((dev->vid == 0x2341 || (dev->vid == 0x16C0 && (dev->pid>>8) == 0x4) || (dev->vid == 0x16D0 && dev->pid == 0x127E) || (dev->vid == 0x1209 && dev->pid == 0x595A)) && strlen(uniq))
+	{
+		snprintf(dev->idstr, sizeof(dev->idstr), "%04x_%04x_%s", dev->vid, dev->pid, uniq);
+		char *p;
+		while ((p = strchr(dev->idstr, '/'))) *p = '_';
+		while ((p = strchr(dev->idstr, ' '))) *p = '_';
+		while ((p = strchr(dev->idstr, '*'))) *p = '_';
+		while ((p = strchr(dev->idstr, ':'))) *p = '_';
+		strcpy(dev->name, uniq);
+	}
+	else if (dev->vid == 0x1209 && (dev->pid == 0xFACE || dev->pid == 0xFACA))
+	{
+		int sum = 0;
+		for (uint32_t i = 0; i < sizeof(dev->name); i++)
+		{
+			if (!dev->name[i]) break;
+			sum += (uint8_t)dev->name[i];
+		}
+		snprintf(dev->idstr, sizeof(dev->idstr), "%04x_%04x_%d", dev->vid, dev->pid, sum);
+	}
+	else
+	{
+		snprintf(dev->idstr, sizeof(dev->idstr), "%04x_%04x", dev->vid, dev->pid);
+	}
+
+	*pfd = fd;
+	return 1;
+}
+
+// Hotplug: a node created in /dev/input is probed on the offload workers and
+// put in a free slot once that's done, a deleted one is closed. Devices already
+// open keep their state, player and queued events.
+#define HOTPLUG_MAX 8
+
+struct hotplug_t
+{
+	char name[32];
+	devInput *dev;
+	int fd;
+	int cancel;
+	OffloadHandle job;
+};
+
+static hotplug_t hotplug[HOTPLUG_MAX];
+
+static void hotplug_drop(hotplug_t *h)
+{
+	if (h->job.valid()) h->job.wait();
+	if (h->fd >= 0) close(h->fd);
+	delete h->dev;
+	*h = hotplug_t();
+}
+
+static void hotplug_reset()
+{
+	for (int i = 0; i < HOTPLUG_MAX; i++) if (hotplug[i].dev) hotplug_drop(&hotplug[i]);
+}
+
+static void input_close_dev(int dev)
+{
+	printf("closed %d: %s \"%s\"\n", dev, input[dev].devname, input[dev].name);
+
+	input_queue_set(dev, -1);
+	devio_sync();
+	close(pool[dev].fd);
+	pool[dev].fd = -1;
+	pool[dev].events = 0;
+	pool[dev].revents = 0;
+
+	// Devices bound to it go to the next one of the same physical device
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (i == dev || pool[i].fd < 0 || input[i].bind != dev) continue;
+
+		input[i].bind = i;
+		if (JOYCON_COMBINED(i))
+		{
+			input[i].misc_flags &= ~(1 << 31);
+			snprintf(input[i].idstr, sizeof(input[i].idstr), "%04x_%04x", input[i].vid, input[i].pid);
+		}
+		else if (input[i].id[0])
+		{
+			for (int j = 0; j < NUMDEV; j++)
+			{
+				if (j != dev && pool[j].fd >= 0 && !input[j].mouse && !strcmp(input[i].id, input[j].id))
+				{
+					input[i].bind = j;
+					break;
+				}
+			}
+		}
+
+		if (input[i].bind == i) restore_player(i);
+	}
+
+	memset(&input[dev], 0, sizeof(input[dev]));
+	crtgun_timeout[dev] = 0;
+	unflag_players();
+}
+
+// Slots after the last open one first, so the binds of open devices don't change
+static int hotplug_slot()
+{
+	int last = -1;
+	for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0) last = i;
+	if (last + 1 < NUMDEV) return last + 1;
+	for (int i = 0; i < NUMDEV; i++) if (pool[i].fd < 0) return i;
+	return -1;
+}
+
+static int hotplug_install(devInput *dev, int fd)
+{
+	// opened by a full scan meanwhile
+	for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0 && !strcmp(input[i].devname, dev->devname)) return 0;
+
+	int n = hotplug_slot();
+	if (n < 0)
+	{
+		printf("No free slot for %s\n", dev->devname);
+		return 0;
+	}
+
+	// rumble effects of the open devices are kept up to date by the worker
+	devio_sync();
+	devInput *saved = (devInput*)malloc(sizeof(input));
+	if (!saved) return 0;
+	memcpy(saved, input, sizeof(input));
+
+	input[n] = *dev;
+	pool[n].fd = fd;
+	pool[n].events = POLLIN;
+	pool[n].revents = 0;
+	ioctl(fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
+
+	// ids and binds for the new device, the open ones are kept as they were
+	mergedevs();
+	for (int i = 0; i < NUMDEV; i++) if (i != n && pool[i].fd >= 0) input[i] = saved[i];
+	free(saved);
+
+	check_joycon();
+	openfire_signal(n);
+	setup_wheels(n);
+
+	struct input_event ev = {};
+	printf("opened %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", n, input[n].bind, input[n].devname, input[n].vid, input[n].pid, input[n].unique_hash, input[n].quirk, input[n].id, input[n].name);
+	restore_player(n);
+	setup_deadzone(&ev, n);
+	unflag_players();
+
+	if (!input[n].mouse) input_queue_set(n, fd);
+	return 1;
+}
+
+// 0 if the node can't be handled alone, all devices are opened again then
+static int hotplug_event(const char *name, int created)
+{
+	// deleted (or replaced) while being probed
+	for (int i = 0; i < HOTPLUG_MAX; i++) if (hotplug[i].dev && !strcmp(hotplug[i].name, name)) hotplug[i].cancel = 1;
+
+	if (!created)
+	{
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			const char *dn = strrchr(input[i].devname, '/');
+			if (pool[i].fd >= 0 && dn && !strcmp(dn + 1, name)) input_close_dev(i);
+		}
+		return 1;
+	}
+
+	hotplug_t *h = NULL;
+	for (int i = 0; i < HOTPLUG_MAX && !h; i++) if (!hotplug[i].dev) h = &hotplug[i];
+	if (!h) return 0;
+
+	snprintf(h->name, sizeof(h->name), "%s", name);
+	h->dev = new devInput;
+	h->fd = -1;
+	h->cancel = 0;
+	h->job = offload_try_submit([h]()
+	{
+		TRACE_SCOPE("input_probe");
+		input_probe(h->dev, &h->fd, h->name);
+	});
+
+	if (!h->job.valid())
+	{
+		hotplug_drop(h);
+		return 0;
+	}
+	return 1;
+}
+
+static void hotplug_service()
+{
+	for (int i = 0; i < HOTPLUG_MAX; i++)
+	{
+		hotplug_t *h = &hotplug[i];
+		if (!h->dev || !h->job.done()) continue;
+
+		h->job = OffloadHandle();
+		if (h->fd >= 0 && !h->cancel && hotplug_install(h->dev, h->fd)) h->fd = -1;
+		hotplug_drop(h);
+	}
+}
+
+// Evdev events come from the reader thread once it runs, mouse devices are always read here
+static int input_read_event(int dev, struct input_event *ev)
+{
+	if (input_queue_fd() >= 0) return input_queue_pop(dev, ev);
+	return read(pool[dev].fd, ev, sizeof(*ev)) == sizeof(*ev);
+}
+
 int input_test(int getchar)
 {
 	static char cur_leds = 0;
@@ -4691,6 +5742,9 @@ int input_test(int getchar)
 
 	if (state == 1)
 	{
+		input_queue_stop();
+		hotplug_reset();
+
 		timeout = 0;
 		printf("Open up to %d input devices.\n", NUMDEV);
 		for (int i = 0; i < NUMDEV; i++)
@@ -4710,347 +5764,9 @@ int input_test(int getchar)
 			{
 				if (!strncmp(de->d_name, "event", 5) || !strncmp(de->d_name, "mouse", 5))
 				{
-					memset(&input[n], 0, sizeof(input[n]));
-					sprintf(input[n].devname, "/dev/input/%s", de->d_name);
-					int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
-					//printf("open(%s): %d\n", input[n].devname, fd);
-
-					if (fd > 0)
+					if (input_probe(&input[n], &pool[n].fd, de->d_name))
 					{
-						pool[n].fd = fd;
 						pool[n].events = POLLIN;
-						input[n].mouse = !strncmp(de->d_name, "mouse", 5);
-
-						char uniq[32] = {};
-						if (!input[n].mouse)
-						{
-							struct input_id id;
-							memset(&id, 0, sizeof(id));
-							ioctl(pool[n].fd, EVIOCGID, &id);
-							input[n].vid = id.vendor;
-							input[n].pid = id.product;
-							input[n].version = id.version;
-							input[n].bustype = id.bustype;
-
-							ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
-							ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
-							input[n].led = has_led(pool[n].fd);
-						}
-
-						//skip our virtual device
-						if (!strcmp(input[n].name, UINPUT_NAME))
-						{
-							close(pool[n].fd);
-
-							pool[n].fd = -1;
-							continue;
-						}
-
-						input[n].bind = -1;
-
-						int effects;
-						input[n].has_rumble = false;
-						if (cfg.rumble)
-						{
-							if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
-							{
-								unsigned char ff_features[(FF_MAX + 7) / 8] = {};
-
-								if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
-								{
-									if (test_bit(FF_RUMBLE, ff_features)) {
-										input[n].rumble_effect.id = -1;
-										input[n].has_rumble = true;
-									}
-								}
-							}
-						}
-
-						// enable scroll wheel reading
-						if (input[n].mouse)
-						{
-							unsigned char buffer[4];
-							static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
-							if (write(pool[n].fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
-							{
-								printf("Cannot switch %s to ImPS/2 protocol(1)\n", input[n].devname);
-							}
-							else if (read(pool[n].fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
-							{
-								printf("Failed to switch %s to ImPS/2 protocol(2)\n", input[n].devname);
-							}
-						}
-
-						// RasPad3 touchscreen
-						if (input[n].vid == 0x222a && input[n].pid == 1)
-						{
-							input[n].quirk = QUIRK_TOUCHGUN;
-							input[n].num = 1;
-							input[n].map_shown = 1;
-
-							input[n].lightgun = 0;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 16383;
-							input[n].guncal[2] = 2047;
-							input[n].guncal[3] = 14337;
-							input_lightgun_load(n);
-						}
-
-						if (input[n].vid == 0x054c)
-						{
-							if (strcasestr(input[n].name, "Motion"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-
-							if (input[n].pid == 0x0268)  input[n].quirk = QUIRK_DS3;
-							else if (input[n].pid == 0x05c4 || input[n].pid == 0x09cc || input[n].pid == 0x0ba0 || input[n].pid == 0x0ce6)
-							{
-								input[n].quirk = QUIRK_DS4;
-								if (strcasestr(input[n].name, "Touchpad"))
-								{
-									input[n].quirk = QUIRK_DS4TOUCH;
-								}
-							}
-						}
-
-						if (input[n].vid == 0x0079 && input[n].pid == 0x1802)
-						{
-							input[n].lightgun = 1;
-							input[n].num = 2; // force mayflash mode 1/2 as second joystick.
-						}
-
-						if (input[n].vid == 0x057e && (input[n].pid == 0x0306 || input[n].pid == 0x0330))
-						{
-							if (strcasestr(input[n].name, "Accelerometer"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else if (strcasestr(input[n].name, "Motion Plus"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else if (!strcasestr(input[n].name, "Pro Controller"))
-							{
-								input[n].quirk = QUIRK_WIIMOTE;
-								input[n].guncal[0] = 0;
-								input[n].guncal[1] = 767;
-								input[n].guncal[2] = 1;
-								input[n].guncal[3] = 1023;
-								input_lightgun_load(n);
-							}
-						}
-
-						if (input[n].vid == 0x057e)
-						{
-							if (strstr(input[n].name, " IMU"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-						}
-
-						if (input[n].vid == 0x057e && input[n].pid == 0x2006)
-						{
-							input[n].misc_flags = 1 << 30;
-							input[n].quirk = QUIRK_JOYCON;
-						}
-						if (input[n].vid == 0x057e && input[n].pid == 0x2007)
-						{
-							input[n].misc_flags = 1 << 29;
-							input[n].quirk = QUIRK_JOYCON;
-						}
-
-						//Ultimarc lightgun
-						if (input[n].vid == 0xd209 && input[n].pid == 0x1601)
-						{
-							input[n].lightgun = 1;
-						}
-
-						//Namco Guncon via Arduino, RetroZord or Reflex Adapt
-						if (((input[n].vid == 0x2341 || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && (strstr(uniq, "RZordPsGun") || strstr(input[n].name, "RZordPsGun"))) ||
-							(input[n].vid == 0x16D0 && input[n].pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(input[n].name, "ReflexPSGun"))))
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//Namco GunCon 2
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x016a)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN_CRT;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 25;
-							input[n].guncal[1] = 245;
-							input[n].guncal[2] = 145;
-							input[n].guncal[3] = 700;
-							input_lightgun_load(n);
-						}
-
-						//Namco GunCon 3
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x0800)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = -32768;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = -32768;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//GUN4IR Lightgun
-						if (input[n].vid == 0x2341 && input[n].pid >= 0x8042 && input[n].pid <= 0x8049)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//OpenFIRE Lightgun
-						//!Note that OF has a user-configurable PID, but the VID is reserved and every device name has the prefix "OpenFIRE"
-						if (input[n].vid == 0xf143 && strstr(input[n].name, "OpenFIRE "))
-						{
-							// OF generates 3 devices, so just focus on the one actual gamepad slot.
-							char *nameInit = input[n].name;
-							if(memcmp(nameInit+strlen(input[n].name)-5, "Mouse", 5) != 0 && memcmp(nameInit+strlen(input[n].name)-8, "Keyboard", 8) != 0)
-							{
-								input[n].quirk = QUIRK_LIGHTGUN;
-								input[n].lightgun = 1;
-								input[n].guncal[0] = -32767;
-								input[n].guncal[1] = 32767;
-								input[n].guncal[2] = -32767;
-								input[n].guncal[3] = 32767;
-								input_lightgun_load(n);
-							}
-						}
-
-						//Blamcon Lightgun
-						if (input[n].vid == 0x3673 && ((input[n].pid >= 0x0100 && input[n].pid <= 0x0103) || (input[n].pid >= 0x0200 && input[n].pid <= 0x0203)))
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//Retroshooter
-						if (input[n].vid == 0x0483 && input[n].pid >= 0x5750 && input[n].pid <= 0x5753)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN_MOUSE;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 1023;
-							input_lightgun_load(n);
-						}
-
-						//Sinden Lightgun (two different PIDs, four different PIDs depending on gun color/config)                                                                                                   
-						if ((input[n].vid == 0x16c0 || input[n].vid == 0x16d0) && (                             
-            					input[n].pid == 0x0f01 ||                             
-            					input[n].pid == 0x0f02 ||                             
-            					input[n].pid == 0x0f38 ||                             
-            					input[n].pid == 0x0f39))                             
-						{                             
-    							input[n].quirk = QUIRK_LIGHTGUN;                             
-    							input[n].lightgun = 1;                             
-    							input[n].guncal[0] = 0;                             
-    							input[n].guncal[1] = 65535;                             
-    							input[n].guncal[2] = 0;                             
-    							input[n].guncal[3] = 65535;                             
-    							input_lightgun_load(n);                             
-						} 
-
-						//Madcatz Arcade Stick 360
-						if (input[n].vid == 0x0738 && input[n].pid == 0x4758) input[n].quirk = QUIRK_MADCATZ360;
-
-						// mr.Spinner
-						// 0x120  - Button
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Overlays on other existing gamepads
-						if (strstr(uniq, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-						if (strstr(input[n].name, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-
-						// Arcade with spinner and/or paddle:
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Includes other buttons and axes, works as a full featured gamepad.
-						if (strstr(uniq, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-						if (strstr(input[n].name, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-
-						//Jamma
-						if (cfg.jamma_vid && cfg.jamma_pid && input[n].vid == cfg.jamma_vid && input[n].pid == cfg.jamma_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA;
-						}
-
-						//Jamma2
-						if (cfg.jamma2_vid && cfg.jamma2_pid && input[n].vid == cfg.jamma2_vid && input[n].pid == cfg.jamma2_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA2;
-						}
-
-						//Atari VCS wireless joystick with spinner
-						if (input[n].vid == 0x3250 && input[n].pid == 0x1001)
-						{
-							input[n].quirk = QUIRK_VCS;
-							input[n].spinner_acc = -1;
-							input[n].misc_flags = 0;
-						}
-
-						//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
-						//Reflex Adapt also uses the UNIQ field to differentiate between device modes
-						//RetroZord Adapter also uses the UNIQ field to differentiate between device modes
-						if ((input[n].vid == 0x2341 || (input[n].vid == 0x16C0 && (input[n].pid>>8) == 0x4) || (input[n].vid == 0x16D0 && input[n].pid == 0x127E) || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && strlen(uniq))
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%s", input[n].vid, input[n].pid, uniq);
-							char *p;
-							while ((p = strchr(input[n].idstr, '/'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ' '))) *p = '_';
-							while ((p = strchr(input[n].idstr, '*'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ':'))) *p = '_';
-							strcpy(input[n].name, uniq);
-						}
-						else if (input[n].vid == 0x1209 && (input[n].pid == 0xFACE || input[n].pid == 0xFACA))
-						{
-							int sum = 0;
-							for (uint32_t i = 0; i < sizeof(input[n].name); i++)
-							{
-								if (!input[n].name[i]) break;
-								sum += (uint8_t)input[n].name[i];
-							}
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%d", input[n].vid, input[n].pid, sum);
-						}
-						else
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x", input[n].vid, input[n].pid);
-						}
-
 						ioctl(pool[n].fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
 
 						n++;
@@ -5072,6 +5788,11 @@ int input_test(int getchar)
 			}
 			unflag_players();
 		}
+
+		int fds[NUMDEV];
+		for (int i = 0; i < NUMDEV; i++) fds[i] = (pool[i].fd >= 0 && !input[i].mouse) ? pool[i].fd : -1;
+		input_queue_start(fds, NUMDEV);
+
 		cur_leds |= 0x80;
 		state++;
 	}
@@ -5106,27 +5827,78 @@ int input_test(int getchar)
 
 	if (state == 2)
 	{
-		int timeout = 0;
-		if (is_menu() && video_fb_state()) timeout = 25;
+		hotplug_service();
+
+		int timeout = scheduler_idle_timeout();
+
+		// wake up for the next autofire toggle
+		if (af_next_us && timeout)
+		{
+			uint64_t now = trace_now_us();
+			int ms = (af_next_us > now) ? (int)((af_next_us - now + 999) / 1000) : 0;
+			if (ms < timeout) timeout = ms;
+		}
 
 		while (1)
 		{
 			if (cfg.rumble && !is_menu())
 			{
+				// the core is asked once per player, however many rumble devices it has
+				int rumble[NUMPLAYERS];
+				for (int i = 0; i < NUMPLAYERS; i++) rumble[i] = -1;
+
 				for (int i = 0; i < NUMDEV; i++)
 				{
 					if (!input[i].has_rumble) continue;
 
 					int dev = i;
 					if (input[i].bind >= 0) dev = input[i].bind;
-					if (!input[dev].num) continue;
+					int num = input[dev].num;
+					if (!num) continue;
 
-					set_rumble(i, spi_uio_cmd(UIO_GET_RUMBLE | ((input[dev].num - 1) << 8)));
+					if (num >= NUMPLAYERS) set_rumble(i, spi_uio_cmd(UIO_GET_RUMBLE | ((num - 1) << 8)));
+					else
+					{
+						if (rumble[num] < 0) rumble[num] = spi_uio_cmd(UIO_GET_RUMBLE | ((num - 1) << 8));
+						set_rumble(i, rumble[num]);
+					}
 				}
 			}
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
-			if (!return_value) break;
+			// Devices read by the reader thread are left out, its eventfd stands in for them
+			int qfd = input_queue_fd();
+			struct pollfd fds[NUMDEV + 4 + PROC_MAX];
+			memcpy(fds, pool, sizeof(pool));
+			if (qfd >= 0) for (int i = 0; i < NUMDEV; i++) if (!input[i].mouse) fds[i].fd = -1;
+			fds[NUMDEV + 3].fd = qfd;
+			fds[NUMDEV + 3].events = POLLIN;
+
+			// output of child processes wakes the loop as well
+			int nproc = proc_poll_fds(fds + NUMDEV + 4, PROC_MAX);
+
+			int queued = 0;
+			for (int i = 0; qfd >= 0 && i < NUMDEV && !queued; i++) queued = input_queue_pending(i);
+
+			int return_value = poll(fds, NUMDEV + 4 + nproc, queued ? 0 : timeout);
+			for (int i = 0; i < NUMDEV + 3; i++) pool[i].revents = fds[i].revents;
+			proc_service();
+
+			if (qfd >= 0)
+			{
+				if (return_value > 0 && (fds[NUMDEV + 3].revents & POLLIN)) input_queue_ack();
+				for (int i = 0; i < NUMDEV; i++)
+				{
+					if (input[i].mouse) continue;
+					pool[i].revents = input_queue_pending(i) ? POLLIN : 0;
+					if (pool[i].revents) queued = 1;
+				}
+			}
+
+			if (!return_value && !queued) break;
+
+			// drain the rest without waiting
+			timeout = 0;
+			scheduler_activity();
 
 			if (return_value < 0)
 			{
@@ -5137,6 +5909,8 @@ int input_test(int getchar)
 			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
 			{
 				printf("Close all devices.\n");
+				input_queue_stop();
+				devio_sync();
 				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 				{
 					ioctl(pool[i].fd, EVIOCGRAB, 0);
@@ -5157,7 +5931,7 @@ int input_test(int getchar)
 					{
 
 						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						if (input_read_event(i, &ev))
 						{
 							if (getchar)
 							{
@@ -5571,7 +6345,9 @@ int input_test(int getchar)
 									dev = i;
 								}
 
+								input_lat_begin(i, input[i].name, &ev, input_queue_rx_us());
 								if (!noabs) input_cb(&ev, &absinfo, i);
+								input_lat_end();
 
 								// simulate digital directions from analog
 								if (ev.type == EV_ABS && !(mapping && mapping_type <= 1 && mapping_button < -4) && !(ev.code <= 1 && input[dev].lightgun) && input[dev].quirk != QUIRK_PDSP && input[dev].quirk != QUIRK_MSSP)
@@ -5591,7 +6367,8 @@ int input_test(int getchar)
 										int treshold = range / 4;
 
 										int only_max = 1;
-										for (int n = 0; n < 4; n++) if (input[dev].mmap[SYS_AXIS1_X + n] && ((input[dev].mmap[SYS_AXIS1_X + n] & 0xFFFF) == ev.code)) only_max = 0;
+										if (fast_map_ready(dev)) only_max = !(input[dev].fast_axis[ev.code & 255] & FAST_AXIS_2WAY);
+										else for (int n = 0; n < 4; n++) if (input[dev].mmap[SYS_AXIS1_X + n] && ((input[dev].mmap[SYS_AXIS1_X + n] & 0xFFFF) == ev.code)) only_max = 0;
 
 										if (ev.value < center - treshold && !only_max) axis_edge = 1;
 										if (ev.value > center + treshold) axis_edge = 2;
@@ -5726,22 +6503,7 @@ int input_test(int getchar)
 					if (cmd[len - 1] == '\n') cmd[len - 1] = 0;
 					cmd[len] = 0;
 					printf("MiSTer_cmd: %s\n", cmd);
-					if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
-					else if (!strncmp(cmd, "load_core ", 10))
-					{
-						if(isXmlName(cmd)) xml_load(cmd + 10);
-						else fpga_load_rbf(cmd + 10);
-					}
-					else if (!strncmp(cmd, "screenshot", 10))
-					{
-						user_io_screenshot_cmd(cmd);
-					}
-					else if (!strncmp(cmd, "volume ", 7))
-					{
-						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
-						else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
-						else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
-					}
+					input_cmd_exec(cmd);
 				}
 			}
 
@@ -5761,21 +6523,29 @@ int input_test(int getchar)
 			cur_leds = leds_state;
 			for (int i = 0; i < NUMDEV; i++)
 			{
-				if (input[i].led)
+				if (input[i].led && pool[i].fd >= 0)
 				{
-					ev.type = EV_LED;
+					int fd = pool[i].fd;
+					char leds = cur_leds;
+					char tag[16];
+					sprintf(tag, "kbdled%d", i);
+					devio_queue(tag, [fd, leds]()
+					{
+						struct input_event ev = {};
+						ev.type = EV_LED;
 
-					ev.code = LED_SCROLLL;
-					ev.value = (cur_leds&HID_LED_SCROLL_LOCK) ? 1 : 0;
-					write(pool[i].fd, &ev, sizeof(struct input_event));
+						ev.code = LED_SCROLLL;
+						ev.value = (leds&HID_LED_SCROLL_LOCK) ? 1 : 0;
+						write(fd, &ev, sizeof(struct input_event));
 
-					ev.code = LED_NUML;
-					ev.value = (cur_leds&HID_LED_NUM_LOCK) ? 1 : 0;
-					write(pool[i].fd, &ev, sizeof(struct input_event));
+						ev.code = LED_NUML;
+						ev.value = (leds&HID_LED_NUM_LOCK) ? 1 : 0;
+						write(fd, &ev, sizeof(struct input_event));
 
-					ev.code = LED_CAPSL;
-					ev.value = (cur_leds&HID_LED_CAPS_LOCK) ? 1 : 0;
-					write(pool[i].fd, &ev, sizeof(struct input_event));
+						ev.code = LED_CAPSL;
+						ev.value = (leds&HID_LED_CAPS_LOCK) ? 1 : 0;
+						write(fd, &ev, sizeof(struct input_event));
+					});
 				}
 			}
 		}
@@ -5784,16 +6554,38 @@ int input_test(int getchar)
 	return 0;
 }
 
+// Autofire half period: a whole number of core frames once the frame time is known,
+// so every press and release lasts the same number of frames.
+static uint32_t af_half_period(int player)
+{
+	uint32_t half = af_delay[player] * 1000;
+	uint32_t frame = video_get_frame_us();
+	if (frame >= 4000 && frame <= 50000)
+	{
+		uint32_t frames = (half + frame / 2) / frame;
+		half = (frames ? frames : 1) * frame;
+	}
+	return half;
+}
+
 int input_poll(int getchar)
 {
-	PROFILE_FUNCTION();
+	PERF_FUNCTION();
 
 	static int af[NUMPLAYERS] = {};
-	static uint32_t time[NUMPLAYERS] = {};
+	static uint64_t af_start[NUMPLAYERS] = {};
+	static uint32_t af_half[NUMPLAYERS] = {};
+	static int af_delay_used[NUMPLAYERS] = {};
 	static uint64_t joy_prev[NUMPLAYERS] = {};
 
 	int ret = input_test(getchar);
-	if (getchar) return ret;
+	if (getchar)
+	{
+		user_io_kbd_flush();
+		gun_flush();
+		user_io_joy_flush();
+		return ret;
+	}
 
 	uinp_check_key();
 
@@ -5824,29 +6616,40 @@ int input_poll(int getchar)
 
 	if (!mouse_emu_x && !mouse_emu_y) mouse_timer = 0;
 
+	af_next_us = 0;
 	if (grabbed)
 	{
+		uint64_t now = trace_now_us();
 		for (int i = 0; i < NUMPLAYERS; i++)
 		{
 			int send = 0;
 			if (af_delay[i] < AF_MIN) af_delay[i] = AF_MIN;
 
 			/* Autofire handler */
+			// The phase comes from the time since the press, a late poll doesn't delay the following toggles
 			if (joy[i] & autofire[i])
 			{
-				if (!time[i]) time[i] = GetTimer(af_delay[i]);
-				else if ((joy[i] ^ joy_prev[i]) & autofire[i])
+				if (!af_start[i] || ((joy[i] ^ joy_prev[i]) & autofire[i]) || af_delay[i] != af_delay_used[i])
 				{
-					time[i] = GetTimer(af_delay[i]);
+					af_start[i] = now;
+					af_half[i] = af_half_period(i);
+					af_delay_used[i] = af_delay[i];
 					af[i] = 0;
 				}
-				else if (CheckTimer(time[i]))
+				else
 				{
-					time[i] = GetTimer(af_delay[i]);
-					af[i] = !af[i];
-					send = 1;
+					uint64_t n = (now - af_start[i]) / af_half[i];
+					if ((int)(n & 1) != af[i])
+					{
+						af[i] = n & 1;
+						send = 1;
+					}
 				}
+
+				uint64_t next = af_start[i] + ((now - af_start[i]) / af_half[i] + 1) * af_half[i];
+				if (!af_next_us || next < af_next_us) af_next_us = next;
 			}
+			else af_start[i] = 0;
 
 			int newdir = ((((uint32_t)(joy[i]) | (uint32_t)(joy[i] >> 32)) & 0xF) != (((uint32_t)(joy_prev[i]) | (uint32_t)(joy_prev[i] >> 32)) & 0xF));
 
@@ -5860,6 +6663,13 @@ int input_poll(int getchar)
 			{
 				user_io_digital_joystick(i, af[i] ? joy[i] & ~autofire[i] : joy[i], newdir);
 			}
+
+			// evdev to SPI, one update per player and poll however many events came in
+			if (joy_rx_us[i])
+			{
+				trace_event("input_joy", joy_rx_us[i]);
+				joy_rx_us[i] = 0;
+			}
 		}
 	}
 
@@ -5870,16 +6680,27 @@ int input_poll(int getchar)
 			if(joy[i]) user_io_digital_joystick(i, 0, 1);
 
 			joy[i] = 0;
+			joy_rx_us[i] = 0;
 			af[i] = 0;
 			autofire[i] = 0;
 		}
 	}
 
+	// Everything the poll changed goes to the core together
+	user_io_kbd_flush();
+	gun_flush();
+	user_io_joy_flush();
+	input_lat_joy_sent();
+
 	if (mouse_req)
 	{
+		// Motion is summed up to the configured rate or the core's frame rate, button changes go out at once
+		int interval = cfg.mouse_rate ? (1000 / cfg.mouse_rate) : video_get_frame_ms();
+		if (interval <= 0 || interval > 100) interval = 16;
+
 		static uint32_t old_time = 0;
 		uint32_t time = GetTimer(0);
-		if ((time - old_time > 15) || (mouse_req & 2))
+		if ((time - old_time >= (uint32_t)interval) || (mouse_req & 2))
 		{
 			old_time = time;
 			user_io_mouse(mouse_btn | mice_btn, mouse_x, mouse_y, mouse_w);
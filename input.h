@@ -78,6 +78,7 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+int input_cmd_exec(char *cmd);
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0);
@@ -99,7 +100,12 @@ uint32_t get_ps2_code(uint16_t key);
 uint32_t get_amiga_code(uint16_t key);
 uint32_t get_archie_code(uint16_t key);
 
+// Key code to core code tables, 256 entries indexed by the key code.
+enum { KBD_TABLE_PS2, KBD_TABLE_PS2_SET1, KBD_TABLE_AMIGA, KBD_TABLE_ARCHIE };
+const int *get_kbd_table(int table);
+
 int input_has_lightgun();
+int input_player_dev(int player, uint16_t *vid, uint16_t *pid);
 void input_lightgun_save(int idx, int32_t *cal);
 
 void input_switch(int grab);
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "input_latency.h"
+#include "profiling.h"
+
+#define LAT_DEVS    32
+#define LAT_PLAYERS 8
+#define LAT_BUCKETS 20 // < 2us << n
+#define LAT_TEST_NAME "MiSTer latency test"
+
+enum { LAT_READ, LAT_CB, LAT_SPI, LAT_STAGES };
+static const char *stage_names[LAT_STAGES] = { "read", "cb", "spi" };
+
+struct lat_hist_t
+{
+	uint32_t buckets[LAT_BUCKETS];
+	uint32_t count;
+	uint32_t max_us;
+};
+
+struct lat_dev_t
+{
+	char name[40];
+	lat_hist_t stage[LAT_STAGES];
+};
+
+static lat_dev_t devs[LAT_DEVS];
+static int enabled = 0;
+
+// last event of the poll: device and kernel time on the monotonic clock
+static int cur_dev = -1;
+static uint64_t cur_us = 0;
+static int cur_done = 0;
+
+// oldest button change per player and oldest key not flushed yet
+static int joy_dev[LAT_PLAYERS];
+static uint64_t joy_us[LAT_PLAYERS];
+static int key_dev = -1;
+static uint64_t key_us = 0;
+
+static int test_running = 0;
+
+static void lat_add(int dev, int stage, int64_t us)
+{
+	if (us < 0) us = 0;
+
+	lat_hist_t *h = &devs[dev].stage[stage];
+	int b = 0;
+	while (b < LAT_BUCKETS - 1 && us >= (2 << b)) b++;
+	h->buckets[b]++;
+	h->count++;
+	if (us > h->max_us) h->max_us = (uint32_t)us;
+}
+
+void input_lat_start()
+{
+	memset(devs, 0, sizeof(devs));
+	for (int i = 0; i < LAT_PLAYERS; i++) joy_dev[i] = -1;
+	key_dev = -1;
+	cur_dev = -1;
+	enabled = 1;
+}
+
+void input_lat_stop()
+{
+	enabled = 0;
+}
+
+void input_lat_begin(int dev, const char *name, const struct input_event *ev, uint64_t rx_us)
+{
+	cur_dev = -1;
+	if (!enabled || dev < 0 || dev >= LAT_DEVS || (!ev->time.tv_sec && !ev->time.tv_usec)) return;
+
+	// evdev stamps with the realtime clock unless told otherwise
+	struct timespec rt, mono;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	int64_t offset = ((int64_t)rt.tv_sec - mono.tv_sec) * 1000000 + (rt.tv_nsec - mono.tv_nsec) / 1000;
+	int64_t ev_us = (int64_t)ev->time.tv_sec * 1000000 + ev->time.tv_usec - offset;
+	if (ev_us <= 0) return;
+
+	// SYN reports carry no input, only the events themselves are counted
+	if (ev->type == EV_SYN) return;
+
+	cur_dev = dev;
+	cur_us = ev_us;
+	cur_done = 0;
+	if (!devs[dev].name[0]) snprintf(devs[dev].name, sizeof(devs[dev].name), "%s", name);
+	if (rx_us) lat_add(dev, LAT_READ, (int64_t)(rx_us - cur_us));
+}
+
+// The event stays current for the digital directions input_cb gets from it
+// after this, until the flush at the end of the poll.
+void input_lat_end()
+{
+	if (cur_dev < 0 || cur_done) return;
+	lat_add(cur_dev, LAT_CB, (int64_t)(trace_now_us() - cur_us));
+	cur_done = 1;
+}
+
+void input_lat_sent()
+{
+	if (cur_dev < 0 || key_dev >= 0) return;
+	key_dev = cur_dev;
+	key_us = cur_us;
+}
+
+void input_lat_joy(int player)
+{
+	if (cur_dev < 0 || player < 0 || player >= LAT_PLAYERS || joy_dev[player] >= 0) return;
+	joy_dev[player] = cur_dev;
+	joy_us[player] = cur_us;
+}
+
+void input_lat_joy_sent()
+{
+	if (!enabled) return;
+
+	uint64_t now = trace_now_us();
+	for (int i = 0; i < LAT_PLAYERS; i++)
+	{
+		if (joy_dev[i] < 0) continue;
+		lat_add(joy_dev[i], LAT_SPI, (int64_t)(now - joy_us[i]));
+		joy_dev[i] = -1;
+	}
+	if (key_dev >= 0) lat_add(key_dev, LAT_SPI, (int64_t)(now - key_us));
+	key_dev = -1;
+	cur_dev = -1;
+}
+
+// Upper bound of the bucket holding the given per mille of the events
+static uint32_t lat_percentile(const lat_hist_t *h, int permille)
+{
+	uint32_t want = ((uint64_t)h->count * permille + 999) / 1000;
+	uint32_t sum = 0;
+	for (int b = 0; b < LAT_BUCKETS; b++)
+	{
+		sum += h->buckets[b];
+		if (sum >= want) return 2u << b;
+	}
+	return h->max_us;
+}
+
+int input_lat_report(char *buf, int size, const char *path)
+{
+	int len = snprintf(buf, size, "%s%s   p50   p99   max us", enabled ? "" : "(off) ", test_running ? "testing" : "");
+
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (f) fprintf(f, "Input latency from the kernel time stamp, us (%s)\n", enabled ? "measuring" : "stopped");
+
+	for (int d = 0; d < LAT_DEVS; d++)
+	{
+		lat_dev_t *dev = &devs[d];
+		if (!dev->stage[LAT_CB].count) continue;
+
+		if (len < size) len += snprintf(buf + len, size - len, "\n%.20s n=%u", dev->name, dev->stage[LAT_CB].count);
+		if (f) fprintf(f, "\n%s (%u events)\n", dev->name, dev->stage[LAT_CB].count);
+
+		for (int s = 0; s < LAT_STAGES; s++)
+		{
+			lat_hist_t *h = &dev->stage[s];
+			if (!h->count) continue;
+
+			if (len < size) len += snprintf(buf + len, size - len, "\n %-5s<%5u <%5u %6u", stage_names[s], lat_percentile(h, 500), lat_percentile(h, 990), h->max_us);
+			if (f)
+			{
+				fprintf(f, "  %s: p50 <%u p99 <%u max %u\n", stage_names[s], lat_percentile(h, 500), lat_percentile(h, 990), h->max_us);
+				for (int b = 0; b < LAT_BUCKETS; b++)
+				{
+					if (h->buckets[b]) fprintf(f, "    <%-9u %8u\n", 2u << b, h->buckets[b]);
+				}
+			}
+		}
+	}
+
+	if (f) fclose(f);
+	return len;
+}
+
+static void lat_emit(int fd, uint16_t type, uint16_t code, int32_t value)
+{
+	struct input_event ev = {};
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	write(fd, &ev, sizeof(ev));
+}
+
+static void *lat_test_thread(void *arg)
+{
+	int count = (int)(intptr_t)arg;
+	trace_thread_name("input_lat_test");
+
+	int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("input_lat: unable to open /dev/uinput\n");
+		__atomic_store_n(&test_running, 0, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	struct uinput_user_dev uinp = {};
+	strncpy(uinp.name, LAT_TEST_NAME, UINPUT_MAX_NAME_SIZE - 1);
+	uinp.id.version = 1;
+	uinp.id.bustype = BUS_VIRTUAL;
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_KEYBIT, KEY_LEFTSHIFT);
+	write(fd, &uinp, sizeof(uinp));
+
+	if (ioctl(fd, UI_DEV_CREATE))
+	{
+		printf("input_lat: unable to create the test device\n");
+		close(fd);
+		__atomic_store_n(&test_running, 0, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	// hotplug has to pick up the device first
+	sleep(2);
+
+	// fixed seed, so every run has the same timing
+	unsigned int seed = 1;
+	for (int i = 0; i < count * 2; i++)
+	{
+		lat_emit(fd, EV_KEY, KEY_LEFTSHIFT, !(i & 1));
+		lat_emit(fd, EV_SYN, SYN_REPORT, 0);
+		usleep(8000 + rand_r(&seed) % 16000);
+	}
+
+	usleep(500000);
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+
+	printf("input_lat: test done, %d key presses\n", count);
+	__atomic_store_n(&test_running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int input_lat_test(int count)
+{
+	if (__atomic_load_n(&test_running, __ATOMIC_ACQUIRE)) return 0;
+	if (count <= 0) count = 500;
+
+	input_lat_start();
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	test_running = 1;
+	if (pthread_create(&thread, &attr, lat_test_thread, (void *)(intptr_t)count))
+	{
+		test_running = 0;
+	}
+	pthread_attr_destroy(&attr);
+	return test_running;
+}
@@ -0,0 +1,37 @@
+#ifndef INPUT_LATENCY_H
+#define INPUT_LATENCY_H
+
+#include <stdint.h>
+#include <linux/input.h>
+
+// Input-to-core latency, per device. Each event is measured from the time
+// the kernel stamped it to the read by the reader thread, to the end of
+// input_cb, and to the SPI write that took it to the core: the keyboard and
+// joystick flushes at the end of the poll. Off until started with
+// "input_lat start" on /dev/MiSTer_cmd, "input_lat" shows the histograms.
+//
+// "input_lat test [n]" creates a uinput keyboard and presses left shift n
+// times at uneven intervals, for measurements that can be repeated.
+
+#define INPUT_LAT_FILE "/tmp/input_latency.txt"
+
+void input_lat_start();
+void input_lat_stop();
+
+// Main thread, around input_cb of one event. rx_us: input_queue_rx_us().
+void input_lat_begin(int dev, const char *name, const struct input_event *ev, uint64_t rx_us);
+void input_lat_end();
+
+// The event being handled is a key, sent with the next flush.
+void input_lat_sent();
+// It changed the buttons of player, sent with the next flush.
+void input_lat_joy(int player);
+// The keyboard and joystick flushes of the poll are done.
+void input_lat_joy_sent();
+
+int input_lat_report(char *buf, int size, const char *path);
+
+// Synthetic key presses through uinput, count of 0 takes 500.
+int input_lat_test(int count);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+#include "input_queue.h"
+#include "profiling.h"
+
+struct input_ring_t
+{
+	std::atomic<uint32_t> head; // written by the reader thread
+	std::atomic<uint32_t> tail; // written by the main thread
+	uint64_t rx_us[INPUT_QUEUE_SIZE];
+	struct input_event ev[INPUT_QUEUE_SIZE];
+};
+
+static input_ring_t rings[INPUT_QUEUE_DEVS];
+static int dev_fds[INPUT_QUEUE_DEVS];
+static int dev_count = 0;
+
+static int notify_fd = -1;
+static int stop_fd = -1;
+static pthread_t reader;
+static int running = 0;
+static uint64_t last_rx_us = 0;
+
+static void *input_reader(void *)
+{
+	trace_thread_name("input");
+
+	struct pollfd fds[INPUT_QUEUE_DEVS + 1];
+	int map[INPUT_QUEUE_DEVS];
+	int n = 0;
+
+	for (int i = 0; i < dev_count; i++)
+	{
+		if (dev_fds[i] < 0) continue;
+		fds[n].fd = dev_fds[i];
+		fds[n].events = POLLIN;
+		map[n++] = i;
+	}
+
+	fds[n].fd = stop_fd;
+	fds[n].events = POLLIN;
+
+	int full = 0;
+	while (1)
+	{
+		int ret = poll(fds, n + 1, full ? 5 : -1);
+
+		// A full ring isn't read for a while so the main thread can catch up, the events wait in the kernel
+		if (full)
+		{
+			for (int k = 0; k < n; k++) fds[k].events = POLLIN;
+			full = 0;
+		}
+
+		if (ret <= 0) continue;
+		if (fds[n].revents) break;
+
+		int queued = 0;
+		for (int k = 0; k < n; k++)
+		{
+			if (fds[k].revents & (POLLERR | POLLHUP | POLLNVAL))
+			{
+				// Unplugged, the main thread finds out through the device watch
+				fds[k].fd = -1;
+				continue;
+			}
+			if (!(fds[k].revents & POLLIN)) continue;
+
+			input_ring_t *r = &rings[map[k]];
+			uint32_t head = r->head.load(std::memory_order_relaxed);
+			uint32_t space = INPUT_QUEUE_SIZE - (head - r->tail.load(std::memory_order_acquire));
+
+			struct input_event buf[64];
+			if (space > 64) space = 64;
+			if (!space)
+			{
+				fds[k].events = 0;
+				full = 1;
+				continue;
+			}
+
+			int len = read(fds[k].fd, buf, space * sizeof(struct input_event));
+			if (len < (int)sizeof(struct input_event)) continue;
+
+			uint64_t now = trace_now_us();
+			int cnt = len / sizeof(struct input_event);
+			for (int e = 0; e < cnt; e++)
+			{
+				r->ev[head % INPUT_QUEUE_SIZE] = buf[e];
+				r->rx_us[head % INPUT_QUEUE_SIZE] = now;
+				head++;
+			}
+			r->head.store(head, std::memory_order_release);
+			queued += cnt;
+		}
+
+		if (queued)
+		{
+			uint64_t one = 1;
+			if (write(notify_fd, &one, sizeof(one)) < 0) {}
+		}
+	}
+
+	return NULL;
+}
+
+// The thread takes the device fds when it starts
+static void reader_start()
+{
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	running = !pthread_create(&reader, &attr, input_reader, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (!running) printf("input: cannot start the reader thread\n");
+}
+
+static void reader_stop()
+{
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof(one)) < 0) {}
+	pthread_join(reader, NULL);
+	if (read(stop_fd, &one, sizeof(one)) < 0) {}
+	running = 0;
+}
+
+void input_queue_start(const int *fds, int count)
+{
+	input_queue_stop();
+
+	if (notify_fd < 0) notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop_fd < 0) stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notify_fd < 0 || stop_fd < 0) return;
+
+	if (count > INPUT_QUEUE_DEVS) count = INPUT_QUEUE_DEVS;
+	dev_count = count;
+	for (int i = 0; i < count; i++)
+	{
+		dev_fds[i] = fds[i];
+		rings[i].head = 0;
+		rings[i].tail = 0;
+	}
+
+	reader_start();
+}
+
+void input_queue_stop()
+{
+	if (!running) return;
+
+	reader_stop();
+
+	input_queue_ack();
+	for (int i = 0; i < dev_count; i++)
+	{
+		rings[i].head = 0;
+		rings[i].tail = 0;
+	}
+
+	dev_count = 0;
+	last_rx_us = 0;
+}
+
+void input_queue_set(int dev, int fd)
+{
+	if (!running || dev < 0 || dev >= dev_count || dev_fds[dev] == fd) return;
+
+	// Restarted with the new set, a closed fd must not be polled any more
+	reader_stop();
+	dev_fds[dev] = fd;
+	rings[dev].head = 0;
+	rings[dev].tail = 0;
+	reader_start();
+}
+
+int input_queue_fd()
+{
+	return running ? notify_fd : -1;
+}
+
+void input_queue_ack()
+{
+	uint64_t val;
+	if (notify_fd >= 0 && read(notify_fd, &val, sizeof(val)) < 0) {}
+}
+
+int input_queue_pending(int dev)
+{
+	if (!running || dev < 0 || dev >= dev_count) return 0;
+	input_ring_t *r = &rings[dev];
+	return r->head.load(std::memory_order_acquire) != r->tail.load(std::memory_order_relaxed);
+}
+
+int input_queue_pop(int dev, struct input_event *ev)
+{
+	last_rx_us = 0;
+	if (!input_queue_pending(dev)) return 0;
+
+	input_ring_t *r = &rings[dev];
+	uint32_t tail = r->tail.load(std::memory_order_relaxed);
+	*ev = r->ev[tail % INPUT_QUEUE_SIZE];
+	last_rx_us = r->rx_us[tail % INPUT_QUEUE_SIZE];
+
+	// Time from the read on the reader thread to here, once per report
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT) trace_event("input_queue", r->rx_us[tail % INPUT_QUEUE_SIZE]);
+
+	r->tail.store(tail + 1, std::memory_order_release);
+	return 1;
+}
+
+uint64_t input_queue_rx_us()
+{
+	return last_rx_us;
+}
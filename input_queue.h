@@ -0,0 +1,33 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <linux/input.h>
+
+// Evdev reader thread.
+// Events of the open evdev devices are read in batches on a separate thread
+// as soon as the kernel has them, and queued per device in lock free single
+// producer/single consumer rings. input_test() takes them from there instead
+// of reading the devices itself, so nothing piles up (or gets dropped by the
+// kernel) while the main thread is busy. The eventfd becomes readable when
+// new events are queued, the main poll() waits on it instead of the devices.
+
+#define INPUT_QUEUE_DEVS 32
+#define INPUT_QUEUE_SIZE 256 // events per device, power of 2
+
+// fds[i] < 0: device i isn't read by the thread (mouse devices, closed slots).
+void input_queue_start(const int *fds, int count);
+void input_queue_stop();
+
+// Hotplug: device dev is read from fd now (< 0: not at all), the other devices keep their queued events.
+void input_queue_set(int dev, int fd);
+
+int input_queue_fd();
+void input_queue_ack(); // clears the eventfd
+
+int input_queue_pending(int dev);
+int input_queue_pop(int dev, struct input_event *ev);
+
+// trace_now_us() when the last popped event was read by the thread, 0 if it didn't come from the queue.
+uint64_t input_queue_rx_us();
+
+#endif
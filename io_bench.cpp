@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+
+#include "io_bench.h"
+#include "file_io.h"
+#include "profiling.h"
+#include "support/chd/mister_chd.h"
+#include "lib/miniz/miniz.h"
+
+#define BENCH_CHUNK      (128 * 1024)
+#define BENCH_SEQ_SIZE   (64 * 1024 * 1024)
+#define BENCH_ZIP_SIZE   (16 * 1024 * 1024)
+#define BENCH_SCAN_FILES 50000
+#define BENCH_CHD_SEQ    8192
+#define BENCH_CHD_RAND   2000
+#define BENCH_CHD_BULK   2048 // hunks
+
+static uint32_t rnd_state;
+
+static uint32_t bench_rand()
+{
+	// xorshift32, same sequence on every run
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+// Roughly 2:1 compressible, similar to typical ROM contents
+static void bench_fill(uint8_t *buf, int size)
+{
+	for (int i = 0; i < size; i += 4)
+	{
+		uint32_t r = bench_rand();
+		uint32_t v = (r & 0x10000000) ? (r & 0x0F0F0F0F) : 0;
+		memcpy(buf + i, &v, 4);
+	}
+}
+
+static void drop_caches()
+{
+	sync();
+	FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (f)
+	{
+		fputs("3", f);
+		fclose(f);
+	}
+}
+
+static FILE *json;
+static int json_count;
+
+static void bench_result(const char *name, uint64_t bytes, uint64_t total_us, std::vector<uint32_t> &lat)
+{
+	if (!total_us) total_us = 1;
+	std::sort(lat.begin(), lat.end());
+
+	uint32_t p50 = lat.empty() ? 0 : lat[lat.size() / 2];
+	uint32_t p99 = lat.empty() ? 0 : lat[(lat.size() * 99) / 100];
+	uint32_t max = lat.empty() ? 0 : lat.back();
+	uint64_t rate = bytes * 100 / total_us; // 0.01 MB/s
+
+	printf("bench %-12s: %llu.%02llu MB/s, %u ops, p50 %uus, p99 %uus, max %uus\n", name,
+		rate / 100, rate % 100, (uint32_t)lat.size(), p50, p99, max);
+
+	if (json)
+	{
+		fprintf(json, "%s\n    { \"name\": \"%s\", \"bytes\": %llu, \"us\": %llu, \"mb_s\": %llu.%02llu, \"ops\": %u, \"p50_us\": %u, \"p99_us\": %u, \"max_us\": %u }",
+			json_count ? "," : "", name, bytes, total_us, rate / 100, rate % 100, (uint32_t)lat.size(), p50, p99, max);
+		json_count++;
+	}
+}
+
+static void bench_skipped(const char *name, const char *reason)
+{
+	printf("bench %-12s: skipped, %s\n", name, reason);
+	if (json)
+	{
+		fprintf(json, "%s\n    { \"name\": \"%s\", \"skipped\": \"%s\" }", json_count ? "," : "", name, reason);
+		json_count++;
+	}
+}
+
+static int bench_create(const char *name, int size, uint8_t *buf)
+{
+	fileTYPE f;
+	if (!FileOpenEx(&f, name, O_CREAT | O_RDWR | O_TRUNC)) return 0;
+
+	std::vector<uint32_t> lat;
+	uint64_t start = trace_now_us();
+	rnd_state = 0x4D695354;
+	for (int pos = 0; pos < size; pos += BENCH_CHUNK)
+	{
+		bench_fill(buf, BENCH_CHUNK);
+		uint64_t t = trace_now_us();
+		if (FileWriteAdv(&f, buf, BENCH_CHUNK) != BENCH_CHUNK)
+		{
+			FileClose(&f);
+			FileDelete(name);
+			return 0;
+		}
+		lat.push_back(trace_now_us() - t);
+	}
+	FileClose(&f);
+
+	bench_result("seq_write", size, trace_now_us() - start, lat);
+	return 1;
+}
+
+static void bench_read(const char *test, const char *name, uint8_t *buf)
+{
+	drop_caches();
+
+	fileTYPE f;
+	std::vector<uint32_t> lat;
+	uint64_t bytes = 0;
+	uint64_t start = trace_now_us();
+	if (!FileOpen(&f, name))
+	{
+		bench_skipped(test, "open failed");
+		return;
+	}
+
+	while (1)
+	{
+		uint64_t t = trace_now_us();
+		int ret = FileReadAdv(&f, buf, BENCH_CHUNK);
+		if (ret <= 0) break;
+		lat.push_back(trace_now_us() - t);
+		bytes += ret;
+	}
+	FileClose(&f);
+
+	bench_result(test, bytes, trace_now_us() - start, lat);
+}
+
+static int bench_create_zip(const char *name, const char *tmp)
+{
+	uint8_t *data = (uint8_t*)malloc(BENCH_ZIP_SIZE);
+	if (!data) return 0;
+
+	rnd_state = 0x5A495030;
+	bench_fill(data, BENCH_ZIP_SIZE);
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(tmp));
+
+	mz_zip_archive z = {};
+	int ok = mz_zip_writer_init_file(&z, path, 0) &&
+		mz_zip_writer_add_mem(&z, "data.bin", data, BENCH_ZIP_SIZE, MZ_DEFAULT_LEVEL) &&
+		mz_zip_writer_finalize_archive(&z);
+	mz_zip_writer_end(&z);
+	free(data);
+
+	// Only a complete archive gets the final name
+	char final_path[1024];
+	snprintf(final_path, sizeof(final_path), "%s", getFullPath(name));
+	if (!ok || rename(path, final_path))
+	{
+		unlink(path);
+		return 0;
+	}
+	return 1;
+}
+
+static void bench_chd(const char *name, uint8_t *buf)
+{
+	if (!FileExists(name, 0))
+	{
+		bench_skipped("chd_seq", "no bench.chd");
+		bench_skipped("chd_random", "no bench.chd");
+		bench_skipped("chd_bulk", "no bench.chd");
+		return;
+	}
+
+	for (int random = 0; random < 2; random++)
+	{
+		const char *test = random ? "chd_random" : "chd_seq";
+		drop_caches();
+
+		chd_file *chd = NULL;
+		if (chd_open(getFullPath(name), CHD_OPEN_READ, NULL, &chd) != CHDERR_NONE)
+		{
+			bench_skipped(test, "open failed");
+			return;
+		}
+
+		const chd_header *hdr = chd_get_header(chd);
+		int frames = hdr->hunkcount * (hdr->hunkbytes / hdr->unitbytes);
+		int reads = random ? BENCH_CHD_RAND : std::min(frames, BENCH_CHD_SEQ);
+
+		std::vector<uint32_t> lat;
+		uint64_t start = trace_now_us();
+		rnd_state = 0x43484430;
+		for (int i = 0; i < reads; i++)
+		{
+			int lba = random ? (int)(bench_rand() % frames) : i;
+			uint64_t t = trace_now_us();
+			if (mister_chd_read_sectors(chd, lba, 1, 0, 2352, buf, 2352) != CHDERR_NONE) break;
+			lat.push_back(trace_now_us() - t);
+		}
+		uint64_t total = trace_now_us() - start;
+		mister_chd_close(chd);
+
+		bench_result(test, (uint64_t)lat.size() * 2352, total, lat);
+	}
+
+	drop_caches();
+
+	chd_file *chd = NULL;
+	if (chd_open(getFullPath(name), CHD_OPEN_READ, NULL, &chd) != CHDERR_NONE)
+	{
+		bench_skipped("chd_bulk", "open failed");
+		return;
+	}
+
+	const chd_header *hdr = chd_get_header(chd);
+	int hunks = std::min((int)hdr->totalhunks, BENCH_CHD_BULK);
+	uint8_t *dest = (uint8_t *)malloc((size_t)hunks * hdr->hunkbytes);
+	if (!dest)
+	{
+		mister_chd_close(chd);
+		bench_skipped("chd_bulk", "no memory");
+		return;
+	}
+
+	// latency is the time between in-order completions
+	struct { std::vector<uint32_t> lat; uint64_t last; } st;
+	st.last = trace_now_us();
+	uint64_t start = st.last;
+	chd_error err = mister_chd_read_hunks(chd, 0, hunks, dest, [](int, void *arg)
+	{
+		auto *p = (decltype(st) *)arg;
+		uint64_t t = trace_now_us();
+		p->lat.push_back(t - p->last);
+		p->last = t;
+	}, &st);
+	uint64_t total = trace_now_us() - start;
+	uint32_t hunkbytes = hdr->hunkbytes;
+	mister_chd_close(chd);
+	free(dest);
+
+	if (err != CHDERR_NONE) bench_skipped("chd_bulk", "read failed");
+	else bench_result("chd_bulk", (uint64_t)hunks * hunkbytes, total, st.lat);
+}
+
+static void bench_scan(const char *dir)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/f%05d.bin", dir, BENCH_SCAN_FILES - 1);
+	if (!FileExists(path, 0))
+	{
+		printf("bench: creating %d files in %s\n", BENCH_SCAN_FILES, dir);
+		FileCreatePath(dir);
+		for (int i = 0; i < BENCH_SCAN_FILES; i++)
+		{
+			snprintf(path, sizeof(path), "%s/f%05d.bin", getFullPath(dir), i);
+			int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+			if (fd < 0)
+			{
+				bench_skipped("scan_cold", "create failed");
+				return;
+			}
+			close(fd);
+		}
+	}
+
+	for (int warm = 0; warm < 2; warm++)
+	{
+		if (!warm) drop_caches();
+
+		std::vector<uint32_t> lat;
+		snprintf(path, sizeof(path), "%s", dir);
+		uint64_t t = trace_now_us();
+		int count = ScanDirectory(path, SCANF_INIT, "BIN", 0);
+		lat.push_back(trace_now_us() - t);
+
+		printf("bench: scanned %d entries\n", count);
+		bench_result(warm ? "scan_warm" : "scan_cold", 0, lat[0], lat);
+	}
+}
+
+int io_bench_run(const char *dir)
+{
+	if (!dir || !*dir) dir = "bench";
+
+	char name[1024], tmp[1024];
+	if (!FileCreatePath(dir))
+	{
+		printf("bench: cannot create %s\n", dir);
+		return 0;
+	}
+
+	uint8_t *buf = (uint8_t*)malloc(BENCH_CHUNK);
+	if (!buf) return 0;
+
+	snprintf(name, sizeof(name), "%s/io_bench.json", getFullPath(dir));
+	json = fopen(name, "w");
+	json_count = 0;
+	if (json) fprintf(json, "{\n  \"storage\": \"%s\",\n  \"results\": [", getRootDir());
+
+	printf("bench: starting in %s\n", getFullPath(dir));
+
+	snprintf(name, sizeof(name), "%s/seq.bin", dir);
+	struct stat64 *st = getPathStat(name);
+	int have_seq = st && st->st_size == BENCH_SEQ_SIZE;
+	if (have_seq) bench_skipped("seq_write", "file exists");
+	if (have_seq || bench_create(name, BENCH_SEQ_SIZE, buf)) bench_read("seq_read", name, buf);
+	else bench_skipped("seq_read", "create failed");
+
+	snprintf(name, sizeof(name), "%s/bench.zip", dir);
+	snprintf(tmp, sizeof(tmp), "%s/bench.zip.part", dir);
+	if (FileExists(name, 0) || bench_create_zip(name, tmp))
+	{
+		snprintf(name, sizeof(name), "%s/bench.zip/data.bin", dir);
+		bench_read("zip_inflate", name, buf);
+	}
+	else bench_skipped("zip_inflate", "create failed");
+
+	snprintf(name, sizeof(name), "%s/bench.chd", dir);
+	bench_chd(name, buf);
+
+	snprintf(name, sizeof(name), "%s/scan", dir);
+	bench_scan(name);
+
+	free(buf);
+
+	if (json)
+	{
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+		json = NULL;
+	}
+
+	printf("bench: done\n");
+	return 1;
+}
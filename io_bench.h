@@ -0,0 +1,13 @@
+#ifndef IO_BENCH_H
+#define IO_BENCH_H
+
+// Storage benchmark: sequential reads, zip inflate, CHD sector reads and
+// ScanDirectory on a large tree. Test data is generated once (fixed seed)
+// under dir (relative to the root, "bench" if NULL) and kept for later runs.
+// bench.chd in that directory is used for the CHD tests if present.
+// Page cache is dropped before every test, results go to dir/io_bench.json.
+// Blocks the caller for a long time and reuses the file browser list, run it
+// with the OSD closed.
+int io_bench_run(const char *dir);
+
+#endif
@@ -65,6 +65,24 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void)) {
   return handle;
 }
 
+/* context at the start of memory, the stack grows down from its end */
+cothread_t co_derive(void* memory, unsigned int size, void (*entrypoint)(void)) {
+  unsigned long* handle;
+  if(!co_swap) {
+    co_init();
+    co_swap = (void (*)(cothread_t, cothread_t))co_swap_function;
+  }
+  if(!co_active_handle) co_active_handle = &co_active_buffer;
+
+  if((handle = (unsigned long*)memory)) {
+    unsigned long* p = (unsigned long*)((unsigned char*)handle + (size & ~15));
+    handle[8] = (unsigned long)p;
+    handle[9] = (unsigned long)entrypoint;
+  }
+
+  return handle;
+}
+
 void co_delete(cothread_t handle) {
   free(handle);
 }
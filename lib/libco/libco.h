@@ -15,6 +15,7 @@ typedef void* cothread_t;
 
 cothread_t co_active();
 cothread_t co_create(unsigned int, void (*)(void));
+cothread_t co_derive(void*, unsigned int, void (*)(void));
 void co_delete(cothread_t);
 void co_switch(cothread_t);
 
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "load_times.h"
+#include "file_io.h"
+#include "fpga_io.h"
+#include "menu.h"
+#include "support/arcade/mra_loader.h"
+
+#define LOAD_TIMES_MAX  (128 * 1024)        // log size before it's rotated
+#define LOAD_PENDING    "/tmp/load_pending"
+#define LOAD_STALE_US   (120 * 1000000ULL)  // an open record older than this is given up
+#define BATCH_STATE     "/tmp/load_batch.state"
+#define BATCH_SETTLE_US (3 * 1000000ULL)    // quiet time before the next title
+
+static const char *phase_names[LOAD_PHASES] = { "config", "rbf", "open", "read", "hash", "tx", "post" };
+
+static load_record_t cur = {};
+static load_record_t last = {};
+static int depth = 0;
+static int have_last = 0;
+static uint64_t last_end_us = 0;
+
+const char *load_phase_name(int phase)
+{
+	return (phase >= 0 && phase < LOAD_PHASES) ? phase_names[phase] : "";
+}
+
+static int record_line(const load_record_t *rec, char *buf, int size)
+{
+	char stamp[32];
+	time_t t = time(NULL);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+
+	int len = snprintf(buf, size, "%s\t%s\t%s\t%s\t%u", stamp, rec->kind, rec->name, rec->failed ? "fail" : "ok", (uint32_t)(rec->total_us / 1000));
+	for (int i = 0; i < LOAD_PHASES && len < size; i++) len += snprintf(buf + len, size - len, "\t%u", (uint32_t)(rec->phase_us[i] / 1000));
+	if (len < size) len += snprintf(buf + len, size - len, "\t%u\n", (uint32_t)(rec->bytes >> 10));
+	return len;
+}
+
+static void record_header(FILE *f)
+{
+	fprintf(f, "# time\tkind\tname\tresult\ttotal_ms");
+	for (int i = 0; i < LOAD_PHASES; i++) fprintf(f, "\t%s_ms", phase_names[i]);
+	fprintf(f, "\tkb\n");
+}
+
+static void log_write(const char *path, const char *line, int rotate)
+{
+	FILE *f = fopen(path, "a");
+	if (!f) return;
+
+	if (rotate && ftell(f) > LOAD_TIMES_MAX)
+	{
+		fclose(f);
+		char old[256];
+		snprintf(old, sizeof(old), "%s.1", path);
+		rename(path, old);
+		f = fopen(path, "a");
+		if (!f) return;
+	}
+
+	if (!ftell(f)) record_header(f);
+	fputs(line, f);
+	fclose(f);
+}
+
+static void batch_record(const char *line);
+
+static void record_close()
+{
+	cur.total_us = trace_now_us() - cur.start_us;
+	depth = 0;
+	last = cur;
+	have_last = 1;
+	last_end_us = trace_now_us();
+
+	char line[512];
+	record_line(&cur, line, sizeof(line));
+	printf("Load time: %s", line);
+	log_write(LOAD_TIMES_LOG, line, 1);
+	batch_record(line);
+}
+
+void load_begin(const char *kind, const char *name)
+{
+	if (depth && trace_now_us() - cur.start_us > LOAD_STALE_US)
+	{
+		printf("Load time: %s never finished.\n", cur.name);
+		cur.failed = 1;
+		record_close();
+	}
+
+	if (!depth++)
+	{
+		memset(&cur, 0, sizeof(cur));
+		strncpy(cur.kind, kind, sizeof(cur.kind) - 1);
+		const char *p = strrchr(name, '/');
+		strncpy(cur.name, p ? p + 1 : name, sizeof(cur.name) - 1);
+		cur.start_us = trace_now_us();
+	}
+}
+
+void load_end()
+{
+	if (depth && !--depth) record_close();
+}
+
+void load_failed()
+{
+	if (depth) cur.failed = 1;
+}
+
+void load_phase_add(int phase, uint64_t us)
+{
+	if (depth && phase >= 0 && phase < LOAD_PHASES) cur.phase_us[phase] += us;
+}
+
+uint64_t load_phase_next(int phase, uint64_t begin_us)
+{
+	uint64_t now = trace_now_us();
+	load_phase_add(phase, now - begin_us);
+	return now;
+}
+
+void load_bytes(uint64_t bytes)
+{
+	if (depth) cur.bytes += bytes;
+}
+
+void load_handoff()
+{
+	if (!depth) return;
+
+	FILE *f = fopen(LOAD_PENDING, "wb");
+	if (!f) return;
+	fwrite(&cur, sizeof(cur), 1, f);
+	fclose(f);
+}
+
+int load_resume()
+{
+	FILE *f = fopen(LOAD_PENDING, "rb");
+	if (!f) return 0;
+
+	load_record_t rec;
+	int ok = fread(&rec, sizeof(rec), 1, f) == 1;
+	fclose(f);
+	unlink(LOAD_PENDING);
+
+	if (!ok || trace_now_us() - rec.start_us > LOAD_STALE_US) return 0;
+
+	cur = rec;
+	depth = 1;
+	return 1;
+}
+
+int load_last(load_record_t *rec)
+{
+	if (have_last) *rec = last;
+	return have_last;
+}
+
+int load_report(char *buf, int size, int count)
+{
+	buf[0] = 0;
+
+	FILE *f = fopen(LOAD_TIMES_LOG, "r");
+	if (!f) return snprintf(buf, size, "No launches recorded.");
+
+	// the last lines fit in this
+	static char tail[4096];
+	fseek(f, 0, SEEK_END);
+	long pos = ftell(f) - (long)(sizeof(tail) - 1);
+	fseek(f, (pos > 0) ? pos : 0, SEEK_SET);
+	int len = fread(tail, 1, sizeof(tail) - 1, f);
+	fclose(f);
+	tail[(len > 0) ? len : 0] = 0;
+
+	char *lines[16];
+	int n = 0;
+	char *save = NULL;
+	for (char *l = strtok_r(tail, "\n", &save); l; l = strtok_r(NULL, "\n", &save))
+	{
+		if (l[0] == '#' || (pos > 0 && l == tail)) continue; // header or cut off
+		if (n == 16) memmove(lines, lines + 1, sizeof(lines[0]) * --n);
+		lines[n++] = l;
+	}
+
+	int out = 0;
+	for (int i = (n > count) ? n - count : 0; i < n && out < size; i++)
+	{
+		char *field[5 + LOAD_PHASES + 1];
+		int fields = 0;
+		for (char *fld = strtok_r(lines[i], "\t", &save); fld && fields < (int)(sizeof(field) / sizeof(field[0])); fld = strtok_r(NULL, "\t", &save)) field[fields++] = fld;
+		if (fields < 5 + LOAD_PHASES) continue;
+
+		out += snprintf(buf + out, size - out, "%s%.22s %s ms%s\n ", out ? "\n" : "", field[2], field[4], strcmp(field[3], "ok") ? " fail" : "");
+		for (int p = 0; p < LOAD_PHASES && out < size; p++)
+		{
+			if (strcmp(field[5 + p], "0")) out += snprintf(buf + out, size - out, " %s %s", phase_names[p], field[5 + p]);
+		}
+	}
+
+	if (!out) out = snprintf(buf, size, "No launches recorded.");
+	return out;
+}
+
+// Batch mode
+
+static int batch_on = -1;    // -1 until the state file was checked
+static int batch_next = 0;
+static int batch_cold = 0;
+static char batch_list[1024];
+static char batch_csv[1024];
+
+static void batch_save()
+{
+	FILE *f = fopen(BATCH_STATE, "w");
+	if (!f) return;
+	fprintf(f, "%d %d\n%s\n", batch_next, batch_cold, batch_list);
+	fclose(f);
+}
+
+static void batch_load()
+{
+	batch_on = 0;
+	FILE *f = fopen(BATCH_STATE, "r");
+	if (!f) return;
+
+	if (fscanf(f, "%d %d\n", &batch_next, &batch_cold) == 2 && fgets(batch_list, sizeof(batch_list), f))
+	{
+		batch_list[strcspn(batch_list, "\r\n")] = 0;
+		batch_on = batch_list[0] != 0;
+	}
+	fclose(f);
+
+	// <list>_times.csv next to the list
+	snprintf(batch_csv, sizeof(batch_csv), "%s", batch_list);
+	char *ext = strrchr(batch_csv, '.');
+	if (ext && !strchr(ext, '/')) *ext = 0;
+	strncat(batch_csv, "_times.csv", sizeof(batch_csv) - strlen(batch_csv) - 1);
+}
+
+static void batch_record(const char *line)
+{
+	if (batch_on < 0) batch_load();
+	if (batch_on) log_write(batch_csv, line, 0);
+}
+
+// Title number n of the list, skipping empty lines and comments
+static int batch_title(int n, char *title, int size)
+{
+	FILE *f = fopen(batch_list, "r");
+	if (!f) return 0;
+
+	int found = 0;
+	while (!found && fgets(title, size, f))
+	{
+		title[strcspn(title, "\r\n")] = 0;
+		if (title[0] && title[0] != '#' && !n--) found = 1;
+	}
+	fclose(f);
+	return found;
+}
+
+static void drop_caches()
+{
+	sync();
+	FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (f)
+	{
+		fputs("3", f);
+		fclose(f);
+	}
+}
+
+int load_batch_start(const char *list, int cold)
+{
+	snprintf(batch_list, sizeof(batch_list), "%s", getFullPath(list));
+
+	char title[1024];
+	if (!batch_title(0, title, sizeof(title)))
+	{
+		printf("load_batch: no titles in %s\n", batch_list);
+		return 0;
+	}
+
+	batch_next = 0;
+	batch_cold = cold;
+	batch_save();
+	batch_load();
+	printf("load_batch: %s, results in %s\n", batch_list, batch_csv);
+
+	// starts right away, a new run gets its own header
+	FILE *f = fopen(batch_csv, "a");
+	if (f)
+	{
+		if (ftell(f)) fputc('\n', f);
+		record_header(f);
+		fclose(f);
+	}
+	last_end_us = 0;
+	return 1;
+}
+
+void load_batch_stop()
+{
+	unlink(BATCH_STATE);
+	batch_on = 0;
+}
+
+void load_batch_poll()
+{
+	if (batch_on < 0) batch_load();
+	if (!batch_on) return;
+
+	uint64_t now = trace_now_us();
+	if (depth)
+	{
+		// a load that doesn't finish (MGL waiting for the OSD?) fails the title
+		if (now - cur.start_us > LOAD_STALE_US)
+		{
+			cur.failed = 1;
+			record_close();
+		}
+		return;
+	}
+
+	if (!last_end_us) last_end_us = now - BATCH_SETTLE_US;
+	if (now - last_end_us < BATCH_SETTLE_US) return;
+
+	char title[1024];
+	if (!batch_title(batch_next, title, sizeof(title)))
+	{
+		printf("load_batch: %d titles done, results in %s\n", batch_next, batch_csv);
+		load_batch_stop();
+
+		static char msg[256];
+		snprintf(msg, sizeof(msg), "%d titles loaded.\nResults in\n%s", batch_next, batch_csv);
+		InfoMessage(msg, 10000, "Load batch");
+		return;
+	}
+
+	batch_next++;
+	batch_save();
+	printf("load_batch: #%d %s\n", batch_next, title);
+
+	if (batch_cold) drop_caches();
+	last_end_us = now;
+
+	// a launch that fails here leaves its record, the next title follows after the settle time
+	if (isXmlName(title)) xml_load(title);
+	else fpga_load_rbf(title);
+}
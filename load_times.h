@@ -0,0 +1,108 @@
+#ifndef LOAD_TIMES_H
+#define LOAD_TIMES_H
+
+#include <stdint.h>
+#include "profiling.h"
+
+// Launch timings. Every launch of an RBF, MRA, MGL or ROM gets one record
+// with the time spent per phase, written to LOAD_TIMES_LOG (tab separated,
+// rotated to .1) once the core is up and the files are sent. Loads started
+// while a record is open (the ROM of an MGL, the BIOS a core loads on init)
+// are added to it. A core launch continues the record in the new process:
+// it's handed over in /tmp by app_restart and picked up by user_io_init.
+//
+// Phases are time spent on the main thread, the rest of the total is
+// delays (MGL) and everything not covered.
+
+#define LOAD_TIMES_LOG "/tmp/load_times.log"
+
+enum LoadPhase
+{
+	LOAD_CONFIG = 0,  // INI, MRA/MGL and config string parsing
+	LOAD_RBF,         // FPGA programming
+	LOAD_OPEN,        // file and zip opens
+	LOAD_READ,        // reads, and waits for the readers
+	LOAD_HASH,        // hashing not overlapped with the transfer
+	LOAD_TX,          // sending to the core or DDR
+	LOAD_POST,        // game ID, saves, flushes before the restart
+	LOAD_PHASES
+};
+
+struct load_record_t
+{
+	char kind[8];      // rbf, mra, mgl, rom, neo
+	char name[128];
+	uint8_t failed;
+	uint64_t start_us; // trace_now_us, monotonic so it survives the restart
+	uint64_t total_us;
+	uint64_t phase_us[LOAD_PHASES];
+	uint64_t bytes;
+};
+
+// Opens a record, or nests into the open one.
+void load_begin(const char *kind, const char *name);
+// Closes the record when the outermost load ends.
+void load_end();
+void load_failed();
+
+// Main thread only, ignored without an open record.
+void load_phase_add(int phase, uint64_t us);
+// Adds the time since begin_us, returns the current time for the next phase.
+uint64_t load_phase_next(int phase, uint64_t begin_us);
+void load_bytes(uint64_t bytes);
+
+// Core launch: app_restart keeps the open record for the new process,
+// user_io_init takes it back. Returns 1 if a record continues.
+void load_handoff();
+int load_resume();
+
+// Last record closed by this process, 0 if none.
+int load_last(load_record_t *rec);
+const char *load_phase_name(int phase);
+
+// The last launches from the log for the OSD.
+int load_report(char *buf, int size, int count);
+
+// Batch mode: launches the titles (rbf, mra or mgl paths, one per line)
+// of list one after the other, each once the previous one settled, and
+// writes their records to <list>_times.csv. "cold" drops the page cache
+// before every launch. State is kept in /tmp across the restarts.
+int load_batch_start(const char *list, int cold);
+void load_batch_stop();
+// Called from the UI loop, starts the next title when it's time.
+void load_batch_poll();
+
+struct LoadScope
+{
+	LoadScope(const char *kind, const char *name)
+	{
+		load_begin(kind, name);
+	}
+
+	~LoadScope()
+	{
+		load_end();
+	}
+};
+
+struct LoadPhaseScope
+{
+	int phase;
+	uint64_t begin_us;
+
+	LoadPhaseScope(int phase)
+		: phase(phase)
+		, begin_us(trace_now_us())
+	{
+	}
+
+	~LoadPhaseScope()
+	{
+		load_phase_add(phase, trace_now_us() - begin_us);
+	}
+};
+
+#define LOAD_SCOPE(kind, name) LoadScope __load_scope(kind, name)
+#define LOAD_PHASE(phase) LoadPhaseScope __load_phase(phase)
+
+#endif
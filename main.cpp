@@ -33,6 +33,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "scheduler.h"
 #include "osd.h"
 #include "offload.h"
+#include "profiling.h"
+#include "realtime.h"
+#include "watchdog.h"
+#include "gamecontroller_db.h"
+#include "storage_probe.h"
 
 const char *version = "$VER:" VDATE;
 
@@ -46,9 +51,14 @@ int main(int argc, char *argv[])
 	CPU_SET(1, &set);
 	sched_setaffinity(0, sizeof(set), &set);
 
+	// boot_* trace spans show where the time to the main loop goes
+	uint64_t boot_start = trace_now_us();
+	uint64_t t = boot_start;
+
 	offload_start();
 
 	fpga_io_init();
+	trace_event("boot_fpga_io", t);
 
 	DISKLED_OFF;
 
@@ -68,11 +78,25 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	t = trace_now_us();
 	FindStorage();
+	trace_event("boot_storage", t);
+	storage_probe_start(0);
+
+	// independent of the core, overlaps with its init
+	gcdb_preload();
+
+	t = trace_now_us();
 	user_io_init((argc > 1) ? argv[1] : "",(argc > 2) ? argv[2] : NULL);
+	trace_event("boot_user_io_init", t);
+
+	trace_event("boot", boot_start);
+	printf("Init done in %llu ms\n", (trace_now_us() - boot_start) / 1000);
 
 #ifdef USE_SCHEDULER
 	scheduler_init();
+	realtime_init();
+	watchdog_init();
 	scheduler_run();
 #else
 	while (1)
@@ -83,6 +107,8 @@ int main(int argc, char *argv[])
 		}
 
 		user_io_poll();
+		user_io_share_poll();
+		user_io_cd_poll();
 		input_poll(0);
 		HandleUI();
 		OsdUpdate();
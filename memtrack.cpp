@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "memtrack.h"
+
+static int64_t cur[MEM_TAGS] = {};
+static int64_t peak[MEM_TAGS] = {};
+
+static const char *tag_names[MEM_TAGS] =
+{
+	"catalog", "preview", "zip", "cd", "savestate", "image", "cache", "pools", "arenas", "roms"
+};
+
+void mem_account(int tag, int64_t delta)
+{
+	if (tag < 0 || tag >= MEM_TAGS || !delta) return;
+
+	int64_t now = __atomic_add_fetch(&cur[tag], delta, __ATOMIC_RELAXED);
+	int64_t p = __atomic_load_n(&peak[tag], __ATOMIC_RELAXED);
+	while (now > p && !__atomic_compare_exchange_n(&peak[tag], &p, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+uint64_t mem_current(int tag)
+{
+	if (tag < 0 || tag >= MEM_TAGS) return 0;
+	int64_t v = __atomic_load_n(&cur[tag], __ATOMIC_RELAXED);
+	return (v > 0) ? v : 0;
+}
+
+uint64_t mem_peak(int tag)
+{
+	if (tag < 0 || tag >= MEM_TAGS) return 0;
+	return __atomic_load_n(&peak[tag], __ATOMIC_RELAXED);
+}
+
+const char *mem_tag_name(int tag)
+{
+	return (tag >= 0 && tag < MEM_TAGS) ? tag_names[tag] : "";
+}
+
+uint32_t mem_rss_kb()
+{
+	static int fd = -1;
+	if (fd < 0) fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	char buf[128];
+	int len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) return 0;
+	buf[len] = 0;
+
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) return 0;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int mem_report(char *buf, int size, const char *path)
+{
+	uint64_t total = 0;
+	int len = snprintf(buf, size, "%-10s %8s %8s", "KB", "now", "peak");
+	for (int i = 0; i < MEM_TAGS && len < size; i++)
+	{
+		total += mem_current(i);
+		len += snprintf(buf + len, size - len, "\n%-10s %8llu %8llu", tag_names[i],
+			(unsigned long long)(mem_current(i) >> 10), (unsigned long long)(mem_peak(i) >> 10));
+	}
+
+	uint32_t rss = mem_rss_kb();
+	if (len < size) len += snprintf(buf + len, size - len, "\n%-10s %8llu\n%-10s %8u", "tracked", (unsigned long long)(total >> 10), "resident", rss);
+
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (f)
+	{
+		fprintf(f, "%s\n", buf);
+		fclose(f);
+	}
+	return len;
+}
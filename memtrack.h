@@ -0,0 +1,39 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <stdint.h>
+
+// Memory accounting per subsystem. Owners report what they allocate and
+// free (or the change of their table sizes), current and peak bytes are
+// kept per tag. Shown by "mem_report" on /dev/MiSTer_cmd and exported
+// through the status page, next to the resident size of the process.
+
+enum MemTag
+{
+	MEM_CATALOG = 0,  // ROM catalog tables
+	MEM_PREVIEW,      // decoded preview thumbnails
+	MEM_ZIP,          // open zip archives and inflate streams
+	MEM_CD,           // CD images copied to RAM
+	MEM_SAVESTATE,    // savestate staging and history
+	MEM_IMAGE,        // menu background, logo and imlib images
+	MEM_CACHE,        // SD/save write caches and overlays
+	MEM_POOL,         // buffer pool slabs (CHD hunks, sector windows)
+	MEM_ARENA,        // load arenas
+	MEM_ROM,          // last ROMs kept for reload
+	MEM_TAGS
+};
+
+// Thread safe.
+void mem_account(int tag, int64_t delta);
+
+uint64_t mem_current(int tag);
+uint64_t mem_peak(int tag);
+const char *mem_tag_name(int tag);
+
+// Resident size of the process in KB, 0 if it can't be read.
+uint32_t mem_rss_kb();
+
+// Table of all tags for the OSD, also written to path if not NULL.
+int mem_report(char *buf, int size, const char *path);
+
+#endif
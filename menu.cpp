@@ -54,7 +54,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "fpga_io.h"
 #include "cfg.h"
 #include "input.h"
-#include "battery.h"
+#include "sensors.h"
 #include "cheats.h"
 #include "video.h"
 #include "audio.h"
@@ -66,6 +66,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bootcore.h"
 #include "ide.h"
 #include "profiling.h"
+#include "proc_run.h"
+#include "save_cache.h"
+#include "cfg_store.h"
+#include "load_times.h"
 
 /*menu states*/
 enum MENU
@@ -219,7 +223,8 @@ enum MENU
 	MENU_ROMS_CORE_SELECT1,
 	MENU_ROMS_CORE_SELECT2,
 	MENU_ROMS_CORE_SELECTED,
-	MENU_ROMS_SCANNING,
+	MENU_ROMS_SCANNING1,
+	MENU_ROMS_SCANNING2,
 	MENU_ROMS_BROWSE1,
 	MENU_ROMS_BROWSE2,
 	MENU_ROMS_LAUNCH,
@@ -232,6 +237,7 @@ static uint32_t menusub_last = 0; //for when we allocate it dynamically and need
 static uint64_t menumask = 0; // Used to determine which rows are selectable...
 static uint32_t menu_timer = 0;
 static uint32_t menu_save_timer = 0;
+static uint32_t rom_scan_timer = 0;
 static uint32_t load_addr = 0;
 static int32_t  bt_timer = 0;
 
@@ -265,13 +271,13 @@ const char *config_scale[] = { "Normal", "V-Integer", "HV-Integer-", "HV-Integer
 
 #define script_line_length 1024
 #define script_lines 50
-static FILE *script_pipe;
-static int script_file;
+static pid_t script_pid;
 static char script_command[script_line_length];
 static int script_line;
 static char script_output[script_lines][script_line_length];
 static char script_line_output[script_line_length];
 static bool script_finished;
+static int bt_renew;
 
 // one screen width
 static const char* HELPTEXT_SPACER = "                                ";
@@ -448,12 +454,12 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 		}
 	}
 
-	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options);
+	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options | SCANO_STREAM);
 	AdjustDirectory(selPath);
 
 	strcpy(fs_pFileExt, pFileExt);
 	fs_ExtLen = strlen(fs_pFileExt);
-	fs_Options = Options & ~SCANO_NOENTER;
+	fs_Options = (Options & ~SCANO_NOENTER) | SCANO_STREAM;
 	fs_MenuSelect = MenuSelect;
 	fs_MenuCancel = MenuCancel;
 
@@ -495,14 +501,43 @@ void SelectINI()
 /* the Atari core handles OSD keys competely inside the core */
 static uint32_t menu_key = 0;
 
+// HandleUI runs when something may have changed: a key, a state change
+// made by its last run, menu_wake() from async work and the timers, which
+// are checked every UI_IDLE_MS (the name scrolling step).
+#define UI_IDLE_MS 10
+#define UI_WAKE_MS 50 // covers the key debounce
+
+static unsigned long ui_wake_until = 0;
+static unsigned long ui_tick = 0;
+static uint32_t ui_last_state = ~0u;
+
+void menu_wake()
+{
+	ui_wake_until = GetTimer(UI_WAKE_MS);
+}
+
 void menu_key_set(unsigned int c)
 {
 	//printf("OSD enqueue: %x\n", c);
 	menu_key = c;
+	menu_wake();
 }
 
 // get key status
 static int hold_cnt = 0;
+
+int menu_ui_due()
+{
+	int due = (menu_key && !(menu_key & UPSTROKE)) || hold_cnt || menustate != ui_last_state ||
+		!mgl_get()->done || !CheckTimer(ui_wake_until) || CheckTimer(ui_tick);
+
+	if (due)
+	{
+		ui_tick = GetTimer(UI_IDLE_MS);
+		ui_last_state = menustate;
+	}
+	return due;
+}
 static uint32_t menu_key_get(void)
 {
 	static uint32_t prev_key = 0;
@@ -674,7 +709,7 @@ static void printSysInfo()
 	{
 		sysinfo_timer = GetTimer(2000);
 		struct battery_data_t bat;
-		int hasbat = getBattery(0, &bat);
+		int hasbat = sensors_battery(&bat);
 		int n = 2;
 		static int flip = 0;
 
@@ -740,7 +775,8 @@ static void printSysInfo()
 		}
 		else
 		{
-			infowrite(n++, "");
+			video_timing_description(str, 40);
+			infowrite(n++, str);
 			video_core_description(str, 40);
 			infowrite(n++, str);
 			video_scaler_description(str, 40);
@@ -964,11 +1000,18 @@ void HandleUI(void)
 				// Some BT dongles get stuck after boot.
 				// Kicking of USB port usually make it work.
 				printf("*** reset bt ***\n");
-				system("/bin/bluetoothd hcireset &");
+				proc_detach(proc_shell("/bin/bluetoothd hcireset"));
 			}
 		}
 	}
 
+	// ROM catalog follows the file changes in the station folders
+	if (rom_catalog_watch_poll())
+	{
+		if (menustate == MENU_ROMS_MAIN2) menustate = MENU_ROMS_MAIN1;
+		if (menustate == MENU_ROMS_BROWSE2) menustate = MENU_ROMS_BROWSE1;
+	}
+
 	switch (user_io_core_type())
 	{
 	case CORE_TYPE_8BIT:
@@ -1051,7 +1094,11 @@ void HandleUI(void)
 			mgl->state = 0;
 			mgl->current++;
 			if (mgl->current < mgl->count) mgl->timer = GetTimer(mgl->item[mgl->current].delay * 1000);
-			else mgl->done = 1;
+			else
+			{
+				mgl->done = 1;
+				load_end();
+			}
 			break;
 
 		case 4:
@@ -1075,6 +1122,9 @@ void HandleUI(void)
 	{
 		// get user control codes
 		c = menu_key_get();
+
+		// next title of a load_batch run
+		load_batch_poll();
 	}
 
 	int release = 0;
@@ -1423,6 +1473,12 @@ void HandleUI(void)
 		}
 		else if (menu || (is_menu() && !video_fb_state()) || (menustate == MENU_NONE2 && !mgl->done && mgl->state == 1))
 		{
+			// user may reset or power off from here
+			ide_cache_flush();
+			n64_save_flush();
+			save_cache_flush();
+			cfg_store_flush();
+
 			OsdSetSize(16);
 			menusub = 0;
 			if(!is_menu() && (get_key_mod() & (LALT | RALT))) //Alt+Menu
@@ -3128,18 +3184,9 @@ void HandleUI(void)
 			printf("CMD [%s]\n",cmd);
 			unlink("/tmp/script");
 			FileSave("/tmp/script", cmd, strlen(cmd));
-			ttypid = fork();
+			const char *argv[] = { "/sbin/agetty", "-a", "root", "-l", "/tmp/script", "--nohostname", "-L", "tty2", "linux", NULL };
+			ttypid = proc_start(argv, PROC_SETSID | PROC_CPU0);
 			ttystatus = 0;
-			if (!ttypid)
-			{
-				cpu_set_t set;
-				CPU_ZERO(&set);
-				CPU_SET(0, &set);
-				sched_setaffinity(0, sizeof(set), &set);
-				setsid();
-				execl("/sbin/agetty", "/sbin/agetty",  "-a", "root", "-l", "/tmp/script", "--nohostname", "-L", "tty2", "linux", NULL);
-				exit(1); //should never be reached
-			}
 		} else {
 			menustate = MENU_DOC_NO_FBTERM;
 		}
@@ -3149,7 +3196,7 @@ void HandleUI(void)
 	case MENU_DOC_FILE_SELECTED_2:
 		if (ttypid)
 		{
-			if (waitpid(ttypid, &ttystatus, WNOHANG) > 0)
+			if (proc_wait(ttypid, &ttystatus))
 			{
 				ttypid = 0;
 				user_io_osd_key_enable(1);
@@ -3560,7 +3607,7 @@ void HandleUI(void)
 		{
 			printf("MENU_SFONT_FILE_SELECTED --> '%s'\n", selPath);
 			snprintf(Selected_tmp, sizeof(Selected_tmp), "/sbin/mlinkutil FSSFONT /media/fat/\"%s\"", selPath);
-			system(Selected_tmp);
+			proc_detach(proc_shell(Selected_tmp));
 			AdjustDirectory(selPath);
 			// MENU_FILE_SELECT1 to file select OSD
 			menustate = MENU_UART1; //MENU_FILE_SELECT1;
@@ -3624,7 +3671,7 @@ void HandleUI(void)
 						if (GetUARTMode() >= 3)
 						{
 							sprintf(s, "/sbin/mlinkutil BAUD %d", GetUARTbaud(GetUARTMode()));
-							system(s);
+							proc_detach(proc_shell(s));
 						}
 						else
 						{
@@ -5092,6 +5139,10 @@ void HandleUI(void)
 				OsdWrite(m++, s);
 				sprintf(s, "   %d ROMs in catalog", rom_get_count());
 				OsdWrite(m++, s);
+				if (g_rom_catalog.scanning) {
+					sprintf(s, "   Scanning... %d%%", rom_scan_progress());
+					OsdWrite(m++, s);
+				}
 				OsdWrite(m++);
 
 				menumask = 0x1F;
@@ -5114,6 +5165,15 @@ void HandleUI(void)
 			break;
 		}
 
+		// Background scan: merge results and refresh counts when done
+		if (g_rom_catalog.scanning) {
+			if (rom_scan_poll() || CheckTimer(rom_scan_timer)) {
+				rom_scan_timer = GetTimer(500);
+				menustate = MENU_ROMS_MAIN1;
+				break;
+			}
+		}
+
 		if (select) {
 			int num_stations = rom_station_count();
 
@@ -5143,7 +5203,7 @@ void HandleUI(void)
 					menusub = 0;
 					break;
 				case 3:  // Rescan
-					menustate = MENU_ROMS_SCANNING;
+					menustate = MENU_ROMS_SCANNING1;
 					break;
 				case 4:  // Exit
 					menustate = MENU_NONE1;
@@ -5252,7 +5312,7 @@ void HandleUI(void)
 				} else if (menusub == visible_items) {
 					// Done - start scanning
 					if (rom_station_count() > 0) {
-						menustate = MENU_ROMS_SCANNING;
+						menustate = MENU_ROMS_SCANNING1;
 					} else {
 						InfoMessage("Add at least one station first", 2000);
 						menustate = MENU_ROMS_SETUP1;
@@ -5333,26 +5393,49 @@ void HandleUI(void)
 		}
 		break;
 
-	case MENU_ROMS_SCANNING:
+	case MENU_ROMS_SCANNING1:
 		{
 			OsdSetSize(16);
+			helptext_idx = 0;
+			parentstate = menustate;
 			OsdSetTitle("Scanning ROMs", 0);
 
 			for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i);
 			OsdWrite(6, "      Scanning ROMs...");
 			OsdWrite(8, "      Please wait...");
-			OsdUpdate();
+			OsdWrite(OsdGetSize() - 1, "     Back: scan in background");
 
-			// Perform the scan
-			int total = rom_scan_all();
-
-			sprintf(s, "    Found %d ROMs", total);
-			OsdWrite(8, s);
-			OsdUpdate();
-			usleep(1500000);  // Show result for 1.5 seconds
+			// Stations are scanned by worker threads, results are merged in rom_scan_poll()
+			rom_scan_start();
+			rom_scan_timer = 0;
+			menustate = MENU_ROMS_SCANNING2;
+		}
+		break;
 
+	case MENU_ROMS_SCANNING2:
+		if (menu || back) {
 			menustate = MENU_ROMS_MAIN1;
 			menusub = 0;
+			break;
+		}
+
+		if (rom_scan_timer) {
+			// Show result for 1.5 seconds
+			if (CheckTimer(rom_scan_timer)) {
+				rom_scan_timer = 0;
+				menustate = MENU_ROMS_MAIN1;
+				menusub = 0;
+			}
+			break;
+		}
+
+		if (rom_scan_poll()) {
+			sprintf(s, "    Found %d ROMs", rom_get_count());
+			OsdWrite(8, s);
+			rom_scan_timer = GetTimer(1500);
+		} else {
+			sprintf(s, "    %s", rom_scan_status());
+			OsdWrite(8, s);
 		}
 		break;
 
@@ -5464,14 +5547,11 @@ void HandleUI(void)
 				rom_entry_t *rom = rom_get_selected();
 				rom_station_t *station = rom ? rom_station_get(rom->station_id) : NULL;
 
-				if (station && station->core_path[0]) {
+				if (station && core_path[0]) {
 					// We need to load the core first, then the ROM
 					// Store the ROM path for after core loads
 					strcpy(Selected_F[0], rom_path);
-
-					// Build the core path
-					char core_file[512];
-					snprintf(core_file, sizeof(core_file), "_%s", station->core_path);
+					printf("ROM catalog: %s -> %s\n", station->core_path, core_path);
 
 					// Load the core
 					OsdSetTitle("Loading...", 0);
@@ -5490,6 +5570,9 @@ void HandleUI(void)
 					// integrate with the core loading system more deeply
 					InfoMessage("Launch feature requires core integration", 2000);
 					menustate = MENU_ROMS_BROWSE1;
+				} else if (station && station->core_path[0]) {
+					InfoMessage("No core found for this station", 2000);
+					menustate = MENU_ROMS_BROWSE1;
 				} else {
 					InfoMessage("No core configured for this station", 2000);
 					menustate = MENU_ROMS_BROWSE1;
@@ -5508,6 +5591,14 @@ void HandleUI(void)
 		OsdSetTitle((fs_Options & SCANO_CORES) ? "Cores" : "Select", 0);
 		PrintDirectory(hold_cnt<2);
 		menustate = MENU_FILE_SELECT2;
+		if ((fs_Options & SCANO_CORES) && flist_nDirEntries() && flist_SelectedItem()->de.d_type != DT_DIR && !isXmlName(flist_SelectedItem()->de.d_name))
+		{
+			// the highlighted core starts loading into the page cache already
+			static char rbf[1024];
+			if (strlen(selPath)) snprintf(rbf, sizeof(rbf), "%s/%s", selPath, flist_SelectedItem()->de.d_name);
+			else snprintf(rbf, sizeof(rbf), "%s", flist_SelectedItem()->de.d_name);
+			fpga_rbf_prefetch(rbf);
+		}
 		if (cfg.log_file_entry && flist_nDirEntries())
 		{
 			//Write out paths infos for external integration
@@ -5520,6 +5611,9 @@ void HandleUI(void)
 	case MENU_FILE_SELECT2:
 		menumask = 0;
 
+		// background scan of a big folder finished, show the complete list
+		if (flist_scan_update()) menustate = MENU_FILE_SELECT1;
+
 		if (c == KEY_BACKSPACE && (fs_Options & (SCANO_UMOUNT | SCANO_CLEAR)) && !strlen(filter))
 		{
 			for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i, "", 0, 0);
@@ -6085,8 +6179,7 @@ void HandleUI(void)
 				ioctl_index = 0;
 				if (df[menusub].status & DSK_INSERTED) // eject selected floppy
 				{
-					df[menusub].status = 0;
-					FileClose(&df[menusub].file);
+					EjectFloppy(&df[menusub]);
 					menustate = MENU_MINIMIG_MAIN1;
 				}
 				else
@@ -7182,12 +7275,8 @@ void HandleUI(void)
 			unlink("/tmp/script");
 			FileSave("/tmp/script", cmd, strlen(cmd));
 			ttystatus = 0;
-			ttypid = fork();
-			if (!ttypid)
-			{
-				execl("/sbin/agetty", "/sbin/agetty", "-a", "root", "-l", "/tmp/script", "--nohostname", "-L", "tty2", "linux", NULL);
-				exit(0); //should never be reached
-			}
+			const char *argv[] = { "/sbin/agetty", "-a", "root", "-l", "/tmp/script", "--nohostname", "-L", "tty2", "linux", NULL };
+			ttypid = proc_start(argv, 0);
 		}
 		else
 		{
@@ -7198,7 +7287,7 @@ void HandleUI(void)
 	case MENU_SCRIPTS_FB2:
 		if (ttypid)
 		{
-			if (waitpid(ttypid, 0, WNOHANG) > 0)
+			if (proc_wait(ttypid))
 			{
 				ttypid = 0;
 				user_io_osd_key_enable(1);
@@ -7255,50 +7344,42 @@ void HandleUI(void)
 		for (int i = 0; i < script_lines; i++) strcpy(script_output[i], "");
 		script_line=0;
 		script_finished = false;
-		cpu_set_t set;
-		CPU_ZERO(&set);
-		CPU_SET(0, &set);
-		CPU_SET(1, &set);
-		sched_setaffinity(0, sizeof(set), &set);
 		if (parentstate == MENU_BTPAIR)
 		{
-			OsdUpdate();
-			if(cfg.bt_reset_before_pair) system("hciconfig hci0 reset");
-			script_pipe = popen("/usr/sbin/btpair", "r");
+			// renew/reset go first in the same shell, nothing here waits for them
+			snprintf(script_command, sizeof(script_command), "%s%sexec /usr/sbin/btpair",
+				bt_renew ? "/bin/bluetoothd renew; " : "", cfg.bt_reset_before_pair ? "hciconfig hci0 reset; " : "");
+			bt_renew = 0;
+			script_pid = proc_shell(script_command, PROC_OUTPUT);
 		}
 		else
 		{
-			script_pipe = popen(getFullPath(selPath), "r");
+			script_pid = proc_shell(getFullPath(selPath), PROC_OUTPUT);
 		}
-		script_file = fileno(script_pipe);
-		fcntl(script_file, F_SETFL, O_NONBLOCK);
 		break;
 
 	case MENU_SCRIPTS1:
 		if (!script_finished)
 		{
-			if (!feof(script_pipe)) {
-				if (fgets(script_line_output, script_line_length, script_pipe) != NULL)
+			int ret, lines = 0;
+			while ((ret = proc_read_line(script_pid, script_line_output, script_line_length)) > 0)
+			{
+				if (script_line < OsdGetSize() - 2)
 				{
-					script_line_output[strcspn(script_line_output, "\n")] = 0;
-					if (script_line < OsdGetSize() - 2)
-					{
-						strcpy(script_output[script_line++], script_line_output);
-					}
-					else
-					{
-						strcpy(script_output[script_line], script_line_output);
-						for (int i = 0; i < script_line; i++) strcpy(script_output[i], script_output[i+1]);
-					};
-					for (int i = 0; i < OsdGetSize() - 2; i++) OsdWrite(i, script_output[i], 0, 0);
+					strcpy(script_output[script_line++], script_line_output);
+				}
+				else
+				{
+					strcpy(script_output[script_line], script_line_output);
+					for (int i = 0; i < script_line; i++) strcpy(script_output[i], script_output[i+1]);
 				};
+				lines++;
 			}
-			else {
-				pclose(script_pipe);
-				cpu_set_t set;
-				CPU_ZERO(&set);
-				CPU_SET(1, &set);
-				sched_setaffinity(0, sizeof(set), &set);
+			if (lines) for (int i = 0; i < OsdGetSize() - 2; i++) OsdWrite(i, script_output[i], 0, 0);
+
+			if (ret < 0) {
+				proc_detach(script_pid);
+				script_pid = 0;
 				script_finished=true;
 				OsdWrite(OsdGetSize() - 1, "             OK", menusub == 0, 0);
 			};
@@ -7310,12 +7391,9 @@ void HandleUI(void)
 			{
 				strcpy(script_command, "killall ");
 				strcat(script_command, (parentstate == MENU_BTPAIR) ? "-SIGINT btctl" : flist_SelectedItem()->de.d_name);
-				system(script_command);
-				pclose(script_pipe);
-				cpu_set_t set;
-				CPU_ZERO(&set);
-				CPU_SET(1, &set);
-				sched_setaffinity(0, sizeof(set), &set);
+				proc_detach(proc_shell(script_command));
+				proc_detach(script_pid);
+				script_pid = 0;
 				script_finished = true;
 			};
 
@@ -7324,7 +7402,7 @@ void HandleUI(void)
 				for (int i = 0; i < OsdGetSize() - 1; i++) OsdWrite(i);
 				OsdWrite(7, "   Delete all pairings...");
 				OsdUpdate();
-				system("/bin/bluetoothd renew");
+				bt_renew = 1;
 				menustate = MENU_BTPAIR;
 			}
 			else
@@ -6,6 +6,8 @@
 void SelectFile(const char* path, const char* pFileExt, int Options, unsigned char MenuSelect, unsigned char MenuCancel);
 
 void HandleUI(void);
+int  menu_ui_due();  // HandleUI has something to do
+void menu_wake();    // async work finished, run HandleUI soon
 void menu_key_set(unsigned int c);
 void menu_process_save();
 void PrintDirectory(int expand = 0);
@@ -1,64 +1,111 @@
 #include "offload.h"
 #include "profiling.h"
+#include "scheduler.h"
 #include <pthread.h>
+#include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <atomic>
 
 static constexpr uint32_t QUEUE_SIZE = 8;
+static constexpr uint32_t MAX_WORKERS = 4;
 
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
+struct OffloadJobState
+{
+	std::atomic<bool> done;
+};
+
+static pthread_t s_thread_handle[MAX_WORKERS];
+static uint32_t s_thread_count;
+static pthread_cond_t s_cond_work, s_cond_available, s_cond_done;
 static pthread_mutex_t s_queue_lock;
 
 struct Work
 {
 	std::function<void()> handler;
+	std::shared_ptr<OffloadJobState> state;
+};
+
+struct Queue
+{
+	Work work[QUEUE_SIZE];
+	uint32_t head, tail;
 };
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
+static Queue s_queue[OFFLOAD_PRIO_COUNT];
+static uint32_t s_pending;
 static bool s_quit;
 
+bool OffloadHandle::done() const
+{
+	return !state || state->done.load(std::memory_order_acquire);
+}
+
+void OffloadHandle::wait() const
+{
+	if (done()) return;
+
+	pthread_mutex_lock(&s_queue_lock);
+	while (!state->done.load(std::memory_order_acquire)) pthread_cond_wait(&s_cond_done, &s_queue_lock);
+	pthread_mutex_unlock(&s_queue_lock);
+}
+
+static const char *s_trace_names[OFFLOAD_PRIO_COUNT] = { "offload_io", "offload_decode", "offload_background" };
+
 static void *worker_thread(void *)
 {
+	trace_thread_name("offload");
+
 	while (true)
 	{
-		Work *current_work = nullptr;
+		Work current_work;
+		int current_prio = 0;
+
 		// Wait for work
 		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
+		while (!s_pending && !s_quit)
 		{
-			// queue empty and quit flag set, exit
-			if (s_quit)
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
-
-			// wait for work signal
 			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
+		}
+
+		// queue empty and quit flag set, exit
+		if (!s_pending)
+		{
+			pthread_mutex_unlock(&s_queue_lock);
+			break;
+		}
+
+		// get work from the highest priority non-empty queue
+		for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+		{
+			Queue *q = &s_queue[prio];
+			if (q->head != q->tail)
 			{
-				pthread_mutex_unlock(&s_queue_lock);
+				Work *work = &q->work[q->tail % QUEUE_SIZE];
+				current_work.handler = std::move(work->handler);
+				current_work.state = std::move(work->state);
+				current_prio = prio;
+				work->handler = nullptr;
+				q->tail++;
+				s_pending--;
 				break;
 			}
 		}
 
-		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
+		pthread_cond_broadcast(&s_cond_available);
 		pthread_mutex_unlock(&s_queue_lock);
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
+		{
+			TRACE_SCOPE(s_trace_names[current_prio]);
+			current_work.handler();
+		}
 
-		// lock and move tail forward
+		// signal completion
 		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
+		current_work.state->done.store(true, std::memory_order_release);
+		pthread_cond_broadcast(&s_cond_done);
 		pthread_mutex_unlock(&s_queue_lock);
 	}
 	return (void *)0;
@@ -68,22 +115,40 @@ void offload_start()
 {
 	pthread_cond_init(&s_cond_available, nullptr);
 	pthread_cond_init(&s_cond_work, nullptr);
+	pthread_cond_init(&s_cond_done, nullptr);
 	pthread_mutex_init(&s_queue_lock, nullptr);
 
-	s_queue_head = s_queue_tail = 0;
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++) s_queue[prio].head = s_queue[prio].tail = 0;
+	s_pending = 0;
 	s_quit = false;
 
 	pthread_attr_t attr;
 
 	pthread_attr_init(&attr);
 
-	// Set affinity to core #0 since main runs on core #1
+	// Keep workers off core #1 since main runs there
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+
 	cpu_set_t set;
 	CPU_ZERO(&set);
-	CPU_SET(0, &set);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	// One worker per available core, but at least two so a blocking I/O job doesn't stall decoding.
+	uint32_t workers = CPU_COUNT(&set);
+	if (workers < 2) workers = 2;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+	s_thread_count = 0;
+	for (uint32_t i = 0; i < workers; i++)
+	{
+		if (pthread_create(&s_thread_handle[s_thread_count], &attr, worker_thread, nullptr)) break;
+		s_thread_count++;
+	}
+
+	pthread_attr_destroy(&attr);
 }
 
 void offload_stop()
@@ -91,32 +156,74 @@ void offload_stop()
 	pthread_mutex_lock(&s_queue_lock);
 
 	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
+	pthread_cond_broadcast(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (uint32_t i = 0; i < s_thread_count; i++) pthread_join(s_thread_handle[i], nullptr);
+	s_thread_count = 0;
 	printf("Done\n");
 }
 
-void offload_add_work(std::function<void()> handler)
+static OffloadHandle offload_enqueue(std::function<void()> &handler, int prio, bool wait)
 {
-	PROFILE_FUNCTION();
+	OffloadHandle handle;
+
+	if (prio < 0) prio = 0;
+	if (prio >= OFFLOAD_PRIO_COUNT) prio = OFFLOAD_PRIO_COUNT - 1;
 
 	pthread_mutex_lock(&s_queue_lock);
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	Queue *q = &s_queue[prio];
+	while ((q->head - q->tail) == QUEUE_SIZE)
 	{
+		if (!wait)
+		{
+			pthread_mutex_unlock(&s_queue_lock);
+			return handle;
+		}
+
 		pthread_cond_wait(&s_cond_available, &s_queue_lock);
 	}
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
-	work->handler = handler;
+	handle.state = std::make_shared<OffloadJobState>();
+	handle.state->done = false;
+
+	Work *work = &q->work[q->head % QUEUE_SIZE];
+	work->handler = std::move(handler);
+	work->state = handle.state;
 
-	s_queue_head++;
+	q->head++;
+	s_pending++;
 
 	pthread_cond_signal(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+
+	return handle;
+}
+
+OffloadHandle offload_submit(std::function<void()> handler, int prio)
+{
+	PROFILE_FUNCTION();
+
+	return offload_enqueue(handler, prio, true);
+}
+
+OffloadHandle offload_try_submit(std::function<void()> handler, int prio)
+{
+	PROFILE_FUNCTION();
+
+	return offload_enqueue(handler, prio, false);
+}
+
+void offload_yield_until(const OffloadHandle &handle)
+{
+	while (!handle.done()) scheduler_yield();
+}
+
+void offload_add_work(std::function<void()> handler)
+{
+	offload_submit(handler);
+}
@@ -3,10 +3,42 @@
 
 #include <stddef.h>
 #include <functional>
+#include <memory>
+
+// Priority classes, lower value is picked first.
+enum OffloadPriority
+{
+	OFFLOAD_PRIO_IO = 0,
+	OFFLOAD_PRIO_DECODE,
+	OFFLOAD_PRIO_BACKGROUND,
+	OFFLOAD_PRIO_COUNT
+};
+
+struct OffloadJobState;
+
+// Completion handle for submitted work.
+// done() never blocks so it can be polled from the coroutines.
+struct OffloadHandle
+{
+	std::shared_ptr<OffloadJobState> state;
+
+	bool valid() const { return (bool)state; }
+	bool done() const;
+	void wait() const;
+};
 
 void offload_start();
 void offload_stop();
 
+// blocks while the queue of the given priority is full.
+OffloadHandle offload_submit(std::function<void()> work, int prio = OFFLOAD_PRIO_IO);
+
+// returns invalid handle if the queue of the given priority is full.
+OffloadHandle offload_try_submit(std::function<void()> work, int prio = OFFLOAD_PRIO_IO);
+
+// yield to scheduler until the work is done (coroutine context only).
+void offload_yield_until(const OffloadHandle &handle);
+
 void offload_add_work(std::function<void()> work);
 
-#endif
\ No newline at end of file
+#endif
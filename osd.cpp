@@ -46,6 +46,7 @@ as rotated copies of the first 128 entries.  -- AMR
 #include "user_io.h"
 #include "hardware.h"
 #include "profiling.h"
+#include "scheduler.h"
 
 #include "support.h"
 
@@ -56,8 +57,11 @@ as rotated copies of the first 128 entries.  -- AMR
 
 static int osd_size = 8;
 
+static uint32_t osdsent_valid = 0;
+
 void OsdSetSize(int n)
 {
+	if (n != osd_size) osdsent_valid = 0;
 	osd_size = n;
 }
 
@@ -77,6 +81,10 @@ static uint8_t osdbuf[256 * 32];
 static int  osdbufpos = 0;
 static int  osdset = 0;
 
+// What the core has in its line buffers, so lines redrawn the same (stars
+// redraw everything each tick, menus each refresh) don't go over SPI again.
+static uint8_t osdsent[256 * 32];
+
 char framebuffer[16][256];
 static void framebuffer_clear()
 {
@@ -279,14 +287,9 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 
 		if (i == 0 && (n < osd_size))
 		{	// Render sidestripe
-			unsigned char tmp[8];
-
 			if (leftchar)
 			{
-				unsigned char tmp2[8];
-				memcpy(tmp2, charfont[(uint)leftchar], 8);
-				rotatechar(tmp2, tmp);
-				p = tmp;
+				p = charfont_rotated((unsigned char)leftchar);
 			}
 			else
 			{
@@ -525,6 +528,7 @@ void OsdRotation(uint8_t rotate)
 	spi_w(0);
 	spi_w(rotate);
 	DisableOsd();
+	osdsent_valid = 0;
 }
 
 // disable displaying of OSD
@@ -662,19 +666,23 @@ char* OsdCoreNameGet()
 
 void OsdUpdate()
 {
-	PROFILE_FUNCTION();
+	PERF_FUNCTION();
 	int n = is_menu() ? 19 : osd_size;
 	for (int i = 0; i < n; i++)
 	{
 		if (osdset & (1 << i))
 		{
+			uint8_t *line = osdbuf + i * 256;
+			if ((osdsent_valid & (1 << i)) && !memcmp(line, osdsent + i * 256, 256)) continue;
+
 			spi_osd_cmd_cont(OSD_CMD_WRITE | i);
-			spi_write(osdbuf + i * 256, 256, 0);
+			spi_write(line, 256, 0);
 			DisableOsd();
-			if (is_megacd()) mcd_poll();
-			if (is_pce()) pcecd_poll();
-			if (is_saturn()) saturn_poll();
-			if (is_neogeo_cd()) neocd_poll();
+			memcpy(osdsent + i * 256, line, 256);
+			osdsent_valid |= 1 << i;
+
+			// lets the CD servicing in when it's due
+			scheduler_checkpoint();
 		}
 	}
 
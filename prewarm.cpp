@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "prewarm.h"
+#include "scheduler.h"
+#include "hardware.h"
+#include "user_io.h"
+#include "file_io.h"
+#include "menu.h"
+#include "osd.h"
+#include "recent.h"
+#include "cheats.h"
+#include "rom_catalog.h"
+#include "rom_preview.h"
+#include "support/arcade/mra_loader.h"
+
+static int pending = 0;
+static unsigned long start_timer = 0;
+
+void prewarm_core()
+{
+	if (is_menu() || is_arcade() || is_neogeo()) return;
+
+	pending = 1;
+	start_timer = GetTimer(PREWARM_DELAY);
+}
+
+// Extensions and scan options of the first file entry of the OSD as
+// SelectFile gets them, and the index of its recent list.
+static int prewarm_file_entry(char *ext, int *options, int *idx)
+{
+	for (int i = 2;; i++)
+	{
+		char *p = user_io_get_confstr(i);
+		if (!p) return 0;
+		if (!strncmp(p, "DEFMRA,", 7)) continue;
+
+		while ((p[0] == 'H' || p[0] == 'D' || p[0] == 'h' || p[0] == 'd') && strlen(p) > 2) p += 2;
+		if (p[0] == 'P' && p[1] >= '0' && p[1] <= '9' && p[2] != ',') p += 2;
+		if (p[0] != 'F') continue;
+
+		int n = 1, store_name = 0;
+		if (p[n] == 'S') n++;
+		if (p[n] == 'C')
+		{
+			store_name = 1;
+			n++;
+		}
+		*idx = (p[n] >= '0' && p[n] <= '9') ? p[n] - '0' : 1;
+
+		substrcpy(ext, p, 1);
+		while (strlen(ext) % 3) strcat(ext, " ");
+		*options = SCANO_DIR | (store_name ? SCANO_CLEAR : 0);
+		return 1;
+	}
+}
+
+// Station of the core: same short name or core file
+static rom_station_t *prewarm_station()
+{
+	const char *core = user_io_get_core_name();
+	int len = strlen(core);
+
+	for (int i = 0; i < rom_station_count(); i++)
+	{
+		rom_station_t *st = rom_station_get_by_index(i);
+		if (!st) break;
+
+		const char *rbf = strrchr(st->core_path, '/');
+		rbf = rbf ? rbf + 1 : st->core_path;
+		if (!strcasecmp(st->short_name, core) || (!strncasecmp(rbf, core, len) && (rbf[len] == '_' || rbf[len] == '.'))) return st;
+	}
+
+	return NULL;
+}
+
+static void prewarm_previews()
+{
+	if (!menu_roms_configured()) return;
+
+	rom_station_t *st = prewarm_station();
+	if (!st) return;
+
+	rom_entry_t *rom;
+	int left = OsdGetSize();
+	for (int i = 0; left && (rom = rom_get_by_index(i)); i++)
+	{
+		if (rom->station_id == st->id)
+		{
+			if (rom_preview_prefetch(rom) < 0) break;
+			left--;
+		}
+
+		if (!(i & 1023)) scheduler_checkpoint();
+	}
+}
+
+void prewarm_task(void)
+{
+	for (;;)
+	{
+		if (!pending || !CheckTimer(start_timer) || !mgl_get()->done || flist_scanning())
+		{
+			scheduler_yield();
+			continue;
+		}
+		pending = 0;
+
+		char ext[256], dir[1024];
+		int options, idx;
+		if (prewarm_file_entry(ext, &options, &idx))
+		{
+			// the folder SelectFile opens at first and the one files were loaded from last
+			flist_prewarm(user_io_get_core_path(NULL, 0), ext, options);
+			if (recent_last_dir(idx, dir, sizeof(dir))) flist_prewarm(dir, ext, options);
+		}
+		scheduler_checkpoint();
+
+		cheats_prewarm();
+		scheduler_checkpoint();
+
+		prewarm_previews();
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+// What the OSD of a console core shows first is read while the core starts:
+// the listing of its game folder and of the folder last loaded from (into
+// the ScanDirectory cache), the CRC index of cheats/<core> and the
+// thumbnails of its first ROM catalog entries. Runs in a background
+// scheduler task once the start-up loads are done, thumbnails are decoded
+// by the offload workers at background priority.
+
+#define PREWARM_DELAY 3000 // ms after the core start
+
+// called at the end of user_io_init
+void prewarm_core();
+
+// scheduler task
+void prewarm_task(void);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "proc_run.h"
+
+extern char **environ;
+
+struct proc_slot_t
+{
+	pid_t pid;      // 0: free
+	int fd;         // output pipe, -1 once closed
+	int exited;
+	int status;
+	int detached;
+	int len;
+	char buf[PROC_BUF];
+};
+
+static proc_slot_t slots[PROC_MAX];
+
+static proc_slot_t *slot_get(pid_t pid)
+{
+	if (pid <= 0) return NULL;
+	for (int i = 0; i < PROC_MAX; i++) if (slots[i].pid == pid) return &slots[i];
+	return NULL;
+}
+
+static void slot_close(proc_slot_t *s)
+{
+	if (s->fd >= 0) close(s->fd);
+	s->fd = -1;
+}
+
+static void slot_fill(proc_slot_t *s)
+{
+	while (s->fd >= 0 && s->len < PROC_BUF)
+	{
+		int ret = read(s->fd, s->buf + s->len, PROC_BUF - s->len);
+		if (ret > 0) s->len += ret;
+		else if (!ret || (errno != EAGAIN && errno != EINTR)) slot_close(s);
+		else if (errno == EAGAIN) break;
+	}
+}
+
+static void slot_reap(proc_slot_t *s)
+{
+	if (!s->exited && waitpid(s->pid, &s->status, WNOHANG) == s->pid) s->exited = 1;
+	if (s->exited && s->detached)
+	{
+		slot_close(s);
+		s->pid = 0;
+	}
+}
+
+pid_t proc_start(const char *const argv[], int flags)
+{
+	proc_slot_t *s = NULL;
+	for (int i = 0; i < PROC_MAX && !s; i++) if (!slots[i].pid) s = &slots[i];
+	if (!s)
+	{
+		printf("proc: too many processes, %s not started\n", argv[0]);
+		return 0;
+	}
+
+	int pfd[2] = { -1, -1 };
+	if ((flags & PROC_OUTPUT) && pipe2(pfd, O_CLOEXEC))
+	{
+		printf("proc: pipe failed for %s\n", argv[0]);
+		return 0;
+	}
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	if (pfd[1] >= 0)
+	{
+		posix_spawn_file_actions_adddup2(&fa, pfd[1], 1);
+		posix_spawn_file_actions_adddup2(&fa, pfd[1], 2);
+	}
+
+	// Signals the main process blocks or ignores aren't passed on
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGPIPE);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	short sflags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_SETSID
+	if (flags & PROC_SETSID) sflags |= POSIX_SPAWN_SETSID;
+#endif
+	posix_spawnattr_setflags(&attr, sflags);
+
+	// The child inherits the affinity, main itself stays on core #1
+	cpu_set_t old, set;
+	sched_getaffinity(0, sizeof(old), &old);
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	if (!(flags & PROC_CPU0)) CPU_SET(1, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	pid_t pid = 0;
+	int ret = posix_spawn(&pid, argv[0], &fa, &attr, (char *const *)argv, environ);
+
+	sched_setaffinity(0, sizeof(old), &old);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (pfd[1] >= 0) close(pfd[1]);
+
+	if (ret)
+	{
+		printf("proc: cannot start %s (%s)\n", argv[0], strerror(ret));
+		if (pfd[0] >= 0) close(pfd[0]);
+		return 0;
+	}
+
+	if (pfd[0] >= 0) fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+
+	s->pid = pid;
+	s->fd = pfd[0];
+	s->exited = 0;
+	s->status = 0;
+	s->detached = 0;
+	s->len = 0;
+	return pid;
+}
+
+pid_t proc_shell(const char *cmd, int flags)
+{
+	const char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+	return proc_start(argv, flags);
+}
+
+int proc_read_line(pid_t pid, char *line, int len)
+{
+	proc_slot_t *s = slot_get(pid);
+	if (!s) return -1;
+
+	slot_fill(s);
+	if (!s->len) return (s->fd < 0) ? -1 : 0;
+
+	char *nl = (char *)memchr(s->buf, '\n', s->len);
+
+	// A line without the newline only at the end or when it fills the buffer
+	if (!nl && s->fd >= 0 && s->len < PROC_BUF) return 0;
+
+	int n = nl ? (nl - s->buf) : s->len;
+	int copy = (n < len - 1) ? n : len - 1;
+	memcpy(line, s->buf, copy);
+	line[copy] = 0;
+
+	if (nl) n++;
+	s->len -= n;
+	memmove(s->buf, s->buf + n, s->len);
+	return 1;
+}
+
+int proc_wait(pid_t pid, int *status)
+{
+	proc_slot_t *s = slot_get(pid);
+	if (!s) return 1;
+
+	slot_reap(s);
+	if (!s->exited) return 0;
+
+	if (status) *status = s->status;
+	slot_close(s);
+	s->pid = 0;
+	return 1;
+}
+
+void proc_detach(pid_t pid)
+{
+	proc_slot_t *s = slot_get(pid);
+	if (!s) return;
+
+	slot_close(s);
+	s->detached = 1;
+	slot_reap(s);
+}
+
+int proc_poll_fds(struct pollfd *fds, int max)
+{
+	int n = 0;
+	for (int i = 0; i < PROC_MAX && n < max; i++)
+	{
+		// a full buffer waits for the UI, the child blocks on the pipe meanwhile
+		if (!slots[i].pid || slots[i].fd < 0 || slots[i].len >= PROC_BUF) continue;
+		fds[n].fd = slots[i].fd;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+
+	return n;
+}
+
+void proc_service()
+{
+	for (int i = 0; i < PROC_MAX; i++)
+	{
+		if (!slots[i].pid) continue;
+		slot_fill(&slots[i]);
+		slot_reap(&slots[i]);
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef PROC_RUN_H
+#define PROC_RUN_H
+
+#include <sys/types.h>
+#include <poll.h>
+
+// Child processes (user scripts, Bluetooth tools, agetty on the terminal).
+// Processes are started with posix_spawn and never waited for: their output
+// goes into a non-blocking pipe which the input poll() watches along with the
+// devices, and exited children are reaped there too. The UI takes output
+// lines and exit status when it gets to them, so neither the poll loop nor
+// HandleUI blocks on a child.
+
+#define PROC_MAX 8
+#define PROC_BUF 4096 // output kept per process until the UI reads it
+
+#define PROC_OUTPUT 1 // stdout and stderr are read
+#define PROC_SETSID 2 // own session, for agetty
+#define PROC_CPU0   4 // core #0 only, otherwise cores #0 and #1
+
+// argv[0] is the full path. Returns the pid, 0 if it couldn't be started.
+pid_t proc_start(const char *const argv[], int flags);
+
+// cmd run by /bin/sh -c.
+pid_t proc_shell(const char *cmd, int flags = 0);
+
+// Next line of output without the newline, truncated to len.
+// Returns 1 for a line, 0 if there's none yet, -1 at the end of the output.
+int proc_read_line(pid_t pid, char *line, int len);
+
+// Returns 1 (and the waitpid status) once the process has exited, 0 while it runs.
+// The process is forgotten after 1 is returned.
+int proc_wait(pid_t pid, int *status = 0);
+
+// Output and status aren't wanted anymore, the process is reaped in the background.
+void proc_detach(pid_t pid);
+
+// Output pipes to add to poll(), returns the count.
+int proc_poll_fds(struct pollfd *fds, int max);
+
+// Reads what the pipes have and reaps exited processes, after the poll().
+void proc_service();
+
+#endif
@@ -1,12 +1,154 @@
-#ifdef PROFILING
-
 #include "profiling.h"
 
-#include "str_util.h"
-
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+
+static constexpr uint32_t TRACE_RING_SIZE = 16384; // per thread, must be pow2
+static constexpr int TRACE_MAX_THREADS = 8;
+
+struct TraceEvent
+{
+	const char *name;
+	uint64_t ts_us;
+	uint32_t dur_us; // value of a counter
+	bool counter;
+};
+
+struct TraceRing
+{
+	int tid;
+	const char *name;
+	std::atomic<uint32_t> head;
+	TraceEvent events[TRACE_RING_SIZE];
+};
+
+static TraceRing *s_trace_rings[TRACE_MAX_THREADS];
+static std::atomic<int> s_trace_ring_count(0);
+static thread_local TraceRing *s_trace_ring = nullptr;
+static thread_local bool s_trace_no_ring = false;
+
+uint64_t trace_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static TraceRing *trace_get_ring()
+{
+	if (s_trace_ring || s_trace_no_ring) return s_trace_ring;
+
+	int idx = s_trace_ring_count.fetch_add(1);
+	if (idx >= TRACE_MAX_THREADS)
+	{
+		s_trace_no_ring = true;
+		return nullptr;
+	}
+
+	TraceRing *ring = new TraceRing;
+	ring->tid = (int)syscall(SYS_gettid);
+	ring->name = nullptr;
+	ring->head = 0;
+
+	s_trace_rings[idx] = ring;
+	s_trace_ring = ring;
+	return ring;
+}
+
+void trace_event(const char *name, uint64_t begin_us)
+{
+	TraceRing *ring = trace_get_ring();
+	if (!ring) return;
+
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	TraceEvent *ev = &ring->events[head % TRACE_RING_SIZE];
+	ev->name = name;
+	ev->ts_us = begin_us;
+	ev->dur_us = (uint32_t)(trace_now_us() - begin_us);
+	ev->counter = false;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void trace_counter(const char *name, uint32_t value)
+{
+	TraceRing *ring = trace_get_ring();
+	if (!ring) return;
+
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	TraceEvent *ev = &ring->events[head % TRACE_RING_SIZE];
+	ev->name = name;
+	ev->ts_us = trace_now_us();
+	ev->dur_us = value;
+	ev->counter = true;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char *name)
+{
+	TraceRing *ring = trace_get_ring();
+	if (ring) ring->name = name;
+}
+
+// Snapshot while the threads keep running, an event being overwritten
+// during the dump may come out mixed, which is fine for a trace.
+int trace_dump(const char *path)
+{
+	if (!path || !*path) path = "/tmp/mister_trace.json";
+
+	FILE *f = fopen(path, "w");
+	if (!f)
+	{
+		printf("trace_dump: cannot create %s\n", path);
+		return 0;
+	}
+
+	int pid = getpid();
+	int count = 0;
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	int rings = s_trace_ring_count.load();
+	if (rings > TRACE_MAX_THREADS) rings = TRACE_MAX_THREADS;
+	for (int i = 0; i < rings; i++)
+	{
+		TraceRing *ring = s_trace_rings[i];
+		if (!ring) continue;
+
+		if (ring->name)
+		{
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", count++ ? ",\n" : "", pid, ring->tid, ring->name);
+		}
+
+		uint32_t head = ring->head.load(std::memory_order_acquire);
+		uint32_t start = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+		for (uint32_t idx = start; idx != head; idx++)
+		{
+			TraceEvent *ev = &ring->events[idx % TRACE_RING_SIZE];
+			if (ev->counter)
+			{
+				fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%d,\"ts\":%llu,\"args\":{\"value\":%u}}", count++ ? ",\n" : "",
+					ev->name, pid, (unsigned long long)ev->ts_us, ev->dur_us);
+				continue;
+			}
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%u}", count++ ? ",\n" : "",
+				ev->name, pid, ring->tid, (unsigned long long)ev->ts_us, ev->dur_us);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("trace_dump: %d events written to %s\n", count, path);
+	return 1;
+}
+
+#ifdef PROFILING
+
+#include <linux/perf_event.h>
+#include "str_util.h"
 
 struct Event
 {
@@ -36,6 +178,9 @@ uint32_t profiling_event_begin(const char *name)
 	return r;
 }
 
+static uint64_t delta_ns(const struct timespec *a, const struct timespec *b);
+static void histogram_add(const char *name, uint64_t us);
+
 void profiling_event_end(uint32_t begin_idx, const char *name)
 {
 	Event *newEvent = get_event(s_event_tail);
@@ -43,6 +188,253 @@ void profiling_event_end(uint32_t begin_idx, const char *name)
 	newEvent->name = name;
 	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
 	s_event_tail++;
+
+	// begin event may be overwritten already
+	if (s_event_tail - begin_idx <= MAX_EVENTS) histogram_add(name, delta_ns(&newEvent->ts, &get_event(begin_idx)->ts) / 1000);
+}
+
+// Per-scope latency histograms.
+// Buckets are log2 with 4 linear steps each, so values are within 25%.
+static constexpr int HIST_SCOPES = 64; // must be pow2
+static constexpr int HIST_BUCKETS = 4 + 4 * 30;
+
+struct Histogram
+{
+	const char *name;
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t buckets[HIST_BUCKETS];
+	uint32_t perf_count;                  // PERF scope calls
+	uint64_t perf[PROFILING_COUNTERS];
+};
+
+static Histogram s_hist[HIST_SCOPES];
+
+static int hist_bucket(uint32_t us)
+{
+	if (us < 4) return us;
+	int log = 31 - __builtin_clz(us);
+	int idx = 4 + (log - 2) * 4 + ((us >> (log - 2)) & 3);
+	return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+static uint32_t hist_bucket_top(int idx)
+{
+	if (idx < 4) return idx;
+	int log = (idx - 4) / 4 + 2;
+	return ((4 + ((idx - 4) & 3) + 1) << (log - 2)) - 1;
+}
+
+// Scope names are string literals, the pointer identifies the scope
+static Histogram *hist_find(const char *name)
+{
+	uint32_t h = (uint32_t)(((uintptr_t)name >> 2) * 2654435761u);
+	for (int i = 0; i < HIST_SCOPES; i++)
+	{
+		Histogram *hist = &s_hist[(h + i) % HIST_SCOPES];
+		if (!hist->name) hist->name = name;
+		if (hist->name == name) return hist;
+	}
+	return nullptr;
+}
+
+static void histogram_add(const char *name, uint64_t us)
+{
+	Histogram *hist = hist_find(name);
+	if (!hist) return;
+
+	uint32_t v = (us > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)us;
+	hist->count++;
+	hist->total_us += v;
+	if (v > hist->max_us) hist->max_us = v;
+	hist->buckets[hist_bucket(v)]++;
+}
+
+// CPU counters of the thread as one perf_event group, so a sample is a single read().
+// Opened on the first PERF scope of the thread. Counters the kernel or the PMU
+// don't offer stay 0, without any the scopes only get timed.
+enum
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_CTX_SWITCHES
+};
+
+struct PerfGroup
+{
+	bool opened;
+	int leader;
+	int nr;
+	int slot[PROFILING_COUNTERS]; // position in the group read, -1 if not counted
+};
+
+static thread_local PerfGroup s_perf = {};
+
+static void perf_open()
+{
+	static const struct { uint32_t type; uint64_t config; } events[PROFILING_COUNTERS] =
+	{
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+
+	s_perf.opened = true;
+	s_perf.leader = -1;
+	s_perf.nr = 0;
+
+	for (int i = 0; i < PROFILING_COUNTERS; i++)
+	{
+		struct perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, s_perf.leader, PERF_FLAG_FD_CLOEXEC);
+		if (fd < 0)
+		{
+			s_perf.slot[i] = -1;
+			continue;
+		}
+
+		if (s_perf.leader < 0) s_perf.leader = fd;
+		s_perf.slot[i] = s_perf.nr++;
+	}
+
+	if (s_perf.nr < PROFILING_COUNTERS) printf("profiling: %d of %d CPU counters available.\n", s_perf.nr, PROFILING_COUNTERS);
+}
+
+void profiling_counters_read(uint64_t *values)
+{
+	if (!s_perf.opened) perf_open();
+
+	uint64_t buf[1 + PROFILING_COUNTERS];
+	int ok = s_perf.leader >= 0 && read(s_perf.leader, buf, sizeof(buf)) >= (ssize_t)((1 + s_perf.nr) * sizeof(uint64_t));
+	for (int i = 0; i < PROFILING_COUNTERS; i++) values[i] = (ok && s_perf.slot[i] >= 0) ? buf[1 + s_perf.slot[i]] : 0;
+}
+
+void profiling_counters_add(const char *name, const uint64_t *begin)
+{
+	uint64_t end[PROFILING_COUNTERS];
+	profiling_counters_read(end);
+
+	Histogram *hist = hist_find(name);
+	if (!hist) return;
+
+	hist->perf_count++;
+	for (int i = 0; i < PROFILING_COUNTERS; i++) hist->perf[i] += end[i] - begin[i];
+}
+
+static uint32_t hist_percentile(const Histogram *hist, uint32_t pct)
+{
+	uint64_t want = ((uint64_t)hist->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen >= want)
+		{
+			uint32_t top = hist_bucket_top(i);
+			return (top < hist->max_us) ? top : hist->max_us;
+		}
+	}
+	return hist->max_us;
+}
+
+static int hist_sorted(const Histogram **list)
+{
+	int n = 0;
+	for (int i = 0; i < HIST_SCOPES; i++) if (s_hist[i].count) list[n++] = &s_hist[i];
+
+	// most time spent first
+	for (int i = 1; i < n; i++)
+	{
+		const Histogram *h = list[i];
+		int j = i;
+		for (; j > 0 && list[j - 1]->total_us < h->total_us; j--) list[j] = list[j - 1];
+		list[j] = h;
+	}
+	return n;
+}
+
+int profiling_stats_text(char *buf, int size, int max_lines)
+{
+	const Histogram *list[HIST_SCOPES];
+	int n = hist_sorted(list);
+	if (n > max_lines - 1) n = max_lines - 1;
+
+	int len = snprintf(buf, size, "%-15s %6s %6s %6s", "scope(us)", "p50", "p99", "max");
+	for (int i = 0; i < n && len < size; i++)
+	{
+		len += snprintf(buf + len, size - len, "\n%-15.15s %6u %6u %6u", list[i]->name,
+			hist_percentile(list[i], 50), hist_percentile(list[i], 99), list[i]->max_us);
+	}
+	return n;
+}
+
+int profiling_perf_text(char *buf, int size, int max_lines)
+{
+	const Histogram *list[HIST_SCOPES];
+	int n = hist_sorted(list);
+
+	int len = snprintf(buf, size, "%-13s %4s %6s %4s %4s", "scope(avg)", "ipc", "miss", "flt", "cs");
+	int lines = 0;
+	for (int i = 0; i < n && lines < max_lines - 1 && len < size; i++)
+	{
+		const Histogram *h = list[i];
+		if (!h->perf_count) continue;
+
+		double ipc = h->perf[PERF_CYCLES] ? (double)h->perf[PERF_INSTRUCTIONS] / h->perf[PERF_CYCLES] : 0;
+		len += snprintf(buf + len, size - len, "\n%-13.13s %4.2f %6llu %4.1f %4.1f", h->name, ipc,
+			h->perf[PERF_CACHE_MISSES] / h->perf_count,
+			(double)h->perf[PERF_PAGE_FAULTS] / h->perf_count,
+			(double)h->perf[PERF_CTX_SWITCHES] / h->perf_count);
+		lines++;
+	}
+
+	if (!lines && len < size) snprintf(buf + len, size - len, "\nNo PERF scope ran yet.");
+	return lines;
+}
+
+int profiling_stats_save(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) return 0;
+
+	const Histogram *list[HIST_SCOPES];
+	int n = hist_sorted(list);
+
+	fprintf(f, "%-32s %10s %10s %8s %8s %8s %8s\n", "scope", "count", "total_ms", "avg_us", "p50_us", "p99_us", "max_us");
+	for (int i = 0; i < n; i++)
+	{
+		const Histogram *h = list[i];
+		fprintf(f, "%-32s %10u %10llu %8llu %8u %8u %8u\n", h->name, h->count, h->total_us / 1000, h->total_us / h->count,
+			hist_percentile(h, 50), hist_percentile(h, 99), h->max_us);
+	}
+
+	fprintf(f, "\n%-32s %10s %10s %10s %6s %8s %8s %8s\n", "perf scope (per call)", "count", "cycles", "instr", "ipc", "misses", "faults", "ctxsw");
+	for (int i = 0; i < n; i++)
+	{
+		const Histogram *h = list[i];
+		if (!h->perf_count) continue;
+
+		uint32_t c = h->perf_count;
+		double ipc = h->perf[PERF_CYCLES] ? (double)h->perf[PERF_INSTRUCTIONS] / h->perf[PERF_CYCLES] : 0;
+		fprintf(f, "%-32s %10u %10llu %10llu %6.2f %8llu %8.2f %8.2f\n", h->name, c,
+			h->perf[PERF_CYCLES] / c, h->perf[PERF_INSTRUCTIONS] / c, ipc, h->perf[PERF_CACHE_MISSES] / c,
+			(double)h->perf[PERF_PAGE_FAULTS] / c, (double)h->perf[PERF_CTX_SWITCHES] / c);
+	}
+
+	fclose(f);
+	printf("Profiling stats written to %s\n", path);
+	return 1;
 }
 
 // result_ns = a - b
@@ -94,6 +486,9 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 		}
 		else
 		{
+			// end of an event begun before this range (coroutine switch)
+			if (!stack_pos) continue;
+
 			stack_pos--;
 			uint32_t span_idx = pair_stack[stack_pos];
 			const uint64_t inclusive_ns = delta_ns(&event->ts, &get_event(span_idx)->ts);
@@ -118,7 +513,7 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 			printf("| %-50s | %7llu | %7llu |\n", label, inclusive_times[cyc_idx] / 1000ULL, (inclusive_times[cyc_idx] - other_times[cyc_idx]) / 1000ULL);
 			indent += 2;
 		}
-		else
+		else if (indent)
 		{
 			indent -= 2;
 		}
@@ -127,4 +522,23 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 	fflush(stdout);
 }
 
-#endif // PROFILING
\ No newline at end of file
+#else // PROFILING
+
+int profiling_stats_text(char *buf, int size, int)
+{
+	snprintf(buf, size, "Build with PROFILING=1\nfor scope statistics.");
+	return 0;
+}
+
+int profiling_stats_save(const char *)
+{
+	return 0;
+}
+
+int profiling_perf_text(char *buf, int size, int)
+{
+	snprintf(buf, size, "Build with PROFILING=1\nfor CPU counters.");
+	return 0;
+}
+
+#endif // PROFILING
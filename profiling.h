@@ -5,19 +5,27 @@
 
 #ifdef PROFILING
 
+// cycles, instructions, cache misses, page faults, context switches
+#define PROFILING_COUNTERS 5
+
 uint32_t profiling_event_begin(const char *name);
 void profiling_event_end(uint32_t begin_idx, const char *name);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
+void profiling_counters_read(uint64_t *values);
+void profiling_counters_add(const char *name, const uint64_t *begin);
 
 struct ProfilingScopedEvent
 {
 	const char *name;
 	uint32_t spike_us;
 	uint32_t begin_idx;
+	bool counted;
+	uint64_t counters[PROFILING_COUNTERS];
 
 	ProfilingScopedEvent(const char *name)
 		: name(name)
 		, spike_us(0)
+		, counted(false)
 	{
 		begin_idx = profiling_event_begin(name);
 	}
@@ -25,12 +33,23 @@ struct ProfilingScopedEvent
 	ProfilingScopedEvent(const char *name, uint32_t spike_us)
 		: name(name)
 		, spike_us(spike_us)
+		, counted(false)
+	{
+		begin_idx = profiling_event_begin(name);
+	}
+
+	ProfilingScopedEvent(const char *name, uint32_t spike_us, bool counted)
+		: name(name)
+		, spike_us(spike_us)
+		, counted(counted)
 	{
 		begin_idx = profiling_event_begin(name);
+		if (counted) profiling_counters_read(counters);
 	}
 
 	~ProfilingScopedEvent()
 	{
+		if (counted) profiling_counters_add(name, counters);
 		profiling_event_end(begin_idx, name);
 		if (spike_us > 0) profiling_spike_report(begin_idx, spike_us);
 	}
@@ -41,13 +60,56 @@ struct ProfilingScopedEvent
 #define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
 #define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
 
+// Also samples the CPU counters of the thread (perf_event_open) at begin and end
+#define PERF_SCOPE(name) ProfilingScopedEvent __scope_timer(name, 0, true)
+#define PERF_FUNCTION() ProfilingScopedEvent __scope_timer(__FUNCTION__, 0, true)
+
 #else // PROFILING
 
 #define PROFILE_SCOPE(name) 
 #define PROFILE_FUNCTION()
 #define SPIKE_SCOPE(name, us)
 #define SPIKE_FUNCTION(us)
+#define PERF_SCOPE(name)
+#define PERF_FUNCTION()
 
 #endif // PROFILING
 
+// Latency histograms of all PROFILE/SPIKE scopes (PROFILING builds only).
+// Text is a p50/p99/max table of the costliest scopes for the OSD.
+int profiling_stats_text(char *buf, int size, int max_lines);
+int profiling_stats_save(const char *path);
+
+// Averages per call of the PERF scopes: IPC, cache misses, page faults and context switches.
+// Low IPC with many misses is memory bound, context switches mean it got preempted.
+int profiling_perf_text(char *buf, int size, int max_lines);
+
+// Always-on trace ring, independent of PROFILING.
+// Every thread records completed scopes into its own ring (no locking),
+// "trace_dump [file]" on /dev/MiSTer_cmd writes them as Chrome trace JSON.
+uint64_t trace_now_us();
+void trace_event(const char *name, uint64_t begin_us);
+void trace_counter(const char *name, uint32_t value); // level over time, like a buffer fill
+void trace_thread_name(const char *name);
+int trace_dump(const char *path);
+
+struct TraceScope
+{
+	const char *name;
+	uint64_t begin_us;
+
+	TraceScope(const char *name)
+		: name(name)
+		, begin_us(trace_now_us())
+	{
+	}
+
+	~TraceScope()
+	{
+		trace_event(name, begin_us);
+	}
+};
+
+#define TRACE_SCOPE(name) TraceScope __trace_scope(name)
+
 #endif // PROFILING_H
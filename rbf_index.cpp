@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "rbf_index.h"
+#include "file_io.h"
+#include "profiling.h"
+
+#define RBF_INDEX_DIRS 32
+
+struct rbf_dir_t
+{
+	std::string path;
+	time_t mtime;
+	uint32_t used;
+	std::unordered_map<std::string, std::string> names; // lower case name -> newest file
+	std::vector<std::string> subdirs;                   // _ folders, sorted
+};
+
+static rbf_dir_t cache[RBF_INDEX_DIRS];
+static uint32_t tick = 0;
+
+static std::string fold(const char *name, size_t len)
+{
+	std::string s(name, len);
+	for (auto &c : s) c = tolower(c);
+	return s;
+}
+
+// Every prefix ending before a '.' or '_' is a name the file can be found by
+static void dir_add(rbf_dir_t *d, const char *file)
+{
+	for (size_t i = 1; file[i]; i++)
+	{
+		if (file[i] != '.' && file[i] != '_') continue;
+
+		std::string &best = d->names[fold(file, i)];
+		if (best.empty() || strcmp(best.c_str(), file) < 0) best = file;
+	}
+}
+
+static const rbf_dir_t *dir_get(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)) return NULL;
+
+	rbf_dir_t *d = &cache[0];
+	for (int i = 0; i < RBF_INDEX_DIRS; i++)
+	{
+		rbf_dir_t *c = &cache[i];
+		if (c->used && c->path == path)
+		{
+			d = c;
+			if (c->mtime == st.st_mtime)
+			{
+				c->used = ++tick;
+				return c;
+			}
+			break;
+		}
+
+		// free or least recently used
+		if (d->used && (!c->used || c->used < d->used)) d = c;
+	}
+
+	TRACE_SCOPE("rbf_index_read");
+
+	DIR *dir = opendir(path);
+	if (!dir)
+	{
+		d->used = 0;
+		return NULL;
+	}
+
+	d->path = path;
+	d->mtime = st.st_mtime;
+	d->names.clear();
+	d->subdirs.clear();
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		int len = strlen(entry->d_name);
+		if (entry->d_type == DT_DIR)
+		{
+			if (entry->d_name[0] == '_') d->subdirs.push_back(entry->d_name);
+		}
+		else if (len > 4 && !strcasecmp(entry->d_name + len - 4, ".rbf"))
+		{
+			dir_add(d, entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	std::sort(d->subdirs.begin(), d->subdirs.end());
+	d->used = ++tick;
+	return d;
+}
+
+const char *rbf_index_find(const char *dir, const char *name)
+{
+	static std::string found;
+
+	const rbf_dir_t *d = dir_get(dir);
+	if (!d || !name[0]) return NULL;
+
+	auto it = d->names.find(fold(name, strlen(name)));
+	if (it == d->names.end()) return NULL;
+
+	found = it->second;
+	return found.c_str();
+}
+
+const char *rbf_index_core(const char *name)
+{
+	static std::string found;
+
+	// root first, then the _ folders level by level
+	std::vector<std::string> todo = { "" };
+	for (size_t n = 0; n < todo.size(); n++)
+	{
+		std::string rel = todo[n];
+		std::string full = rel.empty() ? std::string(getRootDir()) : std::string(getRootDir()) + "/" + rel;
+
+		const char *file = rbf_index_find(full.c_str(), name);
+		if (file)
+		{
+			found = rel.empty() ? std::string(file) : rel + "/" + file;
+			return found.c_str();
+		}
+
+		const rbf_dir_t *d = dir_get(full.c_str());
+		if (!d) continue;
+		for (auto &s : d->subdirs) todo.push_back(rel.empty() ? s : rel + "/" + s);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef RBF_INDEX_H
+#define RBF_INDEX_H
+
+// Core (RBF) name resolution.
+// Cores are stored with a date suffix (Name_20240101.rbf) and a name resolves
+// to the newest of them. Each folder with cores is read once into a table of
+// name -> newest file, kept until the mtime of the folder changes, so
+// resolving for MRA/MGL launches and the ROM catalog doesn't read folders again.
+
+// File name (without folder) of the newest RBF in dir named name followed by
+// '.' or '_', compared case insensitively. NULL if there's none.
+// Valid until the next rbf_index call.
+const char *rbf_index_find(const char *dir, const char *name);
+
+// Like rbf_index_find() over the core folders (the _ folders of the root and
+// their _ sub folders). Returns the path relative to the root, NULL if not found.
+const char *rbf_index_core(const char *name);
+
+#endif
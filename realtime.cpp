@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "realtime.h"
+#include "cfg.h"
+#include "profiling.h"
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 4
+#endif
+
+#define RT_PRIORITY   10                 // SCHED_FIFO priority of main
+#define RT_HEAP_POOL  (16 * 1024 * 1024) // pre-faulted and kept by malloc
+#define RT_HEAP_CHUNK (256 * 1024)
+#define RT_MMAP_MIN   (4 * 1024 * 1024)  // smaller allocations come from the pool
+#define RT_STACK      (256 * 1024)
+#define RT_BUCKETS    20                 // 1us << n
+
+static int rt_active = 0;
+static uint64_t last_tick = 0;
+static uint32_t buckets[RT_BUCKETS];
+static uint32_t ticks = 0;
+static uint32_t max_us = 0;
+static long flt_min = 0, flt_maj = 0;
+
+static void rt_faults(long *min, long *maj)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	*min = ru.ru_minflt;
+	*maj = ru.ru_majflt;
+}
+
+static void __attribute__((noinline)) rt_prefault_stack()
+{
+	uint8_t stack[RT_STACK];
+	memset(stack, 0, sizeof(stack));
+	__asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+static void rt_prefault_heap()
+{
+	// Freed memory stays with malloc, so the pool is reused instead of new pages
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_THRESHOLD, RT_MMAP_MIN);
+
+	void *chunks[RT_HEAP_POOL / RT_HEAP_CHUNK];
+	for (int i = 0; i < RT_HEAP_POOL / RT_HEAP_CHUNK; i++)
+	{
+		chunks[i] = malloc(RT_HEAP_CHUNK);
+		if (chunks[i]) memset(chunks[i], 0, RT_HEAP_CHUNK);
+	}
+	for (int i = 0; i < RT_HEAP_POOL / RT_HEAP_CHUNK; i++) free(chunks[i]);
+}
+
+void realtime_init()
+{
+	if (!cfg.realtime) return;
+
+	uint64_t t = trace_now_us();
+
+	rt_prefault_heap();
+	rt_prefault_stack();
+
+	// Everything mapped now is faulted in and locked, later mappings are locked as they get used
+	// (a locked image copy or a loaded file isn't read in before it's needed)
+	if (mlockall(MCL_CURRENT) || mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT))
+	{
+		printf("realtime: mlockall failed: %s\n", strerror(errno));
+	}
+
+	struct sched_param sp = {};
+	sp.sched_priority = RT_PRIORITY;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp))
+	{
+		printf("realtime: SCHED_FIFO failed: %s\n", strerror(errno));
+	}
+	else
+	{
+		rt_active = 1;
+	}
+
+	trace_event("realtime_init", t);
+	printf("realtime: %s in %llu ms\n", rt_active ? "on" : "partly on", (unsigned long long)(trace_now_us() - t) / 1000);
+	realtime_report_reset();
+}
+
+void realtime_poll_tick()
+{
+	uint64_t now = trace_now_us();
+	if (last_tick)
+	{
+		uint32_t us = now - last_tick;
+		int b = 0;
+		while (b < RT_BUCKETS - 1 && us >= (2u << b)) b++;
+		buckets[b]++;
+		ticks++;
+		if (us > max_us) max_us = us;
+	}
+	last_tick = now;
+}
+
+void realtime_report_reset()
+{
+	memset(buckets, 0, sizeof(buckets));
+	ticks = 0;
+	max_us = 0;
+	last_tick = 0;
+	rt_faults(&flt_min, &flt_maj);
+}
+
+// Upper bound of the bucket holding the given per mille of the intervals
+static uint32_t rt_percentile(int permille)
+{
+	uint32_t want = ((uint64_t)ticks * permille + 999) / 1000;
+	uint32_t sum = 0;
+	for (int b = 0; b < RT_BUCKETS; b++)
+	{
+		sum += buckets[b];
+		if (sum >= want) return 2u << b;
+	}
+	return max_us;
+}
+
+int realtime_report(char *buf, int size, const char *path)
+{
+	long min, maj;
+	rt_faults(&min, &maj);
+
+	int len = snprintf(buf, size, "mode     %s\nrounds   %u\np50   <%6uus\np99   <%6uus\np99.9 <%6uus\nmax    %7uus\nfaults   %ld/%ld",
+		rt_active ? "realtime" : "normal", ticks, rt_percentile(500), rt_percentile(990), rt_percentile(999), max_us,
+		min - flt_min, maj - flt_maj);
+
+	if (path)
+	{
+		FILE *f = fopen(path, "w");
+		if (f)
+		{
+			fprintf(f, "%s\n\n%-12s %10s\n", buf, "interval_us", "count");
+			for (int b = 0; b < RT_BUCKETS; b++)
+			{
+				if (buckets[b]) fprintf(f, "<%-11u %10u\n", 2u << b, buckets[b]);
+			}
+			fclose(f);
+		}
+	}
+
+	return len;
+}
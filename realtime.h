@@ -0,0 +1,21 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+// Real-time mode of the main loop (realtime option).
+// Memory is locked and a heap pool pre-faulted so the loop doesn't take page
+// faults, and the main thread runs SCHED_FIFO on its core. Decoding, hashing
+// and I/O stay on the offload workers and threads on the other core(s).
+// The kernel's RT throttling still leaves a share of the core to others.
+
+// Call once the scheduler tasks exist (their stacks get locked too).
+void realtime_init();
+
+// Called by the poll task every round, measures the time between rounds.
+void realtime_poll_tick();
+
+// Interval histogram and page faults since start or the last reset,
+// written to path and as text for the OSD.
+int realtime_report(char *buf, int size, const char *path);
+void realtime_report_reset();
+
+#endif
@@ -5,6 +5,13 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 #include "file_io.h"
 #include "user_io.h"
@@ -29,6 +36,25 @@ static int numlast = 0;
 static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 
+// Lists read once per session and kept here. Writes go through
+// FileSaveConfig, which defers them until the list stops changing.
+struct recent_store_t
+{
+	std::vector<recent_rec_t> recs;
+};
+
+static std::unordered_map<std::string, recent_store_t> recent_store;
+static pthread_mutex_t recent_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void recent_store_save(const char *name)
+{
+	pthread_mutex_lock(&recent_store_lock);
+	recent_store[name].recs.assign(recents, recents + RECENT_MAX);
+	pthread_mutex_unlock(&recent_store_lock);
+
+	FileSaveConfig(name, recents, sizeof(recents));
+}
+
 static int recent_available()
 {
 	return numlast;
@@ -55,8 +81,22 @@ static void recent_load(int idx)
 	// initialize recent to empty strings
 	memset(recents, 0, sizeof(recents));
 
+	std::string name = recent_create_config_name(idx);
+	pthread_mutex_lock(&recent_store_lock);
+	auto it = recent_store.find(name);
+	bool stored = it != recent_store.end();
+	if (stored) memcpy(recents, it->second.recs.data(), sizeof(recents));
+	pthread_mutex_unlock(&recent_store_lock);
+
 	// load the config file into memory
-	FileLoadConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	if (!stored)
+	{
+		FileLoadConfig(name.c_str(), recents, sizeof(recents));
+
+		pthread_mutex_lock(&recent_store_lock);
+		recent_store[name].recs.assign(recents, recents + RECENT_MAX);
+		pthread_mutex_unlock(&recent_store_lock);
+	}
 
 	for (numlast = 0; numlast < (int)(sizeof(recents)/sizeof(recents[0])) && strlen(recents[numlast].name); numlast++) {}
 
@@ -68,6 +108,27 @@ static void recent_load(int idx)
 	}
 }
 
+// Folder of the newest entry of list idx, leaves the list on screen alone.
+int recent_last_dir(int idx, char *dir, int size)
+{
+	if (!cfg.recents) return 0;
+
+	recent_rec_t rec = {};
+	std::string name = recent_create_config_name(idx);
+	pthread_mutex_lock(&recent_store_lock);
+	auto it = recent_store.find(name);
+	bool stored = it != recent_store.end();
+	if (stored && !it->second.recs.empty()) rec = it->second.recs[0];
+	pthread_mutex_unlock(&recent_store_lock);
+
+	// the first record is enough
+	if (!stored) FileLoadConfig(name.c_str(), &rec, sizeof(rec));
+
+	if (!rec.name[0]) return 0;
+	snprintf(dir, size, "%s", rec.dir);
+	return 1;
+}
+
 int recent_init(int idx)
 {
 	if (!cfg.recents) return 0;
@@ -249,6 +310,7 @@ void recent_update(char* dir, char* path, char* label, int idx)
 	if (name) name++; else name = path;
 
 	// load the current state.  this is necessary because we may have started a ROM from multiple sources
+	// (kept in memory, no read after the first one)
 	recent_load(idx);
 
 	// update the selection
@@ -271,7 +333,7 @@ void recent_update(char* dir, char* path, char* label, int idx)
 	memcpy(recents, &rec, sizeof(recents[0]));
 
 	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	recent_store_save(recent_create_config_name(idx));
 }
 
 void recent_clear(int idx)
@@ -279,5 +341,5 @@ void recent_clear(int idx)
 	memset(recents, 0, sizeof(recents));
 
 	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	recent_store_save(recent_create_config_name(idx));
 }
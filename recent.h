@@ -8,5 +8,6 @@ void recent_print();
 int  recent_select(char *dir, char *path, char *label);
 void recent_update(char* dir, char* path, char* label, int idx);
 void recent_clear(int idx);
+int  recent_last_dir(int idx, char *dir, int size);
 
 #endif
@@ -11,12 +11,25 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include <algorithm>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include <pthread.h>
 
 #include "rom_catalog.h"
 #include "file_io.h"
 #include "osd.h"
 #include "cfg.h"
+#include "hardware.h"
+#include "rbf_index.h"
+#include "memtrack.h"
+#include "profiling.h"
 
 // Global catalog instance
 rom_catalog_t g_rom_catalog = {};
@@ -62,17 +75,113 @@ const int rom_station_template_count = sizeof(rom_station_templates) / sizeof(ro
 static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 static int browse_station_filter = -1;  // -1 = all stations
-static rom_entry_t **filtered_roms = NULL;
+static uint32_t *filtered_roms = NULL;  // ROM indices, NULL when the view is a whole sort order
 static int filtered_count = 0;
-static int filtered_capacity = 0;
 static char search_filter[256] = "";
-static volatile int scan_cancel_flag = 0;
+static std::atomic<int> scan_cancel_flag(0);
+
+// Persistent index of scanned directories.
+// Station ROMs are kept contiguous in g_rom_catalog.roms, so directory
+// ROM ranges are relative to the first ROM of the station.
+#define ROM_INDEX_MAGIC   0x4943524D  // "MRCI"
+#define ROM_INDEX_VERSION 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;             // sizeof(rom_entry_t), layout check
+    uint32_t dir_count;              // Scanned directories (rom_index_dir_t)
+    uint32_t rom_count;
+    uint32_t dirtab_count;           // Directory table (rom_dir_t)
+    uint32_t prefix_count;
+    uint32_t strings_size;
+} rom_index_header_t;
+
+typedef struct {
+    uint32_t dir_id;                 // Entry in directory table
+    uint32_t station_id;
+    uint32_t mtime;                  // Directory modification time when scanned
+    uint32_t ext_hash;               // Hash of station extensions when scanned
+    int32_t parent;                  // Index of parent directory within station (-1 = root)
+    uint32_t rom_first;              // First ROM (station relative) directly in this directory
+    uint32_t rom_count;              // Number of ROMs directly in this directory
+} rom_index_dir_t;
+
+typedef std::vector<rom_index_dir_t> rom_index_dirs_t;
+static rom_index_dirs_t index_dirs[ROM_MAX_STATIONS];
+
+// Trigram search index over ROM names.
+// Posting lists of ROM indices (ascending) per hashed lowercase trigram.
+#define SEARCH_TRI_BITS    14
+#define SEARCH_TRI_BUCKETS (1 << SEARCH_TRI_BITS)
+
+static uint32_t *search_tri_start = NULL;  // SEARCH_TRI_BUCKETS + 1 offsets into postings
+static uint32_t *search_tri_postings = NULL;
+static uint32_t search_tri_rom_count = 0;   // Catalog size the index was built for
+
+// Previous filter result, used to refine when search text was extended
+static char search_last_filter[256] = "";
+static int search_last_station = -1;
+
+// Ready-made browse orders of ROM indices, updated per station when it's
+// scanned. Descending name, date and size orders are walked backwards.
+enum {
+    SORT_ORDER_NAME,
+    SORT_ORDER_DATE,
+    SORT_ORDER_SIZE,
+    SORT_ORDER_STATION_ASC,   // Whole catalog only, station order and name
+    SORT_ORDER_STATION_DESC,
+    SORT_ORDER_COUNT
+};
+#define SORT_STATION_ORDERS 3  // Name, date and size per station
+
+typedef std::vector<uint32_t> rom_order_t;
+
+static rom_order_t sort_orders[SORT_ORDER_COUNT];                          // Absolute ROM indices
+static rom_order_t station_orders[ROM_MAX_STATIONS][SORT_STATION_ORDERS];  // Station relative
+static uint32_t station_first[ROM_MAX_STATIONS];                           // First ROM of the station
+static uint32_t station_count[ROM_MAX_STATIONS];                           // ROMs of the station, listed or not
+static std::vector<uint64_t> sort_name_keys;                               // First 8 lowercase name chars per ROM
+
+// Current unfiltered view
+static const rom_order_t *view_order = NULL;
+static uint32_t view_base = 0;
+static int view_reverse = 0;
 
 // Forward declarations
 static void rebuild_filtered_list(void);
+static void sort_orders_build(void);
+static void sort_orders_free(void);
+static void sort_remove_station(uint32_t station_id);
+static void sort_add_station(uint32_t station_id, uint32_t first, uint32_t count);
+static void search_index_build(void);
+static void search_index_free(void);
+static void watch_sync(void);
+static void watch_free(void);
+static int dedup_build(void);
 static int match_extension(const char *filename, const char *extensions);
 static void extract_display_name(const char *filename, char *display_name, int max_len);
 
+// Reports the change of the catalog tables, search index and sort orders to memtrack
+static void catalog_account(void)
+{
+    static uint64_t accounted = 0;
+
+    uint64_t bytes = (uint64_t)g_rom_catalog.rom_capacity * sizeof(rom_entry_t) +
+                     (uint64_t)g_rom_catalog.dir_capacity * sizeof(rom_dir_t) +
+                     g_rom_catalog.strings_capacity;
+    if (search_tri_start) bytes += (SEARCH_TRI_BUCKETS + 1 + search_tri_start[SEARCH_TRI_BUCKETS]) * sizeof(uint32_t);
+    for (int o = 0; o < SORT_ORDER_COUNT; o++) bytes += sort_orders[o].capacity() * sizeof(uint32_t);
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        for (int o = 0; o < SORT_STATION_ORDERS; o++) bytes += station_orders[i][o].capacity() * sizeof(uint32_t);
+        bytes += index_dirs[i].capacity() * sizeof(rom_index_dir_t);
+    }
+    bytes += sort_name_keys.capacity() * sizeof(uint64_t);
+
+    mem_account(MEM_CATALOG, (int64_t)bytes - (int64_t)accounted);
+    accounted = bytes;
+}
+
 /*****************************************************************************
  * Catalog Initialization and Cleanup
  *****************************************************************************/
@@ -83,30 +192,46 @@ int rom_catalog_init(void)
 
     memset(&g_rom_catalog, 0, sizeof(g_rom_catalog));
 
-    // Initial allocation for ROMs
+    // Initial allocation for ROMs, directories and strings
     g_rom_catalog.rom_capacity = 1024;
     g_rom_catalog.roms = (rom_entry_t*)malloc(g_rom_catalog.rom_capacity * sizeof(rom_entry_t));
-    if (!g_rom_catalog.roms) {
+    g_rom_catalog.dir_capacity = 256;
+    g_rom_catalog.dirs = (rom_dir_t*)malloc(g_rom_catalog.dir_capacity * sizeof(rom_dir_t));
+    g_rom_catalog.strings_capacity = 64 * 1024;
+    g_rom_catalog.strings = (char*)malloc(g_rom_catalog.strings_capacity);
+    if (!g_rom_catalog.roms || !g_rom_catalog.dirs || !g_rom_catalog.strings) {
+        free(g_rom_catalog.roms);
+        free(g_rom_catalog.dirs);
+        free(g_rom_catalog.strings);
+        memset(&g_rom_catalog, 0, sizeof(g_rom_catalog));
         return -1;
     }
 
+    g_rom_catalog.strings[0] = 0;
+    g_rom_catalog.strings_size = 1;
+
     g_rom_catalog.initialized = 1;
+    catalog_account();
     return 0;
 }
 
 void rom_catalog_free(void)
 {
-    if (g_rom_catalog.roms) {
-        free(g_rom_catalog.roms);
-        g_rom_catalog.roms = NULL;
-    }
+    free(g_rom_catalog.roms);
+    free(g_rom_catalog.dirs);
+    free(g_rom_catalog.strings);
 
-    if (filtered_roms) {
-        free(filtered_roms);
-        filtered_roms = NULL;
-    }
+    free(filtered_roms);
+    filtered_roms = NULL;
+    filtered_count = 0;
+
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) rom_index_dirs_t().swap(index_dirs[i]);
+    search_index_free();
+    sort_orders_free();
+    watch_free();
 
     memset(&g_rom_catalog, 0, sizeof(g_rom_catalog));
+    catalog_account();
 }
 
 // Config file name for catalog
@@ -120,6 +245,293 @@ static const char* rom_stations_config_name(void)
     return "rom_stations.cfg";
 }
 
+static const char* rom_index_config_name(void)
+{
+    return "rom_catalog.idx";
+}
+
+static rom_entry_t* alloc_rom_entry(void)
+{
+    // Ensure capacity
+    if (g_rom_catalog.rom_count >= g_rom_catalog.rom_capacity) {
+        uint32_t new_capacity = g_rom_catalog.rom_capacity * 2;
+        rom_entry_t *new_roms = (rom_entry_t*)realloc(g_rom_catalog.roms,
+                                                       new_capacity * sizeof(rom_entry_t));
+        if (!new_roms) return NULL;
+        g_rom_catalog.roms = new_roms;
+        g_rom_catalog.rom_capacity = new_capacity;
+    }
+
+    return &g_rom_catalog.roms[g_rom_catalog.rom_count++];
+}
+
+// Append string to the arena, returns its offset (0 on failure)
+static uint32_t catalog_add_string(const char *str, int len = -1)
+{
+    if (len < 0) len = strlen(str);
+    if (!len) return 0;
+
+    if (g_rom_catalog.strings_size + len + 1 > g_rom_catalog.strings_capacity) {
+        uint32_t new_capacity = g_rom_catalog.strings_capacity * 2;
+        while (g_rom_catalog.strings_size + len + 1 > new_capacity) new_capacity *= 2;
+        char *new_strings = (char*)realloc(g_rom_catalog.strings, new_capacity);
+        if (!new_strings) return 0;
+        g_rom_catalog.strings = new_strings;
+        g_rom_catalog.strings_capacity = new_capacity;
+    }
+
+    uint32_t ofs = g_rom_catalog.strings_size;
+    memcpy(g_rom_catalog.strings + ofs, str, len);
+    g_rom_catalog.strings[ofs + len] = 0;
+    g_rom_catalog.strings_size += len + 1;
+    return ofs;
+}
+
+static inline const char* catalog_string(uint32_t ofs)
+{
+    return g_rom_catalog.strings + ofs;
+}
+
+static uint32_t catalog_intern_prefix(const char *prefix)
+{
+    for (uint32_t i = 0; i < g_rom_catalog.prefix_count; i++) {
+        if (!strcmp(catalog_string(g_rom_catalog.prefix_ofs[i]), prefix)) return g_rom_catalog.prefix_ofs[i];
+    }
+
+    uint32_t ofs = catalog_add_string(prefix);
+    if (ofs && g_rom_catalog.prefix_count < ROM_MAX_PREFIXES) {
+        g_rom_catalog.prefix_ofs[g_rom_catalog.prefix_count++] = ofs;
+    }
+    return ofs;
+}
+
+// Add directory from arena strings, returns directory id (-1 on failure)
+static int catalog_add_dir_ofs(uint32_t prefix_ofs, uint32_t rel_ofs)
+{
+    if (g_rom_catalog.dir_count >= g_rom_catalog.dir_capacity) {
+        uint32_t new_capacity = g_rom_catalog.dir_capacity * 2;
+        rom_dir_t *new_dirs = (rom_dir_t*)realloc(g_rom_catalog.dirs, new_capacity * sizeof(rom_dir_t));
+        if (!new_dirs) return -1;
+        g_rom_catalog.dirs = new_dirs;
+        g_rom_catalog.dir_capacity = new_capacity;
+    }
+
+    rom_dir_t *dir = &g_rom_catalog.dirs[g_rom_catalog.dir_count];
+    dir->prefix_ofs = prefix_ofs;
+    dir->rel_ofs = rel_ofs;
+    return g_rom_catalog.dir_count++;
+}
+
+static int catalog_dir_path(uint32_t dir_id, char *buf, int buf_len)
+{
+    if (dir_id >= g_rom_catalog.dir_count) {
+        if (buf_len) buf[0] = 0;
+        return 0;
+    }
+
+    const rom_dir_t *dir = &g_rom_catalog.dirs[dir_id];
+    return snprintf(buf, buf_len, "%s%s", catalog_string(dir->prefix_ofs), catalog_string(dir->rel_ofs));
+}
+
+// Rebuild string arena and directory table keeping only what ROMs and the index refer to
+static void catalog_compact(void)
+{
+    char *old_strings = g_rom_catalog.strings;
+    rom_dir_t *old_dirs = g_rom_catalog.dirs;
+    uint32_t old_dir_count = g_rom_catalog.dir_count;
+
+    char *new_strings = (char*)malloc(g_rom_catalog.strings_capacity);
+    rom_dir_t *new_dirs = (rom_dir_t*)malloc(g_rom_catalog.dir_capacity * sizeof(rom_dir_t));
+    if (!new_strings || !new_dirs) {
+        free(new_strings);
+        free(new_dirs);
+        return;
+    }
+
+    g_rom_catalog.strings = new_strings;
+    g_rom_catalog.strings[0] = 0;
+    g_rom_catalog.strings_size = 1;
+    g_rom_catalog.dirs = new_dirs;
+    g_rom_catalog.dir_count = 0;
+    g_rom_catalog.prefix_count = 0;
+
+    std::vector<uint32_t> dir_map(old_dir_count, UINT32_MAX);
+    auto remap_dir = [&](uint32_t id) -> uint32_t {
+        if (id >= old_dir_count) return id;
+        if (dir_map[id] == UINT32_MAX) {
+            rom_dir_t *dir = &g_rom_catalog.dirs[g_rom_catalog.dir_count];
+            dir->prefix_ofs = catalog_intern_prefix(old_strings + old_dirs[id].prefix_ofs);
+            dir->rel_ofs = catalog_add_string(old_strings + old_dirs[id].rel_ofs);
+            dir_map[id] = g_rom_catalog.dir_count++;
+        }
+        return dir_map[id];
+    };
+
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        for (rom_index_dir_t &dir : index_dirs[i]) dir.dir_id = remap_dir(dir.dir_id);
+    }
+
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        rom_entry_t *rom = &g_rom_catalog.roms[i];
+        rom->dir_id = remap_dir(rom->dir_id);
+        rom->name_ofs = catalog_add_string(old_strings + rom->name_ofs);
+        rom->filename_ofs = catalog_add_string(old_strings + rom->filename_ofs);
+    }
+
+    free(old_strings);
+    free(old_dirs);
+
+    search_index_build();
+    catalog_account();
+}
+
+static uint32_t ext_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (uint8_t)tolower(*s++)) * 16777619u;
+    return h;
+}
+
+// Map the saved index and restore catalog from it.
+static int rom_index_load(void)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s", getFullPath(CONFIG_DIR "/"));
+    strncat(path, rom_index_config_name(), sizeof(path) - strlen(path) - 1);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(rom_index_header_t)) {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const rom_index_header_t *hdr = (const rom_index_header_t*)map;
+    const uint32_t *prefixes = (const uint32_t*)(hdr + 1);
+    const rom_dir_t *dirtab = (const rom_dir_t*)(prefixes + hdr->prefix_count);
+    const rom_index_dir_t *dirs = (const rom_index_dir_t*)(dirtab + hdr->dirtab_count);
+    const rom_entry_t *roms = (const rom_entry_t*)(dirs + hdr->dir_count);
+    const char *strings = (const char*)(roms + hdr->rom_count);
+
+    if (hdr->magic != ROM_INDEX_MAGIC || hdr->version != ROM_INDEX_VERSION ||
+        hdr->entry_size != sizeof(rom_entry_t) || hdr->prefix_count > ROM_MAX_PREFIXES || !hdr->strings_size ||
+        (uint64_t)st.st_size != sizeof(rom_index_header_t) + (uint64_t)hdr->prefix_count * sizeof(uint32_t) +
+                                (uint64_t)hdr->dirtab_count * sizeof(rom_dir_t) +
+                                (uint64_t)hdr->dir_count * sizeof(rom_index_dir_t) +
+                                (uint64_t)hdr->rom_count * sizeof(rom_entry_t) + hdr->strings_size ||
+        strings[hdr->strings_size - 1]) {
+        printf("ROM catalog: index %s is invalid, ignoring.\n", path);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    // String arena and directory table are taken as is
+    char *new_strings = (char*)malloc(hdr->strings_size);
+    rom_dir_t *new_dirs = (rom_dir_t*)malloc((hdr->dirtab_count ? hdr->dirtab_count : 1) * sizeof(rom_dir_t));
+    if (!new_strings || !new_dirs) {
+        free(new_strings);
+        free(new_dirs);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    memcpy(new_strings, strings, hdr->strings_size);
+    memcpy(new_dirs, dirtab, hdr->dirtab_count * sizeof(rom_dir_t));
+    free(g_rom_catalog.strings);
+    free(g_rom_catalog.dirs);
+    g_rom_catalog.strings = new_strings;
+    g_rom_catalog.strings_size = g_rom_catalog.strings_capacity = hdr->strings_size;
+    g_rom_catalog.dirs = new_dirs;
+    g_rom_catalog.dir_count = g_rom_catalog.dir_capacity = hdr->dirtab_count;
+    if (!g_rom_catalog.dir_capacity) g_rom_catalog.dir_capacity = 1;
+    g_rom_catalog.prefix_count = hdr->prefix_count;
+    memcpy(g_rom_catalog.prefix_ofs, prefixes, hdr->prefix_count * sizeof(uint32_t));
+
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) index_dirs[i].clear();
+    for (uint32_t i = 0; i < hdr->dir_count; i++) {
+        if (dirs[i].station_id < ROM_MAX_STATIONS && g_rom_catalog.stations[dirs[i].station_id].enabled) {
+            index_dirs[dirs[i].station_id].push_back(dirs[i]);
+        }
+    }
+
+    g_rom_catalog.rom_count = 0;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) g_rom_catalog.stations[i].rom_count = 0;
+
+    for (uint32_t i = 0; i < hdr->rom_count; i++) {
+        uint32_t id = roms[i].station_id;
+        if (id >= ROM_MAX_STATIONS || !g_rom_catalog.stations[id].enabled) continue;
+        if (roms[i].name_ofs >= hdr->strings_size || roms[i].filename_ofs >= hdr->strings_size) continue;
+
+        rom_entry_t *rom = alloc_rom_entry();
+        if (!rom) break;
+        *rom = roms[i];
+        g_rom_catalog.stations[id].rom_count++;
+    }
+
+    printf("ROM catalog: loaded %u ROMs in %u directories from index.\n", g_rom_catalog.rom_count, hdr->dir_count);
+    munmap(map, st.st_size);
+
+    search_index_build();
+    sort_orders_build();
+    catalog_account();
+    g_rom_catalog.generation++;
+    return 1;
+}
+
+static int rom_index_save(void)
+{
+    uint32_t dir_count = 0;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) dir_count += index_dirs[i].size();
+
+    size_t size = sizeof(rom_index_header_t) + g_rom_catalog.prefix_count * sizeof(uint32_t) +
+                  g_rom_catalog.dir_count * sizeof(rom_dir_t) + dir_count * sizeof(rom_index_dir_t) +
+                  g_rom_catalog.rom_count * sizeof(rom_entry_t) + g_rom_catalog.strings_size;
+
+    uint8_t *buf = (uint8_t*)malloc(size);
+    if (!buf) return -1;
+
+    rom_index_header_t *hdr = (rom_index_header_t*)buf;
+    hdr->magic = ROM_INDEX_MAGIC;
+    hdr->version = ROM_INDEX_VERSION;
+    hdr->entry_size = sizeof(rom_entry_t);
+    hdr->dir_count = dir_count;
+    hdr->rom_count = g_rom_catalog.rom_count;
+    hdr->dirtab_count = g_rom_catalog.dir_count;
+    hdr->prefix_count = g_rom_catalog.prefix_count;
+    hdr->strings_size = g_rom_catalog.strings_size;
+
+    uint8_t *p = (uint8_t*)(hdr + 1);
+    memcpy(p, g_rom_catalog.prefix_ofs, g_rom_catalog.prefix_count * sizeof(uint32_t));
+    p += g_rom_catalog.prefix_count * sizeof(uint32_t);
+    memcpy(p, g_rom_catalog.dirs, g_rom_catalog.dir_count * sizeof(rom_dir_t));
+    p += g_rom_catalog.dir_count * sizeof(rom_dir_t);
+
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (!index_dirs[i].empty()) {
+            memcpy(p, index_dirs[i].data(), index_dirs[i].size() * sizeof(rom_index_dir_t));
+            p += index_dirs[i].size() * sizeof(rom_index_dir_t);
+        }
+    }
+
+    memcpy(p, g_rom_catalog.roms, g_rom_catalog.rom_count * sizeof(rom_entry_t));
+    p += g_rom_catalog.rom_count * sizeof(rom_entry_t);
+    memcpy(p, g_rom_catalog.strings, g_rom_catalog.strings_size);
+
+    // written right away, rom_index_load maps the file itself
+    char path[256];
+    snprintf(path, sizeof(path), CONFIG_DIR "/%s", rom_index_config_name());
+    int ret = FileSave(path, buf, size);
+    free(buf);
+
+    return (ret == (int)size) ? 0 : -1;
+}
+
 int rom_catalog_load(void)
 {
     if (!g_rom_catalog.initialized) {
@@ -137,13 +549,17 @@ int rom_catalog_load(void)
         }
     }
 
+    // Restore ROMs from the saved index, rescan only refreshes changed directories
+    rom_index_load();
+    watch_sync();
+
     return 0;
 }
 
 int rom_catalog_save(void)
 {
     FileSaveConfig(rom_stations_config_name(), g_rom_catalog.stations, sizeof(g_rom_catalog.stations));
-    return 0;
+    return rom_index_save();
 }
 
 /*****************************************************************************
@@ -178,16 +594,18 @@ int rom_station_add(const char *name, const char *short_name,
 
     g_rom_catalog.station_count++;
     rom_catalog_save();
+    watch_sync();
 
     return slot;
 }
 
 int rom_station_remove(uint32_t station_id)
 {
-    if (station_id >= ROM_MAX_STATIONS) return -1;
+    if (station_id >= ROM_MAX_STATIONS || g_rom_catalog.scanning) return -1;
     if (!g_rom_catalog.stations[station_id].enabled) return -1;
 
     // Remove all ROMs for this station
+    sort_remove_station(station_id);
     int write_idx = 0;
     for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
         if (g_rom_catalog.roms[i].station_id != station_id) {
@@ -198,248 +616,1353 @@ int rom_station_remove(uint32_t station_id)
         }
     }
     g_rom_catalog.rom_count = write_idx;
+    g_rom_catalog.generation++;
+    rom_index_dirs_t().swap(index_dirs[station_id]);
+    catalog_compact();
 
     // Disable station
     g_rom_catalog.stations[station_id].enabled = 0;
     g_rom_catalog.station_count--;
 
     rom_catalog_save();
+    watch_sync();
+
+    // ROM indices moved, the previous search result can't be refined
+    search_last_filter[0] = 0;
     rebuild_filtered_list();
 
     return 0;
 }
 
-int rom_station_update(uint32_t station_id, rom_station_t *station)
+int rom_station_update(uint32_t station_id, rom_station_t *station)
+{
+    if (station_id >= ROM_MAX_STATIONS || g_rom_catalog.scanning) return -1;
+
+    memcpy(&g_rom_catalog.stations[station_id], station, sizeof(rom_station_t));
+    rom_catalog_save();
+    watch_sync();
+
+    return 0;
+}
+
+rom_station_t* rom_station_get(uint32_t station_id)
+{
+    if (station_id >= ROM_MAX_STATIONS) return NULL;
+    if (!g_rom_catalog.stations[station_id].enabled) return NULL;
+    return &g_rom_catalog.stations[station_id];
+}
+
+rom_station_t* rom_station_get_by_index(int index)
+{
+    int count = 0;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (g_rom_catalog.stations[i].enabled) {
+            if (count == index) {
+                return &g_rom_catalog.stations[i];
+            }
+            count++;
+        }
+    }
+    return NULL;
+}
+
+int rom_station_count(void)
+{
+    return g_rom_catalog.station_count;
+}
+
+/*****************************************************************************
+ * ROM Scanning
+ *****************************************************************************/
+
+// Station scan context.
+// Workers only read the global catalog (previous results of their station)
+// and collect new ROMs, strings and directories locally. Results are merged
+// into the catalog on the main thread once all workers are done.
+typedef struct {
+    uint32_t station_id;
+    char short_name[32];
+    char rom_path[ROM_PATH_LEN];
+    char extensions[ROM_EXT_LEN];
+    uint32_t ext_hash;
+
+    // Previous index state of the station (read only from the catalog)
+    const rom_index_dir_t *prev_dirs;
+    uint32_t prev_dir_count;
+    const rom_entry_t *prev_roms;
+    uint32_t prev_rom_count;
+    std::vector<std::vector<int>> prev_children;
+    std::unordered_map<std::string, int> prev_by_path;
+
+    // New results, string/dir offsets are local
+    std::vector<rom_entry_t> roms;
+    std::vector<char> strings;
+    std::vector<rom_dir_t> dirs;
+    rom_index_dirs_t index;
+
+    int done;
+} rom_scan_ctx_t;
+
+#define ROM_SCAN_WORKERS 4
+
+// Paths resolved once per scan, getFullPath uses a shared buffer
+static char scan_games_dir[ROM_PATH_LEN];
+static char scan_root_dir[ROM_PATH_LEN];
+
+static rom_scan_ctx_t *scan_ctx[ROM_MAX_STATIONS];
+static pthread_t scan_threads[ROM_SCAN_WORKERS];
+static int scan_thread_count = 0;
+static std::atomic<int> scan_next_station(0);
+static std::atomic<int> scan_stations_done(0);
+static int scan_stations_total = 0;
+
+static uint32_t ctx_add_string(rom_scan_ctx_t *ctx, const char *str)
+{
+    if (!*str) return 0;
+    uint32_t ofs = ctx->strings.size();
+    ctx->strings.insert(ctx->strings.end(), str, str + strlen(str) + 1);
+    return ofs;
+}
+
+static uint32_t ctx_add_dir(rom_scan_ctx_t *ctx, const char *prefix, const char *path)
+{
+    size_t len = strlen(prefix);
+    if (strncmp(path, prefix, len)) len = 0;
+
+    rom_dir_t dir;
+    dir.prefix_ofs = len ? ctx_add_string(ctx, prefix) : 0;
+    dir.rel_ofs = ctx_add_string(ctx, path + len);
+    ctx->dirs.push_back(dir);
+    return ctx->dirs.size() - 1;
+}
+
+static int path_is_file(const char *path)
+{
+    struct stat st;
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+static uint8_t rom_preview_flags(const char *short_name, const char *name)
+{
+    // Check for preview image
+    char preview_path[ROM_PATH_LEN];
+    snprintf(preview_path, sizeof(preview_path), "%s/previews/%s.png", scan_games_dir, name);
+    if (path_is_file(preview_path)) return ROM_FLAG_PREVIEW_GLOBAL;
+
+    // Try station-specific preview folder
+    snprintf(preview_path, sizeof(preview_path), "%s/%s/previews/%s.png", scan_games_dir, short_name, name);
+    if (path_is_file(preview_path)) return ROM_FLAG_PREVIEW_STATION;
+
+    return 0;
+}
+
+static void add_rom_entry(rom_scan_ctx_t *ctx, uint32_t dir_id, const char *filename,
+                          uint32_t size, uint32_t date)
+{
+    rom_entry_t rom = {};
+
+    char name[ROM_NAME_LEN];
+    extract_display_name(filename, name, sizeof(name));
+    rom.name_ofs = ctx_add_string(ctx, name);
+    rom.filename_ofs = ctx_add_string(ctx, filename);
+    rom.dir_id = dir_id;
+    rom.station_id = ctx->station_id;
+    rom.size = size;
+    rom.date = date;
+    rom.flags = rom_preview_flags(ctx->short_name, name);
+
+    ctx->roms.push_back(rom);
+}
+
+static void scan_directory_recursive(rom_scan_ctx_t *ctx, const char *prefix, const char *dir_path,
+                                     int depth, int parent)
+{
+    if (depth > 5 || scan_cancel_flag) return;  // Max recursion depth
+
+    struct stat st;
+    if (stat(dir_path, &st) < 0 || !S_ISDIR(st.st_mode)) return;
+
+    int idx = ctx->index.size();
+    ctx->index.emplace_back();
+    memset(&ctx->index[idx], 0, sizeof(rom_index_dir_t));
+    ctx->index[idx].station_id = ctx->station_id;
+    ctx->index[idx].mtime = st.st_mtime;
+    ctx->index[idx].ext_hash = ctx->ext_hash;
+    ctx->index[idx].parent = parent;
+    ctx->index[idx].rom_first = ctx->roms.size();
+    ctx->index[idx].dir_id = ctx_add_dir(ctx, prefix, dir_path);
+
+    // Directory unchanged since last scan: take its ROMs and subdirectories from the index
+    auto it = ctx->prev_by_path.find(dir_path);
+    if (it != ctx->prev_by_path.end()) {
+        const rom_index_dir_t &old = ctx->prev_dirs[it->second];
+        if (old.mtime == (uint32_t)st.st_mtime && old.ext_hash == ctx->ext_hash &&
+            old.rom_first + old.rom_count <= ctx->prev_rom_count) {
+            for (uint32_t i = 0; i < old.rom_count; i++) {
+                rom_entry_t rom = ctx->prev_roms[old.rom_first + i];
+                rom.name_ofs = ctx_add_string(ctx, catalog_string(rom.name_ofs));
+                rom.filename_ofs = ctx_add_string(ctx, catalog_string(rom.filename_ofs));
+                rom.dir_id = ctx->index[idx].dir_id;
+                ctx->roms.push_back(rom);
+            }
+            ctx->index[idx].rom_count = ctx->roms.size() - ctx->index[idx].rom_first;
+
+            for (int child : ctx->prev_children[it->second]) {
+                if (scan_cancel_flag) break;
+                char child_path[ROM_PATH_LEN];
+                catalog_dir_path(ctx->prev_dirs[child].dir_id, child_path, sizeof(child_path));
+                scan_directory_recursive(ctx, prefix, child_path, depth + 1, idx);
+            }
+            return;
+        }
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+
+    std::vector<std::string> subdirs;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && !scan_cancel_flag) {
+        if (entry->d_name[0] == '.') continue;
+
+        char full_path[ROM_PATH_LEN];
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+
+        struct stat st;
+        if (stat(full_path, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            // Recurse after the file list, so directory ROMs stay contiguous
+            subdirs.push_back(full_path);
+        } else if (S_ISREG(st.st_mode)) {
+            // Check if file matches extensions
+            if (match_extension(entry->d_name, ctx->extensions)) {
+                add_rom_entry(ctx, ctx->index[idx].dir_id, entry->d_name, st.st_size, st.st_mtime);
+            }
+        }
+    }
+
+    closedir(dir);
+    ctx->index[idx].rom_count = ctx->roms.size() - ctx->index[idx].rom_first;
+
+    for (const std::string &sub : subdirs) {
+        if (scan_cancel_flag) break;
+        scan_directory_recursive(ctx, prefix, sub.c_str(), depth + 1, idx);
+    }
+}
+
+// Snapshot the station setup and its previous state, main thread only
+static rom_scan_ctx_t* scan_ctx_create(rom_station_t *station)
+{
+    rom_scan_ctx_t *ctx = new rom_scan_ctx_t();
+    ctx->station_id = station->id;
+    strcpy(ctx->short_name, station->short_name);
+    strcpy(ctx->rom_path, station->rom_path);
+    strcpy(ctx->extensions, station->extensions);
+    ctx->ext_hash = ext_hash(station->extensions);
+    ctx->strings.push_back(0);
+
+    ctx->prev_dirs = index_dirs[station->id].data();
+    ctx->prev_dir_count = index_dirs[station->id].size();
+    ctx->prev_children.resize(ctx->prev_dir_count);
+    for (uint32_t i = 0; i < ctx->prev_dir_count; i++) {
+        char path[ROM_PATH_LEN];
+        catalog_dir_path(ctx->prev_dirs[i].dir_id, path, sizeof(path));
+        ctx->prev_by_path[path] = i;
+        if (ctx->prev_dirs[i].parent >= 0 && ctx->prev_dirs[i].parent < (int)ctx->prev_dir_count) {
+            ctx->prev_children[ctx->prev_dirs[i].parent].push_back(i);
+        }
+    }
+
+    // Station ROMs are contiguous in the catalog
+    ctx->prev_roms = NULL;
+    ctx->prev_rom_count = 0;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        if (g_rom_catalog.roms[i].station_id == station->id) {
+            ctx->prev_roms = &g_rom_catalog.roms[i];
+            ctx->prev_rom_count = station->rom_count;
+            if (i + ctx->prev_rom_count > g_rom_catalog.rom_count) ctx->prev_rom_count = 0;
+            break;
+        }
+    }
+
+    ctx->done = 0;
+    return ctx;
+}
+
+static void scan_ctx_run(rom_scan_ctx_t *ctx)
+{
+    // Try different storage locations
+    const char *storage_dirs[] = {
+        scan_games_dir,  // games/
+        scan_root_dir,   // root
+        NULL
+    };
+
+    for (int i = 0; storage_dirs[i] && !scan_cancel_flag; i++) {
+        char full_path[ROM_PATH_LEN];
+        snprintf(full_path, sizeof(full_path), "%s/%s", storage_dirs[i], ctx->rom_path);
+
+        struct stat st;
+        if (!stat(full_path, &st) && S_ISDIR(st.st_mode)) {
+            scan_directory_recursive(ctx, full_path, full_path, 0, -1);
+        }
+    }
+
+    // Cancelled scan is incomplete, keep previous results of the station
+    ctx->done = !scan_cancel_flag;
+}
+
+// Replace station ROMs with the scan results, main thread only
+static void scan_ctx_merge(rom_scan_ctx_t *ctx)
+{
+    if (!ctx->done) return;
+
+    uint32_t station_id = ctx->station_id;
+    rom_station_t *station = &g_rom_catalog.stations[station_id];
+
+    // Remove existing ROMs for this station first
+    sort_remove_station(station_id);
+    int write_idx = 0;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        if (g_rom_catalog.roms[i].station_id != station_id) {
+            if (write_idx != (int)i) {
+                g_rom_catalog.roms[write_idx] = g_rom_catalog.roms[i];
+            }
+            write_idx++;
+        }
+    }
+    g_rom_catalog.rom_count = write_idx;
+    station->rom_count = 0;
+
+    // Local strings are appended as a block, local offset 1 is the first string
+    uint32_t str_base = 0;
+    if (ctx->strings.size() > 1) {
+        uint32_t ofs = catalog_add_string(ctx->strings.data() + 1, ctx->strings.size() - 2);
+        if (!ofs) return;
+        str_base = ofs - 1;
+    }
+
+    uint32_t dir_base = g_rom_catalog.dir_count;
+    for (const rom_dir_t &dir : ctx->dirs) {
+        uint32_t prefix_ofs = dir.prefix_ofs ? catalog_intern_prefix(ctx->strings.data() + dir.prefix_ofs) : 0;
+        if (catalog_add_dir_ofs(prefix_ofs, dir.rel_ofs ? str_base + dir.rel_ofs : 0) < 0) return;
+    }
+
+    for (rom_entry_t rom : ctx->roms) {
+        rom_entry_t *dst = alloc_rom_entry();
+        if (!dst) break;
+        if (rom.name_ofs) rom.name_ofs += str_base;
+        if (rom.filename_ofs) rom.filename_ofs += str_base;
+        rom.dir_id += dir_base;
+        *dst = rom;
+        station->rom_count++;
+    }
+    sort_add_station(station_id, write_idx, station->rom_count);
+
+    rom_index_dirs_t &dirs = index_dirs[station_id];
+    dirs.swap(ctx->index);
+    for (rom_index_dir_t &dir : dirs) dir.dir_id += dir_base;
+}
+
+static void* scan_worker(void *)
+{
+    while (!scan_cancel_flag) {
+        int i = scan_next_station++;
+        if (i >= ROM_MAX_STATIONS) break;
+        if (!scan_ctx[i]) continue;
+
+        scan_ctx_run(scan_ctx[i]);
+        scan_stations_done++;
+    }
+
+    return NULL;
+}
+
+static void scan_prepare(void)
+{
+    scan_cancel_flag = 0;
+    snprintf(scan_games_dir, sizeof(scan_games_dir), "%s", getFullPath(GAMES_DIR));
+    snprintf(scan_root_dir, sizeof(scan_root_dir), "%s", getFullPath(""));
+}
+
+static void scan_finish(void)
+{
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (scan_ctx[i]) {
+            scan_ctx_merge(scan_ctx[i]);
+            delete scan_ctx[i];
+            scan_ctx[i] = NULL;
+        }
+    }
+
+    catalog_compact();
+    if (dedup_build()) sort_orders_build();
+    g_rom_catalog.generation++;
+    search_last_filter[0] = 0;
+    rebuild_filtered_list();
+}
+
+int rom_scan_station(uint32_t station_id)
+{
+    rom_station_t *station = rom_station_get(station_id);
+    if (!station || g_rom_catalog.scanning) return -1;
+
+    scan_prepare();
+    g_rom_catalog.scanning = 1;
+    snprintf(g_rom_catalog.scan_status, sizeof(g_rom_catalog.scan_status),
+             "Scanning %s...", station->short_name);
+
+    scan_ctx[station_id] = scan_ctx_create(station);
+    scan_ctx_run(scan_ctx[station_id]);
+    scan_finish();
+
+    g_rom_catalog.scanning = 0;
+    watch_sync();
+    return station->rom_count;
+}
+
+int rom_scan_start(void)
+{
+    if (g_rom_catalog.scanning) return 0;
+
+    scan_prepare();
+    scan_stations_total = 0;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (g_rom_catalog.stations[i].enabled) {
+            scan_ctx[i] = scan_ctx_create(&g_rom_catalog.stations[i]);
+            scan_stations_total++;
+        }
+    }
+
+    scan_next_station = 0;
+    scan_stations_done = 0;
+    g_rom_catalog.scanning = 1;
+    g_rom_catalog.scan_progress = 0;
+    strcpy(g_rom_catalog.scan_status, "Scanning...");
+
+    // Directory reads are mostly waiting on storage, so several workers help
+    // even with only one free core.
+    scan_thread_count = 0;
+    int workers = std::min(scan_stations_total, ROM_SCAN_WORKERS);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&scan_threads[scan_thread_count], NULL, scan_worker, NULL)) break;
+        scan_thread_count++;
+    }
+
+    // No threads, scan on the caller
+    if (!scan_thread_count) scan_worker(NULL);
+    return 1;
+}
+
+int rom_scan_poll(void)
+{
+    if (!g_rom_catalog.scanning) return 1;
+
+    int done = scan_stations_done;
+    g_rom_catalog.scan_progress = scan_stations_total ? (done * 100) / scan_stations_total : 100;
+    snprintf(g_rom_catalog.scan_status, sizeof(g_rom_catalog.scan_status),
+             "Scanning %d/%d stations...", done, scan_stations_total);
+
+    if (scan_thread_count && done < scan_stations_total && !scan_cancel_flag) return 0;
+
+    for (int i = 0; i < scan_thread_count; i++) pthread_join(scan_threads[i], NULL);
+    scan_thread_count = 0;
+
+    scan_finish();
+
+    g_rom_catalog.scanning = 0;
+    g_rom_catalog.scan_progress = 100;
+    strcpy(g_rom_catalog.scan_status, scan_cancel_flag ? "Scan cancelled" : "Scan complete");
+
+    rom_catalog_save();
+    watch_sync();
+    return 1;
+}
+
+int rom_scan_all(void)
+{
+    if (!rom_scan_start()) return -1;
+    while (!rom_scan_poll()) usleep(10000);
+
+    return g_rom_catalog.rom_count;
+}
+
+void rom_scan_cancel(void)
+{
+    scan_cancel_flag = 1;
+}
+
+int rom_scan_progress(void)
+{
+    return g_rom_catalog.scan_progress;
+}
+
+const char* rom_scan_status(void)
+{
+    return g_rom_catalog.scan_status;
+}
+
+/*****************************************************************************
+ * Live Updates
+ *****************************************************************************/
+
+// Directories of the index are watched with inotify. A changed directory is
+// reread on its own once its events settled (files copied in over the network
+// close many times), its ROMs replace the old ones and new or removed
+// subdirectories are added or dropped. The index is saved a while after the
+// last update. Stations on network mounts don't report changes this way and
+// still need a rescan.
+#define WATCH_MASK       (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_SETTLE_MS  1000
+#define WATCH_SAVE_MS    10000
+#define WATCH_MAX_DEPTH  5     // As deep as the scan goes
+
+typedef struct {
+    int wd;
+    uint32_t station_id;
+    std::string path;
+} rom_watch_t;
+
+static int watch_fd = -1;
+static std::vector<rom_watch_t> watches;
+static std::vector<std::string> watch_dirty[ROM_MAX_STATIONS];
+static int watch_overflow = 0;
+static unsigned long watch_settle = 0;
+static unsigned long watch_save = 0;
+static uint32_t watch_compact_size = 0;     // String arena size after the last compaction
+
+static void watch_add(uint32_t station_id, const char *path)
+{
+    if (watch_fd < 0 || is_network_fs(path)) return;
+
+    int wd = inotify_add_watch(watch_fd, path, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) return;
+
+    rom_watch_t w;
+    w.wd = wd;
+    w.station_id = station_id;
+    w.path = path;
+    watches.push_back(w);
+}
+
+static void watch_drop(uint32_t station_id, const char *path)
+{
+    int wd = -1;
+    for (size_t i = 0; i < watches.size(); i++) {
+        if (watches[i].station_id == station_id && watches[i].path == path) {
+            wd = watches[i].wd;
+            watches.erase(watches.begin() + i);
+            break;
+        }
+    }
+
+    // Stations sharing a folder share its watch
+    if (wd < 0) return;
+    for (const rom_watch_t &w : watches) if (w.wd == wd) return;
+    inotify_rm_watch(watch_fd, wd);
+}
+
+static void watch_free(void)
+{
+    if (watch_fd >= 0) close(watch_fd);
+    watch_fd = -1;
+    std::vector<rom_watch_t>().swap(watches);
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) std::vector<std::string>().swap(watch_dirty[i]);
+    watch_overflow = 0;
+    watch_settle = 0;
+}
+
+// Watch all directories of the index again, after it was replaced
+static void watch_sync(void)
+{
+    if (g_rom_catalog.scanning) return;
+
+    // Closing the descriptor drops all of its watches, pending changes are kept
+    if (watch_fd >= 0) close(watch_fd);
+    watches.clear();
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) return;
+
+    snprintf(scan_games_dir, sizeof(scan_games_dir), "%s", getFullPath(GAMES_DIR));
+    snprintf(scan_root_dir, sizeof(scan_root_dir), "%s", getFullPath(""));
+
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (!g_rom_catalog.stations[i].enabled) continue;
+        for (const rom_index_dir_t &dir : index_dirs[i]) {
+            char path[ROM_PATH_LEN];
+            catalog_dir_path(dir.dir_id, path, sizeof(path));
+            watch_add(i, path);
+        }
+    }
+
+    watch_compact_size = g_rom_catalog.strings_size;
+}
+
+static void watch_mark(uint32_t station_id, const std::string &path)
+{
+    std::vector<std::string> &dirty = watch_dirty[station_id];
+    if (std::find(dirty.begin(), dirty.end(), path) == dirty.end()) dirty.push_back(path);
+}
+
+static void watch_drain(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        int len = read(watch_fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (int i = 0; i < len;) {
+            struct inotify_event *ev = (struct inotify_event *)(buf + i);
+            i += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                watch_overflow = 1;
+                watch_settle = GetTimer(WATCH_SETTLE_MS);
+                continue;
+            }
+
+            // Files count once written, hidden ones are skipped like the scan does
+            if ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR)) continue;
+            if (ev->len && ev->name[0] == '.') continue;
+            if (ev->mask & IN_IGNORED) continue;
+
+            for (const rom_watch_t &w : watches) {
+                if (w.wd == ev->wd) watch_mark(w.station_id, w.path);
+            }
+            watch_settle = GetTimer(WATCH_SETTLE_MS);
+        }
+    }
+}
+
+// Reread state of one station
+typedef struct {
+    rom_station_t *station;
+    rom_index_dirs_t *dirs;
+    std::vector<std::vector<rom_entry_t>> roms;  // Per index directory
+    std::vector<uint8_t> removed;
+} watch_update_t;
+
+static int watch_find_dir(watch_update_t *up, const char *path)
+{
+    for (size_t i = 0; i < up->dirs->size(); i++) {
+        if (up->removed[i]) continue;
+        char dir_path[ROM_PATH_LEN];
+        catalog_dir_path((*up->dirs)[i].dir_id, dir_path, sizeof(dir_path));
+        if (!strcmp(dir_path, path)) return i;
+    }
+    return -1;
+}
+
+static void watch_remove_dir(watch_update_t *up, int idx)
+{
+    char path[ROM_PATH_LEN];
+    catalog_dir_path((*up->dirs)[idx].dir_id, path, sizeof(path));
+    watch_drop(up->station->id, path);
+
+    up->removed[idx] = 1;
+    up->roms[idx].clear();
+    for (size_t i = 0; i < up->dirs->size(); i++) {
+        if (!up->removed[i] && (*up->dirs)[i].parent == idx) watch_remove_dir(up, i);
+    }
+}
+
+static void watch_read_dir(watch_update_t *up, int idx, int depth)
+{
+    char path[ROM_PATH_LEN];
+    catalog_dir_path((*up->dirs)[idx].dir_id, path, sizeof(path));
+
+    struct stat st;
+    DIR *dir = (!stat(path, &st) && S_ISDIR(st.st_mode)) ? opendir(path) : NULL;
+    if (!dir) {
+        watch_remove_dir(up, idx);
+        return;
+    }
+
+    (*up->dirs)[idx].mtime = st.st_mtime;
+    std::vector<rom_entry_t> &roms = up->roms[idx];
+    roms.clear();
+
+    std::vector<std::string> subdirs;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        char full_path[ROM_PATH_LEN];
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        if (stat(full_path, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            subdirs.push_back(full_path);
+        } else if (S_ISREG(st.st_mode) && match_extension(entry->d_name, up->station->extensions)) {
+            char name[ROM_NAME_LEN];
+            extract_display_name(entry->d_name, name, sizeof(name));
+
+            rom_entry_t rom = {};
+            rom.name_ofs = catalog_add_string(name);
+            rom.filename_ofs = catalog_add_string(entry->d_name);
+            rom.dir_id = (*up->dirs)[idx].dir_id;
+            rom.station_id = up->station->id;
+            rom.size = st.st_size;
+            rom.date = st.st_mtime;
+            rom.flags = rom_preview_flags(up->station->short_name, name);
+            roms.push_back(rom);
+        }
+    }
+    closedir(dir);
+
+    // Known subdirectories have their own watches, only gone and new ones matter here
+    for (size_t i = 0; i < up->dirs->size(); i++) {
+        if (up->removed[i] || (*up->dirs)[i].parent != idx) continue;
+
+        char child[ROM_PATH_LEN];
+        catalog_dir_path((*up->dirs)[i].dir_id, child, sizeof(child));
+        auto it = std::find(subdirs.begin(), subdirs.end(), std::string(child));
+        if (it != subdirs.end()) subdirs.erase(it);
+        else watch_remove_dir(up, i);
+    }
+
+    if (depth >= WATCH_MAX_DEPTH) return;
+
+    const rom_dir_t *parent_dir = &g_rom_catalog.dirs[(*up->dirs)[idx].dir_id];
+    uint32_t prefix_ofs = parent_dir->prefix_ofs;
+    size_t prefix_len = strlen(catalog_string(prefix_ofs));
+
+    for (const std::string &sub : subdirs) {
+        int dir_id = catalog_add_dir_ofs(prefix_ofs, catalog_add_string(sub.c_str() + prefix_len));
+        if (dir_id < 0) break;
+
+        rom_index_dir_t index = {};
+        index.dir_id = dir_id;
+        index.station_id = up->station->id;
+        index.ext_hash = ext_hash(up->station->extensions);
+        index.parent = idx;
+        up->dirs->push_back(index);
+        up->roms.emplace_back();
+        up->removed.push_back(0);
+
+        watch_add(up->station->id, sub.c_str());
+        watch_read_dir(up, up->dirs->size() - 1, depth + 1);
+    }
+}
+
+// Rereads the changed directories of the station and replaces its ROMs
+static int watch_update_station(uint32_t station_id)
+{
+    std::vector<std::string> paths;
+    paths.swap(watch_dirty[station_id]);
+
+    rom_station_t *station = &g_rom_catalog.stations[station_id];
+    if (!station->enabled || paths.empty()) return 0;
+
+    // Station ROMs are contiguous in the catalog
+    uint32_t first = g_rom_catalog.rom_count;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        if (g_rom_catalog.roms[i].station_id == station_id) {
+            first = i;
+            break;
+        }
+    }
+    if (first + station->rom_count > g_rom_catalog.rom_count) return 0;
+
+    watch_update_t up;
+    up.station = station;
+    up.dirs = &index_dirs[station_id];
+    up.roms.resize(up.dirs->size());
+    up.removed.resize(up.dirs->size());
+    for (size_t i = 0; i < up.dirs->size(); i++) {
+        const rom_index_dir_t &dir = (*up.dirs)[i];
+        if (dir.rom_first + dir.rom_count > station->rom_count) return 0;
+        const rom_entry_t *roms = g_rom_catalog.roms + first + dir.rom_first;
+        up.roms[i].assign(roms, roms + dir.rom_count);
+    }
+
+    for (const std::string &path : paths) {
+        int idx = watch_find_dir(&up, path.c_str());
+        if (idx >= 0) {
+            int depth = 0;
+            for (int p = (*up.dirs)[idx].parent; p >= 0; p = (*up.dirs)[p].parent) depth++;
+            watch_read_dir(&up, idx, depth);
+        }
+    }
+
+    // Drop removed directories from the index, parents are renumbered
+    rom_index_dirs_t dirs;
+    std::vector<rom_entry_t> roms;
+    std::vector<int> dir_map(up.dirs->size(), -1);
+    for (size_t i = 0; i < up.dirs->size(); i++) {
+        if (up.removed[i]) continue;
+
+        rom_index_dir_t dir = (*up.dirs)[i];
+        dir.parent = (dir.parent >= 0) ? dir_map[dir.parent] : -1;
+        dir.rom_first = roms.size();
+        dir.rom_count = up.roms[i].size();
+        roms.insert(roms.end(), up.roms[i].begin(), up.roms[i].end());
+
+        dir_map[i] = dirs.size();
+        dirs.push_back(dir);
+    }
+    up.dirs->swap(dirs);
+
+    // Nothing a ROM list shows changed (e.g. only previews were written)
+    if (roms.size() == station->rom_count) {
+        uint32_t i = 0;
+        for (; i < roms.size(); i++) {
+            const rom_entry_t &a = roms[i];
+            const rom_entry_t &b = g_rom_catalog.roms[first + i];
+            if (a.dir_id != b.dir_id || a.size != b.size || a.date != b.date || a.flags != b.flags ||
+                strcmp(catalog_string(a.filename_ofs), catalog_string(b.filename_ofs))) break;
+        }
+        if (i == roms.size()) return 0;
+    }
+
+    // Replace the ROMs of the station, as a scan merge does
+    sort_remove_station(station_id);
+    int write_idx = 0;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        if (g_rom_catalog.roms[i].station_id != station_id) {
+            if (write_idx != (int)i) {
+                g_rom_catalog.roms[write_idx] = g_rom_catalog.roms[i];
+            }
+            write_idx++;
+        }
+    }
+    g_rom_catalog.rom_count = write_idx;
+    station->rom_count = 0;
+
+    for (const rom_entry_t &rom : roms) {
+        rom_entry_t *dst = alloc_rom_entry();
+        if (!dst) break;
+        *dst = rom;
+        station->rom_count++;
+    }
+    sort_add_station(station_id, write_idx, station->rom_count);
+
+    return 1;
+}
+
+static int dedup_poll(void);
+
+int rom_catalog_watch_poll(void)
+{
+    if (!g_rom_catalog.initialized) return 0;
+    if (watch_fd >= 0) watch_drain();
+
+    // Scan results replace the station trees, the watches follow afterwards
+    if (g_rom_catalog.scanning) {
+        rom_scan_poll();
+        return 0;
+    }
+
+    if (watch_save && CheckTimer(watch_save)) {
+        watch_save = 0;
+        rom_index_save();
+    }
+
+    if (!watch_settle || !CheckTimer(watch_settle)) return dedup_poll();
+    watch_settle = 0;
+
+    // Changes were lost, only a scan can tell
+    if (watch_overflow) {
+        watch_overflow = 0;
+        for (int i = 0; i < ROM_MAX_STATIONS; i++) watch_dirty[i].clear();
+        printf("ROM catalog: file change queue overflowed, rescanning.\n");
+        rom_scan_start();
+        return 0;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) changed |= watch_update_station(i);
+    if (changed) {
+        g_rom_catalog.generation++;
+        if (dedup_build()) sort_orders_build();
+    }
+
+    // Reread ROMs leave their strings behind
+    if (g_rom_catalog.strings_size > watch_compact_size + watch_compact_size / 4) {
+        catalog_compact();
+        watch_compact_size = g_rom_catalog.strings_size;
+    } else if (changed) {
+        search_index_build();
+        catalog_account();
+    }
+
+    // Directory times of the index changed either way
+    watch_save = GetTimer(WATCH_SAVE_MS);
+    if (!changed) return 0;
+
+    search_last_filter[0] = 0;
+    rebuild_filtered_list();
+    if (iSelectedEntry >= filtered_count) iSelectedEntry = filtered_count ? filtered_count - 1 : 0;
+    if (iFirstEntry > iSelectedEntry) iFirstEntry = iSelectedEntry;
+    return 1;
+}
+
+/*****************************************************************************
+ * Duplicates
+ *****************************************************************************/
+
+#define DEDUP_SETTLE_MS  2000
+
+static int dedup_pending = 0;
+static unsigned long dedup_timer = 0;
+
+// Lower is faster to load
+static int dedup_rank(const rom_entry_t *rom, std::vector<int8_t> &dir_net)
+{
+    int rank = 0;
+
+    const char *ext = strrchr(catalog_string(rom->filename_ofs), '.');
+    if (ext && !strcasecmp(ext, ".zip")) rank += 1;
+
+    if (rom->dir_id < dir_net.size()) {
+        if (dir_net[rom->dir_id] < 0) {
+            char path[ROM_PATH_LEN];
+            catalog_dir_path(rom->dir_id, path, sizeof(path));
+            dir_net[rom->dir_id] = is_network_fs(path);
+        }
+        if (dir_net[rom->dir_id]) rank += 2;
+    }
+
+    return rank;
+}
+
+static uint64_t dedup_key(const rom_entry_t *rom)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (const char *p = catalog_string(rom->name_ofs); *p; p++) h = (h ^ (uint8_t)tolower(*p)) * 0x100000001B3ULL;
+    h = (h ^ rom->crc) * 0x100000001B3ULL;
+    return (h ^ rom->station_id) * 0x100000001B3ULL;
+}
+
+static int dedup_same(const rom_entry_t *a, const rom_entry_t *b)
+{
+    return a->crc == b->crc && a->station_id == b->station_id &&
+           !strcasecmp(catalog_string(a->name_ofs), catalog_string(b->name_ofs));
+}
+
+// Flags all but the fastest copy of each ROM, returns 1 if any flag changed.
+// Equal ranks keep the first one, games/ is scanned before the root fallback.
+static int dedup_build(void)
+{
+    dedup_pending = 0;
+
+    std::unordered_map<uint64_t, uint32_t> best;
+    std::vector<int8_t> dir_net(g_rom_catalog.dir_count, -1);
+    std::vector<uint8_t> rank(g_rom_catalog.rom_count);
+
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        const rom_entry_t *rom = &g_rom_catalog.roms[i];
+        if (!rom->crc) continue;
+
+        rank[i] = dedup_rank(rom, dir_net);
+        auto it = best.emplace(dedup_key(rom), i);
+        if (!it.second && rank[i] < rank[it.first->second] && dedup_same(rom, &g_rom_catalog.roms[it.first->second])) {
+            it.first->second = i;
+        }
+    }
+
+    int changed = 0;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
+        rom_entry_t *rom = &g_rom_catalog.roms[i];
+        int dup = 0;
+        if (rom->crc) {
+            uint32_t first = best[dedup_key(rom)];
+            dup = first != i && dedup_same(rom, &g_rom_catalog.roms[first]);
+        }
+
+        if (!!(rom->flags & ROM_FLAG_DUPLICATE) != dup) {
+            rom->flags ^= ROM_FLAG_DUPLICATE;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+// Folds the CRCs reported meanwhile once they stopped coming in
+static int dedup_poll(void)
 {
-    if (station_id >= ROM_MAX_STATIONS) return -1;
+    if (!dedup_pending || !CheckTimer(dedup_timer) || !dedup_build()) return 0;
 
-    memcpy(&g_rom_catalog.stations[station_id], station, sizeof(rom_station_t));
-    rom_catalog_save();
+    sort_orders_build();
+    search_last_filter[0] = 0;
+    rebuild_filtered_list();
+    if (iSelectedEntry >= filtered_count) iSelectedEntry = filtered_count ? filtered_count - 1 : 0;
+    if (iFirstEntry > iSelectedEntry) iFirstEntry = iSelectedEntry;
+    catalog_account();
 
-    return 0;
+    watch_save = GetTimer(WATCH_SAVE_MS);
+    return 1;
 }
 
-rom_station_t* rom_station_get(uint32_t station_id)
+void rom_catalog_set_crc(uint32_t index, uint32_t crc)
 {
-    if (station_id >= ROM_MAX_STATIONS) return NULL;
-    if (!g_rom_catalog.stations[station_id].enabled) return NULL;
-    return &g_rom_catalog.stations[station_id];
+    if (index >= g_rom_catalog.rom_count || g_rom_catalog.roms[index].crc == crc) return;
+
+    g_rom_catalog.roms[index].crc = crc;
+    dedup_pending = 1;
+    dedup_timer = GetTimer(DEDUP_SETTLE_MS);
+    watch_save = GetTimer(WATCH_SAVE_MS);
 }
 
-rom_station_t* rom_station_get_by_index(int index)
+int rom_get_locations(const rom_entry_t *rom, const rom_entry_t **locations, int max)
 {
+    if (!rom || max < 1) return 0;
+
     int count = 0;
-    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
-        if (g_rom_catalog.stations[i].enabled) {
-            if (count == index) {
-                return &g_rom_catalog.stations[i];
-            }
-            count++;
-        }
-    }
-    return NULL;
-}
+    locations[count++] = rom;
+    if (!rom->crc) return count;
 
-int rom_station_count(void)
-{
-    return g_rom_catalog.station_count;
+    for (uint32_t i = 0; i < g_rom_catalog.rom_count && count < max; i++) {
+        const rom_entry_t *other = &g_rom_catalog.roms[i];
+        if (other != rom && dedup_same(rom, other)) locations[count++] = other;
+    }
+    return count;
 }
 
 /*****************************************************************************
- * ROM Scanning
+ * Sort Orders
  *****************************************************************************/
 
-static int add_rom_entry(rom_station_t *station, const char *path, const char *filename,
-                         uint32_t size, uint32_t date)
+// Compares like strcasecmp for names differing in the first 8 characters
+static uint64_t sort_name_key(const char *name)
 {
-    // Ensure capacity
-    if (g_rom_catalog.rom_count >= g_rom_catalog.rom_capacity) {
-        uint32_t new_capacity = g_rom_catalog.rom_capacity * 2;
-        rom_entry_t *new_roms = (rom_entry_t*)realloc(g_rom_catalog.roms,
-                                                       new_capacity * sizeof(rom_entry_t));
-        if (!new_roms) return -1;
-        g_rom_catalog.roms = new_roms;
-        g_rom_catalog.rom_capacity = new_capacity;
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*name) key |= (uint8_t)tolower(*name++);
     }
+    return key;
+}
 
-    rom_entry_t *rom = &g_rom_catalog.roms[g_rom_catalog.rom_count];
-    memset(rom, 0, sizeof(rom_entry_t));
+static bool sort_less(int order, uint32_t a, uint32_t b)
+{
+    const rom_entry_t *ra = &g_rom_catalog.roms[a];
+    const rom_entry_t *rb = &g_rom_catalog.roms[b];
 
-    extract_display_name(filename, rom->name, sizeof(rom->name));
-    strncpy(rom->filename, filename, sizeof(rom->filename) - 1);
-    strncpy(rom->path, path, sizeof(rom->path) - 1);
-    rom->station_id = station->id;
-    rom->size = size;
-    rom->date = date;
+    if (order == SORT_ORDER_DATE && ra->date != rb->date) return ra->date < rb->date;
+    if (order == SORT_ORDER_SIZE && ra->size != rb->size) return ra->size < rb->size;
+    if (sort_name_keys[a] != sort_name_keys[b]) return sort_name_keys[a] < sort_name_keys[b];
 
-    // Check for preview image
-    char preview_path[ROM_PATH_LEN];
-    snprintf(preview_path, sizeof(preview_path), "%s/previews/%s.png",
-             getFullPath(GAMES_DIR), rom->name);
-    if (FileExists(preview_path, 0)) {
-        rom->has_preview = 1;
-        strncpy(rom->preview_path, preview_path, sizeof(rom->preview_path) - 1);
-    } else {
-        // Try station-specific preview folder
-        snprintf(preview_path, sizeof(preview_path), "%s/%s/previews/%s.png",
-                 getFullPath(GAMES_DIR), station->short_name, rom->name);
-        if (FileExists(preview_path, 0)) {
-            rom->has_preview = 1;
-            strncpy(rom->preview_path, preview_path, sizeof(rom->preview_path) - 1);
+    int res = strcasecmp(catalog_string(ra->name_ofs), catalog_string(rb->name_ofs));
+    return res ? res < 0 : a < b;
+}
+
+// Station orders are station name orders one after the other, nothing to compare
+static void sort_station_orders_build(void)
+{
+    for (int desc = 0; desc < 2; desc++) {
+        rom_order_t &order = sort_orders[desc ? SORT_ORDER_STATION_DESC : SORT_ORDER_STATION_ASC];
+        order.clear();
+        order.reserve(g_rom_catalog.rom_count);
+        for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+            int id = desc ? ROM_MAX_STATIONS - 1 - i : i;
+            for (uint32_t rel : station_orders[id][SORT_ORDER_NAME]) order.push_back(station_first[id] + rel);
         }
     }
+}
 
-    g_rom_catalog.rom_count++;
-    station->rom_count++;
+// Sorts the newly appended ROMs of the station and merges them into the catalog orders
+static void sort_add_station(uint32_t station_id, uint32_t first, uint32_t count)
+{
+    if (sort_name_keys.size() != first) return;
 
-    return 0;
+    station_first[station_id] = first;
+    station_count[station_id] = count;
+    for (uint32_t i = 0; i < count; i++) {
+        sort_name_keys.push_back(sort_name_key(catalog_string(g_rom_catalog.roms[first + i].name_ofs)));
+    }
+
+    // Duplicates are left out of the orders
+    rom_order_t listed;
+    listed.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(g_rom_catalog.roms[first + i].flags & ROM_FLAG_DUPLICATE)) listed.push_back(i);
+    }
+
+    for (int o = 0; o < SORT_STATION_ORDERS; o++) {
+        rom_order_t &order = station_orders[station_id][o];
+        order = listed;
+        std::sort(order.begin(), order.end(), [o, first](uint32_t a, uint32_t b) {
+            return sort_less(o, first + a, first + b);
+        });
+
+        uint32_t n = order.size();
+        rom_order_t added(n), merged(sort_orders[o].size() + n);
+        for (uint32_t i = 0; i < n; i++) added[i] = first + order[i];
+        std::merge(sort_orders[o].begin(), sort_orders[o].end(), added.begin(), added.end(), merged.begin(),
+                   [o](uint32_t a, uint32_t b) { return sort_less(o, a, b); });
+        sort_orders[o].swap(merged);
+    }
+
+    sort_station_orders_build();
 }
 
-static void scan_directory_recursive(rom_station_t *station, const char *dir_path, int depth)
+// Called before the (contiguous) ROMs of the station are removed, later ROMs move down
+static void sort_remove_station(uint32_t station_id)
 {
-    if (depth > 5 || scan_cancel_flag) return;  // Max recursion depth
+    uint32_t first = station_first[station_id];
+    uint32_t count = station_count[station_id];
+    for (int o = 0; o < SORT_STATION_ORDERS; o++) rom_order_t().swap(station_orders[station_id][o]);
+    station_count[station_id] = 0;
+    if (!count) return;
+
+    for (int o = 0; o < SORT_STATION_ORDERS; o++) {
+        rom_order_t &order = sort_orders[o];
+        size_t n = 0;
+        for (uint32_t idx : order) {
+            if (idx < first) order[n++] = idx;
+            else if (idx >= first + count) order[n++] = idx - count;
+        }
+        order.resize(n);
+    }
 
-    DIR *dir = opendir(dir_path);
-    if (!dir) return;
+    if (first + count <= sort_name_keys.size()) {
+        sort_name_keys.erase(sort_name_keys.begin() + first, sort_name_keys.begin() + first + count);
+    }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && !scan_cancel_flag) {
-        if (entry->d_name[0] == '.') continue;
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (station_first[i] > first) station_first[i] -= count;
+    }
 
-        char full_path[ROM_PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+    sort_station_orders_build();
+}
 
-        struct stat st;
-        if (stat(full_path, &st) < 0) continue;
+static void sort_orders_free(void)
+{
+    for (int o = 0; o < SORT_ORDER_COUNT; o++) rom_order_t().swap(sort_orders[o]);
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        for (int o = 0; o < SORT_STATION_ORDERS; o++) rom_order_t().swap(station_orders[i][o]);
+        station_first[i] = 0;
+        station_count[i] = 0;
+    }
+    std::vector<uint64_t>().swap(sort_name_keys);
+    view_order = NULL;
+}
 
-        if (S_ISDIR(st.st_mode)) {
-            // Recurse into subdirectory
-            scan_directory_recursive(station, full_path, depth + 1);
-        } else if (S_ISREG(st.st_mode)) {
-            // Check if file matches extensions
-            if (match_extension(entry->d_name, station->extensions)) {
-                add_rom_entry(station, full_path, entry->d_name, st.st_size, st.st_mtime);
-            }
+// Whole catalog, station ROMs are contiguous
+static void sort_orders_build(void)
+{
+    sort_orders_free();
+
+    uint32_t i = 0;
+    while (i < g_rom_catalog.rom_count) {
+        uint32_t id = g_rom_catalog.roms[i].station_id;
+        uint32_t end = i;
+        while (end < g_rom_catalog.rom_count && g_rom_catalog.roms[end].station_id == id) end++;
+        if (station_count[id]) {
+            printf("ROM catalog: ROMs of station %u are not contiguous.\n", id);
+            break;
         }
+        sort_add_station(id, i, end - i);
+        i = end;
     }
+}
 
-    closedir(dir);
+/*****************************************************************************
+ * ROM Browsing
+ *****************************************************************************/
+
+static inline uint32_t search_trigram(const char *p)
+{
+    uint32_t h = ((uint8_t)tolower(p[0]) << 16) | ((uint8_t)tolower(p[1]) << 8) | (uint8_t)tolower(p[2]);
+    return (h * 2654435761u) >> (32 - SEARCH_TRI_BITS);
 }
 
-int rom_scan_station(uint32_t station_id)
+static void search_index_free(void)
 {
-    rom_station_t *station = rom_station_get(station_id);
-    if (!station) return -1;
+    free(search_tri_start);
+    free(search_tri_postings);
+    search_tri_start = NULL;
+    search_tri_postings = NULL;
+    search_tri_rom_count = 0;
+}
 
-    scan_cancel_flag = 0;
-    g_rom_catalog.scanning = 1;
-    snprintf(g_rom_catalog.scan_status, sizeof(g_rom_catalog.scan_status),
-             "Scanning %s...", station->short_name);
+static void search_index_build(void)
+{
+    search_index_free();
+    search_last_filter[0] = 0;
+
+    uint32_t count = g_rom_catalog.rom_count;
+    if (!count) return;
+
+    uint32_t *start = (uint32_t*)calloc(SEARCH_TRI_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t *last = (uint32_t*)malloc(SEARCH_TRI_BUCKETS * sizeof(uint32_t));
+    if (!start || !last) {
+        free(start);
+        free(last);
+        return;
+    }
 
-    // Remove existing ROMs for this station first
-    int write_idx = 0;
-    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
-        if (g_rom_catalog.roms[i].station_id != station_id) {
-            if (write_idx != (int)i) {
-                g_rom_catalog.roms[write_idx] = g_rom_catalog.roms[i];
+    // Pass 1: count ROMs per trigram (each ROM once per bucket)
+    memset(last, 0xFF, SEARCH_TRI_BUCKETS * sizeof(uint32_t));
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const char *name = catalog_string(g_rom_catalog.roms[i].name_ofs);
+        for (int j = 0; name[j] && name[j + 1] && name[j + 2]; j++) {
+            uint32_t t = search_trigram(name + j);
+            if (last[t] != i) {
+                last[t] = i;
+                start[t + 1]++;
+                total++;
             }
-            write_idx++;
         }
     }
-    g_rom_catalog.rom_count = write_idx;
-    station->rom_count = 0;
 
-    // Build full path to ROM directory
-    char full_path[ROM_PATH_LEN];
+    for (uint32_t t = 0; t < SEARCH_TRI_BUCKETS; t++) start[t + 1] += start[t];
 
-    // Try different storage locations
-    const char *storage_dirs[] = {
-        getFullPath(GAMES_DIR),  // games/
-        getFullPath(""),         // root
-        NULL
-    };
+    uint32_t *postings = (uint32_t*)malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!postings) {
+        free(start);
+        free(last);
+        return;
+    }
 
-    for (int i = 0; storage_dirs[i] && !scan_cancel_flag; i++) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", storage_dirs[i], station->rom_path);
-        if (PathIsDir(full_path, 0)) {
-            scan_directory_recursive(station, full_path, 0);
+    // Pass 2: fill posting lists, ROM order keeps them sorted
+    uint32_t *pos = last;
+    memcpy(pos, start, SEARCH_TRI_BUCKETS * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        const char *name = catalog_string(g_rom_catalog.roms[i].name_ofs);
+        for (int j = 0; name[j] && name[j + 1] && name[j + 2]; j++) {
+            uint32_t t = search_trigram(name + j);
+            if (pos[t] == start[t] || postings[pos[t] - 1] != i) postings[pos[t]++] = i;
         }
     }
 
-    g_rom_catalog.scanning = 0;
-    rebuild_filtered_list();
-
-    return station->rom_count;
+    free(last);
+    search_tri_start = start;
+    search_tri_postings = postings;
+    search_tri_rom_count = count;
 }
 
-int rom_scan_all(void)
+static inline int filter_match(const rom_entry_t *rom)
 {
-    scan_cancel_flag = 0;
-    g_rom_catalog.scanning = 1;
-    int total = 0;
+    // Filter by station
+    if (browse_station_filter >= 0 && (int)rom->station_id != browse_station_filter) return 0;
 
-    for (int i = 0; i < ROM_MAX_STATIONS && !scan_cancel_flag; i++) {
-        if (g_rom_catalog.stations[i].enabled) {
-            g_rom_catalog.scan_progress = (i * 100) / g_rom_catalog.station_count;
-            total += rom_scan_station(i);
-        }
+    // Filter by search text
+    if (search_filter[0] && !strcasestr(catalog_string(rom->name_ofs), search_filter)) return 0;
+
+    return 1;
+}
+
+static rom_sort_mode_t current_sort_mode = ROM_SORT_NAME_ASC;
+
+// Ready-made order for the sort mode and station filter, station orders are relative to base
+static const rom_order_t* view_select(rom_sort_mode_t mode, uint32_t *base, int *reverse)
+{
+    int order = SORT_ORDER_NAME;
+    *reverse = 0;
+    switch (mode) {
+        case ROM_SORT_NAME_DESC:    *reverse = 1; break;
+        case ROM_SORT_STATION_ASC:  order = SORT_ORDER_STATION_ASC; break;
+        case ROM_SORT_STATION_DESC: order = SORT_ORDER_STATION_DESC; break;
+        case ROM_SORT_DATE_ASC:     order = SORT_ORDER_DATE; break;
+        case ROM_SORT_DATE_DESC:    order = SORT_ORDER_DATE; *reverse = 1; break;
+        case ROM_SORT_SIZE_ASC:     order = SORT_ORDER_SIZE; break;
+        case ROM_SORT_SIZE_DESC:    order = SORT_ORDER_SIZE; *reverse = 1; break;
+        default: break;
     }
 
-    g_rom_catalog.scanning = 0;
-    g_rom_catalog.scan_progress = 100;
-    strcpy(g_rom_catalog.scan_status, "Scan complete");
+    *base = 0;
+    if (browse_station_filter >= 0 && browse_station_filter < ROM_MAX_STATIONS) {
+        // Within one station it's sorted by name
+        if (order >= SORT_STATION_ORDERS) order = SORT_ORDER_NAME;
+        *base = station_first[browse_station_filter];
+        return &station_orders[browse_station_filter][order];
+    }
 
-    return total;
+    return &sort_orders[order];
 }
 
-void rom_scan_cancel(void)
+static inline uint32_t view_order_at(int k)
 {
-    scan_cancel_flag = 1;
+    k = view_reverse ? (int)view_order->size() - 1 - k : k;
+    return view_base + (*view_order)[k];
 }
 
-int rom_scan_progress(void)
+// ROM at the position of the current view, NULL if the catalog changed under it
+static rom_entry_t* view_get(int k)
 {
-    return g_rom_catalog.scan_progress;
+    if (k < 0 || k >= filtered_count) return NULL;
+
+    uint32_t idx;
+    if (filtered_roms) idx = filtered_roms[k];
+    else if (view_order && (size_t)k < view_order->size()) idx = view_order_at(k);
+    else return NULL;
+
+    return (idx < g_rom_catalog.rom_count) ? &g_rom_catalog.roms[idx] : NULL;
 }
 
-const char* rom_scan_status(void)
+// Search text only got longer around the previous one: keep the subset (and its order)
+static int refine_filtered_list(void)
 {
-    return g_rom_catalog.scan_status;
-}
+    if (!filtered_roms || !search_last_filter[0] || search_last_station != browse_station_filter) return 0;
+    if (!strcasestr(search_filter, search_last_filter)) return 0;
 
-/*****************************************************************************
- * ROM Browsing
- *****************************************************************************/
+    int count = 0;
+    for (int i = 0; i < filtered_count; i++) {
+        if (filter_match(&g_rom_catalog.roms[filtered_roms[i]])) filtered_roms[count++] = filtered_roms[i];
+    }
+    filtered_count = count;
+    return 1;
+}
 
 static void rebuild_filtered_list(void)
 {
+    int refine = search_filter[0] && refine_filtered_list();
+
+    strcpy(search_last_filter, search_filter);
+    search_last_station = browse_station_filter;
+    if (refine) return;
+
     // Free old list
-    if (filtered_roms) {
-        free(filtered_roms);
-        filtered_roms = NULL;
-    }
+    free(filtered_roms);
+    filtered_roms = NULL;
+
+    view_order = view_select(current_sort_mode, &view_base, &view_reverse);
+    filtered_count = view_order->size();
+    if (!search_filter[0]) return;
 
+    int count = filtered_count;
     filtered_count = 0;
-    filtered_capacity = g_rom_catalog.rom_count > 0 ? g_rom_catalog.rom_count : 64;
-    filtered_roms = (rom_entry_t**)malloc(filtered_capacity * sizeof(rom_entry_t*));
+    filtered_roms = (uint32_t*)malloc((count ? count : 1) * sizeof(uint32_t));
     if (!filtered_roms) return;
 
-    for (uint32_t i = 0; i < g_rom_catalog.rom_count; i++) {
-        rom_entry_t *rom = &g_rom_catalog.roms[i];
-
-        // Filter by station
-        if (browse_station_filter >= 0 && (int)rom->station_id != browse_station_filter) {
-            continue;
+    // Only check ROMs sharing the rarest trigram of the search text, the matches
+    // are marked and picked up in view order
+    if (strlen(search_filter) >= 3 && search_tri_start && search_tri_rom_count == g_rom_catalog.rom_count) {
+        uint32_t best = 0, best_len = UINT32_MAX;
+        for (int j = 0; search_filter[j + 2]; j++) {
+            uint32_t t = search_trigram(search_filter + j);
+            uint32_t len = search_tri_start[t + 1] - search_tri_start[t];
+            if (len < best_len) {
+                best = t;
+                best_len = len;
+            }
         }
 
-        // Filter by search text
-        if (search_filter[0]) {
-            if (!strcasestr(rom->name, search_filter)) {
-                continue;
+        std::vector<uint8_t> match(g_rom_catalog.rom_count);
+        int matches = 0;
+        for (uint32_t i = search_tri_start[best]; i < search_tri_start[best + 1]; i++) {
+            uint32_t idx = search_tri_postings[i];
+            if (filter_match(&g_rom_catalog.roms[idx])) {
+                match[idx] = 1;
+                matches++;
             }
         }
 
-        filtered_roms[filtered_count++] = rom;
+        for (int k = 0; k < count && filtered_count < matches; k++) {
+            uint32_t idx = view_order_at(k);
+            if (idx < g_rom_catalog.rom_count && match[idx]) filtered_roms[filtered_count++] = idx;
+        }
+        return;
+    }
+
+    for (int k = 0; k < count; k++) {
+        uint32_t idx = view_order_at(k);
+        if (idx < g_rom_catalog.rom_count && filter_match(&g_rom_catalog.roms[idx])) filtered_roms[filtered_count++] = idx;
     }
 }
 
@@ -536,14 +2059,18 @@ void rom_browse_print(void)
                 continue;
             }
 
-            rom_entry_t *rom = filtered_roms[k];
+            rom_entry_t *rom = view_get(k);
+            if (!rom) {
+                OsdWrite(i, "", 0, 0);
+                continue;
+            }
             rom_station_t *station = rom_station_get(rom->station_id);
 
             // Format: "[SYS] ROM Name"
             if (station && browse_station_filter < 0) {
-                snprintf(s, sizeof(s), "[%.4s] %s", station->short_name, rom->name);
+                snprintf(s, sizeof(s), "[%.4s] %s", station->short_name, catalog_string(rom->name_ofs));
             } else {
-                snprintf(s, sizeof(s), " %s", rom->name);
+                snprintf(s, sizeof(s), " %s", catalog_string(rom->name_ofs));
             }
 
             // Trim to fit OSD width
@@ -568,16 +2095,15 @@ void rom_browse_print(void)
 
 void rom_browse_scroll_name(void)
 {
-    if (iSelectedEntry >= filtered_count) return;
-
-    rom_entry_t *rom = filtered_roms[iSelectedEntry];
+    rom_entry_t *rom = view_get(iSelectedEntry);
+    if (!rom) return;
     rom_station_t *station = rom_station_get(rom->station_id);
 
     static char name[ROM_NAME_LEN + 16];
     if (station && browse_station_filter < 0) {
-        snprintf(name, sizeof(name), "[%.4s] %s", station->short_name, rom->name);
+        snprintf(name, sizeof(name), "[%.4s] %s", station->short_name, catalog_string(rom->name_ofs));
     } else {
-        snprintf(name, sizeof(name), " %s", rom->name);
+        snprintf(name, sizeof(name), " %s", catalog_string(rom->name_ofs));
     }
 
     int len = strlen(name);
@@ -591,21 +2117,26 @@ int rom_browse_select(char *path, char *core_path, char *label)
     core_path[0] = 0;
     label[0] = 0;
 
-    if (!filtered_count || iSelectedEntry >= filtered_count) return 0;
-
-    rom_entry_t *rom = filtered_roms[iSelectedEntry];
+    rom_entry_t *rom = view_get(iSelectedEntry);
+    if (!rom) return 0;
     rom_station_t *station = rom_station_get(rom->station_id);
 
-    strcpy(path, rom->path);
-    strcpy(label, rom->name);
+    rom_get_path(rom, path, ROM_PATH_LEN);
 
-    if (station && station->core_path[0]) {
-        // Find the core RBF file
-        char core_search[ROM_PATH_LEN];
-        snprintf(core_search, sizeof(core_search), "_%s", station->core_path);
+    // Another copy when the listed one went away
+    const rom_entry_t *locations[8];
+    int count = rom_get_locations(rom, locations, 8);
+    for (int i = 1; i < count && !path_is_file(path); i++) {
+        char alt[ROM_PATH_LEN];
+        rom_get_path(locations[i], alt, sizeof(alt));
+        if (path_is_file(alt)) strcpy(path, alt);
+    }
+    strcpy(label, catalog_string(rom->name_ofs));
 
-        // The core will be loaded by the menu system
-        strcpy(core_path, core_search);
+    if (station && station->core_path[0]) {
+        // Newest RBF of the core, the menu system loads it
+        const char *rbf = rbf_index_core(station->core_path);
+        if (rbf) snprintf(core_path, ROM_PATH_LEN, "%s", rbf);
     }
 
     return 1;
@@ -621,55 +2152,44 @@ int rom_browse_get_first_index(void)
     return iFirstEntry;
 }
 
+rom_entry_t* rom_browse_get(int index)
+{
+    return view_get(index);
+}
+
 rom_entry_t* rom_get_selected(void)
 {
-    if (iSelectedEntry >= filtered_count) return NULL;
-    return filtered_roms[iSelectedEntry];
+    return view_get(iSelectedEntry);
 }
 
 /*****************************************************************************
  * Sorting
  *****************************************************************************/
 
-static rom_sort_mode_t current_sort_mode = ROM_SORT_NAME_ASC;
-
-static int compare_roms(const void *a, const void *b)
-{
-    const rom_entry_t *ra = *(const rom_entry_t**)a;
-    const rom_entry_t *rb = *(const rom_entry_t**)b;
-
-    switch (current_sort_mode) {
-        case ROM_SORT_NAME_ASC:
-            return strcasecmp(ra->name, rb->name);
-        case ROM_SORT_NAME_DESC:
-            return strcasecmp(rb->name, ra->name);
-        case ROM_SORT_STATION_ASC:
-            if (ra->station_id != rb->station_id)
-                return ra->station_id - rb->station_id;
-            return strcasecmp(ra->name, rb->name);
-        case ROM_SORT_STATION_DESC:
-            if (ra->station_id != rb->station_id)
-                return rb->station_id - ra->station_id;
-            return strcasecmp(ra->name, rb->name);
-        case ROM_SORT_DATE_ASC:
-            return ra->date - rb->date;
-        case ROM_SORT_DATE_DESC:
-            return rb->date - ra->date;
-        case ROM_SORT_SIZE_ASC:
-            return ra->size - rb->size;
-        case ROM_SORT_SIZE_DESC:
-            return rb->size - ra->size;
-        default:
-            return 0;
-    }
-}
-
+// Switching between ready-made orders, only a search result is picked again
 void rom_sort(rom_sort_mode_t mode)
 {
+    uint32_t base;
+    int reverse;
+    const rom_order_t *order = view_select(mode, &base, &reverse);
     current_sort_mode = mode;
-    if (filtered_roms && filtered_count > 0) {
-        qsort(filtered_roms, filtered_count, sizeof(rom_entry_t*), compare_roms);
+
+    if (!filtered_roms) {
+        view_order = order;
+        view_base = base;
+        view_reverse = reverse;
+        return;
+    }
+
+    // Same order the other way around
+    if (order == view_order && base == view_base) {
+        if (reverse != view_reverse) std::reverse(filtered_roms, filtered_roms + filtered_count);
+        view_reverse = reverse;
+        return;
     }
+
+    search_last_filter[0] = 0;
+    rebuild_filtered_list();
 }
 
 /*****************************************************************************
@@ -707,12 +2227,47 @@ const char* rom_get_station_name(uint32_t station_id)
     return "Unknown";
 }
 
-const char* rom_get_display_name(rom_entry_t *rom)
+const char* rom_get_display_name(const rom_entry_t *rom)
+{
+    if (rom) return catalog_string(rom->name_ofs);
+    return "";
+}
+
+const char* rom_get_filename(const rom_entry_t *rom)
 {
-    if (rom) return rom->name;
+    if (rom) return catalog_string(rom->filename_ofs);
     return "";
 }
 
+int rom_get_path(const rom_entry_t *rom, char *buf, int buf_len)
+{
+    if (!rom) {
+        if (buf_len) buf[0] = 0;
+        return 0;
+    }
+
+    int len = catalog_dir_path(rom->dir_id, buf, buf_len);
+    if (len >= buf_len) return len;
+    return len + snprintf(buf + len, buf_len - len, "/%s", catalog_string(rom->filename_ofs));
+}
+
+int rom_get_preview_path(const rom_entry_t *rom, char *buf, int buf_len)
+{
+    if (buf_len) buf[0] = 0;
+    if (!rom || !(rom->flags & ROM_FLAG_PREVIEW)) return 0;
+
+    if (rom->flags & ROM_FLAG_PREVIEW_GLOBAL) {
+        snprintf(buf, buf_len, "%s/previews/%s.png", getFullPath(GAMES_DIR), catalog_string(rom->name_ofs));
+    } else {
+        rom_station_t *station = rom_station_get(rom->station_id);
+        if (!station) return 0;
+        snprintf(buf, buf_len, "%s/%s/previews/%s.png", getFullPath(GAMES_DIR), station->short_name,
+                 catalog_string(rom->name_ofs));
+    }
+
+    return 1;
+}
+
 void rom_format_size(uint32_t size, char *buf, int buf_len)
 {
     if (size < 1024) {
@@ -804,3 +2359,246 @@ rom_entry_t* rom_get_by_index(int index)
     if (index < 0 || index >= (int)g_rom_catalog.rom_count) return NULL;
     return &g_rom_catalog.roms[index];
 }
+
+/*****************************************************************************
+ * Scale Benchmark
+ *****************************************************************************/
+
+#define BENCH_DIR        "bench/catalog"
+#define BENCH_PAGES      1000    // SCANF_NEXT_PAGE steps of the browse test
+
+static FILE *bench_json = NULL;
+static int bench_json_count = 0;
+
+static void bench_drop_caches(void)
+{
+    sync();
+    FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (f) {
+        fputs("3", f);
+        fclose(f);
+    }
+}
+
+static void bench_result(const char *tree, const char *test, uint64_t us, const char *extra = "")
+{
+    printf("catalog_bench %-9s %-15s: %llu.%03llu ms%s%s\n", tree, test,
+           (unsigned long long)(us / 1000), (unsigned long long)(us % 1000), *extra ? ", " : "", extra);
+    if (bench_json) {
+        fprintf(bench_json, "%s\n    { \"tree\": \"%s\", \"test\": \"%s\", \"us\": %llu%s%s }",
+                bench_json_count ? "," : "", tree, test, (unsigned long long)us, *extra ? ", " : "", extra);
+        bench_json_count++;
+    }
+}
+
+// Same names in every layout, so the preview folders fit all of them
+static void bench_rom_name(int i, char *buf, int len)
+{
+    static const char *words[] = {
+        "Super", "Mega", "Ultra", "Hyper", "Dragon", "Space", "Racing", "Soccer",
+        "Fighter", "Quest", "Legend", "Ninja", "Star", "Shadow", "Tennis", "Puzzle"
+    };
+    static const char *regions[] = { "USA", "Europe", "Japan", "World" };
+
+    uint32_t h = (uint32_t)i * 2654435761u;
+    snprintf(buf, len, "%s %s %06d (%s).bin", words[h >> 28], words[(h >> 24) & 15], i, regions[(h >> 22) & 3]);
+}
+
+static int bench_touch(const char *path)
+{
+    int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+// Tree of count files, made once and marked complete with .done
+static int bench_tree(const char *name, int count, int deep, int previews)
+{
+    char dir[ROM_PATH_LEN], path[ROM_PATH_LEN], rom[ROM_NAME_LEN];
+    snprintf(dir, sizeof(dir), "%s/%s", BENCH_DIR, name);
+    snprintf(path, sizeof(path), "%s/.done", dir);
+    if (FileExists(path, 0)) return 1;
+
+    printf("catalog_bench: creating %s\n", dir);
+    if (previews) snprintf(dir, sizeof(dir), "%s/%s/previews", BENCH_DIR, name);
+    if (!FileCreatePath(dir)) return 0;
+    snprintf(dir, sizeof(dir), "%s", getFullPath(dir));
+
+    for (int i = 0; i < count; i++) {
+        bench_rom_name(i, rom, sizeof(rom));
+        if (previews) {
+            char *ext = strrchr(rom, '.');
+            strcpy(ext, ".png");
+            snprintf(path, sizeof(path), "%s/%s", dir, rom);
+        } else if (deep) {
+            // 1000 folders three levels down
+            char sub[ROM_PATH_LEN];
+            snprintf(sub, sizeof(sub), "%s/%s/d%d/d%d/d%d", BENCH_DIR, name, i % 10, (i / 10) % 10, (i / 100) % 10);
+            if (i < 1000 && !FileCreatePath(sub)) return 0;
+            snprintf(path, sizeof(path), "%s/d%d/d%d/d%d/%s", dir, i % 10, (i / 10) % 10, (i / 100) % 10, rom);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", dir, rom);
+        }
+
+        if (!bench_touch(path)) return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/.done", BENCH_DIR, name);
+    return bench_touch(getFullPath(path));
+}
+
+// Fresh catalog with one station on the tree, previews are looked up in
+// games/<short_name>/previews, so the short name leads to the bench folders
+static void bench_station(const char *tree, const char *previews)
+{
+    rom_catalog_free();
+    rom_catalog_init();
+
+    rom_station_t *station = &g_rom_catalog.stations[0];
+    station->id = 0;
+    strcpy(station->name, "Benchmark");
+    snprintf(station->short_name, sizeof(station->short_name), "../%s/%s", BENCH_DIR, previews);
+    snprintf(station->rom_path, sizeof(station->rom_path), "%s/%s", BENCH_DIR, tree);
+    strcpy(station->extensions, "bin");
+    station->enabled = 1;
+    g_rom_catalog.station_count = 1;
+}
+
+static void bench_run_tree(const char *tree, int count)
+{
+    char extra[128], test[32];
+    char previews[16];
+    snprintf(previews, sizeof(previews), "p%dk", count / 1000);
+
+    // Previews cost two failed lookups per ROM without them, one hit with them
+    bench_station(tree, previews);
+    bench_drop_caches();
+    uint64_t t = trace_now_us();
+    int roms = rom_scan_station(0);
+    snprintf(extra, sizeof(extra), "\"roms\": %d", roms);
+    bench_result(tree, "scan_previews", trace_now_us() - t, extra);
+
+    bench_station(tree, "none");
+    bench_drop_caches();
+    uint32_t rss = mem_rss_kb();
+    t = trace_now_us();
+    roms = rom_scan_station(0);
+    uint64_t us = trace_now_us() - t;
+    snprintf(extra, sizeof(extra), "\"roms\": %d, \"catalog_kb\": %llu, \"rss_kb\": %d", roms,
+             (unsigned long long)(mem_current(MEM_CATALOG) >> 10), (int)(mem_rss_kb() - rss));
+    bench_result(tree, "scan_cold", us, extra);
+
+    // Unchanged folders come from the index
+    t = trace_now_us();
+    rom_scan_station(0);
+    bench_result(tree, "scan_rescan", trace_now_us() - t);
+
+    t = trace_now_us();
+    rom_browse_init(-1);
+    bench_result(tree, "browse_init", trace_now_us() - t);
+
+    for (int mode = ROM_SORT_NAME_ASC; mode <= ROM_SORT_SIZE_DESC; mode++) {
+        t = trace_now_us();
+        rom_sort((rom_sort_mode_t)mode);
+        snprintf(test, sizeof(test), "sort_%d", mode);
+        bench_result(tree, test, trace_now_us() - t);
+    }
+    rom_sort(ROM_SORT_NAME_ASC);
+
+    // Common word, rare number, no match, then typing that refines the result
+    static const char *filters[] = { "racing", "000123", "zzq", "s", "sh", "sha", "shad", "shadow n" };
+    for (uint32_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        t = trace_now_us();
+        rom_filter_set(filters[i]);
+        us = trace_now_us() - t;
+        snprintf(test, sizeof(test), "filter_%s", filters[i]);
+        for (char *c = test; *c; c++) if (*c == ' ') *c = '_';
+        snprintf(extra, sizeof(extra), "\"matches\": %d", rom_browse_available());
+        bench_result(tree, test, us, extra);
+    }
+
+    // Search result sorted again, then the whole list
+    rom_sort(ROM_SORT_DATE_DESC);
+    t = trace_now_us();
+    rom_sort(ROM_SORT_SIZE_ASC);
+    bench_result(tree, "sort_filtered", trace_now_us() - t);
+    t = trace_now_us();
+    rom_filter_clear();
+    bench_result(tree, "filter_clear", trace_now_us() - t);
+
+    uint64_t max = 0;
+    rom_browse_scan(SCANF_INIT);
+    t = trace_now_us();
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        uint64_t s = trace_now_us();
+        rom_browse_scan(SCANF_NEXT_PAGE);
+        rom_get_selected();
+        max = std::max(max, trace_now_us() - s);
+    }
+    rom_browse_scan(SCANF_END);
+    snprintf(extra, sizeof(extra), "\"max_us\": %llu", (unsigned long long)max);
+    bench_result(tree, "browse_pages", trace_now_us() - t, extra);
+}
+
+int rom_catalog_bench(int max_files)
+{
+    if (g_rom_catalog.scanning) return 0;
+    if (max_files <= 0) max_files = 100000;
+
+    static const int sizes[] = { 10000, 50000, 100000 };
+    char path[ROM_PATH_LEN];
+
+    if (!FileCreatePath(BENCH_DIR)) {
+        printf("catalog_bench: cannot create %s\n", BENCH_DIR);
+        return 0;
+    }
+
+    // Trees and previews of all sizes first, their creation isn't timed
+    for (int s = 0; s < 3 && sizes[s] <= max_files; s++) {
+        int k = sizes[s] / 1000;
+        char name[16];
+        snprintf(name, sizeof(name), "flat%dk", k);
+        int ok = bench_tree(name, sizes[s], 0, 0);
+        snprintf(name, sizeof(name), "deep%dk", k);
+        ok = ok && bench_tree(name, sizes[s], 1, 0);
+        snprintf(name, sizeof(name), "p%dk", k);
+        ok = ok && bench_tree(name, sizes[s], 0, 1);
+        if (!ok) {
+            printf("catalog_bench: creating the trees failed\n");
+            return 0;
+        }
+    }
+
+    int was_initialized = g_rom_catalog.initialized;
+
+    snprintf(path, sizeof(path), "%s/catalog_bench.json", getFullPath(BENCH_DIR));
+    bench_json = fopen(path, "w");
+    bench_json_count = 0;
+    if (bench_json) fprintf(bench_json, "{\n  \"storage\": \"%s\",\n  \"results\": [", getRootDir());
+
+    for (int s = 0; s < 3 && sizes[s] <= max_files; s++) {
+        char tree[16];
+        snprintf(tree, sizeof(tree), "flat%dk", sizes[s] / 1000);
+        bench_run_tree(tree, sizes[s]);
+        snprintf(tree, sizeof(tree), "deep%dk", sizes[s] / 1000);
+        bench_run_tree(tree, sizes[s]);
+    }
+
+    if (bench_json) {
+        fprintf(bench_json, "\n  ]\n}\n");
+        fclose(bench_json);
+        bench_json = NULL;
+    }
+
+    // The user's catalog again, as it was saved
+    rom_catalog_free();
+    if (was_initialized) {
+        rom_catalog_init();
+        rom_catalog_load();
+        rom_browse_init(-1);
+    }
+
+    printf("catalog_bench: done, results in %s\n", path);
+    return 1;
+}
@@ -20,18 +20,35 @@
 #define ROM_PATH_LEN         1024    // Maximum path length
 #define ROM_EXT_LEN          32      // Maximum extension length
 
+// ROM entry flags
+#define ROM_FLAG_PREVIEW_GLOBAL  0x01    // Preview in games/previews/{name}.png
+#define ROM_FLAG_PREVIEW_STATION 0x02    // Preview in games/{station}/previews/{name}.png
+#define ROM_FLAG_PREVIEW         (ROM_FLAG_PREVIEW_GLOBAL | ROM_FLAG_PREVIEW_STATION)
+#define ROM_FLAG_DUPLICATE       0x04    // Same ROM as a faster location of the station, not listed
+
 // ROM entry structure
+// Kept small so sorting and filtering stay cache friendly. Strings live in
+// the catalog string arena, full paths are built from the directory table.
 typedef struct {
-    char name[ROM_NAME_LEN];         // Display name (without extension)
-    char filename[ROM_NAME_LEN];     // Actual filename
-    char path[ROM_PATH_LEN];         // Full path to ROM file
-    uint32_t station_id;             // Which station this ROM belongs to
+    uint32_t name_ofs;               // Display name (without extension) in string arena
+    uint32_t filename_ofs;           // Actual filename in string arena
+    uint32_t dir_id;                 // Directory the ROM is in
     uint32_t size;                   // File size in bytes
     uint32_t date;                   // File modification date (Unix timestamp)
-    uint8_t has_preview;             // 1 if preview image exists
-    char preview_path[ROM_PATH_LEN]; // Path to preview image (if exists)
+    uint32_t crc;                    // Content CRC32 from the hash index, 0 until hashed
+    uint8_t station_id;              // Which station this ROM belongs to
+    uint8_t flags;                   // ROM_FLAG_*
+    uint16_t reserved;
 } rom_entry_t;
 
+// Directory table entry, path is prefix + relative part
+typedef struct {
+    uint32_t prefix_ofs;             // Interned storage/station prefix in string arena
+    uint32_t rel_ofs;                // Remaining part of the path in string arena
+} rom_dir_t;
+
+#define ROM_MAX_PREFIXES     (ROM_MAX_STATIONS * 2)
+
 // Game station structure (user-configured)
 typedef struct {
     uint32_t id;                     // Unique station ID
@@ -51,10 +68,19 @@ typedef struct {
     rom_entry_t *roms;               // Dynamically allocated array of ROMs
     uint32_t rom_count;              // Total number of ROMs
     uint32_t rom_capacity;           // Allocated capacity
+    rom_dir_t *dirs;                 // Directory table
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+    char *strings;                   // String arena, offset 0 is ""
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    uint32_t prefix_ofs[ROM_MAX_PREFIXES]; // Interned path prefixes
+    uint32_t prefix_count;
     uint8_t initialized;             // Is catalog initialized?
     uint8_t scanning;                // Currently scanning?
     uint32_t scan_progress;          // Scan progress (0-100)
     char scan_status[256];           // Current scan status message
+    uint32_t generation;             // Bumped whenever ROM indices change
 } rom_catalog_t;
 
 // Predefined station templates for easy setup
@@ -90,12 +116,32 @@ rom_station_t* rom_station_get_by_index(int index);
 int  rom_station_count(void);
 
 // ROM scanning
+// Stations are scanned in parallel by worker threads into private buffers.
+// The catalog stays unchanged (browseable) until rom_scan_poll() merges the
+// results on the calling thread.
 int  rom_scan_station(uint32_t station_id);
-int  rom_scan_all(void);
+int  rom_scan_start(void);            // 0 if a scan is already running
+int  rom_scan_poll(void);             // 1 when the scan is done and merged
+int  rom_scan_all(void);              // blocking start + poll
 void rom_scan_cancel(void);
 int  rom_scan_progress(void);
 const char* rom_scan_status(void);
 
+// Live updates
+// Station folders are watched for added, removed and renamed ROMs, the
+// changed directories are reread once the changes settled. Duplicates are
+// folded again once new content hashes came in. Polled from the UI, returns
+// 1 when the browse lists changed.
+int  rom_catalog_watch_poll(void);
+
+// Duplicates
+// Copies of a ROM within a station (same name and content CRC, e.g. in
+// games/<station> and the root fallback, or zipped and unzipped) are listed
+// once, at the fastest location: local before network, unzipped before
+// zipped. The hash indexer reports the CRCs as it finds them.
+void rom_catalog_set_crc(uint32_t index, uint32_t crc);
+int  rom_get_locations(const rom_entry_t *rom, const rom_entry_t **locations, int max);  // Listed one first
+
 // ROM browsing
 int  rom_get_count(void);
 int  rom_get_count_for_station(uint32_t station_id);
@@ -111,6 +157,7 @@ void rom_browse_scroll_name(void);
 int  rom_browse_select(char *path, char *core_path, char *label);
 int  rom_browse_get_selected_index(void);
 int  rom_browse_get_first_index(void);
+rom_entry_t* rom_browse_get(int index);       // Entry of the browse list (filtered/sorted)
 int  rom_browse_available(void);
 
 // Preview handling
@@ -139,7 +186,19 @@ int  rom_filter_active(void);
 
 // Utility functions
 const char* rom_get_station_name(uint32_t station_id);
-const char* rom_get_display_name(rom_entry_t *rom);
+const char* rom_get_display_name(const rom_entry_t *rom);
+const char* rom_get_filename(const rom_entry_t *rom);
+int  rom_get_path(const rom_entry_t *rom, char *buf, int buf_len);
+int  rom_get_preview_path(const rom_entry_t *rom, char *buf, int buf_len);  // 0 if no preview
 void rom_format_size(uint32_t size, char *buf, int buf_len);
 
+// Scale benchmark
+// Synthetic station trees of 10k, 50k and 100k files (up to max_files, flat
+// and three folders deep) are made once under bench/catalog with preview
+// folders for them. Each is scanned with and without previews, rescanned,
+// sorted, filtered and browsed, times and catalog memory go to
+// bench/catalog/catalog_bench.json. The catalog is replaced while it runs
+// and loaded from its saved state afterwards. Needs the games folder.
+int  rom_catalog_bench(int max_files);
+
 #endif // ROM_CATALOG_H
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+
+#include "rom_hash.h"
+#include "rom_catalog.h"
+#include "file_io.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "hardware.h"
+#include "profiling.h"
+#include "crc.h"
+#include "swap_prim.h"
+#include "lib/md5/md5.h"
+#include "miniz.h"
+
+#define ROM_HASH_NAME     "romhash.bin"
+#define ROM_HASH_MAGIC    0x42444852 // "RHDB"
+#define ROM_HASH_VERSION  2
+#define ROM_HASH_CHUNK    (256 * 1024)
+#define ROM_HASH_MAX_SIZE (256 * 1024 * 1024) // CD images and such are not worth it
+#define ROM_HASH_HOLD_MS  5000               // quiet time before indexing resumes
+#define ROM_HASH_SAVE_MS  60000
+#define ROM_HASH_SKIPPED  0x80000000         // too big or unreadable, only size/mtime are valid
+
+struct rom_hash_rec
+{
+	uint64_t key;
+	uint32_t size;
+	uint32_t mtime;
+	rom_hash_t hash;
+};
+
+struct rom_hash_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t count;
+};
+
+static std::vector<rom_hash_rec> db;
+static int db_loaded = 0;
+static int db_dirty = 0;
+static uint32_t save_timer = 0;
+
+/* SHA-1 (FIPS 180-1), only used by the indexer */
+
+struct sha1_ctx
+{
+	uint32_t h[5];
+	uint64_t len;
+	uint8_t buf[64];
+	uint32_t used;
+};
+
+static inline uint32_t rol32(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static void sha1_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++) w[i] = (p[i * 4] << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (int i = 16; i < 80; i++) w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; i++)
+	{
+		uint32_t f, k;
+		if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+		else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+		else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+		uint32_t t = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+static void sha1_init(sha1_ctx *ctx)
+{
+	static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	memcpy(ctx->h, init, sizeof(init));
+	ctx->len = 0;
+	ctx->used = 0;
+}
+
+static void sha1_update(sha1_ctx *ctx, const uint8_t *data, uint32_t len)
+{
+	ctx->len += len;
+	if (ctx->used)
+	{
+		uint32_t n = std::min(64 - ctx->used, len);
+		memcpy(ctx->buf + ctx->used, data, n);
+		ctx->used += n;
+		data += n;
+		len -= n;
+		if (ctx->used < 64) return;
+		sha1_block(ctx->h, ctx->buf);
+		ctx->used = 0;
+	}
+
+	for (; len >= 64; data += 64, len -= 64) sha1_block(ctx->h, data);
+
+	memcpy(ctx->buf, data, len);
+	ctx->used = len;
+}
+
+static void sha1_final(sha1_ctx *ctx, uint8_t *out)
+{
+	uint64_t bits = ctx->len * 8;
+	uint8_t pad = 0x80;
+	sha1_update(ctx, &pad, 1);
+
+	pad = 0;
+	while (ctx->used != 56) sha1_update(ctx, &pad, 1);
+
+	uint8_t len[8];
+	for (int i = 0; i < 8; i++) len[i] = bits >> (56 - i * 8);
+	sha1_update(ctx, len, 8);
+
+	for (int i = 0; i < 20; i++) out[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/* Index store */
+
+// FNV-1a of the full path, doubled slashes count as one
+static uint64_t path_key(const char *path)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (const char *p = path; *p; p++)
+	{
+		if (*p == '/' && p[1] == '/') continue;
+		h ^= (uint8_t)*p;
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+static rom_hash_rec *db_find(uint64_t key)
+{
+	auto it = std::lower_bound(db.begin(), db.end(), key, [](const rom_hash_rec &r, uint64_t k) { return r.key < k; });
+	return (it != db.end() && it->key == key) ? &*it : NULL;
+}
+
+static void db_insert(const rom_hash_rec &rec)
+{
+	auto it = std::lower_bound(db.begin(), db.end(), rec.key, [](const rom_hash_rec &r, uint64_t k) { return r.key < k; });
+	if (it != db.end() && it->key == rec.key) *it = rec;
+	else db.insert(it, rec);
+	db_dirty++;
+}
+
+static void db_load()
+{
+	if (db_loaded) return;
+	db_loaded = 1;
+
+	int size = FileLoadConfig(ROM_HASH_NAME, 0, 0);
+	if (size < (int)sizeof(rom_hash_header)) return;
+
+	std::vector<uint8_t> data(size);
+	if (FileLoadConfig(ROM_HASH_NAME, data.data(), size) != size) return;
+
+	rom_hash_header hdr;
+	memcpy(&hdr, data.data(), sizeof(hdr));
+	if (hdr.magic != ROM_HASH_MAGIC || hdr.version != ROM_HASH_VERSION || hdr.rec_size != sizeof(rom_hash_rec) ||
+		sizeof(hdr) + (uint64_t)hdr.count * sizeof(rom_hash_rec) != (uint64_t)size)
+	{
+		printf("rom_hash: ignoring outdated %s\n", ROM_HASH_NAME);
+		return;
+	}
+
+	db.resize(hdr.count);
+	memcpy(db.data(), data.data() + sizeof(hdr), hdr.count * sizeof(rom_hash_rec));
+	printf("rom_hash: %u files indexed\n", hdr.count);
+}
+
+static void db_save()
+{
+	rom_hash_header hdr = { ROM_HASH_MAGIC, ROM_HASH_VERSION, sizeof(rom_hash_rec), (uint32_t)db.size() };
+
+	std::vector<uint8_t> data(sizeof(hdr) + db.size() * sizeof(rom_hash_rec));
+	memcpy(data.data(), &hdr, sizeof(hdr));
+	memcpy(data.data() + sizeof(hdr), db.data(), db.size() * sizeof(rom_hash_rec));
+
+	FileSaveConfig(ROM_HASH_NAME, data.data(), data.size());
+	db_dirty = 0;
+	save_timer = GetTimer(ROM_HASH_SAVE_MS);
+}
+
+/* Indexer */
+
+struct hash_job_t
+{
+	char path[1024];
+	rom_hash_rec rec;
+	int ok; // 1 hashed (or skipped), 0 paused, -1 failed
+};
+
+static hash_job_t job;
+static OffloadHandle job_handle;
+static int job_busy = 0;
+static std::atomic<int> job_pause(0);
+static uint32_t hold_timer = 0;
+
+static rom_entry_t *walk_roms = NULL;
+static uint32_t walk_count = 0;
+static uint32_t walk_generation = 0;
+static uint32_t walk_pos = 0;
+
+// CRC32 of the file in a zip holding just one, 0 for other zips
+static uint32_t zip_content_crc(const char *path)
+{
+	mz_zip_archive zip;
+	memset(&zip, 0, sizeof(zip));
+	if (!mz_zip_reader_init_file(&zip, path, 0)) return 0;
+
+	uint32_t crc = 0;
+	int files = 0;
+	for (mz_uint i = 0; i < mz_zip_reader_get_num_files(&zip); i++)
+	{
+		mz_zip_archive_file_stat st;
+		if (mz_zip_reader_is_file_a_directory(&zip, i) || !mz_zip_reader_file_stat(&zip, i, &st)) continue;
+		crc = st.m_crc32;
+		files++;
+	}
+
+	mz_zip_reader_end(&zip);
+	return (files == 1) ? crc : 0;
+}
+
+// Offload worker, plain file I/O only since file_io isn't thread safe
+static void hash_file(hash_job_t *j)
+{
+	TRACE_SCOPE("rom_hash_file");
+
+	j->ok = -1;
+	int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	struct stat64 st;
+	if (fstat64(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return;
+	}
+
+	rom_hash_rec *rec = &j->rec;
+	memset(&rec->hash, 0, sizeof(rec->hash));
+	rec->size = st.st_size;
+	rec->mtime = st.st_mtime;
+
+	uint8_t *buf = (st.st_size <= ROM_HASH_MAX_SIZE) ? (uint8_t*)malloc(ROM_HASH_CHUNK * 2) : NULL;
+	if (!buf)
+	{
+		close(fd);
+		rec->hash.flags = ROM_HASH_SKIPPED;
+		j->ok = 1;
+		return;
+	}
+
+	uint8_t *swap = buf + ROM_HASH_CHUNK;
+	MD5Context md5;
+	MD5Init(&md5);
+	sha1_ctx sha1;
+	sha1_init(&sha1);
+
+	uint32_t skip = rec->size & 0x3FF;
+	uint32_t pos = 0;
+	j->ok = 1;
+	while (pos < rec->size)
+	{
+		if (job_pause)
+		{
+			j->ok = 0;
+			break;
+		}
+
+		int len = read(fd, buf, ROM_HASH_CHUNK);
+		if (len <= 0)
+		{
+			j->ok = -1;
+			break;
+		}
+
+		if (!pos && len >= 4 && buf[0] == 0x80 && buf[1] == 0x37 && buf[2] == 0x12 && buf[3] == 0x40) rec->hash.flags |= ROM_HASH_SWAP16;
+
+		rec->hash.crc = crc32_update(rec->hash.crc, buf, len);
+		if (pos + len > skip)
+		{
+			uint32_t ofs = (pos < skip) ? skip - pos : 0;
+			rec->hash.crc_load = crc32_update(rec->hash.crc_load, buf + ofs, len - ofs);
+		}
+
+		if (rec->hash.flags & ROM_HASH_SWAP16)
+		{
+			swap16(swap, buf, len);
+			rec->hash.crc_swap16 = crc32_update(rec->hash.crc_swap16, swap, len);
+		}
+
+		MD5Update(&md5, buf, len);
+		sha1_update(&sha1, buf, len);
+		pos += len;
+	}
+
+	MD5Final(rec->hash.md5, &md5);
+	sha1_final(&sha1, rec->hash.sha1);
+
+	free(buf);
+	close(fd);
+
+	const char *ext = strrchr(j->path, '.');
+	rec->hash.crc_content = (ext && !strcasecmp(ext, ".zip")) ? zip_content_crc(j->path) : rec->hash.crc;
+}
+
+static int indexer_idle()
+{
+	if (!scheduler_idle_timeout()) hold_timer = GetTimer(ROM_HASH_HOLD_MS);
+	return !hold_timer || CheckTimer(hold_timer);
+}
+
+static void indexer_finish_job()
+{
+	job_busy = 0;
+	job_handle = OffloadHandle();
+
+	// Paused jobs are started again from the beginning later
+	if (job.ok == 0) return;
+
+	if (job.ok > 0)
+	{
+		db_insert(job.rec);
+		if (walk_generation == g_rom_catalog.generation && !(job.rec.hash.flags & ROM_HASH_SKIPPED))
+		{
+			rom_catalog_set_crc(walk_pos, job.rec.hash.crc_content);
+		}
+	}
+	walk_pos++;
+}
+
+void rom_hash_poll()
+{
+	int idle = indexer_idle();
+
+	if (job_busy)
+	{
+		if (!job_handle.done())
+		{
+			if (!idle) job_pause = 1;
+			return;
+		}
+		indexer_finish_job();
+	}
+
+	if (!g_rom_catalog.initialized || g_rom_catalog.scanning) return;
+	db_load();
+
+	// Catalog was scanned again, start over (unchanged files are skipped quickly)
+	if (g_rom_catalog.roms != walk_roms || g_rom_catalog.rom_count != walk_count || g_rom_catalog.generation != walk_generation)
+	{
+		walk_roms = g_rom_catalog.roms;
+		walk_count = g_rom_catalog.rom_count;
+		walk_generation = g_rom_catalog.generation;
+		walk_pos = 0;
+	}
+
+	int pass_done = walk_pos >= walk_count;
+	if (db_dirty && (db_dirty >= 64 || pass_done || CheckTimer(save_timer))) db_save();
+	if (pass_done || !idle) return;
+
+	// Bounded amount of catalog entries checked per call
+	for (int n = 0; n < 256 && walk_pos < walk_count; n++)
+	{
+		const rom_entry_t *rom = &walk_roms[walk_pos];
+		rom_get_path(rom, job.path, sizeof(job.path));
+
+		rom_hash_rec *rec = db_find(path_key(job.path));
+		int known = rec && rec->size == rom->size && rec->mtime == rom->date;
+		if (known && !(rec->hash.flags & ROM_HASH_SKIPPED)) rom_catalog_set_crc(walk_pos, rec->hash.crc_content);
+		if (known || strcasestr(job.path, ".zip/"))
+		{
+			walk_pos++;
+			continue;
+		}
+
+		job.rec.key = path_key(job.path);
+		job_pause = 0;
+		job_handle = offload_try_submit([] { hash_file(&job); }, OFFLOAD_PRIO_BACKGROUND);
+		job_busy = job_handle.valid();
+		break;
+	}
+}
+
+int rom_hash_get(const char *path, rom_hash_t *hash)
+{
+	// A file is being loaded, don't compete for the storage
+	hold_timer = GetTimer(ROM_HASH_HOLD_MS);
+	if (job_busy) job_pause = 1;
+
+	db_load();
+	if (db.empty()) return 0;
+
+	char full[1024];
+	snprintf(full, sizeof(full), "%s", (path[0] == '/') ? path : getFullPath(path));
+
+	struct stat64 st;
+	if (stat64(full, &st) || !S_ISREG(st.st_mode)) return 0;
+
+	rom_hash_rec *rec = db_find(path_key(full));
+	if (!rec || rec->size != (uint32_t)st.st_size || rec->mtime != (uint32_t)st.st_mtime || (rec->hash.flags & ROM_HASH_SKIPPED)) return 0;
+
+	*hash = rec->hash;
+	printf("rom_hash: using indexed hashes of %s\n", full);
+	return 1;
+}
@@ -0,0 +1,34 @@
+#ifndef ROM_HASH_H
+#define ROM_HASH_H
+
+#include <stdint.h>
+
+// Background hash index of the ROM catalog.
+// While the system is idle the ROMs of the catalog stations are hashed one
+// file at a time on the offload pool. Results are kept in config/romhash.bin
+// keyed by full path, size and mtime, so ROM loading can take the hashes
+// from there instead of hashing the data again during the transfer. The
+// content CRCs go to the catalog, which folds duplicate ROMs by them.
+
+#define ROM_HASH_SWAP16  1 // file starts with a big endian N64 header, crc_swap16 is valid
+
+struct rom_hash_t
+{
+	uint32_t crc;        // CRC32 of the whole file
+	uint32_t crc_load;   // CRC32 without the first (size & 0x3FF) bytes, as user_io_file_tx computes it
+	uint32_t crc_swap16; // CRC32 with 16-bit words byte swapped (N64 cheats)
+	uint32_t flags;
+	uint8_t md5[16];
+	uint8_t sha1[20];
+	uint32_t crc_content; // CRC32 of the only file of a zip, else crc (0 for other zips)
+};
+
+// path relative to the root or absolute. Returns 1 if the file is indexed
+// with its current size and mtime. Also holds the indexer off for a while,
+// since a lookup means a file is being loaded.
+int rom_hash_get(const char *path, rom_hash_t *hash);
+
+// Starts and collects indexer jobs, called from the main loop.
+void rom_hash_poll();
+
+#endif
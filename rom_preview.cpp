@@ -16,11 +16,23 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
 
 #include "rom_preview.h"
 #include "rom_catalog.h"
 #include "file_io.h"
 #include "osd.h"
+#include "video.h"
+#include "offload.h"
+#include "http_fetch.h"
+#include "memtrack.h"
+#include "fb_prim.h"
+#include "image_reduce.h"
 #include "lib/imlib2/Imlib2.h"
 
 // Current preview state
@@ -37,6 +49,77 @@ static char fetch_save_path[1024];
 // Batch fetch state
 static volatile int batch_cancel = 0;
 
+// Decoded thumbnail cache.
+// Thumbnails are scaled to fit PREVIEW_WIDTH x PREVIEW_HEIGHT when decoded,
+// so every slot has a fixed size buffer and the cache memory is bounded.
+#define PREVIEW_CACHE_SLOTS  (PREVIEW_CACHE_SIZE / (PREVIEW_WIDTH * PREVIEW_HEIGHT * 4))
+#define PREVIEW_MAX_PATHS    4
+
+typedef enum {
+    CACHE_EMPTY,
+    CACHE_PENDING,                   // Decode job submitted
+    CACHE_READY,
+    CACHE_MISSING                    // No preview file (or it failed to decode)
+} preview_cache_state_t;
+
+typedef struct {
+    preview_cache_state_t state;
+    uint32_t station_id;
+    char name[256];
+    uint32_t *pixels;                // PREVIEW_WIDTH * PREVIEW_HEIGHT
+    int width;
+    int height;
+    uint32_t last_use;
+    int stale;                       // Flushed while pending, drop the result
+    OffloadHandle job;
+} preview_cache_entry_t;
+
+static preview_cache_entry_t preview_cache[PREVIEW_CACHE_SLOTS];
+static pthread_mutex_t preview_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t preview_cache_tick = 0;
+
+// Selection waiting for its background decode
+static int preview_wait_slot = -1;
+
+// Per station thumbnail pack.
+// Header, fixed index of ROM_MAX_PER_STATION entries, then fixed size
+// RGB565 tiles in index order. Read through a shared mapping, so showing a
+// preview doesn't open any file.
+#define PREVIEW_PACK_MAGIC    0x5054524D  // "MRTP"
+#define PREVIEW_PACK_VERSION  1
+#define PREVIEW_PACK_RGB565   1
+#define PREVIEW_PACK_TILE     (PREVIEW_WIDTH * PREVIEW_HEIGHT * 2)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint16_t tile_width;
+    uint16_t tile_height;
+    uint32_t format;
+    uint32_t capacity;               // Index entries
+    uint32_t count;                  // Used entries/tiles
+    uint32_t reserved[2];
+} preview_pack_header_t;
+
+typedef struct {
+    uint32_t hash;                   // Hash of the display name
+    uint16_t width;                  // Tile content size (fits tile_width x tile_height)
+    uint16_t height;
+    char name[120];
+} preview_pack_entry_t;
+
+typedef struct {
+    char path[1024];
+    int absent;                      // No pack file, don't retry until written
+    uint8_t *map;
+    size_t map_size;
+} preview_pack_t;
+
+#define PREVIEW_PACK_DATA  (sizeof(preview_pack_header_t) + ROM_MAX_PER_STATION * sizeof(preview_pack_entry_t))
+
+static preview_pack_t preview_packs[ROM_MAX_STATIONS];
+static pthread_mutex_t preview_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*****************************************************************************
  * Initialize/Cleanup
  *****************************************************************************/
@@ -57,89 +140,691 @@ int rom_preview_init(void)
 void rom_preview_cleanup(void)
 {
     rom_preview_clear();
+
+    // Wait for background decoding before freeing the buffers
+    for (int i = 0; i < PREVIEW_CACHE_SLOTS; i++) {
+        preview_cache[i].job.wait();
+        preview_cache[i].job = OffloadHandle();
+        if (preview_cache[i].pixels) mem_account(MEM_PREVIEW, -(PREVIEW_WIDTH * PREVIEW_HEIGHT * 4));
+        free(preview_cache[i].pixels);
+        preview_cache[i].pixels = NULL;
+        preview_cache[i].state = CACHE_EMPTY;
+    }
 }
 
 /*****************************************************************************
  * Internet Connectivity Check
  *****************************************************************************/
 
-int rom_preview_check_internet(void)
+// Connectivity is probed in background by resolving the thumbnail host
+// (which warms its DNS cache entry as well). Offline the probe backs off
+// from NET_PROBE_MIN to NET_PROBE_MAX seconds, online it's rechecked after
+// NET_PROBE_MAX.
+#define NET_PROBE_HOST  "thumbnails.libretro.com"
+#define NET_PROBE_MIN   10
+#define NET_PROBE_MAX   300
+
+enum { NET_UNKNOWN, NET_ONLINE, NET_OFFLINE };
+
+static std::atomic<int> net_state(NET_UNKNOWN);
+static std::atomic<int> net_probing(0);
+static std::atomic<long> net_next_probe(0);
+static int net_backoff = NET_PROBE_MIN;      // Only touched by the probe
+
+static long net_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Runs with net_probing claimed
+static void net_probe(void)
+{
+    int online = !http_resolve(NET_PROBE_HOST, 80);
+    net_state = online ? NET_ONLINE : NET_OFFLINE;
+
+    if (online) {
+        net_backoff = NET_PROBE_MIN;
+        net_next_probe = net_now() + NET_PROBE_MAX;
+    } else {
+        net_next_probe = net_now() + net_backoff;
+        net_backoff = (net_backoff * 2 > NET_PROBE_MAX) ? NET_PROBE_MAX : net_backoff * 2;
+    }
+
+    net_probing = 0;
+}
+
+static int net_probe_claim(void)
 {
-    // Try to resolve a well-known hostname
-    struct addrinfo hints = {}, *res = NULL;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    int idle = 0;
+    return net_probing.compare_exchange_strong(idle, 1);
+}
+
+// Queues a probe when one is due, never blocks
+static void net_probe_kick(void)
+{
+    if (net_now() < net_next_probe || !net_probe_claim()) return;
+
+    OffloadHandle job = offload_try_submit([]() { net_probe(); }, OFFLOAD_PRIO_BACKGROUND);
+    if (!job.valid()) net_probing = 0;
+}
 
-    int result = getaddrinfo("github.com", "443", &hints, &res);
-    if (res) freeaddrinfo(res);
+// For the fetch threads: the first time waits for the probe result
+static int net_online_wait(void)
+{
+    if (net_state == NET_UNKNOWN) {
+        if (net_probe_claim()) net_probe();
+        else while (net_probing) usleep(20000);
+    } else {
+        net_probe_kick();
+    }
+
+    return net_state == NET_ONLINE;
+}
 
-    return (result == 0) ? 1 : 0;
+int rom_preview_check_internet(void)
+{
+    net_probe_kick();
+    return net_state == NET_ONLINE;
 }
 
 /*****************************************************************************
  * Local Preview Loading
  *****************************************************************************/
 
-int rom_preview_load_local(rom_entry_t *rom)
+// Candidate preview files of a ROM, in order of preference
+static int preview_build_paths(rom_entry_t *rom, char paths[PREVIEW_MAX_PATHS][1024])
 {
-    if (!rom) return -1;
+    int count = 0;
 
-    rom_preview_clear();
+    if (rom_get_preview_path(rom, paths[count], sizeof(paths[count]))) count++;
 
-    // Check if ROM has a preview path
-    if (rom->has_preview && rom->preview_path[0]) {
-        Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
-        Imlib_Image img = imlib_load_image_with_error_return(rom->preview_path, &error);
+    rom_station_t *station = rom_station_get(rom->station_id);
+    const char *station_name = station ? station->short_name : "unknown";
+    const char *games_dir = getFullPath(GAMES_DIR);
+    const char *name = rom_get_display_name(rom);
+
+    // games/previews/{station}/{name}.png
+    snprintf(paths[count++], sizeof(paths[0]), "%s/%s/%s/%s.png", games_dir, PREVIEW_CACHE_DIR, station_name, name);
+    snprintf(paths[count++], sizeof(paths[0]), "%s/%s/%s/%s.jpg", games_dir, PREVIEW_CACHE_DIR, station_name, name);
 
+    // games/{station}/previews/{name}.png
+    if (count < PREVIEW_MAX_PATHS) {
+        snprintf(paths[count++], sizeof(paths[0]), "%s/%s/%s/%s.png", games_dir, station_name, PREVIEW_CACHE_DIR, name);
+    }
+
+    return count;
+}
+
+static uint32_t pack_name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+static void pack_path(uint32_t station_id, char *buf, int len)
+{
+    rom_station_t *station = rom_station_get(station_id);
+    snprintf(buf, len, "%s/%s/%s/%s", getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR,
+             station ? station->short_name : "unknown", PREVIEW_PACK_NAME);
+}
+
+// Pack lock must be held
+static void pack_unmap(preview_pack_t *pack)
+{
+    if (pack->map) munmap(pack->map, pack->map_size);
+    pack->map = NULL;
+    pack->map_size = 0;
+}
+
+// Map pack of a station for reading, pack lock must be held
+static preview_pack_t* pack_map(uint32_t station_id, const char *path)
+{
+    if (station_id >= ROM_MAX_STATIONS) return NULL;
+
+    preview_pack_t *pack = &preview_packs[station_id];
+    if (strcmp(pack->path, path)) {
+        pack_unmap(pack);
+        snprintf(pack->path, sizeof(pack->path), "%s", path);
+        pack->absent = 0;
+    }
+
+    if (pack->map) return pack;
+    if (pack->absent) return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        pack->absent = 1;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < PREVIEW_PACK_DATA) {
+        close(fd);
+        pack->absent = 1;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        pack->absent = 1;
+        return NULL;
+    }
+
+    const preview_pack_header_t *hdr = (const preview_pack_header_t*)map;
+    if (hdr->magic != PREVIEW_PACK_MAGIC || hdr->version != PREVIEW_PACK_VERSION ||
+        hdr->tile_width != PREVIEW_WIDTH || hdr->tile_height != PREVIEW_HEIGHT ||
+        hdr->format != PREVIEW_PACK_RGB565 || hdr->capacity != ROM_MAX_PER_STATION ||
+        hdr->count > hdr->capacity || PREVIEW_PACK_DATA + (size_t)hdr->count * PREVIEW_PACK_TILE > (size_t)st.st_size) {
+        printf("Preview pack %s is invalid, ignoring.\n", path);
+        munmap(map, st.st_size);
+        pack->absent = 1;
+        return NULL;
+    }
+
+    pack->map = (uint8_t*)map;
+    pack->map_size = st.st_size;
+    return pack;
+}
+
+static int pack_find(const preview_pack_t *pack, const char *name)
+{
+    const preview_pack_header_t *hdr = (const preview_pack_header_t*)pack->map;
+    const preview_pack_entry_t *index = (const preview_pack_entry_t*)(pack->map + sizeof(preview_pack_header_t));
+    uint32_t hash = pack_name_hash(name);
+
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (index[i].hash == hash && !strncmp(index[i].name, name, sizeof(index[i].name) - 1)) return i;
+    }
+    return -1;
+}
+
+// Load thumbnail from the pack as ARGB, 0 if found
+static int pack_read(uint32_t station_id, const char *path, const char *name, uint32_t *pixels, int *width, int *height)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&preview_pack_lock);
+    preview_pack_t *pack = pack_map(station_id, path);
+    int idx = pack ? pack_find(pack, name) : -1;
+    if (idx >= 0) {
+        const preview_pack_entry_t *entry = (const preview_pack_entry_t*)(pack->map + sizeof(preview_pack_header_t)) + idx;
+        const uint16_t *tile = (const uint16_t*)(pack->map + PREVIEW_PACK_DATA + (size_t)idx * PREVIEW_PACK_TILE);
+        int w = entry->width, h = entry->height;
+        if (w && h && w <= PREVIEW_WIDTH && h <= PREVIEW_HEIGHT) {
+            for (int y = 0; y < h; y++) {
+                const uint16_t *src = tile + y * PREVIEW_WIDTH;
+                uint32_t *dst = pixels + y * w;
+                for (int x = 0; x < w; x++) {
+                    uint16_t c = src[x];
+                    uint32_t r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+                    dst[x] = 0xFF000000 | (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+                }
+            }
+            *width = w;
+            *height = h;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&preview_pack_lock);
+
+    return ret;
+}
+
+// Store ARGB thumbnail (already fitted to the tile size) into the station pack
+static int pack_write(uint32_t station_id, const char *path, const char *name, const uint32_t *pixels, int width, int height)
+{
+    if (station_id >= ROM_MAX_STATIONS || width < 1 || height < 1 ||
+        width > PREVIEW_WIDTH || height > PREVIEW_HEIGHT) return -1;
+
+    pthread_mutex_lock(&preview_pack_lock);
+
+    preview_pack_t *pack = &preview_packs[station_id];
+    pack_unmap(pack);
+    snprintf(pack->path, sizeof(pack->path), "%s", path);
+
+    int ret = -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        preview_pack_header_t hdr = {};
+        std::vector<preview_pack_entry_t> index;
+
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != PREVIEW_PACK_MAGIC ||
+            hdr.version != PREVIEW_PACK_VERSION || hdr.tile_width != PREVIEW_WIDTH ||
+            hdr.tile_height != PREVIEW_HEIGHT || hdr.format != PREVIEW_PACK_RGB565 ||
+            hdr.capacity != ROM_MAX_PER_STATION || hdr.count > hdr.capacity) {
+            // New or unusable pack, start over
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = PREVIEW_PACK_MAGIC;
+            hdr.version = PREVIEW_PACK_VERSION;
+            hdr.tile_width = PREVIEW_WIDTH;
+            hdr.tile_height = PREVIEW_HEIGHT;
+            hdr.format = PREVIEW_PACK_RGB565;
+            hdr.capacity = ROM_MAX_PER_STATION;
+            if (ftruncate(fd, PREVIEW_PACK_DATA)) hdr.capacity = 0;
+        }
+
+        index.resize(hdr.count);
+        if (hdr.count) pread(fd, index.data(), hdr.count * sizeof(preview_pack_entry_t), sizeof(hdr));
+
+        uint32_t idx = hdr.count;
+        uint32_t hash = pack_name_hash(name);
+        for (uint32_t i = 0; i < hdr.count; i++) {
+            if (index[i].hash == hash && !strncmp(index[i].name, name, sizeof(index[i].name) - 1)) {
+                idx = i;
+                break;
+            }
+        }
+
+        if (idx < hdr.capacity) {
+            std::vector<uint16_t> tile(PREVIEW_WIDTH * PREVIEW_HEIGHT, 0);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    uint32_t c = pixels[y * width + x];
+                    tile[y * PREVIEW_WIDTH + x] = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+                }
+            }
+
+            preview_pack_entry_t entry = {};
+            entry.hash = hash;
+            entry.width = width;
+            entry.height = height;
+            strncpy(entry.name, name, sizeof(entry.name) - 1);
+
+            off_t tile_ofs = PREVIEW_PACK_DATA + (off_t)idx * PREVIEW_PACK_TILE;
+            off_t entry_ofs = sizeof(hdr) + (off_t)idx * sizeof(entry);
+            if (pwrite(fd, tile.data(), PREVIEW_PACK_TILE, tile_ofs) == PREVIEW_PACK_TILE &&
+                pwrite(fd, &entry, sizeof(entry), entry_ofs) == sizeof(entry)) {
+                if (idx == hdr.count) hdr.count++;
+                if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) ret = 0;
+            }
+        }
+
+        close(fd);
+    }
+
+    pack->absent = 0;
+    pthread_mutex_unlock(&preview_pack_lock);
+
+    if (ret) printf("Failed to store %s in preview pack %s\n", name, path);
+    return ret;
+}
+
+static int pack_exists(uint32_t station_id, const char *name)
+{
+    char path[1024];
+    pack_path(station_id, path, sizeof(path));
+
+    pthread_mutex_lock(&preview_pack_lock);
+    preview_pack_t *pack = pack_map(station_id, path);
+    int found = pack && pack_find(pack, name) >= 0;
+    pthread_mutex_unlock(&preview_pack_lock);
+
+    return found;
+}
+
+// Forget mapped packs of a station (all if station_id < 0) before the files go away
+static void pack_close(int station_id)
+{
+    pthread_mutex_lock(&preview_pack_lock);
+    for (int i = 0; i < ROM_MAX_STATIONS; i++) {
+        if (station_id >= 0 && i != station_id) continue;
+        pack_unmap(&preview_packs[i]);
+        preview_packs[i].path[0] = 0;
+        preview_packs[i].absent = 0;
+    }
+    pthread_mutex_unlock(&preview_pack_lock);
+}
+
+// Thumbnail size of a picture, aspect ratio kept.
+static void preview_fit_size(int src_w, int src_h, int *dst_w, int *dst_h)
+{
+    *dst_w = PREVIEW_WIDTH;
+    *dst_h = (src_h * PREVIEW_WIDTH) / src_w;
+    if (*dst_h > PREVIEW_HEIGHT) {
+        *dst_h = PREVIEW_HEIGHT;
+        *dst_w = (src_w * PREVIEW_HEIGHT) / src_h;
+    }
+    if (*dst_w < 1) *dst_w = 1;
+    if (*dst_h < 1) *dst_h = 1;
+}
+
+// Scale image to fit the thumbnail size keeping aspect ratio and copy it out.
+// Imlib lock must be held, the context image is used as source.
+static int preview_fit(uint32_t *pixels, int *width, int *height)
+{
+    int src_w = imlib_image_get_width();
+    int src_h = imlib_image_get_height();
+    if (src_w < 1 || src_h < 1) return -1;
+
+    int dst_w, dst_h;
+    preview_fit_size(src_w, src_h, &dst_w, &dst_h);
+
+    // Up to 2x down bilinear looks the same, beyond that Imlib's box filter
+    // is needed against aliasing.
+    if (src_w <= dst_w * 2 && src_h <= dst_h * 2) {
+        fbp_scale_bilinear(pixels, dst_w, dst_w, dst_h, imlib_image_get_data_for_reading_only(), src_w, src_w, src_h);
+        *width = dst_w;
+        *height = dst_h;
+        return 0;
+    }
+
+    Imlib_Image scaled = imlib_create_cropped_scaled_image(0, 0, src_w, src_h, dst_w, dst_h);
+    if (!scaled) return -1;
+
+    Imlib_Image src = imlib_context_get_image();
+    imlib_context_set_image(scaled);
+    memcpy(pixels, imlib_image_get_data_for_reading_only(), dst_w * dst_h * 4);
+    imlib_free_image();
+    imlib_context_set_image(src);
+
+    *width = dst_w;
+    *height = dst_h;
+    return 0;
+}
+
+// Decode the first existing candidate into a scaled RGBA thumbnail.
+// Safe to call from a worker thread.
+static int preview_decode(char paths[PREVIEW_MAX_PATHS][1024], int count, uint32_t *pixels, int *width, int *height)
+{
+    for (int i = 0; i < count; i++) {
+        if (access(paths[i], R_OK)) continue;
+
+        // PNG comes reduced to less than twice the thumbnail, without the Imlib lock
+        int src_w, src_h;
+        uint32_t *src = image_reduce_load(paths[i], PREVIEW_WIDTH, PREVIEW_HEIGHT, 1, &src_w, &src_h, NULL);
+        if (src) {
+            preview_fit_size(src_w, src_h, width, height);
+            fbp_scale_bilinear(pixels, *width, *width, *height, src, src_w, src_w, src_h);
+            free(src);
+            return 0;
+        }
+
+        video_imlib_lock();
+
+        Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
+        Imlib_Image img = imlib_load_image_with_error_return(paths[i], &error);
+        int ret = -1;
         if (img) {
             imlib_context_set_image(img);
-            g_current_preview.image_data = img;
-            g_current_preview.width = imlib_image_get_width();
-            g_current_preview.height = imlib_image_get_height();
-            g_current_preview.status = PREVIEW_STATUS_READY;
-            strncpy(g_current_preview.rom_name, rom->name, sizeof(g_current_preview.rom_name) - 1);
-            g_current_preview.station_id = rom->station_id;
-            return 0;
+            ret = preview_fit(pixels, width, height);
+            imlib_free_image_and_decache();
         }
+
+        video_imlib_unlock();
+        if (!ret) return 0;
     }
 
-    // Try to find preview in standard locations
-    char preview_path[1024];
-    const char *preview_dirs[] = {
-        "%s/%s/%s/%s.png",      // games/previews/{station}/{name}.png
-        "%s/%s/%s/%s.jpg",
-        "%s/%s/%s.png",         // games/{station}/previews/{name}.png with different structure
-        NULL
-    };
+    return -1;
+}
 
-    rom_station_t *station = rom_station_get(rom->station_id);
-    const char *station_name = station ? station->short_name : "unknown";
+// Move a downloaded preview file into the station pack
+static int preview_pack_file(uint32_t station_id, const char *pack_file, const char *name, const char *file)
+{
+    char paths[PREVIEW_MAX_PATHS][1024];
+    snprintf(paths[0], sizeof(paths[0]), "%s", file);
 
-    for (int i = 0; preview_dirs[i]; i++) {
-        snprintf(preview_path, sizeof(preview_path), preview_dirs[i],
-                 getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station_name, rom->name);
-
-        if (FileExists(preview_path, 0)) {
-            Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
-            Imlib_Image img = imlib_load_image_with_error_return(preview_path, &error);
-
-            if (img) {
-                imlib_context_set_image(img);
-                g_current_preview.image_data = img;
-                g_current_preview.width = imlib_image_get_width();
-                g_current_preview.height = imlib_image_get_height();
-                g_current_preview.status = PREVIEW_STATUS_READY;
-                strncpy(g_current_preview.rom_name, rom->name, sizeof(g_current_preview.rom_name) - 1);
-                g_current_preview.station_id = rom->station_id;
-                return 0;
-            }
+    std::vector<uint32_t> pixels(PREVIEW_WIDTH * PREVIEW_HEIGHT);
+    int width = 0, height = 0;
+    if (preview_decode(paths, 1, pixels.data(), &width, &height)) return -1;
+    if (pack_write(station_id, pack_file, name, pixels.data(), width, height)) return -1;
+
+    unlink(file);
+    return 0;
+}
+
+// Thumbnail from the station pack, or decoded from a preview file
+static int preview_load(uint32_t station_id, const char *pack_file, const char *name,
+                        char paths[PREVIEW_MAX_PATHS][1024], int count, uint32_t *pixels, int *width, int *height)
+{
+    if (!pack_read(station_id, pack_file, name, pixels, width, height)) return 0;
+    return preview_decode(paths, count, pixels, width, height);
+}
+
+// Find cache slot of a ROM, cache lock must be held
+static int preview_cache_find(rom_entry_t *rom)
+{
+    const char *name = rom_get_display_name(rom);
+    for (int i = 0; i < PREVIEW_CACHE_SLOTS; i++) {
+        preview_cache_entry_t *entry = &preview_cache[i];
+        if (entry->state != CACHE_EMPTY && !entry->stale && entry->station_id == rom->station_id &&
+            !strcmp(entry->name, name)) {
+            entry->last_use = ++preview_cache_tick;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Take least recently used slot for a ROM, cache lock must be held.
+// Pending slots are owned by their decode job and never reused.
+static int preview_cache_alloc(rom_entry_t *rom)
+{
+    int slot = -1;
+    for (int i = 0; i < PREVIEW_CACHE_SLOTS; i++) {
+        preview_cache_entry_t *entry = &preview_cache[i];
+        if (entry->state == CACHE_PENDING) continue;
+        if (slot < 0 || entry->state == CACHE_EMPTY ||
+            (preview_cache[slot].state != CACHE_EMPTY && entry->last_use < preview_cache[slot].last_use)) {
+            slot = i;
+        }
+        if (entry->state == CACHE_EMPTY) break;
+    }
+    if (slot < 0) return -1;
+
+    preview_cache_entry_t *entry = &preview_cache[slot];
+    if (!entry->pixels) {
+        entry->pixels = (uint32_t*)malloc(PREVIEW_WIDTH * PREVIEW_HEIGHT * 4);
+        if (!entry->pixels) return -1;
+        mem_account(MEM_PREVIEW, PREVIEW_WIDTH * PREVIEW_HEIGHT * 4);
+    }
+
+    entry->state = CACHE_PENDING;
+    entry->stale = 0;
+    entry->station_id = rom->station_id;
+    strncpy(entry->name, rom_get_display_name(rom), sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = 0;
+    entry->width = 0;
+    entry->height = 0;
+    entry->last_use = ++preview_cache_tick;
+    entry->job = OffloadHandle();
+    return slot;
+}
+
+static void preview_cache_finish(int slot, int result, int width, int height)
+{
+    pthread_mutex_lock(&preview_cache_lock);
+    preview_cache_entry_t *entry = &preview_cache[slot];
+    if (entry->stale) {
+        entry->state = CACHE_EMPTY;
+        entry->stale = 0;
+    } else {
+        entry->state = result ? CACHE_MISSING : CACHE_READY;
+        entry->width = width;
+        entry->height = height;
+    }
+    pthread_mutex_unlock(&preview_cache_lock);
+}
+
+// Queue background decode of a ROM preview, returns slot or -1
+static int preview_cache_submit(rom_entry_t *rom, int prio = OFFLOAD_PRIO_DECODE)
+{
+    char paths[PREVIEW_MAX_PATHS][1024];
+    int count = preview_build_paths(rom, paths);
+
+    pthread_mutex_lock(&preview_cache_lock);
+    int slot = preview_cache_find(rom);
+    if (slot >= 0) {
+        pthread_mutex_unlock(&preview_cache_lock);
+        return slot;
+    }
+    slot = preview_cache_alloc(rom);
+    pthread_mutex_unlock(&preview_cache_lock);
+    if (slot < 0) return -1;
+
+    std::vector<char> job_paths(sizeof(paths));
+    memcpy(job_paths.data(), paths, sizeof(paths));
+
+    char pack_file[1024];
+    pack_path(rom->station_id, pack_file, sizeof(pack_file));
+    std::string job_pack = pack_file;
+    std::string job_name = rom_get_display_name(rom);
+    uint32_t station_id = rom->station_id;
+
+    uint32_t *pixels = preview_cache[slot].pixels;
+    OffloadHandle job = offload_try_submit([slot, count, pixels, job_paths, job_pack, job_name, station_id]() {
+        int width = 0, height = 0;
+        int result = preview_load(station_id, job_pack.c_str(), job_name.c_str(),
+                                  (char(*)[1024])job_paths.data(), count, pixels, &width, &height);
+        preview_cache_finish(slot, result, width, height);
+    }, prio);
+
+    pthread_mutex_lock(&preview_cache_lock);
+    if (job.valid()) {
+        if (preview_cache[slot].state == CACHE_PENDING) preview_cache[slot].job = job;
+    } else {
+        // Queue full, try again later
+        preview_cache[slot].state = CACHE_EMPTY;
+        slot = -1;
+    }
+    pthread_mutex_unlock(&preview_cache_lock);
+
+    return slot;
+}
+
+// Show cached thumbnail as the current preview
+static int preview_show_slot(int slot, rom_entry_t *rom)
+{
+    preview_cache_entry_t *entry = &preview_cache[slot];
+
+    pthread_mutex_lock(&preview_cache_lock);
+    preview_cache_state_t state = entry->state;
+    pthread_mutex_unlock(&preview_cache_lock);
+
+    if (state == CACHE_PENDING) {
+        g_current_preview.status = PREVIEW_STATUS_LOADING;
+        return 1;
+    }
+
+    if (state == CACHE_READY) {
+        video_imlib_lock();
+        Imlib_Image img = imlib_create_image_using_copied_data(entry->width, entry->height, (DATA32*)entry->pixels);
+        video_imlib_unlock();
+
+        if (img) {
+            g_current_preview.image_data = img;
+            g_current_preview.width = entry->width;
+            g_current_preview.height = entry->height;
+            g_current_preview.status = PREVIEW_STATUS_READY;
+            strncpy(g_current_preview.rom_name, entry->name, sizeof(g_current_preview.rom_name) - 1);
+            g_current_preview.station_id = entry->station_id;
+            return 0;
         }
     }
 
     g_current_preview.status = PREVIEW_STATUS_NOT_FOUND;
+    if (rom) {
+        strncpy(g_current_preview.rom_name, rom_get_display_name(rom), sizeof(g_current_preview.rom_name) - 1);
+        g_current_preview.station_id = rom->station_id;
+    }
     return -1;
 }
 
+// Drop cached thumbnails of a station (all if station_id < 0)
+static void preview_cache_flush(int station_id)
+{
+    pthread_mutex_lock(&preview_cache_lock);
+    for (int i = 0; i < PREVIEW_CACHE_SLOTS; i++) {
+        preview_cache_entry_t *entry = &preview_cache[i];
+        if (station_id >= 0 && entry->station_id != (uint32_t)station_id) continue;
+
+        if (entry->state == CACHE_PENDING) entry->stale = 1;
+        else entry->state = CACHE_EMPTY;
+    }
+    pthread_mutex_unlock(&preview_cache_lock);
+}
+
+int rom_preview_load_local(rom_entry_t *rom)
+{
+    if (!rom) return -1;
+
+    rom_preview_clear();
+
+    pthread_mutex_lock(&preview_cache_lock);
+    int slot = preview_cache_find(rom);
+    OffloadHandle job;
+    if (slot >= 0) job = preview_cache[slot].job;
+    pthread_mutex_unlock(&preview_cache_lock);
+
+    // Being decoded in background, just wait for it
+    if (slot >= 0) {
+        job.wait();
+        return preview_show_slot(slot, rom);
+    }
+
+    char paths[PREVIEW_MAX_PATHS][1024];
+    int count = preview_build_paths(rom, paths);
+
+    pthread_mutex_lock(&preview_cache_lock);
+    slot = preview_cache_alloc(rom);
+    pthread_mutex_unlock(&preview_cache_lock);
+
+    if (slot < 0) {
+        g_current_preview.status = PREVIEW_STATUS_NOT_FOUND;
+        return -1;
+    }
+
+    char pack_file[1024];
+    pack_path(rom->station_id, pack_file, sizeof(pack_file));
+
+    int width = 0, height = 0;
+    int result = preview_load(rom->station_id, pack_file, rom_get_display_name(rom), paths, count,
+                              preview_cache[slot].pixels, &width, &height);
+    preview_cache_finish(slot, result, width, height);
+
+    return preview_show_slot(slot, rom);
+}
+
+int rom_preview_select(rom_entry_t *rom)
+{
+    if (!rom) return -1;
+
+    rom_preview_clear();
+
+    // Selected ROM goes first into the queue
+    int slot = preview_cache_submit(rom);
+    preview_wait_slot = -1;
+    if (slot < 0) {
+        // Queue full, rom_preview_get_status() retries
+        g_current_preview.status = PREVIEW_STATUS_LOADING;
+    } else if (preview_show_slot(slot, rom) > 0) {
+        preview_wait_slot = slot;
+    }
+
+    strncpy(g_current_preview.rom_name, rom_get_display_name(rom), sizeof(g_current_preview.rom_name) - 1);
+    g_current_preview.station_id = rom->station_id;
+
+    // Warm up the neighbours in the browse list
+    int index = rom_browse_get_selected_index();
+    for (int i = 1; i <= PREVIEW_PREFETCH_RANGE; i++) {
+        rom_entry_t *next = rom_browse_get(index + i);
+        if (next) preview_cache_submit(next);
+        rom_entry_t *prev = rom_browse_get(index - i);
+        if (prev) preview_cache_submit(prev);
+    }
+
+    return (int)g_current_preview.status;
+}
+
+int rom_preview_prefetch(rom_entry_t *rom)
+{
+    if (!rom) return -1;
+    return (preview_cache_submit(rom, OFFLOAD_PRIO_BACKGROUND) < 0) ? -1 : 0;
+}
+
 /*****************************************************************************
  * Online Preview Fetching
  *****************************************************************************/
@@ -216,21 +901,33 @@ static const char* get_libretro_system_name(const char *short_name)
     return short_name;
 }
 
-// Download a file using wget (available on MiSTer)
-static int download_file(const char *url, const char *save_path)
+// Download a file, keeps the connection open for the next request
+static int download_file(HttpConn *conn, const char *url, const char *save_path, volatile int *cancel)
 {
-    char cmd[2048];
-    snprintf(cmd, sizeof(cmd),
-             "wget -q -T %d -O \"%s\" \"%s\" 2>/dev/null",
-             PREVIEW_FETCH_TIMEOUT, save_path, url);
+    int ret = http_get_file(conn, url, save_path, cancel);
+    if (ret == 200 || ret == 206) return 0;
 
-    int ret = system(cmd);
-    if (ret == 0 && FileExists(save_path, 0)) {
-        return 0;
-    }
-
-    // Clean up failed download
+    // Clean up failed download, partial data is kept for resume
     unlink(save_path);
+    return (ret == -2) ? -2 : -1;
+}
+
+// Thumbnail kinds tried in order
+static const char *libretro_thumb_dirs[] = { "Named_Boxarts", "Named_Snaps", "Named_Titles", NULL };
+
+// Try all thumbnail kinds of a ROM, 0 when downloaded to save_path
+static int fetch_libretro(HttpConn *conn, const char *system, const char *encoded_name, const char *save_path,
+                          volatile int *cancel)
+{
+    // URL format: http://thumbnails.libretro.com/{system}/Named_Boxarts/{name}.png
+    for (int i = 0; libretro_thumb_dirs[i]; i++) {
+        char url[1024];
+        snprintf(url, sizeof(url), "http://thumbnails.libretro.com/%s/%s/%s.png",
+                 system, libretro_thumb_dirs[i], encoded_name);
+
+        int ret = download_file(conn, url, save_path, cancel);
+        if (ret != -1) return ret;
+    }
     return -1;
 }
 
@@ -242,7 +939,7 @@ int rom_preview_fetch_online(rom_entry_t *rom)
     if (!station) return -1;
 
     // Check internet connectivity first
-    if (!rom_preview_check_internet()) {
+    if (!net_online_wait()) {
         g_current_preview.status = PREVIEW_STATUS_NO_INTERNET;
         return -1;
     }
@@ -256,41 +953,24 @@ int rom_preview_fetch_online(rom_entry_t *rom)
              getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name);
     FileCreatePath(save_dir);
 
-    snprintf(save_path, sizeof(save_path), "%s/%s.png", save_dir, rom->name);
+    snprintf(save_path, sizeof(save_path), "%s/%s.png", save_dir, rom_get_display_name(rom));
+
+    char pack_file[1024];
+    pack_path(rom->station_id, pack_file, sizeof(pack_file));
 
-    // Try libretro-thumbnails first
-    // URL format: https://thumbnails.libretro.com/{system}/Named_Boxarts/{name}.png
     const char *libretro_system = get_libretro_system_name(station->short_name);
     char encoded_name[512];
-    url_encode(rom->name, encoded_name, sizeof(encoded_name));
-
-    char url[1024];
-
-    // Try Named_Boxarts
-    snprintf(url, sizeof(url),
-             "https://thumbnails.libretro.com/%s/Named_Boxarts/%s.png",
-             libretro_system, encoded_name);
-
-    if (download_file(url, save_path) == 0) {
-        // Successfully downloaded, now load it
-        return rom_preview_load_local(rom);
-    }
-
-    // Try Named_Snaps
-    snprintf(url, sizeof(url),
-             "https://thumbnails.libretro.com/%s/Named_Snaps/%s.png",
-             libretro_system, encoded_name);
+    url_encode(rom_get_display_name(rom), encoded_name, sizeof(encoded_name));
 
-    if (download_file(url, save_path) == 0) {
-        return rom_preview_load_local(rom);
-    }
-
-    // Try Named_Titles
-    snprintf(url, sizeof(url),
-             "https://thumbnails.libretro.com/%s/Named_Titles/%s.png",
-             libretro_system, encoded_name);
+    HttpConn conn;
+    http_conn_init(&conn, PREVIEW_FETCH_TIMEOUT);
+    int ret = fetch_libretro(&conn, libretro_system, encoded_name, save_path, &fetch_cancel);
+    http_conn_close(&conn);
 
-    if (download_file(url, save_path) == 0) {
+    if (!ret) {
+        // Successfully downloaded, move it into the pack (loose file is kept if that fails) and load it
+        preview_pack_file(rom->station_id, pack_file, rom_get_display_name(rom), save_path);
+        preview_cache_flush(rom->station_id);
         return rom_preview_load_local(rom);
     }
 
@@ -351,7 +1031,9 @@ void rom_preview_display(int x, int y, int max_width, int max_height)
     }
 
     Imlib_Image img = (Imlib_Image)g_current_preview.image_data;
+    video_imlib_lock();
     imlib_context_set_image(img);
+    video_imlib_unlock();
 
     // Calculate scaled dimensions maintaining aspect ratio
     int src_w = g_current_preview.width;
@@ -373,6 +1055,37 @@ void rom_preview_display(int x, int y, int max_width, int max_height)
     // For now, we'll just store the info for the OSD to use
 }
 
+int rom_preview_pack_blit(rom_entry_t *rom, uint32_t *dst, int stride, int max_width, int max_height)
+{
+    if (!rom || !dst) return -1;
+
+    char path[1024];
+    pack_path(rom->station_id, path, sizeof(path));
+
+    int ret = -1;
+    pthread_mutex_lock(&preview_pack_lock);
+    preview_pack_t *pack = pack_map(rom->station_id, path);
+    int idx = pack ? pack_find(pack, rom_get_display_name(rom)) : -1;
+    if (idx >= 0) {
+        const preview_pack_entry_t *entry = (const preview_pack_entry_t*)(pack->map + sizeof(preview_pack_header_t)) + idx;
+        const uint16_t *tile = (const uint16_t*)(pack->map + PREVIEW_PACK_DATA + (size_t)idx * PREVIEW_PACK_TILE);
+
+        // Centered, clipped to the destination
+        int w = std::min((int)entry->width, max_width);
+        int h = std::min((int)entry->height, max_height);
+        int ofs_x = (max_width - w) / 2;
+        int ofs_y = (max_height - h) / 2;
+
+        for (int y = 0; y < h; y++) {
+            fbp_from_565(dst + (y + ofs_y) * stride + ofs_x, tile + y * PREVIEW_WIDTH, w);
+        }
+        ret = 0;
+    }
+    pthread_mutex_unlock(&preview_pack_lock);
+
+    return ret;
+}
+
 void rom_preview_display_text(int x, int y, const char *rom_name, const char *station_name)
 {
     // Display text placeholder using OSD
@@ -411,8 +1124,10 @@ void rom_preview_clear(void)
 {
     if (g_current_preview.image_data) {
         Imlib_Image img = (Imlib_Image)g_current_preview.image_data;
+        video_imlib_lock();
         imlib_context_set_image(img);
         imlib_free_image();
+        video_imlib_unlock();
     }
 
     memset(&g_current_preview, 0, sizeof(g_current_preview));
@@ -421,6 +1136,20 @@ void rom_preview_clear(void)
 
 preview_status_t rom_preview_get_status(void)
 {
+    // Install background decoded thumbnail of the selection once ready
+    if (g_current_preview.status == PREVIEW_STATUS_LOADING && !fetch_in_progress) {
+        rom_entry_t *rom = rom_get_selected();
+        if (rom && rom->station_id == g_current_preview.station_id &&
+            !strcmp(rom_get_display_name(rom), g_current_preview.rom_name)) {
+            if (preview_wait_slot < 0) {
+                preview_wait_slot = preview_cache_submit(rom);
+            }
+            if (preview_wait_slot >= 0 && preview_show_slot(preview_wait_slot, rom) <= 0) {
+                preview_wait_slot = -1;
+            }
+        }
+    }
+
     return g_current_preview.status;
 }
 
@@ -435,9 +1164,11 @@ int rom_preview_cache_exists(rom_entry_t *rom)
     rom_station_t *station = rom_station_get(rom->station_id);
     if (!station) return 0;
 
+    if (pack_exists(rom->station_id, rom_get_display_name(rom))) return 1;
+
     char path[1024];
     snprintf(path, sizeof(path), "%s/%s/%s/%s.png",
-             getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name, rom->name);
+             getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name, rom_get_display_name(rom));
 
     return FileExists(path, 0);
 }
@@ -449,32 +1180,38 @@ int rom_preview_cache_save(rom_entry_t *rom, void *data, int width, int height)
     rom_station_t *station = rom_station_get(rom->station_id);
     if (!station) return -1;
 
-    // Create save path
     char save_dir[512];
-    char save_path[1024];
     snprintf(save_dir, sizeof(save_dir), "%s/%s/%s",
              getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name);
     FileCreatePath(save_dir);
 
-    snprintf(save_path, sizeof(save_path), "%s/%s.png", save_dir, rom->name);
+    // Scale into a tile and store it in the station pack
+    std::vector<uint32_t> pixels(PREVIEW_WIDTH * PREVIEW_HEIGHT);
+    int tile_w = 0, tile_h = 0;
 
-    // Create image from data and save
+    video_imlib_lock();
     Imlib_Image img = imlib_create_image_using_copied_data(width, height, (DATA32*)data);
-    if (!img) return -1;
-
-    imlib_context_set_image(img);
-    imlib_image_set_format("png");
-
-    Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
-    imlib_save_image_with_error_return(save_path, &error);
+    int ret = -1;
+    if (img) {
+        imlib_context_set_image(img);
+        ret = preview_fit(pixels.data(), &tile_w, &tile_h);
+        imlib_free_image();
+    }
+    video_imlib_unlock();
 
-    imlib_free_image();
+    char pack_file[1024];
+    pack_path(rom->station_id, pack_file, sizeof(pack_file));
+    if (!ret) ret = pack_write(rom->station_id, pack_file, rom_get_display_name(rom), pixels.data(), tile_w, tile_h);
 
-    return (error == IMLIB_LOAD_ERROR_NONE) ? 0 : -1;
+    preview_cache_flush(rom->station_id);
+    return ret;
 }
 
 void rom_preview_cache_clear(void)
 {
+    preview_cache_flush(-1);
+    pack_close(-1);
+
     char cmd[512];
     snprintf(cmd, sizeof(cmd), "rm -rf %s/%s/*",
              getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR);
@@ -486,6 +1223,9 @@ void rom_preview_cache_clear_station(uint32_t station_id)
     rom_station_t *station = rom_station_get(station_id);
     if (!station) return;
 
+    preview_cache_flush(station_id);
+    pack_close(station_id);
+
     char cmd[512];
     snprintf(cmd, sizeof(cmd), "rm -rf %s/%s/%s/*",
              getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name);
@@ -496,10 +1236,48 @@ void rom_preview_cache_clear_station(uint32_t station_id)
  * Batch Download
  *****************************************************************************/
 
+typedef struct {
+    char name[256];
+    char encoded_name[512];
+    char save_path[1024];
+} batch_job_t;
+
+// Shared by the batch download threads, set up before they start
+static std::vector<batch_job_t> batch_jobs;
+static const char *batch_system = NULL;
+static uint32_t batch_station_id = 0;
+static char batch_pack_file[1024];
+static std::atomic<int> batch_next(0);
+static std::atomic<int> batch_done(0);
+static std::atomic<int> batch_downloaded(0);
+static std::atomic<int> batch_last(-1);
+
+static void* batch_thread_func(void *)
+{
+    HttpConn conn;
+    http_conn_init(&conn, PREVIEW_FETCH_TIMEOUT);
+
+    while (!batch_cancel) {
+        int i = batch_next++;
+        if (i >= (int)batch_jobs.size()) break;
+
+        batch_job_t *job = &batch_jobs[i];
+        if (!fetch_libretro(&conn, batch_system, job->encoded_name, job->save_path, &batch_cancel) &&
+            !preview_pack_file(batch_station_id, batch_pack_file, job->name, job->save_path)) {
+            batch_downloaded++;
+        }
+
+        batch_last = i;
+        batch_done++;
+    }
+
+    http_conn_close(&conn);
+    return NULL;
+}
+
 int rom_preview_batch_fetch(uint32_t station_id, preview_progress_cb progress_cb)
 {
     batch_cancel = 0;
-    int downloaded = 0;
 
     rom_station_t *station = rom_station_get(station_id);
     if (!station) return 0;
@@ -508,31 +1286,72 @@ int rom_preview_batch_fetch(uint32_t station_id, preview_progress_cb progress_cb
     int total = rom_get_count_for_station(station_id);
     int current = 0;
 
-    // Iterate through all ROMs for this station
+    char save_dir[512];
+    snprintf(save_dir, sizeof(save_dir), "%s/%s/%s",
+             getFullPath(GAMES_DIR), PREVIEW_CACHE_DIR, station->short_name);
+    FileCreatePath(save_dir);
+
+    // Already cached previews are skipped, the rest is downloaded in parallel
+    batch_jobs.clear();
     for (uint32_t i = 0; i < (uint32_t)rom_get_count() && !batch_cancel; i++) {
         rom_entry_t *rom = rom_get_by_index(i);
         if (!rom || rom->station_id != station_id) continue;
 
-        current++;
-
-        // Skip if already cached
         if (rom_preview_cache_exists(rom)) {
-            if (progress_cb) progress_cb(current, total, rom->name);
+            current++;
+            if (progress_cb) progress_cb(current, total, rom_get_display_name(rom));
             continue;
         }
 
-        // Try to fetch
-        if (rom_preview_fetch_online(rom) == 0) {
-            downloaded++;
-        }
+        batch_job_t job;
+        snprintf(job.name, sizeof(job.name), "%s", rom_get_display_name(rom));
+        url_encode(job.name, job.encoded_name, sizeof(job.encoded_name));
+        snprintf(job.save_path, sizeof(job.save_path), "%s/%s.png", save_dir, job.name);
+        batch_jobs.push_back(job);
+    }
+
+    if (batch_jobs.empty() || batch_cancel) return 0;
+    if (!net_online_wait()) return 0;
+
+    batch_system = get_libretro_system_name(station->short_name);
+    batch_station_id = station_id;
+    pack_path(station_id, batch_pack_file, sizeof(batch_pack_file));
+    batch_next = 0;
+    batch_done = 0;
+    batch_downloaded = 0;
+    batch_last = -1;
+
+    pthread_t threads[PREVIEW_FETCH_CONNECTIONS];
+    int thread_count = 0;
+    for (int i = 0; i < PREVIEW_FETCH_CONNECTIONS && i < (int)batch_jobs.size(); i++) {
+        if (pthread_create(&threads[thread_count], NULL, batch_thread_func, NULL)) break;
+        thread_count++;
+    }
 
-        if (progress_cb) progress_cb(current, total, rom->name);
+    if (!thread_count) {
+        batch_thread_func(NULL);
+    } else {
+        // Report progress while the downloads run
+        int reported = 0;
+        while (batch_done < (int)batch_jobs.size() && !batch_cancel) {
+            int done = batch_done;
+            if (done != reported && progress_cb) {
+                int last = batch_last;
+                progress_cb(current + done, total, last >= 0 ? batch_jobs[last].name : "");
+            }
+            reported = done;
+            usleep(50000);
+        }
 
-        // Small delay to avoid hammering the server
-        usleep(100000);  // 100ms
+        for (int i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
     }
 
-    return downloaded;
+    if (progress_cb && batch_done) progress_cb(current + batch_done, total, batch_jobs[batch_last].name);
+
+    preview_cache_flush(station_id);
+    batch_jobs.clear();
+
+    return batch_downloaded;
 }
 
 void rom_preview_batch_cancel(void)
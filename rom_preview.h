@@ -16,7 +16,11 @@
 #define PREVIEW_WIDTH       256
 #define PREVIEW_HEIGHT      192
 #define PREVIEW_CACHE_DIR   "previews"
+#define PREVIEW_PACK_NAME   "thumbs.pack"     // Per station thumbnail pack in PREVIEW_CACHE_DIR/{station}
 #define PREVIEW_FETCH_TIMEOUT 10  // seconds
+#define PREVIEW_FETCH_CONNECTIONS 4  // Parallel downloads in batch fetch
+#define PREVIEW_CACHE_SIZE  (4 * 1024 * 1024)  // Memory for decoded thumbnails
+#define PREVIEW_PREFETCH_RANGE 2              // Browse list neighbours decoded ahead
 
 // Preview fetch status
 typedef enum {
@@ -45,11 +49,19 @@ extern rom_preview_data_t g_current_preview;
 int  rom_preview_init(void);
 void rom_preview_cleanup(void);
 
-// Check if internet is available
+// Check if internet is available. Never blocks: returns the last probe
+// result and queues a new probe when due (0 until the first one is done).
 int  rom_preview_check_internet(void);
 
 // Preview loading (local files)
+// Decoded thumbnails are kept in a LRU cache, load_local decodes on a miss
+// while select queues the decode (and the browse list neighbours) in
+// background and reports PREVIEW_STATUS_LOADING until it's ready.
 int  rom_preview_load_local(rom_entry_t *rom);
+int  rom_preview_select(rom_entry_t *rom);
+// Queues the decode at background priority without touching the current
+// preview, -1 if the queue is full.
+int  rom_preview_prefetch(rom_entry_t *rom);
 
 // Preview fetching (online APIs)
 // Supported APIs: libretro-thumbnails, screenscraper, etc.
@@ -62,6 +74,10 @@ int  rom_preview_fetch_poll(void);  // Returns 1 when complete
 // Display the current preview on framebuffer
 void rom_preview_display(int x, int y, int max_width, int max_height);
 
+// Copy a packed thumbnail into a 32bpp buffer (e.g. framebuffer), centered
+// in max_width x max_height. Returns -1 if the ROM has no packed thumbnail.
+int  rom_preview_pack_blit(rom_entry_t *rom, uint32_t *dst, int stride, int max_width, int max_height);
+
 // Display a text placeholder when no preview available
 void rom_preview_display_text(int x, int y, const char *rom_name, const char *station_name);
 
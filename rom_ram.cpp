@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rom_ram.h"
+#include "file_io.h"
+#include "memtrack.h"
+
+#define ROM_RAM_RESERVE (64 * 1024 * 1024) // left to everything else
+
+struct rom_ram_entry_t
+{
+	rom_ram_t r;
+	char path[1024];
+	int form;
+	int valid;
+	uint64_t fsize;
+	time_t mtime;
+	uint32_t used;
+};
+
+static rom_ram_entry_t entries[ROM_RAM_ENTRIES];
+static uint32_t tick = 0;
+
+static uint64_t mem_available()
+{
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (!f) return 0;
+
+	char line[128];
+	unsigned long long kb = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb * 1024;
+}
+
+// Full path of name and the stat of the file holding it: the file itself
+// or the zip it's in.
+static int rom_ram_stat(const char *name, char *path, struct stat64 *st)
+{
+	snprintf(path, 1024, "%s", getFullPath(name));
+
+	char tmp[1024];
+	strcpy(tmp, path);
+	while (1)
+	{
+		if (!stat64(tmp, st)) return S_ISREG(st->st_mode);
+
+		char *p = strrchr(tmp, '/');
+		if (!p || p == tmp) return 0;
+		*p = 0;
+	}
+}
+
+static void rom_ram_free(rom_ram_entry_t *e)
+{
+	if (e->r.data)
+	{
+		munmap(e->r.data, e->r.size);
+		mem_account(MEM_ROM, -(int64_t)e->r.size);
+	}
+	memset(e, 0, sizeof(*e));
+}
+
+const rom_ram_t *rom_ram_get(const char *name, int form)
+{
+	char path[1024];
+	struct stat64 st;
+	if (!rom_ram_stat(name, path, &st)) return NULL;
+
+	for (int i = 0; i < ROM_RAM_ENTRIES; i++)
+	{
+		rom_ram_entry_t *e = &entries[i];
+		if (!e->valid || e->form != form || strcmp(e->path, path)) continue;
+
+		if (e->fsize != (uint64_t)st.st_size || e->mtime != st.st_mtime)
+		{
+			rom_ram_free(e);
+			return NULL;
+		}
+
+		e->used = ++tick;
+		return &e->r;
+	}
+
+	return NULL;
+}
+
+rom_ram_t *rom_ram_begin(const char *name, int form, uint32_t size)
+{
+	char path[1024];
+	struct stat64 st;
+	if (!size || size > ROM_RAM_LIMIT || !rom_ram_stat(name, path, &st)) return NULL;
+
+	uint64_t total = 0;
+	for (int i = 0; i < ROM_RAM_ENTRIES; i++)
+	{
+		rom_ram_entry_t *e = &entries[i];
+		if (e->r.data && e->form == form && !strcmp(e->path, path)) rom_ram_free(e);
+		total += entries[i].r.size;
+	}
+
+	// what the others may take, memory in use by the cache counts as available
+	uint64_t avail = mem_available() + total;
+	uint64_t limit = (avail > ROM_RAM_RESERVE) ? avail - ROM_RAM_RESERVE : 0;
+	if (limit > ROM_RAM_LIMIT) limit = ROM_RAM_LIMIT;
+	if (size > limit) return NULL;
+
+	rom_ram_entry_t *slot = NULL;
+	while (1)
+	{
+		rom_ram_entry_t *lru = NULL;
+		slot = NULL;
+		for (int i = 0; i < ROM_RAM_ENTRIES; i++)
+		{
+			rom_ram_entry_t *e = &entries[i];
+			if (!e->r.data) slot = e;
+			else if (!lru || e->used < lru->used) lru = e;
+		}
+
+		if (slot && total + size <= limit) break;
+		if (!lru) return NULL;
+
+		total -= lru->r.size;
+		rom_ram_free(lru);
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) return NULL;
+	mem_account(MEM_ROM, size);
+
+	slot->r.data = (uint8_t*)data;
+	slot->r.size = size;
+	strcpy(slot->path, path);
+	slot->form = form;
+	slot->fsize = st.st_size;
+	slot->mtime = st.st_mtime;
+	slot->used = ++tick;
+	return &slot->r;
+}
+
+void rom_ram_commit(rom_ram_t *r)
+{
+	if (!r) return;
+
+	rom_ram_entry_t *e = (rom_ram_entry_t*)r;
+	e->valid = 1;
+	printf("rom_ram: %s kept (%u bytes)\n", e->path, r->size);
+}
+
+void rom_ram_abort(rom_ram_t *r)
+{
+	if (r) rom_ram_free((rom_ram_entry_t*)r);
+}
@@ -0,0 +1,38 @@
+#ifndef ROM_RAM_H
+#define ROM_RAM_H
+
+#include <stdint.h>
+
+// The last ROMs sent to the core, kept in RAM as the payload that went out
+// (byte order normalized for N64) together with its hashes. Loading the same
+// file again, after a reset or from the recents, is only the transfer then:
+// no open, read, unzip or hash. Entries are checked against the size and
+// mtime of the file (of the zip for a file inside one). At most
+// ROM_RAM_ENTRIES of them and ROM_RAM_LIMIT bytes, less when the system runs
+// short of memory. Least recently used ones go first.
+
+#define ROM_RAM_ENTRIES 4
+#define ROM_RAM_LIMIT   (96 * 1024 * 1024)
+
+// what the payload is made of
+enum { ROM_RAM_PLAIN, ROM_RAM_N64 };
+
+struct rom_ram_t
+{
+	uint8_t *data;
+	uint32_t size;
+	uint32_t crc;
+	uint8_t md5[16];
+};
+
+// Entry of name in the given form, NULL if there's none or the file changed.
+// Valid until the next rom_ram_begin().
+const rom_ram_t *rom_ram_get(const char *name, int form);
+
+// New entry of size bytes, NULL if it doesn't fit. The caller fills data,
+// crc and md5, then finishes with rom_ram_commit() or rom_ram_abort().
+rom_ram_t *rom_ram_begin(const char *name, int form, uint32_t size);
+void rom_ram_commit(rom_ram_t *r);
+void rom_ram_abort(rom_ram_t *r);
+
+#endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "save_cache.h"
+#include "user_io.h"
+#include "hardware.h"
+#include "offload.h"
+#include "crc.h"
+#include "profiling.h"
+#include "memtrack.h"
+
+#define SAVE_CACHE_DISKS 16
+#define SAVE_CACHE_MAX   (2 * 1024 * 1024)
+#define SAVE_BLOCK       512
+#define SAVE_IDLE        1000 // ms without writes before the write back
+#define SAVE_MAX_DELAY   5000 // ms after the first change, for cores writing all the time
+#define SAVE_JNL_MAGIC   0x314C4E4A // "JNL1"
+
+struct save_run_t
+{
+	uint64_t offset;
+	std::vector<uint8_t> data;
+};
+
+typedef std::shared_ptr<std::vector<save_run_t>> save_runs_t;
+
+struct save_disk_t
+{
+	uint8_t *data;
+	uint32_t size;
+	int fd;
+	std::string journal;
+	std::vector<uint8_t> dirty; // per SAVE_BLOCK
+	int dirty_count;
+	unsigned long idle_timer;
+	unsigned long max_timer;
+	OffloadHandle writer;
+};
+
+static save_disk_t disks[SAVE_CACHE_DISKS];
+
+// The new journal has to be found after a power loss too
+static void sync_dir(const std::string &path)
+{
+	size_t p = path.rfind('/');
+	if (p == std::string::npos) return;
+
+	int fd = open(path.substr(0, p ? p : 1).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// Header: magic, run count. Runs: offset (8 bytes), length (4 bytes), data. Then CRC32 of all before it.
+static bool journal_write(const std::string &path, const save_runs_t &runs)
+{
+	std::vector<uint8_t> buf;
+	auto put = [&buf](const void *p, size_t len) { buf.insert(buf.end(), (const uint8_t *)p, (const uint8_t *)p + len); };
+
+	uint32_t hdr[2] = { SAVE_JNL_MAGIC, (uint32_t)runs->size() };
+	put(hdr, sizeof(hdr));
+	for (auto &run : *runs)
+	{
+		uint32_t len = run.data.size();
+		put(&run.offset, sizeof(run.offset));
+		put(&len, sizeof(len));
+		put(run.data.data(), len);
+	}
+	uint32_t crc = crc32_update(0, buf.data(), buf.size());
+	put(&crc, sizeof(crc));
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return false;
+
+	bool ok = write(fd, buf.data(), buf.size()) == (ssize_t)buf.size() && !fdatasync(fd);
+	close(fd);
+	if (ok) sync_dir(path);
+	return ok;
+}
+
+static void journal_replay(int fd, const std::string &path)
+{
+	// kept for a writable mount
+	if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) return;
+
+	int jfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (jfd < 0) return;
+
+	std::vector<uint8_t> buf;
+	struct stat st;
+	if (!fstat(jfd, &st) && st.st_size >= 12 && st.st_size <= 2 * SAVE_CACHE_MAX + (1 << 20))
+	{
+		buf.resize(st.st_size);
+		if (read(jfd, buf.data(), buf.size()) != (ssize_t)buf.size()) buf.clear();
+	}
+	close(jfd);
+
+	// Written completely before the save was touched, anything else means the save is still intact
+	bool ok = false;
+	uint32_t hdr[2] = {}, crc = 0;
+	if (buf.size() >= 12)
+	{
+		memcpy(hdr, buf.data(), sizeof(hdr));
+		memcpy(&crc, buf.data() + buf.size() - 4, 4);
+		ok = hdr[0] == SAVE_JNL_MAGIC && crc == crc32_update(0, buf.data(), buf.size() - 4);
+	}
+
+	size_t pos = 8;
+	for (uint32_t i = 0; ok && i < hdr[1]; i++)
+	{
+		uint64_t offset;
+		uint32_t len;
+		if (pos + 12 > buf.size() - 4) break;
+		memcpy(&offset, buf.data() + pos, 8);
+		memcpy(&len, buf.data() + pos + 8, 4);
+		pos += 12;
+		if (len > buf.size() - 4 - pos) break;
+
+		if (pwrite(fd, buf.data() + pos, len, offset) != (ssize_t)len)
+		{
+			printf("save_cache: failed to replay %u bytes at %llu.\n", len, (unsigned long long)offset);
+			return;
+		}
+		pos += len;
+	}
+
+	if (ok)
+	{
+		fdatasync(fd);
+		printf("save_cache: completed an interrupted write back from %s\n", path.c_str());
+	}
+	unlink(path.c_str());
+}
+
+static void write_back(int fd, const std::string &journal, const save_runs_t &runs)
+{
+	TRACE_SCOPE("save_write_back");
+
+	bool journaled = journal_write(journal, runs);
+	for (auto &run : *runs)
+	{
+		if (pwrite(fd, run.data.data(), run.data.size(), run.offset) != (ssize_t)run.data.size())
+		{
+			printf("save_cache: failed to write %u bytes of save data at %llu.\n", (uint32_t)run.data.size(), (unsigned long long)run.offset);
+		}
+	}
+	fdatasync(fd);
+	if (journaled) unlink(journal.c_str());
+}
+
+// Dirty blocks are written back, adjacent ones in one go. Unless sync is set
+// the writes are done by a worker, a write back in progress defers the next one.
+static void disk_flush(save_disk_t *d, bool sync)
+{
+	if (d->writer.valid())
+	{
+		if (!sync && !d->writer.done()) return;
+		d->writer.wait();
+		d->writer = OffloadHandle();
+	}
+
+	d->idle_timer = 0;
+	d->max_timer = 0;
+	if (!d->dirty_count) return;
+
+	auto runs = std::make_shared<std::vector<save_run_t>>();
+	for (size_t blk = 0; blk < d->dirty.size(); blk++)
+	{
+		if (!d->dirty[blk]) continue;
+
+		size_t end = blk;
+		while (end < d->dirty.size() && d->dirty[end]) d->dirty[end++] = 0;
+
+		size_t start = blk * SAVE_BLOCK;
+		size_t len = ((end * SAVE_BLOCK < d->size) ? end * SAVE_BLOCK : d->size) - start;
+		runs->push_back({ start, std::vector<uint8_t>(d->data + start, d->data + start + len) });
+		blk = end;
+	}
+	d->dirty_count = 0;
+
+	diskled_on();
+	int fd = d->fd;
+	std::string journal = d->journal;
+	auto work = [fd, journal, runs]() { write_back(fd, journal, runs); };
+
+	if (!sync) d->writer = offload_try_submit(work, OFFLOAD_PRIO_IO);
+	if (!d->writer.valid()) work();
+}
+
+void save_cache_unmount(int disk)
+{
+	if (disk < 0 || disk >= SAVE_CACHE_DISKS) return;
+
+	save_disk_t *d = &disks[disk];
+	if (!d->data) return;
+
+	disk_flush(d, true);
+	mem_account(MEM_CACHE, -(int64_t)d->size);
+	free(d->data);
+	*d = {};
+}
+
+void save_cache_mount(int disk, fileTYPE *f, const char *name)
+{
+	if (disk < 0 || disk >= SAVE_CACHE_DISKS || !f->filp) return;
+	save_cache_unmount(disk);
+
+	save_disk_t *d = &disks[disk];
+	d->fd = fileno(f->filp);
+	d->journal = std::string(getFullPath(name)) + ".jnl";
+	journal_replay(d->fd, d->journal);
+
+	if (!f->size || f->size > SAVE_CACHE_MAX) return;
+
+	d->data = (uint8_t *)malloc(f->size);
+	if (!d->data) return;
+
+	d->size = f->size;
+	mem_account(MEM_CACHE, d->size);
+	ssize_t got = pread(d->fd, d->data, d->size, 0);
+	if (got < 0) got = 0;
+	if ((uint32_t)got < d->size) memset(d->data + got, 0, d->size - got);
+
+	d->dirty.assign((d->size + SAVE_BLOCK - 1) / SAVE_BLOCK, 0);
+	printf("save_cache: %s (%u bytes) mirrored on %d slot\n", f->name, d->size, disk);
+}
+
+int save_cache_read(int disk, uint64_t pos, uint32_t len, uint8_t *dst)
+{
+	if (disk < 0 || disk >= SAVE_CACHE_DISKS) return 0;
+
+	save_disk_t *d = &disks[disk];
+	if (!d->data || !len || pos >= d->size) return 0;
+
+	// nothing past the end of the file, as a direct read
+	uint32_t n = (pos + len <= d->size) ? len : (uint32_t)(d->size - pos);
+	memcpy(dst, d->data + pos, n);
+	if (n < len) memset(dst + n, 0, len - n);
+	return 1;
+}
+
+int save_cache_write(int disk, uint64_t pos, const uint8_t *data, uint32_t len)
+{
+	if (disk < 0 || disk >= SAVE_CACHE_DISKS) return 0;
+
+	save_disk_t *d = &disks[disk];
+	if (!d->data || !len) return 0;
+
+	// the save grows, it's used directly from now on
+	if (pos + len > d->size)
+	{
+		save_cache_unmount(disk);
+		return 0;
+	}
+
+	memcpy(d->data + pos, data, len);
+	for (uint32_t blk = pos / SAVE_BLOCK; blk <= (pos + len - 1) / SAVE_BLOCK; blk++)
+	{
+		if (!d->dirty[blk])
+		{
+			d->dirty[blk] = 1;
+			d->dirty_count++;
+		}
+	}
+
+	d->idle_timer = GetTimer(SAVE_IDLE);
+	if (!d->max_timer) d->max_timer = GetTimer(SAVE_MAX_DELAY);
+	return 1;
+}
+
+void save_cache_poll()
+{
+	for (int i = 0; i < SAVE_CACHE_DISKS; i++)
+	{
+		save_disk_t *d = &disks[i];
+		if (!d->data) continue;
+
+		if (d->writer.valid() && d->writer.done()) d->writer = OffloadHandle();
+		if (d->dirty_count && (CheckTimer(d->idle_timer) || CheckTimer(d->max_timer))) disk_flush(d, false);
+	}
+}
+
+void save_cache_flush()
+{
+	for (int i = 0; i < SAVE_CACHE_DISKS; i++)
+	{
+		if (disks[i].data) disk_flush(&disks[i], true);
+	}
+}
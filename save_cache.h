@@ -0,0 +1,34 @@
+#ifndef SAVE_CACHE_H
+#define SAVE_CACHE_H
+
+#include <stdint.h>
+
+#include "file_io.h"
+
+// Write-back of the save images the cores use as SD card (SRAM, flash,
+// memory cards). A mounted save is mirrored in RAM, the core reads and
+// writes the mirror and changed 512 byte blocks are written back in one go
+// by an offload worker once the core stops writing for a while, when the
+// OSD opens and before a core change or reboot.
+// Every write back goes to <save>.jnl first: the runs it covers are synced
+// there before the save itself is touched, and a journal left by a power
+// loss is replayed into the save when it's mounted again.
+
+// Mirrors the save image f just opened from name, saves bigger than 2MB stay uncached.
+void save_cache_mount(int disk, fileTYPE *f, const char *name);
+
+// Writes back and drops the mirror of the disk, needed before its image is closed.
+void save_cache_unmount(int disk);
+
+// Return 0 if the disk isn't mirrored, it's read or written directly then.
+// A write growing the save writes the mirror back and drops it.
+int save_cache_read(int disk, uint64_t pos, uint32_t len, uint8_t *dst);
+int save_cache_write(int disk, uint64_t pos, const uint8_t *data, uint32_t len);
+
+// Starts the write back of mirrors idle for long enough, called from the poll loop.
+void save_cache_poll();
+
+// Writes back all mirrors and waits for it.
+void save_cache_flush();
+
+#endif
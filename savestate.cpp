@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "savestate.h"
+#include "cfg.h"
+#include "file_io.h"
+#include "offload.h"
+#include "profiling.h"
+#include "crc.h"
+#include "memtrack.h"
+#include "lib/miniz/miniz.h"
+
+#define SS_MAGIC 0x315A5353 // "SSZ1"
+
+struct ss_header
+{
+	uint32_t magic;
+	uint32_t size;   // raw slot size
+	uint32_t crc;    // CRC32 of the raw slot
+	uint32_t reserved;
+};
+
+struct ss_job
+{
+	int slot;
+	char path[1024];
+	char name[1024];
+	const void *src;
+	uint32_t size;
+	uint32_t packed;
+	int ok;
+	int busy;
+	OffloadHandle handle;
+};
+
+static ss_job jobs[SAVESTATE_SLOTS];
+
+struct ss_load
+{
+	char path[1024];
+	char name[1024];
+	void *dst;
+	uint32_t len;
+	int ret;
+	int busy;
+	OffloadHandle handle;
+};
+
+static ss_load loads[SAVESTATE_SLOTS];
+
+#define SSH_MAGIC 0x31485353 // "SSH1"
+#define SSH_KEY_EVERY 8      // full state every N saves of a slot, bounds the delta chain on restore
+
+struct ssh_entry
+{
+	uint32_t magic;
+	uint8_t slot;
+	uint8_t key;      // payload is the state itself, otherwise XOR against the previous state of the slot
+	uint16_t reserved;
+	uint32_t seq;
+	uint32_t size;    // raw state size
+	uint32_t packed;  // payload size
+	uint32_t crc;     // CRC32 of the raw state (not the delta)
+};
+
+struct ssh_ref
+{
+	off_t offset;     // of the payload
+	ssh_entry hdr;
+};
+
+// History ring file of the current game. All access is under hist_lock since
+// appends come from the slot workers while restores run on the main thread.
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static char hist_path[1024];
+static uint32_t hist_seq;
+static int hist_entries;
+static uint8_t *hist_prev[SAVESTATE_SLOTS];
+static uint32_t hist_prev_size[SAVESTATE_SLOTS];
+static int hist_since_key[SAVESTATE_SLOTS];
+
+static int ss_write_all(int fd, const void *buf, int len)
+{
+	const uint8_t *p = (const uint8_t*)buf;
+	while (len > 0)
+	{
+		int ret = write(fd, p, len);
+		if (ret <= 0) return 0;
+		p += ret;
+		len -= ret;
+	}
+	return 1;
+}
+
+struct ss_out
+{
+	int fd;
+	uint32_t size;
+};
+
+static mz_bool ss_put(const void *buf, int len, void *user)
+{
+	ss_out *out = (ss_out*)user;
+	out->size += len;
+	return ss_write_all(out->fd, buf, len);
+}
+
+static int ss_read_all(int fd, void *buf, int len, off_t offset)
+{
+	uint8_t *p = (uint8_t*)buf;
+	while (len > 0)
+	{
+		int ret = pread(fd, p, len, offset);
+		if (ret <= 0) return 0;
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 1;
+}
+
+// Entries in file order. A torn entry at the end (power loss during append) ends the list.
+static void ssh_scan(int fd, std::vector<ssh_ref> &refs)
+{
+	refs.clear();
+
+	struct stat st;
+	if (fstat(fd, &st)) return;
+
+	off_t pos = 0;
+	ssh_ref ref;
+	while (pos + (off_t)sizeof(ssh_entry) <= st.st_size && ss_read_all(fd, &ref.hdr, sizeof(ssh_entry), pos))
+	{
+		if (ref.hdr.magic != SSH_MAGIC || ref.hdr.slot >= SAVESTATE_SLOTS) break;
+
+		ref.offset = pos + sizeof(ssh_entry);
+		if (ref.offset + (off_t)ref.hdr.packed > st.st_size) break;
+
+		refs.push_back(ref);
+		pos = ref.offset + ref.hdr.packed;
+	}
+}
+
+// Drops the oldest entries over the limit and then any deltas which lost their
+// keyframe, the survivors are copied into a new file which replaces the old one.
+static void ssh_compact(int limit)
+{
+	int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	std::vector<ssh_ref> refs;
+	ssh_scan(fd, refs);
+
+	int first = (int)refs.size() - limit;
+	if (first < 0) first = 0;
+
+	int keyed[SAVESTATE_SLOTS] = {};
+	std::vector<ssh_ref> keep;
+	for (int i = first; i < (int)refs.size(); i++)
+	{
+		ssh_ref &ref = refs[i];
+		if (ref.hdr.key) keyed[ref.hdr.slot] = 1;
+		if (keyed[ref.hdr.slot]) keep.push_back(ref);
+	}
+
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", hist_path);
+	int out = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+	int ok = out >= 0;
+
+	std::vector<uint8_t> buf;
+	for (size_t i = 0; ok && i < keep.size(); i++)
+	{
+		buf.resize(keep[i].hdr.packed);
+		ok = ss_read_all(fd, buf.data(), buf.size(), keep[i].offset) &&
+			ss_write_all(out, &keep[i].hdr, sizeof(ssh_entry)) &&
+			ss_write_all(out, buf.data(), buf.size());
+	}
+	close(fd);
+
+	if (out >= 0)
+	{
+		ok = ok && !fsync(out);
+		close(out);
+		if (ok) ok = !rename(tmp, hist_path);
+		if (!ok) unlink(tmp);
+	}
+
+	if (ok) hist_entries = keep.size();
+}
+
+// Takes ownership of state (the staging buffer), it becomes the base of the next delta.
+static void ssh_append(int slot, uint8_t *state, uint32_t size)
+{
+	TRACE_SCOPE("savestate_history");
+
+	pthread_mutex_lock(&hist_lock);
+
+	int limit = cfg.savestate_history;
+	if (hist_path[0] && limit)
+	{
+		uint8_t *prev = hist_prev[slot];
+		int key = !prev || hist_since_key[slot] >= SSH_KEY_EVERY;
+
+		uint8_t *delta = NULL;
+		if (!key && (delta = (uint8_t*)malloc(size)))
+		{
+			uint32_t common = (size < hist_prev_size[slot]) ? size : hist_prev_size[slot];
+			for (uint32_t i = 0; i < common; i++) delta[i] = state[i] ^ prev[i];
+			memcpy(delta + common, state + common, size - common);
+		}
+		if (!delta) key = 1;
+
+		size_t packed = 0;
+		int flags = tdefl_create_comp_flags_from_zip_params(1, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+		void *payload = tdefl_compress_mem_to_heap(key ? state : delta, size, &packed, flags);
+		free(delta);
+
+		ssh_entry hdr = { SSH_MAGIC, (uint8_t)slot, (uint8_t)key, 0, hist_seq, size, (uint32_t)packed, crc32_update(0, state, size) };
+		int fd = payload ? open(hist_path, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0666) : -1;
+		if (fd >= 0)
+		{
+			if (ss_write_all(fd, &hdr, sizeof(hdr)) && ss_write_all(fd, payload, packed))
+			{
+				hist_seq++;
+				hist_entries++;
+				hist_since_key[slot] = key ? 1 : hist_since_key[slot] + 1;
+
+				mem_account(MEM_SAVESTATE, -(int64_t)hist_prev_size[slot]);
+				free(hist_prev[slot]);
+				hist_prev[slot] = state;
+				hist_prev_size[slot] = size;
+				state = NULL;
+			}
+			close(fd);
+		}
+		else
+		{
+			printf("savestate: unable to write history %s\n", hist_path);
+		}
+		mz_free(payload);
+
+		// A failed append leaves no base, so the next entry of the slot is a keyframe
+		if (state)
+		{
+			mem_account(MEM_SAVESTATE, -(int64_t)hist_prev_size[slot]);
+			free(hist_prev[slot]);
+			hist_prev[slot] = NULL;
+			hist_prev_size[slot] = 0;
+		}
+
+		// Compact with some slack so the file isn't rewritten on every save
+		if (hist_entries > limit + limit / 4) ssh_compact(limit);
+	}
+
+	pthread_mutex_unlock(&hist_lock);
+	if (state) mem_account(MEM_SAVESTATE, -(int64_t)size);
+	free(state);
+}
+
+// Offload worker, plain file I/O on the full path since file_io isn't thread safe
+static void ss_write_job(ss_job *job)
+{
+	TRACE_SCOPE("savestate_write");
+
+	job->ok = 0;
+	uint8_t *stage = (uint8_t*)malloc(job->size);
+	if (!stage) return;
+	mem_account(MEM_SAVESTATE, job->size);
+
+	// DDR is mapped uncached, one sequential copy is much cheaper than deflate reading it
+	memcpy(stage, job->src, job->size);
+
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+	if (fd >= 0)
+	{
+		ss_header hdr = { SS_MAGIC, job->size, crc32_update(0, stage, job->size), 0 };
+		ss_out out = { fd, 0 };
+
+		// Level 1: states are mostly zeroes and repeats, higher levels gain little for a lot of time
+		int flags = tdefl_create_comp_flags_from_zip_params(1, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+		job->ok = ss_write_all(fd, &hdr, sizeof(hdr)) &&
+			tdefl_compress_mem_to_output(stage, job->size, ss_put, &out, flags) &&
+			!fsync(fd);
+		job->packed = out.size + sizeof(hdr);
+
+		close(fd);
+		if (job->ok) job->ok = !rename(tmp, job->path);
+		if (!job->ok) unlink(tmp);
+	}
+
+	if (job->ok) ssh_append(job->slot, stage, job->size);
+	else
+	{
+		mem_account(MEM_SAVESTATE, -(int64_t)job->size);
+		free(stage);
+	}
+}
+
+int savestate_write(int slot, const char *name, const void *src, uint32_t size)
+{
+	if (slot < 0 || slot >= SAVESTATE_SLOTS) return 0;
+
+	ss_job *job = &jobs[slot];
+	if (job->busy || savestate_loading(slot)) return 0;
+
+	job->slot = slot;
+	snprintf(job->name, sizeof(job->name), "%s", name);
+	snprintf(job->path, sizeof(job->path), "%s", getFullPath(name));
+	job->src = src;
+	job->size = size;
+	job->busy = 1;
+	job->handle = offload_submit([job] { ss_write_job(job); }, OFFLOAD_PRIO_IO);
+	return 1;
+}
+
+void savestate_poll()
+{
+	for (int i = 0; i < SAVESTATE_SLOTS; i++)
+	{
+		ss_job *job = &jobs[i];
+		if (!job->busy || !job->handle.done()) continue;
+
+		job->busy = 0;
+		job->handle = OffloadHandle();
+		if (job->ok) printf("Wrote %u bytes (%u packed) to file: %s\n", job->size, job->packed, job->name);
+		else printf("Unable to write file: %s\n", job->name);
+	}
+
+	for (int i = 0; i < SAVESTATE_SLOTS; i++)
+	{
+		ss_load *job = &loads[i];
+		if (!job->busy || !job->handle.done()) continue;
+
+		job->busy = 0;
+		job->handle = OffloadHandle();
+		if (!job->name[0]) continue;
+		if (job->ret < 0) printf("Unable to read file: %s\n", job->name);
+		else printf("process_ss: read %d bytes from file: %s\n", job->ret, job->name);
+	}
+}
+
+void savestate_wait()
+{
+	for (int i = 0; i < SAVESTATE_SLOTS; i++)
+	{
+		if (jobs[i].busy) jobs[i].handle.wait();
+		if (loads[i].busy) loads[i].handle.wait();
+	}
+	savestate_poll();
+}
+
+// Plain file I/O so it also runs on a worker. The state is inflated on the heap
+// and copied once, inflating straight into uncached DDR would read it back for matches.
+static int ss_read_path(const char *path, void *dst, uint32_t len)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	ss_header hdr = {};
+	int ret = -1;
+	if (!fstat(fd, &st) && st.st_size > (off_t)sizeof(hdr) && ss_read_all(fd, &hdr, sizeof(hdr), 0) && hdr.magic == SS_MAGIC)
+	{
+		uint32_t packed = st.st_size - sizeof(hdr);
+		uint8_t *src = (uint8_t*)malloc(packed);
+		uint8_t *raw = (uint8_t*)malloc(hdr.size);
+		if (src && raw && ss_read_all(fd, src, packed, sizeof(hdr)) &&
+			tinfl_decompress_mem_to_mem(raw, hdr.size, src, packed, 0) == hdr.size &&
+			crc32_update(0, raw, hdr.size) == hdr.crc)
+		{
+			ret = (hdr.size < len) ? hdr.size : len;
+			memcpy(dst, raw, ret);
+		}
+		else
+		{
+			printf("savestate: %s is damaged\n", path);
+		}
+
+		free(src);
+		free(raw);
+	}
+	else
+	{
+		uint32_t raw = (st.st_size < (off_t)len) ? (uint32_t)st.st_size : len;
+		if (ss_read_all(fd, dst, raw, 0)) ret = raw;
+	}
+
+	close(fd);
+	return ret;
+}
+
+int savestate_read(const char *name, void *dst, uint32_t len)
+{
+	return ss_read_path(getFullPath(name), dst, len);
+}
+
+static void ss_load_job(ss_load *job)
+{
+	TRACE_SCOPE("savestate_load");
+
+	uint8_t *dst = (uint8_t*)job->dst;
+	job->ret = job->path[0] ? ss_read_path(job->path, dst, job->len) : 0;
+
+	uint32_t used = (job->ret > 0) ? job->ret : 0;
+	memset(dst + used, 0, job->len - used);
+
+	// The counter goes last: until it is set the slot reads as empty and process_ss leaves it alone
+	__sync_synchronize();
+	*(volatile uint32_t*)dst = 0xFFFFFFFF;
+}
+
+void savestate_preload(int slot, const char *name, void *dst, uint32_t len)
+{
+	if (slot < 0 || slot >= SAVESTATE_SLOTS || len < 8) return;
+
+	ss_load *job = &loads[slot];
+	if (job->busy) job->handle.wait();
+
+	// Taken by the core as an empty slot until the load is done
+	((volatile uint32_t*)dst)[0] = 0;
+	((volatile uint32_t*)dst)[1] = 0;
+
+	snprintf(job->name, sizeof(job->name), "%s", name ? name : "");
+	snprintf(job->path, sizeof(job->path), "%s", name ? getFullPath(name) : "");
+	job->dst = dst;
+	job->len = len;
+	job->busy = 1;
+	job->handle = offload_submit([job] { ss_load_job(job); }, OFFLOAD_PRIO_IO);
+}
+
+int savestate_loading(int slot)
+{
+	return slot >= 0 && slot < SAVESTATE_SLOTS && loads[slot].busy && !loads[slot].handle.done();
+}
+
+void savestate_history_open(const char *name)
+{
+	savestate_wait();
+
+	pthread_mutex_lock(&hist_lock);
+
+	hist_path[0] = 0;
+	hist_seq = 0;
+	hist_entries = 0;
+	for (int i = 0; i < SAVESTATE_SLOTS; i++)
+	{
+		mem_account(MEM_SAVESTATE, -(int64_t)hist_prev_size[i]);
+		free(hist_prev[i]);
+		hist_prev[i] = NULL;
+		hist_prev_size[i] = 0;
+		hist_since_key[i] = 0;
+	}
+
+	if (name && cfg.savestate_history)
+	{
+		snprintf(hist_path, sizeof(hist_path), "%s", getFullPath(name));
+
+		int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			std::vector<ssh_ref> refs;
+			ssh_scan(fd, refs);
+			close(fd);
+
+			hist_entries = refs.size();
+			if (!refs.empty()) hist_seq = refs.back().hdr.seq + 1;
+
+			// Drop a torn tail and anything over a lowered limit right away
+			struct stat st;
+			off_t end = refs.empty() ? 0 : refs.back().offset + refs.back().hdr.packed;
+			if ((!stat(hist_path, &st) && st.st_size != end) || hist_entries > cfg.savestate_history) ssh_compact(cfg.savestate_history);
+		}
+	}
+
+	pthread_mutex_unlock(&hist_lock);
+}
+
+int savestate_history_count(int slot)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&hist_lock);
+	int fd = hist_path[0] ? open(hist_path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0)
+	{
+		std::vector<ssh_ref> refs;
+		ssh_scan(fd, refs);
+		close(fd);
+
+		for (auto &ref : refs) if (ref.hdr.slot == slot) count++;
+	}
+	pthread_mutex_unlock(&hist_lock);
+
+	return count;
+}
+
+int savestate_history_read(int slot, int back, void *dst, uint32_t len)
+{
+	TRACE_SCOPE("savestate_history_read");
+
+	int ret = -1;
+
+	pthread_mutex_lock(&hist_lock);
+	int fd = hist_path[0] ? open(hist_path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0)
+	{
+		std::vector<ssh_ref> refs;
+		ssh_scan(fd, refs);
+
+		std::vector<ssh_ref> chain;
+		for (auto &ref : refs) if (ref.hdr.slot == slot) chain.push_back(ref);
+
+		int last = (int)chain.size() - 1 - back;
+		int first = last;
+		while (first >= 0 && !chain[first].hdr.key) first--;
+
+		if (last >= 0 && first >= 0)
+		{
+			std::vector<uint8_t> state, src, raw;
+			int ok = 1;
+			for (int i = first; ok && i <= last; i++)
+			{
+				ssh_entry &hdr = chain[i].hdr;
+				src.resize(hdr.packed);
+				raw.resize(hdr.size);
+				ok = ss_read_all(fd, src.data(), src.size(), chain[i].offset) &&
+					tinfl_decompress_mem_to_mem(raw.data(), raw.size(), src.data(), src.size(), 0) == hdr.size;
+				if (!ok) break;
+
+				if (hdr.key) state.swap(raw);
+				else
+				{
+					// A grown state XORs against zeroes past the old end
+					state.resize(hdr.size, 0);
+					for (uint32_t n = 0; n < hdr.size; n++) state[n] ^= raw[n];
+				}
+				ok = crc32_update(0, state.data(), state.size()) == hdr.crc;
+			}
+
+			if (ok)
+			{
+				ret = (state.size() < len) ? state.size() : len;
+				memcpy(dst, state.data(), ret);
+			}
+			else
+			{
+				printf("savestate: history %s is damaged\n", hist_path);
+			}
+		}
+		close(fd);
+	}
+	pthread_mutex_unlock(&hist_lock);
+
+	return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdint.h>
+
+// Savestate slot files.
+// Slots are written on an offload worker: the slot is copied out of DDR into a
+// staging buffer, deflated and written to a temporary file which replaces the
+// old one by rename, so a crash never leaves a half written state behind.
+// Files start with a small header when compressed, plain raw slot dumps from
+// older versions still load.
+//
+// With savestate_history set in MiSTer.ini every successful slot write is also
+// appended to a per game <game>.ssh file: a deflated XOR against the previous
+// save of the same slot, with a full keyframe every few saves. The file keeps
+// the last savestate_history saves of all slots together.
+
+#define SAVESTATE_SLOTS 4
+
+// name relative to the root. src must stay mapped until the write is finished.
+// Returns 0 if the previous write of that slot is still running.
+int savestate_write(int slot, const char *name, const void *src, uint32_t size);
+
+// Reports finished writes, call from the main loop.
+void savestate_poll();
+
+// Blocks until all writes are done (before a slot is reused).
+void savestate_wait();
+
+// Reads a slot file (compressed or raw) into dst. Returns bytes read, -1 on error.
+int savestate_read(const char *name, void *dst, uint32_t len);
+
+// Clears the slot memory and reads the slot file (NULL if there is none) into it
+// on a worker. The slot counter word is set to 0xFFFFFFFF once it's done, until
+// then the slot header reads as empty.
+void savestate_preload(int slot, const char *name, void *dst, uint32_t len);
+
+// 1 while the preload of the slot is running, its memory must not be saved.
+int savestate_loading(int slot);
+
+// Selects the history file of the game (name relative to the root), NULL to close.
+// Waits for running writes, call when the slots are cleared at ROM mount.
+void savestate_history_open(const char *name);
+
+// Number of saves of the slot in the history.
+int savestate_history_count(int slot);
+
+// Rebuilds the save of the slot back steps before the latest one (0 - latest) into dst.
+// Returns the state size, -1 if there is no such entry or it's damaged.
+int savestate_history_read(int slot, int back, void *dst, uint32_t len);
+
+#endif
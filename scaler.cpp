@@ -18,7 +18,21 @@ with help from the MiSTer contributors including Grabulosaure
 
 #include "scaler.h"
 #include "shmem.h"
+#include "offload.h"
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+static void scaler_parse_header(mister_scaler *ms, const unsigned char *buffer)
+{
+    ms->header=buffer[2]<<8 | buffer[3];
+    ms->width =buffer[6]<<8 | buffer[7];
+    ms->height=buffer[8]<<8 | buffer[9];
+    ms->line  =buffer[10]<<8 | buffer[11];
+    ms->output_width =buffer[12]<<8 | buffer[13];
+    ms->output_height=buffer[14]<<8 | buffer[15];
+}
 
 mister_scaler * mister_scaler_init()
 {
@@ -32,7 +46,7 @@ mister_scaler * mister_scaler_init()
     //printf("map_start = %d map_off=%d offset=%d\n",map_start,ms->map_off,offset);
 
     unsigned char *buffer;
-    ms->map=(char *)shmem_map(map_start, ms->num_bytes+ms->map_off);
+    ms->map=(char *)shmem_map_cached(map_start, ms->num_bytes+ms->map_off);
     if (!ms->map)
     {
         mister_scaler_free(ms);
@@ -48,12 +62,7 @@ mister_scaler * mister_scaler_init()
         return NULL;
     }
 
-    ms->header=buffer[2]<<8 | buffer[3];
-    ms->width =buffer[6]<<8 | buffer[7];
-    ms->height=buffer[8]<<8 | buffer[9];
-    ms->line  =buffer[10]<<8 | buffer[11];
-    ms->output_width =buffer[12]<<8 | buffer[13];
-    ms->output_height=buffer[14]<<8 | buffer[15];
+    scaler_parse_header(ms, buffer);
 
     printf ("Image: Width=%i Height=%i  Line=%i  Header=%i output_width=%i output_height=%i \n",ms->width,ms->height,ms->line,ms->header,ms->output_width,ms->output_height);
    /*
@@ -68,84 +77,243 @@ mister_scaler * mister_scaler_init()
 
 void mister_scaler_free(mister_scaler *ms)
 {
-   shmem_unmap(ms->map,ms->num_bytes+ms->map_off);
+   if (ms->map) shmem_unmap_cached(ms->map);
    free(ms);
 }
 
-int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
+// Re-read the frame geometry, the mode may have changed since init
+int mister_scaler_update(mister_scaler *ms)
 {
-    unsigned char *buffer;
-    buffer = (unsigned char *)(ms->map+ms->map_off);
+    const unsigned char *buffer = (const unsigned char *)(ms->map+ms->map_off);
+    if (buffer[0]!=1 || buffer[1]!=1) return -1;
+
+    scaler_parse_header(ms, buffer);
+    return 0;
+}
+
+// BT.601 limited range, 8 bit fixed point
+static inline unsigned char rgb_y(int r, int g, int b) { return ((66*r + 129*g + 25*b + 128) >> 8) + 16; }
+static inline unsigned char rgb_u(int r, int g, int b) { return ((-38*r - 74*g + 112*b + 128) >> 8) + 128; }
+static inline unsigned char rgb_v(int r, int g, int b) { return ((112*r - 94*g - 18*b + 128) >> 8) + 128; }
+
+#ifdef __ARM_NEON
+static inline uint8x16_t neon_y(const uint8x16x3_t &p)
+{
+    uint16x8_t lo = vmull_u8(vget_low_u8(p.val[0]), vdup_n_u8(66));
+    lo = vmlal_u8(lo, vget_low_u8(p.val[1]), vdup_n_u8(129));
+    lo = vmlal_u8(lo, vget_low_u8(p.val[2]), vdup_n_u8(25));
+
+    uint16x8_t hi = vmull_u8(vget_high_u8(p.val[0]), vdup_n_u8(66));
+    hi = vmlal_u8(hi, vget_high_u8(p.val[1]), vdup_n_u8(129));
+    hi = vmlal_u8(hi, vget_high_u8(p.val[2]), vdup_n_u8(25));
+
+    return vaddq_u8(vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)), vdupq_n_u8(16));
+}
+
+static inline uint8x8_t neon_chroma(int16x8_t r, int16x8_t g, int16x8_t b, int cr, int cg, int cb)
+{
+    int16x8_t c = vmulq_n_s16(r, cr);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, b, cb);
+    c = vaddq_s16(vshrq_n_s16(vaddq_s16(c, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+    return vqmovun_s16(c);
+}
 
-    // do this slow way for now..
-    unsigned char *pixbuf;
-    unsigned char *outbufy;
-    unsigned char *outbufU;
-    unsigned char *outbufV;
-    for (int  y=0; y< ms->height ; y++)
-	{
-        pixbuf=&buffer[ms->header + y*ms->line];
-        outbufy=&bufY[y*(lineY)];
-        outbufU=&bufU[y*(lineU)];
-        outbufV=&bufV[y*(lineV)];
-        for (int x = 0; x < ms->width ; x++)
-		{
-			int R,G,B;
-			R = *pixbuf++;
-			G = *pixbuf++;
-			B = *pixbuf++;
-			int Y =  (0.257 * R) + (0.504 * G) + (0.098 * B) + 16;
-			int U = -(0.148 * R) - (0.291 * G) + (0.439 * B) + 128;
-			int V =  (0.439 * R) - (0.368 * G) - (0.071 * B) + 128;
-
-			*outbufy++ = Y;
-			*outbufU++ = U;
-			*outbufV++ = V;
+// 2x2 block average of one channel of two rows
+static inline int16x8_t neon_avg(uint8x16_t a, uint8x16_t b)
+{
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(a), vpaddlq_u8(b)), 2));
+}
+
+// Full resolution chroma of 8 pixels
+static inline uint8x16_t neon_chroma16(const uint8x16x3_t &p, int cr, int cg, int cb)
+{
+    int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(p.val[0])));
+    int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(p.val[1])));
+    int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(p.val[2])));
+    uint8x8_t lo = neon_chroma(r, g, b, cr, cg, cb);
+
+    r = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(p.val[0])));
+    g = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(p.val[1])));
+    b = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(p.val[2])));
+    return vcombine_u8(lo, neon_chroma(r, g, b, cr, cg, cb));
+}
+#endif
+
+// Rows of a frame are split between the caller and one offload worker, so both
+// free A9 cores read from the uncached buffer. Small frames, or a full queue,
+// are done by the caller alone.
+static void scaler_rows(int rows, int align, const std::function<void(int, int)> &fn)
+{
+    if (rows >= 128)
+    {
+        int half = (rows / 2) & ~(align - 1);
+        OffloadHandle h = offload_try_submit([&fn, half]() { fn(0, half); }, OFFLOAD_PRIO_DECODE);
+        if (h.valid())
+        {
+            fn(half, rows);
+            h.wait();
+            return;
         }
     }
 
+    fn(0, rows);
+}
+
+static int scaler_valid(mister_scaler *ms)
+{
+    return ms->header + ms->height*ms->line <= ms->num_bytes;
+}
+
+// Planar 4:2:0 (I420) of the even sized part of the frame, (width & ~1) per Y line,
+// half of that per U/V line. Chroma is the average of each 2x2 block.
+int mister_scaler_read_yuv420(mister_scaler *ms, unsigned char *bufY, unsigned char *bufU, unsigned char *bufV)
+{
+    if (!scaler_valid(ms)) return -1;
+
+    const unsigned char *buffer = (const unsigned char *)(ms->map+ms->map_off);
+    int w = ms->width & ~1;
+    int h = ms->height & ~1;
+
+    scaler_rows(h, 2, [=](int first, int last)
+    {
+        for (int y = first; y < last; y += 2)
+        {
+            const unsigned char *s0 = &buffer[ms->header + y*ms->line];
+            const unsigned char *s1 = s0 + ms->line;
+            unsigned char *y0 = &bufY[y*w];
+            unsigned char *y1 = y0 + w;
+            unsigned char *u = &bufU[(y/2)*(w/2)];
+            unsigned char *v = &bufV[(y/2)*(w/2)];
+            int x = 0;
+
+#ifdef __ARM_NEON
+            for (; x + 16 <= w; x += 16, s0 += 48, s1 += 48, y0 += 16, y1 += 16, u += 8, v += 8)
+            {
+                uint8x16x3_t p0 = vld3q_u8(s0);
+                uint8x16x3_t p1 = vld3q_u8(s1);
+                vst1q_u8(y0, neon_y(p0));
+                vst1q_u8(y1, neon_y(p1));
+
+                int16x8_t r = neon_avg(p0.val[0], p1.val[0]);
+                int16x8_t g = neon_avg(p0.val[1], p1.val[1]);
+                int16x8_t b = neon_avg(p0.val[2], p1.val[2]);
+                vst1_u8(u, neon_chroma(r, g, b, -38, -74, 112));
+                vst1_u8(v, neon_chroma(r, g, b, 112, -94, -18));
+            }
+#endif
+
+            for (; x < w; x += 2, s0 += 6, s1 += 6, y0 += 2, y1 += 2, u++, v++)
+            {
+                y0[0] = rgb_y(s0[0], s0[1], s0[2]);
+                y0[1] = rgb_y(s0[3], s0[4], s0[5]);
+                y1[0] = rgb_y(s1[0], s1[1], s1[2]);
+                y1[1] = rgb_y(s1[3], s1[4], s1[5]);
+
+                int r = (s0[0] + s0[3] + s1[0] + s1[3] + 2) >> 2;
+                int g = (s0[1] + s0[4] + s1[1] + s1[4] + 2) >> 2;
+                int b = (s0[2] + s0[5] + s1[2] + s1[5] + 2) >> 2;
+                *u = rgb_u(r, g, b);
+                *v = rgb_v(r, g, b);
+            }
+        }
+    });
+
+    return 0;
+}
+
+// Planar 4:4:4, BT.601 limited range
+int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
+{
+    if (!scaler_valid(ms)) return -1;
+
+    const unsigned char *buffer = (const unsigned char *)(ms->map+ms->map_off);
+
+    scaler_rows(ms->height, 1, [=](int first, int last)
+    {
+        for (int y = first; y < last; y++)
+        {
+            const unsigned char *pixbuf = &buffer[ms->header + y*ms->line];
+            unsigned char *outbufY = &bufY[y*lineY];
+            unsigned char *outbufU = &bufU[y*lineU];
+            unsigned char *outbufV = &bufV[y*lineV];
+            int x = 0;
+
+#ifdef __ARM_NEON
+            for (; x + 16 <= ms->width; x += 16, pixbuf += 48, outbufY += 16, outbufU += 16, outbufV += 16)
+            {
+                uint8x16x3_t p = vld3q_u8(pixbuf);
+                vst1q_u8(outbufY, neon_y(p));
+                vst1q_u8(outbufU, neon_chroma16(p, -38, -74, 112));
+                vst1q_u8(outbufV, neon_chroma16(p, 112, -94, -18));
+            }
+#endif
+
+            for (; x < ms->width; x++, pixbuf += 3)
+            {
+                *outbufY++ = rgb_y(pixbuf[0], pixbuf[1], pixbuf[2]);
+                *outbufU++ = rgb_u(pixbuf[0], pixbuf[1], pixbuf[2]);
+                *outbufV++ = rgb_v(pixbuf[0], pixbuf[1], pixbuf[2]);
+            }
+        }
+    });
+
     return 0;
 }
 
+// Frame in the scaler's own RGB order, packed to width*3 per line
 int mister_scaler_read(mister_scaler *ms,unsigned char *gbuf)
 {
-    unsigned char *buffer;
-    buffer = (unsigned char *)(ms->map+ms->map_off);
+    if (!scaler_valid(ms)) return -1;
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
-    for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*3)];
-          for (int x = 0; x < ms->width ; x++) {
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-          }
-    }
+    const unsigned char *buffer = (const unsigned char *)(ms->map+ms->map_off);
+
+    scaler_rows(ms->height, 1, [=](int first, int last)
+    {
+        for (int y = first; y < last; y++)
+            memcpy(&gbuf[y*ms->width*3], &buffer[ms->header + y*ms->line], ms->width*3);
+    });
 
     return 0;
 }
 
-int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf) {
-    unsigned char *buffer;
-    buffer = (unsigned char *)(ms->map+ms->map_off);
+// BGRA (Imlib's ARGB32)
+int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf)
+{
+    if (!scaler_valid(ms)) return -1;
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
-    for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*4)];
-          for (int x = 0; x < ms->width ; x++) {
-            outbuf[2] = *pixbuf++;
-            outbuf[1] = *pixbuf++;
-            outbuf[0] = *pixbuf++;
-            outbuf[3] = 0xFF;
-	    outbuf+=4;
-          }
-    }
+    const unsigned char *buffer = (const unsigned char *)(ms->map+ms->map_off);
+
+    scaler_rows(ms->height, 1, [=](int first, int last)
+    {
+        for (int y = first; y < last; y++)
+        {
+            const unsigned char *pixbuf = &buffer[ms->header + y*ms->line];
+            unsigned char *outbuf = &gbuf[y*(ms->width*4)];
+            int x = 0;
+
+#ifdef __ARM_NEON
+            for (; x + 16 <= ms->width; x += 16, pixbuf += 48, outbuf += 64)
+            {
+                uint8x16x3_t p = vld3q_u8(pixbuf);
+                uint8x16x4_t o;
+                o.val[0] = p.val[2];
+                o.val[1] = p.val[1];
+                o.val[2] = p.val[0];
+                o.val[3] = vdupq_n_u8(0xFF);
+                vst4q_u8(outbuf, o);
+            }
+#endif
+
+            for (; x < ms->width; x++, pixbuf += 3, outbuf += 4)
+            {
+                outbuf[2] = pixbuf[0];
+                outbuf[1] = pixbuf[1];
+                outbuf[0] = pixbuf[2];
+                outbuf[3] = 0xFF;
+            }
+        }
+    });
 
     return 0;
 }
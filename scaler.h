@@ -26,6 +26,8 @@ mister_scaler *mister_scaler_init();
 int mister_scaler_read(mister_scaler *,unsigned char *buffer);
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *buffer);
 int mister_scaler_read_yuv(mister_scaler *ms,int,unsigned char *y,int, unsigned char *U,int, unsigned char *V);
+int mister_scaler_read_yuv420(mister_scaler *ms, unsigned char *y, unsigned char *u, unsigned char *v);
+int mister_scaler_update(mister_scaler *ms);
 void mister_scaler_free(mister_scaler *);
 
 #endif
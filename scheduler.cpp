@@ -1,5 +1,9 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
@@ -7,16 +11,64 @@
 #include "fpga_io.h"
 #include "osd.h"
 #include "profiling.h"
+#include "hardware.h"
+#include "video.h"
+#include "file_io.h"
+#include "file_aio.h"
+#include "cmd_channel.h"
+#include "status_page.h"
+#include "realtime.h"
+#include "watchdog.h"
+#include "prewarm.h"
+
+#define SCHED_MAX_TASKS 16
+#define SCHED_BG_ROUNDS 4 // background tasks get one slice every N rounds
+
+// Task stacks are carved from one reserved region with an inaccessible page
+// below each, so an overflow faults instead of running into the next stack.
+// Pages only take memory once touched.
+#define SCHED_STACK_DEFAULT (256 * 1024)
+#define SCHED_STACK_LARGE   (1024 * 1024) // loads, decoding and the menu run on these
+#define SCHED_STACK_POOL    (8 * 1024 * 1024)
+#define SCHED_STACK_CTX     64            // libco context at the bottom of the stack
+
+struct sched_task_t
+{
+	const char *name;
+	cothread_t co;
+	int prio;
+	uint32_t budget_us;
+	uint32_t period_us;
+	uint64_t last_us;
+	uint32_t slices;
+	uint64_t busy_us;
+	uint8_t *stack;      // NULL if it didn't fit the pool
+	uint32_t stack_size;
+};
 
 static cothread_t co_scheduler = nullptr;
-static cothread_t co_poll = nullptr;
-static cothread_t co_ui = nullptr;
-static cothread_t co_last = nullptr;
+static sched_task_t tasks[SCHED_MAX_TASKS];
+static int task_count = 0;
+static sched_task_t *task_current = nullptr;
+static uint64_t slice_start = 0;
+static uint32_t round_num = 0;
+static int ui_next = 0;
+static int bg_next = 0;
+static int periodic_count = 0;
+
+static uint8_t *stack_pool = nullptr;
+static size_t stack_pool_used = 0;
+static size_t page_size = 0;
+
+#define SCHED_IDLE_AFTER 100 // ms
+
+static uint32_t active_timer = 0;
 
 static void scheduler_wait_fpga_ready(void)
 {
 	while (!is_fpga_ready(1))
 	{
+		watchdog_beat();
 		fpga_wait_to_reset();
 	}
 }
@@ -27,22 +79,86 @@ static void scheduler_co_poll(void)
 	{
 		scheduler_wait_fpga_ready();
 
+		user_io_poll();
+		input_poll(0);
+		file_aio_poll();
+		realtime_poll_tick();
+		watchdog_beat();
+
+		scheduler_yield();
+	}
+}
+
+// Guests send the next share request right after the answer to the previous
+// one, so during copies keep serving while they come back quickly instead of
+// one request per round. When the share is unused it's checked less often.
+#define SHARE_SPIN_US    100  // wait this long for a follow-up request
+#define SHARE_BATCH_US   1000 // but don't hold the other tasks off longer than this
+#define SHARE_IDLE_AFTER 1000 // ms without requests before backing off
+#define SHARE_IDLE_POLL  2    // ms between checks when backed off
+
+static void scheduler_co_share(void)
+{
+	unsigned long idle_timer = GetTimer(0);
+	unsigned long next_check = 0;
+
+	for (;;)
+	{
+		if (!CheckTimer(idle_timer) || CheckTimer(next_check))
 		{
-			SPIKE_SCOPE("co_poll", 1000);
-			user_io_poll();
-			input_poll(0);
+			next_check = GetTimer(SHARE_IDLE_POLL);
+
+			uint64_t start = trace_now_us();
+			uint64_t last = 0;
+			while (1)
+			{
+				uint64_t now = trace_now_us();
+				if (user_io_share_poll()) last = now;
+				else if (!last || now - last >= SHARE_SPIN_US) break;
+				if (now - start >= SHARE_BATCH_US) break;
+			}
+
+			if (last)
+			{
+				idle_timer = GetTimer(SHARE_IDLE_AFTER);
+				scheduler_activity();
+			}
 		}
 
 		scheduler_yield();
 	}
 }
 
+// CD cores stream sectors on their own timing. Their servicing used to happen
+// between the OSD line writes too, now the OSD yields to this instead.
+#define CD_PERIOD_US 500
+
+static void scheduler_co_cd(void)
+{
+	uint64_t last = 0;
+	for (;;)
+	{
+		scheduler_wait_fpga_ready();
+
+		uint64_t start = trace_now_us();
+		if (user_io_cd_poll())
+		{
+			// from one service to the next, what the core has to wait at worst
+			if (last) trace_event("cd_interval", last);
+			last = start;
+		}
+		else last = 0;
+
+		scheduler_yield();
+	}
+}
+
 static void scheduler_co_ui(void)
 {
 	for (;;)
 	{
+		if (menu_ui_due())
 		{
-			SPIKE_SCOPE("co_ui", 1000);
 			HandleUI();
 			OsdUpdate();
 		}
@@ -51,39 +167,163 @@ static void scheduler_co_ui(void)
 	}
 }
 
+static void scheduler_run_task(sched_task_t *task)
+{
+	// a slice overrunning its budget twice gets a spike report
+	SPIKE_SCOPE(task->name, task->budget_us * 2);
+
+	slice_start = trace_now_us();
+	__atomic_store_n(&task_current, task, __ATOMIC_RELEASE);
+	task->last_us = slice_start;
+	co_switch(task->co);
+	__atomic_store_n(&task_current, (sched_task_t *)nullptr, __ATOMIC_RELEASE);
+
+	task->slices++;
+	task->busy_us += trace_now_us() - slice_start;
+	trace_event(task->name, slice_start);
+}
+
+// Next task of the tier, round robin
+static sched_task_t *scheduler_pick(int prio, int *next)
+{
+	for (int i = 0; i < task_count; i++)
+	{
+		sched_task_t *task = &tasks[(*next + i) % task_count];
+		if (task->prio == prio)
+		{
+			*next = (task - tasks + 1) % task_count;
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+
+// Realtime tasks run between any two slices of the lower tiers,
+// so a long UI operation can't hold off FPGA request servicing.
 static void scheduler_schedule(void)
 {
-	if (co_last == co_poll)
+	for (int i = 0; i < task_count; i++)
+	{
+		if (tasks[i].prio == SCHED_PRIO_REALTIME) scheduler_run_task(&tasks[i]);
+	}
+
+	sched_task_t *task = nullptr;
+	if (!(++round_num % SCHED_BG_ROUNDS)) task = scheduler_pick(SCHED_PRIO_BACKGROUND, &bg_next);
+	if (!task) task = scheduler_pick(SCHED_PRIO_UI, &ui_next);
+	if (!task) task = scheduler_pick(SCHED_PRIO_BACKGROUND, &bg_next);
+	if (task) scheduler_run_task(task);
+}
+
+static uint8_t *scheduler_stack_alloc(uint32_t size)
+{
+	if (!stack_pool)
 	{
-		co_last = co_ui;
-		co_switch(co_ui);
+		void *p = mmap(NULL, SCHED_STACK_POOL, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) return nullptr;
+		stack_pool = (uint8_t *)p;
+	}
+
+	if (stack_pool_used + page_size + size > SCHED_STACK_POOL) return nullptr;
+
+	uint8_t *stack = stack_pool + stack_pool_used + page_size;
+	if (mprotect(stack, size, PROT_READ | PROT_WRITE)) return nullptr;
+
+	stack_pool_used += page_size + size;
+	return stack;
+}
+
+// Runs on its own stack, the faulting one may be all used up
+static void scheduler_segv(int, siginfo_t *si, void *)
+{
+	uint8_t *addr = (uint8_t *)si->si_addr;
+	for (int i = 0; i < task_count; i++)
+	{
+		sched_task_t *t = &tasks[i];
+		if (!t->stack || addr < t->stack - page_size || addr >= t->stack) continue;
+
+		char msg[96];
+		int n = snprintf(msg, sizeof(msg), "\n*** stack overflow in %s (%u KB) ***\n", t->name, t->stack_size >> 10);
+		if (write(STDOUT_FILENO, msg, n) < 0) break;
+	}
+	// SA_RESETHAND: the fault repeats with the default action
+}
+
+static void scheduler_guard_init(void)
+{
+	static uint8_t alt_stack[16 * 1024];
+
+	stack_t ss = {};
+	ss.ss_sp = alt_stack;
+	ss.ss_size = sizeof(alt_stack);
+	if (sigaltstack(&ss, NULL)) return;
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = scheduler_segv;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+int scheduler_add_task(const char *name, void (*entry)(void), int prio, uint32_t budget_us, uint32_t period_us, uint32_t stack_size)
+{
+	if (task_count >= SCHED_MAX_TASKS) return 0;
+
+	if (!page_size) page_size = sysconf(_SC_PAGESIZE);
+	if (!stack_size) stack_size = SCHED_STACK_DEFAULT;
+	stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+	sched_task_t *task = &tasks[task_count];
+	task->stack = scheduler_stack_alloc(stack_size);
+	task->stack_size = stack_size;
+	if (task->stack)
+	{
+		task->co = co_derive(task->stack, stack_size, entry);
 	}
 	else
 	{
-		co_last = co_poll;
-		co_switch(co_poll);
+		printf("scheduler: no guarded stack for %s.\n", name);
+		task->co = co_create(stack_size, entry);
 	}
+	if (!task->co) return 0;
+
+	task->name = name;
+	task->prio = prio;
+	task->budget_us = budget_us;
+	task->period_us = (prio == SCHED_PRIO_REALTIME) ? period_us : 0;
+	task->last_us = 0;
+	task->slices = 0;
+	task->busy_us = 0;
+	if (task->period_us) periodic_count++;
+	task_count++;
+	return 1;
 }
 
 void scheduler_init(void)
 {
-	const unsigned int co_stack_size = 262144 * sizeof(void*);
+	scheduler_guard_init();
 
-	co_poll = co_create(co_stack_size, scheduler_co_poll);
-	co_ui = co_create(co_stack_size, scheduler_co_ui);
+	scheduler_add_task("co_poll", scheduler_co_poll, SCHED_PRIO_REALTIME, 1000, 0, SCHED_STACK_LARGE);
+	scheduler_add_task("co_share", scheduler_co_share, SCHED_PRIO_REALTIME, SHARE_BATCH_US);
+	scheduler_add_task("co_cd", scheduler_co_cd, SCHED_PRIO_REALTIME, 1000, CD_PERIOD_US, SCHED_STACK_LARGE);
+	scheduler_add_task("co_ui", scheduler_co_ui, SCHED_PRIO_UI, 2000, 0, SCHED_STACK_LARGE);
+	scheduler_add_task("co_scan", flist_scan_task, SCHED_PRIO_BACKGROUND, 2000);
+	scheduler_add_task("co_cmd", cmd_channel_task, SCHED_PRIO_UI, 2000, 0, SCHED_STACK_LARGE);
+	scheduler_add_task("co_status", status_page_task, SCHED_PRIO_BACKGROUND, 1000);
+	scheduler_add_task("co_prewarm", prewarm_task, SCHED_PRIO_BACKGROUND, 2000);
 }
 
 void scheduler_run(void)
 {
 	co_scheduler = co_active();
+	trace_thread_name("main");
 
 	for (;;)
 	{
 		scheduler_schedule();
 	}
 
-	co_delete(co_ui);
-	co_delete(co_poll);
+	for (int i = 0; i < task_count; i++) co_delete(tasks[i].co);
 	co_delete(co_scheduler);
 }
 
@@ -91,3 +331,89 @@ void scheduler_yield(void)
 {
 	co_switch(co_scheduler);
 }
+
+static int scheduler_periodic_due(uint64_t now)
+{
+	for (int i = 0; i < task_count; i++)
+	{
+		if (tasks[i].period_us && now - tasks[i].last_us >= tasks[i].period_us) return 1;
+	}
+
+	return 0;
+}
+
+void scheduler_checkpoint(void)
+{
+	if (!task_current || task_current->prio == SCHED_PRIO_REALTIME) return;
+
+	uint64_t now = trace_now_us();
+	if (now - slice_start >= task_current->budget_us || (periodic_count && scheduler_periodic_due(now)))
+	{
+		scheduler_yield();
+	}
+}
+
+const char *scheduler_task_stats(int idx, uint32_t *slices, uint64_t *busy_us)
+{
+	if (idx < 0 || idx >= task_count) return nullptr;
+
+	*slices = tasks[idx].slices;
+	*busy_us = tasks[idx].busy_us;
+	return tasks[idx].name;
+}
+
+// Deepest use so far: the lowest page touched, then the lowest word written in it.
+// Stack memory starts zeroed, so this can only miss frames that wrote zeros.
+uint32_t scheduler_task_stack(int idx, uint32_t *size)
+{
+	if (idx < 0 || idx >= task_count) return 0;
+
+	sched_task_t *t = &tasks[idx];
+	*size = t->stack_size;
+	if (!t->stack) return 0;
+
+	uint32_t pages = t->stack_size / page_size;
+	unsigned char vec[1024];
+	if (pages > sizeof(vec) || mincore(t->stack, t->stack_size, vec)) return 0;
+
+	for (uint32_t i = 0; i < pages; i++)
+	{
+		if (!(vec[i] & 1)) continue;
+
+		uint32_t *p = (uint32_t *)(t->stack + i * page_size);
+		uint32_t *end = (uint32_t *)(t->stack + (i + 1) * page_size);
+		if (!i) p += SCHED_STACK_CTX / sizeof(uint32_t);
+		while (p < end && !*p) p++;
+		if (p < end) return t->stack + t->stack_size - (uint8_t *)p;
+	}
+
+	return 0;
+}
+
+const char *scheduler_current_task(uint64_t *slice_start_us)
+{
+	sched_task_t *task = __atomic_load_n(&task_current, __ATOMIC_ACQUIRE);
+	if (!task) return nullptr;
+
+	*slice_start_us = slice_start;
+	return task->name;
+}
+
+void scheduler_activity(void)
+{
+	active_timer = GetTimer(SCHED_IDLE_AFTER);
+}
+
+int scheduler_idle_timeout(void)
+{
+	if (active_timer && !CheckTimer(active_timer)) return 0;
+
+	// Menu core with terminal/wallpaper only: nothing to poll but input
+	if (is_menu() && video_fb_state()) return 25;
+
+	// OSD timers (scrolling, timeouts) are much coarser than this
+	if (user_io_osd_is_visible() || menu_present()) return 10;
+
+	// Core running: FPGA requests are polled, keep the wake-up latency small
+	return 1;
+}
@@ -1,10 +1,49 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <inttypes.h>
+
 #define USE_SCHEDULER
 
+// Priority tiers
+enum
+{
+	SCHED_PRIO_REALTIME,   // FPGA/input servicing, runs between all other slices
+	SCHED_PRIO_UI,
+	SCHED_PRIO_BACKGROUND
+};
+
 void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Tasks yield at their budget through scheduler_checkpoint(),
+// slices taking twice as long are reported as spikes (PROFILING builds).
+// A realtime task with a period also makes lower tier tasks yield at their next
+// checkpoint once it hasn't run for period_us, whatever is left of their budget.
+// stack_size 0 is 256KB, stacks have a guard page and an overflow is reported.
+int scheduler_add_task(const char *name, void (*entry)(void), int prio, uint32_t budget_us, uint32_t period_us = 0, uint32_t stack_size = 0);
+
+// Yield only if the running task has used up its budget or a periodic task is due.
+// Cheap enough to call from inner loops of long operations.
+void scheduler_checkpoint(void);
+
+// Slices run and time spent by task idx, NULL past the last task.
+const char *scheduler_task_stats(int idx, uint32_t *slices, uint64_t *busy_us);
+
+// Stack bytes task idx has used at most so far, size: its stack size.
+uint32_t scheduler_task_stack(int idx, uint32_t *size);
+
+// Task running now and when its slice started, NULL between slices.
+// Can be called from other threads.
+const char *scheduler_current_task(uint64_t *slice_start_us);
+
+// Idle handling.
+// Code that services the FPGA or the user calls scheduler_activity().
+// After SCHED_IDLE_AFTER ms without activity the poll loop sleeps in
+// the input poll() for scheduler_idle_timeout() ms, so it wakes on any
+// input at once but leaves the CPU alone while nothing is going on.
+void scheduler_activity(void);
+int scheduler_idle_timeout(void);
+
 #endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sd_cache.h"
+#include "file_aio.h"
+#include "profiling.h"
+#include "memtrack.h"
+#include "storage_probe.h"
+
+#define SD_CACHE_MIN  (16 * 1024) // as much as the old single buffer held
+#define SD_CACHE_MAX  (256 * 1024)
+#define SD_CACHE_SLOW 2000        // us of a random read that make storage slow
+
+struct sd_window_t
+{
+	uint8_t *buf;
+	uint64_t pos;
+	uint32_t want;
+	uint32_t len; // set when the read ahead is waited for
+	file_aio_t io;
+};
+
+struct sd_disk_t
+{
+	sd_window_t win[2];
+	int cur;
+	int fd;
+	uint64_t next;   // where a sequential read goes on
+	uint32_t window; // size of the next read ahead
+	uint32_t min_window;
+	uint32_t hits, ahead, misses;
+};
+
+static sd_disk_t disks[SD_CACHE_DISKS];
+
+static void win_wait(sd_window_t *w)
+{
+	if (w->io.state == FILE_AIO_IDLE) return;
+	int ret = file_aio_wait(&w->io);
+	w->len = (ret > 0) ? ret : 0;
+}
+
+// read ahead still running, a finished one is collected
+static int win_busy(sd_window_t *w)
+{
+	if (w->io.state == FILE_AIO_IDLE) return 0;
+	if (!file_aio_done(&w->io)) return 1;
+	win_wait(w);
+	return 0;
+}
+
+static int win_overlaps(const sd_window_t *w, uint64_t pos, uint32_t len)
+{
+	return pos < w->pos + w->want && w->pos < pos + len;
+}
+
+void sd_cache_reset(int disk)
+{
+	if (disk < 0 || disk >= SD_CACHE_DISKS) return;
+	sd_disk_t *d = &disks[disk];
+	if (!d->win[0].buf) return;
+
+	for (int i = 0; i < 2; i++)
+	{
+		win_wait(&d->win[i]);
+		free(d->win[i].buf);
+	}
+	mem_account(MEM_CACHE, -2 * SD_CACHE_MAX);
+
+	if (d->hits || d->ahead || d->misses) printf("sd_cache: disk %d: %u hits, %u read ahead, %u misses\n", disk, d->hits, d->ahead, d->misses);
+	*d = {};
+}
+
+static int disk_init(sd_disk_t *d, int fd)
+{
+	d->win[0].buf = (uint8_t *)malloc(SD_CACHE_MAX);
+	d->win[1].buf = (uint8_t *)malloc(SD_CACHE_MAX);
+	if (!d->win[0].buf || !d->win[1].buf)
+	{
+		free(d->win[0].buf);
+		free(d->win[1].buf);
+		*d = {};
+		return 0;
+	}
+
+	mem_account(MEM_CACHE, 2 * SD_CACHE_MAX);
+	d->fd = fd;
+	d->next = UINT64_MAX;
+
+	// a small window costs a whole round trip on slow storage (USB HDDs, shares)
+	storage_profile_t sp;
+	d->min_window = SD_CACHE_MIN;
+	if (storage_profile_fd(fd, &sp) && sp.rand_us > SD_CACHE_SLOW)
+	{
+		d->min_window = (sp.chunk > SD_CACHE_MAX) ? SD_CACHE_MAX : (sp.chunk < SD_CACHE_MIN) ? SD_CACHE_MIN : sp.chunk;
+	}
+	d->window = d->min_window;
+	return 1;
+}
+
+// The window after the current one is read in the background
+static void read_ahead(sd_disk_t *d)
+{
+	sd_window_t *w = &d->win[d->cur];
+	sd_window_t *n = &d->win[d->cur ^ 1];
+	uint64_t end = w->pos + w->len;
+
+	if (n->pos == end && (win_busy(n) || n->len)) return;
+	win_wait(n);
+
+	if (d->window < SD_CACHE_MAX) d->window *= 2;
+	n->pos = end;
+	n->want = d->window;
+	n->len = 0;
+
+	// queue full, try again on the next read
+	if (!file_aio_read(&n->io, d->fd, n->buf, n->want, n->pos)) n->want = 0;
+}
+
+int sd_cache_read(int disk, fileTYPE *f, uint64_t pos, uint32_t len, uint8_t *dst)
+{
+	if (disk < 0 || disk >= SD_CACHE_DISKS || !f->filp || !len || len > SD_CACHE_MAX) return 0;
+
+	sd_disk_t *d = &disks[disk];
+	int fd = fileno(f->filp);
+	if (d->win[0].buf && d->fd != fd) sd_cache_reset(disk);
+	if (!d->win[0].buf && !disk_init(d, fd)) return 0;
+
+	int seq = (pos == d->next);
+	d->next = pos + len;
+	if (!seq) d->window = d->min_window;
+
+	int hit = -1;
+	for (int i = 0; i < 2 && hit < 0; i++)
+	{
+		int k = d->cur ^ i;
+		sd_window_t *w = &d->win[k];
+		if (win_busy(w))
+		{
+			if (pos < w->pos || pos + len > w->pos + w->want) continue;
+
+			// being read already, quicker than starting over
+			TRACE_SCOPE("sd_wait_ahead");
+			win_wait(w);
+		}
+
+		if (pos >= w->pos && pos + len <= w->pos + w->len) hit = k;
+	}
+
+	if (hit >= 0)
+	{
+		if (hit == d->cur) d->hits++;
+		else d->ahead++;
+
+		d->cur = hit;
+		sd_window_t *w = &d->win[hit];
+		memcpy(dst, w->buf + (pos - w->pos), len);
+	}
+	else
+	{
+		d->misses++;
+
+		sd_window_t *w = &d->win[d->cur];
+		win_wait(w);
+
+		w->pos = pos;
+		w->want = (d->window > len) ? d->window : len;
+		ssize_t ret = pread(fd, w->buf, w->want, pos);
+		w->len = (ret > 0) ? ret : 0;
+		if (!w->len) return 0;
+
+		uint32_t n = (w->len < len) ? w->len : len;
+		memcpy(dst, w->buf, n);
+		if (n < len) memset(dst + n, 0, len - n);
+	}
+
+	// sequential stream past half of the window: read the next one ahead
+	sd_window_t *w = &d->win[d->cur];
+	if (seq && w->len == w->want && pos + len >= w->pos + w->len / 2) read_ahead(d);
+
+	return 1;
+}
+
+void sd_cache_write(int disk, uint64_t pos, const uint8_t *data, uint32_t len)
+{
+	if (disk < 0 || disk >= SD_CACHE_DISKS) return;
+	sd_disk_t *d = &disks[disk];
+	if (!d->win[0].buf) return;
+
+	for (int i = 0; i < 2; i++)
+	{
+		sd_window_t *w = &d->win[i];
+		if (!win_overlaps(w, pos, len)) continue;
+		win_wait(w);
+
+		uint64_t start = (pos > w->pos) ? pos : w->pos;
+		uint64_t end = pos + len;
+		if (end > w->pos + w->len) end = w->pos + w->len;
+		if (start < end) memcpy(w->buf + (start - w->pos), data + (start - pos), end - start);
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef SD_CACHE_H
+#define SD_CACHE_H
+
+#include <stdint.h>
+
+#include "file_io.h"
+
+// Read cache of the SD card images served to the cores.
+// Each disk has two windows: the one reads are served from and the next one,
+// which is read in the background (file_aio.h) while the core goes through the
+// current. Windows start at 16KB and double up to 256KB as long as the core
+// reads sequentially, a read elsewhere falls back to a small window. Slow
+// storage (see storage_probe.h) starts with its best request size instead.
+// Only uncompressed image files are cached.
+
+#define SD_CACHE_DISKS 16
+
+// Copies len bytes at pos of f into dst. Returns 0 if the file isn't cached
+// or nothing could be read, the caller reads it itself then.
+int sd_cache_read(int disk, fileTYPE *f, uint64_t pos, uint32_t len, uint8_t *dst);
+
+// Data written to the image at pos, cached windows covering it are updated.
+void sd_cache_write(int disk, uint64_t pos, const uint8_t *data, uint32_t len);
+
+// Drops the cache of the disk, needed before its image is closed or changed.
+void sd_cache_reset(int disk);
+
+#endif
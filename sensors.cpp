@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "sensors.h"
+#include "battery.h"
+#include "brightness.h"
+#include "cfg.h"
+
+#define SENSORS_PERIOD 2000 // ms, if not set
+
+static pthread_once_t sensors_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sensors_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sensors_cond;
+
+// published by the thread
+static battery_data_t bat_data;
+static int bat_valid = 0;
+static std::atomic<int> bright(0);
+
+// brightness changes for the thread: value to set (-1 if none), then steps up or down
+static int bright_set = -1;
+static int bright_steps = 0;
+
+static void sensors_deadline(struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void *sensors_thread(void *)
+{
+	int period = cfg.sensor_period ? cfg.sensor_period : SENSORS_PERIOD;
+	struct timespec next;
+	sensors_deadline(&next, 0);
+
+	pthread_mutex_lock(&sensors_lock);
+	while (1)
+	{
+		if (bright_set >= 0 || bright_steps)
+		{
+			int set = bright_set, steps = bright_steps;
+			bright_set = -1;
+			bright_steps = 0;
+			pthread_mutex_unlock(&sensors_lock);
+
+			if (set >= 0) setBrightness(BRIGHTNESS_SET, set);
+			for (; steps > 0; steps--) setBrightness(BRIGHTNESS_UP, 0);
+			for (; steps < 0; steps++) setBrightness(BRIGHTNESS_DOWN, 0);
+			bright = getBrightness();
+
+			pthread_mutex_lock(&sensors_lock);
+			continue;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec))
+		{
+			pthread_mutex_unlock(&sensors_lock);
+
+			battery_data_t data;
+			memset(&data, 0, sizeof(data));
+			int valid = getBattery(0, &data);
+
+			pthread_mutex_lock(&sensors_lock);
+			bat_data = data;
+			bat_valid = valid;
+			sensors_deadline(&next, period);
+			continue;
+		}
+
+		pthread_cond_timedwait(&sensors_cond, &sensors_lock, &next);
+	}
+
+	return NULL;
+}
+
+static void sensors_start()
+{
+	pthread_condattr_t cattr;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sensors_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	bright = getBrightness();
+
+	// idle priority and off core #1, not inheriting the main loop's real-time class
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+	struct sched_param param = {};
+	pthread_attr_setschedparam(&attr, &param);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (CPU_COUNT(&set)) pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, sensors_thread, NULL)) printf("sensors: cannot start the thread\n");
+	else pthread_detach(thread);
+
+	pthread_attr_destroy(&attr);
+}
+
+int sensors_battery(struct battery_data_t *data)
+{
+	pthread_once(&sensors_once, sensors_start);
+
+	pthread_mutex_lock(&sensors_lock);
+	int valid = bat_valid;
+	if (valid) *data = bat_data;
+	pthread_mutex_unlock(&sensors_lock);
+	return valid;
+}
+
+void sensors_set_brightness(int cmd, int val)
+{
+	pthread_once(&sensors_once, sensors_start);
+
+	pthread_mutex_lock(&sensors_lock);
+	if (cmd == BRIGHTNESS_UP) bright_steps++;
+	else if (cmd == BRIGHTNESS_DOWN) bright_steps--;
+	else
+	{
+		bright_set = val;
+		bright_steps = 0;
+	}
+	pthread_cond_signal(&sensors_cond);
+	pthread_mutex_unlock(&sensors_lock);
+}
+
+int sensors_brightness()
+{
+	pthread_once(&sensors_once, sensors_start);
+	return bright;
+}
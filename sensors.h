@@ -0,0 +1,20 @@
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include "battery.h"
+
+// Battery and pi-top hub brightness, served by a low priority thread that
+// samples the battery every sensor_period ms (MiSTer.ini) and applies the
+// brightness changes. Readers get the latest values and never wait on the
+// I2C or SPI peripherals. The thread starts on first use.
+
+// Latest battery sample, 0 if there's no battery or nothing was sampled yet.
+int sensors_battery(struct battery_data_t *data);
+
+// Queues a brightness change (BRIGHTNESS_* in brightness.h).
+void sensors_set_brightness(int cmd, int val);
+
+// Brightness as last set, 0 if the screen is off.
+int sensors_brightness();
+
+#endif
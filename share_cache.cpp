@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "share_cache.h"
+#include "file_io.h"
+#include "hardware.h"
+
+#define SHARE_CACHE_DIRS  32
+#define SHARE_CACHE_ITEMS 65536
+#define SHARE_CACHE_TTL   2000 // ms, network shares only
+
+#define SHARE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | \
+	IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_ONLYDIR)
+
+struct share_dir_t
+{
+	std::string path; // full path
+	std::vector<share_item_t> items;
+	std::unordered_map<std::string, uint32_t> names;  // name -> index
+	std::unordered_map<std::string, uint32_t> folded; // lower case name -> index
+	int wd;
+	unsigned long expire; // instead of wd on network shares
+	uint64_t used;
+	bool valid;
+};
+
+// Held by pointer, a listing handed out must not move while another one is read
+static std::vector<share_dir_t*> dirs;
+static share_dir_t uncached;
+static int notify_fd = -1;
+static uint64_t tick;
+
+void share_name83(const char *src, char *dst)
+{
+	int namelen = 0;
+	int extlen = 0;
+
+	const char *p = strrchr(src, '/');
+	if (p) src = p + 1;
+
+	if (!strcmp(src, ".") || !strcmp(src, ".."))
+	{
+		namelen = strlen(src);
+		p = NULL;
+	}
+	else
+	{
+		p = strrchr(src, '.');
+		if (!p) namelen = strlen(src);
+		else
+		{
+			namelen = p - src;
+			extlen = strlen(src) - namelen - 1;
+		}
+	}
+
+	if (namelen > 8) namelen = 8;
+	if (extlen > 3) extlen = 3;
+
+	char ext[4] = { ' ', ' ', ' ', 0 };
+	if (p) memcpy(ext, p + 1, extlen);
+	for (int i = 0; i < namelen; i++) dst[i] = toupper(src[i]);
+	while (namelen < 8) dst[namelen++] = ' ';
+	for (int i = 0; i < 3; i++) dst[8 + i] = toupper(ext[i]);
+}
+
+static std::string fold(const char *name)
+{
+	std::string s(name);
+	for (auto &c : s) c = tolower(c);
+	return s;
+}
+
+static bool item_fill(const share_dir_t *d, share_item_t &it)
+{
+	std::string path = d->path + "/" + it.name;
+	if (stat64(path.c_str(), &it.st)) return false;
+
+	const char *ext = strrchr(it.name.c_str(), '.');
+	size_t namelen = ext ? (size_t)(ext - it.name.c_str()) : it.name.length();
+	size_t extlen = ext ? strlen(ext + 1) : 0;
+
+	it.fits83 = namelen <= 8 && extlen <= 3;
+	share_name83(it.name.c_str(), it.name83);
+	return true;
+}
+
+static void item_remove(share_dir_t *d, uint32_t idx)
+{
+	share_item_t &it = d->items[idx];
+	d->names.erase(it.name);
+
+	auto f = d->folded.find(fold(it.name.c_str()));
+	if (f != d->folded.end() && f->second == idx) d->folded.erase(f);
+
+	// Order doesn't matter to the guests, move the last one into the gap
+	uint32_t last = d->items.size() - 1;
+	if (idx != last)
+	{
+		it = std::move(d->items[last]);
+		d->names[it.name] = idx;
+		f = d->folded.find(fold(it.name.c_str()));
+		if (f != d->folded.end() && f->second == last) f->second = idx;
+	}
+	d->items.pop_back();
+}
+
+static void item_insert(share_dir_t *d, share_item_t &it)
+{
+	uint32_t idx = d->items.size();
+	d->names[it.name] = idx;
+	d->folded.emplace(fold(it.name.c_str()), idx);
+	d->items.push_back(std::move(it));
+}
+
+// Entry name of the directory was created, changed or removed
+static void item_update(share_dir_t *d, const char *name, unsigned char type)
+{
+	share_item_t it = {};
+	it.name = name;
+	it.type = type;
+	bool exists = item_fill(d, it);
+
+	auto n = d->names.find(it.name);
+	if (n != d->names.end())
+	{
+		if (!exists) item_remove(d, n->second);
+		else
+		{
+			share_item_t &cur = d->items[n->second];
+			if (type == DT_UNKNOWN) it.type = S_ISDIR(it.st.st_mode) ? DT_DIR : S_ISREG(it.st.st_mode) ? DT_REG : cur.type;
+			cur = std::move(it);
+		}
+	}
+	else if (exists)
+	{
+		if (type == DT_UNKNOWN) it.type = S_ISDIR(it.st.st_mode) ? DT_DIR : S_ISREG(it.st.st_mode) ? DT_REG : DT_UNKNOWN;
+		item_insert(d, it);
+	}
+}
+
+static void dir_unwatch(int wd)
+{
+	if (wd < 0) return;
+	for (auto d : dirs) if (d->wd == wd) return;
+	inotify_rm_watch(notify_fd, wd);
+}
+
+static void dir_remove(size_t n)
+{
+	share_dir_t *d = dirs[n];
+	dirs.erase(dirs.begin() + n);
+	dir_unwatch(d->wd);
+	delete d;
+}
+
+static void drain()
+{
+	if (notify_fd < 0) return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1)
+	{
+		int len = read(notify_fd, buf, sizeof(buf));
+		if (len <= 0) break;
+
+		for (int i = 0; i < len;)
+		{
+			struct inotify_event *ev = (struct inotify_event *)(buf + i);
+			i += sizeof(struct inotify_event) + ev->len;
+
+			for (auto d : dirs)
+			{
+				if (ev->mask & IN_Q_OVERFLOW) d->valid = false;
+				if (d->wd < 0 || d->wd != ev->wd || !d->valid) continue;
+
+				if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED)) d->valid = false;
+				else if (ev->len && ev->name[0]) item_update(d, ev->name, (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN);
+			}
+		}
+	}
+}
+
+static share_dir_t *dir_find(const char *full_path)
+{
+	drain();
+
+	for (size_t i = 0; i < dirs.size(); i++)
+	{
+		share_dir_t *d = dirs[i];
+		if (d->path != full_path) continue;
+
+		if (d->valid && d->wd < 0 && CheckTimer(d->expire)) d->valid = false;
+		if (!d->valid)
+		{
+			dir_remove(i);
+			return NULL;
+		}
+
+		d->used = ++tick;
+		return d;
+	}
+
+	return NULL;
+}
+
+static share_dir_t *dir_read(const char *full_path)
+{
+	share_dir_t *d = dir_find(full_path);
+	if (d) return d;
+
+	d = new share_dir_t();
+	d->path = full_path;
+	d->wd = -1;
+	d->valid = true;
+
+	// Watch before reading so changes during the scan aren't lost
+	if (!is_network_fs(full_path))
+	{
+		if (notify_fd < 0) notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notify_fd >= 0) d->wd = inotify_add_watch(notify_fd, full_path, SHARE_WATCH_MASK);
+	}
+	d->expire = GetTimer(SHARE_CACHE_TTL);
+
+	DIR *dir = opendir(full_path);
+	if (!dir)
+	{
+		dir_unwatch(d->wd);
+		delete d;
+		return NULL;
+	}
+
+	struct dirent64 *de;
+	while ((de = readdir64(dir)))
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+		share_item_t it = {};
+		it.name = de->d_name;
+		it.type = de->d_type;
+		if (item_fill(d, it)) item_insert(d, it);
+	}
+	closedir(dir);
+
+	if (d->items.size() > SHARE_CACHE_ITEMS)
+	{
+		dir_unwatch(d->wd);
+		d->wd = -1;
+		uncached = std::move(*d);
+		delete d;
+		return &uncached;
+	}
+
+	while (!dirs.empty())
+	{
+		size_t total = d->items.size();
+		size_t lru = 0;
+		for (size_t i = 0; i < dirs.size(); i++)
+		{
+			total += dirs[i]->items.size();
+			if (dirs[i]->used < dirs[lru]->used) lru = i;
+		}
+
+		if (dirs.size() < SHARE_CACHE_DIRS && total <= SHARE_CACHE_ITEMS) break;
+		dir_remove(lru);
+	}
+
+	d->used = ++tick;
+	dirs.push_back(d);
+	return d;
+}
+
+static share_dir_t *parent_read(const char *path, std::string &name)
+{
+	std::string full = getFullPath(path);
+	while (full.length() > 1 && full.back() == '/') full.pop_back();
+
+	size_t p = full.rfind('/');
+	if (p == std::string::npos || p + 1 >= full.length()) return NULL;
+
+	name = full.substr(p + 1);
+	full.resize(p ? p : 1);
+	return dir_read(full.c_str());
+}
+
+const std::vector<share_item_t> *share_list(const char *path)
+{
+	share_dir_t *d = dir_read(getFullPath(path));
+	return d ? &d->items : NULL;
+}
+
+const share_item_t *share_lookup(const char *path)
+{
+	std::string name;
+	share_dir_t *d = parent_read(path, name);
+	if (!d) return NULL;
+
+	auto n = d->names.find(name);
+	return (n != d->names.end()) ? &d->items[n->second] : NULL;
+}
+
+int share_is_dir(const char *path)
+{
+	const share_item_t *it = share_lookup(path);
+	return it && S_ISDIR(it->st.st_mode);
+}
+
+int share_is_file(const char *path)
+{
+	const share_item_t *it = share_lookup(path);
+	return it && S_ISREG(it->st.st_mode);
+}
+
+void share_fix_case(char *path, int skip)
+{
+	char *cur = path + skip;
+	while (*cur == '/') cur++;
+
+	while (*cur)
+	{
+		char *next = strchr(cur, '/');
+		if (next) *next = 0;
+
+		std::string name;
+		share_dir_t *d = parent_read(path, name);
+		bool found = false;
+		if (d)
+		{
+			found = d->names.count(name) > 0;
+			if (!found)
+			{
+				auto f = d->folded.find(fold(name.c_str()));
+				if (f != d->folded.end() && d->items[f->second].name.length() == name.length())
+				{
+					memcpy(cur, d->items[f->second].name.c_str(), name.length());
+					found = true;
+				}
+			}
+		}
+
+		if (next) *next = '/';
+		if (!found || !next) break;
+		cur = next + 1;
+	}
+}
+
+void share_changed(const char *path)
+{
+	std::string full = getFullPath(path);
+	while (full.length() > 1 && full.back() == '/') full.pop_back();
+
+	drain();
+
+	size_t p = full.rfind('/');
+	if (p == std::string::npos || p + 1 >= full.length()) return;
+
+	std::string name = full.substr(p + 1);
+	std::string parent = full.substr(0, p ? p : 1);
+	for (auto d : dirs)
+	{
+		if (!d->valid) continue;
+		if (d->path == parent) item_update(d, name.c_str(), DT_UNKNOWN);
+		else if (d->path == full && !PathIsDir(full.c_str(), 0)) d->valid = false;
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef SHARE_CACHE_H
+#define SHARE_CACHE_H
+
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+// Host side directory cache for the guest file sharing (x86 and Minimig).
+// Directories are read once with all entries stat'ed and their DOS names
+// prepared, then kept up to date from inotify events per entry. Network
+// shares can't be watched, their listings just expire after a short time.
+// Paths are like the file_io ones: relative to the root or absolute.
+
+struct share_item_t
+{
+	std::string name;
+	unsigned char type;  // d_type from readdir
+	char name83[11];     // DOS name, upper case and space padded
+	bool fits83;         // name is 8.3 already, name83 isn't truncated
+	struct stat64 st;
+};
+
+// Entries of the directory without "." and "..", NULL if it can't be read.
+// Valid until the next share_* call.
+const std::vector<share_item_t> *share_list(const char *path);
+
+// Entry of path out of the listing of its parent directory, NULL if it doesn't exist.
+const share_item_t *share_lookup(const char *path);
+
+int share_is_dir(const char *path);
+int share_is_file(const char *path);
+
+// Corrects the case of the components of path after the first skip chars
+// where only a case insensitive match exists (AmigaOS names ignore case).
+void share_fix_case(char *path, int skip);
+
+// Refreshes the entry after the share itself modified it, so the cache is
+// right even before inotify events arrive or where there are none.
+void share_changed(const char *path);
+
+// Fills dst[11] with the space padded 8.3 form of the last component of src.
+void share_name83(const char *src, char *dst);
+
+#endif
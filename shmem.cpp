@@ -10,6 +10,11 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "shmem.h"
 
@@ -48,13 +53,167 @@ int shmem_unmap(void* map, uint32_t size)
 	return 1;
 }
 
+// Persistent mappings for repeated access to the same regions.
+// Windows are aligned to SHMEM_WINDOW and stay mapped while referenced.
+// Unreferenced windows are kept until SHMEM_CACHE_MAX bytes are mapped.
+
+#define SHMEM_WINDOW    (1024 * 1024)
+#define SHMEM_WINDOWS   16
+#define SHMEM_CACHE_MAX (64 * 1024 * 1024)
+
+struct shmem_window_t
+{
+	uint32_t address;
+	uint32_t size;
+	uint8_t *map;
+	int      refs;
+	uint32_t last_use;
+};
+
+static shmem_window_t windows[SHMEM_WINDOWS] = {};
+static uint32_t windows_size = 0;
+static uint32_t windows_tick = 0;
+static pthread_mutex_t windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void window_drop(shmem_window_t *w)
+{
+	shmem_unmap(w->map, w->size);
+	windows_size -= w->size;
+	w->map = 0;
+}
+
+// Unmap least recently used idle windows while over the limit
+static void windows_trim(uint32_t limit)
+{
+	while (windows_size > limit)
+	{
+		shmem_window_t *lru = 0;
+		for (int i = 0; i < SHMEM_WINDOWS; i++)
+		{
+			shmem_window_t *w = &windows[i];
+			if (w->map && !w->refs && (!lru || w->last_use < lru->last_use)) lru = w;
+		}
+
+		if (!lru) break;
+		window_drop(lru);
+	}
+}
+
+void *shmem_map_cached(uint32_t address, uint32_t size)
+{
+	if (!size) return 0;
+
+	pthread_mutex_lock(&windows_lock);
+
+	shmem_window_t *win = 0;
+	for (int i = 0; i < SHMEM_WINDOWS && !win; i++)
+	{
+		shmem_window_t *w = &windows[i];
+		if (w->map && address >= w->address && (uint64_t)address + size <= (uint64_t)w->address + w->size) win = w;
+	}
+
+	if (!win)
+	{
+		uint32_t start = address & ~(SHMEM_WINDOW - 1);
+		uint64_t end = ((uint64_t)address + size + SHMEM_WINDOW - 1) & ~(uint64_t)(SHMEM_WINDOW - 1);
+		uint32_t len = (uint32_t)(end - start);
+
+		// Free slot or the least recently used idle one
+		for (int i = 0; i < SHMEM_WINDOWS; i++)
+		{
+			shmem_window_t *w = &windows[i];
+			if (!w->map)
+			{
+				win = w;
+				break;
+			}
+			if (!w->refs && (!win || w->last_use < win->last_use)) win = w;
+		}
+
+		if (!win)
+		{
+			pthread_mutex_unlock(&windows_lock);
+			printf("Error: no free shmem window for (0x%X, %d)!\n", address, size);
+			return 0;
+		}
+
+		if (win->map) window_drop(win);
+		windows_trim((len < SHMEM_CACHE_MAX) ? SHMEM_CACHE_MAX - len : 0);
+
+		win->map = (uint8_t*)shmem_map(start, len);
+		if (!win->map)
+		{
+			pthread_mutex_unlock(&windows_lock);
+			return 0;
+		}
+
+		win->address = start;
+		win->size = len;
+		win->refs = 0;
+		windows_size += len;
+	}
+
+	win->refs++;
+	win->last_use = ++windows_tick;
+	void *res = win->map + (address - win->address);
+
+	pthread_mutex_unlock(&windows_lock);
+	return res;
+}
+
+void shmem_unmap_cached(void *ptr)
+{
+	if (!ptr) return;
+
+	pthread_mutex_lock(&windows_lock);
+
+	for (int i = 0; i < SHMEM_WINDOWS; i++)
+	{
+		shmem_window_t *w = &windows[i];
+		if (w->map && w->refs && (uint8_t*)ptr >= w->map && (uint8_t*)ptr < w->map + w->size)
+		{
+			w->refs--;
+			break;
+		}
+	}
+
+	windows_trim(SHMEM_CACHE_MAX);
+	pthread_mutex_unlock(&windows_lock);
+}
+
+// Copy with wide bursts, FPGA memory is mapped uncached
+void shmem_copy(void *dst, const void *src, uint32_t size)
+{
+	uint8_t *d = (uint8_t*)dst;
+	const uint8_t *s = (const uint8_t*)src;
+
+#ifdef __ARM_NEON
+	while (size >= 64)
+	{
+		uint8x16_t a = vld1q_u8(s);
+		uint8x16_t b = vld1q_u8(s + 16);
+		uint8x16_t c = vld1q_u8(s + 32);
+		uint8x16_t e = vld1q_u8(s + 48);
+		vst1q_u8(d, a);
+		vst1q_u8(d + 16, b);
+		vst1q_u8(d + 32, c);
+		vst1q_u8(d + 48, e);
+		s += 64;
+		d += 64;
+		size -= 64;
+	}
+#endif
+
+	if (size) memcpy(d, s, size);
+}
+
 int shmem_put(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_map_cached(address, size);
 	if (shmem)
 	{
-		memcpy(shmem, buf, size);
-		shmem_unmap(shmem, size);
+		shmem_copy(shmem, buf, size);
+		shmem_unmap_cached(shmem);
 	}
 
 	return shmem != 0;
@@ -62,11 +221,11 @@ int shmem_put(uint32_t address, uint32_t size, void *buf)
 
 int shmem_get(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_map_cached(address, size);
 	if (shmem)
 	{
-		memcpy(buf, shmem, size);
-		shmem_unmap(shmem, size);
+		shmem_copy(buf, shmem, size);
+		shmem_unmap_cached(shmem);
 	}
 
 	return shmem != 0;
@@ -9,5 +9,13 @@ int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
 
+// Reference counted mappings kept between calls, for regions accessed often.
+// Address doesn't need to be page aligned.
+void *shmem_map_cached(uint32_t address, uint32_t size);
+void shmem_unmap_cached(void *ptr);
+
+// Bulk copy to/from mapped FPGA memory
+void shmem_copy(void *dst, const void *src, uint32_t size);
+
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
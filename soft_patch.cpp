@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "soft_patch.h"
+#include "file_io.h"
+#include "rom_hash.h"
+#include "crc.h"
+
+#define SOFT_PATCH_MAX     (16 * 1024 * 1024) // patch file
+#define SOFT_PATCH_RESOLVE (32 * 1024 * 1024) // BPS copies resolved at open
+
+enum { SP_PATCH, SP_COPY, SP_FILL };
+
+struct sp_rec_t
+{
+	uint32_t start;
+	uint32_t len;
+	uint32_t ofs;   // into the patch file or the resolved copies
+	uint8_t type;
+	uint8_t fill;
+};
+
+struct soft_patch
+{
+	uint8_t *data;  // the patch file
+	uint32_t data_len;
+	std::vector<uint8_t> copy;
+	std::vector<sp_rec_t> recs;
+	int sorted;     // in offset order without overlaps, otherwise applied in file order
+	uint32_t size;
+	uint32_t crc;
+	int has_crc;
+};
+
+static const uint8_t *rec_data(const soft_patch *p, const sp_rec_t *r)
+{
+	return ((r->type == SP_COPY) ? p->copy.data() : p->data) + r->ofs;
+}
+
+static uint32_t get24(const uint8_t *d)
+{
+	return (d[0] << 16) | (d[1] << 8) | d[2];
+}
+
+static uint32_t get32le(const uint8_t *d)
+{
+	return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+static int ips_parse(soft_patch *p, uint32_t rom_size)
+{
+	const uint8_t *d = p->data + 5, *end = p->data + p->data_len;
+	if (p->data_len < 8 || memcmp(p->data, "PATCH", 5)) return 0;
+
+	uint32_t size = rom_size;
+	while (1)
+	{
+		if (end - d < 3) return 0;
+		uint32_t ofs = get24(d);
+		d += 3;
+		if (ofs == 0x454F46) break; // "EOF"
+
+		if (end - d < 2) return 0;
+		sp_rec_t r = { ofs, (uint32_t)((d[0] << 8) | d[1]), 0, SP_PATCH, 0 };
+		d += 2;
+
+		if (!r.len)
+		{
+			// run of one byte
+			if (end - d < 3) return 0;
+			r.len = (d[0] << 8) | d[1];
+			r.type = SP_FILL;
+			r.fill = d[2];
+			d += 3;
+		}
+		else
+		{
+			if (end - d < r.len) return 0;
+			r.ofs = d - p->data;
+			d += r.len;
+		}
+
+		if (!r.len) continue;
+		p->recs.push_back(r);
+		size = std::max(size, r.start + r.len);
+	}
+
+	// truncation
+	if (end - d >= 3) size = get24(d);
+	p->size = size;
+
+	// later records win where they overlap, so only sort when none do
+	std::vector<sp_rec_t> s = p->recs;
+	std::stable_sort(s.begin(), s.end(), [](const sp_rec_t &a, const sp_rec_t &b) { return a.start < b.start; });
+	for (size_t i = 1; i < s.size(); i++)
+	{
+		if (s[i].start < s[i - 1].start + s[i - 1].len) return 1;
+	}
+
+	p->recs.swap(s);
+	p->sorted = 1;
+	return 1;
+}
+
+static int bps_num(const uint8_t **d, const uint8_t *end, uint64_t *val)
+{
+	uint64_t v = 0, shift = 1;
+	while (*d < end && shift < (1ULL << 56))
+	{
+		uint8_t x = *(*d)++;
+		v += (x & 0x7F) * shift;
+		if (x & 0x80)
+		{
+			*val = v;
+			return 1;
+		}
+		shift <<= 7;
+		v += shift;
+	}
+	return 0;
+}
+
+static int bps_source(fileTYPE *rom, uint32_t pos, uint8_t *dst, uint32_t len)
+{
+	return FileSeek(rom, pos, SEEK_SET) && FileReadAdv(rom, dst, len) == (int)len;
+}
+
+// Output from pos as the records so far make it, the ROM where there are none.
+static int bps_target(const soft_patch *p, fileTYPE *rom, uint32_t pos, uint8_t *dst, uint32_t len)
+{
+	while (len)
+	{
+		auto it = std::partition_point(p->recs.begin(), p->recs.end(), [pos](const sp_rec_t &r) { return r.start + r.len <= pos; });
+		uint32_t n;
+		if (it != p->recs.end() && it->start <= pos)
+		{
+			n = std::min(len, it->start + it->len - pos);
+			memcpy(dst, rec_data(p, &*it) + (pos - it->start), n);
+		}
+		else
+		{
+			n = (it != p->recs.end()) ? std::min(len, it->start - pos) : len;
+			if (!bps_source(rom, pos, dst, n)) return 0;
+		}
+
+		pos += n;
+		dst += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int bps_parse(soft_patch *p, const char *name, uint32_t rom_size)
+{
+	if (p->data_len < 19 || memcmp(p->data, "BPS1", 4)) return 0;
+
+	const uint8_t *d = p->data + 4, *end = p->data + p->data_len - 12;
+	uint32_t src_crc = get32le(end);
+	uint32_t tgt_crc = get32le(end + 4);
+	if (crc32_update(0, p->data, p->data_len - 4) != get32le(end + 8)) return 0;
+
+	uint64_t src_size, tgt_size, meta;
+	if (!bps_num(&d, end, &src_size) || !bps_num(&d, end, &tgt_size) || !bps_num(&d, end, &meta) || meta > (uint64_t)(end - d)) return 0;
+	if (src_size != rom_size || tgt_size > 0xFFFFFFFF) return 0;
+	d += meta;
+
+	// the index has the CRC of the ROM without reading it
+	rom_hash_t hash;
+	if (rom_hash_get(name, &hash) && hash.crc != src_crc) return 0;
+
+	fileTYPE rom = {};
+	if (!FileOpen(&rom, name, 1)) return 0;
+
+	std::vector<uint8_t> tmp;
+	uint64_t out = 0;
+	int64_t src_rel = 0, tgt_rel = 0;
+	int ok = 1;
+	while (ok && d < end)
+	{
+		uint64_t v, o;
+		if (!bps_num(&d, end, &v)) break;
+
+		uint32_t cmd = v & 3;
+		uint64_t len = (v >> 2) + 1;
+		if (out + len > tgt_size) break;
+
+		switch (cmd)
+		{
+		case 0: // source read, the ROM as it is
+			ok = out + len <= rom_size;
+			break;
+
+		case 1: // target read
+			ok = (uint64_t)(end - d) >= len;
+			if (ok)
+			{
+				p->recs.push_back({ (uint32_t)out, (uint32_t)len, (uint32_t)(d - p->data), SP_PATCH, 0 });
+				d += len;
+			}
+			break;
+
+		default: // source or target copy
+			ok = bps_num(&d, end, &o) && p->copy.size() + len <= SOFT_PATCH_RESOLVE;
+			if (!ok) break;
+
+			tmp.resize(len);
+			if (cmd == 2)
+			{
+				src_rel += (o & 1) ? -(int64_t)(o >> 1) : (int64_t)(o >> 1);
+				ok = src_rel >= 0 && src_rel + len <= rom_size && bps_source(&rom, src_rel, tmp.data(), len);
+				src_rel += len;
+			}
+			else
+			{
+				tgt_rel += (o & 1) ? -(int64_t)(o >> 1) : (int64_t)(o >> 1);
+				ok = tgt_rel >= 0 && (uint64_t)tgt_rel < out;
+				if (ok)
+				{
+					// may run into its own output, byte by byte then
+					uint32_t n = std::min<uint64_t>(len, out - tgt_rel);
+					ok = bps_target(p, &rom, tgt_rel, tmp.data(), n);
+					for (uint64_t i = n; i < len; i++) tmp[i] = tmp[tgt_rel + i - out];
+				}
+				tgt_rel += len;
+			}
+
+			if (ok)
+			{
+				p->recs.push_back({ (uint32_t)out, (uint32_t)len, (uint32_t)p->copy.size(), SP_COPY, 0 });
+				p->copy.insert(p->copy.end(), tmp.begin(), tmp.end());
+			}
+			break;
+		}
+
+		out += len;
+	}
+
+	FileClose(&rom);
+	if (!ok || d != end || out != tgt_size) return 0;
+
+	p->size = tgt_size;
+	p->crc = tgt_crc;
+	p->has_crc = 1;
+	p->sorted = 1;
+	return 1;
+}
+
+static const char *patch_exts[] = { ".ips", ".bps" };
+
+// name with the extension of patch type i
+static void patch_path(const char *name, int i, char *path, int size)
+{
+	snprintf(path, size - 4, "%s", name);
+
+	char *ext = strrchr(path, '.');
+	if (!ext || strchr(ext, '/')) ext = path + strlen(path);
+	strcpy(ext, patch_exts[i]);
+}
+
+int soft_patch_exists(const char *name)
+{
+	char path[1024];
+	for (int i = 0; i < 2; i++)
+	{
+		patch_path(name, i, path, sizeof(path));
+		if (FileExists(path)) return 1;
+	}
+	return 0;
+}
+
+soft_patch *soft_patch_open(const char *name, uint32_t rom_size)
+{
+	char path[1024];
+	for (int i = 0; i < 2; i++)
+	{
+		patch_path(name, i, path, sizeof(path));
+		if (!FileExists(path)) continue;
+
+		fileTYPE f = {};
+		if (!FileOpen(&f, path, 1)) continue;
+
+		soft_patch *p = new soft_patch();
+		p->data_len = f.size;
+		p->data = (f.size <= SOFT_PATCH_MAX) ? (uint8_t*)malloc(f.size + 1) : NULL;
+		int ok = p->data && FileReadAdv(&f, p->data, f.size) == (int)f.size;
+		FileClose(&f);
+
+		if (ok) ok = i ? bps_parse(p, name, rom_size) : ips_parse(p, rom_size);
+		if (ok)
+		{
+			printf("soft_patch: %s, %u records, %u bytes out\n", path, (uint32_t)p->recs.size(), p->size);
+			return p;
+		}
+
+		printf("soft_patch: %s doesn't fit the ROM, not applied\n", path);
+		soft_patch_close(p);
+	}
+
+	return NULL;
+}
+
+uint32_t soft_patch_size(const soft_patch *p)
+{
+	return p->size;
+}
+
+void soft_patch_apply(const soft_patch *p, uint8_t *buf, uint32_t pos, uint32_t len)
+{
+	uint32_t end = pos + len;
+	auto it = p->sorted ? std::partition_point(p->recs.begin(), p->recs.end(), [pos](const sp_rec_t &r) { return r.start + r.len <= pos; }) : p->recs.begin();
+
+	for (; it != p->recs.end(); ++it)
+	{
+		if (it->start >= end)
+		{
+			if (p->sorted) break;
+			continue;
+		}
+		if (it->start + it->len <= pos) continue;
+
+		uint32_t from = std::max(it->start, pos);
+		uint32_t to = std::min(it->start + it->len, end);
+		if (it->type == SP_FILL) memset(buf + (from - pos), it->fill, to - from);
+		else memcpy(buf + (from - pos), rec_data(p, &*it) + (from - it->start), to - from);
+	}
+}
+
+int soft_patch_crc(const soft_patch *p, uint32_t *crc)
+{
+	if (p->has_crc) *crc = p->crc;
+	return p->has_crc;
+}
+
+void soft_patch_close(soft_patch *p)
+{
+	if (!p) return;
+	free(p->data);
+	delete p;
+}
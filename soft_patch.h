@@ -0,0 +1,33 @@
+#ifndef SOFT_PATCH_H
+#define SOFT_PATCH_H
+
+#include <stdint.h>
+
+// IPS/BPS patches applied to a ROM while it's sent, so translations and hacks
+// need no patched copy on storage. The patch sits beside the ROM (or in the
+// same zip) with the same name and .ips or .bps extension. Its records are
+// sorted by offset when it's opened and laid over every chunk that passes,
+// output offsets being offsets into the file as stored. Data from other
+// places of the ROM (BPS source and target copies) is resolved at open.
+
+struct soft_patch;
+
+// There's a patch for the ROM, without reading it.
+int soft_patch_exists(const char *name);
+
+// NULL if there's no patch for the ROM or it can't be used.
+soft_patch *soft_patch_open(const char *name, uint32_t rom_size);
+
+// Size of the patched ROM.
+uint32_t soft_patch_size(const soft_patch *p);
+
+// buf holds len bytes of output from pos: bytes of the ROM, zero past its
+// end. Patches it in place.
+void soft_patch_apply(const soft_patch *p, uint8_t *buf, uint32_t pos, uint32_t len);
+
+// CRC32 of the whole patched ROM if the patch carries one (BPS).
+int soft_patch_crc(const soft_patch *p, uint32_t *crc);
+
+void soft_patch_close(soft_patch *p);
+
+#endif
@@ -1,6 +1,11 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
+#include "user_io.h"
 
 #define SSPI_FPGA_EN (1<<18)
 #define SSPI_OSD_EN  (1<<19)
@@ -203,3 +208,92 @@ void spi_block_write(const uint8_t *addr, int wide, int sz)
 	if (wide) fpga_spi_fast_block_write((const uint16_t*)addr, sz/2);
 	else fpga_spi_fast_block_write_8(addr, sz);
 }
+
+/* Bus use */
+spi_stat_t spi_stats[SPI_TAGS] = {};
+
+static const char *spi_tag_names[SPI_TAGS] = { "osd", "joy", "kbd", "ide", "cd", "sd", "file", "status", "video", "other" };
+
+const char *spi_tag_name(int tag)
+{
+	return (tag >= 0 && tag < SPI_TAGS) ? spi_tag_names[tag] : "";
+}
+
+int spi_classify(uint32_t mask, int word)
+{
+	if (mask & SSPI_OSD_EN) return SPI_OSD;
+	if (word < 0) return SPI_OTHER;
+	if (mask & SSPI_FPGA_EN) return SPI_FILE;
+
+	switch (word & 0xFF)
+	{
+	case UIO_JOYSTICK0: case UIO_JOYSTICK1: case UIO_JOYSTICK2: case UIO_JOYSTICK3:
+	case UIO_JOYSTICK4: case UIO_JOYSTICK5: case UIO_ASTICK: case UIO_ASTICK_2:
+	case UIO_JOY_FRAME: case UIO_GET_RUMBLE: case UIO_MM2_JOY:
+		return SPI_JOY;
+
+	case UIO_MOUSE: case UIO_KEYBOARD: case UIO_KBD_OSD: case UIO_GET_KBD_LED:
+	case UIO_PS2_CTL: case UIO_BUT_SW:
+		return SPI_KBD;
+
+	case UIO_DMA_WRITE: case UIO_DMA_READ: case UIO_DMA_SDIO: case UIO_MM2_HDD:
+		return SPI_IDE;
+
+	case UIO_CD_GET: case UIO_CD_SET:
+		return SPI_CD;
+
+	case UIO_GET_SDSTAT: case UIO_SECTOR_RD: case UIO_SECTOR_WR: case UIO_SET_SDCONF:
+	case UIO_SET_SDSTAT: case UIO_SET_SDINFO: case UIO_MM2_FLP:
+		return SPI_SD;
+
+	case UIO_STATUS: case UIO_SET_STATUS: case UIO_SET_STATUS2: case UIO_GET_STATUS:
+	case UIO_GET_STRING: case UIO_INFO_GET: case UIO_CHK_UPLOAD:
+		return SPI_STATUS;
+
+	case UIO_SET_VIDEO: case UIO_GET_VRES: case UIO_SETHEIGHT: case UIO_SETWIDTH:
+	case UIO_SET_FLTCOEF: case UIO_SET_FLTNUM: case UIO_GET_VMODE: case UIO_SET_VPOS:
+	case UIO_GET_OSDMASK: case UIO_SET_FBUF: case UIO_WAIT_VSYNC: case UIO_SET_GAMMA:
+	case UIO_SET_GAMCURV: case UIO_SETSYNC: case UIO_SET_AR_CUST: case UIO_SHADOWMASK:
+	case UIO_GET_FB_PAR: case UIO_SET_YC_PAR: case UIO_GET_FR_CNT: case UIO_MM2_VID:
+		return SPI_VIDEO;
+	}
+
+	return SPI_OTHER;
+}
+
+int spi_report(char *buf, int size, const char *path, int reset)
+{
+	static spi_stat_t prev[SPI_TAGS] = {};
+	static uint64_t prev_ns = 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	uint64_t period = prev_ns ? now - prev_ns : 0;
+
+	int len = snprintf(buf, size, "%-7s %7s %8s %6s", "", "xfer/s", "KW/s", "busy%");
+	for (int i = 0; i < SPI_TAGS && len < size && !reset; i++)
+	{
+		uint64_t xfers = spi_stats[i].xfers - prev[i].xfers;
+		uint64_t words = spi_stats[i].words - prev[i].words;
+		uint64_t busy = spi_stats[i].busy_ns - prev[i].busy_ns;
+		if (!period) break;
+
+		len += snprintf(buf + len, size - len, "\n%-7s %7llu %8llu %6.2f", spi_tag_names[i],
+			(unsigned long long)(xfers * 1000000000ULL / period),
+			(unsigned long long)(words * 1000000ULL / period),
+			busy * 100.0 / period);
+	}
+	if ((!period || reset) && len < size) len += snprintf(buf + len, size - len, "\n\nMeasuring, repeat for the rates.");
+
+	memcpy(prev, spi_stats, sizeof(prev));
+	prev_ns = now;
+
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (f)
+	{
+		fprintf(f, "%s\n", buf);
+		fclose(f);
+	}
+	return len;
+}
@@ -60,4 +60,38 @@ uint16_t spi_uio_cmd16(uint8_t cmd, uint16_t parm);
 void spi_uio_cmd32(uint8_t cmd, uint32_t parm, int wide);
 void spi_uio_cmd32_cont(uint8_t cmd, uint32_t parm);
 
+/* Bus use per subsystem, counted in fpga_io.cpp. A transaction (chip
+   select to deselect) is charged to the subsystem of its first word. */
+enum SpiTag
+{
+	SPI_OSD = 0,
+	SPI_JOY,
+	SPI_KBD,     // keyboard and mouse
+	SPI_IDE,
+	SPI_CD,
+	SPI_SD,      // SD card sector emulation
+	SPI_FILE,    // file download and upload
+	SPI_STATUS,
+	SPI_VIDEO,
+	SPI_OTHER,
+	SPI_TAGS
+};
+
+struct spi_stat_t
+{
+	uint32_t xfers;
+	uint64_t words;
+	uint64_t busy_ns;  // chip select active
+};
+
+extern spi_stat_t spi_stats[SPI_TAGS];
+
+// Tag of a transaction by its chip select mask and first word (-1 if none).
+int spi_classify(uint32_t mask, int word);
+const char *spi_tag_name(int tag);
+
+// Rates per tag since the previous report (reset: only start a new period),
+// also written to path if not NULL.
+int spi_report(char *buf, int size, const char *path, int reset);
+
 #endif // SPI_H
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stddef.h>
+
+#include "status_page.h"
+#include "scheduler.h"
+#include "hardware.h"
+#include "user_io.h"
+#include "input.h"
+#include "menu.h"
+#include "video.h"
+#include "file_io.h"
+#include "rom_catalog.h"
+#include "memtrack.h"
+#include "load_times.h"
+#include "spi.h"
+#include "sensors.h"
+
+#define STATUS_PERIOD 100 // ms
+
+static status_page_t *page = nullptr;
+
+static void status_open()
+{
+	int fd = open(STATUS_PAGE_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		printf("status_page: cannot create %s\n", STATUS_PAGE_PATH);
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(status_page_t)) < 0)
+	{
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, sizeof(status_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	page = (status_page_t*)map;
+	page->magic = STATUS_PAGE_MAGIC;
+	page->version = STATUS_PAGE_VERSION;
+	page->size = sizeof(status_page_t);
+}
+
+static void status_fill(status_page_t *st)
+{
+	memset(st, 0, sizeof(status_page_t));
+
+	strncpy(st->core, user_io_get_core_name(), sizeof(st->core) - 1);
+	st->menu = is_menu();
+	st->osd = (user_io_osd_is_visible() || menu_present()) ? 1 : 0;
+	strncpy(st->game, user_io_get_filename(), sizeof(st->game) - 1);
+	st->game_crc = user_io_get_file_crc();
+	for (int i = 0; i < STATUS_IMAGES; i++)
+	{
+		const char *name = get_image_name(i);
+		if (name) strncpy(st->image[i], name, sizeof(st->image[i]) - 1);
+	}
+
+	const VideoInfo *vi = video_get_info();
+	st->width = vi->width;
+	st->height = vi->height;
+	st->vtime = vi->vtime;
+	st->htime = vi->htime;
+	st->interlaced = vi->interlaced;
+	st->rotated = video_get_rotated() ? 1 : 0;
+	st->fb = video_fb_state() ? 1 : 0;
+
+	for (int i = 0; i < STATUS_PLAYERS; i++)
+	{
+		uint16_t vid, pid;
+		if (input_player_dev(i + 1, &vid, &pid))
+		{
+			st->player_vid[i] = vid;
+			st->player_pid[i] = pid;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) st->ss_count[i] = user_io_ss_count(i);
+
+	for (int i = 0; i < STATUS_TASKS; i++)
+	{
+		uint32_t slices;
+		uint64_t busy_us;
+		const char *name = scheduler_task_stats(i, &slices, &busy_us);
+		if (!name) break;
+
+		strncpy(st->task_name[i], name, sizeof(st->task_name[i]) - 1);
+		st->task_slices[i] = slices;
+		st->task_busy_us[i] = busy_us;
+
+		uint32_t stack_size;
+		st->task_stack_used_kb[i] = scheduler_task_stack(i, &stack_size) >> 10;
+		st->task_stack_kb[i] = stack_size >> 10;
+	}
+
+	st->flist_scanning = flist_scanning() ? 1 : 0;
+	st->rom_scan_progress = rom_scan_progress();
+	strncpy(st->rom_scan_status, rom_scan_status(), sizeof(st->rom_scan_status) - 1);
+
+	st->mem_rss_kb = mem_rss_kb();
+	for (int i = 0; i < MEM_TAGS && i < STATUS_MEM; i++)
+	{
+		strncpy(st->mem_tag[i], mem_tag_name(i), sizeof(st->mem_tag[i]) - 1);
+		st->mem_kb[i] = mem_current(i) >> 10;
+		st->mem_peak_kb[i] = mem_peak(i) >> 10;
+	}
+
+	load_record_t rec;
+	if (load_last(&rec))
+	{
+		strncpy(st->load_name, rec.name, sizeof(st->load_name) - 1);
+		st->load_failed = rec.failed;
+		st->load_ms = rec.total_us / 1000;
+		for (int i = 0; i < LOAD_PHASES && i < STATUS_PHASES; i++) st->load_phase_ms[i] = rec.phase_us[i] / 1000;
+	}
+
+	for (int i = 0; i < SPI_TAGS && i < STATUS_SPI; i++)
+	{
+		strncpy(st->spi_tag[i], spi_tag_name(i), sizeof(st->spi_tag[i]) - 1);
+		st->spi_xfers[i] = spi_stats[i].xfers;
+		st->spi_words[i] = spi_stats[i].words;
+		st->spi_busy_us[i] = spi_stats[i].busy_ns / 1000;
+	}
+
+	struct battery_data_t bat;
+	if (sensors_battery(&bat))
+	{
+		st->bat_present = 1;
+		st->bat_capacity = bat.capacity;
+		st->bat_load_ma = bat.load_current;
+		st->bat_time = bat.time;
+		st->bat_mv = bat.voltage;
+		st->brightness = sensors_brightness();
+	}
+}
+
+// Header fields stay as they are, only the part after gen is compared and copied.
+#define STATUS_BODY offsetof(status_page_t, core)
+
+static void status_update()
+{
+	static status_page_t st;
+	status_fill(&st);
+
+	if (!memcmp((uint8_t*)page + STATUS_BODY, (uint8_t*)&st + STATUS_BODY, sizeof(st) - STATUS_BODY)) return;
+
+	__atomic_store_n(&page->gen, page->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((uint8_t*)page + STATUS_BODY, (uint8_t*)&st + STATUS_BODY, sizeof(st) - STATUS_BODY);
+	__atomic_store_n(&page->gen, page->gen + 1, __ATOMIC_RELEASE);
+}
+
+void status_page_task(void)
+{
+	unsigned long timer = 0;
+
+	status_open();
+
+	for (;;)
+	{
+		if (page && (!timer || CheckTimer(timer)))
+		{
+			timer = GetTimer(STATUS_PERIOD);
+			status_update();
+		}
+
+		scheduler_yield();
+	}
+}
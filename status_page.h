@@ -0,0 +1,100 @@
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <inttypes.h>
+
+// Read-only status block for monitoring tools, mapped from STATUS_PAGE_PATH.
+// gen is odd while an update is in progress: readers copy the page,
+// and use the copy if gen was even and unchanged before and after.
+// gen only moves when some value changed. Strings are zero terminated.
+
+#define STATUS_PAGE_PATH    "/dev/shm/MiSTer_status"
+#define STATUS_PAGE_MAGIC   0x5354534D // "MSTS"
+#define STATUS_PAGE_VERSION 1
+
+#define STATUS_IMAGES  16
+#define STATUS_PLAYERS 6
+#define STATUS_TASKS   8
+#define STATUS_MEM     12
+#define STATUS_PHASES  7
+#define STATUS_SPI     12
+
+struct status_page_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;     // sizeof(status_page_t), fields are only ever appended
+	uint32_t gen;
+
+	// core
+	char     core[32];
+	uint8_t  menu;
+	uint8_t  osd;
+	uint8_t  reserved[2];
+	char     game[128];     // last loaded file, no path or extension
+	uint32_t game_crc;
+	char     image[STATUS_IMAGES][128];
+
+	// video, as read from the core
+	uint32_t width;
+	uint32_t height;
+	uint32_t vtime;         // frame time in 100MHz ticks
+	uint32_t htime;
+	uint8_t  interlaced;
+	uint8_t  rotated;
+	uint8_t  fb;            // linux framebuffer shown
+	uint8_t  reserved2;
+
+	// input
+	uint16_t player_vid[STATUS_PLAYERS]; // 0 if no device
+	uint16_t player_pid[STATUS_PLAYERS];
+
+	uint32_t ss_count[4];
+
+	// scheduler
+	char     task_name[STATUS_TASKS][16];
+	uint32_t task_slices[STATUS_TASKS];
+	uint64_t task_busy_us[STATUS_TASKS];
+
+	// file browser and catalog scans
+	uint8_t  flist_scanning;
+	uint8_t  rom_scan_progress; // 0-100
+	uint8_t  reserved3[2];
+	char     rom_scan_status[64];
+
+	// memory per subsystem (memtrack.h), unused tags have no name
+	uint32_t mem_rss_kb;
+	char     mem_tag[STATUS_MEM][12];
+	uint32_t mem_kb[STATUS_MEM];
+	uint32_t mem_peak_kb[STATUS_MEM];
+
+	// last launch (load_times.h), phases in LoadPhase order
+	char     load_name[64];
+	uint8_t  load_failed;
+	uint8_t  reserved4[3];
+	uint32_t load_ms;
+	uint32_t load_phase_ms[STATUS_PHASES];
+
+	// scheduler task stacks, deepest use so far
+	uint32_t task_stack_kb[STATUS_TASKS];
+	uint32_t task_stack_used_kb[STATUS_TASKS];
+
+	// SPI bus use per subsystem (spi.h), totals since start, unused tags have no name
+	char     spi_tag[STATUS_SPI][8];
+	uint32_t spi_xfers[STATUS_SPI];
+	uint64_t spi_words[STATUS_SPI];
+	uint64_t spi_busy_us[STATUS_SPI];
+
+	// pi-top battery and screen (sensors.h), all 0 without a battery
+	uint8_t  bat_present;
+	uint8_t  brightness;    // pi-top screen, 0 if off
+	int16_t  bat_capacity;  // %, -1 if unknown
+	int16_t  bat_load_ma;   // > 0 charging
+	int16_t  bat_time;      // minutes to full or empty, -1 if unknown
+	int16_t  bat_mv;
+} __attribute__((packed));
+
+// scheduler task, refreshes the page a few times per second
+void status_page_task(void);
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+#include "storage_probe.h"
+#include "profiling.h"
+
+#define PROBE_FILE     ".storage_probe"
+#define PROBE_SIZE     (16 * 1024 * 1024)
+#define PROBE_SEQ      (4 * 1024 * 1024)  // bytes read per request size
+#define PROBE_RAND     64                 // random 4K reads
+#define PROBE_DELAY    15                 // seconds after the start
+#define PROBE_PROFILES "/tmp/storage_profiles"
+#define PROBE_MAX      16
+
+static const uint32_t probe_sizes[STORAGE_PROBE_SIZES] = { 16 << 10, 64 << 10, 128 << 10, 256 << 10, 1024 << 10 };
+
+static const char *probe_fstypes[] = { "vfat", "exfat", "ntfs", "ntfs3", "fuseblk", "ext2", "ext3", "ext4", "hfsplus", "cifs", "nfs", "nfs4" };
+
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static storage_profile_t profiles[PROBE_MAX];
+static int profile_cnt = -1; // -1 until loaded from /tmp
+static int running = 0;
+
+// Main and the probe thread, with profiles_lock held
+static void profiles_load()
+{
+	if (profile_cnt >= 0) return;
+	profile_cnt = 0;
+
+	FILE *f = fopen(PROBE_PROFILES, "rb");
+	if (!f) return;
+	profile_cnt = fread(profiles, sizeof(profiles[0]), PROBE_MAX, f);
+	fclose(f);
+}
+
+static void profiles_save()
+{
+	FILE *f = fopen(PROBE_PROFILES ".tmp", "wb");
+	if (!f) return;
+	fwrite(profiles, sizeof(profiles[0]), profile_cnt, f);
+	fclose(f);
+	rename(PROBE_PROFILES ".tmp", PROBE_PROFILES);
+}
+
+static void profile_store(const storage_profile_t *p)
+{
+	pthread_mutex_lock(&profiles_lock);
+	int i = 0;
+	while (i < profile_cnt && profiles[i].dev != p->dev) i++;
+	if (i < PROBE_MAX)
+	{
+		profiles[i] = *p;
+		if (i == profile_cnt) profile_cnt++;
+		profiles_save();
+	}
+	pthread_mutex_unlock(&profiles_lock);
+}
+
+// Storage mounts under /media with their devices
+static std::vector<storage_profile_t> probe_mounts()
+{
+	std::vector<storage_profile_t> list;
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (!f) return list;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		// id parent major:minor root mount options ... - fstype source
+		char dir[256], fstype[32];
+		char *sep = strstr(line, " - ");
+		if (!sep || sscanf(line, "%*s %*s %*s %*s %255s", dir) != 1 || sscanf(sep + 3, "%31s", fstype) != 1) continue;
+		if (strncmp(dir, "/media/", 7)) continue;
+
+		bool known = false;
+		for (const char *t : probe_fstypes) known = known || !strcmp(fstype, t);
+		if (!known) continue;
+
+		struct stat64 st;
+		if (stat64(dir, &st)) continue;
+
+		// the last mount on a point is the one seen there
+		list.erase(std::remove_if(list.begin(), list.end(), [&](const storage_profile_t &p) { return !strcmp(p.mount, dir); }), list.end());
+
+		storage_profile_t p = {};
+		p.dev = st.st_dev;
+		snprintf(p.mount, sizeof(p.mount), "%s", dir);
+		snprintf(p.fstype, sizeof(p.fstype), "%s", fstype);
+		list.push_back(p);
+	}
+	fclose(f);
+	return list;
+}
+
+// Opens the probe file, made the first time. Read only mounts fail here.
+static int probe_open(const char *mount, uint8_t *buf)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/" PROBE_FILE, mount);
+
+	struct stat64 st;
+	if (!stat64(path, &st) && st.st_size == PROBE_SIZE) return open(path, O_RDONLY | O_CLOEXEC);
+
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	// random data, so compressing file systems can't cheat
+	uint32_t r = 0x50524F42;
+	for (uint32_t i = 0; i < (1 << 20) / 4; i++)
+	{
+		r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+		memcpy(buf + i * 4, &r, 4);
+	}
+
+	int ok = 1;
+	for (int pos = 0; ok && pos < PROBE_SIZE; pos += 1 << 20) ok = write(fd, buf, 1 << 20) == (1 << 20);
+	ok = ok && !fsync(fd);
+	close(fd);
+
+	if (!ok)
+	{
+		unlink(path);
+		return -1;
+	}
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void probe_one(storage_profile_t *p)
+{
+	printf("storage_probe: %s (%s)\n", p->mount, p->fstype);
+	uint64_t t0 = trace_now_us();
+
+	uint8_t *buf = (uint8_t *)malloc(1 << 20);
+	int fd = buf ? probe_open(p->mount, buf) : -1;
+	if (fd < 0)
+	{
+		printf("storage_probe: no probe file on %s\n", p->mount);
+		p->failed = 1;
+		free(buf);
+		return;
+	}
+
+	// each size reads its own part of the file, dropped from the page cache first
+	uint32_t best = 0;
+	for (int s = 0; s < STORAGE_PROBE_SIZES; s++)
+	{
+		off64_t base = (off64_t)(s % 4) * PROBE_SEQ;
+		posix_fadvise(fd, base, PROBE_SEQ, POSIX_FADV_DONTNEED);
+
+		uint64_t t = trace_now_us();
+		uint32_t done = 0;
+		while (done < PROBE_SEQ)
+		{
+			ssize_t ret = pread(fd, buf, probe_sizes[s], base + done);
+			if (ret <= 0) break;
+			done += ret;
+		}
+		uint64_t us = trace_now_us() - t;
+
+		p->seq_kbs[s] = (done == PROBE_SEQ) ? (uint32_t)(((uint64_t)done * 1000000 / 1024) / (us ? us : 1)) : 0;
+		best = std::max(best, p->seq_kbs[s]);
+	}
+
+	posix_fadvise(fd, 0, PROBE_SIZE, POSIX_FADV_DONTNEED);
+	std::vector<uint32_t> lat;
+	uint32_t r = 0x52414E44;
+	for (int i = 0; i < PROBE_RAND; i++)
+	{
+		r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+		uint64_t t = trace_now_us();
+		if (pread(fd, buf, 4096, (off64_t)(r % (PROBE_SIZE / 4096)) * 4096) != 4096) break;
+		lat.push_back(trace_now_us() - t);
+	}
+	close(fd);
+	free(buf);
+
+	if (!best || lat.empty())
+	{
+		p->failed = 1;
+		return;
+	}
+
+	std::sort(lat.begin(), lat.end());
+	p->rand_us = lat[lat.size() / 2];
+
+	// smallest request that gets 90% of the best throughput
+	int s = 0;
+	while (p->seq_kbs[s] < best - best / 10) s++;
+	p->chunk = probe_sizes[s];
+
+	// enough requests in flight to cover the latency of one with the transfer of the others
+	uint32_t chunk_us = (uint32_t)((uint64_t)p->chunk * 1000000 / 1024 / best);
+	p->depth = std::min<uint32_t>(std::max<uint32_t>(2, 1 + p->rand_us / (chunk_us ? chunk_us : 1)), 8);
+
+	printf("storage_probe: %s: %u KB/s at %uK, depth %u, random 4K %uus, %llu ms\n", p->mount, best, p->chunk >> 10,
+		p->depth, p->rand_us, (unsigned long long)((trace_now_us() - t0) / 1000));
+}
+
+static void *probe_thread(void *arg)
+{
+	std::vector<storage_profile_t> *list = (std::vector<storage_profile_t> *)arg;
+	trace_thread_name("storage_probe");
+	sleep(PROBE_DELAY);
+
+	for (storage_profile_t &p : *list)
+	{
+		probe_one(&p);
+		profile_store(&p);
+	}
+
+	delete list;
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void storage_probe_start(int force)
+{
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+
+	std::vector<storage_profile_t> *list = new std::vector<storage_profile_t>(probe_mounts());
+
+	pthread_mutex_lock(&profiles_lock);
+	profiles_load();
+	if (!force)
+	{
+		list->erase(std::remove_if(list->begin(), list->end(), [](const storage_profile_t &p)
+		{
+			for (int i = 0; i < profile_cnt; i++) if (profiles[i].dev == p.dev) return true;
+			return false;
+		}), list->end());
+	}
+	pthread_mutex_unlock(&profiles_lock);
+
+	if (list->empty())
+	{
+		delete list;
+		return;
+	}
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	running = 1;
+	if (pthread_create(&thread, &attr, probe_thread, list))
+	{
+		running = 0;
+		delete list;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+int storage_profile_fd(int fd, storage_profile_t *p)
+{
+	struct stat64 st;
+	if (fd < 0 || fstat64(fd, &st)) return 0;
+
+	int found = 0;
+	pthread_mutex_lock(&profiles_lock);
+	profiles_load();
+	for (int i = 0; i < profile_cnt && !found; i++)
+	{
+		if (profiles[i].dev == st.st_dev && !profiles[i].failed)
+		{
+			*p = profiles[i];
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&profiles_lock);
+	return found;
+}
+
+uint32_t storage_chunk(int fd, uint32_t def)
+{
+	storage_profile_t p;
+	return storage_profile_fd(fd, &p) ? p.chunk : def;
+}
+
+int storage_depth(int fd, int def)
+{
+	storage_profile_t p;
+	return storage_profile_fd(fd, &p) ? p.depth : def;
+}
+
+int storage_report(char *buf, int size, const char *path)
+{
+	int len = snprintf(buf, size, "%s", __atomic_load_n(&running, __ATOMIC_ACQUIRE) ? "Probing...\n" : "");
+
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (f) fprintf(f, "mount\tfstype\tchunk_kb\tdepth\trand_us\tkbs_16k\tkbs_64k\tkbs_128k\tkbs_256k\tkbs_1m\n");
+
+	pthread_mutex_lock(&profiles_lock);
+	profiles_load();
+	for (int i = 0; i < profile_cnt; i++)
+	{
+		const storage_profile_t *p = &profiles[i];
+		const char *name = strrchr(p->mount, '/');
+		name = name ? name + 1 : p->mount;
+
+		if (p->failed)
+		{
+			if (len < size) len += snprintf(buf + len, size - len, "%s%.12s: no probe", len ? "\n" : "", name);
+			continue;
+		}
+
+		uint32_t best = *std::max_element(p->seq_kbs, p->seq_kbs + STORAGE_PROBE_SIZES);
+		if (len < size) len += snprintf(buf + len, size - len, "%s%.12s %s\n %u MB/s %uK x%u, 4K %uus",
+			len ? "\n" : "", name, p->fstype, best >> 10, p->chunk >> 10, p->depth, p->rand_us);
+
+		if (f)
+		{
+			fprintf(f, "%s\t%s\t%u\t%u\t%u", p->mount, p->fstype, p->chunk >> 10, p->depth, p->rand_us);
+			for (int s = 0; s < STORAGE_PROBE_SIZES; s++) fprintf(f, "\t%u", p->seq_kbs[s]);
+			fprintf(f, "\n");
+		}
+	}
+	pthread_mutex_unlock(&profiles_lock);
+
+	if (!len) len = snprintf(buf, size, "No storage probed yet.");
+	if (f) fclose(f);
+	return len;
+}
@@ -0,0 +1,43 @@
+#ifndef STORAGE_PROBE_H
+#define STORAGE_PROBE_H
+
+#include <stdint.h>
+
+// Per device storage profiles. Every storage mounted under /media (the SD
+// card, USB drives, network shares) is measured once per boot in the
+// background: sequential throughput for several request sizes and the
+// latency of random 4K reads, on a 16MB .storage_probe file kept in the
+// root of the mount. The profile gives the request size and the number of
+// requests in flight that the transfer pipeline and the read-ahead use.
+// Profiles are kept in /tmp across core launches.
+
+#define STORAGE_PROBE_SIZES 5 // 16K to 1M request sizes
+
+struct storage_profile_t
+{
+	uint64_t dev;                              // st_dev of the mount
+	char mount[64];
+	char fstype[16];
+	uint32_t seq_kbs[STORAGE_PROBE_SIZES];     // KB/s per request size
+	uint32_t rand_us;                          // p50 of random 4K reads
+	uint32_t chunk;                            // best request size, bytes
+	uint8_t depth;                             // requests to keep in flight
+	uint8_t failed;                            // probe file couldn't be made or read
+	uint8_t reserved[2];
+};
+
+// Probes mounts without a profile on a background thread, after a delay
+// so a core launch isn't slowed down. force: all mounts again.
+void storage_probe_start(int force);
+
+// Profile of the storage the open file is on, 0 if there is none (yet).
+int storage_profile_fd(int fd, storage_profile_t *p);
+
+// Request size and depth for reads from fd, def if not probed.
+uint32_t storage_chunk(int fd, uint32_t def);
+int storage_depth(int fd, int def);
+
+// Table of all profiles for the OSD, also written to path if not NULL.
+int storage_report(char *buf, int size, const char *path);
+
+#endif
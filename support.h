@@ -18,6 +18,7 @@
 
 // X86  support
 #include "support/x86/x86.h"
+#include "support/x86/x86_share.h"
 
 // SNES  support
 #include "support/snes/snes.h"
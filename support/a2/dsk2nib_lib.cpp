@@ -133,58 +133,33 @@ static int phys_to_logical_sector(int phys_sector) {
     return 0; // fallback
 }
 
-void a2_readDsk2Nib(fileTYPE*fd, uint64_t offset, uchar *byte) {
-    int nib_track = offset / BYTES_PER_NIB_TRACK;
-    uint64_t track_offset = offset % BYTES_PER_NIB_TRACK;
+// Builds NIB track nib_track of the DSK image into out.
+static void build_nib_track(fileTYPE *fd, int nib_track, uchar *out) {
     int volume = DEFAULT_VOLUME;
-    
-    // Bounds check
-    if (nib_track >= TRACKS_PER_DISK) {
-        memset(byte, 0, 512);
-        return;
+
+    // The DSK sectors of a track are contiguous, read them at once
+    uchar dsk_track[BYTES_PER_TRACK];
+    if (!FileSeek(fd, (off_t)nib_track * BYTES_PER_TRACK, SEEK_SET) ||
+        !FileReadAdv(fd, dsk_track, BYTES_PER_TRACK)) {
+        memset(dsk_track, 0, BYTES_PER_TRACK);
     }
-    
-    // Build entire NIB track in memory
-    uchar nib_track_data[BYTES_PER_NIB_TRACK];
-    
+
     // Process all 16 sectors in this track
     for (int phys_sector = 0; phys_sector < SECTORS_PER_TRACK; phys_sector++) {
         // Convert physical sector to logical sector
         int logical_sector = phys_to_logical_sector(phys_sector);
-        
+
         // Get corresponding DSK soft sector
         int dsk_soft_sector = soft_interleave[logical_sector];
-        
-        // Read DSK sector data
-        uchar dsk_sector[BYTES_PER_SECTOR];
-        off_t dsk_offset = (off_t)nib_track * BYTES_PER_TRACK + (off_t)dsk_soft_sector * BYTES_PER_SECTOR;
-
-	if (FileSeek(fd, dsk_offset, SEEK_SET))
-        {
-             if (FileReadAdv(fd, dsk_sector, BYTES_PER_SECTOR))
-             {
-		     // good
-             }
-	     else {
-            	memset(dsk_sector, 0, BYTES_PER_SECTOR);
-	     }
-        } else {
-            memset(dsk_sector, 0, BYTES_PER_SECTOR);
-	}
+        uchar *dsk_sector = dsk_track + dsk_soft_sector * BYTES_PER_SECTOR;
 
-        
-        //if (lseek(fd, dsk_offset, SEEK_SET) == -1) {
-        //} else if (read(fd, dsk_sector, BYTES_PER_SECTOR) != BYTES_PER_SECTOR) {
-        //    memset(dsk_sector, 0, BYTES_PER_SECTOR);
-        //}
-        
         // Build NIB sector structure
         nib_sector_t nib_sector;
-        
+
         // Initialize gaps
         memset(nib_sector.gap1, GAP_BYTE, GAP1_LEN);
         memset(nib_sector.gap2, GAP_BYTE, GAP2_LEN);
-        
+
         // Set address field
         memcpy(nib_sector.addr.prolog, addr_prolog, 3);
         memcpy(nib_sector.addr.epilog, addr_epilog, 3);
@@ -193,31 +168,124 @@ void a2_readDsk2Nib(fileTYPE*fd, uint64_t offset, uchar *byte) {
         odd_even_encode(nib_sector.addr.sector, logical_sector);
         int csum = volume ^ nib_track ^ logical_sector;
         odd_even_encode(nib_sector.addr.checksum, csum);
-        
+
         // Set data field
         memcpy(nib_sector.data.prolog, data_prolog, 3);
         memcpy(nib_sector.data.epilog, data_epilog, 3);
         nibbilize(dsk_sector, &nib_sector.data);
-        
+
         // Copy this sector to the track buffer
-        memcpy(nib_track_data + phys_sector * BYTES_PER_NIB_SECTOR, &nib_sector, sizeof(nib_sector));
+        memcpy(out + phys_sector * BYTES_PER_NIB_SECTOR, &nib_sector, sizeof(nib_sector));
     }
-    
-    // Copy requested 512 bytes from the track
-    int bytes_to_copy = 512;
-    int available_bytes = BYTES_PER_NIB_TRACK - track_offset;
-    
-    if (available_bytes <= 0) {
+}
+
+// Nibblized tracks of the mounted images. A track is built on its first read
+// and served from here until it's written or the image is changed, the core
+// reads each track in 13 blocks and keeps rereading it while the drive spins.
+#define A2_CACHE_DISKS 4
+
+typedef struct {
+    fileTYPE *fd;
+    __off64_t size;
+    uint64_t valid;     // bit per track
+    uchar *nib;         // TRACKS_PER_DISK * BYTES_PER_NIB_TRACK
+} nib_cache_t;
+
+static nib_cache_t nib_cache[A2_CACHE_DISKS];
+static int nib_cache_next = 0;
+
+// NIB data written by the core is gathered per track and decoded when the
+// track is complete, the image is read, the core moves to another track or
+// the image is changed.
+static uchar track_buffer[BYTES_PER_NIB_TRACK];
+static fileTYPE *wr_fd = 0;
+static int wr_track = -1;
+static int bytes_accumulated = 0;
+static int wr_dirty = 0;
+
+static void flush_write(fileTYPE *fd);
+
+static nib_cache_t *nib_cache_get(fileTYPE *fd) {
+    nib_cache_t *c = 0;
+    for (int i = 0; i < A2_CACHE_DISKS; i++) {
+        if (nib_cache[i].fd == fd) {
+            c = &nib_cache[i];
+            break;
+        }
+    }
+
+    if (!c) {
+        c = &nib_cache[nib_cache_next];
+        nib_cache_next = (nib_cache_next + 1) % A2_CACHE_DISKS;
+        c->fd = fd;
+        c->valid = 0;
+    }
+
+    // same slot with another image in it
+    if (c->size != fd->size) {
+        c->size = fd->size;
+        c->valid = 0;
+    }
+
+    if (!c->nib) {
+        c->nib = (uchar*)malloc(TRACKS_PER_DISK * BYTES_PER_NIB_TRACK);
+        if (!c->nib) c->fd = 0;
+    }
+
+    return c->nib ? c : 0;
+}
+
+void a2_dsk_reset(fileTYPE *fd) {
+    flush_write(fd);
+    if (wr_fd == fd) {
+        wr_fd = 0;
+        wr_track = -1;
+    }
+    for (int i = 0; i < A2_CACHE_DISKS; i++) {
+        if (nib_cache[i].fd == fd) {
+            free(nib_cache[i].nib);
+            memset(&nib_cache[i], 0, sizeof(nib_cache_t));
+        }
+    }
+}
+
+void a2_readDsk2Nib(fileTYPE*fd, uint64_t offset, uchar *byte) {
+    int nib_track = offset / BYTES_PER_NIB_TRACK;
+    uint64_t track_offset = offset % BYTES_PER_NIB_TRACK;
+
+    // Bounds check
+    if (nib_track >= TRACKS_PER_DISK) {
         memset(byte, 0, 512);
         return;
     }
-    
+
+    // Pending NIB data has to be in the DSK image before the track is built
+    flush_write(fd);
+
+    uchar nib_track_data[BYTES_PER_NIB_TRACK];
+    uchar *track = nib_track_data;
+
+    nib_cache_t *c = nib_cache_get(fd);
+    if (c) {
+        track = c->nib + nib_track * BYTES_PER_NIB_TRACK;
+        if (!(c->valid & (1ULL << nib_track))) {
+            build_nib_track(fd, nib_track, track);
+            c->valid |= 1ULL << nib_track;
+        }
+    } else {
+        build_nib_track(fd, nib_track, track);
+    }
+
+    // Copy requested 512 bytes from the track
+    int bytes_to_copy = 512;
+    int available_bytes = BYTES_PER_NIB_TRACK - track_offset;
+
     if (bytes_to_copy > available_bytes) {
         bytes_to_copy = available_bytes;
     }
-    
-    memcpy(byte, nib_track_data + track_offset, bytes_to_copy);
-    
+
+    memcpy(byte, track + track_offset, bytes_to_copy);
+
     // Fill remaining bytes with zeros if needed
     if (bytes_to_copy < 512) {
         memset(byte + bytes_to_copy, 0, 512 - bytes_to_copy);
@@ -402,66 +470,75 @@ void a2_readDSK(fileTYPE* idx, uint64_t lba, int ack) {
 }
 
 
-void a2_writeNib2Dsk(fileTYPE*fd, uint64_t offset, uchar *byte) {
-    int nib_track = offset / BYTES_PER_NIB_TRACK;
-    uint64_t track_offset = offset % BYTES_PER_NIB_TRACK;
-    
-    // Bounds check
-    if (nib_track >= TRACKS_PER_DISK) {
-        return;
-    }
-    
-    // We need to accumulate a full track's worth of NIB data to properly decode
-    // This is a simplified approach - we'll try to parse sectors from the given 512 bytes
-    static uchar track_buffer[BYTES_PER_NIB_TRACK];
-    static int current_track = -1;
-    static int bytes_accumulated = 0;
-    
-    // If this is a new track, reset the buffer
-    if (current_track != nib_track) {
-        current_track = nib_track;
-        bytes_accumulated = 0;
-        memset(track_buffer, 0, BYTES_PER_NIB_TRACK);
-    }
-    
-    // Copy the 512 bytes into our track buffer at the appropriate offset
-    int copy_len = 512;
-    if (track_offset + copy_len > BYTES_PER_NIB_TRACK) {
-        copy_len = BYTES_PER_NIB_TRACK - track_offset;
-    }
-    
-    if (copy_len > 0) {
-        memcpy(track_buffer + track_offset, byte, copy_len);
-        bytes_accumulated += copy_len;
-    }
-    
-    // Try to parse and write any complete sectors we can find
+// The buffer stays, a track written in parts is decoded as a whole again.
+static void flush_write(fileTYPE *fd) {
+    if (!wr_dirty || (fd && fd != wr_fd)) return;
+
+    fileTYPE *f = wr_fd;
+    int nib_track = wr_track;
+    wr_dirty = 0;
+
     // Look for sectors in the accumulated data
     int pos = 0;
     while (pos < bytes_accumulated - 400) { // Need at least 400 bytes for a sector
         uchar dsk_sector[BYTES_PER_SECTOR];
         int track_num, sector_num;
-        
+
         if (parse_nib_sector(track_buffer + pos, bytes_accumulated - pos, dsk_sector, &track_num, &sector_num)) {
             // Successfully parsed a sector
             if (track_num == nib_track && sector_num < SECTORS_PER_TRACK) {
                 // Map logical sector to soft sector using interleave
                 int soft_sector = soft_interleave[sector_num];
-                
+
                 // Calculate DSK file offset
                 off_t dsk_offset = (off_t)track_num * BYTES_PER_TRACK + (off_t)soft_sector * BYTES_PER_SECTOR;
-                
+
                 // Write sector to DSK file
-                //if (lseek(fd, dsk_offset, SEEK_SET) != -1) {
-                if (FileSeek(fd,dsk_offset, SEEK_SET))
-	//			if (lseek(fd, dsk_offset, SEEK_SET) != -1) {
-		    FileWriteAdv(fd, dsk_sector,BYTES_PER_SECTOR);
-                    //write(fd, dsk_sector, BYTES_PER_SECTOR);
-                //}
+                if (FileSeek(f, dsk_offset, SEEK_SET))
+                    FileWriteAdv(f, dsk_sector, BYTES_PER_SECTOR);
             }
             pos += BYTES_PER_NIB_SECTOR; // Move to next sector
         } else {
             pos++; // Try next byte position
         }
     }
+
+    // the track is built again from the DSK image on its next read
+    for (int i = 0; i < A2_CACHE_DISKS; i++) {
+        if (nib_cache[i].fd == f) nib_cache[i].valid &= ~(1ULL << nib_track);
+    }
+}
+
+void a2_writeNib2Dsk(fileTYPE*fd, uint64_t offset, uchar *byte) {
+    int nib_track = offset / BYTES_PER_NIB_TRACK;
+    uint64_t track_offset = offset % BYTES_PER_NIB_TRACK;
+
+    // Bounds check
+    if (nib_track >= TRACKS_PER_DISK) {
+        return;
+    }
+
+    // If this is a new track, write out the previous one and reset the buffer
+    if (wr_fd != fd || wr_track != nib_track) {
+        flush_write(0);
+        wr_fd = fd;
+        wr_track = nib_track;
+        bytes_accumulated = 0;
+        memset(track_buffer, 0, BYTES_PER_NIB_TRACK);
+    }
+
+    // Copy the 512 bytes into our track buffer at the appropriate offset
+    int copy_len = 512;
+    if (track_offset + copy_len > BYTES_PER_NIB_TRACK) {
+        copy_len = BYTES_PER_NIB_TRACK - track_offset;
+    }
+
+    if (copy_len > 0) {
+        memcpy(track_buffer + track_offset, byte, copy_len);
+        bytes_accumulated += copy_len;
+        wr_dirty = 1;
+    }
+
+    // The last block of the track
+    if (track_offset + copy_len >= BYTES_PER_NIB_TRACK) flush_write(fd);
 }
@@ -15,5 +15,9 @@ void a2_writeNib2Dsk(fileTYPE*fd, uint64_t offset, uchar *byte);
 void a2_writeDSK(fileTYPE* idx, uint64_t lba, int ack);
 void a2_readDSK(fileTYPE* idx, uint64_t lba, int ack);
 
+// Writes out pending NIB data and drops the cached tracks of the image,
+// needed before it's closed or changed.
+void a2_dsk_reset(fileTYPE* idx);
+
 
 #endif
@@ -74,10 +74,9 @@ buffer_data * buffer_init(unsigned int initial_size) {
 //  Purpose:
 //
 //     This function will take data and append it into a buffer in the struct
-//     given. It will growing as required (or as allowed by realloc) by the
-//     length desired in the structure element "expand_length" plus the length
-//     of the data being appended. If additional expansion is not desired, you
-//     can set the struct element "expand_length" to zero.
+//     given. It will growing as required (or as allowed by realloc) to at
+//     least twice its capacity, or the length of the data being appended plus
+//     the structure element "expand_length" if that is more.
 //
 //  Parameters:
 //
@@ -115,11 +114,14 @@ int buffer_append(buffer_data * buffer, const char * append_data) {
 		return -1;
 	}
 
-	// is there enough space, or should we reallocate memory?
-	if (buffer->length + append_len > buffer->capacity) {
+	// is there enough space (with the terminator), or should we reallocate memory?
+	if (buffer->length + append_len + 1 > buffer->capacity) {
 
-		const unsigned int realloc_size =
-			buffer->capacity + append_len + buffer->expand_length;
+		// grow by doubling so appending many small texts stays linear
+		unsigned int realloc_size = buffer->capacity * 2;
+		if (realloc_size < buffer->length + append_len + 1 + buffer->expand_length) {
+			realloc_size = buffer->length + append_len + 1 + buffer->expand_length;
+		}
 
 		// allocate the new buffer
 		char *new_buffer = (char *)realloc(buffer->content, realloc_size);
@@ -129,20 +131,14 @@ int buffer_append(buffer_data * buffer, const char * append_data) {
 			return -2;
 		}
 
-		// copy the data to append into the new content buffer
-		strcat(new_buffer, append_data);
-
 		// update the struct with the new values
 		buffer->content = new_buffer;       // new buffer content
-		buffer->capacity = realloc_size;    // add the amount to expand beyond our initial needs
-		buffer->length = buffer->length + append_len;
-
-	}
-	else {
-		// append the string
-		strcat(buffer->content, append_data);
+		buffer->capacity = realloc_size;
 	}
 
+	// append the string at the known end, no need to search for it
+	memcpy(buffer->content + buffer->length, append_data, append_len + 1);
+
 	// update the buffer length
 	buffer->length += append_len;
 
@@ -150,33 +146,6 @@ int buffer_append(buffer_data * buffer, const char * append_data) {
 	return append_len;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-//  Function buffer_destroy
-//
-//  Purpose:
-//
-//     This function will destroy the inner buffer and reset all of the data
-//     if the struct was dynamically allocated, it is expected that you will
-//     take care of freeing the data.
-//
-//  Parameters:
-//
-//     buffer_data (IN) This parameter is a struct (mapped below) to
-//     keep track of the internal buffer and its working parameters.
-//
-//       typedef struct {
-//           unsigned int length;        // the current length of the content in bytes
-//           unsigned int capacity;      // the total capacity of "content" in bytes
-//           unsigned int expand_length; // the amount to expand the buffer on resize
-//           char * content;       // the target for appending data
-//       } buffer_data;
-//
-//  Returns:
-//
-//     returns nothing
-//
-////////////////////////////////////////////////////////////////////////////////
 
 void buffer_destroy(buffer_data * buffer) {
 
@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -11,10 +17,15 @@
 #include "../../file_io.h"
 #include "../../menu.h"
 #include "../../fpga_io.h"
-#include "../../lib/md5/md5.h"
+#include "../../hash_stream.h"
+#include "../../offload.h"
 #include "../../shmem.h"
 #include "../../str_util.h"
 #include "../../cheats.h"
+#include "../../rbf_index.h"
+#include "../../load_times.h"
+#include "../../hardware.h"
+#include "../../crc.h"
 
 #include "buffer.h"
 #include "mra_loader.h"
@@ -46,7 +57,8 @@ struct arc_struct {
 	uint32_t address;
 	uint32_t crc;
 	buffer_data *data;
-	struct MD5Context context;
+	hash_stream *hash;
+	size_t partseq;
 };
 
 static char arcade_error_msg[kBigTextSize] = {};
@@ -63,30 +75,166 @@ static int  nvram_idx  = 0;
 static int  nvram_size = 0;
 static char nvram_name[200] = {};
 
-void arcade_nvm_save()
+// The NVRAM is read back from the core NVRAM_STEP bytes per poll, a full
+// pass every NVRAM_PERIOD ms. The file only gets the NVRAM_BLOCKs whose CRC
+// changed since they were last written, on an offload worker.
+#define NVRAM_BLOCK  256
+#define NVRAM_STEP   4096
+#define NVRAM_PERIOD 10000
+
+static std::vector<uint8_t>  nvram_img;   // contents read from the core
+static std::vector<uint32_t> nvram_crc;   // per block, of what the file holds
+static bool nvram_file = false;           // file is there with the full size
+static int nvram_pos = -1;                // scan position, -1 between scans
+static unsigned long nvram_timer = 0;
+static std::atomic<int> nvram_busy(0);
+
+static void nvram_path(char *path, int size)
+{
+	snprintf(path, size, "%s/" CONFIG_DIR "/nvram/%s", getRootDir(), nvram_name);
+}
+
+static void nvram_read(uint8_t *buf, int ofs, int len)
+{
+	user_io_set_index(nvram_idx);
+	user_io_set_upload(1, ofs);
+	user_io_file_rx_data(buf, len);
+	user_io_set_upload(0);
+}
+
+static void nvram_reset(const uint8_t *buf, bool file)
 {
-	if(nvram_idx && nvram_size)
+	while (nvram_busy) usleep(1000);
+
+	nvram_img.assign(buf, buf + nvram_size);
+	nvram_crc.resize((nvram_size + NVRAM_BLOCK - 1) / NVRAM_BLOCK);
+	for (size_t i = 0; i < nvram_crc.size(); i++)
 	{
-		char path[256] = CONFIG_DIR"/nvram/";
-		FileCreatePath(path);
-		strcat(path, nvram_name);
+		int len = std::min(NVRAM_BLOCK, nvram_size - (int)i * NVRAM_BLOCK);
+		nvram_crc[i] = crc32_update(0, buf + i * NVRAM_BLOCK, len);
+	}
 
-		uint8_t *buf = new uint8_t[nvram_size];
-		if (buf)
+	nvram_file = file;
+	nvram_pos = -1;
+	nvram_timer = GetTimer(NVRAM_PERIOD);
+}
+
+// Queues the write of the changed blocks of nvram_img. 0 if the previous one
+// is still going.
+static int nvram_sync()
+{
+	if (nvram_busy) return 0;
+
+	struct range_t { int ofs; std::vector<uint8_t> data; };
+	std::vector<range_t> ranges;
+
+	for (size_t i = 0; i < nvram_crc.size(); i++)
+	{
+		int ofs = i * NVRAM_BLOCK;
+		int len = std::min(NVRAM_BLOCK, nvram_size - ofs);
+		uint32_t crc = crc32_update(0, nvram_img.data() + ofs, len);
+		if (crc == nvram_crc[i] && nvram_file) continue;
+		nvram_crc[i] = crc;
+
+		if (!ranges.empty() && ranges.back().ofs + (int)ranges.back().data.size() == ofs)
+		{
+			ranges.back().data.insert(ranges.back().data.end(), nvram_img.begin() + ofs, nvram_img.begin() + ofs + len);
+		}
+		else
 		{
-			printf("Request for nvram (idx=%d, size=%d) data\n", nvram_idx, nvram_size);
+			ranges.push_back({ ofs, std::vector<uint8_t>(nvram_img.begin() + ofs, nvram_img.begin() + ofs + len) });
+		}
+	}
 
-			user_io_set_index(nvram_idx);
-			user_io_set_upload(1);
-			user_io_file_rx_data(buf, nvram_size);
-			user_io_set_upload(0);
+	if (ranges.empty()) return 1;
 
-			FileSave(path, buf, nvram_size);
-			delete [] buf;
+	char path[1024];
+	nvram_path(path, sizeof(path));
+	std::string fpath = path;
+	bool whole = !nvram_file;
+	nvram_file = true;
+	if (whole) FileCreatePath(CONFIG_DIR"/nvram/");
+
+	nvram_busy = 1;
+	offload_add_work([fpath, whole, ranges]
+	{
+		if (whole)
+		{
+			// no file of the right size yet, a single range covers it all
+			std::string tmp = fpath + ".tmp";
+			int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+			int ok = fd >= 0 && write(fd, ranges[0].data.data(), ranges[0].data.size()) == (ssize_t)ranges[0].data.size() && !fsync(fd);
+			if (fd >= 0) close(fd);
+			if (!ok || rename(tmp.c_str(), fpath.c_str()))
+			{
+				printf("Cannot write %s\n", fpath.c_str());
+				unlink(tmp.c_str());
+			}
+		}
+		else
+		{
+			int fd = open(fpath.c_str(), O_WRONLY | O_CLOEXEC);
+			if (fd >= 0)
+			{
+				size_t total = 0;
+				for (auto &r : ranges)
+				{
+					if (pwrite(fd, r.data.data(), r.data.size(), r.ofs) == (ssize_t)r.data.size()) total += r.data.size();
+				}
+				fsync(fd);
+				close(fd);
+				printf("nvram: %zu bytes in %zu ranges written\n", total, ranges.size());
+			}
 		}
+		nvram_busy = 0;
+	});
+
+	return 1;
+}
+
+void arcade_nvm_save()
+{
+	if (nvram_idx && nvram_size && (int)nvram_img.size() == nvram_size)
+	{
+		printf("Request for nvram (idx=%d, size=%d) data\n", nvram_idx, nvram_size);
+
+		while (nvram_busy) usleep(1000);
+		nvram_read(nvram_img.data(), 0, nvram_size);
+		nvram_sync();
+
+		nvram_pos = -1;
+		nvram_timer = GetTimer(NVRAM_PERIOD);
+	}
+}
+
+void arcade_nvm_poll()
+{
+	if (!nvram_idx || !nvram_size || (int)nvram_img.size() != nvram_size) return;
+
+	if (nvram_pos < 0)
+	{
+		if (!CheckTimer(nvram_timer)) return;
+		nvram_pos = 0;
+	}
+
+	if (nvram_pos < nvram_size)
+	{
+		int len = std::min(NVRAM_STEP, nvram_size - nvram_pos);
+		nvram_read(nvram_img.data() + nvram_pos, nvram_pos, len);
+		nvram_pos += len;
+	}
+	else if (nvram_sync())
+	{
+		nvram_pos = -1;
+		nvram_timer = GetTimer(NVRAM_PERIOD);
 	}
 }
 
+void arcade_nvm_flush()
+{
+	while (nvram_busy) usleep(1000);
+}
+
 static void arcade_nvm_load()
 {
 	if (nvram_idx && nvram_size)
@@ -98,7 +246,8 @@ static void arcade_nvm_load()
 			memset(buf, 0, nvram_size);
 
 			strcat(path, nvram_name);
-			if (FileLoadConfig(path, buf, nvram_size))
+			int size = FileLoadConfig(path, buf, nvram_size);
+			if (size)
 			{
 				printf("Sending nvram (idx=%d, size=%d) to core\n", nvram_idx, nvram_size);
 				user_io_set_index(nvram_idx);
@@ -107,6 +256,7 @@ static void arcade_nvm_load()
 				user_io_set_download(0);
 			}
 
+			nvram_reset(buf, size == nvram_size);
 			delete [] buf;
 		}
 	}
@@ -135,10 +285,9 @@ void arcade_sw_save()
 	if (sw->dip_num && sw->dip_saved != sw->dip_cur)
 	{
 		static char path[1024];
-		strcpy(path, CONFIG_DIR"/dips/");
-		FileCreatePath(path);
+		strcpy(path, "dips/");
 		strcat(path, sw->name);
-		if (FileSave(path, &sw->dip_cur, sizeof(sw->dip_cur)))
+		if (FileSaveConfig(path, &sw->dip_cur, sizeof(sw->dip_cur)))
 		{
 			sw->dip_saved = sw->dip_cur;
 		}
@@ -227,12 +376,13 @@ static int rom_checksz(int idx, int chunk)
 	return 1;
 }
 
-static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *md5context)
+static int rom_data(const uint8_t *buf, int chunk, int map, hash_stream *hash)
 {
 	uint8_t offsets[8]; // assert (unitlen <= 8)
 	int bytes_in_iter = 0;
 
-	if (md5context) MD5Update(md5context, buf, chunk);
+	// MD5 is computed on the hash stream worker while the data is interleaved here
+	if (hash) hash_stream_add(hash, buf, chunk);
 
 	int idx = 0;
 	if (!map) map = 1;
@@ -282,21 +432,27 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 	return 1;
 }
 
-static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, struct MD5Context *md5context)
+static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, hash_stream *hash)
 {
 	fileTYPE f = {};
 	static uint8_t buf[8192];
-	if (!FileOpenZip(&f, name, crc32)) return 0;
+	uint64_t t = trace_now_us();
+	int ok = FileOpenZip(&f, name, crc32);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!ok) return 0;
 	if (start) FileSeek(&f, start, SEEK_SET);
 	unsigned long bytes2send = f.size - f.offset;
 	if (len > 0 && len < (int)bytes2send) bytes2send = len;
+	load_bytes(bytes2send);
 
 	while (bytes2send)
 	{
 		uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
 
+		t = trace_now_us();
 		FileReadAdv(&f, buf, chunk);
-		if (!rom_data(buf, chunk, map, md5context))
+		load_phase_add(LOAD_READ, trace_now_us() - t);
+		if (!rom_data(buf, chunk, map, hash))
 		{
 			FileClose(&f);
 			return 0;
@@ -309,6 +465,164 @@ static int rom_file(const char *name, uint32_t crc32, int start, int len, int ma
 	return 1;
 }
 
+/*
+ * MRA loading is done in two passes. The planning pass collects every <part>
+ * that comes from a zip, in document order. While the ROMs are assembled,
+ * the upcoming parts are opened here and read/inflated on the offload workers,
+ * a few at a time, so the main thread only interleaves and sends the data.
+ */
+
+#define PREFETCH_MAX_PARTS 6
+#define PREFETCH_MAX_BYTES (32 * 1024 * 1024)
+
+struct mra_part_plan
+{
+	std::string zips;   // zip candidates separated by '|'
+	std::string name;
+	uint32_t crc;
+	int start;
+	int length;
+};
+
+struct mra_prefetch
+{
+	fileTYPE f;
+	char fname[kBigTextSize * 2 + 16];
+	uint8_t *data;
+	int size;
+	int opened;
+	std::atomic<int> ok;
+	OffloadHandle job;
+};
+
+static std::vector<mra_part_plan> mra_plan;
+static std::vector<mra_prefetch*> mra_fetched; // parallel to mra_plan, nullptr until opened
+static size_t mra_next_fetch = 0;
+static size_t mra_inflight_parts = 0;
+static size_t mra_inflight_bytes = 0;
+static std::atomic<bool> mra_cancel(false);
+
+static void prefetch_read(mra_prefetch *p)
+{
+	int pos = 0;
+	while (pos < p->size && !mra_cancel)
+	{
+		int chunk = p->size - pos;
+		if (chunk > 256 * 1024) chunk = 256 * 1024;
+
+		int ret = FileReadAdv(&p->f, p->data + pos, chunk);
+		if (ret <= 0) break;
+		pos += ret;
+	}
+
+	p->ok = (pos == p->size);
+}
+
+// Opens the next planned part (on this thread, file_io is not thread safe) and queues the read
+static void prefetch_part(size_t idx)
+{
+	LOAD_PHASE(LOAD_OPEN);
+	mra_part_plan *plan = &mra_plan[idx];
+	mra_prefetch *p = new mra_prefetch();
+	mra_fetched[idx] = p;
+
+	char zipnames_list[kBigTextSize];
+	snprintf(zipnames_list, sizeof(zipnames_list), "%s", plan->zips.c_str());
+
+	char *zipname = NULL;
+	char *zipptr = zipnames_list;
+	const char *root = get_arcade_root(0);
+	while ((zipname = strsep(&zipptr, "|")) != NULL)
+	{
+		snprintf(p->fname, sizeof(p->fname), (zipname[0] == '/') ? "%s%s/%s" : "%s/mame/%s/%s", root, zipname, plan->name.c_str());
+		if (!FileOpenZip(&p->f, p->fname, plan->crc)) continue;
+
+		if (plan->start) FileSeek(&p->f, plan->start, SEEK_SET);
+		int size = p->f.size - p->f.offset;
+		if (plan->length > 0 && plan->length < size) size = plan->length;
+
+		p->data = (uint8_t*)malloc(size ? size : 1);
+		if (!p->data)
+		{
+			printf("prefetch: no memory for %s (%d bytes)\n", p->fname, size);
+			FileClose(&p->f);
+			break;
+		}
+
+		p->size = size;
+		p->opened = 1;
+		load_bytes(size);
+		mra_inflight_parts++;
+		mra_inflight_bytes += size;
+		p->job = offload_try_submit([p]() { prefetch_read(p); });
+		break;
+	}
+}
+
+static void prefetch_fill()
+{
+	while (mra_next_fetch < mra_plan.size())
+	{
+		if (mra_inflight_parts && (mra_inflight_parts >= PREFETCH_MAX_PARTS || mra_inflight_bytes >= PREFETCH_MAX_BYTES)) break;
+		prefetch_part(mra_next_fetch++);
+	}
+}
+
+static void prefetch_free(size_t idx)
+{
+	mra_prefetch *p = mra_fetched[idx];
+	if (!p) return;
+
+	if (p->job.valid()) p->job.wait();
+	if (p->opened)
+	{
+		FileClose(&p->f);
+		mra_inflight_parts--;
+		mra_inflight_bytes -= p->size;
+	}
+	free(p->data);
+	delete p;
+	mra_fetched[idx] = nullptr;
+}
+
+// Waits for the part, reading it here if it couldn't be queued.
+// NULL if the part isn't in the plan, check ok for the result.
+static mra_prefetch *prefetch_get(size_t idx)
+{
+	if (idx >= mra_plan.size()) return NULL;
+
+	while (mra_next_fetch <= idx) prefetch_part(mra_next_fetch++);
+
+	mra_prefetch *p = mra_fetched[idx];
+	if (!p->opened) return p;
+
+	LOAD_PHASE(LOAD_READ);
+	if (p->job.valid()) p->job.wait();
+	else prefetch_read(p);
+
+	return p;
+}
+
+static void prefetch_done(size_t idx)
+{
+	if (idx < mra_plan.size()) prefetch_free(idx);
+	prefetch_fill();
+}
+
+// Cancels outstanding reads and releases everything
+static void prefetch_stop()
+{
+	mra_cancel = true;
+	for (size_t i = 0; i < mra_fetched.size(); i++) prefetch_free(i);
+	mra_cancel = false;
+
+	mra_plan.clear();
+	mra_fetched.clear();
+	mra_next_fetch = 0;
+	mra_inflight_parts = 0;
+	mra_inflight_bytes = 0;
+}
+
 static int rom_patch(const uint8_t *buf, int offset, uint16_t len, int dataop)
 {
 	if ((offset + len) > romlen[0]) return 0;
@@ -330,6 +644,7 @@ static void rom_finish(int send, uint32_t address, int index)
 	{
 		if (send)
 		{
+			LOAD_PHASE(LOAD_TX);
 			uint8_t *data = romdata;
 			int len = romlen[0];
 
@@ -481,7 +796,8 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			arc_info->zipname[0] = 0;
 			arc_info->address = 0;
 			arc_info->insideinterleave = 0;
-			MD5Init(&arc_info->context);
+			hash_stream_close(arc_info->hash, NULL);
+			arc_info->hash = hash_stream_open(HASH_MD5);
 			ProgressMessage(0, 0, 0, 0);
 		}
 
@@ -773,7 +1089,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			for (int i = 1; i < 8; i++) romlen[i] = romlen[0];
 		}
 
-		ProgressMessage("Loading", message, ftell(sd->file), arc_info->file_size);
+		ProgressMessage("Loading", message, XMLDoc_SAX_pos(sd), arc_info->file_size);
 		break;
 
 	case XML_EVENT_TEXT:
@@ -803,8 +1119,10 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 			if (arc_info->insiderom)
 			{
-				unsigned char checksum[16];
-				MD5Final(checksum, &arc_info->context);
+				hash_result res = {};
+				hash_stream_close(arc_info->hash, &res);
+				arc_info->hash = NULL;
+				unsigned char *checksum = res.md5;
 
 				char hex[40];
 				char *p = hex;
@@ -852,10 +1170,19 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 		//int user_io_file_tx_body_filepart(const char *name,int start, int len)
 		if (!strcasecmp(node->tag, "part") && arc_info->insiderom)
 		{
+			// planned parts are counted the same way as in xml_scan_meta
+			size_t part_idx = arc_info->partseq;
+			int has_name = strlen(arc_info->partname) > 0;
+			if (has_name) arc_info->partseq++;
+
 			// suppress rom0 if we already sent a valid one
 			// this is useful for merged rom sets - if the first one was valid, use it
 			// the second might not be
-			if (arc_info->romindex == 0 && arc_info->validrom0 == 1) break;
+			if (arc_info->romindex == 0 && arc_info->validrom0 == 1)
+			{
+				if (has_name) prefetch_done(part_idx);
+				break;
+			}
 			char fname[kBigTextSize * 2 + 16];
 			int start, length, repeat;
 			uint32_t crc32;
@@ -874,8 +1201,29 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			if (unitlen == 1 || (arc_info->imap & 0xF)) printf("%6X: ", romlen[0]);
 			else printf("        ");
 
+			mra_prefetch *part = has_name ? prefetch_get(part_idx) : NULL;
+			if (part)
+			{
+				int result = 0;
+				if (part->opened && part->ok)
+				{
+					if (unitlen > 1) printf("file: %s, start=%d, len=%d, map(%d)=%X\n", part->fname, start, length, unitlen, arc_info->imap);
+					else printf("file: %s, start=%d, len=%d\n", part->fname, start, length);
+
+					result = 1;
+					for (int i = 0; i < repeat && result; i++) result = rom_data(part->data, part->size, arc_info->imap, arc_info->hash);
+				}
+
+				if (!result)
+				{
+					printf("%s does not exist\n", arc_info->partname);
+					snprintf(arc_info->error_msg, kBigTextSize, "%s\n%s not found", part->fname, arc_info->partname);
+				}
+
+				prefetch_done(part_idx);
+			}
 			//user_io_file_tx_body_filepart(getFullPath(fname),0,0);
-			if (strlen(arc_info->partname))
+			else if (has_name)
 			{
 				char zipnames_list[kBigTextSize];
 
@@ -899,7 +1247,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 					for (int i = 0; i < repeat; i++)
 					{
-						result = rom_file(fname, crc32, start, length, arc_info->imap, &arc_info->context);
+						result = rom_file(fname, crc32, start, length, arc_info->imap, arc_info->hash);
 
 						// we should check file not found error for the zip
 						if (result == 0)
@@ -927,7 +1275,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				printf("data: ");
 				if (binary)
 				{
-					for (int i = 0; i < repeat; i++) rom_data(binary, len, arc_info->imap, &arc_info->context);
+					for (int i = 0; i < repeat; i++) rom_data(binary, len, arc_info->imap, arc_info->hash);
 					free(binary);
 				}
 				printf("%d(0x%X) bytes from xml\n", romlen[0] - prev_len, romlen[0] - prev_len);
@@ -1003,31 +1351,139 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 	return true;
 }
 
-static int xml_scan_rbf(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+/*
+ * MRA metadata cache.
+ * Everything needed before the ROMs are sent (rbf, setname, rotation and the
+ * part list for read-ahead) is collected in one SAX pass and kept in
+ * config/mra_cache.bin, keyed by path and checked against mtime and size.
+ * Launching an MRA that was used before doesn't parse the XML until arcade_send_rom.
+ */
+
+#define MRA_CACHE_NAME    "mra_cache.bin"
+#define MRA_CACHE_MAGIC   0x3143524D // "MRC1"
+#define MRA_CACHE_ENTRIES 128
+
+struct mra_meta
+{
+	std::string path;
+	int64_t mtime;
+	int64_t size;
+	std::string rbf;
+	std::string setname;
+	uint8_t samedir;
+	uint8_t has_rotation;
+	uint8_t vertical;
+	uint8_t rotation;
+	std::vector<mra_part_plan> parts;
+};
+
+static std::vector<mra_meta> mra_cache;
+static bool mra_cache_loaded = false;
+
+static void parse_rotation(const char *text, uint8_t *vertical, uint8_t *dir)
+{
+	*vertical = strncasecmp(text, "vertical", 8) == 0;
+
+	*dir = 0;
+	if (*vertical)
+	{
+		// Check for CCW first (must check before CW since "ccw" contains "cw")
+		if (strstr(text, "ccw") || strstr(text, "CCW") ||
+			strstr(text, "counterclockwise") || strstr(text, "counter-clockwise"))
+		{
+			*dir = 2;
+		}
+		// Then check for CW
+		else if (strstr(text, "cw") || strstr(text, "CW") ||
+			strstr(text, "clockwise"))
+		{
+			*dir = 1;
+		}
+		// Default to CW if no direction specified
+		else
+		{
+			*dir = 1; // Fallback to CW if no direction is declared
+		}
+	}
+}
+
+static int xml_scan_meta(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
 {
-	static int insiderbf = 0;
-	char *rbf = (char *)sd->user;
+	mra_meta *meta = (mra_meta *)sd->user;
+
+	static int insiderbf, insetname, inrotation, insiderom;
+	static bool foundsetname;
+	static std::string romzip;
+	static mra_part_plan part;
 
 	switch (evt)
 	{
 	case XML_EVENT_START_DOC:
-		insiderbf = 0;
+		insiderbf = insetname = inrotation = insiderom = 0;
+		foundsetname = false;
 		break;
 
 	case XML_EVENT_START_NODE:
-		if (!strcasecmp(node->tag, "rbf")) insiderbf = 1;
+		insiderbf = !strcasecmp(node->tag, "rbf");
+
+		if (!strcasecmp(node->tag, "setname") && !foundsetname)
+		{
+			insetname = 1;
+			foundsetname = true;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "same_dir") && !strcmp(node->attributes[i].value, "1")) meta->samedir = 1;
+			}
+		}
+		else if (!strcasecmp(node->tag, "rotation") && !meta->has_rotation)
+		{
+			inrotation = 1;
+		}
+		else if (!strcasecmp(node->tag, "rom"))
+		{
+			insiderom = 1;
+			romzip.clear();
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "zip")) romzip = node->attributes[i].value;
+			}
+		}
+		else if (insiderom && !strcasecmp(node->tag, "part"))
+		{
+			part = {};
+			part.zips = romzip;
+			part.length = -1;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				const char *name = node->attributes[i].name;
+				const char *value = node->attributes[i].value;
+				if (!strcasecmp(name, "zip")) part.zips = value;
+				else if (!strcasecmp(name, "name")) part.name = value;
+				else if (!strcasecmp(name, "offset")) part.start = strtoul(value, NULL, 0);
+				else if (!strcasecmp(name, "length")) part.length = strtoul(value, NULL, 0);
+				else if (!strcasecmp(name, "crc")) part.crc = strtoul(value, NULL, 16);
+			}
+		}
 		break;
 
 	case XML_EVENT_TEXT:
 		if (insiderbf)
 		{
 			insiderbf = 0;
-			strncpy(rbf, text, kBigTextSize);
+			meta->rbf.assign(text, strnlen(text, kBigTextSize - 1));
+		}
+		if (insetname) meta->setname = text;
+		if (inrotation)
+		{
+			meta->has_rotation = 1;
+			parse_rotation(text, &meta->vertical, &meta->rotation);
 		}
 		break;
 
 	case XML_EVENT_END_NODE:
-		insiderbf = 0;
+		if (insiderom && !strcasecmp(node->tag, "part") && !part.name.empty()) meta->parts.push_back(part);
+		if (!strcasecmp(node->tag, "rom")) insiderom = 0;
+		insiderbf = insetname = inrotation = 0;
 		break;
 
 	case XML_EVENT_ERROR:
@@ -1040,98 +1496,199 @@ static int xml_scan_rbf(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 	return true;
 }
 
-static int xml_read_pre_parse(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+static void cache_put(std::string &out, const void *data, size_t len)
+{
+	out.append((const char*)data, len);
+}
+
+static void cache_put_str(std::string &out, const std::string &s)
 {
-	(void)(sd);
-	static bool insetname = false;
-	static bool inrotation = false;
-	static int  samedir = 0;
+	uint16_t len = s.size();
+	cache_put(out, &len, sizeof(len));
+	out.append(s, 0, len);
+}
 
-	static bool foundsetname = false;
-	static bool foundrotation = false;
+struct cache_reader
+{
+	const uint8_t *pos, *end;
 
-	switch (evt)
+	bool get(void *data, size_t len)
 	{
-	case XML_EVENT_START_DOC:
-		insetname = false;
-		inrotation = false;
-		foundsetname = false;
-		foundrotation = false;
-		samedir = 0;
-		rotation_dir = 0;
-		break;
+		if ((size_t)(end - pos) < len) return false;
+		memcpy(data, pos, len);
+		pos += len;
+		return true;
+	}
 
-	case XML_EVENT_START_NODE:
-		if (!strcasecmp(node->tag, "setname"))
-		{
-			insetname = true;
-			foundsetname = true;
+	bool get_str(std::string &s)
+	{
+		uint16_t len;
+		if (!get(&len, sizeof(len)) || (size_t)(end - pos) < len) return false;
+		s.assign((const char*)pos, len);
+		pos += len;
+		return true;
+	}
+};
 
-			for (int i = 0; i < node->n_attributes; i++)
+static void mra_cache_load()
+{
+	mra_cache_loaded = true;
+
+	int size = FileLoadConfig(MRA_CACHE_NAME, 0, 0);
+	if (size <= 0) return;
+
+	uint8_t *data = (uint8_t*)malloc(size);
+	if (!data) return;
+
+	if (FileLoadConfig(MRA_CACHE_NAME, data, size) == size)
+	{
+		cache_reader rd = { data, data + size };
+		uint32_t magic = 0, count = 0;
+		if (rd.get(&magic, 4) && magic == MRA_CACHE_MAGIC && rd.get(&count, 4))
+		{
+			for (uint32_t i = 0; i < count; i++)
 			{
-				if (!strcasecmp(node->attributes[i].name, "same_dir") && !strcmp(node->attributes[i].value, "1")) samedir = 1;
+				mra_meta m;
+				uint32_t parts = 0;
+				if (!rd.get_str(m.path) || !rd.get(&m.mtime, 8) || !rd.get(&m.size, 8) ||
+					!rd.get_str(m.rbf) || !rd.get_str(m.setname) || !rd.get(&m.samedir, 1) ||
+					!rd.get(&m.has_rotation, 1) || !rd.get(&m.vertical, 1) || !rd.get(&m.rotation, 1) ||
+					!rd.get(&parts, 4)) break;
+
+				bool ok = true;
+				for (uint32_t j = 0; j < parts && ok; j++)
+				{
+					mra_part_plan p;
+					ok = rd.get_str(p.zips) && rd.get_str(p.name) && rd.get(&p.crc, 4) && rd.get(&p.start, 4) && rd.get(&p.length, 4);
+					if (ok) m.parts.push_back(p);
+				}
+				if (!ok) break;
+
+				mra_cache.push_back(std::move(m));
 			}
 		}
-		else if (!strcasecmp(node->tag, "rotation"))
+	}
+
+	free(data);
+	printf("MRA cache: %d entries\n", (int)mra_cache.size());
+}
+
+static void mra_cache_save()
+{
+	std::string out;
+	uint32_t magic = MRA_CACHE_MAGIC, count = mra_cache.size();
+	cache_put(out, &magic, 4);
+	cache_put(out, &count, 4);
+
+	for (const mra_meta &m : mra_cache)
+	{
+		cache_put_str(out, m.path);
+		cache_put(out, &m.mtime, 8);
+		cache_put(out, &m.size, 8);
+		cache_put_str(out, m.rbf);
+		cache_put_str(out, m.setname);
+		cache_put(out, &m.samedir, 1);
+		cache_put(out, &m.has_rotation, 1);
+		cache_put(out, &m.vertical, 1);
+		cache_put(out, &m.rotation, 1);
+
+		uint32_t parts = m.parts.size();
+		cache_put(out, &parts, 4);
+		for (const mra_part_plan &p : m.parts)
 		{
-			inrotation = true;
-			foundrotation = true;
+			cache_put_str(out, p.zips);
+			cache_put_str(out, p.name);
+			cache_put(out, &p.crc, 4);
+			cache_put(out, &p.start, 4);
+			cache_put(out, &p.length, 4);
 		}
-		break;
+	}
 
-	case XML_EVENT_TEXT:
-		if(insetname)
+	FileSaveConfig(MRA_CACHE_NAME, (void*)out.data(), out.size());
+}
+
+// Metadata of the MRA/MGL, parsed only if it isn't cached or the file changed
+static const mra_meta *mra_meta_get(const char *xml)
+{
+	if (!mra_cache_loaded) mra_cache_load();
+
+	struct stat64 st;
+	if (stat64(getFullPath(xml), &st) < 0) return NULL;
+	const char *path = getFullPath(xml);
+
+	for (const mra_meta &m : mra_cache)
+	{
+		if (m.path == path && m.mtime == (int64_t)st.st_mtime && m.size == (int64_t)st.st_size) return &m;
+	}
+
+	mra_meta meta = {};
+	meta.path = path;
+	meta.mtime = st.st_mtime;
+	meta.size = st.st_size;
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = xml_scan_meta;
+	if (!XMLDoc_parse_file_SAX(xml, &sax, &meta))
+	{
+		// use whatever was found, but don't cache a broken file
+		static mra_meta uncached;
+		uncached = std::move(meta);
+		return &uncached;
+	}
+
+	for (size_t i = 0; i < mra_cache.size(); i++)
+	{
+		if (mra_cache[i].path == meta.path)
 		{
-			user_io_name_override(text, samedir);
-			// Capture setname for game ID
-			snprintf(arcade_setname, sizeof(arcade_setname), "%s", text);
+			mra_cache.erase(mra_cache.begin() + i);
+			break;
 		}
-		if(inrotation)
-		{
-			is_vertical = strncasecmp(text, "vertical", 8) == 0;
+	}
 
-			rotation_dir = 0;
-			if (is_vertical)
-			{
-				// Check for CCW first (must check before CW since "ccw" contains "cw")
-				if (strstr(text, "ccw") || strstr(text, "CCW") ||
-				    strstr(text, "counterclockwise") || strstr(text, "counter-clockwise"))
-				{
-					rotation_dir = 2;
-				}
-				// Then check for CW
-				else if (strstr(text, "cw") || strstr(text, "CW") ||
-				         strstr(text, "clockwise"))
-				{
-					rotation_dir = 1;
-				}
-				// Default to CW if no direction specified
-				else
-				{
-					rotation_dir = 1; // Fallback to CW if no direction is declared
-				}
-			}
-		}
-		break;
+	if (mra_cache.size() >= MRA_CACHE_ENTRIES) mra_cache.erase(mra_cache.begin());
+	mra_cache.push_back(std::move(meta));
+	mra_cache_save();
 
-	case XML_EVENT_END_NODE:
-		insetname = false;
-		inrotation = false;
-		if (foundrotation && foundsetname) return false;
-		break;
+	return &mra_cache.back();
+}
 
-	case XML_EVENT_ERROR:
-		printf("XML parse: %s: ERROR %d\n", text, n);
-		break;
-	default:
-		break;
+void arcade_pre_parse(const char *xml)
+{
+	rotation_dir = 0;
+
+	const mra_meta *meta = mra_meta_get(xml);
+	if (!meta) return;
+
+	if (!meta->setname.empty())
+	{
+		user_io_name_override(meta->setname.c_str(), meta->samedir);
+		// Capture setname for game ID
+		snprintf(arcade_setname, sizeof(arcade_setname), "%s", meta->setname.c_str());
 	}
 
-	return true;
+	if (meta->has_rotation)
+	{
+		is_vertical = meta->vertical;
+		rotation_dir = meta->rotation;
+	}
+}
+
+static void prefetch_plan(const char *xml)
+{
+	prefetch_stop();
+
+	const mra_meta *meta = mra_meta_get(xml);
+	if (meta) mra_plan = meta->parts;
+
+	mra_fetched.assign(mra_plan.size(), nullptr);
+	printf("MRA plan: %d parts\n", (int)mra_plan.size());
+	prefetch_fill();
 }
 
 int arcade_send_rom(const char *xml)
 {
+	LOAD_SCOPE("mra", xml);
 	const char *p = strrchr(xml, '/');
 	p = p ? p + 1 : xml;
 	snprintf(switches.name, sizeof(switches.name), "%s", p);
@@ -1154,12 +1711,22 @@ int arcade_send_rom(const char *xml)
 	arc_info.data = buffer_init(kBigTextSize);
 	arc_info.error_msg[0] = 0;
 	arc_info.validrom0 = 0;
+	arc_info.hash = NULL;
+	arc_info.partseq = 0;
 	struct stat64 *st = getPathStat(xml);
 	if (st) arc_info.file_size = (int)st->st_size;
 	ProgressMessage(0, 0, 0, 0);
 
+	// plan, so the parts can be read ahead while the ROMs are assembled
+	prefetch_plan(xml);
+
 	// parse
 	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+	{
+		LOAD_PHASE(LOAD_HASH);
+		hash_stream_close(arc_info.hash, NULL);
+	}
+	prefetch_stop();
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
@@ -1175,6 +1742,7 @@ int arcade_send_rom(const char *xml)
 		user_io_write_gameid(mra_path, 0, arcade_setname);
 	}
 
+	LOAD_PHASE(LOAD_POST);
 	switches.dip_cur = switches.dip_def;
 	arcade_sw_load();
 	switches.dip_saved = switches.dip_cur;
@@ -1182,15 +1750,6 @@ int arcade_send_rom(const char *xml)
 	return 0;
 }
 
-void arcade_pre_parse(const char *xml)
-{
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	sax.all_event = xml_read_pre_parse;
-	XMLDoc_parse_file_SAX(xml, &sax, NULL);
-}
-
 bool arcade_is_vertical()
 {
 	return is_vertical;
@@ -1225,17 +1784,11 @@ static const char *get_rbf(const char *xml, int arcade)
 	static char rbfname[kBigTextSize];
 
 	rbfname[0] = 0;
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	sax.all_event = xml_scan_rbf;
-	XMLDoc_parse_file_SAX(xml, &sax, rbfname);
+	const mra_meta *meta = mra_meta_get(xml);
+	if (meta) snprintf(rbfname, sizeof(rbfname), "%s", meta->rbf.c_str());
 
 	/* once we have the rbfname fragment from the MRA xml file
-	 * search the arcade folder for the match */
-	struct dirent *entry;
-	DIR *dir = 0;
-
+	 * look up the newest match in the arcade folder */
 	const char *dirname;
 	const char *filename;
 	if (arcade)
@@ -1251,53 +1804,30 @@ static const char *get_rbf(const char *xml, int arcade)
 		else filename = rbfname;
 	}
 
-	if (!(dir = opendir(dirname)))
+	std::string found;
+	if (arcade)
 	{
-		printf("%s directory not found\n", dirname);
-		return NULL;
+		char newstring[kBigTextSize];
+		snprintf(newstring, kBigTextSize, "Arcade-%s", filename);
+		const char *file = rbf_index_find(dirname, newstring);
+		if (file) found = file;
 	}
 
-	int len;
-	static char lastfound[256] = {};
-	while ((entry = readdir(dir)) != NULL)
-	{
-		len = strlen(entry->d_name);
-		if (entry->d_type != DT_DIR && len > 4 && !strcasecmp(entry->d_name+len-4,".rbf"))
-		{
-			static char newstring[kBigTextSize];
-			//printf("entry name: %s\n",entry->d_name);
-
-			if (arcade)
-			{
-				snprintf(newstring, kBigTextSize, "Arcade-%s", filename);
-				len = strlen(newstring);
-				if (!strncasecmp(newstring, entry->d_name, len) && (entry->d_name[len] == '.' || entry->d_name[len] == '_'))
-				{
-					if (!lastfound[0] || strcmp(lastfound, entry->d_name) < 0)
-					{
-						strcpy(lastfound, entry->d_name);
-					}
-				}
-			}
+	const char *file = rbf_index_find(dirname, filename);
+	if (file && strcmp(found.c_str(), file) < 0) found = file;
 
-			snprintf(newstring, kBigTextSize, "%s", filename);
-			len = strlen(newstring);
-			if (!strncasecmp(newstring, entry->d_name, len) && (entry->d_name[len] == '.' || entry->d_name[len] == '_'))
-			{
-				if (!lastfound[0] || strcmp(lastfound, entry->d_name) < 0)
-				{
-					strcpy(lastfound, entry->d_name);
-				}
-			}
-		}
+	if (found.empty())
+	{
+		if (!PathIsDir(dirname, 0)) printf("%s directory not found\n", dirname);
+		return NULL;
 	}
 
-	if (lastfound[0]) snprintf(rbfname, sizeof(rbfname), "%s/%s", dirname, lastfound);
-	closedir(dir);
-
-	return lastfound[0] ? rbfname : NULL;
+	snprintf(rbfname, sizeof(rbfname), "%s/%s", dirname, found.c_str());
+	return rbfname;
 }
 
+static void mgl_prefetch_all(const char *xml, const char *rbf);
+
 int xml_load(const char *xml)
 {
 	MenuHide();
@@ -1309,18 +1839,23 @@ int xml_load(const char *xml)
 	int len = strlen(xml);
 	int is_arcade = (len > 4) && !strcasecmp(xml + len - 4, ".mra");
 
+	LOAD_SCOPE(is_arcade ? "mra" : "mgl", path);
+	uint64_t t = trace_now_us();
 	if (is_arcade) set_arcade_root(path);
 	printf("xml_load [%s]\n", path);
 	const char *rbf = get_rbf(path, is_arcade);
+	load_phase_add(LOAD_CONFIG, trace_now_us() - t);
 
 	if (rbf)
 	{
 		printf("XML: %s, RBF: %s\n", path, rbf);
+		if (isXmlName(path) == 2) mgl_prefetch_all(path, rbf);
 		fpga_load_rbf(rbf, NULL, path);
 	}
 	else
 	{
 		Info("No rbf found!");
+		load_failed();
 	}
 
 	return 0;
@@ -1330,7 +1865,7 @@ static mgl_struct mgl = {};
 
 static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
 {
-	(void)sd;
+	mgl_struct *m = (mgl_struct *)sd->user;
 
 	static int inside_mgl = 0;
 	switch (evt)
@@ -1341,75 +1876,75 @@ static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const in
 
 	case XML_EVENT_START_NODE:
 		if (!strcasecmp(node->tag, "mistergamedescription")) inside_mgl = 1;
-		else if (inside_mgl && mgl.count < (int)(sizeof(mgl.item) / sizeof(mgl.item[0])))
+		else if (inside_mgl && m->count < (int)(sizeof(m->item) / sizeof(m->item[0])))
 		{
 			if (!strcasecmp(node->tag, "file"))
 			{
-				mgl.item[mgl.count].action = MGL_ACTION_LOAD;
+				m->item[m->count].action = MGL_ACTION_LOAD;
 
 				for (int i = 0; i < node->n_attributes; i++)
 				{
 					if (!strcasecmp(node->attributes[i].name, "delay"))
 					{
-						mgl.item[mgl.count].delay = strtoul(node->attributes[i].value, NULL, 0);
-						mgl.item[mgl.count].valid |= 0x1;
+						m->item[m->count].delay = strtoul(node->attributes[i].value, NULL, 0);
+						m->item[m->count].valid |= 0x1;
 					}
 					else if (!strcasecmp(node->attributes[i].name, "type"))
 					{
 						if (!strcasecmp(node->attributes[i].value, "s"))
 						{
-							mgl.item[mgl.count].type = 'S';
-							mgl.item[mgl.count].valid |= 0x2;
+							m->item[m->count].type = 'S';
+							m->item[m->count].valid |= 0x2;
 						}
 						else if (!strcasecmp(node->attributes[i].value, "f"))
 						{
-							mgl.item[mgl.count].type = 'F';
-							mgl.item[mgl.count].valid |= 0x2;
+							m->item[m->count].type = 'F';
+							m->item[m->count].valid |= 0x2;
 						}
 					}
 					else if (!strcasecmp(node->attributes[i].name, "index"))
 					{
-						mgl.item[mgl.count].index = strtoul(node->attributes[i].value, NULL, 0);
-						mgl.item[mgl.count].valid |= 0x4;
+						m->item[m->count].index = strtoul(node->attributes[i].value, NULL, 0);
+						m->item[m->count].valid |= 0x4;
 					}
 					else if (!strcasecmp(node->attributes[i].name, "path"))
 					{
-						snprintf(mgl.item[mgl.count].path, sizeof(mgl.item[mgl.count].path), "%s", node->attributes[i].value);
-						mgl.item[mgl.count].valid |= 0x8;
+						snprintf(m->item[m->count].path, sizeof(m->item[m->count].path), "%s", node->attributes[i].value);
+						m->item[m->count].valid |= 0x8;
 					}
 				}
 
-				printf("  action=load\n  delay=%d\n  type=%c\n  index=%d\n  path=%s\n  valid=%X\n\n", mgl.item[mgl.count].delay, mgl.item[mgl.count].type, mgl.item[mgl.count].index, mgl.item[mgl.count].path, mgl.item[mgl.count].valid);
+				printf("  action=load\n  delay=%d\n  type=%c\n  index=%d\n  path=%s\n  valid=%X\n\n", m->item[m->count].delay, m->item[m->count].type, m->item[m->count].index, m->item[m->count].path, m->item[m->count].valid);
 
-				if (mgl.item[mgl.count].valid == 0xF)
+				if (m->item[m->count].valid == 0xF)
 				{
-					mgl.item[mgl.count].valid = 1;
-					mgl.count++;
+					m->item[m->count].valid = 1;
+					m->count++;
 				}
 				else
 				{
-					mgl.item[mgl.count].valid = 0;
+					m->item[m->count].valid = 0;
 				}
 			}
 			else if (!strcasecmp(node->tag, "reset"))
 			{
-				mgl.item[mgl.count].action = MGL_ACTION_RESET;
+				m->item[m->count].action = MGL_ACTION_RESET;
 
 				for (int i = 0; i < node->n_attributes; i++)
 				{
 					if (!strcasecmp(node->attributes[i].name, "delay"))
 					{
-						mgl.item[mgl.count].delay = strtoul(node->attributes[i].value, NULL, 0);
-						mgl.item[mgl.count].valid = 1;
+						m->item[m->count].delay = strtoul(node->attributes[i].value, NULL, 0);
+						m->item[m->count].valid = 1;
 					}
 					else if (!strcasecmp(node->attributes[i].name, "hold"))
 					{
-						mgl.item[mgl.count].hold = strtoul(node->attributes[i].value, NULL, 0);
+						m->item[m->count].hold = strtoul(node->attributes[i].value, NULL, 0);
 					}
 				}
 
-				printf("  action=reset\n  delay=%d\n  hold=%d\n\n", mgl.item[mgl.count].delay, mgl.item[mgl.count].hold);
-				if (mgl.item[mgl.count].valid) mgl.count++;
+				printf("  action=reset\n  delay=%d\n  hold=%d\n\n", m->item[m->count].delay, m->item[m->count].hold);
+				if (m->item[m->count].valid) m->count++;
 			}
 		}
 		break;
@@ -1431,17 +1966,100 @@ static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const in
 	return true;
 }
 
-mgl_struct* mgl_parse(const char *xml)
+static void mgl_read(mgl_struct *m, const char *xml)
 {
-	memset(&mgl, 0, sizeof(mgl));
+	memset(m, 0, sizeof(*m));
 
 	printf("MGL %s\n", xml);
 
 	SAX_Callbacks sax;
 	SAX_Callbacks_init(&sax);
 	sax.all_event = scan_mgl;
-	XMLDoc_parse_file_SAX(xml, &sax, 0);
+	XMLDoc_parse_file_SAX(xml, &sax, m);
+}
+
+/*
+ * The files of an MGL are read ahead into the page cache on the offload
+ * workers, first while the FPGA is programmed (the cache survives the
+ * restart) and again once the core is up, so the menu finds them cached
+ * when the delays run out. Only the head of big images is read ahead.
+ */
+#define MGL_PREFETCH_MAX (16 * 1024 * 1024)
+
+static void mgl_prefetch(const char *path)
+{
+	std::string full = getFullPath(path);
+	offload_add_work([full]()
+	{
+		int fd = open(full.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return;
+		posix_fadvise(fd, 0, MGL_PREFETCH_MAX, POSIX_FADV_WILLNEED);
+		close(fd);
+	});
+}
+
+// With drop, file items that don't exist are left out (their delay goes to
+// the next item so the timing of the others is kept) instead of leaving the
+// menu waiting on a file selection that can't happen.
+static void mgl_prepare(mgl_struct *m, const char *home, int drop)
+{
+	int n = 0;
+	int delay = 0;
+	for (int i = 0; i < m->count; i++)
+	{
+		mgl_item_struct *item = &m->item[i];
+		if (item->action == MGL_ACTION_LOAD)
+		{
+			char path[1024];
+			if (item->path[0] == '/') snprintf(path, sizeof(path), "%s", item->path);
+			else snprintf(path, sizeof(path), "%s/%s", home, item->path);
 
+			if (drop && !FileExists(path))
+			{
+				printf("MGL: %s not found, skipped\n", path);
+				delay += item->delay;
+				continue;
+			}
+
+			mgl_prefetch(path);
+		}
+
+		if (n != i) m->item[n] = *item;
+		m->item[n++].delay += delay;
+		delay = 0;
+	}
+
+	m->count = n;
+}
+
+// The core isn't running yet, its home folder is guessed from the setname or the RBF name
+static void mgl_prefetch_all(const char *xml, const char *rbf)
+{
+	static mgl_struct pre;
+	mgl_read(&pre, xml);
+	if (!pre.count) return;
+
+	char home[1024];
+	const mra_meta *meta = mra_meta_get(xml);
+	if (meta && !meta->setname.empty() && !meta->samedir) snprintf(home, sizeof(home), "%s", meta->setname.c_str());
+	else
+	{
+		const char *name = strrchr(rbf, '/');
+		snprintf(home, sizeof(home), "%s", name ? name + 1 : rbf);
+		char *p = strrchr(home, '_');
+		if (!p) p = strrchr(home, '.');
+		if (p) *p = 0;
+		if (!strcasecmp(home, "minimig")) strcpy(home, "Amiga");
+	}
+
+	prefixGameDir(home, sizeof(home));
+	mgl_prepare(&pre, home, 0);
+}
+
+mgl_struct* mgl_parse(const char *xml)
+{
+	mgl_read(&mgl, xml);
+	mgl_prepare(&mgl, HomeDir(), 1);
 	return &mgl;
 }
 
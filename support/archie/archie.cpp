@@ -52,11 +52,15 @@ enum state {
 #define LEDS    0x00         // mask 0xf8
 #define PRST    0x21         // nop
 
-#define QUEUE_LEN 8
+// Bytes wait here for the ack of the one before, a key or mouse report is a pair
+#define QUEUE_LEN 64
 static unsigned char tx_queue[QUEUE_LEN][2];
 static unsigned char tx_queue_rptr, tx_queue_wptr;
 #define QUEUE_NEXT(a)  ((a+1)&(QUEUE_LEN-1))
 
+#define KBD_RX_BATCH 4   // bytes from the ARM taken per poll
+#define IDE_BATCH    16  // HDD requests served per poll
+
 static unsigned long ack_timeout;
 static short mouse_x, mouse_y;
 
@@ -188,13 +192,35 @@ static void archie_kbd_tx(unsigned char state, unsigned char byte)
 	ack_timeout = GetTimer(10);  // 10ms timeout
 }
 
+// sends the next queued byte unless the last one isn't acked yet
+static void archie_kbd_flush(void)
+{
+	if ((kbd_state == STATE_WAIT4ACK1) || (kbd_state == STATE_WAIT4ACK2) || (kbd_state == STATE_HOLD_OFF))
+		return;
+
+	if (tx_queue_rptr == tx_queue_wptr)
+		return;
+
+	archie_kbd_tx(tx_queue[tx_queue_rptr][0], tx_queue[tx_queue_rptr][1]);
+	tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
+}
+
+// always through the queue so a byte can't overtake older ones still waiting there
 static void archie_kbd_send(unsigned char state, unsigned char byte)
 {
-	// don't send if we are waiting for an ack
-	if ((kbd_state != STATE_WAIT4ACK1) && (kbd_state != STATE_WAIT4ACK2))
-		archie_kbd_tx(state, byte);
-	else
-		archie_kbd_enqueue(state, byte);
+	archie_kbd_enqueue(state, byte);
+	archie_kbd_flush();
+}
+
+// Movement is summed up while the link is busy and sent as one report once it's free
+static void archie_mouse_flush(void)
+{
+	if (kbd_state != STATE_IDLE || tx_queue_rptr != tx_queue_wptr) return;
+	if (!(flags & FLAG_MOUSE_ENABLED) || !(mouse_x || mouse_y)) return;
+
+	archie_kbd_send(STATE_WAIT4ACK1, mouse_x & 0x7f);
+	archie_kbd_send(STATE_WAIT4ACK2, mouse_y & 0x7f);
+	mouse_x = mouse_y = 0;
 }
 
 static void archie_kbd_reset(void)
@@ -402,16 +428,8 @@ void archie_mouse(unsigned char b, int16_t x, int16_t y)
 		return;
 	}
 
-	// ignore any mouse movement if mouse is disabled or if nothing to report
-	if ((flags & FLAG_MOUSE_ENABLED) && (mouse_x || mouse_y))
-	{
-		// send asap if no pending byte
-		if (kbd_state == STATE_IDLE) {
-			archie_kbd_send(STATE_WAIT4ACK1, mouse_x & 0x7f);
-			archie_kbd_send(STATE_WAIT4ACK2, mouse_y & 0x7f);
-			mouse_x = mouse_y = 0;
-		}
-	}
+	// send asap if no pending byte, otherwise from archie_poll()
+	archie_mouse_flush();
 
 	// ignore mouse buttons if key scanning is disabled
 	if (flags & FLAG_SCAN_ENABLED)
@@ -435,15 +453,6 @@ void archie_mouse(unsigned char b, int16_t x, int16_t y)
 	}
 }
 
-static void archie_check_queue(void)
-{
-	if (tx_queue_rptr == tx_queue_wptr)
-		return;
-
-	archie_kbd_tx(tx_queue[tx_queue_rptr][0], tx_queue[tx_queue_rptr][1]);
-	tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
-}
-
 static void check_reset()
 {
 	static uint32_t timer = 0;
@@ -467,15 +476,126 @@ static void check_reset()
 	}
 }
 
+// Serves the HDD requests following each other in one go instead of one per
+// main loop pass. A channel waiting for its image read is left to the next poll.
+static void archie_hdd_poll(void)
+{
+	uint16_t sd_req = ide_check();
+	ide_io(0, sd_req & 7);
+	if (sd_req & 0x0100) ide_cdda_send_sector();
+
+	for (int i = 1; i < IDE_BATCH && (sd_req & 7) && !ide_async_pending(); i++)
+	{
+		sd_req = ide_check();
+		if (!sd_req) break;
+
+		ide_io(0, sd_req & 7);
+		if (sd_req & 0x0100) ide_cdda_send_sector();
+	}
+}
+
+static void archie_kbd_rx(unsigned char data)
+{
+	//archie_debugf("KBD RX %x", data);
+
+	switch (data) {
+		// arm requests reset
+	case HRST:
+		archie_kbd_reset();
+		archie_kbd_send(STATE_RAK1, HRST);
+		ack_timeout = GetTimer(20);  // 20ms timeout
+		break;
+
+		// arm sends reset ack 1
+	case RAK1:
+		if (kbd_state == STATE_RAK1) {
+			archie_kbd_send(STATE_RAK2, RAK1);
+			ack_timeout = GetTimer(20);  // 20ms timeout
+		}
+		else
+			kbd_state = STATE_HRST;
+		break;
+
+		// arm sends reset ack 2
+	case RAK2:
+		if (kbd_state == STATE_RAK2) {
+			archie_kbd_send(STATE_IDLE, RAK2);
+			ack_timeout = GetTimer(20);  // 20ms timeout
+		}
+		else
+			kbd_state = STATE_HRST;
+		break;
+
+		// arm request keyboard id
+	case RQID:
+		archie_kbd_send(STATE_IDLE, KBID | 1);
+		break;
+
+		// arm acks first byte
+	case BACK:
+		if (kbd_state != STATE_WAIT4ACK1) {
+			archie_debugf("KBD unexpected BACK, resetting KBD");
+			kbd_state = STATE_HRST;
+		}
+		else {
+#ifdef HOLD_OFF_TIME
+			// wait some time before sending next byte
+			archie_debugf("KBD starting hold off");
+			kbd_state = STATE_HOLD_OFF;
+			hold_off_timer = GetTimer(10);
+#else
+			kbd_state = STATE_IDLE;
+			archie_kbd_flush();
+#endif
+		}
+		break;
+
+		// arm acks second byte
+	case NACK:
+	case SACK:
+	case MACK:
+	case SMAK:
+
+		if (((data == SACK) || (data == SMAK)) && !(flags & FLAG_SCAN_ENABLED)) {
+			archie_debugf("KBD Enabling key scanning");
+			flags |= FLAG_SCAN_ENABLED;
+		}
+
+		if (((data == NACK) || (data == MACK)) && (flags & FLAG_SCAN_ENABLED)) {
+			archie_debugf("KBD Disabling key scanning");
+			flags &= ~FLAG_SCAN_ENABLED;
+		}
+
+		if (((data == MACK) || (data == SMAK)) && !(flags & FLAG_MOUSE_ENABLED)) {
+			archie_debugf("KBD Enabling mouse");
+			flags |= FLAG_MOUSE_ENABLED;
+		}
+
+		if (((data == NACK) || (data == SACK)) && (flags & FLAG_MOUSE_ENABLED)) {
+			archie_debugf("KBD Disabling mouse");
+			flags &= ~FLAG_MOUSE_ENABLED;
+		}
+
+		// wait another 10ms before sending next byte
+#ifdef HOLD_OFF_TIME
+		archie_debugf("KBD starting hold off");
+		kbd_state = STATE_HOLD_OFF;
+		hold_off_timer = GetTimer(10);
+#else
+		kbd_state = STATE_IDLE;
+		archie_kbd_flush();
+#endif
+		break;
+	}
+}
+
 void archie_poll(void)
 {
 	EnableFpga();
 	uint16_t status = spi_w(0);
 	DisableFpga();
 
-	uint16_t sd_req = ide_check();
-	ide_io(0, sd_req & 7);
-	if (sd_req & 0x0100) ide_cdda_send_sector();
+	archie_hdd_poll();
 
 	check_cmos(status);
 	check_reset();
@@ -484,7 +604,7 @@ void archie_poll(void)
 	if ((kbd_state == STATE_HOLD_OFF) && CheckTimer(hold_off_timer)) {
 		archie_debugf("KBD resume after hold off");
 		kbd_state = STATE_IDLE;
-		archie_check_queue();
+		archie_kbd_flush();
 	}
 #endif
 
@@ -497,6 +617,7 @@ void archie_poll(void)
 				archie_debugf(">>>> KBD ACK TIMEOUT 2ND BYTE <<<<");
 
 			kbd_state = STATE_IDLE;
+			archie_kbd_flush();
 		}
 	}
 
@@ -507,117 +628,28 @@ void archie_poll(void)
 		{
 			//archie_debugf("KBD timeout in reset state");
 
+			tx_queue_rptr = tx_queue_wptr; // nothing queued before the reset is valid after it
 			archie_kbd_send(STATE_RAK1, HRST);
 			ack_timeout = GetTimer(20);  // 20ms timeout
 		}
 	}
 
-	spi_uio_cmd_cont(0x04);
-	if (spi_in() == 0xa1)
+	// take what the ARM has sent, each ack lets the next queued byte go out right away
+	for (int i = 0; i < KBD_RX_BATCH; i++)
 	{
-		unsigned char data = spi_in();
-		DisableIO();
-
-		//archie_debugf("KBD RX %x", data);
-
-		switch (data) {
-			// arm requests reset
-		case HRST:
-			archie_kbd_reset();
-			archie_kbd_send(STATE_RAK1, HRST);
-			ack_timeout = GetTimer(20);  // 20ms timeout
-			break;
-
-			// arm sends reset ack 1
-		case RAK1:
-			if (kbd_state == STATE_RAK1) {
-				archie_kbd_send(STATE_RAK2, RAK1);
-				ack_timeout = GetTimer(20);  // 20ms timeout
-			}
-			else
-				kbd_state = STATE_HRST;
-			break;
-
-			// arm sends reset ack 2
-		case RAK2:
-			if (kbd_state == STATE_RAK2) {
-				archie_kbd_send(STATE_IDLE, RAK2);
-				ack_timeout = GetTimer(20);  // 20ms timeout
-			}
-			else
-				kbd_state = STATE_HRST;
-			break;
-
-			// arm request keyboard id
-		case RQID:
-			archie_kbd_send(STATE_IDLE, KBID | 1);
-			break;
-
-			// arm acks first byte
-		case BACK:
-			if (kbd_state != STATE_WAIT4ACK1) {
-				archie_debugf("KBD unexpected BACK, resetting KBD");
-				kbd_state = STATE_HRST;
-			}
-			else {
-#ifdef HOLD_OFF_TIME
-				// wait some time before sending next byte
-				archie_debugf("KBD starting hold off");
-				kbd_state = STATE_HOLD_OFF;
-				hold_off_timer = GetTimer(10);
-				// wait some time before sending next byte
-				archie_debugf("KBD starting hold off");
-				kbd_state = STATE_HOLD_OFF;
-				hold_off_timer = GetTimer(10);
-#else
-				kbd_state = STATE_IDLE;
-				archie_check_queue();
-				kbd_state = STATE_IDLE;
-				archie_check_queue();
-#endif
-			}
-			break;
-
-			// arm acks second byte
-		case NACK:
-		case SACK:
-		case MACK:
-		case SMAK:
-
-			if (((data == SACK) || (data == SMAK)) && !(flags & FLAG_SCAN_ENABLED)) {
-				archie_debugf("KBD Enabling key scanning");
-				flags |= FLAG_SCAN_ENABLED;
-			}
-
-			if (((data == NACK) || (data == MACK)) && (flags & FLAG_SCAN_ENABLED)) {
-				archie_debugf("KBD Disabling key scanning");
-				flags &= ~FLAG_SCAN_ENABLED;
-			}
-
-			if (((data == MACK) || (data == SMAK)) && !(flags & FLAG_MOUSE_ENABLED)) {
-				archie_debugf("KBD Enabling mouse");
-				flags |= FLAG_MOUSE_ENABLED;
-			}
-
-			if (((data == NACK) || (data == SACK)) && (flags & FLAG_MOUSE_ENABLED)) {
-				archie_debugf("KBD Disabling mouse");
-				flags &= ~FLAG_MOUSE_ENABLED;
-			}
-
-			// wait another 10ms before sending next byte
-#ifdef HOLD_OFF_TIME
-			archie_debugf("KBD starting hold off");
-			kbd_state = STATE_HOLD_OFF;
-			hold_off_timer = GetTimer(10);
-#else
-			kbd_state = STATE_IDLE;
-			archie_check_queue();
-#endif
+		spi_uio_cmd_cont(0x04);
+		if (spi_in() != 0xa1)
+		{
+			DisableIO();
 			break;
 		}
-	}
-	else
+
+		unsigned char data = spi_in();
 		DisableIO();
+		archie_kbd_rx(data);
+	}
+
+	archie_mouse_flush();
 }
 
 const char *archie_get_hdd_name(int i)
@@ -11,6 +11,8 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../input.h"
+#include "../../crc.h"
+#include "../../fw_cache.h"
 
 #include "c64.h"
 
@@ -286,6 +288,8 @@ static int c64_convert_t64_to_d64(fileTYPE* f_in, fileTYPE* f_out)
 	return 1;
 }
 
+#define T64_CACHE_MAX (1024 * 1024)
+
 int c64_openT64(const char *path, fileTYPE* f)
 {
 	if (!FileOpenEx(f, "vdsk", -1))
@@ -301,7 +305,41 @@ int c64_openT64(const char *path, fileTYPE* f)
 		return 0;
 	}
 
-	int ret = c64_convert_t64_to_d64(&f_in, f);
+	// the converted image is cached by the contents of the T64
+	uint32_t src_size = f_in.size;
+	uint8_t *src = (src_size && src_size <= T64_CACHE_MAX) ? new uint8_t[src_size] : NULL;
+	if (src && FileReadAdv(&f_in, src, src_size) != (int)src_size)
+	{
+		delete[] src;
+		src = NULL;
+	}
+
+	uint32_t size;
+	uint8_t *d64 = src ? fw_cache_derived_get("t64-d64", src, src_size, &size, D64_SECTOR_PER_DISK * D64_BYTE_PER_SECTOR) : NULL;
+	int ret;
+	if (d64)
+	{
+		ret = FileWriteAdv(f, d64, size) == (int)size;
+		f->size = FileGetSize(f);
+		free(d64);
+		printf("Virtual D64 from cache, size = %llu\n", f->size);
+	}
+	else
+	{
+		ret = c64_convert_t64_to_d64(&f_in, f);
+		if (ret && src)
+		{
+			size = f->size;
+			d64 = (uint8_t*)malloc(size);
+			if (d64 && FileSeek(f, 0, SEEK_SET) && FileReadAdv(f, d64, size) == (int)size)
+			{
+				fw_cache_derived_put("t64-d64", src, src_size, d64, size);
+			}
+			free(d64);
+		}
+	}
+
+	delete[] src;
 	FileClose(&f_in);
 
 	if (!ret)
@@ -453,44 +491,51 @@ static const uint8_t bin_lut[32] = {
 	0, 9, 10, 11, 0, 13, 14, 0
 };
 
-static uint8_t *gcrptr;
-static int gcrcnt = 0;
+// A byte is 10 GCR bits, so 4 bytes are 5 GCR bytes. Whole blocks go through
+// the byte wide tables below, built from the nibble tables on first use.
+static uint16_t gcr_enc[256];
+static uint8_t gcr_dec[1024];
 
-void bin2gcr(uint8_t bin)
+static void gcr_init()
 {
-	static uint64_t gcr = 0;
+	static bool done = false;
+	if (done) return;
 
-	gcr <<= 5;
-	gcr |= gcr_lut[(bin >> 4) & 0xF];
-	gcr <<= 5;
-	gcr |= gcr_lut[bin & 0xF];
+	for (int i = 0; i < 256; i++) gcr_enc[i] = (gcr_lut[i >> 4] << 5) | gcr_lut[i & 0xF];
+	for (int i = 0; i < 1024; i++) gcr_dec[i] = (bin_lut[i >> 5] << 4) | bin_lut[i & 0x1F];
+	done = true;
+}
+
+// len is a multiple of 4, returns the end of the GCR data
+static uint8_t *gcr_encode(const uint8_t *bin, int len, uint8_t *gcr)
+{
+	gcr_init();
 
-	gcrcnt++;
-	if (gcrcnt == 4)
+	for (; len > 0; len -= 4, bin += 4)
 	{
-		gcrcnt = 0;
-		*gcrptr++ = (uint8_t)(gcr >> 32);
-		*gcrptr++ = (uint8_t)(gcr >> 24);
-		*gcrptr++ = (uint8_t)(gcr >> 16);
-		*gcrptr++ = (uint8_t)(gcr >> 8);
-		*gcrptr++ = (uint8_t)(gcr);
+		uint64_t v = ((uint64_t)gcr_enc[bin[0]] << 30) | ((uint64_t)gcr_enc[bin[1]] << 20) | (gcr_enc[bin[2]] << 10) | gcr_enc[bin[3]];
+		*gcr++ = (uint8_t)(v >> 32);
+		*gcr++ = (uint8_t)(v >> 24);
+		*gcr++ = (uint8_t)(v >> 16);
+		*gcr++ = (uint8_t)(v >> 8);
+		*gcr++ = (uint8_t)v;
 	}
+
+	return gcr;
 }
 
-void gcr2bin(uint8_t *gcr, uint8_t *bin)
+// blocks of 5 GCR bytes into 4 bytes each
+static void gcr_decode(const uint8_t *gcr, uint8_t *bin, int blocks)
 {
-	// from VICE
-	register uint32_t tmp = *gcr;
-	tmp <<= 13;
+	gcr_init();
 
-	for (int i = 5; i < 13; i += 2, bin++)
+	for (; blocks > 0; blocks--, gcr += 5)
 	{
-		gcr++;
-		tmp |= ((uint32_t)(*gcr)) << i;
-		*bin = bin_lut[(tmp >> 16) & 0x1f] << 4;
-		tmp <<= 5;
-		*bin |= bin_lut[(tmp >> 16) & 0x1f];
-		tmp <<= 5;
+		uint64_t v = ((uint64_t)gcr[0] << 32) | ((uint32_t)gcr[1] << 24) | (gcr[2] << 16) | (gcr[3] << 8) | gcr[4];
+		*bin++ = gcr_dec[(v >> 30) & 0x3FF];
+		*bin++ = gcr_dec[(v >> 20) & 0x3FF];
+		*bin++ = gcr_dec[(v >> 10) & 0x3FF];
+		*bin++ = gcr_dec[v & 0x3FF];
 	}
 }
 
@@ -537,39 +582,31 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 			FileReadAdv(gcr_info[idx].f, trk_buf, size);
 
 			uint8_t sec = 0;
-			gcrptr = gcr_buf + 2;
+			uint8_t *gcrptr = gcr_buf + 2;
 			for (int ptr = 0; ptr < size; ptr += 256)
 			{
-				gcrcnt = 0;
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x08);
-				bin2gcr(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]);
-				bin2gcr(sec);
-				bin2gcr(track_h);
-				bin2gcr(gcr_info[idx].id[1]);
-				bin2gcr(gcr_info[idx].id[0]);
-				bin2gcr(0x0F);
-				bin2gcr(0x0F);
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
+				uint8_t hdr[8] = { 0x08, (uint8_t)(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]), sec, track_h,
+					gcr_info[idx].id[1], gcr_info[idx].id[0], 0x0F, 0x0F };
 
+				memset(gcrptr, 0xFF, 5); gcrptr += 5;
+				gcrptr = gcr_encode(hdr, sizeof(hdr), gcrptr);
+				memset(gcrptr, 0x55, 9); gcrptr += 9;
+
+				// data block: mark, 256 bytes, checksum and 2 off bytes
+				static uint8_t blk[260];
 				uint8_t cs = 0;
-				uint8_t bt;
+				blk[0] = 0x07;
+				memcpy(blk + 1, trk_buf + ptr, 256);
+				for (int i = 0; i < 256; i++) cs ^= blk[i + 1];
+				blk[257] = cs;
+				blk[258] = 0;
+				blk[259] = 0;
 
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x07);
-				for (int i = 0; i < 256; i++)
-				{
-					bt = trk_buf[ptr + i];
-					cs ^= bt;
-					bin2gcr(bt);
-				}
-				bin2gcr(cs);
-				bin2gcr(0);
-				bin2gcr(0);
+				memset(gcrptr, 0xFF, 5); gcrptr += 5;
+				gcrptr = gcr_encode(blk, sizeof(blk), gcrptr);
 
 				int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
-				while (gap--) *gcrptr++ = 0x55;
+				memset(gcrptr, 0x55, gap); gcrptr += gap;
 				sec++;
 			}
 
@@ -807,7 +844,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 			uint8_t *hdr = align(gcr_buf + ptr + off, 11);
 
 			uint32_t bin;
-			gcr2bin(hdr, (uint8_t*)&bin);
+			gcr_decode(hdr, (uint8_t*)&bin, 1);
 			if (!started && (bin & 0xFF) == 8)
 			{
 				off = ptr - 2;
@@ -821,7 +858,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 			if ((bin & 0xFF) == 8)
 			{
 				sec = (uint8_t)(bin >> 16);
-				gcr2bin(hdr + 5, (uint8_t*)&bin);
+				gcr_decode(hdr + 5, (uint8_t*)&bin, 1);
 				gcr_info[idx].id[1] = (uint8_t)(bin);
 				gcr_info[idx].id[0] = (uint8_t)(bin >> 8);
 
@@ -834,12 +871,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 					dbgprintf("data...\n\n");
 					uint8_t *data = align(gcr_buf + ptr + off, 330);
 
-					int dst = 0;
-					int src = 0;
-					for (; dst < 260; src += 5, dst += 4)
-					{
-						gcr2bin(data + src, sec_buf + dst);
-					}
+					gcr_decode(data, sec_buf, 260 / 4);
 
 					memcpy(trk_buf + (sec * 256), sec_buf + 1, 256);
 					/*
@@ -884,6 +916,27 @@ static const uint8_t ezfl_shdr[16] = { 0x43, 0x48, 0x49, 0x50, 0x00, 0x00, 0x20,
 static char ezfl_hdr[64];
 static char ezfl_buf[crt_bank_size];
 
+// What the save file holds, to rewrite only the banks that changed: CRC of
+// each 8K bank and the file offset of its CHIP packet (-1 if not there).
+// ezfl_inplace is cleared when the file doesn't follow the tracked layout.
+static const int ezfl_banks = 128;
+static uint32_t ezfl_crc[ezfl_banks];
+static int ezfl_pos[ezfl_banks];
+static int ezfl_inplace = 0;
+
+static uint32_t ezfl_bank_crc(const uint8_t *buf, int bank)
+{
+	return crc32_update(0, buf + 64 + (bank * crt_bank_size) + 16, crt_bank_size - 16);
+}
+
+static int ezfl_bank_empty(const uint8_t *buf, int bank)
+{
+	const uint8_t *p = buf + 64 + (bank * crt_bank_size);
+	uint8_t chk = 0xFF;
+	for (int i = 16; i < crt_bank_size; i++) chk &= p[i];
+	return chk == 0xFF;
+}
+
 static void ezfl_format(uint8_t *buf)
 {
 	memset(buf, -1, ezfl_size);
@@ -901,10 +954,14 @@ static void ezfl_format(uint8_t *buf)
 	}
 }
 
-static uint8_t* ezfl_load(const char* name)
+// save: name is the save file, its layout is tracked then.
+static uint8_t* ezfl_load(const char* name, int save)
 {
 	printf("Loading %s.\n", name);
 
+	for (int i = 0; i < ezfl_banks; i++) ezfl_pos[i] = -1;
+	ezfl_inplace = save;
+
 	uint8_t *buf = new uint8_t[ezfl_size];
 	if (buf)
 	{
@@ -914,17 +971,32 @@ static uint8_t* ezfl_load(const char* name)
 			if (FileReadAdv(&f, ezfl_hdr, 64))
 			{
 				ezfl_format(buf);
+				int pos = 64;
 				int sz;
 				while ((sz = FileReadAdv(&f, ezfl_buf, crt_bank_size)))
 				{
+					int full = (sz == crt_bank_size) && !memcmp(ezfl_buf, ezfl_shdr, 4) && ezfl_buf[14] == 0x20 && !ezfl_buf[15];
 					while (sz < crt_bank_size) ezfl_buf[sz++] = 0xFF;
 
 					uint8_t bank = ezfl_buf[11];
 					uint8_t addr = ezfl_buf[12];
-					int off = 64 + (((bank * 2) + ((addr <= 0x80) ? 0 : 1)) * crt_bank_size);
-					if ((off+ crt_bank_size) <= ezfl_size) memcpy(buf + off, ezfl_buf, crt_bank_size);
-					else printf("WARNING: invalid Easyflash bank header (%d, 0x%02X), skipping.\n", bank, addr);
+					int idx = ((bank * 2) + ((addr <= 0x80) ? 0 : 1));
+					int off = 64 + (idx * crt_bank_size);
+					if ((off+ crt_bank_size) <= ezfl_size)
+					{
+						memcpy(buf + off, ezfl_buf, crt_bank_size);
+						if (!full || ezfl_pos[idx] >= 0) ezfl_inplace = 0;
+						ezfl_pos[idx] = pos;
+					}
+					else
+					{
+						printf("WARNING: invalid Easyflash bank header (%d, 0x%02X), skipping.\n", bank, addr);
+						ezfl_inplace = 0;
+					}
+					pos += crt_bank_size;
 				}
+
+				for (int i = 0; i < ezfl_banks; i++) ezfl_crc[i] = ezfl_bank_crc(buf, i);
 			}
 
 			int len = strlen(f.name);
@@ -939,6 +1011,7 @@ static uint8_t* ezfl_load(const char* name)
 		delete[] buf;
 	}
 
+	ezfl_inplace = 0;
 	printf("ERROR: cannot load %s.\n", name);
 	return 0;
 }
@@ -952,21 +1025,62 @@ static void ezfl_save(const char* name, uint8_t *buf)
 	{
 		FileWriteAdv(&f, buf, 64);
 
-		int off = 64;
-		while (off < ezfl_size)
+		int pos = 64;
+		for (int i = 0; i < ezfl_banks; i++)
 		{
-			uint8_t chk = 0xFF;
-			for (int i = 16; i < crt_bank_size; i++) chk &= buf[off + i];
-			if (chk != 0xFF) FileWriteAdv(&f, buf + off, crt_bank_size);
-			off += crt_bank_size;
+			ezfl_pos[i] = -1;
+			if (!ezfl_bank_empty(buf, i))
+			{
+				FileWriteAdv(&f, buf + 64 + (i * crt_bank_size), crt_bank_size);
+				ezfl_pos[i] = pos;
+				pos += crt_bank_size;
+			}
 		}
 
 		FileClose(&f);
+		ezfl_inplace = 1;
 	}
 	else
 	{
 		printf("ERROR: cannot creat file %s.\n", name);
+		ezfl_inplace = 0;
+	}
+}
+
+// Rewrites the data of the changed banks in place, appends the CHIP packets
+// of banks the file doesn't have yet.
+static int ezfl_update(const char* name, uint8_t *buf, const uint32_t *crc)
+{
+	fileTYPE f = {};
+	if (!FileOpenEx(&f, name, O_RDWR | O_SYNC | O_CLOEXEC)) return 0;
+
+	int cnt = 0;
+	for (int i = 0; i < ezfl_banks; i++)
+	{
+		if (crc[i] == ezfl_crc[i]) continue;
+
+		const uint8_t *p = buf + 64 + (i * crt_bank_size);
+		if (ezfl_pos[i] >= 0)
+		{
+			if (!FileSeek(&f, ezfl_pos[i] + 16, SEEK_SET) || FileWriteAdv(&f, (void*)(p + 16), crt_bank_size - 16) != crt_bank_size - 16) break;
+		}
+		else if (!ezfl_bank_empty(buf, i))
+		{
+			int pos = f.size;
+			if (!FileSeek(&f, pos, SEEK_SET) || FileWriteAdv(&f, (void*)p, crt_bank_size) != crt_bank_size) break;
+			ezfl_pos[i] = pos;
+		}
+
+		ezfl_crc[i] = crc[i];
+		cnt++;
 	}
+
+	int ok = 1;
+	for (int i = 0; i < ezfl_banks; i++) if (crc[i] != ezfl_crc[i]) ok = 0;
+
+	FileClose(&f);
+	printf("Easyflash: %d bank(s) updated in %s\n", cnt, name);
+	return ok;
 }
 
 void c64_open_file(const char* name, unsigned char index)
@@ -991,7 +1105,8 @@ void c64_open_file(const char* name, unsigned char index)
 				int mod = get_key_mod();
 				printf("mod = %x\n", mod);
 
-				uint8_t *ezfl = ezfl_load((!(get_key_mod() & 0x2200) && FileExists((char*)buf)) ? (char*)buf : name);
+				int save = !(get_key_mod() & 0x2200) && FileExists((char*)buf);
+				uint8_t *ezfl = ezfl_load(save ? (char*)buf : name, save);
 				if (ezfl)
 				{
 					user_io_set_index(index);
@@ -1044,7 +1159,14 @@ void c64_save_cart(int open_menu)
 			}
 			user_io_set_upload(0);
 
-			ezfl_save(ezfl_save_name, ezfl);
+			uint32_t crc[ezfl_banks];
+			for (int i = 0; i < ezfl_banks; i++) crc[i] = ezfl_bank_crc(ezfl, i);
+
+			if (!ezfl_inplace || !ezfl_update(ezfl_save_name, ezfl, crc))
+			{
+				ezfl_save(ezfl_save_name, ezfl);
+				memcpy(ezfl_crc, crc, sizeof(ezfl_crc));
+			}
 			ProgressMessage(0, 0, 0, 0);
 			delete[] ezfl;
 		}
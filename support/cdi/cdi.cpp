@@ -42,22 +42,17 @@ struct subcode
 };
 static_assert(sizeof(struct subcode) == 24);
 
-struct toc_entry
-{
-	uint8_t control;
-	uint8_t track;
-	uint8_t m;
-	uint8_t s;
-	uint8_t f;
-};
-
 #define CD_SECTOR_LEN 2352
 #define CDIC_BUFFER_SIZE (CD_SECTOR_LEN + sizeof(subcode))
-static std::array<struct toc_entry, 200> toc_buffer;
+
+// Subcode as sent, built at mount: the lead-in TOC entries and one per
+// track (index 0 past the last one). Only the running times and the CRC
+// are filled in per sector.
+static std::array<struct subcode, 200> toc_buffer;
 uint32_t toc_entry_count = 0;
+static std::array<struct subcode, 100> track_subcode;
+static uint16_t bcd_be[100];
 
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 
 static int sgets(char *out, int sz, char **in)
 {
@@ -96,12 +91,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf)
-		free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 }
 
 static void unload_cue(toc_t *table)
@@ -135,9 +127,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end += 150;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -149,6 +138,7 @@ static int load_cue(const char *filename, toc_t *table)
 	static char toc[100 * 1024];
 
 	unload_cue(table);
+	if (cd_cue_cache_load(filename, "cdi", table)) return 1;
 	printf("\x1b[32mCDI: Open CUE: %s\n\x1b[0m", fname);
 
 	strcpy(fname, filename);
@@ -288,6 +278,7 @@ static int load_cue(const char *filename, toc_t *table)
 		printf("\x1b[32mCUE: Track = %u, start = %u, end = %u, offset = %d, sector_size=%d, type = %u, pregap = %u\n\x1b[0m", i, table->tracks[i].start, table->tracks[i].end, table->tracks[i].offset, table->tracks[i].sector_size, table->tracks[i].type, table->tracks[i].pregap);
 	}
 
+	cd_cue_cache_save(filename, "cdi", table);
 	return 1;
 }
 
@@ -327,23 +318,25 @@ static int load_cd_image(const char *filename, toc_t *table)
 
 static void prepare_toc_buffer(toc_t *toc)
 {
-	struct toc_entry *toc_ptr = toc_buffer.data();
+	for (int i = 0; i < 100; i++)
+		bcd_be[i] = htons(BCD(i));
+
 	toc_entry_count = 0;
 
 	auto add_entry = [&](uint8_t control, uint8_t track, uint8_t m, uint8_t s, uint8_t f)
 	{
-		for (int i = 0; i < 3; i++)
+		for (int i = 0; i < 3 && toc_entry_count < toc_buffer.size(); i++)
 		{
-			toc_ptr->control = control;
-			toc_ptr->track = track;
-			toc_ptr->m = m;
-			toc_ptr->s = s;
-			toc_ptr->f = f;
-
-			toc_ptr++;
-
-			if (toc_entry_count < toc_buffer.size())
-				toc_entry_count++;
+			struct subcode &out = toc_buffer[toc_entry_count++];
+			memset(&out, 0, sizeof(out));
+			out.control = htons(control);
+			out.track = 0; // Track 0 for TOC
+			out.index = htons(track);
+			out.mode1_amins = htons(m);
+			out.mode1_asecs = htons(s);
+			out.mode1_afrac = htons(f);
+			out.mode1_crc0 = htons(0xff);
+			out.mode1_crc1 = htons(0xff);
 		}
 	};
 
@@ -370,6 +363,16 @@ static void prepare_toc_buffer(toc_t *toc)
 		f = lba % 75;
 		add_entry(1, 0xA2, BCD(m), BCD(s), BCD(f));
 	}
+
+	for (int i = 0; i < (int)track_subcode.size(); i++)
+	{
+		struct subcode &out = track_subcode[i];
+		memset(&out, 0, sizeof(out));
+		out.control = htons(toc->tracks[i].type ? 0x41 : 0x01);
+		out.track = htons(BCD(i + 1));
+		out.mode1_crc0 = htons(0xff);
+		out.mode1_crc1 = htons(0xff);
+	}
 }
 
 #define TIMEKEEPER_SIZE (8 * 1024)
@@ -393,6 +396,18 @@ static void cdi_mount_save(const char *filename)
 
 static toc_t toc = {};
 
+// Track of lba as GetTrackByLBA finds it. Sectors are asked for in order,
+// so it's mostly the one of the sector before.
+static int subcode_track(int lba)
+{
+	static int track = 0;
+
+	if (track <= toc.last && (!track || toc.tracks[track - 1].end <= lba) && (track == toc.last || toc.tracks[track].end > lba))
+		return track;
+
+	return track = toc.GetTrackByLBA(lba);
+}
+
 int cdi_chd_hunksize()
 {
 	if (toc.chd_f)
@@ -592,10 +607,7 @@ const uint8_t s_sector_scramble[] =
 
 void descramble_sector(uint8_t *buffer)
 {
-	for (uint32_t i = 12; i < CD_SECTOR_LEN; i++)
-	{
-		buffer[i] ^= s_sector_scramble[i - 12];
-	}
+	cd_xor(buffer + 12, s_sector_scramble, CD_SECTOR_LEN - 12);
 }
 
 static inline uint32_t unBCD(uint32_t val)
@@ -659,20 +671,11 @@ void subcode_data(int lba, struct subcode &out)
 
 		if (toc_entry_count == 0) // catch division by zero
 			return;
-		auto &toc_entry = toc_buffer[lba % toc_entry_count];
-
-		out.control = htons(toc_entry.control);
-		out.track = 0; // Track 0 for TOC
-		out.index = htons(toc_entry.track);
-		out.mode1_mins = htons(BCD(am));
-		out.mode1_secs = htons(BCD(as));
-		out.mode1_frac = htons(BCD(af));
-		out.mode1_zero = 0;
-		out.mode1_amins = htons(toc_entry.m);
-		out.mode1_asecs = htons(toc_entry.s);
-		out.mode1_afrac = htons(toc_entry.f);
-		out.mode1_crc0 = htons(0xff);
-		out.mode1_crc1 = htons(0xff);
+
+		out = toc_buffer[lba % toc_entry_count];
+		out.mode1_mins = bcd_be[am % 100];
+		out.mode1_secs = bcd_be[as];
+		out.mode1_frac = bcd_be[af];
 	}
 	else
 	{
@@ -682,7 +685,7 @@ void subcode_data(int lba, struct subcode &out)
 		as = rem_lba / 75;
 		af = rem_lba % 75;
 
-		int track = toc.GetTrackByLBA(lba + 150);
+		int track = subcode_track(lba + 150);
 
 		int track_lba = 0;
 		if (track < (int)ARRAY_LENGTH(toc.tracks))
@@ -704,19 +707,24 @@ void subcode_data(int lba, struct subcode &out)
 		ts = track_lba / 75;
 		tf = track_lba % 75;
 
-		if (track < (int)ARRAY_LENGTH(toc.tracks))
-			out.control = htons(toc.tracks[track].type ? 0x41 : 0x01);
-		out.track = htons(BCD(track + 1));
-		out.index = htons(BCD(index));
-		out.mode1_mins = htons(BCD(tm));
-		out.mode1_secs = htons(BCD(ts));
-		out.mode1_frac = htons(BCD(tf));
-		out.mode1_zero = 0;
-		out.mode1_amins = htons(BCD(am));
-		out.mode1_asecs = htons(BCD(as));
-		out.mode1_afrac = htons(BCD(af));
-		out.mode1_crc0 = htons(0xff);
-		out.mode1_crc1 = htons(0xff);
+		if (track < (int)track_subcode.size())
+		{
+			out = track_subcode[track];
+		}
+		else
+		{
+			out.track = htons(BCD(track + 1));
+			out.mode1_zero = 0;
+			out.mode1_crc0 = htons(0xff);
+			out.mode1_crc1 = htons(0xff);
+		}
+		out.index = bcd_be[index];
+		out.mode1_mins = bcd_be[tm % 100];
+		out.mode1_secs = bcd_be[ts];
+		out.mode1_frac = bcd_be[tf];
+		out.mode1_amins = bcd_be[am % 100];
+		out.mode1_asecs = bcd_be[as];
+		out.mode1_afrac = bcd_be[af];
 	}
 
 	uint16_t crc_accum = 0;
@@ -761,48 +769,32 @@ void cdi_read_cd(uint8_t *buffer, int lba, int cnt)
 			{
 				if (lba >= (toc.tracks[i].start - toc.tracks[i].pregap) && lba <= toc.tracks[i].end)
 				{
-					if (!toc.chd_f)
+					cd_source_t src = {};
+					src.sector_size = CD_SECTOR_LEN;
+					if (toc.chd_f)
+					{
+						src.chd_f = toc.chd_f;
+					}
+					else
+					{
+						src.f = toc.tracks[i].offset ? &toc.tracks[0].f : &toc.tracks[i].f;
+						src.offset = toc.tracks[i].offset;
+					}
+
+					// Read the rest of the request within this track in one go
+					int n = toc.tracks[i].end - lba + 1;
+					if (n > cnt)
+						n = cnt;
+
+					// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
+					int read_lba = toc.chd_f ? (lba - 150 + toc.tracks[i].offset) : (lba - toc.tracks[i].start + toc.tracks[i].pregap);
+					if (cd_read_sectors(&src, read_lba, n, toc.tracks[i].type ? CD_READ_RAW : CD_READ_AUDIO, buffer, CDIC_BUFFER_SIZE) < n && toc.chd_f)
 					{
-						if (toc.tracks[i].offset)
-						{
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset + ((lba - toc.tracks[i].start + toc.tracks[i].pregap) * CD_SECTOR_LEN), SEEK_SET);
-						}
-						else
-						{
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start + toc.tracks[i].pregap) * CD_SECTOR_LEN, SEEK_SET);
-						}
+						printf("\x1b[32mCDI: CHD read error: %d\n\x1b[0m", lba);
 					}
 
 					while (cnt)
 					{
-						if (toc.chd_f)
-						{
-							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - 150;
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
-							{
-								if (!toc.tracks[i].type) // CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else
-							{
-								printf("\x1b[32mCDI: CHD read error: %d\n\x1b[0m", lba);
-							}
-						}
-						else
-						{
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
 						if ((lba + 1) > toc.tracks[i].end)
 							break;
 
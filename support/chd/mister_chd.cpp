@@ -5,10 +5,177 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <vector>
 #include "../../file_io.h"
 #include "../../cd.h"
+#include "../../offload.h"
+#include "../../arena.h"
 #include "mister_chd.h"
 
+// Decoded hunks shared by all readers of a CHD.
+// When reads go forward the next hunks are decoded on an offload worker,
+// so the codec (zstd/lzma/flac) doesn't run inside the core's request handler.
+
+#define CHD_CACHE_HUNKS    8
+#define CHD_PREFETCH_HUNKS 2
+#define CHD_SEEK_HUNKS     4 // decoded ahead of a seek, leaves room for the hunks in use
+
+struct chd_cache_slot_t
+{
+	int hunknum;
+	bool busy;                  // being decoded, hunknum is already set
+	uint32_t last_use;
+	uint8_t *data;
+};
+
+struct chd_reader_t
+{
+	chd_file *chd_f;
+	pthread_mutex_t lock;       // slots
+	pthread_cond_t cond;        // a busy slot finished
+	pthread_mutex_t io_lock;    // chd_read, libchdr is not reentrant
+	chd_cache_slot_t slots[CHD_CACHE_HUNKS];
+	uint32_t tick;
+	uint32_t hunkcount;
+	uint32_t hunkbytes;         // slot buffers come from the pool of this size
+	int last_hunk;
+	OffloadHandle prefetch;
+	OffloadHandle seek;
+};
+
+static std::vector<chd_reader_t *> chd_readers;
+
+static chd_reader_t *chd_reader_get(chd_file *chd_f)
+{
+	for (chd_reader_t *rd : chd_readers)
+	{
+		if (rd->chd_f == chd_f) return rd;
+	}
+
+	const chd_header *header = chd_get_header(chd_f);
+	if (!header) return NULL;
+
+	chd_reader_t *rd = new chd_reader_t();
+	rd->chd_f = chd_f;
+	rd->hunkbytes = header->hunkbytes;
+	rd->hunkcount = header->totalhunks;
+	rd->last_hunk = -1;
+	pthread_mutex_init(&rd->lock, NULL);
+	pthread_mutex_init(&rd->io_lock, NULL);
+	pthread_cond_init(&rd->cond, NULL);
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+	{
+		rd->slots[i].hunknum = -1;
+		rd->slots[i].data = (uint8_t *)mem_pool_get(rd->hunkbytes);
+	}
+
+	chd_readers.push_back(rd);
+	return rd;
+}
+
+static void chd_reader_free(chd_reader_t *rd)
+{
+	rd->prefetch.wait();
+	rd->seek.wait();
+	for (int i = 0; i < CHD_CACHE_HUNKS; i++) mem_pool_put(rd->slots[i].data, rd->hunkbytes);
+	pthread_mutex_destroy(&rd->lock);
+	pthread_mutex_destroy(&rd->io_lock);
+	pthread_cond_destroy(&rd->cond);
+	delete rd;
+}
+
+// Call with lock held. Returns slot holding the hunk, decoding it if needed.
+// The lock is dropped while decoding so hits on other hunks don't wait.
+static chd_cache_slot_t *chd_reader_load(chd_reader_t *rd, int hunknum, chd_error *err)
+{
+	chd_cache_slot_t *victim;
+	while (1)
+	{
+		chd_cache_slot_t *hit = NULL;
+		victim = NULL;
+		for (int i = 0; i < CHD_CACHE_HUNKS; i++)
+		{
+			chd_cache_slot_t *slot = &rd->slots[i];
+			if (!slot->data) continue;
+			if (slot->hunknum == hunknum) hit = slot;
+			else if (!slot->busy && (!victim || slot->hunknum < 0 || (victim->hunknum >= 0 && slot->last_use < victim->last_use))) victim = slot;
+		}
+
+		if (!hit) break;
+		if (!hit->busy)
+		{
+			hit->last_use = ++rd->tick;
+			*err = CHDERR_NONE;
+			return hit;
+		}
+
+		pthread_cond_wait(&rd->cond, &rd->lock);
+	}
+
+	if (!victim)
+	{
+		*err = CHDERR_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	victim->hunknum = hunknum;
+	victim->busy = true;
+	pthread_mutex_unlock(&rd->lock);
+
+	pthread_mutex_lock(&rd->io_lock);
+	*err = chd_read(rd->chd_f, hunknum, victim->data);
+	pthread_mutex_unlock(&rd->io_lock);
+
+	pthread_mutex_lock(&rd->lock);
+	victim->busy = false;
+	victim->last_use = ++rd->tick;
+	if (*err != CHDERR_NONE) victim->hunknum = -1;
+	pthread_cond_broadcast(&rd->cond);
+
+	return (*err == CHDERR_NONE) ? victim : NULL;
+}
+
+static void chd_reader_prefetch(chd_reader_t *rd, int hunknum)
+{
+	if (!rd->prefetch.done()) return;
+
+	int first = hunknum + 1;
+	int last = hunknum + CHD_PREFETCH_HUNKS;
+	if (last >= (int)rd->hunkcount) last = rd->hunkcount - 1;
+	if (first > last) return;
+
+	rd->prefetch = offload_try_submit([rd, first, last]()
+	{
+		pthread_mutex_lock(&rd->lock);
+		for (int h = first; h <= last; h++)
+		{
+			chd_error err;
+			if (!chd_reader_load(rd, h, &err)) break;
+		}
+		pthread_mutex_unlock(&rd->lock);
+	}, OFFLOAD_PRIO_DECODE);
+}
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	for (size_t i = 0; i < chd_readers.size(); i++)
+	{
+		if (chd_readers[i]->chd_f == chd_f)
+		{
+			chd_reader_free(chd_readers[i]);
+			chd_readers.erase(chd_readers.begin() + i);
+			break;
+		}
+	}
+
+	chd_close(chd_f);
+}
+
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
 {
 	const chd_header *chd_header = chd_get_header(chd_f);
@@ -160,27 +327,231 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+// Bulk reads split the hunks between the calling thread and offload workers.
+// libchdr keeps codec state in the chd_file, so each worker decodes through
+// its own handle of the same file.
+
+#define CHD_BULK_HELPERS 3
+
+struct chd_bulk_t
+{
+	int first;
+	int count;
+	uint32_t hunkbytes;
+	uint8_t *dest;
+	int next;                   // next hunk to take
+	int err;                    // first error, stops everyone
+	uint8_t *ready;             // per hunk, set once decoded
+};
+
+// Decodes up to max hunks taken from the shared counter, returns false when there are none left.
+static bool chd_bulk_decode(chd_bulk_t *b, chd_file *chd_f, pthread_mutex_t *io_lock, int max)
+{
+	while (max-- > 0)
+	{
+		if (__atomic_load_n(&b->err, __ATOMIC_RELAXED)) return false;
+
+		int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if (i >= b->count) return false;
+
+		if (io_lock) pthread_mutex_lock(io_lock);
+		chd_error err = chd_read(chd_f, b->first + i, b->dest + (size_t)i * b->hunkbytes);
+		if (io_lock) pthread_mutex_unlock(io_lock);
+
+		if (err != CHDERR_NONE)
+		{
+			int none = CHDERR_NONE;
+			__atomic_compare_exchange_n(&b->err, &none, (int)err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		__atomic_store_n(&b->ready[i], 1, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+// Another handle of the file, with its own file offset and codecs.
+static chd_file *chd_bulk_open(chd_file *chd_f)
+{
+	char path[64];
+	sprintf(path, "/proc/self/fd/%d", fileno((FILE *)chd_core_file(chd_f)->argp));
+
+	chd_file *f = NULL;
+	if (chd_open(path, CHD_OPEN_READ, NULL, &f) != CHDERR_NONE) return NULL;
+
+	fcntl(fileno((FILE *)chd_core_file(f)->argp), F_SETFD, FD_CLOEXEC);
+	return f;
+}
+
+static int chd_bulk_advance(chd_bulk_t *b, int done, void (*ready)(int hunks, void *arg), void *arg)
+{
+	int n = done;
+	while (n < b->count && __atomic_load_n(&b->ready[n], __ATOMIC_ACQUIRE)) n++;
+	if (n != done && ready) ready(n, arg);
+	return n;
+}
+
+chd_error mister_chd_read_hunks(chd_file *chd_f, int first, int count, uint8_t *dest, void (*ready)(int hunks, void *arg), void *arg)
+{
+	chd_reader_t *rd = chd_reader_get(chd_f);
+	if (!rd) return CHDERR_OUT_OF_MEMORY;
+	if (first < 0 || count < 0 || first + count > (int)rd->hunkcount) return CHDERR_HUNK_OUT_OF_RANGE;
+	if (!count) return CHDERR_NONE;
+
+	chd_bulk_t b = {};
+	b.first = first;
+	b.count = count;
+	b.hunkbytes = chd_get_header(chd_f)->hunkbytes;
+	b.dest = dest;
+	b.ready = (uint8_t *)calloc(count, 1);
+	if (!b.ready) return CHDERR_OUT_OF_MEMORY;
+
+	long helpers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (helpers < 1) helpers = 1;
+	if (helpers > CHD_BULK_HELPERS) helpers = CHD_BULK_HELPERS;
+	if (helpers > count - 1) helpers = count - 1;
+
+	OffloadHandle jobs[CHD_BULK_HELPERS];
+	for (int i = 0; i < helpers; i++)
+	{
+		chd_file *f = chd_bulk_open(chd_f);
+		if (!f) break;
+
+		chd_bulk_t *bp = &b;
+		jobs[i] = offload_try_submit([bp, f]()
+		{
+			chd_bulk_decode(bp, f, NULL, bp->count);
+			chd_close(f);
+		}, OFFLOAD_PRIO_DECODE);
+
+		if (!jobs[i].valid())
+		{
+			chd_close(f);
+			break;
+		}
+	}
+
+	// The caller decodes as well, one hunk at a time so the decoded prefix is reported as it grows.
+	int done = 0;
+	while (chd_bulk_decode(&b, chd_f, &rd->io_lock, 1)) done = chd_bulk_advance(&b, done, ready, arg);
+
+	for (int i = 0; i < CHD_BULK_HELPERS; i++)
+	{
+		while (!jobs[i].done())
+		{
+			done = chd_bulk_advance(&b, done, ready, arg);
+			usleep(1000);
+		}
+	}
+	chd_bulk_advance(&b, done, ready, arg);
+
+	free(b.ready);
+
+	if (b.err != CHDERR_NONE) mister_chd_log("ERROR %s\n", chd_error_string((chd_error)b.err));
+	return (chd_error)b.err;
+}
+
+void mister_chd_prefetch(chd_file *chd_f, int lba, int count)
 {
+	chd_reader_t *rd = chd_reader_get(chd_f);
+	if (!rd || count <= 0 || !rd->seek.done()) return;
 
-	int tmphnum = 0;
-	int hunkofs = 0;
+	int first, last, ofs;
+	lba_to_hunkinfo(chd_f, lba < 0 ? 0 : lba, &first, &ofs);
+	lba_to_hunkinfo(chd_f, (lba < 0 ? 0 : lba) + count - 1, &last, &ofs);
+	if (last >= first + CHD_SEEK_HUNKS) last = first + CHD_SEEK_HUNKS - 1;
+	if (last >= (int)rd->hunkcount) last = rd->hunkcount - 1;
+	if (first > last) return;
 
-	lba_to_hunkinfo(chd_f, lba, &tmphnum, &hunkofs);
+	rd->seek = offload_try_submit([rd, first, last]()
+	{
+		pthread_mutex_lock(&rd->lock);
+		for (int h = first; h <= last; h++)
+		{
+			chd_error err;
+			if (!chd_reader_load(rd, h, &err)) break;
+		}
+		pthread_mutex_unlock(&rd->lock);
+	}, OFFLOAD_PRIO_IO);
 
+	// Reads from there on continue the prefetch
+	rd->last_hunk = first - 1;
+}
 
-	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+// Streaming (data or CDDA) moves to the next hunk, decode ahead
+static void chd_reader_streaming(chd_reader_t *rd, int hunknum)
+{
+	if (hunknum != rd->last_hunk)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
+		if (hunknum == rd->last_hunk + 1) chd_reader_prefetch(rd, hunknum);
+		rd->last_hunk = hunknum;
+	}
+}
+
+chd_error mister_chd_read_sectors(chd_file *chd_f, int lba, int count, uint32_t s_offset, int length, uint8_t *destbuf, int stride)
+{
+	chd_reader_t *rd = chd_reader_get(chd_f);
+	if (!rd) return CHDERR_OUT_OF_MEMORY;
+
+	const chd_header *chd_header = chd_get_header(chd_f);
+	int sectors_per_hunk = chd_header->hunkbytes / chd_header->unitbytes;
+	int hunknum = -1;
+
+	//mister_chd_log("READ LBA: %d, count: %d sector offset: %d length %d chd_f %p\n", lba, count, s_offset, length, chd_f);
+	while (count > 0)
+	{
+		int hunkofs;
+		lba_to_hunkinfo(chd_f, lba, &hunknum, &hunkofs);
+
+		int n = sectors_per_hunk - hunkofs;
+		if (n > count) n = count;
+
+		pthread_mutex_lock(&rd->lock);
+		chd_error err;
+		chd_cache_slot_t *slot = chd_reader_load(rd, hunknum, &err);
+		if (slot)
+		{
+			// Straight from the cache into the caller's buffer
+			const uint8_t *src = slot->data + hunkofs * CD_FRAME_SIZE + s_offset;
+			for (int i = 0; i < n; i++, src += CD_FRAME_SIZE, destbuf += stride) memcpy(destbuf, src, length);
+		}
+		pthread_mutex_unlock(&rd->lock);
+
 		if (err != CHDERR_NONE)
 		{
 			mister_chd_log("ERROR %s\n", chd_error_string(err));
 			return err;
 		}
-		*hunknum = tmphnum;
+
+		chd_reader_streaming(rd, hunknum);
+		lba += n;
+		count -= n;
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+
+	return CHDERR_NONE;
+}
+
+chd_error mister_chd_use_sector(chd_file *chd_f, int lba, uint32_t s_offset, int length, void (*use)(const uint8_t *data, int len, void *ctx), void *ctx)
+{
+	chd_reader_t *rd = chd_reader_get(chd_f);
+	if (!rd) return CHDERR_OUT_OF_MEMORY;
+
+	int hunknum, hunkofs;
+	lba_to_hunkinfo(chd_f, lba, &hunknum, &hunkofs);
+
+	pthread_mutex_lock(&rd->lock);
+	chd_error err;
+	chd_cache_slot_t *slot = chd_reader_load(rd, hunknum, &err);
+	if (slot) use(slot->data + hunkofs * CD_FRAME_SIZE + s_offset, length, ctx);
+	pthread_mutex_unlock(&rd->lock);
+
+	if (err != CHDERR_NONE)
+	{
+		mister_chd_log("ERROR %s\n", chd_error_string(err));
+		return err;
+	}
+
+	chd_reader_streaming(rd, hunknum);
 	return CHDERR_NONE;
 }
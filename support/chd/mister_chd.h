@@ -5,7 +5,20 @@
 #include <libchdr/cdrom.h>
 #include "../../cd.h"
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum);
+// Copy length bytes from s_offset of count frames starting at lba, stride bytes apart in destbuf.
+// Hunks are shared with every other reader of the file and decoded ahead for sequential reads.
+chd_error mister_chd_read_sectors(chd_file *chd_f, int lba, int count, uint32_t s_offset, int length, uint8_t *destbuf, int stride);
+// Calls use with length bytes from s_offset of frame lba right in the hunk cache, no copy.
+// The cache is locked meanwhile, use must be quick and must not read the CHD itself.
+chd_error mister_chd_use_sector(chd_file *chd_f, int lba, uint32_t s_offset, int length, void (*use)(const uint8_t *data, int len, void *ctx), void *ctx);
+// Decodes the hunks of count frames starting at lba in the background, e.g. while a seek is emulated.
+void mister_chd_prefetch(chd_file *chd_f, int lba, int count);
+// Decodes count whole hunks starting at first into dest (count * hunkbytes), in parallel on the offload workers.
+// ready, if set, is called from the calling thread with the number of hunks decoded from the start so far.
+chd_error mister_chd_read_hunks(chd_file *chd_f, int first, int count, uint8_t *dest, void (*ready)(int hunks, void *arg) = NULL, void *arg = NULL);
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc);
 
+// Use instead of chd_close, releases the shared hunk cache of the file.
+void mister_chd_close(chd_file *chd_f);
+
 #endif
@@ -10,6 +10,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../cd_set.h"
 #include "megacd.h"
 
 #define SAVE_IO_INDEX 5 // fake download to trigger save loading
@@ -110,7 +111,7 @@ static int mcd_load_rom(const char *basename, const char *name, int sub_index)
 	{
 		p++;
 		strcpy(p, name);
-		if (user_io_file_tx(buf, sub_index << 6)) return 1;
+		if (sub_index ? user_io_file_tx(buf, sub_index << 6) : user_io_file_tx_fw(buf, 0)) return 1;
 	}
 
 	return 0;
@@ -121,6 +122,7 @@ void mcd_set_image(int num, const char *filename)
 	static char last_dir[1024] = {};
 
 	(void)num;
+	filename = cd_set_disc(filename);
 
 	cdd.Unload();
 	cdd.status = CD_STAT_OPEN;
@@ -164,6 +166,7 @@ void mcd_set_image(int num, const char *filename)
 			cdd.status = cdd.loaded ? CD_STAT_STOP : CD_STAT_NO_DISC;
 			cdd.latency = 10;
 			cdd.SendData = mcd_send_data;
+			cdd.SendDataV = mcd_send_datav;
 			cdd.CanSendData = mcd_can_send_data;
 
 			if (!same_game)
@@ -195,6 +198,14 @@ int mcd_send_data(uint8_t* buf, int len, uint8_t index) {
 	return 1;
 }
 
+int mcd_send_datav(const struct iovec *iov, int cnt, uint8_t index) {
+	user_io_set_index(index);
+	user_io_set_download(1);
+	user_io_file_tx_datav(iov, cnt);
+	user_io_set_download(0);
+	return 1;
+}
+
 static char int_blank[] = {
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -50,11 +50,13 @@ public:
 	uint8_t isData;
 	int loaded;
 	SendDataFunc SendData;
+	SendDataVFunc SendDataV;
 	int (*CanSendData)(uint8_t type);
 
 	cdd_t();
 	int Load(const char *filename);
 	void Unload();
+	static int LoadImage(const char *filename, toc_t *table, int *extra);
 	void Reset();
 	void Update();
 	void CommandExec();
@@ -69,16 +71,15 @@ private:
 	int scanOffset;
 	int audioLength;
 	int audioOffset;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 	uint8_t stat[10];
 	uint8_t comm[10];
 
-	int LoadCUE(const char* filename);
+	static int LoadCUE(const char* filename, toc_t *table);
 	int LoadCHD(const char* filename);
 	int SectorSend(uint8_t* header);
 	int SubcodeSend();
+	int DataSource(cd_source_t *src, int *lba);
 	void ReadData(uint8_t *buf);
 	int ReadCDDA(uint8_t *buf);
 	int ReadSubcode(uint16_t* buf);
@@ -100,6 +101,7 @@ void mcd_poll();
 void mcd_set_image(int num, const char *filename);
 void mcd_reset();
 int mcd_send_data(uint8_t* buf, int len, uint8_t index);
+int mcd_send_datav(const struct iovec *iov, int cnt, uint8_t index);
 int mcd_can_send_data(uint8_t type);
 void mcd_fill_blanksave(uint8_t *buffer, uint32_t lba);
 
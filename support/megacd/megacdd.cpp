@@ -6,6 +6,9 @@
 #include <time.h>
 
 #include "megacd.h"
+#include "../../cdda_stream.h"
+#include "../../cd_ram.h"
+#include "../../cd_set.h"
 #include "../chd/mister_chd.h"
 
 cdd_t cdd;
@@ -20,9 +23,8 @@ cdd_t::cdd_t() {
 	status = CD_STAT_NO_DISC;
 	audioLength = 0;
 	audioOffset = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
+	SendDataV = NULL;
 	CanSendData = NULL;
 
 	stat[0] = 0xB;
@@ -71,7 +73,7 @@ static int sgets(char *out, int sz, char **in)
 }
 
 
-int cdd_t::LoadCUE(const char* filename) {
+int cdd_t::LoadCUE(const char* filename, toc_t *table) {
 	static char fname[1024 + 10];
 	static char line[128];
 	char *ptr, *lptr;
@@ -79,6 +81,7 @@ int cdd_t::LoadCUE(const char* filename) {
 	static char toc[100 * 1024];
 
 	strcpy(fname, filename);
+	if (cd_cue_cache_load(filename, "megacd", table)) return 0;
 
 	memset(toc, 0, sizeof(toc));
 	if (!FileLoad(fname, toc, sizeof(toc) - 1)) return 1;
@@ -116,17 +119,17 @@ int cdd_t::LoadCUE(const char* filename) {
 			}
 			*ptr = 0;
 
-			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			if(!FileOpen(&table->tracks[table->last].f, fname)) return -1;
 
 			printf("\x1b[32mMCD: Open track file: %s\n\x1b[0m", fname);
 
 			pregap = 0;
 
-			this->toc.tracks[this->toc.last].offset = 0;
+			table->tracks[table->last].offset = 0;
 
 			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
 			{
-				FileClose(&this->toc.tracks[this->toc.last].f);
+				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mMCD: unsupported file: %s\n\x1b[0m", fname);
 
 				return -1;
@@ -136,39 +139,39 @@ int cdd_t::LoadCUE(const char* filename) {
 		/* decode TRACK commands */
 		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
 		{
-			if (bb != (this->toc.last + 1))
+			if (bb != (table->last + 1))
 			{
-				FileClose(&this->toc.tracks[this->toc.last].f);
+				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mMCD: missing tracks: %s\n\x1b[0m", fname);
 				break;
 			}
 
-			if (!this->toc.last)
+			if (!table->last)
 			{
 				if (strstr(lptr, "MODE1/2048"))
 				{
-					this->toc.tracks[0].sector_size = 2048;
+					table->tracks[0].sector_size = 2048;
 				}
 				else if (strstr(lptr, "MODE1/2352"))
 				{
-					this->toc.tracks[0].sector_size = 2352;
+					table->tracks[0].sector_size = 2352;
 
-					FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
+					FileSeek(&table->tracks[0].f, 0x10, SEEK_SET);
 				}
 
-				if (this->toc.tracks[0].sector_size)
+				if (table->tracks[0].sector_size)
 				{
-					this->toc.tracks[0].type = 1;
+					table->tracks[0].type = 1;
 
-					FileReadAdv(&this->toc.tracks[0].f, header, 0x210);
-					FileSeek(&this->toc.tracks[0].f, 0, SEEK_SET);
+					FileReadAdv(&table->tracks[0].f, header, 0x210);
+					FileSeek(&table->tracks[0].f, 0, SEEK_SET);
 				}
 			}
 			else
 			{
-				if (!this->toc.tracks[this->toc.last].f.opened())
+				if (!table->tracks[table->last].f.opened())
 				{
-					this->toc.tracks[this->toc.last - 1].end = 0;
+					table->tracks[table->last - 1].end = 0;
 				}
 			}
 		}
@@ -183,97 +186,100 @@ int cdd_t::LoadCUE(const char* filename) {
 		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
 			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
 		{
-			if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+			if (table->last && !table->tracks[table->last - 1].end)
 			{
-				this->toc.tracks[this->toc.last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
+				table->tracks[table->last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
 			}
 		}
 		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
 			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
 		{
-			this->toc.tracks[this->toc.last].offset += pregap * 2352;
+			table->tracks[table->last].offset += pregap * 2352;
 
-			if (!this->toc.tracks[this->toc.last].f.opened())
+			if (!table->tracks[table->last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
-				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
-				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+				FileOpen(&table->tracks[table->last].f, fname);
+				table->tracks[table->last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
+				if (table->last && !table->tracks[table->last - 1].end)
 				{
-					this->toc.tracks[this->toc.last - 1].end = this->toc.tracks[this->toc.last].start;
+					table->tracks[table->last - 1].end = table->tracks[table->last].start;
 				}
 			}
 			else
 			{
-				FileSeek(&this->toc.tracks[this->toc.last].f, 0, SEEK_SET);
+				FileSeek(&table->tracks[table->last].f, 0, SEEK_SET);
 
-				this->toc.tracks[this->toc.last].start = this->toc.end + pregap;
-				this->toc.tracks[this->toc.last].offset += this->toc.end * 2352;
+				table->tracks[table->last].start = table->end + pregap;
+				table->tracks[table->last].offset += table->end * 2352;
 
 				int sectorSize = 2352;
-				if (this->toc.tracks[this->toc.last].type) sectorSize = this->toc.tracks[0].sector_size;
-				this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((this->toc.tracks[this->toc.last].f.size + sectorSize - 1) / sectorSize);
+				if (table->tracks[table->last].type) sectorSize = table->tracks[0].sector_size;
+				table->tracks[table->last].end = table->tracks[table->last].start + ((table->tracks[table->last].f.size + sectorSize - 1) / sectorSize);
 
-				this->toc.tracks[this->toc.last].start += (bb + ss * 75 + mm * 60 * 75);
-				this->toc.end = this->toc.tracks[this->toc.last].end;
+				table->tracks[table->last].start += (bb + ss * 75 + mm * 60 * 75);
+				table->end = table->tracks[table->last].end;
 			}
 
 			printf("\x1b[32mMCD: Track = %u, start = %u, end = %u, offset = %u, type = %u\n\x1b[0m", cdd.toc.last, cdd.toc.tracks[cdd.toc.last].start, cdd.toc.tracks[cdd.toc.last].end, cdd.toc.tracks[cdd.toc.last].offset, cdd.toc.tracks[cdd.toc.last].type);
 
-			this->toc.last++;
-			if (this->toc.last == 99) break;
+			table->last++;
+			if (table->last == 99) break;
 		}
 	}
 
-	if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+	if (table->last && !table->tracks[table->last - 1].end)
 	{
-		this->toc.end += pregap;
-		this->toc.tracks[this->toc.last - 1].end = this->toc.end;
+		table->end += pregap;
+		table->tracks[table->last - 1].end = table->end;
 	}
 
         memcpy(&fname[strlen(fname) - 4], ".sub", 4);
-        FileOpen(&this->toc.sub, getFullPath(fname));
+        FileOpen(&table->sub, getFullPath(fname));
 
-	FileClose(&this->toc.tracks[this->toc.last].f);
+	FileClose(&table->tracks[table->last].f);
+	cd_cue_cache_save(filename, "megacd", table);
 	return 0;
 }
 
-int cdd_t::Load(const char *filename)
+// CUE or CHD image into table, for Load and the other discs of a set.
+int cdd_t::LoadImage(const char *filename, toc_t *table, int *extra)
 {
-	//char fname[1024 + 10];
-	static char header[32];
-	fileTYPE *fd_img;
-
-	Unload();
+	(void)extra;
 
 	const char *ext = filename+strlen(filename)-4;
 	if (!strncasecmp(".cue", ext, 4))
 	{
-		if (LoadCUE(filename)) {
-			return (-1);
-		}
+		return !LoadCUE(filename, table);
 	} else if (!strncasecmp(".chd", ext, 4))  {
-		chd_error err = mister_load_chd(filename, &this->toc);
+		chd_error err = mister_load_chd(filename, table);
 		if (err != CHDERR_NONE)
 		{
 			printf("ERROR %s\n", chd_error_string(err));
-			return -1;
+			return 0;
 		}
+		return 1;
+	}
 
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
+	return 0;
+}
+
+int cdd_t::Load(const char *filename)
+{
+	//char fname[1024 + 10];
+	static char header[32];
+	fileTYPE *fd_img;
 
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
- 	} else {
-		return (-1);
+	Unload();
 
+	if (!cd_set_take(filename, &this->toc, NULL, LoadImage))
+	{
+		if (!LoadImage(filename, &this->toc, NULL)) return -1;
+		cd_set_mounted(filename);
 	}
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sectors(this->toc.chd_f, 0, 1, 0, 0x10, (uint8_t *)header, 0);
 	} else {
 		fd_img = &this->toc.tracks[0].f;
 
@@ -300,6 +306,7 @@ int cdd_t::Load(const char *filename)
 	{
 		this->toc.tracks[this->toc.last].start = this->toc.end;
 		this->loaded = 1;
+		cd_ram_install(&this->toc);
 
 		printf("\x1b[32mMCD: CD mounted , last track = %u\n\x1b[0m", this->toc.last);
 
@@ -313,26 +320,25 @@ void cdd_t::Unload()
 {
 	if (this->loaded)
 	{
-		if (this->toc.chd_f)
+		cdda_stop();
+		cd_ram_release();
+		if (!cd_set_unmount(&this->toc))
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
+			if (this->toc.chd_f)
+			{
+				mister_chd_close(this->toc.chd_f);
+			}
 
-		for (int i = 0; i < this->toc.last; i++)
-		{
-			if (this->toc.tracks[i].f.opened())
+			for (int i = 0; i < this->toc.last; i++)
 			{
-				FileClose(&this->toc.tracks[i].f);
+				if (this->toc.tracks[i].f.opened())
+				{
+					FileClose(&this->toc.tracks[i].f);
+				}
 			}
-		}
 
-		if (this->toc.sub.opened()) FileClose(&this->toc.sub);
+			if (this->toc.sub.opened()) FileClose(&this->toc.sub);
+		}
 
 		this->loaded = 0;
 	}
@@ -915,30 +921,29 @@ void cdd_t::SeekToLBA(int lba, int play) {
 
 }
 
-void cdd_t::ReadData(uint8_t *buf)
+// Where the data sector at the current position is stored, 0 if there's none
+int cdd_t::DataSource(cd_source_t *src, int *lba)
 {
-	if (this->toc.tracks[this->index].type && (this->lba >= 0))
-	{
+	if (!this->toc.tracks[this->index].type || (this->lba < 0)) return 0;
 
-		if (this->toc.chd_f)
-		{
-			int read_offset = 0;
-			if (this->sectorSize != 2048)
-			{
-				read_offset += 16;
-			}
-
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		} else {
-			if (this->sectorSize == 2048)
-			{
-				FileSeek(&this->toc.tracks[0].f, this->lba * 2048, SEEK_SET);
-			} else {
-			FileSeek(&this->toc.tracks[0].f, this->lba * 2352 + 16, SEEK_SET);
-			}
-			FileReadAdv(&this->toc.tracks[0].f, buf, 2048);
-		}
+	memset(src, 0, sizeof(*src));
+	src->sector_size = this->sectorSize;
+	if (this->toc.chd_f)
+	{
+		src->chd_f = this->toc.chd_f;
+		*lba = this->lba + this->toc.tracks[0].offset;
+	} else {
+		src->f = &this->toc.tracks[0].f;
+		*lba = this->lba;
 	}
+	return 1;
+}
+
+void cdd_t::ReadData(uint8_t *buf)
+{
+	cd_source_t src;
+	int lba;
+	if (DataSource(&src, &lba)) cd_read_sectors(&src, lba, 1, CD_READ_MODE1, buf);
 }
 
 int cdd_t::ReadCDDA(uint8_t *buf)
@@ -956,18 +961,12 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 
 	if (this->toc.chd_f)
 	{
+		cd_source_t src = {};
+		src.chd_f = this->toc.chd_f;
+		src.sector_size = 2352;
 		for(int i = 0; i < this->audioLength / 2352; i++)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		}
-
-		//CHD audio requires byteswap. There's probably a better way to do this...
-
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
+			cdda_read(&src, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, this->toc.tracks[this->index].end + this->toc.tracks[this->index].offset, buf + 2352*i);
 		}
 
 		if ((this->audioLength / 2352) > 1)
@@ -976,25 +975,26 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 		}
 
 	} else if (this->toc.tracks[this->index].f.opened()) {
-		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
-	}
-
-	return this->audioLength;
-}
-
-void InterleaveSubcode(uint8_t *subc_data, uint16_t *buf)
-{
-	for(int i = 0, n=0; i < 96; i+=2,n++)
-	{
-		int code = 0;
-		for (int j = 0; j < 8; j++)
+		// Sequential from where the track file was positioned
+		fileTYPE *f = &this->toc.tracks[this->index].f;
+		cd_source_t src = {};
+		src.f = f;
+		src.offset = -this->toc.tracks[this->index].offset;
+		src.sector_size = 2352;
+
+		__off64_t pos = f->offset - src.offset;
+		if (f->filp && pos >= 0 && !(pos % 2352))
+		{
+			cdda_read(&src, pos / 2352, this->toc.tracks[this->index].end, buf, this->audioLength / 2352);
+			FileSeek(f, f->offset + this->audioLength, SEEK_SET);
+		}
+		else
 		{
-			int bits = (subc_data[(j * 12) + (i / 8)] >> (6 - (i&6))) & 3;
-			code |= ((bits & 1) << (15 - j));
-			code |= ((bits >> 1) << (7 - j));
+			FileReadAdv(f, buf, this->audioLength);
 		}
-		buf[n] = code;
 	}
+
+	return this->audioLength;
 }
 
 int cdd_t::ReadSubcode(uint16_t* buf)
@@ -1003,18 +1003,21 @@ int cdd_t::ReadSubcode(uint16_t* buf)
 	uint8_t subc[96];
 	if (this->toc.chd_f)
 	{
-		//Just use the read sector call with an offset, since we previously read that sector, it is already in the hunk cache
+		//Since we previously read that sector, it is already in the hunk cache
+		cd_source_t src = {};
+		src.chd_f = this->toc.chd_f;
+		src.sector_size = 2352;
 		if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW_RAW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf, this->chd_hunkbuf, &this->chd_hunknum);
+			cd_read_sectors(&src, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 1, CD_READ_SUBCODE, (uint8_t *)buf);
 		} else if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc, this->chd_hunkbuf, &this->chd_hunknum);
-			InterleaveSubcode(subc, buf);
+			cd_read_sectors(&src, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 1, CD_READ_SUBCODE, subc);
+			cd_subcode_interleave(subc, buf);
 		} else {
 			err = -1;
 		}
 	} else if (this->toc.sub.opened()) {
 		FileReadAdv(&this->toc.sub, subc, 96);
-		InterleaveSubcode(subc, buf);
+		cd_subcode_interleave(subc, buf);
 	} else {
 		err = -1;
 	}
@@ -1030,15 +1033,23 @@ int cdd_t::SectorSend(uint8_t* header)
 	uint8_t index = MCD_DATA_IO_INDEX;
 
 	if (header) {
+		memset(buf, 0, 12);
 		memcpy(buf + 12, header, 4);
+		SubcodeSend();
+
+		// The data goes out from where it's kept (CD RAM, CHD hunk cache), not copied to buf
+		cd_source_t src;
+		int lba;
+		if (SendDataV && DataSource(&src, &lba) && cd_send_sector(&src, lba, CD_READ_MODE1, buf, 16, len, buf + 16, SendDataV, index)) return 1;
+
 		ReadData(buf + 16);
 	}
 	else {
 		index = MCD_CDDA_IO_INDEX;
 		len = ReadCDDA(buf);
+		SubcodeSend();
 	}
 
-	SubcodeSend();
 	if (SendData)
 		return SendData(buf, len, index);
 
@@ -1,6 +1,7 @@
 // config.c
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <sys/stat.h>
@@ -13,6 +14,8 @@
 #include "../../input.h"
 #include "../../cfg.h"
 #include "../../ide.h"
+#include "../../cd.h"
+#include "../../fw_cache.h"
 #include "minimig_boot.h"
 #include "minimig_fdd.h"
 #include "minimig_config.h"
@@ -46,32 +49,40 @@ typedef struct
 mm_configTYPE minimig_config = { };
 static unsigned char romkey[3072];
 
-static void SendFileV2(fileTYPE* file, unsigned char* key, int keysize, int address, int size)
+// size blocks of 512 bytes from src (read through fw_cache), missing bytes are zero
+static void SendFileV2(const uint8_t *src, uint32_t src_len, unsigned char* key, int keysize, int address, int size)
 {
-	static uint8_t buf[512];
-	unsigned int keyidx = 0;
+	int len = size * 512;
+	uint8_t *data = (uint8_t*)malloc(len);
+	if (!data)
+	{
+		printf("SendFileV2: cannot allocate %d bytes\n", len);
+		return;
+	}
+
 	printf("File size: %dkB\n", size >> 1);
 	printf("[");
 	if (keysize)
 	{
-		// read header
-		FileReadAdv(file, buf, 0xb);
+		// skip header
+		src += 0xb;
+		src_len = (src_len > 0xb) ? src_len - 0xb : 0;
+	}
+
+	int got = ((int)src_len < len) ? (int)src_len : len;
+	memcpy(data, src, got);
+	if (got < len) memset(data + got, 0, len - got);
+
+	if (keysize)
+	{
+		// decrypt ROM, key repeats every keysize bytes
+		for (int j = 0; j < len; j += keysize) cd_xor(data + j, key, (len - j < keysize) ? len - j : keysize);
 	}
 
 	for (int i = 0; i<size; i++)
 	{
 		if (!(i & 31)) printf("*");
-		FileReadAdv(file, buf, 512);
 
-		if (keysize)
-		{
-			// decrypt ROM
-			for (int j = 0; j<512; j++)
-			{
-				buf[j] ^= key[keyidx++];
-				if ((int)keyidx >= keysize) keyidx -= keysize;
-			}
-		}
 		EnableIO();
 		unsigned int adr = address + i * 512;
 		spi8(UIO_MM2_WR);
@@ -79,43 +90,47 @@ static void SendFileV2(fileTYPE* file, unsigned char* key, int keysize, int addr
 		spi8(adr & 0xff); adr = adr >> 8;
 		spi8(adr & 0xff); adr = adr >> 8;
 		spi8(adr & 0xff); adr = adr >> 8;
-		for (int j = 0; j<512; j = j + 4)
-		{
-			spi8(buf[j + 0]);
-			spi8(buf[j + 1]);
-			spi8(buf[j + 2]);
-			spi8(buf[j + 3]);
-		}
+		spi_block_write(data + i * 512, 0, 512);
 		DisableIO();
 	}
 
 	printf("]\n");
+	free(data);
 }
 
+// from the home directory of the core or the root
+static uint8_t *LoadRom(const char *name, uint32_t *size)
+{
+	uint8_t *data = fw_cache_load(user_io_make_filepath(HomeDir(), name), size, 0x100000);
+	if (!data) data = fw_cache_load(name, size, 0x100000);
+	return data;
+}
 
 static char UploadKickstart(char *name)
 {
-	fileTYPE file = {};
 	int keysize = 0;
+	uint32_t size;
 
 	BootPrint("Checking for Amiga Forever key file:");
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), "ROM.KEY")) || FileOpen(&file, "ROM.KEY")) {
-		keysize = file.size;
-		if (file.size<sizeof(romkey))
+	uint8_t *keyfile = LoadRom("ROM.KEY", &size);
+	if (keyfile) {
+		keysize = size;
+		if (size<sizeof(romkey))
 		{
-			FileReadAdv(&file, romkey, keysize);
+			memcpy(romkey, keyfile, keysize);
 			BootPrint("Loaded Amiga Forever key file");
 		}
 		else
 		{
 			BootPrint("Amiga Forever keyfile is too large!");
 		}
-		FileClose(&file);
+		free(keyfile);
 	}
 	BootPrint("Loading file: ");
 	BootPrint(name);
 
-	if (FileOpen(&file, name))
+	uint8_t *rom = fw_cache_load(name, &size, 0x100000);
+	if (rom)
 	{
 		// discard from possible residents
 		EnableIO();
@@ -124,80 +139,61 @@ static char UploadKickstart(char *name)
 		for (int i = 0; i < 4; i++) spi8(1);
 		DisableIO();
 
-		if (file.size == 0x100000) {
+		char ok = 1;
+		if (size == 0x100000) {
 			// 1MB Kickstart ROM
 			BootPrint("Uploading 1MB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 10);
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 10);
-			FileClose(&file);
-			return(1);
+			SendFileV2(rom, size, NULL, 0, 0xe00000, size >> 10);
+			SendFileV2(rom + (size >> 1), size >> 1, NULL, 0, 0xf80000, size >> 10);
 		}
-		else if ((file.size == 8203) && keysize) {
+		else if ((size == 8203) && keysize) {
 			// Cloanto encrypted A1000 boot ROM
 			BootPrint("Uploading encrypted A1000 boot ROM");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
+			SendFileV2(rom, size, romkey, keysize, 0xf80000, size >> 9);
 			//clear tag (write 0 to $fc0000) to force bootrom to load Kickstart from disk
 			//and not use one which was already there.
 			spi_uio_cmd32_cont(UIO_MM2_WR, 0xfc0000);
 			spi8(0x00);spi8(0x00);
 			DisableIO();
-			return(1);
 		  }
-		else if (file.size == 0x2000) {
+		else if (size == 0x2000) {
 			// 8KB A1000 boot ROM
 			BootPrint("Uploading A1000 boot ROM");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
+			SendFileV2(rom, size, NULL, 0, 0xf80000, size >> 9);
 			spi_uio_cmd32_cont(UIO_MM2_WR, 0xfc0000);
 			spi8(0x00);spi8(0x00);
 			DisableIO();
-			return(1);
 		  }
-		else if (file.size == 0x80000) {
+		else if (size == 0x80000) {
 			// 512KB Kickstart ROM
 			BootPrint("Uploading 512KB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			SendFileV2(rom, size, NULL, 0, 0xf80000, size >> 9);
+			SendFileV2(rom, size, NULL, 0, 0xe00000, size >> 9);
 		}
-		else if ((file.size == 0x8000b) && keysize) {
+		else if ((size == 0x8000b) && keysize) {
 			// 512KB Kickstart ROM
 			BootPrint("Uploading 512 KB Kickstart (Probably Amiga Forever encrypted...)");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, romkey, keysize, 0xe00000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			SendFileV2(rom, size, romkey, keysize, 0xf80000, size >> 9);
+			SendFileV2(rom, size, romkey, keysize, 0xe00000, size >> 9);
 		}
-		else if (file.size == 0x40000) {
+		else if (size == 0x40000) {
 			// 256KB Kickstart ROM
 			BootPrint("Uploading 256 KB Kickstart...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, NULL, 0, 0xfc0000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			SendFileV2(rom, size, NULL, 0, 0xf80000, size >> 9);
+			SendFileV2(rom, size, NULL, 0, 0xfc0000, size >> 9);
 		}
-		else if ((file.size == 0x4000b) && keysize) {
+		else if ((size == 0x4000b) && keysize) {
 			// 256KB Kickstart ROM
 			BootPrint("Uploading 256 KB Kickstart (Probably Amiga Forever encrypted...");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, romkey, keysize, 0xfc0000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			SendFileV2(rom, size, romkey, keysize, 0xf80000, size >> 9);
+			SendFileV2(rom, size, romkey, keysize, 0xfc0000, size >> 9);
 		}
 		else {
 			BootPrint("Unsupported ROM file size!");
+			ok = 0;
 		}
-		FileClose(&file);
+		free(rom);
+		return(ok);
 	}
 	else {
 		printf("No \"%s\" file!\n", name);
@@ -207,12 +203,14 @@ static char UploadKickstart(char *name)
 
 static char UploadActionReplay()
 {
-	fileTYPE file = {};
-	if(FileOpen(&file, user_io_make_filepath(HomeDir(), "HRTMON.ROM")) || FileOpen(&file, "HRTMON.ROM"))
+	uint32_t size;
+	uint8_t *rom = LoadRom("HRTMON.ROM", &size);
+	if(rom)
 	{
 		int adr, data;
 		puts("Uploading HRTmon ROM... ");
-		SendFileV2(&file, NULL, 0, 0xa10000, (file.size + 511) >> 9);
+		SendFileV2(rom, size, NULL, 0, 0xa10000, (size + 511) >> 9);
+		free(rom);
 		// HRTmon config
 		adr = 0xa10000 + 20;
 		spi_uio_cmd32_cont(UIO_MM2_WR, adr);
@@ -263,7 +261,6 @@ static char UploadActionReplay()
 		spi8((data >> 8) & 0xff); spi8((data >> 0) & 0xff);
 		DisableIO();
 
-		FileClose(&file);
 		return(1);
 	}
 	else {
@@ -489,8 +486,7 @@ int minimig_cfg_load(int num)
 
 	for (int i = 0; i < 4; i++)
 	{
-		df[i].status = 0;
-		FileClose(&df[i].file);
+		EjectFloppy(&df[i]);
 	}
 
 	// print config to boot screen
@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2010-01-09   - support for variable number of tracks
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../../hardware.h"
 #include "../../file_io.h"
@@ -32,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../menu.h"
+#include "../../spi.h"
 
 unsigned char drives = 0; // number of active drives reported by FPGA (may change only during reset)
 adfTYPE *pdfx;            // drive select pointer
@@ -48,61 +50,64 @@ unsigned char Error;
 #define SECTOR_COUNT 11
 #define LAST_SECTOR (SECTOR_COUNT - 1)
 #define GAP_SIZE (TRACK_SIZE - SECTOR_COUNT * SECTOR_SIZE)
+#define SECTOR_WORDS 544 // mfm words of a sector as sent
+#define FLUSH_DELAY 1000 // ms after the last write
 
 #define B2W(a,b) (((((uint16_t)(a))<<8) & 0xFF00) | ((uint16_t)(b) & 0x00FF))
 
-						  // sends the data in the sector buffer to the FPGA, translated into an Amiga floppy format sector
-						  // note that we do not insert clock bits because they will be stripped by the Amiga software anyway
-void SendSector(unsigned char *pData, unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl)
+// translates a sector into the Amiga floppy format as sent to the FPGA, the sync words are left 0
+// (they come from the FPGA with each request), see SendSector()
+// note that we do not insert clock bits because they will be stripped by the Amiga software anyway
+static void EncodeSector(uint16_t *w, const unsigned char *pData, unsigned char sector, unsigned char track)
 {
 	unsigned char checksum[4];
 	unsigned short i;
 	unsigned char x,y;
-	unsigned char *p;
+	const unsigned char *p;
 
 	// preamble
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
+	*w++ = 0xAAAA;
+	*w++ = 0xAAAA;
 
 	// synchronization
-	spi_w(B2W(dsksynch, dsksyncl));
-	spi_w(B2W(dsksynch, dsksyncl));
+	*w++ = 0;
+	*w++ = 0;
 
 	// odd bits of header
 	x = 0x55;
 	checksum[0] = x;
 	y = (track >> 1) & 0x55;
 	checksum[1] = y;
-	spi_w(B2W(x,y));
+	*w++ = B2W(x,y);
 
 	x = (sector >> 1) & 0x55;
 	checksum[2] = x;
 	y = ((11 - sector) >> 1) & 0x55;
 	checksum[3] = y;
-	spi_w(B2W(x, y));
+	*w++ = B2W(x, y);
 
 	// even bits of header
 	x = 0x55;
 	checksum[0] ^= x;
 	y = track & 0x55;
 	checksum[1] ^= y;
-	spi_w(B2W(x, y));
+	*w++ = B2W(x, y);
 
 	x = sector & 0x55;
 	checksum[2] ^= x;
 	y = (11 - sector) & 0x55;
 	checksum[3] ^= y;
-	spi_w(B2W(x, y));
+	*w++ = B2W(x, y);
 
 	// sector label and reserved area (changes nothing to checksum)
 	i = 0x10;
-	while (i--) spi_w(0xAAAA);
+	while (i--) *w++ = 0xAAAA;
 
 	// send header checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
+	*w++ = 0xAAAA;
+	*w++ = 0xAAAA;
+	*w++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*w++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
 
 	// calculate data checksum
 	checksum[0] = 0;
@@ -125,10 +130,10 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	}
 
 	// send data checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
+	*w++ = 0xAAAA;
+	*w++ = 0xAAAA;
+	*w++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*w++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
 
 	// odd bits of data field
 	i = DATA_SIZE / 4;
@@ -137,7 +142,7 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	{
 		x = (*p++ >> 1) | 0xAA;
 		y = (*p++ >> 1) | 0xAA;
-		spi_w(B2W(x, y));
+		*w++ = B2W(x, y);
 	}
 
 	// even bits of data field
@@ -147,10 +152,38 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	{
 		x = *p++ | 0xAA;
 		y = *p++ | 0xAA;
-		spi_w(B2W(x, y));
+		*w++ = B2W(x, y);
 	}
 }
 
+// sends an encoded sector with the sync word of the request
+static void SendSector(const uint16_t *mfm, unsigned short dsksync)
+{
+	spi_w(mfm[0]);
+	spi_w(mfm[1]);
+	spi_w(dsksync);
+	spi_w(dsksync);
+	spi_write((const uint8_t*)(mfm + 4), (SECTOR_WORDS - 4) * 2, 1);
+}
+
+// encoded sectors of the track, from the image in memory
+static const uint16_t *TrackMFM(adfTYPE *drive, unsigned char track)
+{
+	if (!drive->mfm[track])
+	{
+		uint16_t *mfm = (uint16_t*)malloc(SECTOR_COUNT * SECTOR_WORDS * sizeof(uint16_t));
+		if (!mfm) return NULL;
+
+		for (int sector = 0; sector < SECTOR_COUNT; sector++)
+		{
+			EncodeSector(mfm + sector * SECTOR_WORDS, drive->image + (track * SECTOR_COUNT + sector) * 512, sector, track);
+		}
+		drive->mfm[track] = mfm;
+	}
+
+	return drive->mfm[track];
+}
+
 void SendGap(void)
 {
 	unsigned short i = GAP_SIZE/2;
@@ -174,22 +207,19 @@ void ReadTrack(adfTYPE *drive)
 		drive->track = drive->tracks - 1;
 	}
 
-	unsigned long lba;
-
 	if (drive->track != drive->track_prev)
 	{ // track step or track 0, start at beginning of track
 		drive->track_prev = drive->track;
 		sector = 0;
 		drive->sector_offset = sector;
-		lba = drive->track * SECTOR_COUNT;
 	}
 	else
 	{ // same track, start at next sector in track
 		sector = drive->sector_offset;
-		lba = (drive->track * SECTOR_COUNT) + sector;
 	}
 
-	if (!FileSeekLBA(&drive->file, lba))
+	const uint16_t *mfm = drive->image ? TrackMFM(drive, drive->track) : NULL;
+	if (!mfm)
 	{
 		return;
 	}
@@ -207,8 +237,6 @@ void ReadTrack(adfTYPE *drive)
 
 	while (1)
 	{
-		FileReadSec(&drive->file, sector_buffer);
-
 		EnableFpga();
 
 		// check if FPGA is still asking for data
@@ -239,9 +267,7 @@ void ReadTrack(adfTYPE *drive)
 			// send sector if fpga is still asking for data
 			if (status & CMD_RDTRK)
 			{
-				//GenerateHeader(sector_header, sector_buffer, sector, track, dsksync);
-				//SendSector(sector_header, sector_buffer);
-				SendSector(sector_buffer, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
+				SendSector(mfm + sector * SECTOR_WORDS, dsksync);
 
 				if (sector == LAST_SECTOR)
 					SendGap();
@@ -264,11 +290,6 @@ void ReadTrack(adfTYPE *drive)
 		{
 			// go to the start of current track
 			sector = 0;
-			lba = drive->track * SECTOR_COUNT;
-			if (!FileSeekLBA(&drive->file, lba))
-			{
-				return;
-			}
 		}
 
 		// remember current sector
@@ -571,7 +592,7 @@ void WriteTrack(adfTYPE *drive)
 		{
 			if (Track == drive->track)
 			{
-				if (!FileSeekLBA(&drive->file, lba+Sector))
+				if (!drive->image || Track >= drive->tracks)
 				{
 					return;
 				}
@@ -580,7 +601,12 @@ void WriteTrack(adfTYPE *drive)
 				{
 					if (drive->status & DSK_WRITABLE)
 					{
-						FileWriteSec(&drive->file, sector_buffer);
+						// written back by FlushFloppy() once the writes stop
+						memcpy(drive->image + (lba + Sector) * 512, sector_buffer, 512);
+						free(drive->mfm[Track]);
+						drive->mfm[Track] = NULL;
+						drive->dirty[Track] = 1;
+						drive->flush_timer = GetTimer(FLUSH_DELAY);
 					}
 					else
 					{
@@ -607,11 +633,57 @@ void UpdateDriveStatus(void)
 	DisableFpga();
 }
 
+static void FlushFloppy(adfTYPE *drive)
+{
+	drive->flush_timer = 0;
+	if (!drive->image) return;
+
+	for (int track = 0; track < drive->tracks; track++)
+	{
+		if (!drive->dirty[track]) continue;
+		drive->dirty[track] = 0;
+
+		if (!FileSeekLBA(&drive->file, track * SECTOR_COUNT) ||
+			FileWriteAdv(&drive->file, drive->image + track * SECTOR_COUNT * 512, SECTOR_COUNT * 512) != SECTOR_COUNT * 512)
+		{
+			fdd_debugf("FlushFloppy: cannot write track %d\n", track);
+			Info("Write error");
+		}
+	}
+}
+
+void FlushFloppies(void)
+{
+	for (int i = 0; i < 4; i++) FlushFloppy(&df[i]);
+}
+
+void EjectFloppy(adfTYPE *drive)
+{
+	FlushFloppy(drive);
+
+	drive->status = 0;
+	FileClose(&drive->file);
+
+	free(drive->image);
+	drive->image = NULL;
+	for (int track = 0; track < MAX_TRACKS; track++)
+	{
+		free(drive->mfm[track]);
+		drive->mfm[track] = NULL;
+	}
+	memset(drive->dirty, 0, sizeof(drive->dirty));
+}
+
 void HandleFDD(unsigned char c1, unsigned char c2)
 {
 	unsigned char sel;
 	drives = (c1 >> 4) & 0x03; // number of active floppy drives
 
+	for (int i = 0; i < 4; i++)
+	{
+		if (df[i].flush_timer && CheckTimer(df[i].flush_timer)) FlushFloppy(&df[i]);
+	}
+
 	if (c1 & CMD_RDTRK)
 	{
 		sel = (c1 >> 6) & 0x03;
@@ -631,6 +703,7 @@ void InsertFloppy(adfTYPE *drive, char* path)
 {
 	int writable = FileCanWrite(path);
 
+	EjectFloppy(drive);
 	if (!FileOpenEx(&drive->file, path, writable ? O_RDWR | O_SYNC : O_RDONLY))
 	{
 		return;
@@ -647,6 +720,16 @@ void InsertFloppy(adfTYPE *drive, char* path)
 	}
 	drive->tracks = (unsigned char)tracks;
 
+	// the whole image is read now, so track steps don't wait for the storage
+	uint32_t size = tracks * SECTOR_COUNT * 512;
+	drive->image = (unsigned char*)malloc(size);
+	if (!drive->image || !FileSeekLBA(&drive->file, 0) || FileReadAdv(&drive->file, drive->image, size) != (int)size)
+	{
+		menu_debugf("Cannot read floppy image: \"%s\"\n", path);
+		EjectFloppy(drive);
+		return;
+	}
+
 	strcpy(drive->name, path);
 
 	// initialize the rest of drive struct
@@ -22,6 +22,10 @@ typedef struct
 	unsigned char track; /*current track*/
 	unsigned char track_prev; /*previous track*/
 	char          name[1024]; /*floppy name*/
+	unsigned char *image; /*whole image in memory*/
+	uint16_t      *mfm[MAX_TRACKS]; /*encoded tracks, made on first read*/
+	unsigned char dirty[MAX_TRACKS]; /*tracks not written back yet*/
+	unsigned long flush_timer; /*write back when expired*/
 } adfTYPE;
 
 extern unsigned char drives;
@@ -30,6 +34,8 @@ extern adfTYPE df[4];
 void UpdateDriveStatus(void);
 void HandleFDD(unsigned char c1, unsigned char c2);
 void InsertFloppy(adfTYPE *drive, char* path);
+void EjectFloppy(adfTYPE *drive);
+void FlushFloppies(void);
 
 #endif
 
@@ -17,6 +17,7 @@
 #include "../../spi.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../share_cache.h"
 #include "miminig_fs_messages.h"
 
 #define SHMEM_ADDR      0x27FF4000
@@ -50,7 +51,7 @@ struct lock
 {
 	uint16_t mode;
 	std::string path;
-	std::vector<dirent64> dir_items;
+	std::vector<share_item_t> dir_items;
 };
 
 static std::map<uint32_t, lock> locks;
@@ -211,6 +212,9 @@ static char* find_path(uint32_t key, const char *name)
 
 	dbg_print("Converted path: %s\n", str);
 
+	// AmigaOS names are case insensitive
+	if (str[0]) share_fix_case(str, baselen);
+
 	if (str[0])
 	{
 		char *p = strrchr(str, '/');
@@ -218,7 +222,7 @@ static char* find_path(uint32_t key, const char *name)
 		else
 		{
 			*p = 0;
-			if (!PathIsDir(str, 0)) str[0] = 0;
+			if (!share_is_dir(str)) str[0] = 0;
 			else *p = '/';
 		}
 	}
@@ -305,7 +309,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (!FileExists(str, 0) && !PathIsDir(str, 0))
+			if (!share_lookup(str))
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
@@ -409,6 +413,7 @@ static int process_request(void *reqres_buffer)
 
 			int disk_key = 666;
 			static char fn[256];
+			const struct stat64 *st = NULL;
 			if (rtype == ACTION_EXAMINE_OBJECT)
 			{
 				dbg_print("  examine first\n");
@@ -421,24 +426,17 @@ static int process_request(void *reqres_buffer)
 				}
 
 				locks[key].dir_items.clear();
-				if (PathIsDir(name, 0))
+				if (share_is_dir(name))
 				{
-					const char* full_path = getFullPath(name);
-					DIR *d = opendir(full_path);
-					if (!d)
+					const std::vector<share_item_t> *items = share_list(name);
+					if (!items)
 					{
-						printf("Couldn't open dir: %s\n", full_path);
+						printf("Couldn't open dir: %s\n", getFullPath(name));
 						ret = ERROR_OBJECT_WRONG_TYPE;
 						break;
 					}
 
-					struct dirent64 *de;
-					while ((de = readdir64(d)))
-					{
-						if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
-						locks[key].dir_items.push_back(*de);
-					}
-					closedir(d);
+					locks[key].dir_items = *items;
 				}
 			}
 			else
@@ -457,18 +455,26 @@ static int process_request(void *reqres_buffer)
 					break;
 				}
 
+				st = &locks[key].dir_items[listed].st;
 				strcat(name, "/");
-				strcat(name, locks[key].dir_items[listed].d_name);
-				memcpy(fn, locks[key].dir_items[listed].d_name, sizeof(fn));
+				strcat(name, locks[key].dir_items[listed].name.c_str());
+				snprintf(fn, sizeof(fn), "%s", locks[key].dir_items[listed].name.c_str());
 				ret = 0;
 			}
 
 			dbg_print("    name: %s\n", name);
 			dbg_print("    fn: %s\n", fn);
 
+			// Entries come with their stat from the listing, only the examined object itself is looked up
+			if (!st)
+			{
+				const share_item_t *it = share_lookup(name);
+				if (it) st = &it->st;
+			}
+
 			int type = 0;
-			if (FileExists(name, 0)) type = ST_FILE;
-			else if (PathIsDir(name, 0)) type = ST_USERDIR;
+			if (st && S_ISREG(st->st_mode)) type = ST_FILE;
+			else if (st && S_ISDIR(st->st_mode)) type = ST_USERDIR;
 			else
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
@@ -478,7 +484,6 @@ static int process_request(void *reqres_buffer)
 			time_t time = 0;
 			uint32_t size = 0;
 
-			struct stat64 *st = getPathStat(name);
 			if (st)
 			{
 				time = st->st_mtime;
@@ -579,7 +584,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (PathIsDir(name, 0))
+			if (share_is_dir(name))
 			{
 				ret = ERROR_OBJECT_WRONG_TYPE;
 				break;
@@ -601,6 +606,9 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
+			strcpy(open_file_handles[key].path, name);
+			if (mode & O_CREAT) share_changed(name);
+
 			res->arg1 = SWAP_INT(key);
 			ret = 0;
 		}
@@ -700,7 +708,9 @@ static int process_request(void *reqres_buffer)
 
 			if (open_file_handles.find(key) != open_file_handles.end())
 			{
-				FileClose(&open_file_handles[key]);
+				fileTYPE &f = open_file_handles[key];
+				FileClose(&f);
+				share_changed(f.path);
 				open_file_handles.erase(key);
 			}
 
@@ -723,15 +733,17 @@ static int process_request(void *reqres_buffer)
 				}
 
 				DISKLED_ON;
-				if (PathIsDir(name, 0))
+				if (share_is_dir(name))
 				{
 					ret = DirDelete(name) ? 0 : ERROR_DIRECTORY_NOT_EMPTY;
+					share_changed(name);
 					break;
 				}
 
-				if (FileExists(name, 0))
+				if (share_is_file(name))
 				{
 					ret = FileDelete(name) ? 0 : ERROR_OBJECT_NOT_FOUND;
+					share_changed(name);
 					break;
 				}
 			}
@@ -756,7 +768,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (!FileExists(cp1, 0) && !PathIsDir(cp1, 0))
+			if (!share_lookup(cp1))
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
@@ -781,7 +793,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
-			if (FileExists(cp2, 0) || PathIsDir(cp2, 0))
+			if (share_lookup(cp2))
 			{
 				ret = ERROR_OBJECT_EXISTS;
 				break;
@@ -794,6 +806,9 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
+			share_changed(buf);
+			share_changed(cp2);
+
 			ret = 0;
 		}
 		break;
@@ -813,6 +828,8 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
+			share_changed(name);
+
 			uint32_t key = add_lock(SHARED_LOCK, name);
 			res->key = SWAP_INT(key);
 
@@ -896,7 +913,7 @@ static int process_request(void *reqres_buffer)
 	return sz_res;
 }
 
-void minimig_share_poll()
+int minimig_share_poll()
 {
 	if (!shmem)
 	{
@@ -906,7 +923,7 @@ void minimig_share_poll()
 	else if(shmem != (uint8_t *)-1)
 	{
 		static uint32_t old_req_id = 0;
-		uint32_t req_id = *(uint32_t*)(shmem + REQUEST_FLG);
+		uint32_t req_id = *(volatile uint32_t*)(shmem + REQUEST_FLG);
 
 		if ((uint16_t)old_req_id != (uint16_t)req_id)
 		{
@@ -915,10 +932,13 @@ void minimig_share_poll()
 			if (((req_id>>16) & 0xFFFF) == 0x5AA5 && ((req_id - 77) & 0xFF) == ((req_id >> 8) & 0xFF))
 			{
 				process_request(shmem + REQUEST_BUFFER);
-				*(uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
+				*(volatile uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
+				return 1;
 			}
 		}
 	}
+
+	return 0;
 }
 
 void minimig_share_reset()
@@ -4,7 +4,7 @@
 
 #include <stdint.h>
 
-void minimig_share_poll();
+int minimig_share_poll(); // 1 if a request was served
 void minimig_share_reset();
 
 #endif
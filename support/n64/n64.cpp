@@ -1,12 +1,24 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../profiling.h"
+#include "../../hash_stream.h"
+#include "../../rom_hash.h"
+#include "../../rom_ram.h"
+#include "../../load_times.h"
+#include "../../swap_prim.h"
 #include "../../lib/md5/md5.h"
 
 #include "miniz.h"
@@ -253,27 +265,12 @@ static ByteOrder detect_rom_endianness(const uint8_t* data) {
 }
 
 static void normalize_data(uint8_t* data, size_t size, ByteOrder endianness) {
-	static uint8_t temp0, temp1, temp2;
 	switch (endianness) {
 	case ByteOrder::BYTE_SWAPPED:
-		for (size_t i = 0; i < (size & ~1U); i += 2) {
-			temp0 = data[0];
-			data[0] = data[1];
-			data[1] = temp0;
-			data += 2;
-		}
+		swap16(data, data, size);
 		break;
 	case ByteOrder::LITTLE_ENDIAN:
-		for (size_t i = 0; i < (size & ~3U); i += 4) {
-			temp0 = data[0];
-			temp1 = data[1];
-			temp2 = data[2];
-			data[0] = data[3];
-			data[1] = temp2;
-			data[2] = temp1;
-			data[3] = temp0;
-			data += 4;
-		}
+		swap32(data, data, size);
 		break;
 	default:
 		// Do nothing
@@ -281,6 +278,30 @@ static void normalize_data(uint8_t* data, size_t size, ByteOrder endianness) {
 	}
 }
 
+struct n64_xform_t {
+	bool first;
+	ByteOrder endianness;
+	hash_stream* hs;
+	uint8_t* keep;
+};
+
+// Transfer read-ahead stage: ROM endianness detected on the first chunk, every chunk
+// normalized to big-endian, then hashed and copied for rom_ram off the main core.
+static void n64_rom_xform(uint8_t* buf, uint32_t len, void* ctx) {
+	auto x = (n64_xform_t*)ctx;
+	if (x->first) {
+		x->endianness = (len >= 4) ? detect_rom_endianness(buf) : ByteOrder::UNKNOWN;
+		x->first = false;
+	}
+
+	normalize_data(buf, len, x->endianness);
+	if (x->hs) hash_stream_add(x->hs, buf, len);
+	if (x->keep) {
+		memcpy(x->keep, buf, len);
+		x->keep += len;
+	}
+}
+
 static MemoryType get_cart_save_type() {
 	auto v = (MemoryType)user_io_status_get(SAVE_TYPE_OPT);
 	return (get_save_size(v) ? v : MemoryType::NONE);
@@ -310,11 +331,11 @@ static uint32_t get_save_offset(unsigned char idx) {
 	return offset;
 }
 
-static char full_path[1024];
 static uint8_t save_file_buf[0x20000]; // Largest save size
 static uint8_t mounted_save_files = 0;
 
 static size_t create_file(const char* filename, const uint8_t* data, size_t sz) {
+	char full_path[1024];
 	snprintf(full_path, sizeof(full_path), "%s/%s", getRootDir(), filename);
 	FILE* fp = fopen(full_path, "w");
 	if (!fp) return 0;
@@ -324,6 +345,7 @@ static size_t create_file(const char* filename, const uint8_t* data, size_t sz)
 }
 
 static size_t read_file(const char* filename, uint8_t* data, uint32_t offset, size_t sz) {
+	char full_path[1024];
 	snprintf(full_path, sizeof(full_path), "%s/%s", getRootDir(), filename);
 	FILE* fp = fopen(full_path, "r");
 	if (!fp) return 0;
@@ -357,10 +379,31 @@ static bool is_empty(uint8_t* arr, size_t sz) {
 // Shouldn't be possible to allocate more than 5 save files right now...
 static N64SaveFile* save_files[8] = { nullptr };
 
+// Start of each mounted save in the core's save space, taken at mount time.
+// save_offsets[i + 1] is the end of save i.
+static uint32_t save_offsets[9] = { 0 };
+
+#define SAVE_BLOCK       512
+#define SAVE_FLUSH_DELAY 1000 // ms after the first write
+
+struct SaveRun {
+	off_t offset;
+	std::vector<uint8_t> data;
+};
+
 struct N64SaveFile {
 	int idx;
 	MemoryType type;
 
+	// Whole save in RAM, in core byte order. Reads of the core are served from
+	// here, writes go here and are written back to the file by flush().
+	uint8_t* data;
+	size_t size;
+	std::vector<uint8_t> dirty; // per SAVE_BLOCK
+	int dirty_count;
+	unsigned long flush_timer;
+	OffloadHandle writer;
+
 	fileTYPE* get_image() const {
 		return ((this->idx >= 0) && (this->idx < (int)(sizeof(save_files) / sizeof(*save_files)))) ? (fileTYPE*)::get_image(this->idx) : nullptr;
 	}
@@ -442,22 +485,123 @@ struct N64SaveFile {
 		user_io_file_mount(path, idx, 1, pre_size);
 		this->idx = idx;
 		save_files[idx] = this;
+		save_offsets[idx] = get_save_offset(idx);
+		save_offsets[idx + 1] = get_save_offset(idx + 1);
+		this->load();
 	}
 
-	void mount(const char* path, const char* old_path) {
-		this->create_if_missing(path, old_path);
-		this->mount(path);
+	// Mirror the mounted file, done once so the core never waits for the SD card
+	void load() {
+		fileTYPE* image = this->get_image();
+		if (!image || !image->filp || !image->size) return;
+
+		this->size = image->size;
+		this->data = (uint8_t*)malloc(this->size);
+		if (!this->data) {
+			printf("No memory to cache %s save file, using it directly.\n", stringify(this->type));
+			return;
+		}
+
+		size_t got = 0;
+		if (FileSeek(image, 0, SEEK_SET)) {
+			int ret = FileReadAdv(image, this->data, this->size);
+			if (ret > 0) got = ret;
+		}
+		if (got < this->size) memset(this->data + got, 0, this->size - got);
+
+		if ((this->type == MemoryType::CPAK) || (this->type == MemoryType::TPAK)) {
+			normalize_data(this->data, this->size, ByteOrder::LITTLE_ENDIAN);
+		}
+
+		this->dirty.assign((this->size + SAVE_BLOCK - 1) / SAVE_BLOCK, 0);
+		this->dirty_count = 0;
+		this->flush_timer = 0;
+	}
+
+	void write(uint32_t pos, const uint8_t* buf, uint32_t sz) {
+		memcpy(this->data + pos, buf, sz);
+		for (uint32_t blk = pos / SAVE_BLOCK; blk <= (pos + sz - 1) / SAVE_BLOCK; blk++) {
+			if (!this->dirty[blk]) {
+				this->dirty[blk] = 1;
+				this->dirty_count++;
+			}
+		}
+		if (!this->flush_timer) this->flush_timer = GetTimer(SAVE_FLUSH_DELAY);
+	}
+
+	// Write dirty blocks back, adjacent ones in one go. Unless sync is set the
+	// writes are done by a worker, a flush still in progress defers the next one.
+	void flush(bool sync) {
+		if (this->writer.valid()) {
+			if (!sync && !this->writer.done()) return;
+			this->writer.wait();
+			this->writer = OffloadHandle();
+		}
+
+		this->flush_timer = 0;
+		if (!this->dirty_count) return;
+
+		fileTYPE* image = this->get_image();
+		if (!image || !image->filp) return;
+
+		auto runs = std::make_shared<std::vector<SaveRun>>();
+		for (size_t blk = 0; blk < this->dirty.size(); blk++) {
+			if (!this->dirty[blk]) continue;
+
+			size_t end = blk;
+			while (end < this->dirty.size() && this->dirty[end]) this->dirty[end++] = 0;
+
+			size_t start = blk * SAVE_BLOCK;
+			size_t len = std::min(end * SAVE_BLOCK, this->size) - start;
+			runs->push_back({ (off_t)start, std::vector<uint8_t>(this->data + start, this->data + start + len) });
+			if ((this->type == MemoryType::CPAK) || (this->type == MemoryType::TPAK)) {
+				normalize_data(runs->back().data.data(), len, ByteOrder::LITTLE_ENDIAN);
+			}
+			blk = end;
+		}
+		this->dirty_count = 0;
+
+		diskled_on();
+		int fd = fileno(image->filp);
+		auto work = [fd, runs]() {
+			for (auto& run : *runs) {
+				if (pwrite(fd, run.data.data(), run.data.size(), run.offset) != (ssize_t)run.data.size()) {
+					printf("Failed to write %u bytes of save data at %u.\n", run.data.size(), (uint32_t)run.offset);
+				}
+			}
+			fdatasync(fd);
+		};
+
+		if (!sync) this->writer = offload_try_submit(work, OFFLOAD_PRIO_IO);
+		if (!this->writer.valid()) work();
 	}
 
 	void unmount() {
 		if (!this->is_mounted()) return;
+		this->flush(true);
+		free(this->data);
+		this->data = nullptr;
+		this->size = 0;
 		printf("Unmounting %s save file at %d slot.\n", stringify(this->type), this->idx);
 		user_io_file_mount("", this->idx);
 	}
 
+	void mount(const char* path, const char* old_path) {
+		this->create_if_missing(path, old_path);
+		this->mount(path);
+	}
+
 	N64SaveFile(MemoryType type) {
 		this->idx = -1; // Unmounted
 		this->type = type;
+		this->data = nullptr;
+		this->size = 0;
+		this->dirty_count = 0;
+		this->flush_timer = 0;
+	}
+
+	~N64SaveFile() {
+		free(this->data);
 	}
 };
 
@@ -641,6 +785,7 @@ static bool parse_and_apply_db_tags(char* tags) {
 
 	printf("Auto-detect is ON, updating OSD settings.\n");
 
+	user_io_status_hold(1);
 	if (system_type != SystemType::UNKNOWN) user_io_status_set(SYS_TYPE_OPT, (uint32_t)system_type);
 	if (cic_type != CIC::UNKNOWN) user_io_status_set(CIC_TYPE_OPT, (uint32_t)cic_type);
 
@@ -654,115 +799,295 @@ static bool parse_and_apply_db_tags(char* tags) {
 	if (is_autopak() && ((PadType)user_io_status_get(CONTROLLER_OPTS[0]) != PadType::SNAC)) {
 		user_io_status_set(CONTROLLER_OPTS[0], (uint32_t)prefered_pad);
 	}
+	user_io_status_hold(0);
 
 	return (system_type != SystemType::UNKNOWN && cic_type != CIC::UNKNOWN);
 }
 
-static bool md5_matches(const char* line, const char* md5) {
-	for (size_t i = MD5_LENGTH * 2; i > 0; --i, line++, md5++) {
-		int c = *line;
-		if (!c || *md5 != tolower(c)) {
-			return false;
-		}
+/* The text DBs are compiled into a binary index the first time they are used
+   and again whenever the text file changes. The index is kept in memory and
+   saved to the config folder so the next session can skip parsing.
+   Layout: header, MD5 entries sorted by hash, ID entries in file order, tag strings. */
+
+static constexpr uint32_t DB_INDEX_VERSION = 1;
+static constexpr uint32_t DB_TAGS_MALFORMED = 0x80000000;
+
+struct db_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t src_size;
+	int64_t src_mtime;
+	uint32_t md5_count;
+	uint32_t id_count;
+	uint32_t text_size;
+	uint32_t reserved;
+};
+
+struct db_md5_entry {
+	uint8_t md5[MD5_LENGTH];
+	uint32_t tags; // offset into the tag strings, DB_TAGS_MALFORMED if there are none
+};
+
+struct db_id_entry {
+	char id[CARTID_LENGTH]; // '_' = don't care
+	uint8_t len; // number of characters to compare
+	uint8_t reserved;
+	uint32_t tags;
+};
+
+struct db_index {
+	uint8_t* data;
+	uint32_t size;
+	const db_index_header* hdr;
+	const db_md5_entry* md5;
+	const db_id_entry* id;
+	const char* text;
+};
+
+static const char* DB_FILE_NAMES[] = {
+	"N64-database_user.txt",
+	"N64-database.txt"
+};
+
+static constexpr size_t DB_FILE_COUNT = sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES);
+static db_index db_indexes[DB_FILE_COUNT];
+
+static int hex_digit(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+// Parses 32 hex characters, returns false if the line doesn't start with a hash
+static bool parse_md5(const char* hex, uint8_t* md5) {
+	for (size_t i = 0; i < MD5_LENGTH; i++) {
+		int hi = hex_digit(hex[i * 2]);
+		int lo = (hi < 0) ? -1 : hex_digit(hex[i * 2 + 1]);
+		if (lo < 0) return false;
+		md5[i] = (uint8_t)((hi << 4) | lo);
 	}
 
 	return true;
 }
 
-// Returns numbers of matching characters if match, otherwize 0
-static size_t cart_id_is_match(const char* line, const char* cart_id) {
-	const auto prefix_len = strlen(CARTID_PREFIX);
+// Adds the tags following the key, same rules as sscanf("%*[ \t]%[^#;]")
+static uint32_t add_db_tags(std::vector<char>& text, const char* s) {
+	const char* p = s;
+	while (*p == ' ' || *p == '\t') p++;
 
-	// A valid ID line should start with "ID:"
-	if (strncmp(line, CARTID_PREFIX, prefix_len)) {
-		return 0;
+	size_t len = strcspn(p, "#;");
+	bool malformed = (p == s) || !len;
+	if (malformed) {
+		// Keep the raw text for the error message
+		p = s;
+		len = strlen(s);
 	}
 
-	// Skip the line if it doesn't match our cart_id, '_' = don't care
-	const char* lp = line + prefix_len;
-	for (size_t i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
-		if (i && isspace(*lp)) {
-			return i; // Early termination
-		}
+	uint32_t ofs = (uint32_t)text.size();
+	text.insert(text.end(), p, p + len);
+	text.push_back('\0');
+	return malformed ? (ofs | DB_TAGS_MALFORMED) : ofs;
+}
 
-		if (*lp != '_' && *lp != cart_id[i]) {
-			return 0; // Character didn't match pattern
-		}
+static bool db_index_attach(db_index* idx, uint8_t* data, uint32_t size) {
+	auto hdr = (const db_index_header*)data;
+	if (size < sizeof(db_index_header) || memcmp(hdr->magic, "N64DBIX", 8) || hdr->version != DB_INDEX_VERSION) {
+		return false;
+	}
+
+	uint64_t need = sizeof(db_index_header) + (uint64_t)hdr->md5_count * sizeof(db_md5_entry) +
+		(uint64_t)hdr->id_count * sizeof(db_id_entry) + hdr->text_size;
+	if (need != size || !hdr->text_size || data[size - 1]) {
+		return false;
 	}
 
-	return CARTID_LENGTH;
+	idx->data = data;
+	idx->size = size;
+	idx->hdr = hdr;
+	idx->md5 = (const db_md5_entry*)(data + sizeof(db_index_header));
+	idx->id = (const db_id_entry*)(idx->md5 + hdr->md5_count);
+	idx->text = (const char*)(idx->id + hdr->id_count);
+	return true;
 }
 
-static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
+static bool db_index_build(db_index* idx, const char* path, const struct stat64* st) {
 	fileTextReader reader = {};
-
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
-
-	if (!FileOpenTextReader(&reader, full_path)) {
-		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+	if (!FileOpenTextReader(&reader, path)) {
+		return false;
 	}
 
+	std::vector<db_md5_entry> md5s;
+	std::vector<db_id_entry> ids;
+	std::vector<char> text;
+	const auto prefix_len = strlen(CARTID_PREFIX);
+
 	while (const char* line = FileReadLine(&reader)) {
-		// Skip the line if it doesn't start with our hash
-		if (!md5_matches(line, lookup_hash)) continue;
-
-		const char* s = line + (MD5_LENGTH * 2);
-		char* tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
-			return 2;
+		db_md5_entry m;
+		if (parse_md5(line, m.md5)) {
+			m.tags = add_db_tags(text, line + (MD5_LENGTH * 2));
+			md5s.push_back(m);
+			continue;
 		}
 
-		printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+		// A valid ID line should start with "ID:"
+		if (strncmp(line, CARTID_PREFIX, prefix_len)) continue;
+
+		db_id_entry e = {};
+		const char* lp = line + prefix_len;
+		while (e.len < CARTID_LENGTH && *lp && !(e.len && isspace(*lp))) {
+			e.id[e.len++] = *lp++;
+		}
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+		if (!e.len) continue;
+		e.tags = add_db_tags(text, lp);
+		ids.push_back(e);
 	}
 
-	return 0;
+	// Entries with the same hash keep their file order, so the first one wins as before
+	std::stable_sort(md5s.begin(), md5s.end(), [](const db_md5_entry& a, const db_md5_entry& b) {
+		return memcmp(a.md5, b.md5, MD5_LENGTH) < 0;
+	});
+
+	if (text.empty()) text.push_back('\0');
+
+	uint32_t size = sizeof(db_index_header) + md5s.size() * sizeof(db_md5_entry) +
+		ids.size() * sizeof(db_id_entry) + text.size();
+	uint8_t* data = (uint8_t*)malloc(size);
+	if (!data) return false;
+
+	db_index_header hdr = {};
+	memcpy(hdr.magic, "N64DBIX", 8);
+	hdr.version = DB_INDEX_VERSION;
+	hdr.src_size = (uint32_t)st->st_size;
+	hdr.src_mtime = st->st_mtime;
+	hdr.md5_count = md5s.size();
+	hdr.id_count = ids.size();
+	hdr.text_size = text.size();
+
+	uint8_t* p = data;
+	memcpy(p, &hdr, sizeof(hdr)); p += sizeof(hdr);
+	if (!md5s.empty()) { memcpy(p, md5s.data(), md5s.size() * sizeof(db_md5_entry)); p += md5s.size() * sizeof(db_md5_entry); }
+	if (!ids.empty()) { memcpy(p, ids.data(), ids.size() * sizeof(db_id_entry)); p += ids.size() * sizeof(db_id_entry); }
+	memcpy(p, text.data(), text.size());
+
+	return db_index_attach(idx, data, size);
 }
 
-static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
-	fileTextReader reader = {};
+static void db_index_cache_name(char* out, size_t size, const char* db_file_name) {
+	snprintf(out, size, "n64/%s.idx", db_file_name);
+}
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+// Returns the index of the DB file, rebuilding it if the text file has changed
+static const db_index* get_db_index(size_t db) {
+	const char* db_file_name = DB_FILE_NAMES[db];
+	db_index* idx = &db_indexes[db];
 
-	if (!FileOpenTextReader(&reader, full_path)) {
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+	struct stat64* pst = getPathStat(full_path);
+	if (!pst) {
 		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+		return nullptr;
 	}
+	struct stat64 st = *pst;
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip lines that doesn't start with our ID
-		size_t i;
-		if (!(i = cart_id_is_match(line, cart_id))) continue;
+	auto is_current = [&st](const db_index* i) {
+		return i->hdr && i->hdr->src_size == (uint32_t)st.st_size && i->hdr->src_mtime == (int64_t)st.st_mtime;
+	};
+
+	if (is_current(idx)) {
+		return idx;
+	}
 
-		auto s = line + strlen(CARTID_PREFIX) + i;
-		auto tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
-			return 2;
+	free(idx->data);
+	*idx = {};
+
+	char cache_name[256];
+	db_index_cache_name(cache_name, sizeof(cache_name), db_file_name);
+
+	int size = FileLoadConfig(cache_name, 0, 0);
+	if (size > 0) {
+		uint8_t* data = (uint8_t*)malloc(size);
+		if (data && FileLoadConfig(cache_name, data, size) == size && db_index_attach(idx, data, size) && is_current(idx)) {
+			return idx;
 		}
 
-		printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags);
+		free(data);
+		*idx = {};
+	}
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	uint64_t start = trace_now_us();
+	if (!db_index_build(idx, full_path, &st)) {
+		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
+		return nullptr;
 	}
 
-	return 0;
+	printf("Indexed N64 data file \"%s\": %u hashes, %u IDs in %llums.\n", db_file_name,
+		idx->hdr->md5_count, idx->hdr->id_count, (trace_now_us() - start) / 1000);
+
+	FileSaveConfig(cache_name, idx->data, idx->size);
+	return idx;
 }
 
-static const char* DB_FILE_NAMES[] = {
-	"N64-database_user.txt",
-	"N64-database.txt"
-};
+// tags is a copy since parse_and_apply_db_tags splits it in place
+static uint8_t apply_db_entry(const db_index* idx, uint32_t tags, const char* key_name, const char* key) {
+	const char* s = idx->text + (tags & ~DB_TAGS_MALFORMED);
+	if (tags & DB_TAGS_MALFORMED) {
+		printf("Found ROM entry for %s %s, but the tag was malformed! \"%s\".\n", key_name, key, s);
+		return 2;
+	}
+
+	printf("Found ROM entry for %s %s: [%s]\n", key_name, key, s);
+
+	char* copy = strdup(s);
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	uint8_t detected = parse_and_apply_db_tags(copy) ? 3 : 2;
+	free(copy);
+	return detected;
+}
+
+static uint8_t detect_rom_settings_in_db(const char* lookup_hash, size_t db) {
+	const db_index* idx = get_db_index(db);
+	uint8_t md5[MD5_LENGTH];
+	if (!idx || !parse_md5(lookup_hash, md5)) return 0;
+
+	const db_md5_entry* first = idx->md5;
+	const db_md5_entry* last = idx->md5 + idx->hdr->md5_count;
+	const db_md5_entry* e = std::lower_bound(first, last, md5, [](const db_md5_entry& a, const uint8_t* b) {
+		return memcmp(a.md5, b, MD5_LENGTH) < 0;
+	});
+
+	if (e == last || memcmp(e->md5, md5, MD5_LENGTH)) return 0;
+	return apply_db_entry(idx, e->tags, "MD5", lookup_hash);
+}
+
+static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, size_t db) {
+	const db_index* idx = get_db_index(db);
+	if (!idx) return 0;
+
+	// ID patterns can have wildcards, so these are checked in file order
+	for (uint32_t n = 0; n < idx->hdr->id_count; n++) {
+		const db_id_entry* e = &idx->id[n];
+		size_t i;
+		for (i = 0; i < e->len; i++) {
+			if (e->id[i] != '_' && e->id[i] != cart_id[i]) break;
+		}
+
+		if (i == e->len) {
+			char id[CARTID_LENGTH + 3];
+			snprintf(id, sizeof(id), "[%s]", cart_id);
+			return apply_db_entry(idx, e->tags, "ID", id);
+		}
+	}
+
+	return 0;
+}
 
 static uint8_t detect_rom_settings_in_dbs_with_md5(const char* lookup_hash) {
 	uint8_t detected = 0;
-	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db(lookup_hash, DB_FILE_NAMES[i]))) {
+	for (auto i = 0U; i < DB_FILE_COUNT; i++) {
+		if ((detected = detect_rom_settings_in_db(lookup_hash, i))) {
 			break;
 		}
 	}
@@ -783,8 +1108,8 @@ static uint8_t detect_rom_settings_in_dbs_with_cartid(const char* lookup_id) {
 	}
 
 	uint8_t detected = 0;
-	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, DB_FILE_NAMES[i]))) {
+	for (auto i = 0U; i < DB_FILE_COUNT; i++) {
+		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, i))) {
 			break;
 		}
 	}
@@ -1163,29 +1488,58 @@ static void get_old_save_path(char* save_path) {
 	}
 }
 
+// Save file holding pos of the save space, pos is made relative to it
+static N64SaveFile* find_save(int64_t& pos, unsigned char& file_idx) {
+	for (file_idx = 0; file_idx < mounted_save_files; file_idx++) {
+		N64SaveFile* save_file = save_files[file_idx];
+		if (!save_file || !save_file->is_mounted()) break;
+		if (pos < save_offsets[file_idx + 1]) {
+			pos -= save_offsets[file_idx];
+			return save_file;
+		}
+	}
+
+	return nullptr;
+}
+
+static void flush_saves(bool sync) {
+	for (size_t i = 0; i < (sizeof(save_files) / sizeof(*save_files)); i++) {
+		N64SaveFile* save_file = save_files[i];
+		if (!save_file || !save_file->is_mounted()) continue;
+		if (sync || (save_file->flush_timer && CheckTimer(save_file->flush_timer)) || save_file->writer.valid()) {
+			save_file->flush(sync);
+		}
+	}
+}
+
+void n64_save_flush() {
+	flush_saves(true);
+}
+
 void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buffer, uint32_t buffer_size, uint32_t blksz, uint32_t sz) {
-	int invalid = 0;
 	int done = 0;
-	unsigned char file_idx = 0;
+	unsigned char file_idx;
 	int64_t pos = lba * blksz;
-	N64SaveFile* save_file;
+	N64SaveFile* save_file = find_save(pos, file_idx);
+	fileTYPE* image = nullptr;
 
-	do {
-		if ((file_idx >= mounted_save_files) || !(save_file = save_files[file_idx]) || !save_file->is_mounted()) {
-			buffer_lba = -1;
-			invalid = 1;
-			break;
-		}
-		if (pos < get_save_offset(file_idx + 1)) {
-			break;
+	if (!save_file) {
+		buffer_lba = -1;
+	}
+	else if (save_file->data) {
+		if (pos < (int64_t)save_file->size) {
+			uint32_t read_sz = std::min((uint64_t)sz, (uint64_t)(save_file->size - pos));
+			memcpy(buffer, save_file->data + pos, read_sz);
+			if (read_sz < sz) {
+				// Pad block that wasn't filled completely
+				memset(buffer + read_sz, 0, sz - read_sz);
+			}
+			done = 1;
+			buffer_lba = lba;
 		}
-		file_idx++;
-	} while (1);
-
-	fileTYPE* image;
-	if (!invalid && (image = save_file->get_image()) && image->size) {
+	}
+	else if ((image = save_file->get_image()) && image->size) {
 		diskled_on();
-		pos -= get_save_offset(file_idx);
 		uint32_t read_sz;
 		if (FileSeek(image, pos, SEEK_SET) && (read_sz = FileReadAdv(image, buffer, sz))) {
 			if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
@@ -1202,7 +1556,7 @@ void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 
 	// Even after error we have to provide the block to the core
 	// Give an empty block.
-	if (!done || invalid) {
+	if (!done) {
 		memset(buffer, 0, buffer_size);
 	}
 
@@ -1212,8 +1566,8 @@ void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	spi_block_write(buffer, user_io_get_width(), sz);
 	DisableIO();
 
-	if (done && ((pos + blksz) >= image->size)) {
-		printf("Loaded save data from \"%s\". (%lld bytes)\n", get_image_name(file_idx), image->size);
+	if (done && ((pos + blksz) >= save_file->get_image()->size)) {
+		printf("Loaded save data from \"%s\". (%lld bytes)\n", get_image_name(file_idx), save_file->get_image()->size);
 	}
 }
 
@@ -1221,22 +1575,10 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	menu_process_save();
 
 	buffer_lba = -1;
-	int invalid = 0;
 	int done = 0;
-	unsigned char file_idx = 0;
+	unsigned char file_idx;
 	int64_t pos = lba * blksz;
-	N64SaveFile* save_file;
-
-	do {
-		if ((file_idx >= mounted_save_files) || !(save_file = save_files[file_idx]) || !save_file->is_mounted()) {
-			invalid = 1;
-			break;
-		}
-		if (pos < get_save_offset(file_idx + 1)) {
-			break;
-		}
-		file_idx++;
-	} while (1);
+	N64SaveFile* save_file = find_save(pos, file_idx);
 
 	// Fetch sector data from FPGA ...
 	EnableIO();
@@ -1244,11 +1586,10 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	spi_block_read(buffer, user_io_get_width(), sz);
 	DisableIO();
 
-	if (invalid) {
+	if (!save_file) {
 		return;
 	}
 
-	pos -= get_save_offset(file_idx);
 	fileTYPE* image;
 
 	if (!sz || !(image = save_file->get_image()) || (pos >= image->size)) {
@@ -1259,12 +1600,20 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 		sz = image->size - pos;
 	}
 
-	diskled_on();
-	if (FileSeek(image, pos, SEEK_SET)) {
-		if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
-			normalize_data(buffer, sz, ByteOrder::LITTLE_ENDIAN);
+	if (save_file->data && (pos + sz <= (int64_t)save_file->size)) {
+		// Written back later by flush_saves(), a Controller Pak game saving
+		// many blocks in a row costs a single write
+		save_file->write(pos, buffer, sz);
+		done = 1;
+	}
+	else {
+		diskled_on();
+		if (FileSeek(image, pos, SEEK_SET)) {
+			if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
+				normalize_data(buffer, sz, ByteOrder::LITTLE_ENDIAN);
+			}
+			done = FileWriteAdv(image, buffer, sz, -1) >= 0;
 		}
-		done = FileWriteAdv(image, buffer, sz, -1) >= 0;
 	}
 
 	if (done && ((pos + blksz) >= image->size)) {
@@ -1394,6 +1743,8 @@ void n64_reset() {
 void n64_poll() {
 	static uint8_t adj = 0;
 
+	flush_saves(false);
+
 	if (!poll_timer || CheckTimer(poll_timer)) {
 
 		if (!(loaded && is_fpga_ready(0))) {
@@ -1454,12 +1805,24 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	static uint8_t buf[4096];
 	fileTYPE f;
 
-	if (!FileOpen(&f, name, 1)) {
+	LOAD_SCOPE("rom", name);
+
+	// A ROM loaded before comes out of RAM already normalized and hashed (Game Boy files are read)
+	const rom_ram_t* kept = ((idx & 0x3f) != 2) ? rom_ram_get(name, ROM_RAM_N64) : nullptr;
+	const char* fname = strrchr(name, '/');
+	fname = kept ? (fname ? fname + 1 : name) : f.name;
+
+	uint64_t t = trace_now_us();
+	int opened = kept || FileOpen(&f, name, 1);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!opened) {
+		load_failed();
 		return 0;
 	}
 
-	uint32_t data_size = f.size;
+	uint32_t data_size = kept ? kept->size : f.size;
 	uint32_t data_left = data_size;
+	load_bytes(data_size);
 
 	printf("N64 file \"%s\" with %u bytes to send for index %02x.\n", name, data_size, idx);
 
@@ -1496,9 +1859,12 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 
 		while (data_left) {
 			uint32_t chunk = (data_left > sizeof(buf)) ? sizeof(buf) : data_left;
+			t = trace_now_us();
 			FileReadAdv(&f, buf, chunk);
+			t = load_phase_next(LOAD_READ, t);
 
 			user_io_file_tx_data(buf, chunk);
+			load_phase_next(LOAD_TX, t);
 
 			ProgressMessage("Loading", f.name, data_size - data_left, data_size);
 			data_left -= chunk;
@@ -1534,7 +1900,6 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	   2 = Found some ROM info in DB (Save type etc.), but System region and/or CIC has not been determined
 	   3 = Has detected everything, System type, CIC, Save type etc. */
 	uint8_t rom_settings_detected = 0;
-	ByteOrder rom_endianness;
 	uint8_t md5[MD5_LENGTH];
 	char md5_hex[MD5_LENGTH * 2 + 1];
 	uint64_t bootcode_sums[2] = { };
@@ -1551,52 +1916,77 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	void* mem = load_addr ? (uint8_t*)shmem_map(fpga_mem(load_addr), data_size) : nullptr;
 	uint8_t* write_ptr = (uint8_t*)mem;
 
-	MD5Context ctx;
-	MD5Init(&ctx);
+	// File MD5 and the CRC32 (of the byte swapped data) are computed on another core during the transfer.
+	// Big endian ROMs aren't changed by normalizing, so hashes from the background index can be used as is.
+	rom_hash_t indexed;
+	bool use_indexed = !kept && rom_hash_get(name, &indexed) && (indexed.flags & ROM_HASH_SWAP16);
+
+	hash_stream* hs = (use_indexed || kept) ? nullptr : hash_stream_open(HASH_MD5 | HASH_CRC32_SWAP16);
+
+	// the normalized data is kept for the next load
+	rom_ram_t* keep = kept ? nullptr : rom_ram_begin(name, ROM_RAM_N64, data_size);
 
 	// prepare transmission of new file
 	user_io_set_download(1, load_addr ? data_size : 0);
 	ProgressMessage();
+	FileReadOnce(&f);
 
-	while (data_left) {
-		size_t chunk = (data_left > sizeof(buf)) ? sizeof(buf) : data_left;
-
-		FileReadAdv(&f, buf, chunk);
-
-		// Perform sanity checks and detect ROM endianness
-		if (is_first_chunk) {
-			if (chunk < 4096) {
-				// Signal end of transmission
-				user_io_set_download(0);
-				*current_rom_path = '\0';
-				printf("Failed to load ROM: must be at least 4096 bytes.\n");
-
-				return 0;
-			}
+	n64_xform_t xform = { true, ByteOrder::UNKNOWN, hs, keep ? keep->data : nullptr };
+	tx_pipe_t* pipe = (kept || (!hs && !use_indexed)) ? nullptr : user_io_tx_pipe_open(&f, data_size, n64_rom_xform, &xform);
+	if (!kept && !pipe) {
+		user_io_set_download(0);
+		if (hs) hash_stream_close(hs, nullptr);
+		rom_ram_abort(keep);
+		if (mem) shmem_unmap(mem, data_size);
+		FileClose(&f);
+		*current_rom_path = '\0';
+		printf("Failed to load ROM: out of memory.\n");
+		load_failed();
+		return 0;
+	}
 
-			rom_endianness = detect_rom_endianness(buf);
+	while (data_left) {
+		uint32_t chunk;
+		const uint8_t* chunk_buf;
+		if (kept) {
+			chunk = (data_left > HASH_STREAM_CHUNK) ? HASH_STREAM_CHUNK : data_left;
+			chunk_buf = kept->data + (data_size - data_left);
+		}
+		else {
+			// read, normalized, hashed and kept on the other core
+			chunk_buf = user_io_tx_pipe_next(pipe, &chunk);
+			if (!chunk_buf) break;
 		}
 
-		// Normalize data to big-endian format, if needed
-		normalize_data(buf, chunk, rom_endianness);
-		MD5Update(&ctx, buf, chunk);
+		// Perform sanity checks
+		if (is_first_chunk && chunk < 4096) {
+			// Signal end of transmission
+			user_io_set_download(0);
+			user_io_tx_pipe_close(pipe);
+			if (hs) hash_stream_close(hs, nullptr);
+			rom_ram_abort(keep);
+			if (mem) shmem_unmap(mem, data_size);
+			FileClose(&f);
+			*current_rom_path = '\0';
+			printf("Failed to load ROM: must be at least 4096 bytes.\n");
+			load_failed();
+
+			return 0;
+		}
 
 		if (is_first_chunk) {
-			/* Try to detect ROM settings based on header MD5 hash.
-			   For calculating the MD5 hash of the header, we need to make a
-			   copy of the context before calling MD5Final, otherwise the file
-			   hash will be incorrect later on. */
-
+			// Try to detect ROM settings based on header MD5 hash (first 4096 bytes).
 			MD5Context ctx_header;
-			memcpy(&ctx_header, &ctx, sizeof(struct MD5Context));
+			MD5Init(&ctx_header);
+			MD5Update(&ctx_header, chunk_buf, 4096);
 			MD5Final(md5, &ctx_header);
 			md5_to_hex(md5, md5_hex);
 			printf("Header MD5 hash: %s\n", md5_hex);
 
-			trim(internal_name, 20, (char*)&buf[0x20]);
+			trim(internal_name, 20, (char*)&chunk_buf[0x20]);
 			rom_settings_detected = detect_rom_settings_in_dbs_with_md5(md5_hex);
-			memcpy(controller_settings, &buf[0x34], sizeof(controller_settings));
-			calc_bootcode_checksums(bootcode_sums, buf);
+			memcpy(controller_settings, &chunk_buf[0x34], sizeof(controller_settings));
+			calc_bootcode_checksums(bootcode_sums, chunk_buf);
 
 			/* The first byte (starting at 0x3b) indicates the type of ROM
 				 'N' = Cartridge
@@ -1608,7 +1998,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			   The 4th byte indicates the region and language for the game
 			   The 5th byte indicates the revision of the game */
 
-			auto p_cid = (char*)&buf[0x3b];
+			auto p_cid = (char*)&chunk_buf[0x3b];
 			for (auto i = 0; i < 4; i++, p_cid++) {
 				if (isalnum(*p_cid)) {
 					cart_id[i] = *p_cid;
@@ -1619,7 +2009,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			}
 
 			if (strncmp(cart_id, "????", 4)) {
-				sprintf(cart_id + 4, "%02X", buf[0x3f]);
+				sprintf(cart_id + 4, "%02X", chunk_buf[0x3f]);
 				printf("Cartridge ID: %s\n", cart_id);
 			}
 			else {
@@ -1628,25 +2018,47 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 		}
 
 		// Copy to DDR memory for fast ROM loading
+		t = trace_now_us();
 		if (mem) {
-			memcpy(write_ptr, buf, chunk);
+			memcpy(write_ptr, chunk_buf, chunk);
 			write_ptr += chunk;
 		}
 		else {
 			// Fallback to normal (slow) loading
-			user_io_file_tx_data(buf, chunk);
+			user_io_file_tx_data(chunk_buf, chunk);
 		}
+		load_phase_next(LOAD_TX, t);
+		if (pipe) user_io_tx_pipe_done(pipe);
 
-		ProgressMessage("Loading", f.name, data_size - data_left, data_size);
+		ProgressMessage("Loading", fname, data_size - data_left, data_size);
 		data_left -= chunk;
 		is_first_chunk = false;
+	}
+	user_io_tx_pipe_close(pipe);
 
-		// CRC32 is used for cheat look-up. Cheat files from gamehacking.org use byte swapped CRC32 for some reason...
-		normalize_data(buf, chunk, ByteOrder::BYTE_SWAPPED);
-		file_crc = crc32(file_crc, buf, chunk);
+	// CRC32 is used for cheat look-up. Cheat files from gamehacking.org use byte swapped CRC32 for some reason...
+	t = trace_now_us();
+	if (hs) {
+		hash_result hashes;
+		hash_stream_close(hs, &hashes);
+		file_crc = hashes.crc;
+		memcpy(md5, hashes.md5, MD5_LENGTH);
+	}
+	else if (kept) {
+		file_crc = kept->crc;
+		memcpy(md5, kept->md5, MD5_LENGTH);
 	}
+	else {
+		file_crc = indexed.crc_swap16;
+		memcpy(md5, indexed.md5, MD5_LENGTH);
+	}
+	load_phase_next(LOAD_HASH, t);
 
-	MD5Final(md5, &ctx);
+	if (keep) {
+		keep->crc = file_crc;
+		memcpy(keep->md5, md5, MD5_LENGTH);
+		rom_ram_commit(keep);
+	}
 	md5_to_hex(md5, md5_hex);
 	printf("File MD5: %s\n", md5_hex);
 
@@ -1666,12 +2078,14 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 					printf("No ROM information found for Cart ID.\n");
 					if (is_auto()) {
 						// Defaulting misc. System Settings, everything OFF
+						user_io_status_hold(1);
 						user_io_status_set(NO_EPAK_OPT, 0); // Enable Expansion Pak
 						user_io_status_set(CPAK_OPT, 0); // Disable Controller Pak
 						user_io_status_set(RPAK_OPT, 0); // Disable Rumble Pak
 						user_io_status_set(TPAK_OPT, 0); // Disable Transfer Pak
 						user_io_status_set(RTC_OPT, 0); // Disable RTC
 						set_cart_save_type(MemoryType::NONE); // Disable Save
+						user_io_status_hold(0);
 					}
 				}
 			}
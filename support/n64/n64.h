@@ -19,4 +19,7 @@ int n64_rom_tx(const char* name, unsigned char index, uint32_t load_addr, uint32
 void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buffer, uint32_t buffer_size, uint32_t blksz, uint32_t sz);
 void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buffer, uint32_t blksz, uint32_t sz);
 
+// Writes cached save data back to the files, before the core goes away.
+void n64_save_flush();
+
 #endif
\ No newline at end of file
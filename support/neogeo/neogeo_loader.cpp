@@ -7,12 +7,19 @@
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
 #include "neogeo_loader.h"
 #include "neogeocd.h"
+#include "neogeo_xml.h"
 #include "../../sxmlc.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../load_times.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 struct NeoFile
 {
@@ -52,7 +59,20 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	Out: FEDCBA9876 15432 0
 	*/
 
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	uint32_t i = 0;
+
+#ifdef __ARM_NEON
+	// Each 32 word block is words 16-31 interleaved with words 0-15
+	for (; i + 32 <= size; i += 32)
+	{
+		uint16x8x2_t lo = { { vld1q_u16(buf_in + i + 16), vld1q_u16(buf_in + i) } };
+		uint16x8x2_t hi = { { vld1q_u16(buf_in + i + 24), vld1q_u16(buf_in + i + 8) } };
+		vst2q_u16(buf_out + i, lo);
+		vst2q_u16(buf_out + i + 16, hi);
+	}
+#endif
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 
 	/*
 	0 <- 20
@@ -78,9 +98,48 @@ static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t
 	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 }
 
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+// swap: also exchange the middle bytes of every 32 bit word of the input first
+static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size, int swap = 0)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+	uint32_t i = 0;
+
+#ifdef __ARM_NEON
+	// Each 64 word block is the dwords of the upper half interleaved with the
+	// dwords of the lower half, with the words of every dword swapped
+	const uint32x4_t keep = vdupq_n_u32(0xFF0000FF);
+	const uint32x4_t mid_hi = vdupq_n_u32(0x00FF0000);
+	const uint32x4_t mid_lo = vdupq_n_u32(0x0000FF00);
+
+	for (; i + 64 <= size; i += 64)
+	{
+		const uint32_t *in = (const uint32_t*)(buf_in + i);
+		uint32_t *out = (uint32_t*)(buf_out + i);
+
+		for (int j = 0; j < 16; j += 4)
+		{
+			uint32x4_t a = vld1q_u32(in + j);
+			uint32x4_t b = vld1q_u32(in + 16 + j);
+			if (swap)
+			{
+				a = vorrq_u32(vandq_u32(a, keep), vorrq_u32(vandq_u32(vshlq_n_u32(a, 8), mid_hi), vandq_u32(vshrq_n_u32(a, 8), mid_lo)));
+				b = vorrq_u32(vandq_u32(b, keep), vorrq_u32(vandq_u32(vshlq_n_u32(b, 8), mid_hi), vandq_u32(vshrq_n_u32(b, 8), mid_lo)));
+			}
+
+			uint32x4x2_t o;
+			o.val[0] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(b)));
+			o.val[1] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(a)));
+			vst2q_u32(out + j * 2, o);
+		}
+	}
+#endif
+
+	if (swap)
+	{
+		uint32_t *p = (uint32_t*)(buf_in + i);
+		for (uint32_t n = 0; n < (size - i) / 2; n++) p[n] = (p[n] & 0xFF0000FF) | ((p[n] & 0xFF00) << 8) | ((p[n] & 0xFF0000) >> 8);
+	}
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
 }
 
 static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
@@ -135,16 +194,21 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 	fileTYPE f = {};
 	uint8_t buf[4096];	// Same in user_io_file_tx
 	uint8_t buf_out[4096];
-	static char name_buf[1024];
+	char name_buf[1024];
 
 	sprintf(name_buf, "%s/%s", path, name);
-	if (!FileOpen(&f, name_buf, 0)) return 0;
+	uint64_t t = trace_now_us();
+	int opened = FileOpen(&f, name_buf, 0);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!opened) return 0;
 	if (!size && offset < f.size) size = f.size - offset;
 	if (!size) return 0;
 
 	uint32_t bytes2send = size;
+	load_bytes(size);
 
 	FileSeek(&f, offset, SEEK_SET);
+	FileReadOnce(&f);
 	printf("Loading %s (offset %u, size %u, type %u) with index %u\n", name, offset, bytes2send, neo_file_type, index);
 	const char *dispname = get_name(path, name);
 
@@ -161,7 +225,9 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 	{
 		uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
 
+		t = trace_now_us();
 		FileReadAdv(&f, buf, chunk);
+		t = load_phase_next(LOAD_READ, t);
 
 		EnableFpga();
 		spi8(FIO_FILE_TX_DAT);
@@ -187,6 +253,7 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 		}
 
 		DisableFpga();
+		load_phase_next(LOAD_TX, t);
 
 		ProgressMessage("Loading", dispname, size - bytes2send, size);
 		bytes2send -= chunk;
@@ -214,73 +281,117 @@ static void make_path(const char *root, const char *name, char *path)
 }
 
 extern uint8_t loadbuf[];
-static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
-{
-	fileTYPE f = {};
-	static char name_buf[1024];
-
-	make_path(path, name, name_buf);
-	if (!FileOpen(&f, name_buf, 0)) return 0;
-	if (!size && offset < f.size) size = f.size - offset;
-	if (!size)
-	{
-		FileClose(&f);
-		return 0;
-	}
+static uint8_t loadbuf2[LOADBUF_SZ];
 
-	size *= 2;
+typedef void (*neo_conv_fn)(uint8_t *in, uint8_t *out, uint32_t in_bytes);
 
-	FileSeek(&f, offset, SEEK_SET);
-	printf("CROM %s (offset %u, size %u) with index %u\n", name, offset, size, index);
-	const char *dispname = get_name(path, name);
+static void conv_crom(uint8_t *in, uint8_t *out, uint32_t in_bytes) { spr_convert_skp((uint16_t*)in, (uint16_t*)out, in_bytes / 2); }
+static void conv_spr(uint8_t *in, uint8_t *out, uint32_t in_bytes) { spr_convert_dbl((uint16_t*)in, (uint16_t*)out, in_bytes / 2); }
+static void conv_spr_swap(uint8_t *in, uint8_t *out, uint32_t in_bytes) { spr_convert_dbl((uint16_t*)in, (uint16_t*)out, in_bytes / 2, 1); }
+static void conv_fix(uint8_t *in, uint8_t *out, uint32_t in_bytes) { fix_convert(in, out, in_bytes); }
 
-	// Put pairs of bitplanes in the correct order for the core
+static void read_part(fileTYPE *f, uint8_t *buf, uint32_t len, uint32_t *remain_in)
+{
+	LOAD_PHASE(LOAD_READ);
+	uint32_t n = (len < *remain_in) ? len : *remain_in;
+	if (n) FileReadAdv(f, buf, n);
+	if (n < len) memset(buf + n, 0, len - n);
+	*remain_in -= n;
+}
 
+// Load size bytes of converted data to map_addr, in LOADBUF_SZ parts.
+// in_size bytes come from the file, ratio output bytes per input byte, missing
+// input is zero. While a part is converted straight into DDR, half of it by an
+// offload worker and half by this thread, the next part is read into the other buffer.
+static bool load_converted(fileTYPE *f, const char *dispname, uint32_t map_addr, uint32_t size, uint32_t in_size,
+	uint32_t ratio, uint32_t out_ofs, neo_conv_fn conv)
+{
+	uint8_t *buf[2] = { loadbuf, loadbuf2 };
+	int cur = 0;
 	uint32_t remain = size;
-	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
+	uint32_t remain_in = in_size;
+
+	uint32_t partsz = (remain > LOADBUF_SZ) ? LOADBUF_SZ : remain;
+	read_part(f, buf[cur], partsz / ratio, &remain_in);
 
 	ProgressMessage();
 	while (remain)
 	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
+		uint8_t *base = (uint8_t*)shmem_map_cached(map_addr, partsz);
+		if (!base) return false;
 
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
+		uint8_t *in = buf[cur];
+		uint8_t *out = base + out_ofs;
+		uint32_t in_bytes = partsz / ratio;
+		uint32_t half = (in_bytes / 2) & ~127;
+
+		OffloadHandle job;
+		if (half) job = offload_submit([=]() { conv(in, out, half); }, OFFLOAD_PRIO_DECODE);
+
+		uint32_t next = remain - partsz;
+		if (next > LOADBUF_SZ) next = LOADBUF_SZ;
+		if (next) read_part(f, buf[cur ^ 1], next / ratio, &remain_in);
 
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+		uint64_t t = trace_now_us();
+		conv(in + half, out + half * ratio, in_bytes - half);
+		job.wait();
+		load_phase_next(LOAD_TX, t);
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
+		shmem_unmap_cached(base);
 		remain -= partsz;
 		map_addr += partsz;
+		partsz = next;
+		cur ^= 1;
 	}
 
-	FileClose(&f);
 	ProgressMessage();
-
-	return map_addr - 0x38000000;
+	return true;
 }
 
-static inline void spr_bswap(uint32_t* buf, uint32_t size)
+static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+	fileTYPE f = {};
+	char name_buf[1024];
+
+	make_path(path, name, name_buf);
+	uint64_t t = trace_now_us();
+	int opened = FileOpen(&f, name_buf, 0);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!opened) return 0;
+	if (!size && offset < f.size) size = f.size - offset;
+	if (!size)
+	{
+		FileClose(&f);
+		return 0;
+	}
+
+	load_bytes(size);
+	size *= 2;
+
+	FileSeek(&f, offset, SEEK_SET);
+	printf("CROM %s (offset %u, size %u) with index %u\n", name, offset, size, index);
+	const char *dispname = get_name(path, name);
+
+	// Put pairs of bitplanes in the correct order for the core
+	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
+	bool ok = load_converted(&f, dispname, map_addr, size, size / 2, 2, ((index ^ 1) & 1) * 2, conv_crom);
+
+	FileClose(&f);
+	return ok ? map_addr + size - 0x38000000 : 0;
 }
 
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
 {
 	fileTYPE f = {};
-	static char name_buf[1024];
+	char name_buf[1024];
 
 	make_path(path, name, name_buf);
-	if (!FileOpen(&f, name_buf, 0)) return 0;
+	uint64_t t = trace_now_us();
+	int opened = FileOpen(&f, name_buf, 0);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!opened) return 0;
 	if (!size && offset < f.size) size = f.size - offset;
 	if (!size)
 	{
@@ -289,16 +400,26 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 	}
 
 	FileSeek(&f, offset, SEEK_SET);
+	FileReadOnce(&f);
 	printf("ROM %s (offset %u, size %u, exp %u, type %u, addr %u) with index %u\n", name, offset, size, expand, neo_file_type, addr, index);
 	const char *dispname = get_name(path, name);
 
 	uint32_t remainf = size;
+	load_bytes(size);
 
 	if(expand) size = expand;
 	uint32_t remain = size;
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
 
+	if (neo_file_type == NEO_FILE_FIX || neo_file_type == NEO_FILE_SPR)
+	{
+		neo_conv_fn conv = (neo_file_type == NEO_FILE_FIX) ? conv_fix : swap ? conv_spr_swap : conv_spr;
+		bool ok = load_converted(&f, dispname, map_addr, size, remainf, 1, 0, conv);
+		FileClose(&f);
+		return ok ? size : 0;
+	}
+
 	ProgressMessage();
 	while (remain)
 	{
@@ -306,39 +427,26 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
 
 		uint32_t partszf = remainf;
-		if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+		if (partszf > partsz) partszf = partsz;
 
 		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
+		void *base = shmem_map_cached(map_addr, partsz);
 		if (!base)
 		{
 			FileClose(&f);
 			return 0;
 		}
 
-		if (neo_file_type == NEO_FILE_FIX)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
-		}
-		else if (neo_file_type == NEO_FILE_SPR)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
-		}
-		else
-		{
-			memset(base, ((index>=16) && (index<64)) ? 8 : 0, partsz);
-			if (partszf) FileReadAdv(&f, base, partszf);
-		}
+		memset(base, ((index>=16) && (index<64)) ? 8 : 0, partsz);
+		t = trace_now_us();
+		if (partszf) FileReadAdv(&f, base, partszf);
+		load_phase_next(LOAD_READ, t);
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
+		shmem_unmap_cached(base);
 		remain -= partsz;
+		remainf -= partszf;
 		map_addr += partsz;
 	}
 
@@ -428,66 +536,8 @@ static uint32_t neogeo_tx(const char* path, const char* name, uint8_t neo_file_t
 	return sz;
 }
 
-struct rom_info
-{
-	char name[256];
-	char altname[256];
-	char hide;
-};
-
-static rom_info roms[1000];
-static uint32_t rom_cnt = 0;
-
-static int xml_scan(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
-{
-	(void)(sd);
-
-	switch (evt)
-	{
-	case XML_EVENT_START_NODE:
-		if (!strcasecmp(node->tag, "romset") && (rom_cnt < (sizeof(roms) / sizeof(roms[0]))))
-		{
-			memset(&roms[rom_cnt], 0, sizeof(rom_info));
-			for (int i = 0; i < node->n_attributes; i++)
-			{
-				if (!strcasecmp(node->attributes[i].name, "name"))
-				{
-					if (strchr(node->attributes[i].value, ','))
-						snprintf(roms[rom_cnt].name, sizeof(roms[rom_cnt].name) - 1, ",%s,", node->attributes[i].value);
-					else
-						strncpy(roms[rom_cnt].name, node->attributes[i].value, sizeof(roms[rom_cnt].name) - 1);
-					strcpy(roms[rom_cnt].altname, "No name");
-				}
-			}
-
-			for (int i = 0; i < node->n_attributes; i++)
-			{
-				if (!strcasecmp(node->attributes[i].name, "altname"))
-				{
-					memset(roms[rom_cnt].altname, 0, sizeof(roms[rom_cnt].altname));
-					strncpy(roms[rom_cnt].altname, node->attributes[i].value, sizeof(roms[rom_cnt].altname) - 1);
-				}
-				else if (!strcasecmp(node->attributes[i].name, "hide"))
-				{
-					roms[rom_cnt].hide = 1;
-				}
-			}
-			rom_cnt++;
-		}
-		break;
-
-	case XML_EVENT_END_NODE:
-		break;
-
-	case XML_EVENT_ERROR:
-		printf("XML parse: %s: ERROR %d\n", text, n);
-		break;
-	default:
-		break;
-	}
-
-	return true;
-}
+// romsets.xml of the last scan, for the names of the folder entries
+static const neo_xml_t *scan_xml = nullptr;
 
 static int xml_get_altname(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
 {
@@ -549,14 +599,8 @@ int neogeo_scan_xml(char *path)
 	sprintf(full_path, "%s/romsets.xml", path);
 	if(!FileExists(full_path)) sprintf(full_path, "%s/%s/romsets.xml", getRootDir(), HomeDir());
 
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	memset(roms, 0, sizeof(roms));
-	rom_cnt = 0;
-	sax.all_event = xml_scan;
-	parse_xml(full_path, &sax, 0);
-	return rom_cnt;
+	scan_xml = neo_xml_get(full_path);
+	return scan_xml ? neo_xml_set_count(scan_xml) : 0;
 }
 
 char *neogeo_get_altname(char *path, char *name, char *altname)
@@ -596,25 +640,34 @@ char *neogeo_get_altname(char *path, char *name, char *altname)
 		if (*altname) return altname;
 	}
 
+	if (!scan_xml) return NULL;
+
 	sprintf(full_path, ",%s,", altname);
-	for (uint32_t i = 0; i < rom_cnt; i++)
+	for (uint32_t i = 0; i < neo_xml_set_count(scan_xml); i++)
 	{
-		if (roms[i].name[0] == ',')
+		const neo_xml_set_t *set = neo_xml_set(scan_xml, i);
+		const char *set_name = neo_xml_str(scan_xml, set->name);
+		const char *set_altname = neo_xml_str(scan_xml, set->altname);
+		if (!set->name) continue;
+
+		if (strchr(set_name, ','))
 		{
-			char *p = strcasestr(roms[i].name, full_path);
+			static char names[256];
+			snprintf(names, sizeof(names) - 1, ",%s,", set_name);
+			char *p = strcasestr(names, full_path);
 			if (p)
 			{
-				if (roms[i].hide) return (char*)-1;
-				if(p == roms[i].name) return roms[i].altname;
+				if (set->hide) return (char*)-1;
+				if (p == names) return (char*)set_altname;
 
-				sprintf(full_path, "%s (%s)", roms[i].altname, altname);
+				sprintf(full_path, "%s (%s)", set_altname, altname);
 				return full_path;
 			}
 		}
-		else if (!strcasecmp(altname, roms[i].name))
+		else if (!strcasecmp(altname, set_name))
 		{
-			if (roms[i].hide) return (char*)-1;
-			return roms[i].altname;
+			if (set->hide) return (char*)-1;
+			return (char*)set_altname;
 		}
 	}
 	return NULL;
@@ -652,6 +705,38 @@ static const char* get_romset(const char *path)
 	return romset;
 }
 
+// Runs cb over the compiled xml as a parse would, but in a <romsets> file
+// only over the sets with the name of the romset at path.
+static void replay_romset(const neo_xml_t *x, const char *path, int (*cb)(XMLEvent, const XMLNode*, SXML_CHAR*, const int, SAX_Data*))
+{
+	if (!x) return;
+
+	int romsets_end = neo_xml_romsets_end(x);
+	if (romsets_end < 0)
+	{
+		neo_xml_replay(x, 0, neo_xml_node_count(x), cb, (void*)path);
+		return;
+	}
+
+	const char *romset = get_romset(path);
+	if (!romset) return;
+
+	// <romsets> and whatever comes before the first set
+	uint32_t count = neo_xml_set_count(x);
+	if (!neo_xml_replay(x, 0, count ? neo_xml_set(x, 0)->first : romsets_end, cb, (void*)path)) return;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const neo_xml_set_t *set = neo_xml_set(x, i);
+		if (set->name && has_name(neo_xml_str(x, set->name), romset))
+		{
+			if (!neo_xml_replay(x, set->first, set->end, cb, (void*)path)) return;
+		}
+	}
+
+	neo_xml_replay(x, romsets_end, romsets_end + 1, cb, (void*)path);
+}
+
 static int checked_ok;
 static int romsets = 0;
 static int xml_check_files(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
@@ -1144,6 +1229,8 @@ int neogeo_romset_tx(char* name, int cd_en)
 	if (!romset) return 0;
 	romset++;
 
+	LOAD_SCOPE("neo", name);
+
 	int system_mvs, system_cdz;
 	static char full_path[1024];
 
@@ -1200,21 +1287,25 @@ int neogeo_romset_tx(char* name, int cd_en)
 			}
 			printf("xml for %s: %s\n", name, full_path);
 
-			SAX_Callbacks sax;
-			SAX_Callbacks_init(&sax);
+			uint64_t t = trace_now_us();
+			const neo_xml_t *xml = neo_xml_get(full_path);
+			scan_xml = nullptr;
 
 			checked_ok = false;
 			romsets = 0;
 			if (!dspack)
 			{
-				sax.all_event = xml_check_files;
-				parse_xml(full_path, &sax, name);
-				if (!checked_ok) return 0;
+				replay_romset(xml, name, xml_check_files);
+				if (!checked_ok)
+				{
+					load_failed();
+					return 0;
+				}
 			}
+			load_phase_add(LOAD_CONFIG, trace_now_us() - t);
 
 			romsets = 0;
-			sax.all_event = xml_load_files;
-			parse_xml(full_path, &sax, name);
+			replay_romset(xml, name, xml_load_files);
 		}
 	}
 
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+
+#include "neogeo_xml.h"
+#include "../../file_io.h"
+#include "../../crc.h"
+
+#define NEO_XML_CACHE_DIR "/tmp/neogeo_xml"
+#define NEO_XML_MAGIC     0x4C4D584E // "NXML"
+#define NEO_XML_VERSION   1
+#define NEO_XML_MAX_ATTR  64
+
+struct neo_xml_hdr_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_len;        // key follows the header, padded to 4
+	uint32_t n_sets;
+	uint32_t n_nodes;
+	uint32_t n_attrs;
+	uint32_t str_size;
+	int32_t  romsets_end;
+};
+
+struct neo_xml_node_t
+{
+	uint16_t evt;
+	uint16_t tag_type;
+	uint32_t tag;
+	uint32_t first_attr;
+	uint32_t n_attr;
+};
+
+struct neo_xml_attr_t
+{
+	uint32_t name;
+	uint32_t value;
+};
+
+struct neo_xml_t
+{
+	std::string path;
+	std::string key;
+	void *map;
+	size_t map_len;
+	std::vector<uint8_t> mem; // used when the cache file can't be written
+
+	const neo_xml_hdr_t *hdr;
+	const neo_xml_set_t *sets;
+	const neo_xml_node_t *nodes;
+	const neo_xml_attr_t *attrs;
+	const char *str;
+};
+
+static neo_xml_t current = {};
+
+// Collected while parsing
+struct neo_xml_build_t
+{
+	std::vector<neo_xml_set_t> sets;
+	std::vector<neo_xml_node_t> nodes;
+	std::vector<neo_xml_attr_t> attrs;
+	std::string str;
+	int romsets_end;
+	int in_set;
+};
+
+static uint32_t build_str(neo_xml_build_t *b, const char *s)
+{
+	if (!s || !*s) return 0;
+	uint32_t off = b->str.size();
+	b->str.append(s, strlen(s) + 1);
+	return off;
+}
+
+static int build_event(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	neo_xml_build_t *b = (neo_xml_build_t*)sd->user;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_NODE:
+	case XML_EVENT_END_NODE:
+		{
+			neo_xml_node_t nd = {};
+			nd.evt = evt;
+			nd.tag_type = node->tag_type;
+			nd.tag = build_str(b, node->tag);
+			nd.first_attr = b->attrs.size();
+			nd.n_attr = (evt == XML_EVENT_START_NODE) ? node->n_attributes : 0;
+			if (nd.n_attr > NEO_XML_MAX_ATTR) nd.n_attr = NEO_XML_MAX_ATTR;
+			for (uint32_t i = 0; i < nd.n_attr; i++)
+			{
+				neo_xml_attr_t a = { build_str(b, node->attributes[i].name), build_str(b, node->attributes[i].value) };
+				b->attrs.push_back(a);
+			}
+
+			uint32_t idx = b->nodes.size();
+			b->nodes.push_back(nd);
+
+			if (!strcasecmp(node->tag, "romsets") && evt == XML_EVENT_END_NODE) b->romsets_end = idx;
+			if (!strcasecmp(node->tag, "romset"))
+			{
+				if (evt == XML_EVENT_START_NODE)
+				{
+					neo_xml_set_t set = {};
+					set.first = idx;
+					for (int i = 0; i < node->n_attributes; i++)
+					{
+						if (!strcasecmp(node->attributes[i].name, "name"))
+						{
+							set.name = build_str(b, node->attributes[i].value);
+							set.altname = build_str(b, "No name");
+						}
+					}
+					for (int i = 0; i < node->n_attributes; i++)
+					{
+						if (!strcasecmp(node->attributes[i].name, "altname")) set.altname = build_str(b, node->attributes[i].value);
+						else if (!strcasecmp(node->attributes[i].name, "hide")) set.hide = 1;
+					}
+					b->sets.push_back(set);
+					b->in_set = 1;
+				}
+				else if (b->in_set)
+				{
+					b->sets.back().end = idx + 1;
+					b->in_set = 0;
+				}
+			}
+		}
+		break;
+
+	case XML_EVENT_ERROR:
+		printf("XML parse: %s: ERROR %d\n", text, n);
+		break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+static int neo_xml_compile(const char *path, neo_xml_build_t *b)
+{
+	b->str.assign(1, 0); // offset 0 is the empty string
+	b->romsets_end = -1;
+	b->in_set = 0;
+
+	fileTYPE f = {};
+	if (!FileOpen(&f, path)) return 0;
+	if (!f.size)
+	{
+		FileClose(&f);
+		return 0;
+	}
+
+	std::vector<char> buf(f.size + 1);
+	int size = FileReadAdv(&f, buf.data(), f.size);
+	FileClose(&f);
+	if (size <= 0) return 0;
+	buf[size] = 0;
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = build_event;
+	XMLDoc_parse_buffer_SAX(buf.data(), path, &sax, b);
+
+	if (b->in_set) b->sets.back().end = b->nodes.size();
+	return 1;
+}
+
+static void neo_xml_serialize(neo_xml_build_t *b, const std::string &key, std::vector<uint8_t> &out)
+{
+	neo_xml_hdr_t hdr = {};
+	hdr.magic = NEO_XML_MAGIC;
+	hdr.version = NEO_XML_VERSION;
+	hdr.key_len = key.size();
+	hdr.n_sets = b->sets.size();
+	hdr.n_nodes = b->nodes.size();
+	hdr.n_attrs = b->attrs.size();
+	hdr.str_size = b->str.size();
+	hdr.romsets_end = b->romsets_end;
+
+	uint32_t key_size = (key.size() + 3) & ~3;
+	out.clear();
+	out.reserve(sizeof(hdr) + key_size + hdr.n_sets * sizeof(neo_xml_set_t) + hdr.n_nodes * sizeof(neo_xml_node_t) +
+		hdr.n_attrs * sizeof(neo_xml_attr_t) + hdr.str_size);
+
+	out.insert(out.end(), (uint8_t*)&hdr, (uint8_t*)(&hdr + 1));
+	out.insert(out.end(), key.begin(), key.end());
+	out.resize(sizeof(hdr) + key_size, 0);
+	out.insert(out.end(), (uint8_t*)b->sets.data(), (uint8_t*)(b->sets.data() + b->sets.size()));
+	out.insert(out.end(), (uint8_t*)b->nodes.data(), (uint8_t*)(b->nodes.data() + b->nodes.size()));
+	out.insert(out.end(), (uint8_t*)b->attrs.data(), (uint8_t*)(b->attrs.data() + b->attrs.size()));
+	out.insert(out.end(), b->str.begin(), b->str.end());
+}
+
+// Points the table at data, 0 if it isn't a table for key.
+static int neo_xml_attach(neo_xml_t *x, const uint8_t *data, size_t len, const std::string &key)
+{
+	if (len < sizeof(neo_xml_hdr_t)) return 0;
+
+	const neo_xml_hdr_t *hdr = (const neo_xml_hdr_t*)data;
+	if (hdr->magic != NEO_XML_MAGIC || hdr->version != NEO_XML_VERSION || hdr->key_len != key.size()) return 0;
+
+	size_t pos = sizeof(neo_xml_hdr_t);
+	if (len < pos + key.size() || memcmp(data + pos, key.data(), key.size())) return 0;
+	pos += (key.size() + 3) & ~3;
+
+	size_t need = pos + (size_t)hdr->n_sets * sizeof(neo_xml_set_t) + (size_t)hdr->n_nodes * sizeof(neo_xml_node_t) +
+		(size_t)hdr->n_attrs * sizeof(neo_xml_attr_t) + hdr->str_size;
+	if (len != need || !hdr->str_size || data[len - 1]) return 0;
+
+	x->hdr = hdr;
+	x->sets = (const neo_xml_set_t*)(data + pos);
+	pos += hdr->n_sets * sizeof(neo_xml_set_t);
+	x->nodes = (const neo_xml_node_t*)(data + pos);
+	pos += hdr->n_nodes * sizeof(neo_xml_node_t);
+	x->attrs = (const neo_xml_attr_t*)(data + pos);
+	pos += hdr->n_attrs * sizeof(neo_xml_attr_t);
+	x->str = (const char*)(data + pos);
+	return 1;
+}
+
+static void neo_xml_release(neo_xml_t *x)
+{
+	if (x->map) munmap(x->map, x->map_len);
+	x->map = nullptr;
+	x->map_len = 0;
+	x->mem.clear();
+	x->hdr = nullptr;
+	x->path.clear();
+	x->key.clear();
+}
+
+static int neo_xml_map(neo_xml_t *x, const char *cache, const std::string &key)
+{
+	int fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	if (!neo_xml_attach(x, (const uint8_t*)map, st.st_size, key))
+	{
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	x->map = map;
+	x->map_len = st.st_size;
+	return 1;
+}
+
+static int neo_xml_store(const char *cache, const std::vector<uint8_t> &data)
+{
+	mkdir(NEO_XML_CACHE_DIR, 0755);
+
+	char tmp[128];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return 0;
+
+	int ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+	close(fd);
+	if (ok) ok = !rename(tmp, cache);
+	if (!ok) unlink(tmp);
+	return ok;
+}
+
+const neo_xml_t *neo_xml_get(const char *path)
+{
+	const char *full = getFullPath(path);
+	struct stat64 st;
+	if (stat64(full, &st)) return nullptr;
+
+	char key[1200];
+	snprintf(key, sizeof(key), "%s\n%llu\n%llu\n", full, (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	if (current.hdr && current.key == key) return &current;
+
+	neo_xml_release(&current);
+	current.path = full;
+	current.key = key;
+
+	char cache[64];
+	sprintf(cache, NEO_XML_CACHE_DIR "/%08x", crc32_update(0, key, strlen(key)));
+	if (neo_xml_map(&current, cache, current.key)) return &current;
+
+	neo_xml_build_t b;
+	if (!neo_xml_compile(path, &b))
+	{
+		neo_xml_release(&current);
+		return nullptr;
+	}
+
+	std::vector<uint8_t> data;
+	neo_xml_serialize(&b, current.key, data);
+	printf("neo_xml: compiled %s, %u romsets\n", full, (uint32_t)b.sets.size());
+
+	if (neo_xml_store(cache, data) && neo_xml_map(&current, cache, current.key)) return &current;
+
+	current.mem.swap(data);
+	neo_xml_attach(&current, current.mem.data(), current.mem.size(), current.key);
+	return &current;
+}
+
+uint32_t neo_xml_set_count(const neo_xml_t *x)
+{
+	return x->hdr->n_sets;
+}
+
+const neo_xml_set_t *neo_xml_set(const neo_xml_t *x, uint32_t idx)
+{
+	return (idx < x->hdr->n_sets) ? &x->sets[idx] : nullptr;
+}
+
+const char *neo_xml_str(const neo_xml_t *x, uint32_t off)
+{
+	return (off < x->hdr->str_size) ? x->str + off : "";
+}
+
+int neo_xml_romsets_end(const neo_xml_t *x)
+{
+	return x->hdr->romsets_end;
+}
+
+uint32_t neo_xml_node_count(const neo_xml_t *x)
+{
+	return x->hdr->n_nodes;
+}
+
+int neo_xml_replay(const neo_xml_t *x, uint32_t first, uint32_t end, int (*cb)(XMLEvent, const XMLNode*, SXML_CHAR*, const int, SAX_Data*), void *user)
+{
+	static XMLAttribute attrs[NEO_XML_MAX_ATTR];
+
+	SAX_Data sd = {};
+	sd.name = x->path.c_str();
+	sd.user = user;
+
+	if (end > x->hdr->n_nodes) end = x->hdr->n_nodes;
+	for (uint32_t i = first; i < end; i++)
+	{
+		const neo_xml_node_t *nd = &x->nodes[i];
+		if (nd->first_attr + nd->n_attr > x->hdr->n_attrs || nd->n_attr > NEO_XML_MAX_ATTR) continue;
+
+		XMLNode node = {};
+		node.tag = (SXML_CHAR*)neo_xml_str(x, nd->tag);
+		node.tag_type = (TagType)nd->tag_type;
+		node.active = true;
+		node.attributes = attrs;
+		node.n_attributes = nd->n_attr;
+		for (uint32_t a = 0; a < nd->n_attr; a++)
+		{
+			attrs[a].name = (SXML_CHAR*)neo_xml_str(x, x->attrs[nd->first_attr + a].name);
+			attrs[a].value = (SXML_CHAR*)neo_xml_str(x, x->attrs[nd->first_attr + a].value);
+			attrs[a].active = true;
+		}
+
+		if (!cb((XMLEvent)nd->evt, &node, NULL, 0, &sd)) return 0;
+	}
+
+	return 1;
+}
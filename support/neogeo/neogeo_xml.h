@@ -0,0 +1,40 @@
+#ifndef NEOGEO_XML_H
+#define NEOGEO_XML_H
+
+#include <stdint.h>
+#include "../../sxmlc.h"
+
+// romsets.xml compiled into a flat table: the romsets with their names,
+// and the start/end node events of the whole file with their attributes.
+// The table is written to NEO_XML_CACHE_DIR keyed by path, size and mtime
+// and mapped from there, so browsing and launching after the first scan
+// (also in the next Main started for the core) don't parse any XML.
+
+struct neo_xml_set_t
+{
+	uint32_t name;     // string offsets, raw attribute value (may be a list with ',')
+	uint32_t altname;  // "No name" if the set has none
+	uint32_t hide;
+	uint32_t first;    // node events of the set, first to end (exclusive)
+	uint32_t end;
+};
+
+struct neo_xml_t;
+
+// Compiled table of the file (relative to the root or absolute), NULL if it can't be read.
+// Valid until the next neo_xml_get() of another file.
+const neo_xml_t *neo_xml_get(const char *path);
+
+uint32_t neo_xml_set_count(const neo_xml_t *x);
+const neo_xml_set_t *neo_xml_set(const neo_xml_t *x, uint32_t idx);
+const char *neo_xml_str(const neo_xml_t *x, uint32_t off);
+
+// Node events of the root <romsets> (start is 0, end the last one), -1 if the file has a single <romset>.
+int neo_xml_romsets_end(const neo_xml_t *x);
+uint32_t neo_xml_node_count(const neo_xml_t *x);
+
+// Hands node events first..end-1 to the SAX callback as the parser would.
+// Returns 0 once the callback returned 0.
+int neo_xml_replay(const neo_xml_t *x, uint32_t first, uint32_t end, int (*cb)(XMLEvent, const XMLNode*, SXML_CHAR*, const int, SAX_Data*), void *user);
+
+#endif
@@ -9,6 +9,7 @@
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../cd_set.h"
 #include "pcecd.h"
 
 
@@ -192,6 +193,7 @@ static int load_bios(char *biosname, const char *cuename, int sgx)
 void pcecd_set_image(int num, const char *filename)
 {
 	(void)num;
+	filename = cd_set_disc(filename);
 
 	pcecdd.Unload();
 	pcecdd.state = PCECD_STATE_NODISC;
@@ -205,6 +207,7 @@ void pcecd_set_image(int num, const char *filename)
 			pcecdd.state = pcecdd.loaded ? PCECD_STATE_IDLE : PCECD_STATE_NODISC;
 			pcecdd.latency = 10;
 			pcecdd.SendData = pcecd_send_data;
+			pcecdd.SendDataV = pcecd_send_datav;
 
 			int sgx = 0;
 
@@ -253,3 +256,11 @@ int pcecd_send_data(uint8_t* buf, int len, uint8_t index) {
 	user_io_set_download(0);
 	return 1;
 }
+
+int pcecd_send_datav(const struct iovec *iov, int cnt, uint8_t index) {
+	user_io_set_index(index);
+	user_io_set_download(1);
+	user_io_file_tx_datav(iov, cnt);
+	user_io_set_download(0);
+	return 1;
+}
@@ -70,6 +70,7 @@ public:
 	uint8_t isData;
 	int loaded;
 	SendDataFunc SendData;
+	SendDataVFunc SendDataV;
 	int has_status;
 	bool data_req;
 	bool can_read_next;
@@ -78,6 +79,7 @@ public:
 	pcecdd_t();
 	int Load(const char *filename);
 	void Unload();
+	static int LoadImage(const char *filename, toc_t *table, int *extra);
 	void Reset();
 	void Update();
 	void CommandExec();
@@ -104,8 +106,6 @@ private:
 	uint8_t CDDAMode;
 	sense_t sense;
 	uint8_t region;
-	uint8_t *chd_hunkbuf;
-	int chd_hunknum;
 
 	uint16_t stat;
 	uint8_t comm[14];
@@ -113,10 +113,12 @@ private:
 	uint8_t sec_buf[2352 + 2];
 	uint8_t subcd_buf[98 + 2];
 
-	int LoadCUE(const char* filename);
+	static int LoadCUE(const char* filename, toc_t *table);
 	int SectorSend(uint8_t* header);
+	int DataSource(cd_source_t *src, int *lba);
 	void ReadData(uint8_t *buf);
 	int ReadCDDA(uint8_t *buf);
+	void Prefetch(int lba, int count);
 	void ReadSubcode(int lba, uint8_t* buf);
 	void LBAToMSF(int lba, msf_t* msf);
 	void MSFToLBA(int* lba, msf_t* msf);
@@ -139,6 +141,7 @@ extern pcecdd_t pcecdd;
 void pcecd_poll();
 void pcecd_set_image(int num, const char *filename);
 int pcecd_send_data(uint8_t* buf, int len, uint8_t index);
+int pcecd_send_datav(const struct iovec *iov, int cnt, uint8_t index);
 void pcecd_reset();
 int pcecd_using_cd();
 
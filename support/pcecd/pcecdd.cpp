@@ -7,11 +7,16 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 
+#include "../../cdda_stream.h"
+#include "../../cd_ram.h"
+#include "../../cd_set.h"
 #include "../chd/mister_chd.h"
 #include "pcecd.h"
 
 #define PCECD_DATA_IO_INDEX 2
 #define PCECD_CDDA_IO_INDEX 3
+
+#define PCECD_PREFETCH 64 // sectors read in during an emulated seek
 #define PCECD_SUBCODE_IO_INDEX 4
 
 float get_cd_seek_ms(int start_sector, int target_sector);
@@ -30,6 +35,7 @@ pcecdd_t::pcecdd_t() {
 	audioLength = 0;
 	audioOffset = 0;
 	SendData = NULL;
+	SendDataV = NULL;
 	has_status = 0;
 	data_req = false;
 	can_read_next = false;
@@ -76,7 +82,7 @@ static int sgets(char *out, int sz, char **in)
 	return *out;
 }
 
-int pcecdd_t::LoadCUE(const char* filename) {
+int pcecdd_t::LoadCUE(const char* filename, toc_t *table) {
 	static char fname[1024 + 10];
 	static char line[128];
 	char *ptr, *lptr;
@@ -84,6 +90,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 	int hdr = 0;
 
 	strcpy(fname, filename);
+	if (cd_cue_cache_load(filename, "pcecd", table)) return 0;
 
 	memset(toc, 0, sizeof(toc));
 	if (!FileLoad(fname, toc, sizeof(toc) - 1)) return 1;
@@ -121,7 +128,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 			}
 			*ptr = 0;
 
-			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			if(!FileOpen(&table->tracks[table->last].f, fname)) return -1;
 
 			printf("\x1b[32mPCECD: Open track file: %s\n\x1b[0m", fname);
 
@@ -130,11 +137,11 @@ int pcecdd_t::LoadCUE(const char* filename) {
 
 			pregap = 0;
 
-			this->toc.tracks[this->toc.last].offset = 0;
+			table->tracks[table->last].offset = 0;
 
 			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
 			{
-				FileClose(&this->toc.tracks[this->toc.last].f);
+				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mPCECD: unsupported file: %s\n\x1b[0m", fname);
 
 				return -1;
@@ -144,49 +151,49 @@ int pcecdd_t::LoadCUE(const char* filename) {
 		/* decode TRACK commands */
 		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
 		{
-			if (bb != (this->toc.last + 1))
+			if (bb != (table->last + 1))
 			{
-				FileClose(&this->toc.tracks[this->toc.last].f);
+				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mPCECD: missing tracks: %s\n\x1b[0m", fname);
 				break;
 			}
 
-			//if (!this->toc.last)
+			//if (!table->last)
 			{
 				if (strstr(lptr, "MODE1/2048"))
 				{
-					this->toc.tracks[this->toc.last].sector_size = 2048;
-					this->toc.tracks[this->toc.last].type = 1;
+					table->tracks[table->last].sector_size = 2048;
+					table->tracks[table->last].type = 1;
 				}
 				else if (strstr(lptr, "MODE1/2352"))
 				{
-					this->toc.tracks[this->toc.last].sector_size = 2352;
-					this->toc.tracks[this->toc.last].type = 1;
+					table->tracks[table->last].sector_size = 2352;
+					table->tracks[table->last].type = 1;
 
-					FileSeek(&this->toc.tracks[this->toc.last].f, 0x10, SEEK_SET);
+					FileSeek(&table->tracks[table->last].f, 0x10, SEEK_SET);
 				}
 				else if (strstr(lptr, "AUDIO"))
 				{
-					this->toc.tracks[this->toc.last].sector_size = 2352;
-					this->toc.tracks[this->toc.last].type = 0;
+					table->tracks[table->last].sector_size = 2352;
+					table->tracks[table->last].type = 0;
 
-					FileSeek(&this->toc.tracks[this->toc.last].f, 0, SEEK_SET);
+					FileSeek(&table->tracks[table->last].f, 0, SEEK_SET);
 				}
 
 				/*if (this->sectorSize)
 				{
-					this->toc.tracks[0].type = 1;
+					table->tracks[0].type = 1;
 
-					FileReadAdv(&this->toc.tracks[0].f, header, 0x210);
-					FileSeek(&this->toc.tracks[0].f, 0, SEEK_SET);
+					FileReadAdv(&table->tracks[0].f, header, 0x210);
+					FileSeek(&table->tracks[0].f, 0, SEEK_SET);
 				}*/
 			}
 
-			if (this->toc.last)
+			if (table->last)
 			{
-				if (!this->toc.tracks[this->toc.last].f.opened())
+				if (!table->tracks[table->last].f.opened())
 				{
-					this->toc.tracks[this->toc.last - 1].end = 0;
+					table->tracks[table->last - 1].end = 0;
 				}
 			}
 		}
@@ -201,84 +208,91 @@ int pcecdd_t::LoadCUE(const char* filename) {
 		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
 			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
 		{
-			if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+			if (table->last && !table->tracks[table->last - 1].end)
 			{
-				this->toc.tracks[this->toc.last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
+				table->tracks[table->last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
 			}
 		}
 		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
 			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
 		{
-			if (!this->toc.tracks[this->toc.last].f.opened())
+			if (!table->tracks[table->last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
-				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
-				this->toc.tracks[this->toc.last].offset = (pregap * this->toc.tracks[this->toc.last].sector_size) - hdr;
-				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+				FileOpen(&table->tracks[table->last].f, fname);
+				table->tracks[table->last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
+				table->tracks[table->last].offset = (pregap * table->tracks[table->last].sector_size) - hdr;
+				if (table->last && !table->tracks[table->last - 1].end)
 				{
-					this->toc.tracks[this->toc.last - 1].end = this->toc.tracks[this->toc.last].start;
+					table->tracks[table->last - 1].end = table->tracks[table->last].start;
 				}
 			}
 			else
 			{
-				FileSeek(&this->toc.tracks[this->toc.last].f, 0, SEEK_SET);
+				FileSeek(&table->tracks[table->last].f, 0, SEEK_SET);
 
-				this->toc.tracks[this->toc.last].start = this->toc.end + pregap;
-				this->toc.tracks[this->toc.last].offset = (this->toc.tracks[this->toc.last].start * this->toc.tracks[this->toc.last].sector_size) - hdr;
-				this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((this->toc.tracks[this->toc.last].f.size - hdr + this->toc.tracks[this->toc.last].sector_size - 1) / this->toc.tracks[this->toc.last].sector_size);
+				table->tracks[table->last].start = table->end + pregap;
+				table->tracks[table->last].offset = (table->tracks[table->last].start * table->tracks[table->last].sector_size) - hdr;
+				table->tracks[table->last].end = table->tracks[table->last].start + ((table->tracks[table->last].f.size - hdr + table->tracks[table->last].sector_size - 1) / table->tracks[table->last].sector_size);
 
-				this->toc.tracks[this->toc.last].start += (bb + ss * 75 + mm * 60 * 75);
-				this->toc.end = this->toc.tracks[this->toc.last].end;
+				table->tracks[table->last].start += (bb + ss * 75 + mm * 60 * 75);
+				table->end = table->tracks[table->last].end;
 			}
 
-			this->toc.last++;
-			if (this->toc.last == 99) break;
+			table->last++;
+			if (table->last == 99) break;
 		}
 	}
 
-	if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+	if (table->last && !table->tracks[table->last - 1].end)
 	{
-		this->toc.end += pregap;
-		this->toc.tracks[this->toc.last - 1].end = this->toc.end;
+		table->end += pregap;
+		table->tracks[table->last - 1].end = table->end;
 	}
 
-	for (int i = 0; i < this->toc.last; i++)
+	for (int i = 0; i < table->last; i++)
 	{
-		printf("\x1b[32mPCECD: Track = %u, start = %u, end = %u, offset = %d, sector_size=%d, type = %u\n\x1b[0m", i, this->toc.tracks[i].start, this->toc.tracks[i].end, this->toc.tracks[i].offset, this->toc.tracks[i].sector_size, this->toc.tracks[i].type);
+		printf("\x1b[32mPCECD: Track = %u, start = %u, end = %u, offset = %d, sector_size=%d, type = %u\n\x1b[0m", i, table->tracks[i].start, table->tracks[i].end, table->tracks[i].offset, table->tracks[i].sector_size, table->tracks[i].type);
 	}
 
-	FileClose(&this->toc.tracks[this->toc.last].f);
+	FileClose(&table->tracks[table->last].f);
+	cd_cue_cache_save(filename, "pcecd", table);
 	return 0;
 }
 
-int pcecdd_t::Load(const char *filename)
+// CUE or CHD image into table, for Load and the other discs of a set.
+int pcecdd_t::LoadImage(const char *filename, toc_t *table, int *extra)
 {
-	char subcode_name[256];
-
-	Unload();
+	(void)extra;
 
 	const char *ext = filename+strlen(filename)-4;
 	if (!strncasecmp(".cue", ext, 4))
 	{
-		if (LoadCUE(filename)) return -1;
+		return !LoadCUE(filename, table);
 	} else if (!strncasecmp(".chd", ext, 4)) {
-		mister_load_chd(filename, &this->toc);
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
+		mister_load_chd(filename, table);
+		return 1;
+	}
 
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
-	} else {
-		return -1;
+	return 0;
+}
+
+int pcecdd_t::Load(const char *filename)
+{
+	char subcode_name[256];
+
+	Unload();
+
+	if (!cd_set_take(filename, &this->toc, NULL, LoadImage))
+	{
+		if (!LoadImage(filename, &this->toc, NULL)) return -1;
+		cd_set_mounted(filename);
 	}
 
 	if (this->toc.last)
 	{
 		this->toc.tracks[this->toc.last].start = this->toc.end;
 		this->loaded = 1;
+		cd_ram_install(&this->toc);
 
 		memcpy(subcode_name, filename, strlen(filename));
 		subcode_name[strlen(filename)] = 0x00;
@@ -303,20 +317,19 @@ void pcecdd_t::Unload()
 {
 	if (this->loaded)
 	{
-		if (this->toc.chd_f)
+		cdda_stop();
+		cd_ram_release();
+		if (!cd_set_unmount(&this->toc))
 		{
-			chd_close(this->toc.chd_f);
-			this->toc.chd_f = NULL;
-			if (this->chd_hunkbuf)
+			if (this->toc.chd_f)
 			{
-				free(this->chd_hunkbuf);
-				this->chd_hunkbuf = NULL;
-				this->chd_hunknum = -1;
-			}
-		} else {
-			for (int i = 0; i < this->toc.last; i++)
-			{
-				FileClose(&this->toc.tracks[i].f);
+				mister_chd_close(this->toc.chd_f);
+				this->toc.chd_f = NULL;
+			} else {
+				for (int i = 0; i < this->toc.last; i++)
+				{
+					FileClose(&this->toc.tracks[i].f);
+				}
 			}
 		}
 
@@ -401,10 +414,17 @@ void pcecdd_t::Update() {
 			// CD-ROM (Mode 1)
 			sec_buf[0] = 0x00;
 			sec_buf[1] = 0x08 | 0x80;
-			ReadData(sec_buf + 2);
 
-			if (SendData)
-				SendData(sec_buf, 2048 + 2, PCECD_DATA_IO_INDEX);
+			// The data goes out from where it's kept (CD RAM, CHD hunk cache), not copied to sec_buf
+			cd_source_t src;
+			int lba;
+			if (!SendDataV || !DataSource(&src, &lba) || !cd_send_sector(&src, lba, CD_READ_MODE1, sec_buf, 2, 2048 + 2, sec_buf + 2, SendDataV, PCECD_DATA_IO_INDEX))
+			{
+				ReadData(sec_buf + 2);
+
+				if (SendData)
+					SendData(sec_buf, 2048 + 2, PCECD_DATA_IO_INDEX);
+			}
 
 			//printf("\x1b[32mPCECD: Data sector send = %i\n\x1b[0m", this->lba);
 		}
@@ -464,10 +484,6 @@ void pcecdd_t::Update() {
 		{
 			if (!this->toc.tracks[this->index].type)
 			{
-				if (this->toc.tracks[this->index].f.opened()) 
-				{
-					FileSeek(&this->toc.tracks[index].f, (this->lba * 2352) - this->toc.tracks[index].offset, SEEK_SET);
-				}
 				sec_buf[0] = 0x30;
 				sec_buf[1] = 0x09;
 				ReadCDDA(sec_buf + 2);
@@ -677,6 +693,8 @@ void pcecdd_t::CommandExec() {
 		}
 		printf("seek time ticks: %d\n", this->latency);
 
+		if (this->latency) Prefetch(new_lba, cnt_ < PCECD_PREFETCH ? cnt_ : PCECD_PREFETCH);
+
 		this->lba = new_lba;
 		this->cnt = cnt_;
 
@@ -752,6 +770,8 @@ void pcecdd_t::CommandExec() {
 
 		printf("seek time ticks: %d\n", this->latency);
 
+		if (this->latency) Prefetch(new_lba, PCECD_PREFETCH);
+
 		this->lba = new_lba;
 		int index = GetTrackByLBA(new_lba, &this->toc);
 
@@ -905,28 +925,50 @@ int pcecdd_t::GetTrackByLBA(int lba, toc_t* toc) {
 	return index;
 }
 
-void pcecdd_t::ReadData(uint8_t *buf)
+// Where the data sector at the current position is stored, 0 if there's none
+int pcecdd_t::DataSource(cd_source_t *src, int *lba)
 {
-	if (this->toc.tracks[this->index].type && (this->lba >= 0))
+	if (!this->toc.tracks[this->index].type || (this->lba < 0)) return 0;
+
+	memset(src, 0, sizeof(*src));
+	src->sector_size = this->toc.tracks[this->index].sector_size;
+	if (this->toc.chd_f)
 	{
-		if (this->toc.chd_f)
-		{
-			int s_offset = 0;
-			if (this->toc.tracks[this->index].sector_size != 2048)
-			{
-				s_offset += 16;
-			}
+		src->chd_f = this->toc.chd_f;
+		*lba = this->lba + this->toc.tracks[this->index].offset;
+	} else {
+		src->f = &this->toc.tracks[this->index].f;
+		src->offset = -this->toc.tracks[this->index].offset;
+		*lba = this->lba;
+	}
+	return 1;
+}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		} else {
-			if (this->toc.tracks[this->index].sector_size == 2048)
-			{
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2048 - this->toc.tracks[this->index].offset, SEEK_SET);
-			} else {
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2352 + 16 - this->toc.tracks[this->index].offset, SEEK_SET);
-			}
-			FileReadAdv(&this->toc.tracks[this->index].f, buf, 2048);
-		}
+void pcecdd_t::ReadData(uint8_t *buf)
+{
+	cd_source_t src;
+	int lba;
+	if (DataSource(&src, &lba)) cd_read_sectors(&src, lba, 1, CD_READ_MODE1, buf);
+}
+
+// The emulated seek time is used to get the target sectors off the image
+void pcecdd_t::Prefetch(int lba, int count)
+{
+	int index = GetTrackByLBA(lba, &this->toc);
+	if (index > this->toc.last) return;
+
+	cd_source_t src = {};
+	src.sector_size = this->toc.tracks[index].sector_size;
+	if (this->toc.chd_f)
+	{
+		src.chd_f = this->toc.chd_f;
+		cd_prefetch(&src, lba + this->toc.tracks[index].offset, count);
+	}
+	else if (this->toc.tracks[index].f.opened())
+	{
+		src.f = &this->toc.tracks[index].f;
+		src.offset = -this->toc.tracks[index].offset;
+		cd_prefetch(&src, lba, count);
 	}
 }
 
@@ -936,17 +978,16 @@ int pcecdd_t::ReadCDDA(uint8_t *buf)
 	this->audioOffset = 0;// 2352;
 
 
+	cd_source_t src = {};
+	src.sector_size = 2352;
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
+		src.chd_f = this->toc.chd_f;
+		cdda_read(&src, this->lba + this->toc.tracks[this->index].offset, this->toc.tracks[this->index].end + this->toc.tracks[this->index].offset, buf);
 	} else if (this->toc.tracks[this->index].f.opened()) {
-		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
+		src.f = &this->toc.tracks[this->index].f;
+		src.offset = -this->toc.tracks[this->index].offset;
+		cdda_read(&src, this->lba, this->toc.tracks[this->index].end, buf);
 	}
 
 	return this->audioLength;
@@ -957,7 +998,7 @@ void pcecdd_t::ReadSubcode(int lba, uint8_t* buf)
 	static uint8_t subc[96];
 	static int last_lba = -1;
 	msf_t msf;
-	int i, j;
+	int i;
 	uint8_t msb, lsb, x;
 
 	buf[0] = 0x00;	// synchronization word while playing
@@ -1005,16 +1046,7 @@ void pcecdd_t::ReadSubcode(int lba, uint8_t* buf)
 
 	// printf("\x1b[32mPCECD: Subcode sector latency = %d, lba = %i, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n\x1b[0m", this->latency, lba, subc[12], subc[13], subc[14], subc[15], subc[16], subc[17], subc[18], subc[19], subc[20], subc[21], subc[22], subc[23]);
 
-	for (i = 0; i < 96; i++)
-	{
-		int code = 0;
-		for (j = 0; j < 8; j++)	// subcode P = 0; subcode Q = 1, etc.
-		{
-			uint8_t bits = subc[(j * 12) + (i >> 3)] >> (7 - (i & 7));
-			code |= ((bits & 1) << (7 - j));
-		}
-		buf[i+2] = code;
-	}
+	cd_subcode_symbols(subc, buf + 2);	// subcode P = bit 7; subcode Q = bit 6, etc.
 }
 
 int pcecdd_t::SectorSend(uint8_t* header)
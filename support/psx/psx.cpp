@@ -3,21 +3,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../crc.h"
+#include "../../fw_cache.h"
 #include "psx.h"
 #include "mcdheader.h"
 #include "../../cd.h"
+#include "../../cd_ram.h"
+#include "../../cd_set.h"
 #include "../chd/mister_chd.h"
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 static int noreset = 0;
 
 static int sgets(char *out, int sz, char **in)
@@ -103,31 +108,26 @@ static uint16_t libCryptMask(fileTYPE* sbi_file)
 	return mask;
 }
 
-static void unload_chd(toc_t *table)
+static void unload_cd(toc_t *table)
 {
-	if (table->chd_f)
+	cd_ram_release();
+	if (!cd_set_unmount(table))
 	{
-		chd_close(table->chd_f);
-	}
-	if (chd_hunkbuf) free(chd_hunkbuf);
-	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
-
-}
+		if (table->chd_f)
+		{
+			mister_chd_close(table->chd_f);
+		}
 
-static void unload_cue(toc_t *table)
-{
-	for (int i = 0; i < table->last; i++)
-	{
-		FileClose(&table->tracks[i].f);
+		for (int i = 0; i < table->last; i++)
+		{
+			FileClose(&table->tracks[i].f);
+		}
 	}
 	memset(table, 0, sizeof(toc_t));
 }
 
 static int load_chd(const char *filename, toc_t *table)
 {
-
-	unload_chd(table);
 	chd_error err = mister_load_chd(filename, table);
 	if (err != CHDERR_NONE)
 	{
@@ -155,9 +155,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -168,7 +165,7 @@ static int load_cue(const char* filename, toc_t *table)
 	char *ptr, *lptr;
 	static char toc[100 * 1024];
 
-	unload_cue(table);
+	if (cd_cue_cache_load(filename, "psx", table)) return 1;
 	printf("\x1b[32mPSX: Open CUE: %s\n\x1b[0m", fname);
 
 	strcpy(fname, filename);
@@ -327,11 +324,14 @@ static int load_cue(const char* filename, toc_t *table)
 
 	}*/
 
+	cd_cue_cache_save(filename, "psx", table);
 	return 1;
 }
 
-static int load_cd_image(const char *filename, toc_t *table)
+// CUE or CHD image into table, for the mount and the other discs of a set.
+static int load_cd_image(const char *filename, toc_t *table, int *extra)
 {
+	(void)extra;
 
 	const char *ext = strrchr(filename, '.');
 	if (!ext) return 0;
@@ -488,56 +488,49 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 			{
 				if (lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)
 				{
-					if (!toc.chd_f)
+					cd_source_t src = {};
+					src.sector_size = CD_SECTOR_LEN;
+					if (toc.chd_f)
 					{
-						if (toc.tracks[i].offset)
-            {
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset+((lba-toc.tracks[i].start)*CD_SECTOR_LEN), SEEK_SET);
-
-            }else {
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start) * CD_SECTOR_LEN, SEEK_SET);
-            }
+						src.chd_f = toc.chd_f;
+					}
+					else
+					{
+						src.f = toc.tracks[i].offset ? &toc.tracks[0].f : &toc.tracks[i].f;
+						src.offset = toc.tracks[i].offset;
 					}
+
 					while (cnt)
 					{
-            if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].indexes[1]))
-            {
-              //The TOC is setup so that pregap sectors are actually part of the
-              //PREVIOUS track. If the pregap field is set the file doesn't contain
-              //this data, so we have to fake it. 
-              //Check the next track's pregap and indexes[1] values to determine
-              //if we're reading pregap sectors
-              
-
-              memset(buffer, 0x0, CD_SECTOR_LEN);
-            }
-            else if (toc.chd_f)
+						int n = 1;
+						if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].indexes[1]))
+						{
+							//The TOC is setup so that pregap sectors are actually part of the
+							//PREVIOUS track. If the pregap field is set the file doesn't contain
+							//this data, so we have to fake it.
+							//Check the next track's pregap and indexes[1] values to determine
+							//if we're reading pregap sectors
+							memset(buffer, 0x0, CD_SECTOR_LEN);
+						}
+						else
 						{
+							// Read the rest of the request within this track in one go
+							int last = toc.tracks[i].end;
+							if (toc.tracks[i+1].pregap && last > toc.tracks[i+1].start - toc.tracks[i+1].indexes[1]) last = toc.tracks[i+1].start - toc.tracks[i+1].indexes[1];
+							n = last - lba + 1;
+							if (n > cnt) n = cnt;
 
 							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
+							int read_lba = toc.chd_f ? (lba - toc.tracks[0].indexes[1] + toc.tracks[i].offset) : (lba - toc.tracks[i].start);
+							if (cd_read_sectors(&src, read_lba, n, toc.tracks[i].type ? CD_READ_RAW : CD_READ_AUDIO, buffer) < n && toc.chd_f)
 							{
-								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else {
 								printf("\x1b[32mPSX: CHD read error: %d\n\x1b[0m", lba);
 							}
 						}
-						else {
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
+
+						buffer += (n - 1) * CD_SECTOR_LEN;
+						cnt -= n - 1;
+						lba += n - 1;
 						if ((lba + 1) > toc.tracks[i].end) break;
 						buffer += CD_SECTOR_LEN;
 						cnt--;
@@ -659,8 +652,69 @@ static game_info_t psx_get_game_info()
 	return { game_id, region_t::UNKNOWN };
 }
 
+// Disc metadata found on mount, cached in /tmp by image path, size and mtime
+// so swapping discs or relaunching doesn't read (and decompress) the sectors again.
+
+#define PSX_META_DIR   "/tmp/psx_meta"
+#define PSX_META_MAGIC 0x3161744D // "Mta1"
+
+struct psx_meta_t
+{
+	uint32_t magic;
+	char key[1100];
+	char game_id[11];
+	uint8_t game_region;
+	uint8_t region;
+	uint8_t has_sbi;
+	uint16_t mask;
+};
+
+static psx_meta_t cur_meta = {};
+static int cur_meta_valid = 0;
+
+static int psx_meta_path(const char *filename, char *path, char *key, int keylen)
+{
+	const char *full = getFullPath(filename);
+	struct stat64 st;
+	if (stat64(full, &st)) return 0;
+
+	snprintf(key, keylen, "%s\n%llu\n%llu\n", full, (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	sprintf(path, PSX_META_DIR "/%08x", crc32_update(0, key, strlen(key)));
+	return 1;
+}
+
+static int psx_meta_load(const char *filename, psx_meta_t *meta)
+{
+	char path[64], key[sizeof(meta->key)];
+	if (!psx_meta_path(filename, path, key, sizeof(key))) return 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = read(fd, meta, sizeof(psx_meta_t)) == sizeof(psx_meta_t) && meta->magic == PSX_META_MAGIC && !strcmp(meta->key, key);
+	close(fd);
+	return ok;
+}
+
+static void psx_meta_save(const char *filename, psx_meta_t *meta)
+{
+	char path[64], tmp[80];
+	meta->magic = PSX_META_MAGIC;
+	if (!psx_meta_path(filename, path, meta->key, sizeof(meta->key))) return;
+
+	mkdir(PSX_META_DIR, 0777);
+	sprintf(tmp, "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return;
+
+	int ok = write(fd, meta, sizeof(psx_meta_t)) == sizeof(psx_meta_t);
+	close(fd);
+	if (!ok || rename(tmp, path)) unlink(tmp);
+}
+
 const char* psx_get_game_id()
 {
+	if (cur_meta_valid) return cur_meta.game_id;
 	return psx_get_game_info().game_id;
 }
 
@@ -676,9 +730,13 @@ static void mount_cd(int size, int index)
 
 static int load_bios(const char* filename)
 {
-	int sz = FileLoad(filename, 0, 0);
-	if (sz != 512 * 1024) return 0;
-	return user_io_file_tx(filename, 0xC0);
+	uint32_t sz;
+	uint8_t *data = fw_cache_load(filename, &sz, 512 * 1024);
+	if (!data) return 0;
+
+	int ok = (sz == 512 * 1024) && user_io_file_tx_mem(filename, data, sz, 0xC0);
+	free(data);
+	return ok;
 }
 
 void psx_mount_cd(int f_index, int s_index, const char *filename)
@@ -687,17 +745,34 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 
 	int loaded = 0;
 
+	filename = cd_set_disc(filename);
+	unload_cd(&toc);
+
 	if (strlen(filename))
 	{
-		if (load_cd_image(filename, &toc) && toc.last)
+		int ready = cd_set_take(filename, &toc, NULL, load_cd_image);
+		if ((ready || load_cd_image(filename, &toc, NULL)) && toc.last)
 		{
+			if (!ready) cd_set_mounted(filename);
+
 			int reset = 0;
-			game_info_t game_info = psx_get_game_info();
-			const char* game_id = game_info.game_id;
-			region_t region = psx_get_region();
+			psx_meta_t *meta = &cur_meta;
+			int cached = psx_meta_load(filename, meta);
+			if (!cached)
+			{
+				memset(meta, 0, sizeof(psx_meta_t));
+				game_info_t game_info = psx_get_game_info();
+				strcpy(meta->game_id, game_info.game_id);
+				meta->game_region = game_info.region;
+				meta->region = psx_get_region();
+			}
+			cur_meta_valid = 1;
+
+			const char* game_id = meta->game_id;
+			region_t region = (region_t)meta->region;
 			if (region == region_t::UNKNOWN)
-				region = game_info.region;
-			printf("Game ID: %s, region: %s\n", game_id, region_string(region));
+				region = (region_t)meta->game_region;
+			printf("Game ID: %s, region: %s%s\n", game_id, region_string(region), cached ? " (cached)" : "");
 
 			// Write game ID if it's not empty (BIOS check is handled in user_io_write_gameid)
 			if (game_id && game_id[0] != '\0')
@@ -759,27 +834,34 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 				}
 			}
 
-			uint16_t mask = 0;
+			uint16_t mask = meta->mask;
 
 			fileTYPE sbi_file = {};
 			bool has_sbi_file = false;
 
-			// search for .sbi file in PSX/sbi.zip
-			sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), game_id);
-			has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-
-			if (!has_sbi_file)
+			if (!cached)
 			{
-				// search for .sbi file base on image name
-				strcpy(buf, filename);
-				strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
+				// search for .sbi file in PSX/sbi.zip
+				sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), game_id);
 				has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-			}
 
-			if (has_sbi_file)
-			{
-				printf("Found SBI file: %s\n", buf);
-				mask = libCryptMask(&sbi_file);
+				if (!has_sbi_file)
+				{
+					// search for .sbi file base on image name
+					strcpy(buf, filename);
+					strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
+					has_sbi_file = (FileOpen(&sbi_file, buf, 1));
+				}
+
+				if (has_sbi_file)
+				{
+					printf("Found SBI file: %s\n", buf);
+					mask = libCryptMask(&sbi_file);
+				}
+
+				meta->has_sbi = has_sbi_file;
+				meta->mask = mask;
+				psx_meta_save(filename, meta);
 			}
 
 			send_cue_and_metadata(&toc, mask, region, reset);
@@ -788,6 +870,7 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 			process_ss(filename, name_len != 0);
 
 			mount_cd(toc.end*CD_SECTOR_LEN, s_index);
+			cd_ram_install(&toc);
 			loaded = 1;
 		}
 	}
@@ -795,8 +878,8 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 	if (!loaded)
 	{
 		printf("Unmount CD\n");
-		unload_cue(&toc);
-		unload_chd(&toc);
+		cur_meta_valid = 0;
+		unload_cd(&toc);
 		mount_cd(0, s_index);
 	}
 }
@@ -9,6 +9,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../cd_set.h"
 #include "saturn.h"
 
 static int need_reset = 0;
@@ -147,7 +148,7 @@ static int saturn_load_rom(const char *basename, const char *name, int sub_index
 	{
 		p++;
 		strcpy(p, name);
-		if (user_io_file_tx(buf, sub_index << 6)) return 1;
+		if (sub_index ? user_io_file_tx(buf, sub_index << 6) : user_io_file_tx_fw(buf, 0)) return 1;
 	}
 
 	return 0;
@@ -158,6 +159,7 @@ void saturn_set_image(int num, const char *filename)
 	static char last_dir[1024] = {};
 
 	(void)num;
+	filename = cd_set_disc(filename);
 
 	satcdd.Unload();
 	satcdd.Reset();
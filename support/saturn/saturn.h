@@ -28,6 +28,8 @@
 #define SATURN_STAT_NODISK			0x83
 #define SATURN_STAT_SEEK_RING		0xB2
 
+#define SATURN_RUN					16 // data sectors prepared ahead
+
 typedef enum {
 	Idle,
 	Open,
@@ -51,6 +53,7 @@ public:
 	satcdd_t();
 	int Load(const char *filename);
 	void Unload();
+	static int LoadImage(const char *filename, toc_t *table, int *sector_size);
 	void Reset();
 	void Process(uint8_t* time_mode);
 	void Update();
@@ -86,23 +89,24 @@ private:
 	uint8_t cd_buf[4096 + 2];
 	int audioLength;
 	int audioFirst;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
+	int run_lba;
+	int run_count;
+	uint8_t run_buf[SATURN_RUN * 2352];
 
 
-	int LoadCUE(const char* filename);
+	static int LoadCUE(const char* filename, toc_t *table, int *sector_size);
 	void LBAToMSF(int lba, msf_t* msf);
 	int CalcSeekDelay(int lba_old, int lba_new);
 	int GetFAD(uint8_t* cmd);
 	int GetSectorOffsetByIndex(int tno, int idx);
 	void SetChecksum(uint8_t* stat);
 	int CheckCommand(uint8_t* cmd);
-	void ReadData(uint8_t *buf);
+	void ReadRun(int lba);
 	int ReadCDDA(uint8_t *buf, int first);
+	void Prefetch(int lba, int count);
 	void MakeSecureRingData(uint8_t *buf);
-	uint32_t DataSectorCalcCRC(uint8_t* buf, int len);
-	int DataSectorSend(uint8_t* header, int speed);
+	int DataSectorSend(int speed);
 	int AudioSectorSend(int first);
 	int RingDataSend(uint8_t* header, int speed);
 };
@@ -6,9 +6,14 @@
 
 #include "saturn.h"
 #include "../../shmem.h"
+#include "../../crc.h"
+#include "../../cdda_stream.h"
+#include "../../cd_ram.h"
+#include "../../cd_set.h"
 #include "../chd/mister_chd.h"
 
 #define SHMEM_ADDR  0x31000000
+#define SATURN_PREFETCH 64 // sectors read in during an emulated seek
 
 satcdd_t satcdd;
 
@@ -28,8 +33,8 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
+	run_lba = 0;
+	run_count = 0;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -78,7 +83,7 @@ static int sgets(char *out, int sz, char **in)
 	return *out;
 }
 
-int satcdd_t::LoadCUE(const char* filename) {
+int satcdd_t::LoadCUE(const char* filename, toc_t *table, int *sector_size) {
 	static char fname[1024 + 10];
 	static char line[128];
 	char *ptr, *lptr;
@@ -87,6 +92,12 @@ int satcdd_t::LoadCUE(const char* filename) {
 	int file_size = 0;
 
 	strcpy(fname, filename);
+	int cached_size = 0;
+	if (cd_cue_cache_load(filename, "saturn", table, &cached_size))
+	{
+		*sector_size = cached_size;
+		return 0;
+	}
 
 	memset(cue, 0, sizeof(cue));
 	if (!FileLoad(fname, cue, sizeof(cue) - 1)) return 1;
@@ -95,7 +106,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 	printf("\x1b[32mSaturn: Open CUE: %s\n\x1b[0m", fname);
 #endif // SATURN_DEBUG
 
-	this->toc.last = -1;
+	table->last = -1;
 	int idx, mm, ss, bb, pregap = 0;
 
 	char *buf = cue;
@@ -107,7 +118,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 		/* decode FILE commands */
 		if (!(memcmp(lptr, "FILE", 4)))
 		{
-			if (this->toc.last == 99) break;
+			if (table->last == 99) break;
 
 			ptr = fname + strlen(fname) - 1;
 			while ((ptr - fname) && (*ptr != '/') && (*ptr != '\\')) ptr--;
@@ -129,9 +140,9 @@ int satcdd_t::LoadCUE(const char* filename) {
 			}
 			*ptr = 0;
 
-			if (!FileOpen(&this->toc.tracks[this->toc.last + 1].f, fname)) return -1;
-			FileSeek(&this->toc.tracks[this->toc.last + 1].f, 0, SEEK_SET);
-			file_size = this->toc.tracks[this->toc.last + 1].f.size;
+			if (!FileOpen(&table->tracks[table->last + 1].f, fname)) return -1;
+			FileSeek(&table->tracks[table->last + 1].f, 0, SEEK_SET);
+			file_size = table->tracks[table->last + 1].f.size;
 
 #ifdef SATURN_DEBUG
 			printf("\x1b[32mSaturn: Open track file: %s\n\x1b[0m", fname);
@@ -139,11 +150,11 @@ int satcdd_t::LoadCUE(const char* filename) {
 
 			pregap = 0;
 
-			this->toc.tracks[this->toc.last + 1].offset = 0;
+			table->tracks[table->last + 1].offset = 0;
 
 			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
 			{
-				FileClose(&this->toc.tracks[this->toc.last + 1].f);
+				FileClose(&table->tracks[table->last + 1].f);
 #ifdef SATURN_DEBUG
 				printf("\x1b[32mSaturn: unsupported file: %s\n\x1b[0m", fname);
 #endif // SATURN_DEBUG
@@ -155,12 +166,12 @@ int satcdd_t::LoadCUE(const char* filename) {
 		/* decode TRACK commands */
 		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
 		{
-			if (this->toc.last == 99) break;
-			this->toc.last++;
+			if (table->last == 99) break;
+			table->last++;
 			
-			if (bb != (this->toc.last + 1))
+			if (bb != (table->last + 1))
 			{
-				FileClose(&this->toc.tracks[this->toc.last].f);
+				FileClose(&table->tracks[table->last].f);
 #ifdef SATURN_DEBUG
 				printf("\x1b[32mSaturn: missing tracks: %s\n\x1b[0m", fname);
 #endif // SATURN_DEBUG
@@ -169,72 +180,72 @@ int satcdd_t::LoadCUE(const char* filename) {
 
 			if (strstr(lptr, "MODE1/2048"))
 			{
-				this->sectorSize = 2048;
-				this->toc.tracks[this->toc.last].type = 1;
+				*sector_size = 2048;
+				table->tracks[table->last].type = 1;
 			}
 			else if (strstr(lptr, "MODE1/2352"))
 			{
-				this->sectorSize = 2352;
-				this->toc.tracks[this->toc.last].type = 1;
+				*sector_size = 2352;
+				table->tracks[table->last].type = 1;
 
-				//FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
+				//FileSeek(&table->tracks[0].f, 0x10, SEEK_SET);
 			}
 			else if (strstr(lptr, "MODE2/2352"))
 			{
-				this->sectorSize = 2352;
-				this->toc.tracks[this->toc.last].type = 2;
+				*sector_size = 2352;
+				table->tracks[table->last].type = 2;
 
-				//FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
+				//FileSeek(&table->tracks[0].f, 0x10, SEEK_SET);
 			}
 
-			if (!this->toc.last)
+			if (!table->last)
 			{
 				/*if (strstr(lptr, "MODE1/2048"))
 				{
-					this->sectorSize = 2048;
-					this->toc.tracks[0].type = 1;
+					*sector_size = 2048;
+					table->tracks[0].type = 1;
 				}
 				else if (strstr(lptr, "MODE1/2352") || strstr(lptr, "MODE2/2352"))
 				{
-					this->sectorSize = 2352;
-					this->toc.tracks[0].type = 1;
+					*sector_size = 2352;
+					table->tracks[0].type = 1;
 
-					FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
+					FileSeek(&table->tracks[0].f, 0x10, SEEK_SET);
 				}
 
-				if (this->sectorSize)
+				if (*sector_size)
 				{
-					this->toc.tracks[0].type = 1;
+					table->tracks[0].type = 1;
 
-					FileReadAdv(&this->toc.tracks[0].f, header, 0x210);
-					FileSeek(&this->toc.tracks[0].f, 0, SEEK_SET);
+					FileReadAdv(&table->tracks[0].f, header, 0x210);
+					FileSeek(&table->tracks[0].f, 0, SEEK_SET);
 				}*/
 			}
 			else
 			{
-				if (!this->toc.tracks[this->toc.last].f.opened())
+				if (!table->tracks[table->last].f.opened())
 				{
-					this->toc.tracks[this->toc.last - 1].end = 0;
+					table->tracks[table->last - 1].end = 0;
 				}
 			}
 
 			new_file = 1;
-			if (!this->toc.tracks[this->toc.last].f.opened())
+			if (!table->tracks[table->last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
+				FileOpen(&table->tracks[table->last].f, fname);
 				new_file = 0;
 			}
 
 #ifdef SATURN_DEBUG
-			printf("\x1b[32mSaturn: track = %u, type = %u\n\x1b[0m", this->toc.last + 1, this->toc.tracks[this->toc.last].type);
+			printf("\x1b[32mSaturn: track = %u, type = %u\n\x1b[0m", table->last + 1, table->tracks[table->last].type);
 #endif // SATURN_DEBUG
 		}
 
 		/* decode PREGAP commands */
 		else if (sscanf(lptr, "PREGAP %02d:%02d:%02d", &mm, &ss, &bb) == 3)
 		{
-			this->toc.tracks[this->toc.last].pregap = bb + ss * 75 + mm * 60 * 75;
-			pregap += this->toc.tracks[this->toc.last].pregap;
+			table->tracks[table->last].pregap = bb + ss * 75 + mm * 60 * 75;
+			pregap += table->tracks[table->last].pregap;
 		}
 
 		/* decode INDEX commands */
@@ -243,117 +254,122 @@ int satcdd_t::LoadCUE(const char* filename) {
 		{
 			int idx_pos = bb + ss * 75 + mm * 60 * 75;
 			if (idx == 0) {
-				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+				if (table->last && !table->tracks[table->last - 1].end)
 				{
-					this->toc.tracks[this->toc.last - 1].end = pregap;
+					table->tracks[table->last - 1].end = pregap;
 				}
 			}
 			else if (idx == 1) {
-				this->toc.tracks[this->toc.last].offset += pregap * this->sectorSize;
+				table->tracks[table->last].offset += pregap * *sector_size;
 
 				if (!new_file)
 				{
-					this->toc.tracks[this->toc.last].start = idx_pos + pregap;
-					if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+					table->tracks[table->last].start = idx_pos + pregap;
+					if (table->last && !table->tracks[table->last - 1].end)
 					{
-						this->toc.tracks[this->toc.last - 1].end = this->toc.tracks[this->toc.last].start - this->toc.tracks[this->toc.last].pregap;
+						table->tracks[table->last - 1].end = table->tracks[table->last].start - table->tracks[table->last].pregap;
 #ifdef SATURN_DEBUG
-						printf("\x1b[32mSaturn: track = %u, start = %u, end = %u\n\x1b[0m", this->toc.last - 1 + 1, this->toc.tracks[this->toc.last - 1].start, this->toc.tracks[this->toc.last - 1].end);
+						printf("\x1b[32mSaturn: track = %u, start = %u, end = %u\n\x1b[0m", table->last - 1 + 1, table->tracks[table->last - 1].start, table->tracks[table->last - 1].end);
 #endif // SATURN_DEBUG
 					}
 				}
 				else
 				{
-					this->toc.tracks[this->toc.last].start = this->toc.end + pregap;
-					this->toc.tracks[this->toc.last].offset += this->toc.end * this->sectorSize;
+					table->tracks[table->last].start = table->end + pregap;
+					table->tracks[table->last].offset += table->end * *sector_size;
 
 					int sectorSize = 2352;
-					if (this->toc.tracks[this->toc.last].type) sectorSize = this->sectorSize;
-					this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((file_size + sectorSize - 1) / sectorSize);
+					if (table->tracks[table->last].type) sectorSize = *sector_size;
+					table->tracks[table->last].end = table->tracks[table->last].start + ((file_size + sectorSize - 1) / sectorSize);
 
-					this->toc.end = this->toc.tracks[this->toc.last].end;
+					table->end = table->tracks[table->last].end;
 #ifdef SATURN_DEBUG
-					printf("\x1b[32mSaturn: track = %u, start = %u, end = %u\n\x1b[0m", this->toc.last + 1, this->toc.tracks[this->toc.last].start, this->toc.tracks[this->toc.last].end);
+					printf("\x1b[32mSaturn: track = %u, start = %u, end = %u\n\x1b[0m", table->last + 1, table->tracks[table->last].start, table->tracks[table->last].end);
 #endif // SATURN_DEBUG
 				}
 
 #ifdef SATURN_DEBUG
-				printf("\x1b[32mSaturn: track = %u, offset = %u\n\x1b[0m", this->toc.last + 1, this->toc.tracks[this->toc.last].offset);
+				printf("\x1b[32mSaturn: track = %u, offset = %u\n\x1b[0m", table->last + 1, table->tracks[table->last].offset);
 #endif // SATURN_DEBUG
 			}
 
 			if (idx == 0) {
-				this->toc.tracks[this->toc.last].indexes[idx] = 0;
+				table->tracks[table->last].indexes[idx] = 0;
 			}
 			else {
 				if (!new_file)
 				{
-					this->toc.tracks[this->toc.last].indexes[idx] = idx_pos - this->toc.tracks[this->toc.last].start;
+					table->tracks[table->last].indexes[idx] = idx_pos - table->tracks[table->last].start;
 				}
 				else
 				{
-					this->toc.tracks[this->toc.last].indexes[idx] = idx_pos;
+					table->tracks[table->last].indexes[idx] = idx_pos;
 				}
 			}
-			this->toc.tracks[this->toc.last].index_num = idx + 1;
+			table->tracks[table->last].index_num = idx + 1;
 #ifdef SATURN_DEBUG
-			//printf("\x1b[32mSaturn: index = %u, pos = %u\n\x1b[0m", idx, this->toc.tracks[this->toc.last].indexes[idx]);
+			//printf("\x1b[32mSaturn: index = %u, pos = %u\n\x1b[0m", idx, table->tracks[table->last].indexes[idx]);
 #endif // SATURN_DEBUG
 		}
 	}
-	this->toc.last++;
+	table->last++;
 
-	if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
+	if (table->last && !table->tracks[table->last - 1].end)
 	{
-		this->toc.end += pregap;
-		this->toc.tracks[this->toc.last - 1].end = this->toc.end;
+		table->end += pregap;
+		table->tracks[table->last - 1].end = table->end;
 	}
 
+	cd_cue_cache_save(filename, "saturn", table, *sector_size);
 	return 0;
 }
 
-int satcdd_t::Load(const char *filename)
+// CUE or CHD image into table, for Load and the other discs of a set.
+int satcdd_t::LoadImage(const char *filename, toc_t *table, int *sector_size)
 {
-	//static char header[32];
-	//fileTYPE *fd_img;
-
-	Unload();
+	*sector_size = 0;
 
 	const char *ext = filename + strlen(filename) - 4;
 	if (!strncasecmp(".cue", ext, 4))
 	{
-		if (LoadCUE(filename)) {
-			return (-1);
-		}
+		return !LoadCUE(filename, table, sector_size);
 	}
 	else if (!strncasecmp(".chd", ext, 4)) {
-		chd_error err = mister_load_chd(filename, &this->toc);
+		chd_error err = mister_load_chd(filename, table);
 		if (err != CHDERR_NONE)
 		{
 			printf("ERROR %s\n", chd_error_string(err));
-			return -1;
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
+			return 0;
 		}
 
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
-		if (this->toc.tracks[0].sector_size)
+		if (table->tracks[0].sector_size)
 		{
-			this->sectorSize = this->toc.tracks[0].sector_size;
+			*sector_size = table->tracks[0].sector_size;
 		}
+		return 1;
 	}
-	else {
-		return (-1);
 
+	return 0;
+}
+
+int satcdd_t::Load(const char *filename)
+{
+	//static char header[32];
+	//fileTYPE *fd_img;
+
+	Unload();
+
+	int sector_size = 0;
+	if (!cd_set_take(filename, &this->toc, &sector_size, LoadImage))
+	{
+		if (!LoadImage(filename, &this->toc, &sector_size)) return -1;
+		cd_set_mounted(filename, sector_size);
 	}
+	this->sectorSize = sector_size;
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sectors(this->toc.chd_f, 0, 1, 0, 0x10, (uint8_t *)header, 0);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -381,6 +397,7 @@ int satcdd_t::Load(const char *filename)
 		this->loaded = 1;
 		this->lid_open = false;
 		this->stop_pend = true;
+		cd_ram_install(&this->toc);
 
 #ifdef SATURN_DEBUG
 		printf("\x1b[32mSaturn: CD mounted, last track = %u\n\x1b[0m", this->toc.last);
@@ -396,22 +413,21 @@ void satcdd_t::Unload()
 {
 	if (this->loaded)
 	{
-		if (this->toc.chd_f)
-		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
+		cdda_stop();
+		cd_ram_release();
+		if (!cd_set_unmount(&this->toc))
 		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
+			if (this->toc.chd_f)
+			{
+				mister_chd_close(this->toc.chd_f);
+			}
 
-		for (int i = 0; i < this->toc.last; i++)
-		{
-			if (this->toc.tracks[i].f.opened())
+			for (int i = 0; i < this->toc.last; i++)
 			{
-				FileClose(&this->toc.tracks[i].f);
+				if (this->toc.tracks[i].f.opened())
+				{
+					FileClose(&this->toc.tracks[i].f);
+				}
 			}
 		}
 
@@ -420,6 +436,7 @@ void satcdd_t::Unload()
 
 	memset(&this->toc, 0x00, sizeof(this->toc));
 	this->sectorSize = 0;
+	this->run_count = 0;
 
 #ifdef SATURN_DEBUG
 	printf("\x1b[32mSaturn: ");
@@ -439,7 +456,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sectors(this->toc.chd_f, 0, 1, offset, 256, buf, 0);
 	}
 	else 
 	{
@@ -602,6 +619,7 @@ void satcdd_t::CommandExec() {
 		this->read_pend = true;
 		this->seek_pend = true;
 		this->seek_delay = CalcSeekDelay(lba_old - 4, fad - 150);
+		if (this->seek_delay) Prefetch(this->lba, SATURN_PREFETCH);
 		this->pause_pend = false;
 		this->speed = comm[10] == 1 ? 1 : 2;
 
@@ -1013,36 +1031,13 @@ void satcdd_t::Update() {
 		else if (this->toc.tracks[this->track].type)
 		{
 			// CD-ROM Data (Mode 1/2)
-			uint8_t header[16];
-
 #ifdef SATURN_DEBUG
 			//printf("\x1b[32mSaturn: ");
 			//printf("Update read data, track = %i, lba = %i, msf = %02X:%02X:%02X, mode = %u", this->track + 1, this->lba + 150, BCD(msf.m), BCD(msf.s), BCD(msf.f), this->toc.tracks[this->track].type);
 			//printf("\n\x1b[0m");
 #endif // SATURN_DEBUG
 
-			if (this->sectorSize == 2048 || (this->lba - this->toc.tracks[this->track].start) < 0) {
-				header[0] = 0x00;
-				header[1] = 0xFF;
-				header[2] = 0xFF;
-				header[3] = 0xFF;
-				header[4] = 0xFF;
-				header[5] = 0xFF;
-				header[6] = 0xFF;
-				header[7] = 0xFF;
-				header[8] = 0xFF;
-				header[9] = 0xFF;
-				header[10] = 0xFF;
-				header[11] = 0x00;
-				header[12] = BCD(msf.m);
-				header[13] = BCD(msf.s);
-				header[14] = BCD(msf.f);
-				header[15] = 0x01;
-				DataSectorSend(header, this->speed);
-			}
-			else {
-				DataSectorSend(0, this->speed);
-			}
+			DataSectorSend(this->speed);
 		}
 		else
 		{
@@ -1136,7 +1131,17 @@ int satcdd_t::SetCommand(uint8_t* data) {
 	return 0;
 }
 
+// The pattern is the same for every sector, it's made once
 void satcdd_t::MakeSecureRingData(uint8_t *buf) {
+	static uint8_t ring[2348];
+	static bool ring_made = false;
+
+	if (ring_made)
+	{
+		memcpy(buf + 12, ring + 12, 2348 - 12);
+		return;
+	}
+
 	int i, j;
 	uint16_t lfsr = 1;
 	uint8_t a;
@@ -1154,66 +1159,103 @@ void satcdd_t::MakeSecureRingData(uint8_t *buf) {
 		}
 		buf[i] = a;
 	}
+
+	memcpy(ring + 12, buf + 12, 2348 - 12);
+	ring_made = true;
 }
 
-uint32_t satcdd_t::DataSectorCalcCRC(uint8_t* buf, int len)
+// Data sectors from lba on (to the end of the track, SATURN_RUN at most)
+// into run_buf with one read, each completed with its header (cooked
+// images, pregap) and EDC, so sending one is a copy. The next run is
+// prefetched meanwhile, so reads at 2x stay ahead of the drive.
+void satcdd_t::ReadRun(int lba)
 {
-	static uint32_t crc_tab[256];
-	for (int i = 0; i < 256; i++)
+	int lba_ = lba >= 0 ? lba : 0;
+	int count = (lba >= 0) ? this->toc.tracks[this->track].end - lba : 1;
+	if (count > SATURN_RUN) count = SATURN_RUN;
+	if (count < 1) count = 1;
+
+	cd_source_t src = {};
+	src.sector_size = this->sectorSize;
+	int start = lba_;
+	if (this->toc.chd_f)
 	{
-		uint32_t c = i;
-
-		for (unsigned j = 0; j < 8; j++)
-			c = (c >> 1) ^ ((c & 0x1) ? 0xD8018001 : 0);
-
-		crc_tab[i] = c;
+		src.chd_f = this->toc.chd_f;
+		start += this->toc.tracks[this->track].offset;
 	}
-
-	uint32_t crc = 0;
-	for (int i = 0; i < len; i++)
+	else
 	{
-		crc ^= buf[i];
-		crc = (crc >> 8) ^ crc_tab[crc & 0xFF];
+		src.f = &this->toc.tracks[this->track].f;
+		src.offset = -this->toc.tracks[this->track].offset;
 	}
 
-	return crc;
-}
+	int got = cd_read_sectors(&src, start, count, CD_READ_RAW, this->run_buf);
+	if (got < 0) got = 0;
+	memset(this->run_buf + got * this->sectorSize, 0, (count - got) * this->sectorSize);
 
-void satcdd_t::ReadData(uint8_t *buf)
-{
-	int offs = 0; 
-	
-	if (this->toc.tracks[this->track].type)
+	// Cooked sectors go after the (missing) 16 byte header, spread from the last one
+	if (this->sectorSize == 2048)
+	{
+		for (int i = count - 1; i >= 0; i--) memmove(this->run_buf + i * 2352 + 16, this->run_buf + i * 2048, 2048);
+	}
+
+	for (int i = 0; i < count; i++)
 	{
-		int lba_ = this->lba >= 0 ? this->lba : 0;
-		if (this->toc.chd_f)
+		uint8_t *data_ptr = this->run_buf + i * 2352;
+
+		if (this->sectorSize == 2048 || (lba + i - this->toc.tracks[this->track].start) < 0)
 		{
-			int read_offset = 0;
-			if (this->sectorSize == 2048)
-			{
-				read_offset += 16;
-			}
+			msf_t msf;
+			LBAToMSF(lba + i + 150, &msf);
+			memset(data_ptr, 0xFF, 12);
+			data_ptr[0] = 0x00;
+			data_ptr[11] = 0x00;
+			data_ptr[12] = BCD(msf.m);
+			data_ptr[13] = BCD(msf.s);
+			data_ptr[14] = BCD(msf.f);
+			data_ptr[15] = 0x01;
+		}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		uint8_t sec_mode = data_ptr[15];
+		uint32_t crc = crc_edc(0, data_ptr, (sec_mode == 2 ? 2348 : 2064));
+		if (sec_mode != 0x02) {
+			data_ptr[2064] = crc >> 0;
+			data_ptr[2065] = crc >> 8;
+			data_ptr[2066] = crc >> 16;
+			data_ptr[2067] = crc >> 24;
+			memset(data_ptr + 2068, 0, 2352 - 2068);
 		}
-		else {
-			if (this->sectorSize == 2048)
-			{
-				offs = (lba_ * 2048) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf + 16, 2048);
-			}
-			else {
-				offs = (lba_ * 2352) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf, 2352);
-			}
+	}
+
+	this->run_lba = lba;
+	this->run_count = count;
+
 #ifdef SATURN_DEBUG
-			//printf("\x1b[32mSaturn: ");
-			//printf("Read data, lba = %i, track = %i, offset = %i", lba_, this->track, offs);
-			//printf(" (%u)\n\x1b[0m", saturn_frame_cnt);
+	//printf("\x1b[32mSaturn: ");
+	//printf("Read data run, lba = %i, count = %i, track = %i", lba, count, this->track);
+	//printf(" (%u)\n\x1b[0m", saturn_frame_cnt);
 #endif // SATURN_DEBUG
-		}
+
+	if (lba >= 0 && lba + count < this->toc.tracks[this->track].end) cd_prefetch(&src, start + count, SATURN_RUN);
+}
+
+// The emulated seek time is used to get the target sectors off the image
+void satcdd_t::Prefetch(int lba, int count)
+{
+	int track = this->toc.GetTrackByLBA(lba < 0 ? 0 : lba);
+
+	cd_source_t src = {};
+	src.sector_size = this->toc.tracks[track].type ? this->sectorSize : 2352;
+	if (this->toc.chd_f)
+	{
+		src.chd_f = this->toc.chd_f;
+		cd_prefetch(&src, lba + this->toc.tracks[track].offset, count);
+	}
+	else if (this->toc.tracks[track].f.opened())
+	{
+		src.f = &this->toc.tracks[track].f;
+		src.offset = -this->toc.tracks[track].offset;
+		cd_prefetch(&src, lba, count);
 	}
 }
 
@@ -1221,21 +1263,13 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 {
 	int sec_offs = first ? 0 : 1;
 
-	uint8_t *dest = buf;
+	// Sectors go to 4KB slots of the buffer
+	cd_source_t src = {};
+	src.sector_size = 2352;
 	if (this->toc.chd_f)
 	{
-		for (int i = sec_offs; i < 2; i++, dest += 4096)
-		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
-
-			//CHD audio requires byteswap. There's probably a better way to do this...
-			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
-			{
-				uint8_t temp = dest[swapidx];
-				dest[swapidx] = dest[swapidx + 1];
-				dest[swapidx + 1] = temp;
-			}
-		}
+		src.chd_f = this->toc.chd_f;
+		cdda_read(&src, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + sec_offs, this->toc.tracks[this->track].end + this->toc.tracks[this->track].offset, buf, 2 - sec_offs, 4096);
 
 		/*if ((len / 2352) > 1)
 		{
@@ -1243,12 +1277,9 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 		}*/
 	}
 	else if (this->toc.tracks[this->track].f.opened()) {
-		int offs = (this->lba * 2352) - this->toc.tracks[this->track].offset;
-		for (int i = sec_offs; i < 2; i++, dest += 4096)
-		{
-			FileSeek(&this->toc.tracks[this->track].f, offs + (i * 2352), SEEK_SET);
-			FileReadAdv(&this->toc.tracks[this->track].f, dest, 2352);
-		}
+		src.f = &this->toc.tracks[this->track].f;
+		src.offset = -this->toc.tracks[this->track].offset;
+		cdda_read(&src, this->lba + sec_offs, this->toc.tracks[this->track].end, buf, 2 - sec_offs, 4096);
 	}
 
 #ifdef SATURN_DEBUG
@@ -1260,36 +1291,19 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	return (first ? 2352 * 2 : 2352);
 }
 
-int satcdd_t::DataSectorSend(uint8_t* header, int speed)
+int satcdd_t::DataSectorSend(int speed)
 {
 	static int buf_num_read = 0, buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
-	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
+	if (this->lba < this->run_lba || this->lba >= this->run_lba + this->run_count) ReadRun(this->lba);
+	const uint8_t *sector = this->run_buf + (this->lba - this->run_lba) * 2352;
 
-	ReadData(data_ptr);
-	if (header) {
-		memcpy(data_ptr, header, 16);
-	}
-	uint8_t sec_mode = data_ptr[15];
-
-	uint32_t crc = DataSectorCalcCRC(data_ptr, (sec_mode == 2 ? 2348 : 2064));
-	if (sec_mode == 0x02) {
-		/*data_ptr[2348] = crc >> 0;
-		data_ptr[2349] = crc >> 8;
-		data_ptr[2350] = crc >> 16;
-		data_ptr[2351] = crc >> 24;*/
-	}
-	else {
-		data_ptr[2064] = crc >> 0;
-		data_ptr[2065] = crc >> 8;
-		data_ptr[2066] = crc >> 16;
-		data_ptr[2067] = crc >> 24;
-		memset(data_ptr + 2068, 0, 2352 - 2068);
-	}
+	uint8_t *shmem_ptr = (uint8_t*)shmem_map_cached(SHMEM_ADDR, 4096 * 4);
+	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
+	memcpy(data_ptr, sector, 2352);
 
 	int boot = (data_ptr[12] == 0x00 && data_ptr[13] == 0x02 && data_ptr[14] == 0x00 && data_ptr[15] == 0x01);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_unmap_cached(shmem_ptr);
 
 
 	buf_num_write++;
@@ -1308,14 +1322,14 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 
 int satcdd_t::RingDataSend(uint8_t* header, int speed)
 {
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_map_cached(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr;
 	if (header) {
 		MakeSecureRingData(data_ptr);
 		memcpy(data_ptr + 12, header, 12);
 		memset(data_ptr + 2348, 0, 4);
 	}
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_unmap_cached(shmem_ptr);
 
 	uint16_t mode = (speed == 2 ? 0x0101 : 0x0000) | 0x0404;
 
@@ -1331,11 +1345,11 @@ int satcdd_t::AudioSectorSend(int first)
 
 	if (first) buf_num_read = buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_map_cached(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 
 	ReadCDDA(data_ptr, first);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_unmap_cached(shmem_ptr);
 
 	if (first) buf_num_write++;
 	buf_num_write++;
@@ -58,6 +58,23 @@ static sharpmz_config_t      config;
 static uint8_t               sector_buffer[1024];
 static sharpmz_tape_header_t tapeHeader;
 static tape_queue_t          tapeQueue;
+
+// Catalog of the queued tapes. The header and data of each MZF are read when it's
+// queued and kept while its mtime and size don't change, so APSS play and the
+// queue walk don't go back to the storage.
+//
+typedef struct
+{
+    sharpmz_tape_header_t header;
+    uint8_t              *data;
+    uint32_t              dataSize;
+    time_t                mtime;
+    off_t                 size;
+    char                 *fileName;              // Same pointer as in tapeQueue.
+} tape_catalog_t;
+static tape_catalog_t        tapeCatalog[MAX_TAPE_QUEUE];
+static tape_catalog_t        tapePopped;             // Last entry popped off the queue.
+static void                  sharpmz_catalog_free(tape_catalog_t *entry);
 static unsigned char         debugEnabled = 0;
 
 static uint32_t set_status(uint32_t new_status, uint32_t mask, int ex = 0)
@@ -347,7 +364,9 @@ void sharpmz_init(void)
     for(int i=0; i < MAX_TAPE_QUEUE; i++)
     {
         tapeQueue.queue[i] = NULL;
+        sharpmz_catalog_free(&tapeCatalog[i]);
     }
+    sharpmz_catalog_free(&tapePopped);
     tapeQueue.tapePos      = 0;
     tapeQueue.elements     = 0;
     tapeQueue.fileName[0]  = 0;
@@ -468,6 +487,87 @@ void sharpmz_poll(void)
     }
 }
 
+// Method to release the data of a catalog entry.
+//
+static void sharpmz_catalog_free(tape_catalog_t *entry)
+{
+    free(entry->data);
+    memset(entry, 0, sizeof(tape_catalog_t));
+}
+
+// Method to read the header and data of a tape (MZF) file into a catalog entry.
+// Returns 0 on success, 1 = open failure, 2 = header read failure, 4 = bad header or data.
+//
+static short sharpmz_catalog_read(const char *tapeFile, tape_catalog_t *entry)
+{
+    unsigned int  actualReadSize;
+    struct stat64 st;
+    fileTYPE      file = {};
+
+    if (stat64(getFullPath(tapeFile), &st) || !FileOpen(&file, tapeFile)) return(1);
+
+    // Read in the tape header, this indicates crucial data such as data type, size, exec address, load address etc.
+    //
+    actualReadSize = sharpmz_file_read(&file, &entry->header, MZ_TAPE_HEADER_SIZE);
+    if(actualReadSize != MZ_TAPE_HEADER_SIZE)
+    {
+        sharpmz_debugf("Only read:%d bytes of header, aborting.\n", actualReadSize);
+        FileClose(&file);
+        return(2);
+    }
+
+    // Some sanity checks.
+    //
+    if(entry->header.dataType == 0 || entry->header.dataType > 5)
+    {
+        FileClose(&file);
+        return(4);
+    }
+
+    // The data goes to the emulator in whole sectors as far as the file has them.
+    //
+    uint32_t wanted = (entry->header.fileSize + 511) & ~511;
+    entry->data = (uint8_t *)malloc(wanted ? wanted : 1);
+    entry->dataSize = 0;
+    while(entry->data && entry->dataSize < entry->header.fileSize)
+    {
+        DISKLED_ON;
+        actualReadSize = sharpmz_file_read(&file, entry->data + entry->dataSize, 512);
+        DISKLED_OFF;
+        if(actualReadSize == 0) break;
+        entry->dataSize += actualReadSize;
+    }
+    FileClose(&file);
+
+    if(!entry->data || entry->dataSize < entry->header.fileSize)
+    {
+        sharpmz_debugf("Bad tape or corruption, read:%d, sizeHeader:%d", entry->dataSize, entry->header.fileSize);
+        sharpmz_catalog_free(entry);
+        return(4);
+    }
+
+    entry->mtime = st.st_mtime;
+    entry->size  = st.st_size;
+    return(0);
+}
+
+// Method to find the catalog entry of a queued tape, if it's still the same file.
+//
+static const tape_catalog_t *sharpmz_catalog_find(const char *tapeFile)
+{
+    const tape_catalog_t *entry = NULL;
+    for(int i=0; i < tapeQueue.elements && i < MAX_TAPE_QUEUE; i++)
+    {
+        if(tapeCatalog[i].data && tapeCatalog[i].fileName && !strcmp(tapeCatalog[i].fileName, tapeFile)) entry = &tapeCatalog[i];
+    }
+    if(!entry && tapePopped.data && !strcmp(tapeQueue.fileName, tapeFile)) entry = &tapePopped;
+    if(!entry) return(NULL);
+
+    struct stat64 st;
+    if(stat64(getFullPath(tapeFile), &st) || st.st_mtime != entry->mtime || st.st_size != entry->size) return(NULL);
+    return(entry);
+}
+
 // Method to push a tape filename onto the queue.
 //
 void sharpmz_push_filename(char *fileName)
@@ -483,6 +583,14 @@ void sharpmz_push_filename(char *fileName)
         // Copy filename into queue.
         strcpy(ptr, fileName);
         tapeQueue.queue[tapeQueue.elements] = ptr;
+
+        // Catalog the tape, a failure just leaves it to be read when played.
+        //
+        tape_catalog_t *entry = &tapeCatalog[tapeQueue.elements];
+        sharpmz_catalog_free(entry);
+        sharpmz_catalog_read(fileName, entry);
+        entry->fileName = ptr;
+
         tapeQueue.elements++;
     }
 
@@ -501,11 +609,20 @@ char *sharpmz_pop_filename(void)
         strcpy(tapeQueue.fileName, tapeQueue.queue[0]);
         free(tapeQueue.queue[0]);
         tapeQueue.elements--;
+
+        // Keep the catalog entry of the popped tape, it's loaded next.
+        //
+        sharpmz_catalog_free(&tapePopped);
+        tapePopped = tapeCatalog[0];
+        tapePopped.fileName = NULL;
+
         for(int i= 1; i < MAX_TAPE_QUEUE; i++)
         {
             tapeQueue.queue[i-1] = tapeQueue.queue[i];
+            tapeCatalog[i-1]     = tapeCatalog[i];
         }
         tapeQueue.queue[MAX_TAPE_QUEUE-1] = NULL;
+        memset(&tapeCatalog[MAX_TAPE_QUEUE-1], 0, sizeof(tape_catalog_t));
 
     }
 
@@ -601,8 +718,10 @@ void sharpmz_clear_filelist(void)
                 free(tapeQueue.queue[i]);
             }
             tapeQueue.queue[i] = NULL;
+            sharpmz_catalog_free(&tapeCatalog[i]);
         }
     }
+    sharpmz_catalog_free(&tapePopped);
     tapeQueue.elements    = 0;
     tapeQueue.tapePos     = 0;
     tapeQueue.fileName[0] = 0;
@@ -2011,7 +2130,6 @@ short sharpmz_read_tape_header(const char *tapeFile)
 //
 short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 {
-    unsigned int  actualReadSize;
     unsigned long time = GetTimer(0);
   #if defined __SHARPMZ_DEBUG__
     char          fileName[17];
@@ -2019,26 +2137,18 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 
     //sharpmz_debugf("Sending tape file:%s to emulator ram", tapeFile);
 
-    // Handle for the MZF file to be processed.
-    //
-    fileTYPE file = {};
-
-    // Try and open the tape file, exit if it cannot be opened.
+    // Queued tapes come out of the catalog, others are read now.
     //
-    if (!FileOpen(&file, tapeFile)) return(1);
-
-    // Read in the tape header, this indicates crucial data such as data type, size, exec address, load address etc.
-    //
-    actualReadSize = sharpmz_file_read(&file, &tapeHeader, 128);
-    if(actualReadSize != 128)
+    tape_catalog_t        loaded = {};
+    const tape_catalog_t *entry = sharpmz_catalog_find(tapeFile);
+    if(!entry)
     {
-        sharpmz_debugf("Only read:%d bytes of header, aborting.\n", actualReadSize);
-        return(2);
+        short ret = sharpmz_catalog_read(tapeFile, &loaded);
+        if(ret) return(ret);
+        entry = &loaded;
     }
+    tapeHeader = entry->header;
 
-    // Some sanity checks.
-    //
-    if(tapeHeader.dataType == 0 || tapeHeader.dataType > 5) return(4);
   #if defined __SHARPMZ_DEBUG__
     for(int i=0; i < 17; i++)
     {
@@ -2078,7 +2188,10 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
     // Check the data type, only load machine code directly to RAM.
     //
     if(dstCMT == 0 && tapeHeader.dataType != SHARPMZ_CMT_MC)
+    {
+        sharpmz_catalog_free(&loaded);
         return(3);
+    }
 
     // Reset Emulator if loading direct to RAM. This clears out memory, resets monitor and places it in a known state.
     //
@@ -2102,24 +2215,7 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
         spi8(0x00);
     }
 
-    for (unsigned short i = 0; i < tapeHeader.fileSize && actualReadSize > 0; i += actualReadSize)
-    {
-        DISKLED_ON;
-        actualReadSize = sharpmz_file_read(&file, sector_buffer, 512);
-        DISKLED_OFF;
-
-        sharpmz_debugf("Bytes to read, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-
-        if(actualReadSize > 0)
-        {
-            // Write the sector (or part) to the fpga memory.
-            spi_write(sector_buffer, actualReadSize, 0);
-        } else
-        {
-            sharpmz_debugf("Bad tape or corruption, should never be 0, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-            return(4);
-        }
-    }
+    spi_write(entry->data, entry->dataSize, 0);
     DisableFpga();
 
     // signal end of transmission
@@ -2165,7 +2261,7 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 #endif
 
     // Tidy up.
-    FileClose(&file);
+    sharpmz_catalog_free(&loaded);
 
 #ifdef __SHARPMZ_DEBUG_EXTRA__
     // Dump out the memory if needed (generally for debug purposes).
@@ -378,7 +378,7 @@ void                   sharpmz_set_config_register(short addr, unsigned char val
 unsigned char          sharpmz_read_config_register(short addr);
 void                   sharpmz_send_file(romData_t &, char *);
 void                   sharpmz_set_rom(romData_t *);
-int                    sharpmz_FileRead(fileTYPE *file, void *pBuffer, int nSize);
+int                    sharpmz_file_read(fileTYPE *file, void *pBuffer, int nSize);
 short                  sharpmz_get_machine_group(void);
 int                    sharpmz_get_fasttape(void);
 int                    sharpmz_get_display_type(void);
@@ -5,10 +5,14 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <glob.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../cfg.h"
+#include "../../profiling.h"
 
 static uint8_t hdr[512];
 
@@ -368,12 +372,264 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
+// Audio streamer.
+// The track is read on a separate thread into a ring buffer ahead of the
+// position the core plays, so a slow read doesn't stall the sectors the core
+// asks for. The start of the loop of the track is kept aside as well, the
+// jump back there at the end of the track is served without waiting for the
+// storage. Requests and reads carry a generation, data of a previous track or
+// position is never handed out.
+
+#define MSU_CHUNK      1024
+#define MSU_READ_SIZE  (16 * 1024)
+#define MSU_LOOP_CACHE (32 * 1024)
+
+struct msu_stream_t
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int busy;      // thread is reading the file
+	uint32_t gen;  // changed on every track change and seek
+	uint32_t track;
+
+	fileTYPE *f;   // NULL while no track is streamed
+	uint8_t *ring;
+	uint32_t size;
+	uint32_t rd;   // ring index of pos
+	uint32_t fill;
+	uint64_t pos;  // file offset the core gets next
+	int eof;
+
+	int loop_pending;
+	int loop_valid;
+	uint64_t loop_pos;
+	uint32_t loop_len;
+	uint32_t loop_rd; // < loop_len while the loop cache is served
+	uint8_t loop[MSU_LOOP_CACHE];
+
+	uint32_t underruns;
+};
+
+static msu_stream_t msu = {};
+
+static void *msu_stream_thread(void *)
+{
+	trace_thread_name("msu_stream");
+
+	pthread_mutex_lock(&msu.lock);
+	while (1)
+	{
+		if (!msu.f || (!msu.loop_pending && (msu.eof || msu.fill == msu.size)))
+		{
+			pthread_cond_wait(&msu.cond, &msu.lock);
+			continue;
+		}
+
+		fileTYPE *f = msu.f;
+		uint32_t gen = msu.gen;
+		uint32_t track = msu.track;
+		msu.busy = 1;
+
+		// The loop start is read once the first sectors are there
+		if (msu.loop_pending && (msu.eof || msu.fill == msu.size || msu.fill >= MSU_READ_SIZE))
+		{
+			pthread_mutex_unlock(&msu.lock);
+
+			// "MSU1" and the loop point in samples of 4 bytes, the core seeks to its sector
+			uint8_t head[8] = {};
+			uint64_t loop_pos = 0;
+			uint32_t len = 0;
+			if (FileSeek(f, 0, SEEK_SET) && FileReadAdv(f, head, sizeof(head)) == sizeof(head) && !memcmp(head, "MSU1", 4))
+			{
+				loop_pos = (8 + (uint64_t)(head[4] | (head[5] << 8) | (head[6] << 16) | ((uint32_t)head[7] << 24)) * 4) & ~(uint64_t)(MSU_CHUNK - 1);
+				if (loop_pos < (uint64_t)f->size && FileSeek(f, loop_pos, SEEK_SET)) len = FileReadAdv(f, msu.loop, MSU_LOOP_CACHE);
+			}
+
+			pthread_mutex_lock(&msu.lock);
+			msu.busy = 0;
+			if (track == msu.track)
+			{
+				msu.loop_pending = 0;
+				msu.loop_pos = loop_pos;
+				msu.loop_len = len;
+				msu.loop_valid = len > 0;
+			}
+			pthread_cond_broadcast(&msu.cond);
+			continue;
+		}
+
+		uint64_t off = msu.pos + msu.fill;
+		uint32_t idx = (msu.rd + msu.fill) % msu.size;
+		uint32_t len = msu.size - msu.fill;
+		if (len > msu.size - idx) len = msu.size - idx;
+		if (len > MSU_READ_SIZE) len = MSU_READ_SIZE;
+		pthread_mutex_unlock(&msu.lock);
+
+		int ret;
+		{
+			TRACE_SCOPE("msu_read");
+			ret = FileSeek(f, off, SEEK_SET) ? FileReadAdv(f, msu.ring + idx, len) : 0;
+		}
+
+		pthread_mutex_lock(&msu.lock);
+		msu.busy = 0;
+		if (gen == msu.gen)
+		{
+			if (ret > 0) msu.fill += ret;
+			if (ret < (int)len) msu.eof = 1;
+		}
+		pthread_cond_broadcast(&msu.cond);
+	}
+
+	return NULL;
+}
+
+static int msu_stream_start()
+{
+	if (msu.running) return 1;
+
+	msu.size = (cfg.msu_buffer ? cfg.msu_buffer : 512) * 1024;
+	msu.ring = (uint8_t*)malloc(msu.size);
+	if (!msu.ring) return 0;
+
+	pthread_mutex_init(&msu.lock, NULL);
+	pthread_cond_init(&msu.cond, NULL);
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	msu.running = !pthread_create(&msu.thread, &attr, msu_stream_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (!msu.running)
+	{
+		printf("MSU: cannot start the streamer, reading inline.\n");
+		free(msu.ring);
+		msu.ring = NULL;
+	}
+	return msu.running;
+}
+
+// Stops streaming the current track, the file may be closed or reopened after.
+static void msu_stream_stop()
+{
+	if (!msu.running) return;
+
+	pthread_mutex_lock(&msu.lock);
+	msu.f = NULL;
+	msu.gen++;
+	while (msu.busy) pthread_cond_wait(&msu.cond, &msu.lock);
+	pthread_mutex_unlock(&msu.lock);
+}
+
+static void msu_stream_track(fileTYPE *f)
+{
+	msu_stream_stop();
+	if (!f->size || !msu_stream_start()) return;
+
+	pthread_mutex_lock(&msu.lock);
+	msu.gen++;
+	msu.track++;
+	msu.f = f;
+	msu.pos = 0;
+	msu.rd = 0;
+	msu.fill = 0;
+	msu.eof = 0;
+	msu.loop_pending = 1;
+	msu.loop_valid = 0;
+	msu.loop_rd = 0;
+	msu.loop_len = 0;
+	pthread_cond_broadcast(&msu.cond);
+	pthread_mutex_unlock(&msu.lock);
+}
+
+static void msu_stream_seek(uint64_t pos)
+{
+	pthread_mutex_lock(&msu.lock);
+	if (msu.loop_rd < msu.loop_len)
+	{
+		// Leave the loop cache, the ring continues behind it
+		msu.loop_rd = msu.loop_len;
+	}
+
+	if (pos >= msu.pos && pos < msu.pos + msu.fill)
+	{
+		uint32_t skip = pos - msu.pos;
+		msu.rd = (msu.rd + skip) % msu.size;
+		msu.fill -= skip;
+		msu.pos = pos;
+	}
+	else
+	{
+		msu.gen++;
+		msu.rd = 0;
+		msu.fill = 0;
+		msu.eof = 0;
+		msu.pos = pos;
+		if (msu.loop_valid && pos == msu.loop_pos)
+		{
+			msu.loop_rd = 0;
+			msu.pos += msu.loop_len;
+		}
+	}
+	pthread_cond_broadcast(&msu.cond);
+	pthread_mutex_unlock(&msu.lock);
+}
+
+static void msu_stream_read(uint8_t *data, int len)
+{
+	pthread_mutex_lock(&msu.lock);
+	if (msu.loop_rd < msu.loop_len)
+	{
+		uint32_t n = msu.loop_len - msu.loop_rd;
+		if (n > (uint32_t)len) n = len;
+		memcpy(data, msu.loop + msu.loop_rd, n);
+		msu.loop_rd += n;
+	}
+	else
+	{
+		if (msu.fill < (uint32_t)len && !msu.eof && msu.f)
+		{
+			uint64_t begin = trace_now_us();
+			msu.underruns++;
+			while (msu.fill < (uint32_t)len && !msu.eof && msu.f) pthread_cond_wait(&msu.cond, &msu.lock);
+			trace_event("msu_underrun", begin);
+		}
+
+		uint32_t n = (msu.fill < (uint32_t)len) ? msu.fill : len;
+		uint32_t first = msu.size - msu.rd;
+		if (first > n) first = n;
+		memcpy(data, msu.ring + msu.rd, first);
+		memcpy(data + first, msu.ring, n - first);
+		msu.rd = (msu.rd + n) % msu.size;
+		msu.fill -= n;
+		msu.pos += n;
+	}
+	trace_counter("msu_fill_kb", msu.fill / 1024);
+	pthread_cond_broadcast(&msu.cond);
+	pthread_mutex_unlock(&msu.lock);
+}
+
 static int msu_send_data(fileTYPE *f, int idx)
 {
 	int chunk = sizeof(buf);
 
 	memset(buf, 0, chunk);
-	if (f->size) FileReadAdv(f, buf, chunk);
+	if (f->size)
+	{
+		if (msu.running && msu.f == f) msu_stream_read(buf, chunk);
+		else FileReadAdv(f, buf, chunk);
+	}
 
 	user_io_set_index(idx);
 	user_io_set_download(1);
@@ -386,6 +642,7 @@ static int msu_send_data(fileTYPE *f, int idx)
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
+	msu_stream_stop();
 	FileClose(&f_audio);
 
 	memset(snes_romFileName, 0, 1024);
@@ -434,14 +691,17 @@ void snes_poll(void)
 		case 0x35:
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
+			msu_stream_stop();
 			FileOpen(&f_audio, SelectedPath);
+			msu_stream_track(&f_audio);
 			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
 			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
 			break;
 
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
-			FileSeek(&f_audio, data * 1024, SEEK_SET);
+			if (msu.running && msu.f == &f_audio) msu_stream_seek((uint64_t)data * 1024);
+			else FileSeek(&f_audio, data * 1024, SEEK_SET);
 			// fallthrough
 
 		case 0x34:
@@ -8,6 +8,8 @@
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
+#include "../../ide.h"
+#include "../../fw_cache.h"
 #include "st_tos.h"
 
 #define ST_WRITE_MEMORY 0x08
@@ -38,6 +40,19 @@ typedef struct {
 static tos_config_t config;
 
 fileTYPE hdd_image[2] = {};
+static ide_wcache_t *hdd_wcache[2] = {};
+
+// Floppy images are small, while inserted they're kept in RAM and written
+// sectors go back through the IDE write-back cache.
+#define TOS_FLOPPY_MAX (4 * 1024 * 1024)
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+	ide_wcache_t *wcache;
+} tos_floppy_t;
+
+static tos_floppy_t floppy[2] = {};
 
 static unsigned char dma_buffer[512];
 
@@ -248,9 +263,10 @@ static void handle_acsi(unsigned char *buffer)
 						if (len > 128) len = 128;
 						length -= len;
 
-						len *= 512;
-						FileReadAdv(&hdd_image[target], buf, len);
-						memory_write(buf, len / 2);
+						FileReadAdv(&hdd_image[target], buf, len * 512);
+						ide_wcache_read(hdd_wcache[target], lba, buf, len);
+						memory_write(buf, len * 256);
+						lba += len;
 					}
 					DISKLED_OFF;
 
@@ -291,16 +307,15 @@ static void handle_acsi(unsigned char *buffer)
 				if (lba + length <= blocks)
 				{
 					DISKLED_ON;
-					FileSeekLBA(&hdd_image[target], lba);
 					while (length)
 					{
 						uint32_t len = length;
 						if (len > 128) len = 128;
 						length -= len;
 
-						len *= 512;
-						memory_read(buf, len / 2);
-						FileWriteAdv(&hdd_image[target], buf, len);
+						memory_read(buf, len * 256);
+						ide_wcache_write(&hdd_wcache[target], &hdd_image[target], lba, buf, len);
+						lba += len;
 					}
 					DISKLED_OFF;
 					dma_ack(0x00);
@@ -506,6 +521,7 @@ static void tos_select_hdd_image(int i, const char *name)
 	tos_debugf("Select ACSI%c image %s", '0' + i, name);
 
 	strcpy(config.acsi_img[i], name);
+	ide_wcache_close(&hdd_wcache[i]);
 	if (!strlen(name))
 	{
 		FileClose(&hdd_image[i]);
@@ -524,13 +540,70 @@ static void tos_select_hdd_image(int i, const char *name)
 	set_control(config.system_ctrl);
 }
 
+static void tos_floppy_eject(int index)
+{
+	ide_wcache_close(&floppy[index].wcache);
+	free(floppy[index].data);
+	floppy[index].data = NULL;
+	floppy[index].size = 0;
+}
+
+static void tos_floppy_load(int index)
+{
+	fileTYPE *f = get_image(index);
+	if (!f->size || f->size > TOS_FLOPPY_MAX || (f->size & 511)) return;
+
+	uint8_t *data = (uint8_t*)malloc(f->size);
+	if (!data) return;
+
+	if (!FileSeek(f, 0, SEEK_SET) || FileReadAdv(f, data, f->size) != (int)f->size)
+	{
+		free(data);
+		FileSeek(f, 0, SEEK_SET);
+		return;
+	}
+
+	FileSeek(f, 0, SEEK_SET);
+	floppy[index].data = data;
+	floppy[index].size = f->size;
+}
+
+int tos_floppy_read(int index, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+	if (index > 1 || !floppy[index].data || offset >= floppy[index].size) return 0;
+
+	uint32_t cnt = floppy[index].size - offset;
+	if (cnt > len) cnt = len;
+	memcpy(buf, floppy[index].data + offset, cnt);
+	if (cnt < len) memset(buf + cnt, 0, len - cnt);
+	return 1;
+}
+
+int tos_floppy_write(int index, uint64_t offset, const uint8_t *buf, uint32_t len)
+{
+	if (index > 1 || !floppy[index].data) return 0;
+	if (offset >= floppy[index].size) return 1;
+
+	uint32_t cnt = floppy[index].size - offset;
+	if (cnt > len) cnt = len;
+	memcpy(floppy[index].data + offset, buf, cnt);
+
+	// whole sectors out of the RAM copy, it has the rest of partial ones
+	uint32_t lba = offset / 512;
+	uint32_t end = (offset + cnt + 511) / 512;
+	ide_wcache_write(&floppy[index].wcache, get_image(index), lba, floppy[index].data + lba * 512, end - lba);
+	return 1;
+}
+
 void tos_insert_disk(int index, const char *name)
 {
 	static int wpins = 0;
 
 	if (index <= 1)
 	{
+		tos_floppy_eject(index);
 		user_io_file_mount(name, index);
+		tos_floppy_load(index);
 		if (tos_disk_is_inserted(index))
 		{
 			if (!index) wpins &= ~TOS_CONTROL_FDC_WR_PROT_A;
@@ -563,17 +636,20 @@ void tos_reset(char cold)
 		fill_tx(0, 16 * 1024, 3);
 
 		// upload and verify tos image
-		int len = FileLoad(config.tos_img, 0, 0);
-		if (len)
+		uint32_t len = 0;
+		uint8_t *tos = fw_cache_load(config.tos_img, &len, 1024 * 1024);
+		if (tos && len)
 		{
 			tos_debugf("TOS.IMG:\n  size = %d", len);
 
-			if (len >= 256 * 1024) user_io_file_tx(config.tos_img, 0);
-			else if (len == 192 * 1024) user_io_file_tx(config.tos_img, 1);
+			if (len >= 256 * 1024) user_io_file_tx_mem(config.tos_img, tos, len, 0);
+			else if (len == 192 * 1024) user_io_file_tx_mem(config.tos_img, tos, len, 1);
 			else tos_debugf("WARNING: Unexpected TOS size!");
+			free(tos);
 		}
 		else
 		{
+			free(tos);
 			tos_debugf("Unable to find tos.img");
 			return;
 		}
@@ -92,6 +92,10 @@ const char *tos_get_cartridge_name();
 char tos_cartridge_is_inserted();
 void tos_load_cartridge(const char *);
 
+// Sector access of the floppies for user_io, 0: not held in RAM, use the image
+int tos_floppy_read(int index, uint64_t offset, uint8_t *buf, uint32_t len);
+int tos_floppy_write(int index, uint64_t offset, const uint8_t *buf, uint32_t len);
+
 void tos_config_load(int slot); // slot -1 == last config
 void tos_config_save(int slot);
 int tos_config_exists(int slot);
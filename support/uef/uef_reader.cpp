@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <assert.h>
+#include <vector>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
@@ -58,168 +59,155 @@ typedef struct {
     uint32_t    pre_carrier;
 } __attribute__((packed)) ChunkInfo;
 
-// TODO - allocate this as part of the desc structure
-static ChunkInfo s_ChunkData = { 0,0,0,0,0,0 };
-
-
+// The whole (inflated) tape is kept in memory with an index of the chunks
+// carrying bits, in tape order, so a bit position is found without parsing
+// the chunks again.
+typedef struct {
+    std::vector<uint8_t>   data;
+    std::vector<ChunkInfo> chunks;
+    uint32_t               numbits;
+    size_t                 cur;     // chunk of the last lookup
+} UEF_Tape;
 
-static uint16_t ReadChunkHeader(FILE* f, ChunkInfo* chunk)
+static uint16_t GetU16(const UEF_Tape *tape, uint32_t pos)
 {
-    chunk->id = -1;
-    chunk->length = 0;
-
-    if (fread(chunk, 1, UEF_ChunkHeaderSize, f) != UEF_ChunkHeaderSize) {
-        return (-1);
-    }
-
-    //fprintf(stderr, "ReadChunkHeader: chunk->id %d chunk->length %d\n", chunk->id,chunk->length);
-    return chunk->id;
+    if (pos + 2 > tape->data.size()) return 0;
+    return tape->data[pos] | (tape->data[pos + 1] << 8);
 }
 
-static ChunkInfo* GetChunkAtPosFile(FILE *f, uint32_t* p_bit_pos)
+static uint32_t GetU32(const UEF_Tape *tape, uint32_t pos)
 {
-    uint32_t bit_pos = *p_bit_pos;
-    uint8_t length_check = (bit_pos == 0xffffffff);
-    ChunkInfo* chunk = &s_ChunkData;
-
-    //fprintf(stderr, "Find pos : %d\n", bit_pos);
-
-    if (chunk->bit_offset_start <= bit_pos && bit_pos < chunk->bit_offset_end) {
-        bit_pos -= chunk->bit_offset_start;
-        *p_bit_pos = bit_pos;
-        return chunk;
-    }
+    if (pos + 4 > tape->data.size()) return 0;
+    return GetU16(tape, pos) | ((uint32_t)GetU16(tape, pos + 2) << 16);
+}
 
+// Reports the chunks without bits and indexes the others.
+static void BuildChunkIndex(UEF_Tape *tape)
+{
+    uint32_t size = tape->data.size();
+    uint32_t pos = 12;      // sizeof(UEF_header)
     uint32_t chunk_start = 0;
-    uint32_t chunk_bitlen = 0;
 
-    if (chunk->bit_offset_end != 0 && bit_pos >= chunk->bit_offset_end) {
-        fseek(f, chunk->file_offset + chunk->length, SEEK_SET);
-        chunk_start = chunk->bit_offset_end;
-        bit_pos -= chunk_start;
+    tape->chunks.clear();
+    tape->cur = 0;
 
-    } else {
-        fseek(f, 12, SEEK_SET);     // sizeof(UEF_header)
-    }
+    while (pos + UEF_ChunkHeaderSize <= size) {
+        ChunkInfo chunk = {};
+        chunk.id = GetU16(tape, pos);
+        chunk.length = GetU32(tape, pos + 2);
+        chunk.file_offset = pos + UEF_ChunkHeaderSize;
 
-    chunk->bit_offset_end = 0;
-
-    while (!feof(f)) {
-        uint16_t id = ReadChunkHeader(f, chunk);
-
-        if (id == (uint16_t) - 1) {
-            break;
-        }
-
-        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk->id, chunk->length, chunk->length, (uint32_t)ftell(f));
-        chunk->file_offset = ftell(f);
+        uint16_t id = chunk.id;
+        uint32_t chunk_bitlen = 0;
+        const uint8_t *data = tape->data.data() + chunk.file_offset;
 
         if (UEF_tapeID == id || UEF_gapID == id || UEF_highToneID == id || UEF_highDummyID == id) {
 
             if (id == UEF_tapeID) {
-                chunk_bitlen = chunk->length * 10;
+                chunk_bitlen = chunk.length * 10;
 
             } else if (id == UEF_gapID || id == UEF_highToneID) {
-                uint16_t ms;
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
+                if (chunk.file_offset + 2 > size) {
                     break;
                 }
 
-                chunk_bitlen = ms * (UEF_Baud / 1000.0);
-                fseek(f, -sizeof(ms), SEEK_CUR);
+                chunk_bitlen = GetU16(tape, chunk.file_offset) * (UEF_Baud / 1000.0);
 
             } else if (id == UEF_highDummyID) {
-                uint16_t ms;
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
-
-                chunk->pre_carrier = ms * (UEF_Baud / 1000.0);
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
+                if (chunk.file_offset + 4 > size) {
                     break;
                 }
 
-                uint32_t post_carrier = ms * (UEF_Baud / 1000.0);
-                chunk_bitlen = chunk->pre_carrier + 20 + post_carrier;
-                fseek(f, -sizeof(ms) * 2, SEEK_CUR);
+                chunk.pre_carrier = GetU16(tape, chunk.file_offset) * (UEF_Baud / 1000.0);
+                uint32_t post_carrier = GetU16(tape, chunk.file_offset + 2) * (UEF_Baud / 1000.0);
+                chunk_bitlen = chunk.pre_carrier + 20 + post_carrier;
             }
 
-            if (bit_pos < chunk_bitlen) {
-                chunk->bit_offset_start = chunk_start;
-                chunk->bit_offset_end = chunk_start + chunk_bitlen;
-                break;
+            if (chunk_bitlen) {
+                chunk.bit_offset_start = chunk_start;
+                chunk.bit_offset_end = chunk_start + chunk_bitlen;
+                tape->chunks.push_back(chunk);
+                chunk_start += chunk_bitlen;
             }
 
-            bit_pos -= chunk_bitlen;
-            chunk_start += chunk_bitlen;
-
-        } else if (length_check) {
-
-            if (UEF_infoID == id) {
-                char buffer[64];
-                uint32_t length = chunk->length;
-
-                while (length > 0) {
-                    uint32_t read_len = length;
+        } else if (UEF_infoID == id) {
+            uint32_t length = chunk.length;
+            if (length > size - chunk.file_offset) length = size - chunk.file_offset;
+            fprintf(stderr, "Drv02:UEF Info : '%.*s'\n", (int)length, (const char*)data);
 
-                    if (read_len > sizeof(buffer) - 1) {
-                        read_len = sizeof(buffer) - 1;
-                    }
-
-                    if (fread(buffer, 1, read_len, f) != read_len) {
-                        break;
-                    }
-
-                    buffer[read_len] = '\0';
-                    fprintf(stderr, "Drv02:UEF Info : '%s'", buffer);
+        } else if (UEF_freqChgID == id) {
+            float freq;
+            if (chunk.file_offset + sizeof(freq) > size) {
+                break;
+            }
 
-                    length -= read_len;
-                }
+            memcpy(&freq, data, sizeof(freq));
+            fprintf(stderr, "Drv02:Ignoring base frequency change : %d\n", (int)freq);
 
-            } else if (UEF_freqChgID == id) {
-                float freq;
+        } else if (UEF_floatGapID == id) {
+            float gap;
+            if (chunk.file_offset + sizeof(gap) > size) {
+                break;
+            }
 
-                if (fread(&freq, 1, sizeof(freq), f) != sizeof(freq)) {
-                    break;
-                }
+            memcpy(&gap, data, sizeof(gap));
+            fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms\n", (int)(gap * 1000.f));
 
-                fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
+        } else if (UEF_securityID == id) {
 
-            } else if (UEF_floatGapID == id) {
-                float gap;
+            fprintf(stderr, "Drv02:UEF security block ignored\n");
 
-                if (fread(&gap, 1, sizeof(gap), f) != sizeof(gap)) {
-                    break;
-                }
+        } else {
+            fprintf(stderr, "Drv02:Unknown UEF block ID %04x\n", id);
+        }
 
-                fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
+        if (chunk.length > size - chunk.file_offset) {
+            break;
+        }
+        pos = chunk.file_offset + chunk.length;
+    }
 
-            } else if (UEF_securityID == id) {
+    tape->numbits = chunk_start;
+}
 
-                fprintf(stderr, "Drv02:UEF security block ignored");
+static const ChunkInfo* GetChunkAtPos(UEF_Tape *tape, uint32_t* p_bit_pos)
+{
+    uint32_t bit_pos = *p_bit_pos;
+    size_t n = tape->chunks.size();
+    if (!n) {
+        return 0;
+    }
 
-            } else {
-                fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
-            }
+    // the bits are read in order, so it's mostly the same or the next chunk
+    size_t i = tape->cur;
+    if (i >= n || bit_pos < tape->chunks[i].bit_offset_start) {
+        i = 0;
+    }
 
-            fseek(f, chunk->file_offset, SEEK_SET);
+    if (bit_pos >= tape->chunks[i].bit_offset_end && i + 1 < n && bit_pos >= tape->chunks[i + 1].bit_offset_end) {
+        size_t lo = i + 1, hi = n;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (tape->chunks[mid].bit_offset_end <= bit_pos) lo = mid + 1;
+            else hi = mid;
         }
-
-        fseek(f, chunk->length, SEEK_CUR);
+        i = lo;
+    } else if (bit_pos >= tape->chunks[i].bit_offset_end) {
+        i++;
     }
 
-    /*DEBUG(1, "OK!");*/
+    if (i >= n) {
+        return 0;
+    }
 
-    *p_bit_pos = bit_pos;
-    return chunk->bit_offset_end ? chunk : 0;
+    tape->cur = i;
+    *p_bit_pos = bit_pos - tape->chunks[i].bit_offset_start;
+    return &tape->chunks[i];
 }
 
-static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
+static uint8_t GetBitAtPos(UEF_Tape *tape, uint32_t bit_pos)
 {
-    ChunkInfo* info = GetChunkAtPosFile(f, &bit_pos);
+    const ChunkInfo* info = GetChunkAtPos(tape, &bit_pos);
 
     if (!info) {
         return 0;
@@ -247,10 +235,8 @@ static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
             return UEF_stopBit;
         }
 
-        uint8_t byte;
-        fseek(f, info->file_offset + byte_offset, SEEK_SET);
-        int ret=fread(&byte, 1, sizeof(byte), f);
-        if (ret<0) fprintf(stderr,"uef: error reading byte\n");
+        uint32_t pos = info->file_offset + byte_offset;
+        uint8_t byte = (pos < tape->data.size()) ? tape->data[pos] : 0;
 
         bit_offset -= 1;        // E (0,7)
         assert(bit_offset < 8);
@@ -282,47 +268,34 @@ static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
     return (byte & (1 << bit_pos)) ? 1 : 0;
 }
 
-#define BUFLEN      16384
 #define CHUNK 16384
 
 #define kBufferSize 4096
 
-static int uef_copy_file(fileTYPE *source, FILE *dest)
+static int uef_copy_file(fileTYPE *source, std::vector<uint8_t> &dest)
 {
-unsigned char in[CHUNK];
-int num_bytes;
-
-
-  do {
-       num_bytes = FileReadAdv(source, in, CHUNK,-1);
-       fprintf(stderr,"fread: %d\n",num_bytes);
-       if (num_bytes<0) {
-           fprintf(stderr,"uef_copy_file: error reading data\n");
-           return -1;
-       }
-       if (fwrite(in, 1, num_bytes, dest) != (size_t)num_bytes || ferror(dest)) {
-           fprintf(stderr,"uef_copy_file: error writing data\n");
-           return -1;
-       }
-   } while (num_bytes!=0);
+    dest.resize(source->size);
+    if (FileReadAdv(source, dest.data(), dest.size(), -1) != (int)dest.size()) {
+        fprintf(stderr,"uef_copy_file: error reading data\n");
+        dest.clear();
+        return -1;
+    }
 
-  return 0;
+    return 0;
 }
 
-/* Decompress from file source to file dest until stream ends or EOF.
+/* Decompress from file source into dest until stream ends or EOF.
    inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
    allocated for processing, Z_DATA_ERROR if the deflate data is
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-static int uef_inflate_file(fileTYPE *source, FILE *dest)
+   is an error reading the file. */
+static int uef_inflate_file(fileTYPE *source, std::vector<uint8_t> &dest)
 {
 
     int ret;
-    unsigned have;
     z_stream strm;
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
 
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
@@ -335,6 +308,10 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
     if (ret != Z_OK)
         return ret;
 
+    // tapes compress well, start with a few times the compressed size
+    dest.clear();
+    dest.reserve(source->size * 4);
+
     /* decompress until deflate stream ends or end of file */
     do {
 
@@ -351,10 +328,10 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
         /* run inflate() on input until output buffer not full */
         do {
 
+            size_t have = dest.size();
+            dest.resize(have + CHUNK);
             strm.avail_out = CHUNK;
-            strm.next_out = out;
-
-
+            strm.next_out = dest.data() + have;
 
             ret = inflate(&strm, Z_NO_FLUSH);
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
@@ -374,11 +351,7 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
             break;
             }
 
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
+            dest.resize(dest.size() - strm.avail_out);
 
         } while (strm.avail_out == 0);
 
@@ -403,9 +376,6 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         } UEF_header;
         UEF_header header;
 
-
-
-
         // the UAE file might be gzipped, if so we need to ungzip it
         // gzip : 1f 8b
         if ( FileReadAdv(inputfile, &fbuf,2) !=2)
@@ -416,96 +386,78 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         // we need to rewind to the beginning
         FileSeek(inputfile, 0, SEEK_SET);
 
-        FILE *uncompressed_file= tmpfile();
+        UEF_Tape tape;
 
         // 1f 8b is the gzip magic number
         if (fbuf[0]==0x1f && fbuf[1]==0x8b) {
             fprintf(stderr,"UEF is compressed\n");
-            uef_inflate_file(inputfile, uncompressed_file);
+            uef_inflate_file(inputfile, tape.data);
         }
         else {
-            uef_copy_file(inputfile,uncompressed_file);
+            uef_copy_file(inputfile, tape.data);
             fprintf(stderr,"UEF is not compressed\n");
         }
 
-        rewind(uncompressed_file);
-
-        if (fread(&header, 1, sizeof(UEF_header), uncompressed_file) != sizeof(UEF_header)) {
+        if (tape.data.size() < sizeof(UEF_header)) {
             fprintf(stderr,"Couldn't read file header\n");
+            return 0;
+        }
 
-        } else if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
+        memcpy(&header, tape.data.data(), sizeof(UEF_header));
+        if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
             fprintf(stderr,"UEF file header mismatch\n");
             fprintf(stderr,"File compressed?\n");
+            return 0;
+        }
 
-        } else {
-            fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
-
-            // figure out how big the file is
-            fseek(uncompressed_file, 0L, SEEK_END);
-            uint32_t size =ftell(uncompressed_file);
-            fprintf(stderr,"size: %d\n",size);
-            rewind(uncompressed_file);
-//FILE *outfile = fopen("tape.raw","wb");
-
-
-            //
-            //  Read the header to find out how big the audio file should be
-            //
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t numbits = 0xffffffff;
-            GetChunkAtPosFile(uncompressed_file,&numbits);
-
-            numbits = ~numbits;
-
-            uint32_t bits_per_second = 1225;
-            fprintf(stderr, "Bit length  : %d\n", numbits);
-            fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
-            fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
-
-            // size is the output size of the file we are creating (or dynamically sending)
-            size= (numbits + 7) / 8;
-            uint32_t  orig_size=size;
-
-            fprintf(stderr,"output size: %d\n",size);
-
-            // clear the header
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t tot_size=0;
-            uint32_t cur_size=0;
-            uint32_t act_size=0;
-
-            while (size) {
-                cur_size= size;
-                if (cur_size>  buf_size) cur_size=buf_size;
-                act_size=cur_size;
-                // artifically clamp size to the end of the bit stream
-                if (addr + act_size >  orig_size)
-                   act_size = orig_size  - addr;
-
-               tot_size+=act_size;
-               // this is a very naive conversion, but it'll have to do for now..
-               for (uint32_t pos = 0; pos < act_size; ++pos) {
-                   uint8_t val = 0;
-                   for (uint32_t bit = 0; bit < 8; ++bit) {
-                      val = val << 1;
-                      val = val | GetBitAtPos(uncompressed_file, ((addr + pos) << 3) + bit);
-                   }
-
-                   fbuf[pos] = val;
-               }
-               if (use_progress) ProgressMessage("Loading", inputfile->name, orig_size-size  , orig_size);
-               user_io_file_tx_data(fbuf, act_size);
-               if (act_size!=cur_size)
-                  fprintf(stderr,"truncated?\n");
-//fwrite(fbuf,1,act_size,outfile);
-               size -= cur_size;
-               addr += cur_size;
+        fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
+        fprintf(stderr,"size: %d\n",(int)tape.data.size());
+
+        //
+        //  Index the chunks, which also tells how big the audio file should be
+        //
+        BuildChunkIndex(&tape);
+        uint32_t numbits = tape.numbits;
+
+        uint32_t bits_per_second = 1225;
+        fprintf(stderr, "Bit length  : %d\n", numbits);
+        fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
+        fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
+
+        // size is the output size of the file we are creating (or dynamically sending)
+        uint32_t size= (numbits + 7) / 8;
+        uint32_t  orig_size=size;
+
+        fprintf(stderr,"output size: %d\n",size);
+
+        uint32_t cur_size=0;
+        uint32_t act_size=0;
+
+        while (size) {
+            cur_size= size;
+            if (cur_size>  buf_size) cur_size=buf_size;
+            act_size=cur_size;
+            // artifically clamp size to the end of the bit stream
+            if (addr + act_size >  orig_size)
+               act_size = orig_size  - addr;
+
+            // this is a very naive conversion, but it'll have to do for now..
+            for (uint32_t pos = 0; pos < act_size; ++pos) {
+                uint8_t val = 0;
+                for (uint32_t bit = 0; bit < 8; ++bit) {
+                   val = val << 1;
+                   val = val | GetBitAtPos(&tape, ((addr + pos) << 3) + bit);
+                }
+
+                fbuf[pos] = val;
             }
-         fclose(uncompressed_file);
+            if (use_progress) ProgressMessage("Loading", inputfile->name, orig_size-size  , orig_size);
+            user_io_file_tx_data(fbuf, act_size);
+            if (act_size!=cur_size)
+               fprintf(stderr,"truncated?\n");
+            size -= cur_size;
+            addr += cur_size;
+        }
 
-//fclose(outfile);
-      }
   return 0;
 }
-
-
@@ -38,6 +38,9 @@
 #include "../../fpga_io.h"
 #include "../../shmem.h"
 #include "../../ide.h"
+#include "../../fw_cache.h"
+#include "../../cfg.h"
+#include "../../scheduler.h"
 #include "x86_share.h"
 
 #define FDD0_BASE   0xF200
@@ -300,36 +303,36 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 
 static int mem_set(uint32_t offset, uint8_t fill_byte, uint32_t size)
 {
-	void *buf = shmem_map(SHMEM_ADDR + offset, size);
+	void *buf = shmem_map_cached(SHMEM_ADDR + offset, size);
 	if (!buf) return 0;
 
 	memset(buf, fill_byte, size);
-	shmem_unmap(buf, size);
+	shmem_unmap_cached(buf);
 
 	return 1;
 }
 
+// ROM is read into normal memory in one go (fw_cache keeps it for the next
+// reset) and copied to the DDR in bulk, reading straight into the uncached
+// mapping is much slower.
 static int load_rom(const char* name, uint32_t mem_offset)
 {
 	printf("BIOS: %s\n", name);
 
-	fileTYPE f;
-	if (!FileOpen(&f, name)) return 0;
+	uint32_t size;
+	uint8_t *data = fw_cache_load(name, &size, 0x40000);
+	if (!data) return 0;
 
-	uint32_t size = f.size;
-
-	void *buf = shmem_map(SHMEM_ADDR + mem_offset, size);
+	void *buf = shmem_map_cached(SHMEM_ADDR + mem_offset, size);
 	if (!buf)
 	{
-		FileClose(&f);
+		free(data);
 		return 0;
 	}
 
-	memset(buf, 0, size);
-	FileReadAdv(&f, buf, size);
-	shmem_unmap(buf, size);
-
-	FileClose(&f);
+	shmem_copy(buf, data, size);
+	shmem_unmap_cached(buf);
+	free(data);
 	return 1;
 }
 
@@ -369,13 +372,21 @@ static uint8_t get_fdd_bios_type(char type)
 
 static fileTYPE fdd0_image = {};
 static fileTYPE fdd1_image = {};
+static uint8_t *fdd_data[2] = {}; // whole floppy in RAM, NULL if it didn't fit
 static fileTYPE ide_image[4] = {};
 static bool boot_from_floppy = 1;
 
-static int img_read(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
+// Returns the sector data (mapped image or buf), NULL on error
+static uint32_t *img_read(fileTYPE *f, uint32_t lba, uint32_t *buf, uint32_t cnt)
 {
-	if (!FileSeekLBA(f, lba)) return 0;
-	return FileReadAdv(f, buf, cnt * 512);
+	if (cfg.hdd_mmap)
+	{
+		const void *data = FileMapRead(f, (__off64_t)lba << 9, cnt * 512);
+		if (data) return (uint32_t*)data;
+	}
+
+	if (!FileSeekLBA(f, lba)) return NULL;
+	return FileReadAdv(f, buf, cnt * 512) ? buf : NULL;
 }
 
 static uint32_t img_write(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
@@ -390,6 +401,9 @@ static void fdd_set(int num, char* filename)
 
 	fileTYPE *fdd_image = num ? &fdd1_image : &fdd0_image;
 
+	free(fdd_data[num]);
+	fdd_data[num] = NULL;
+
 	int floppy = ide_img_mount(fdd_image, filename, 1);
 	uint32_t size = fdd_image->size/512;
 	printf("floppy size: %d blks\n", size);
@@ -416,6 +430,16 @@ static void fdd_set(int num, char* filename)
 		floppy = 0;
 	}
 
+	// Floppies are small, read once here instead of a seek and read per sector
+	if (floppy && (fdd_data[num] = (uint8_t*)malloc(size * 512)))
+	{
+		if (!FileSeekLBA(fdd_image, 0) || FileReadAdv(fdd_image, fdd_data[num], size * 512) != (int)(size * 512))
+		{
+			free(fdd_data[num]);
+			fdd_data[num] = NULL;
+		}
+	}
+
 	/*
 	0x00.[0]:      media present
 	0x01.[0]:      media writeprotect
@@ -689,13 +713,18 @@ static void fdd_io(uint8_t read)
 
 	x86_dma_recvbuf(FDD0_BASE, sizeof(sd_params) >> 2, (uint32_t*)&sd_params);
 
+	int num = 0;
 	if (sd_params.lba >> 15)
 	{
 		// Floppy B:
 		sd_params.lba &= 0x7FFF;
 		img = &fdd1_image;
+		num = 1;
 	}
 
+	uint8_t *mirror = fdd_data[num];
+	uint32_t blocks = img->size / 512;
+
 	int res = 0;
 	if (read)
 	{
@@ -703,9 +732,10 @@ static void fdd_io(uint8_t read)
 
 		if (img->size)
 		{
-			if (img_read(img, sd_params.lba, &secbuf, 1))
+			uint32_t *data = (mirror && sd_params.lba < blocks) ? (uint32_t*)(mirror + sd_params.lba * 512) : img_read(img, sd_params.lba, secbuf, 1);
+			if (data)
 			{
-				x86_dma_sendbuf(FDD0_BASE + 255, 128, secbuf);
+				x86_dma_sendbuf(FDD0_BASE + 255, 128, data);
 				res = 1;
 			}
 		}
@@ -734,6 +764,7 @@ static void fdd_io(uint8_t read)
 					if (img_write(img, sd_params.lba, secbuf, sd_params.cnt))
 					{
 						res = 1;
+						if (mirror && sd_params.lba + sd_params.cnt <= blocks) memcpy(mirror + sd_params.lba * 512, secbuf, sd_params.cnt * 512);
 					}
 				}
 				else
@@ -753,13 +784,14 @@ static void fdd_io(uint8_t read)
 	}
 }
 
-void x86_poll(int only_ide)
+int x86_poll(int only_ide)
 {
-	if(!only_ide) x86_share_poll();
-
 	uint16_t sd_req = ide_check();
-	if (sd_req)
+	int active = sd_req || ide_async_pending();
+	if (active)
 	{
+		scheduler_activity();
+
 		if (sd_req & 0x400) ide_cdda_send_sector();
 
 		ide_io(0, sd_req & 7);
@@ -769,6 +801,8 @@ void x86_poll(int only_ide)
 		sd_req >>= 3;
 		if (!only_ide && (sd_req & 3)) fdd_io(sd_req & 1);
 	}
+
+	return active;
 }
 
 void x86_set_image(int num, char *filename)
@@ -2,7 +2,7 @@
 #define X86_H
 
 void x86_init();
-void x86_poll(int only_ide);
+int x86_poll(int only_ide); // 0 if there was nothing to do
 void x86_ide_set();
 
 void x86_set_image(int num, char *filename);
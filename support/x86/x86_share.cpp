@@ -42,6 +42,7 @@
 #include "../../file_io.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../share_cache.h"
 
 #define SHMEM_ADDR      0x300CE000
 #define SHMEM_SIZE      0x2000
@@ -99,7 +100,7 @@ static int baselen = 0;
 struct dir_item_t
 {
 	dirent64 de;
-	stat64 st;
+	struct stat64 st;
 };
 
 struct lock
@@ -173,6 +174,97 @@ static short get_fp()
 	return fp;
 }
 
+// Per handle transfer state. Sequential writes are collected and go to the
+// file in big blocks instead of a seek, write and flush per small request.
+// Sequential reads send readahead hints so the next requests hit the page cache.
+#define WB_SIZE    (256 * 1024)
+#define WB_TIMEOUT 1000 // ms, write out a buffer which stopped growing
+#define RA_SIZE    (512 * 1024)
+
+struct xfer_t
+{
+	uint8_t *wbuf;
+	uint32_t wstart;
+	uint32_t wlen;
+	int werror;
+	unsigned long wtimer;
+	uint32_t rnext;    // end of the last read
+	uint32_t rahead;   // hinted up to here
+};
+
+static std::map<short, xfer_t> xfers;
+
+static int xfer_flush(short key)
+{
+	auto it = xfers.find(key);
+	if (it == xfers.end() || !it->second.wlen) return 1;
+
+	xfer_t &x = it->second;
+	fileTYPE *f = &open_file_handles[key];
+	if (!FileSeek(f, x.wstart, SEEK_SET) || FileWriteAdv(f, x.wbuf, x.wlen) != (int)x.wlen)
+	{
+		printf("x86_share: write error in %s\n", f->name);
+		x.werror = 1;
+	}
+
+	x.wlen = 0;
+	return !x.werror;
+}
+
+static void xfer_flush_all()
+{
+	for (auto &pair : xfers) xfer_flush(pair.first);
+}
+
+static void xfer_close(short key)
+{
+	auto it = xfers.find(key);
+	if (it == xfers.end()) return;
+
+	free(it->second.wbuf);
+	xfers.erase(it);
+}
+
+static int xfer_write(short key, uint32_t off, const void *data, uint16_t sz)
+{
+	xfer_t &x = xfers[key];
+	if (x.werror) return 0;
+
+	if (x.wlen && (off != x.wstart + x.wlen || x.wlen + sz > WB_SIZE))
+	{
+		if (!xfer_flush(key)) return 0;
+	}
+
+	if (!x.wbuf) x.wbuf = (uint8_t*)malloc(WB_SIZE);
+	if (!x.wbuf)
+	{
+		fileTYPE *f = &open_file_handles[key];
+		FileSeek(f, off, SEEK_SET);
+		return FileWriteAdv(f, (void*)data, sz);
+	}
+
+	if (!x.wlen) x.wstart = off;
+	memcpy(x.wbuf + x.wlen, data, sz);
+	x.wlen += sz;
+	x.wtimer = GetTimer(WB_TIMEOUT);
+	return sz;
+}
+
+static void xfer_read_hint(short key, uint32_t off, int len)
+{
+	xfer_t &x = xfers[key];
+	if (off != x.rnext) x.rahead = off;
+	x.rnext = off + len;
+
+	// Keep at least half the window ahead of the reader
+	if (x.rahead < x.rnext + RA_SIZE / 2)
+	{
+		fileTYPE *f = &open_file_handles[key];
+		if (f->filp) posix_fadvise(fileno(f->filp), x.rahead, RA_SIZE, POSIX_FADV_WILLNEED);
+		x.rahead += RA_SIZE;
+	}
+}
+
 static char* find_path(const char *name)
 {
 	dbg_print("find_path(%s)\n", name);
@@ -259,7 +351,7 @@ static char* find_path(const char *name)
 		else
 		{
 			*p = 0;
-			if (!PathIsDir(str, 0)) str[0] = 0;
+			if (!share_is_dir(str)) str[0] = 0;
 			else *p = '/';
 		}
 	}
@@ -291,8 +383,10 @@ static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *s
 	if (date) *date = 0;
 	if (size) *size = 0;
 
-	stat64 *st = getPathStat(path);
-	if (!st) return 0;
+	const share_item_t *it = share_lookup(path);
+	if (!it) return 0;
+
+	const struct stat64 *st = &it->st;
 
 	tm *t = localtime(&st->st_mtime);
 	if (time) *time = (t->tm_sec / 2) | (t->tm_min << 5) | (t->tm_hour << 11);
@@ -301,68 +395,15 @@ static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *s
 	return st->st_mode;
 }
 
-static void name83(const char *src, char *dst)
-{
-	int namelen = 0;
-	int extlen = 0;
-
-	const char *p = strrchr(src, '/');
-	if (p) src = p + 1;
-
-	if (!strcmp(src, ".") || !strcmp(src, ".."))
-	{
-		namelen = strlen(src);
-	}
-	else
-	{
-		p = strrchr(src, '.');
-		if (!p) namelen = strlen(src);
-		else
-		{
-			namelen = p - src;
-			extlen = strlen(src) - namelen - 1;
-		}
-	}
-
-
-	char ext[4] = { ' ', ' ', ' ', 0 };
-	if (p) memcpy(ext, p + 1, extlen);
-	for (int i = 0; i < namelen; i++) dst[i] = toupper(src[i]);
-	while (namelen < 8) dst[namelen++] = ' ';
-	for (int i = 0; i < 3; i++) dst[8 + i] = toupper(ext[i]);
-}
-
-static int cmp_name(const char *name, const char *flt)
+// fltname is the 8.3 form of the search pattern
+static int cmp_name(const share_item_t &item, const char *fltname)
 {
-	int namelen = 0;
-	int extlen = 0;
+	if (!item.fits83) return 0;
 
-	const char *ext = strrchr(name, '.');
-	if (!ext)
-	{
-		namelen = strlen(name);
-		ext = name + namelen;
-	}
-	else
-	{
-		namelen = ext - name;
-		ext++;
-		extlen = strlen(ext);
-	}
-
-	if (namelen > 8 || extlen > 3) return 0;
-
-	char testname[16];
-	char fltname[16];
-	name83(name, testname);
-	name83(flt, fltname);
-
-	testname[11] = 0;
-	fltname[11] = 0;
-
-	char *cmpname = fltname;
-	char *cmpend = fltname + 8;
-	char *cur = testname;
+	const char *testname = item.name83;
+	const char *cmpname = fltname;
+	const char *cmpend = fltname + 8;
+	const char *cur = testname;
 
 	while (cmpname < cmpend)
 	{
@@ -451,6 +492,9 @@ static int process_request(void *reqres_buffer)
 	char *buf = ((char*)reqres_buffer) + 8;
 	buf[len] = 0;
 
+	// Anything but data transfer may look at sizes or names, buffered writes go out first
+	if (func != AL_READ && func != AL_WRITE) xfer_flush_all();
+
 	switch (func)
 	{
 	case AL_RMDIR:
@@ -471,6 +515,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		share_changed(path);
 		res = 0;
 	}
 	break;
@@ -492,6 +537,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		share_changed(path);
 		res = 0;
 	}
 	break;
@@ -501,7 +547,7 @@ static int process_request(void *reqres_buffer)
 		dbg_print("> AL_CHDIR\n");
 
 		char *path = find_path(buf);
-		if (!*path || !PathIsDir(path))
+		if (!*path || !share_is_dir(path))
 		{
 			res = 3;
 			break;
@@ -523,7 +569,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
-		if (!FileExists(path, 0))
+		if (!share_is_file(path))
 		{
 			res = 2;
 			break;
@@ -542,9 +588,11 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		strcpy(open_file_handles[key].path, path);
+		posix_fadvise(fileno(open_file_handles[key].filp), 0, 0, POSIX_FADV_SEQUENTIAL);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4));
 		buf += 8;
@@ -602,10 +650,13 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		strcpy(open_file_handles[key].path, path);
+		posix_fadvise(fileno(open_file_handles[key].filp), 0, 0, POSIX_FADV_SEQUENTIAL);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
+		share_changed(path);
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4));
 		buf += 8;
 		*buf++ = key;
@@ -645,7 +696,7 @@ static int process_request(void *reqres_buffer)
 		int mode = openmode & 0x3;
 		uint16_t spopres = 0;
 
-		if (FileExists(path, 0))
+		if (share_is_file(path))
 		{
 			if ((actioncode & 0xF) == 1)
 			{
@@ -689,10 +740,13 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		strcpy(open_file_handles[key].path, path);
+		posix_fadvise(fileno(open_file_handles[key].filp), 0, 0, POSIX_FADV_SEQUENTIAL);
 
 		*buf++ = 0;
-		name83(path, buf);
+		share_name83(path, buf);
 		buf += 11;
+		if (spopres != 1) share_changed(path);
 		get_attr(path, (uint16_t*)buf, (uint16_t*)(buf + 2), (uint32_t*)(buf + 4)); // 12 14 16
 		buf += 8;
 		*buf++ = key;
@@ -711,16 +765,23 @@ static int process_request(void *reqres_buffer)
 		dbg_print("> AL_CLOSE\n");
 
 		key = *(short *)buf;
+		int failed = 0;
 		if (open_file_handles.find(key) != open_file_handles.end())
 		{
-			FileClose(&open_file_handles[key]);
+			failed = xfers.count(key) && xfers[key].werror;
+			xfer_close(key);
+
+			fileTYPE &f = open_file_handles[key];
+			int written = f.mode & (O_WRONLY | O_RDWR);
+			FileClose(&f);
+			if (written) share_changed(f.path);
 			open_file_handles.erase(key);
 
 			dbg_print("closed handle: %d\n", key);
 		}
 
 		reslen = 0;
-		res = 0;
+		res = failed ? 5 : 0;
 	}
 	break;
 
@@ -740,6 +801,12 @@ static int process_request(void *reqres_buffer)
 		uint16_t sz = buf[6] | (buf[7] << 8);
 		dbg_print("  read %d bytes at %d\n", sz, off);
 
+		if (!xfer_flush(key))
+		{
+			res = 5;
+			break;
+		}
+
 		FileSeek(&open_file_handles[key], off, SEEK_SET);
 
 		int read = FileReadAdv(&open_file_handles[key], buf, sz, -1);
@@ -749,6 +816,8 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		xfer_read_hint(key, off, read);
+
 		dbg_print("  was read %d\n", read);
 
 		reslen = read;
@@ -772,18 +841,21 @@ static int process_request(void *reqres_buffer)
 		uint16_t sz = buf[6] | (buf[7] << 8);
 		dbg_print("  write %d bytes at %d\n", sz, off);
 
-		FileSeek(&open_file_handles[key], off, SEEK_SET);
-
 		int written = 0;
 		if (sz)
 		{
-			written = FileWriteAdv(&open_file_handles[key], buf + 8, sz);
+			written = xfer_write(key, off, buf + 8, sz);
 			if (!written)
 			{
 				res = 5;
 				break;
 			}
 		}
+		else
+		{
+			xfer_flush(key);
+			FileSeek(&open_file_handles[key], off, SEEK_SET);
+		}
 
 		dbg_print("  written %d\n", written);
 
@@ -918,6 +990,8 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		share_changed(path);
+		share_changed(str);
 		res = 0;
 	}
 	break;
@@ -945,6 +1019,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		share_changed(path);
 		res = 0;
 	}
 	break;
@@ -974,12 +1049,11 @@ static int process_request(void *reqres_buffer)
 		*flt++ = 0;
 		key = add_lock(token);
 
-		const char* full_path = getFullPath(path);
-		DIR *d = opendir(full_path);
-		if (!d)
+		const std::vector<share_item_t> *items = share_list(path);
+		if (!items)
 		{
 			locks.erase(key);
-			printf("Couldn't open dir: %s\n", full_path);
+			printf("Couldn't open dir: %s\n", getFullPath(path));
 			res = 0x12;
 			break;
 		}
@@ -1007,24 +1081,20 @@ static int process_request(void *reqres_buffer)
 		}
 		else
 		{
-			struct dirent64 de, *de2;
-			while ((de2 = readdir64(d)))
+			char fltname[11];
+			share_name83(flt, fltname);
+
+			struct dirent64 de = {};
+			for (const share_item_t &it : *items)
 			{
-				if (de2->d_type == DT_REG || (attr & FAT_DIR))
+				if ((it.type == DT_REG || (attr & FAT_DIR)) && cmp_name(it, fltname))
 				{
-					memcpy(&de, de2, sizeof(dirent64));
-					sprintf(str, "%s/%s", path, de.d_name);
-					stat64 *st = getPathStat(str);
-
-					if (st && cmp_name(de.d_name, flt))
-					{
-						name83(de2->d_name, de.d_name);
-						de.d_name[11] = 0;
-						locks[key].dir_items.push_back({ de, *st });
-					}
+					de.d_type = it.type;
+					memcpy(de.d_name, it.name83, 11);
+					de.d_name[11] = 0;
+					locks[key].dir_items.push_back({ de, it.st });
 				}
 			}
-			closedir(d);
 		}
 	}
 	// fall through
@@ -1128,7 +1198,7 @@ static int process_request(void *reqres_buffer)
 	return reslen;
 }
 
-void x86_share_poll()
+int x86_share_poll()
 {
 	if (!shmem)
 	{
@@ -1138,7 +1208,12 @@ void x86_share_poll()
 	else if (shmem != (uint8_t *)-1)
 	{
 		static uint32_t old_req_id = 0;
-		uint32_t req_id = *(uint32_t*)(shmem + REQUEST_FLG);
+		uint32_t req_id = *(volatile uint32_t*)(shmem + REQUEST_FLG);
+
+		for (auto &pair : xfers)
+		{
+			if (pair.second.wlen && CheckTimer(pair.second.wtimer)) xfer_flush(pair.first);
+		}
 
 		if ((uint16_t)old_req_id != (uint16_t)req_id)
 		{
@@ -1148,14 +1223,21 @@ void x86_share_poll()
 			if (((req_id >> 16) & 0xFFFF) == 0xA55A && ((req_id + 77) & 0xFF) == ((req_id >> 8) & 0xFF))
 			{
 				process_request(shmem + REQUEST_BUFFER);
-				*(uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
+				*(volatile uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
+				return 1;
 			}
 		}
 	}
+
+	return 0;
 }
 
 void x86_share_reset()
 {
+	xfer_flush_all();
+	for (auto &pair : xfers) free(pair.second.wbuf);
+	xfers.clear();
+
 	open_file_handles.clear();
 	locks.clear();
 	next_fp = 1;
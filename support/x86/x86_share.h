@@ -1,10 +1,10 @@
 
-#ifndef __MINIMIG_SHARE_H__
-#define __MINIMIG_SHARE_H__
+#ifndef __X86_SHARE_H__
+#define __X86_SHARE_H__
 
 #include <stdint.h>
 
-void x86_share_poll();
+int x86_share_poll(); // 1 if a request was served
 void x86_share_reset();
 
 #endif
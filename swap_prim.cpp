@@ -0,0 +1,87 @@
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "swap_prim.h"
+
+void swap16(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+#ifdef __ARM_NEON
+	while (len >= 64)
+	{
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+		vst1q_u8(dst, vrev16q_u8(a));
+		vst1q_u8(dst + 16, vrev16q_u8(b));
+		vst1q_u8(dst + 32, vrev16q_u8(c));
+		vst1q_u8(dst + 48, vrev16q_u8(d));
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+
+	while (len >= 16)
+	{
+		vst1q_u8(dst, vrev16q_u8(vld1q_u8(src)));
+		src += 16;
+		dst += 16;
+		len -= 16;
+	}
+#endif
+
+	for (; len >= 2; len -= 2)
+	{
+		uint8_t a = src[0];
+		dst[0] = src[1];
+		dst[1] = a;
+		src += 2;
+		dst += 2;
+	}
+
+	if (len && dst != src) *dst = *src;
+}
+
+void swap32(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+#ifdef __ARM_NEON
+	while (len >= 64)
+	{
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+		vst1q_u8(dst, vrev32q_u8(a));
+		vst1q_u8(dst + 16, vrev32q_u8(b));
+		vst1q_u8(dst + 32, vrev32q_u8(c));
+		vst1q_u8(dst + 48, vrev32q_u8(d));
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+
+	while (len >= 16)
+	{
+		vst1q_u8(dst, vrev32q_u8(vld1q_u8(src)));
+		src += 16;
+		dst += 16;
+		len -= 16;
+	}
+#endif
+
+	for (; len >= 4; len -= 4)
+	{
+		uint8_t a = src[0], b = src[1];
+		dst[0] = src[3];
+		dst[1] = src[2];
+		dst[2] = b;
+		dst[3] = a;
+		src += 4;
+		dst += 4;
+	}
+
+	if (len && dst != src) memcpy(dst, src, len);
+}
@@ -0,0 +1,16 @@
+#ifndef SWAP_PRIM_H
+#define SWAP_PRIM_H
+
+#include <stdint.h>
+
+// Byte order primitives for ROM data (v64/n64 images, 16-bit hashes).
+// dst may be the same as src. Bytes past the last whole word are copied as
+// they are.
+
+// every 16-bit word byte swapped
+void swap16(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+// every 32-bit word byte reversed
+void swap32(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+#endif
@@ -39,6 +39,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SXMLC_MMAP
+#endif
 #include "sxmlc.h"
 
 /*
@@ -1592,6 +1599,38 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
 	if (sax == NULL || filename == NULL || filename[0] == NULC)
 		return false;
 
+#if defined(SXMLC_MMAP) && !defined(SXMLC_UNICODE)
+	{
+		/* Parse straight from the page cache. The mapping is followed by at least one zero
+		   page of its own so the buffer parser finds its terminator even for a file that
+		   ends on a page boundary. */
+		int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0) {
+			long page = sysconf(_SC_PAGESIZE);
+			size_t map_len = ((size_t)st.st_size + page) & ~(size_t)(page - 1);
+			char* area = (char*)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (area != MAP_FAILED) {
+				if (mmap(area, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0) != MAP_FAILED) {
+					DataSourceBuffer dsb = { area, 0 };
+					close(fd);
+					madvise(area, st.st_size, MADV_SEQUENTIAL);
+					sd.name = (SXML_CHAR*)filename;
+					sd.user = user;
+					sd.file = NULL;
+					sd.dsb = &dsb;
+					ret = _parse_data_SAX((void*)&dsb, DATA_SOURCE_BUFFER, sax, &sd);
+					munmap(area, map_len);
+					return ret;
+				}
+				munmap(area, map_len);
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+#endif
+
 	f = sx_fopen(filename, fmode);
 	if (f == NULL)
 		return false;
@@ -1606,6 +1645,7 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
 	sd.name = (SXML_CHAR*)filename;
 	sd.user = user;
 	sd.file = f;
+	sd.dsb = NULL;
 #ifdef SXMLC_UNICODE
 	bom = freadBOM(f, NULL, NULL); /* Skip BOM, if any */
 	/* In Unicode, re-open the file in text-mode if there is no BOM (or UTF-8) as we assume that
@@ -1636,9 +1676,20 @@ int XMLDoc_parse_buffer_SAX(const SXML_CHAR* buffer, const SXML_CHAR* name, cons
 
 	sd.name = name;
 	sd.user = user;
+	sd.file = NULL;
+	sd.dsb = &dsb;
 	return _parse_data_SAX((void*)&dsb, DATA_SOURCE_BUFFER, sax, &sd);
 }
 
+long XMLDoc_SAX_pos(const SAX_Data* sd)
+{
+	if (sd == NULL)
+		return 0;
+	if (sd->dsb != NULL)
+		return sd->dsb->cur_pos;
+	return sd->file != NULL ? ftell(sd->file) : 0;
+}
+
 int XMLDoc_parse_file_DOM_text_as_nodes(const SXML_CHAR* filename, XMLDoc* doc, int text_as_nodes)
 {
 	DOM_through_SAX dom;
@@ -1788,6 +1839,93 @@ int _beob(DataSourceBuffer* ds)
 	return false;
 }
 
+#ifndef SXMLC_UNICODE
+static int _count_char(const SXML_CHAR* p, int len, SXML_CHAR c)
+{
+	int n = 0;
+	const SXML_CHAR* end = p + len;
+	while ((p = (const SXML_CHAR*)memchr(p, c, end - p)) != NULL) {
+		n++;
+		p++;
+	}
+	return n;
+}
+
+/* 'read_line_alloc' for buffers: same result, but the text up to 'to' is found with
+   'strchr' and copied in one go instead of character by character. The line buffer
+   grows by doubling. */
+static int _read_line_buffer(DataSourceBuffer* ds, SXML_CHAR** line, int* sz_line, int i0, SXML_CHAR from, SXML_CHAR to, int keep_fromto, SXML_CHAR interest, int* interest_count)
+{
+	const SXML_CHAR *p = ds->buf + ds->cur_pos, *end;
+	int n, len, need;
+	SXML_CHAR ch = NULC;
+
+	if (interest_count != NULL)
+		*interest_count = 0;
+
+	/* Search for character 'from' */
+	if (from == NULC) {
+		if (*p != NULC)
+			ch = *p++;
+	} else {
+		end = sx_strchr(p, from);
+		if (end == NULL)
+			end = p + strlen(p);
+		if (interest_count != NULL)
+			*interest_count += _count_char(p, (int)(end - p) + (*end != NULC), interest);
+		p = end;
+		if (*p != NULC)
+			ch = *p++;
+	}
+
+	if (*line == NULL || *sz_line == 0) {
+		if (*sz_line == 0) *sz_line = MEM_INCR_RLA;
+		*line = (SXML_CHAR*)__malloc(*sz_line*sizeof(SXML_CHAR));
+		if (*line == NULL)
+			return 0;
+	}
+	if (i0 < 0)
+		i0 = 0;
+	if (i0 > *sz_line)
+		return 0;
+
+	n = i0;
+	if (ch == NULC) { /* End of buffer before 'to' char => return the empty string */
+		ds->cur_pos = (int)(p - ds->buf);
+		(*line)[n] = NULC;
+		return n;
+	}
+	if (from == NULC && interest_count != NULL && ch == interest)
+		(*interest_count)++;
+
+	end = sx_strchr(p, to);
+	len = end != NULL ? (int)(end - p) + 1 : (int)strlen(p);
+	if (interest_count != NULL)
+		*interest_count += _count_char(p, len, interest);
+
+	need = n + 2 + len;
+	if (need > *sz_line) {
+		int sz = *sz_line * 2;
+		SXML_CHAR* pt;
+		if (sz < need)
+			sz = need;
+		pt = (SXML_CHAR*)__realloc(*line, sz*sizeof(SXML_CHAR));
+		if (pt == NULL)
+			return 0;
+		*line = pt;
+		*sz_line = sz;
+	}
+
+	if (ch != from || keep_fromto)
+		(*line)[n++] = ch;
+	memcpy(*line + n, p, len*sizeof(SXML_CHAR));
+	n += (end != NULL && !keep_fromto) ? len - 1 : len;
+	(*line)[n] = NULC;
+	ds->cur_pos = (int)(p + len - ds->buf);
+	return n;
+}
+#endif
+
 int read_line_alloc(void* in, DataSourceType in_type, SXML_CHAR** line, int* sz_line, int i0, SXML_CHAR from, SXML_CHAR to, int keep_fromto, SXML_CHAR interest, int* interest_count)
 {
 	int init_sz = 0;
@@ -1802,6 +1940,15 @@ int read_line_alloc(void* in, DataSourceType in_type, SXML_CHAR** line, int* sz_
 
 	if (to == NULC)
 		to = C2SX('\n');
+
+	if (sz_line == NULL)
+		sz_line = &init_sz;
+
+#ifndef SXMLC_UNICODE
+	if (in_type == DATA_SOURCE_BUFFER)
+		return _read_line_buffer((DataSourceBuffer*)in, line, sz_line, i0, from, to, keep_fromto, interest, interest_count);
+#endif
+
 	/* Search for character 'from' */
 	if (interest_count != NULL)
 		*interest_count = 0;
@@ -1818,9 +1965,6 @@ int read_line_alloc(void* in, DataSourceType in_type, SXML_CHAR** line, int* sz_
 			break;
 	}
 
-	if (sz_line == NULL)
-		sz_line = &init_sz;
-
 	if (*line == NULL || *sz_line == 0) {
 		if (*sz_line == 0) *sz_line = MEM_INCR_RLA;
 		*line = (SXML_CHAR*)__malloc(*sz_line*sizeof(SXML_CHAR));
@@ -1854,7 +1998,7 @@ int read_line_alloc(void* in, DataSourceType in_type, SXML_CHAR** line, int* sz_
 		if (ch != to || (keep_fromto && to != NULC && ch == to)) /* If we reached the 'to' character and we keep it, we still need to add the extra '\0' */
 			n++;
 		if (n >= *sz_line) { /* Too many characters for our line => realloc some more */
-			*sz_line += MEM_INCR_RLA;
+			*sz_line *= 2;
 			pt = (SXML_CHAR*)__realloc(*line, *sz_line*sizeof(SXML_CHAR));
 			if (pt == NULL) {
 				ret = 0;
@@ -272,6 +272,7 @@ typedef struct _SAX_Data {
 	FILE *file;
 	int line_num;
 	void* user;
+	DataSourceBuffer* dsb; /* source of buffer (and mapped file) parsing, 'file' is NULL then */
 } SAX_Data;
 
 /*
@@ -679,6 +680,7 @@ int XMLDoc_parse_buffer_DOM_text_as_nodes(const SXML_CHAR* buffer, const SXML_CH
  Parse an XML document from a given 'filename', calling SAX callbacks given in the 'sax' structure.
  'user' is a user-given pointer that will be given back to all callbacks.
  Return 'false' in case of error (memory or unavailable filename, malformed document), 'true' otherwise.
+ Where mmap is available the file is mapped and parsed as a buffer, 'sd->file' is NULL then.
  */
 int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, void* user);
 
@@ -690,6 +692,11 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
  */
 int XMLDoc_parse_buffer_SAX(const SXML_CHAR* buffer, const SXML_CHAR* name, const SAX_Callbacks* sax, void* user);
 
+/*
+ Current read position of a SAX parse, for progress reporting from the callbacks.
+ */
+long XMLDoc_SAX_pos(const SAX_Data* sd);
+
 /*
  Parse an XML file using the DOM implementation.
  */
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include "table_cache.h"
+#include "fpga_io.h"
+#include "profiling.h"
+
+#define TABLE_CACHE_SIZE 16
+
+struct table_entry_t
+{
+	std::string path;
+	table_parse_t parse;
+	int arg;
+	time_t mtime;
+	off_t size;
+	uint32_t used;
+	std::vector<uint16_t> words;
+};
+
+static table_entry_t cache[TABLE_CACHE_SIZE];
+static table_entry_t uncached; // files inside zips have no mtime to check
+static uint32_t tick = 0;
+
+const std::vector<uint16_t> *table_get(const char *path, int arg, table_parse_t parse)
+{
+	struct stat st;
+	int have_st = !stat(getFullPath(path), &st) && S_ISREG(st.st_mode);
+
+	table_entry_t *e = &uncached;
+	if (have_st)
+	{
+		e = &cache[0];
+		for (int i = 0; i < TABLE_CACHE_SIZE; i++)
+		{
+			table_entry_t *c = &cache[i];
+			if (c->used && c->parse == parse && c->arg == arg && c->mtime == st.st_mtime && c->size == st.st_size && c->path == path)
+			{
+				c->used = ++tick;
+				return &c->words;
+			}
+
+			// free or least recently used
+			if (e->used && (!c->used || c->used < e->used)) e = c;
+		}
+	}
+
+	TRACE_SCOPE("table_parse");
+
+	fileTextReader reader = {};
+	if (!FileOpenTextReader(&reader, path))
+	{
+		e->used = 0;
+		return NULL;
+	}
+
+	e->words.clear();
+	parse(&reader, arg, e->words);
+
+	e->path = path;
+	e->parse = parse;
+	e->arg = arg;
+	e->mtime = have_st ? st.st_mtime : 0;
+	e->size = have_st ? st.st_size : 0;
+	e->used = have_st ? ++tick : 0;
+	return &e->words;
+}
+
+void table_send(const std::vector<uint16_t> *words)
+{
+	if (words && !words->empty()) fpga_spi_fast_block_write(words->data(), words->size());
+}
@@ -0,0 +1,24 @@
+#ifndef TABLE_CACHE_H
+#define TABLE_CACHE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "file_io.h"
+
+// Text tables sent to the core (gamma curves, shadow masks, audio filters).
+// A file is parsed once into the 16 bit words the core takes, kept by path,
+// size and mtime (and arg for tables depending on the video mode), then
+// pushed out in one block transfer. Switching presets doesn't parse again.
+
+// Appends the words of the table in reader, arg as passed to table_get().
+typedef void (*table_parse_t)(fileTextReader *reader, int arg, std::vector<uint16_t> &words);
+
+// Words of the table, NULL if the file can't be read.
+// Valid until the next table_get().
+const std::vector<uint16_t> *table_get(const char *path, int arg, table_parse_t parse);
+
+// Sends the words inside an open UIO command (as spi_w() of each one).
+void table_send(const std::vector<uint16_t> *words);
+
+#endif
@@ -9,10 +9,10 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
-
-#include "lib/imlib2/Imlib2.h"
+#include <pthread.h>
 
 #include "hardware.h"
+#include "scheduler.h"
 #include "osd.h"
 #include "user_io.h"
 #include "debug.h"
@@ -24,6 +24,7 @@
 #include "menu.h"
 #include "DiskImage.h"
 #include "brightness.h"
+#include "sensors.h"
 #include "sxmlc.h"
 #include "bootcore.h"
 #include "charrom.h"
@@ -36,8 +37,23 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "offload.h"
+#include "hash_stream.h"
+#include "rom_hash.h"
+#include "savestate.h"
+#include "crc.h"
+#include "sd_cache.h"
+#include "save_cache.h"
+#include "load_times.h"
+#include "storage_probe.h"
 
 #include "support.h"
+#include "fw_cache.h"
+#include "rom_ram.h"
+#include "soft_patch.h"
+#include "cd_set.h"
+#include "cfg_store.h"
+#include "prewarm.h"
 
 static char core_path[1024] = {};
 static char rbf_path[1024] = {};
@@ -67,6 +83,86 @@ static unsigned char dual_sdr = 0;
 static int fio_size = 0;
 static int io_ver = 0;
 
+// Cores answering UIO_JOY_FRAME take the state of all players in one transfer,
+// the updates of a poll are collected and sent together by user_io_joy_flush().
+#define JOY_FRAME_MAGIC 0xA5
+#define JOY_FRAME_MAX   6 // NUMPLAYERS of input
+
+struct joy_frame_t
+{
+	uint32_t digital;
+	uint16_t left, right; // (y << 8) | x
+};
+
+static int joy_frame_players = 0;
+static joy_frame_t joy_frame[JOY_FRAME_MAX] = {};
+static int joy_frame_dirty = 0;
+
+static int joy_frame_probe()
+{
+	// A header announcing 0 players, the core answers with its own
+	spi_uio_cmd_cont(UIO_JOY_FRAME);
+	uint16_t caps = spi_w(JOY_FRAME_MAGIC << 8);
+	DisableIO();
+
+	if ((caps >> 8) != JOY_FRAME_MAGIC) return 0;
+	int players = caps & 0xFF;
+	return (players > JOY_FRAME_MAX) ? JOY_FRAME_MAX : players;
+}
+
+// Key codes go through the table of the core, picked when the core is loaded
+// (and on a change of the PS/2 scan set) instead of per key.
+enum { KBD_NONE, KBD_PS2, KBD_SHARPMZ, KBD_AMIGA, KBD_ARCHIE };
+static int kbd_mode = KBD_NONE;
+static const int *kbd_table = NULL;
+static int kbd_pcxt = 0;
+
+// PS/2 bytes of the keys of a poll, sent in one transfer by user_io_kbd_flush().
+// Not more than the PS/2 fifo of hps_io takes at once.
+#define KBD_BATCH_SIZE 16
+static uint8_t kbd_batch[KBD_BATCH_SIZE];
+static int kbd_batch_len = 0;
+
+static void kbd_select()
+{
+	kbd_mode = KBD_NONE;
+	kbd_table = NULL;
+	kbd_pcxt = is_pcxt();
+
+	if (is_minimig())
+	{
+		kbd_mode = KBD_AMIGA;
+		kbd_table = get_kbd_table(KBD_TABLE_AMIGA);
+	}
+	else if (is_archie())
+	{
+		kbd_mode = KBD_ARCHIE;
+		kbd_table = get_kbd_table(KBD_TABLE_ARCHIE);
+	}
+	else if (core_type == CORE_TYPE_8BIT || core_type == CORE_TYPE_SHARPMZ)
+	{
+		kbd_mode = (core_type == CORE_TYPE_SHARPMZ) ? KBD_SHARPMZ : KBD_PS2;
+		kbd_table = get_kbd_table((ps2_kbd_scan_set == 1) ? KBD_TABLE_PS2_SET1 : KBD_TABLE_PS2);
+	}
+}
+
+void user_io_kbd_flush()
+{
+	if (!kbd_batch_len) return;
+
+	spi_uio_cmd_cont(UIO_KEYBOARD);
+	spi_write(kbd_batch, kbd_batch_len, 0);
+	DisableIO();
+	kbd_batch_len = 0;
+}
+
+static void kbd_batch_add(const uint8_t *buf, int len)
+{
+	if (kbd_batch_len + len > KBD_BATCH_SIZE) user_io_kbd_flush();
+	memcpy(kbd_batch + kbd_batch_len, buf, len);
+	kbd_batch_len += len;
+}
+
 // keep state of caps lock
 static char caps_lock_toggle = 0;
 
@@ -81,6 +177,11 @@ static bool winkey_pressed = 0;
 static uint16_t sdram_cfg = 0;
 
 static char last_filename[1024] = {};
+const char *user_io_get_filename()
+{
+	return last_filename;
+}
+
 void user_io_store_filename(char *filename)
 {
 	char *p = strrchr(filename, '/');
@@ -433,6 +534,11 @@ int substrcpy(char *d, const char *s, char idx)
 
 static char cur_status[16] = {};
 
+// What the core was sent last, so unchanged status isn't sent again
+static char sent_status[16] = {};
+static int sent_valid = 0;
+static int status_hold = 0;
+
 int user_io_status_bits(const char *opt, int *s, int *e, int ex, int single)
 {
 	uint32_t start = 0, end = 0;
@@ -504,6 +610,19 @@ uint32_t user_io_hd_mask(const char *opt)
 	return start;
 }
 
+static void status_flush()
+{
+	if (is_st()) return;
+	if (sent_valid && !memcmp(sent_status, cur_status, sizeof(cur_status))) return;
+
+	spi_uio_cmd_cont(UIO_SET_STATUS2);
+	for (uint32_t i = 0; i < sizeof(cur_status); i += 2) spi_w((cur_status[i + 1] << 8) | cur_status[i]);
+	DisableIO();
+
+	memcpy(sent_status, cur_status, sizeof(cur_status));
+	sent_valid = 1;
+}
+
 void user_io_status_set(const char *opt, uint32_t value, int ex)
 {
 	int start, end;
@@ -521,12 +640,13 @@ void user_io_status_set(const char *opt, uint32_t value, int ex)
 	cur_status[s] = (char)x;
 	if (e != s) cur_status[e] = (char)(x >> 8);
 
-	if (!is_st())
-	{
-		spi_uio_cmd_cont(UIO_SET_STATUS2);
-		for (uint32_t i = 0; i < sizeof(cur_status); i += 2) spi_w((cur_status[i + 1] << 8) | cur_status[i]);
-		DisableIO();
-	}
+	if (!status_hold) status_flush();
+}
+
+void user_io_status_hold(int hold)
+{
+	if (hold) status_hold++;
+	else if (status_hold && !--status_hold) status_flush();
 }
 
 int user_io_status_save(const char *filename)
@@ -1333,6 +1453,9 @@ void user_io_init(const char *path, const char *xml)
 	// Clean up old game ID when loading a new core
 	unlink("/tmp/GAMEID");
 
+	// launch record of the core, closed once it's up (and its MGL is done)
+	load_resume();
+
 	// we need to set the directory to where the XML file (MRA) is
 	// not the RBF. The RBF will be in arcade, which the user shouldn't
 	// browse
@@ -1360,6 +1483,11 @@ void user_io_init(const char *path, const char *xml)
 		io_ver = 0;
 	}
 
+	memset(joy_frame, 0, sizeof(joy_frame));
+	joy_frame_dirty = 0;
+	joy_frame_players = (core_type == CORE_TYPE_8BIT && io_ver) ? joy_frame_probe() : 0;
+	if (joy_frame_players) printf("Core takes joystick frames for %d players\n", joy_frame_players);
+
 	OsdSetSize(8);
 
 	if (xml)
@@ -1390,8 +1518,11 @@ void user_io_init(const char *path, const char *xml)
 		SelectINI();
 	}
 
+	uint64_t t = trace_now_us();
 	cfg_parse();
 	cfg_print();
+	trace_event("boot_cfg", t);
+	load_phase_add(LOAD_CONFIG, trace_now_us() - t);
 	while (cfg.waitmount[0] && !is_menu())
 	{
 		printf("> > > wait for %s mount < < <\n", cfg.waitmount);
@@ -1412,7 +1543,10 @@ void user_io_init(const char *path, const char *xml)
 	uint8_t hotswap[4] = {};
 	ide_reset(hotswap);
 
+	t = trace_now_us();
 	parse_config();
+	trace_event("boot_confstr", t);
+	load_phase_add(LOAD_CONFIG, trace_now_us() - t);
 	if (!xml && defmra[0] && FileExists(defmra))
 	{
 		// attn: FC option won't use name from defmra!
@@ -1432,13 +1566,20 @@ void user_io_init(const char *path, const char *xml)
 		bootcore_init(xml ? xml : path);
 	}
 
+	t = trace_now_us();
 	video_init();
+	trace_event("boot_video", t);
 	if (strlen(cfg.font)) LoadFont(cfg.font);
 	load_volume();
 
 	user_io_send_buttons(1);
-	if (xml && isXmlName(xml) == 2) mgl_parse(xml);
+	if (xml && isXmlName(xml) == 2)
+	{
+		LOAD_PHASE(LOAD_CONFIG);
+		mgl_parse(xml);
+	}
 
+	t = trace_now_us();
 	switch (core_type)
 	{
 	case CORE_TYPE_UNKNOWN:
@@ -1621,6 +1762,7 @@ void user_io_init(const char *path, const char *xml)
 		}
 		break;
 	}
+	trace_event("boot_core", t);
 
 	OsdRotation((cfg.osd_rotate == 1) ? 3 : (cfg.osd_rotate == 2) ? 1 : 0);
 
@@ -1666,14 +1808,36 @@ void user_io_init(const char *path, const char *xml)
 	if (!mgl_get()->count || is_menu() || is_st() || is_archie() || user_io_core_type() == CORE_TYPE_SHARPMZ)
 	{
 		mgl_get()->done = 1;
+		load_end();
 	}
 	else
 	{
 		mgl_get()->timer = GetTimer(mgl_get()->item[0].delay * 1000);
 	}
+
+	kbd_select();
+	prewarm_core();
 }
 
 static int joyswap = 0;
+
+void user_io_joy_flush()
+{
+	if (!joy_frame_dirty) return;
+	joy_frame_dirty = 0;
+
+	spi_uio_cmd_cont(UIO_JOY_FRAME);
+	spi_w((JOY_FRAME_MAGIC << 8) | joy_frame_players);
+	for (int i = 0; i < joy_frame_players; i++)
+	{
+		spi_w((uint16_t)joy_frame[i].digital);
+		spi_w(joy_frame[i].digital >> 16);
+		spi_w(joy_frame[i].left);
+		spi_w(joy_frame[i].right);
+	}
+	DisableIO();
+}
+
 void user_io_set_joyswap(int swap)
 {
 	joyswap = swap;
@@ -1688,6 +1852,13 @@ void user_io_l_analog_joystick(unsigned char joystick, char valueX, char valueY)
 {
 	uint8_t joy = (joystick > 1 || !joyswap) ? joystick : (joystick >= 15) ? (joystick ^ 16) : (joystick ^ 1);
 
+	if (joy < joy_frame_players)
+	{
+		joy_frame[joy].left = (valueY << 8) | (uint8_t)valueX;
+		joy_frame_dirty = 1;
+		return;
+	}
+
 	if (core_type == CORE_TYPE_8BIT)
 	{
 		spi_uio_cmd8_cont(UIO_ASTICK, joy);
@@ -1705,6 +1876,13 @@ void user_io_r_analog_joystick(unsigned char joystick, char valueX, char valueY)
 {
 	uint8_t joy = (joystick > 1 || !joyswap) ? joystick : (joystick ^ 1);
 
+	if (joy < joy_frame_players)
+	{
+		joy_frame[joy].right = (valueY << 8) | (uint8_t)valueX;
+		joy_frame_dirty = 1;
+		return;
+	}
+
 	if (core_type == CORE_TYPE_8BIT)
 	{
 		spi_uio_cmd8_cont(UIO_ASTICK_2, joy);
@@ -1727,10 +1905,18 @@ void user_io_digital_joystick(unsigned char joystick, uint64_t map, int newdir)
 	// by other mapping being pressed
 	uint32_t bitmask = (uint32_t)(map) | (uint32_t)(map >> 32);
 	use32 |= bitmask >> 16;
-	spi_uio_cmd_cont((joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2));
-	spi_w(bitmask);
-	if(use32) spi_w(bitmask >> 16);
-	DisableIO();
+	if (joy < joy_frame_players)
+	{
+		joy_frame[joy].digital = bitmask;
+		joy_frame_dirty = 1;
+	}
+	else
+	{
+		spi_uio_cmd_cont((joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2));
+		spi_w(bitmask);
+		if(use32) spi_w(bitmask >> 16);
+		DisableIO();
+	}
 
 	if (!is_minimig() && joy_transl == 1 && newdir)
 	{
@@ -1833,12 +2019,18 @@ static void kbd_fifo_poll()
 	kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE - 1);
 }
 
+static uint32_t ss_cnt[4] = {};
+static void *ss_slot[4] = {};
+
+uint32_t user_io_ss_count(int slot)
+{
+	return (slot >= 0 && slot < 4 && ss_slot[slot]) ? ss_cnt[slot] : 0;
+}
+
 int process_ss(const char *rom_name, int enable)
 {
 	static char ss_name[1024] = {};
 	static char *ss_sufx = 0;
-	static uint32_t ss_cnt[4] = {};
-	static void *base[4] = {};
 	static int enabled = 0;
 
 	if (!ss_base) return 0;
@@ -1846,23 +2038,35 @@ int process_ss(const char *rom_name, int enable)
 	if (rom_name)
 	{
 		enabled = enable;
-		if (!enabled) return 0;
+		if (!enabled)
+		{
+			savestate_history_open(NULL);
+			return 0;
+		}
 
 		uint32_t len = ss_size;
 		uint32_t map_addr = ss_base;
-		fileTYPE f = {};
 
+		// slots are about to be cleared, writes from the previous game must finish first
+		savestate_wait();
+
+		// game_1.ss -> game.ssh
+		FileGenerateSavestatePath(rom_name, ss_name, 1);
+		strcpy(ss_name + strlen(ss_name) - 5, ".ssh");
+		savestate_history_open(ss_name);
+
+		// Slots are cleared and filled on workers so the game starts right away,
+		// a slot stays empty for the core and is skipped below until it is loaded
 		for (int i = 0; i < 4; i++)
 		{
-			if (!base[i]) base[i] = shmem_map(map_addr, len);
-			if (!base[i])
+			if (!ss_slot[i]) ss_slot[i] = shmem_map(map_addr, len);
+			if (!ss_slot[i])
 			{
 				printf("Unable to mmap (0x%X, %d)!\n", map_addr, len);
 			}
 			else
 			{
 				ss_cnt[i] = 0xFFFFFFFF;
-				memset(base[i], 0, len);
 
 				if (!i)
 				{
@@ -1875,20 +2079,7 @@ int process_ss(const char *rom_name, int enable)
 					FileGenerateSavestatePath(rom_name, ss_name, i + 1);
 				}
 
-				if (FileExists(ss_name))
-				{
-					if (!FileOpen(&f, ss_name))
-					{
-						printf("Unable to open file: %s\n", ss_name);
-					}
-					else
-					{
-						int ret = FileReadAdv(&f, base[i], len);
-						FileClose(&f);
-						printf("process_ss: read %d bytes from file: %s\n", ret, ss_name);
-					}
-				}
-				*(uint32_t*)(base[i]) = 0xFFFFFFFF;
+				savestate_preload(i, FileExists(ss_name) ? ss_name : NULL, ss_slot[i], len);
 			}
 
 			map_addr += len;
@@ -1901,39 +2092,32 @@ int process_ss(const char *rom_name, int enable)
 
 	if (!enabled) return 0;
 
+	savestate_poll();
+
 	static unsigned long ss_timer = 0;
 	if (ss_timer && !CheckTimer(ss_timer)) return 0;
 	ss_timer = GetTimer(1000);
 
-	fileTYPE f = {};
 	for (int i = 0; i < 4; i++)
 	{
-		if (base[i])
+		if (ss_slot[i] && !savestate_loading(i))
 		{
-			uint32_t curcnt = ((uint32_t*)(base[i]))[0];
-			uint32_t size = ((uint32_t*)(base[i]))[1];
+			uint32_t curcnt = ((uint32_t*)(ss_slot[i]))[0];
+			uint32_t size = ((uint32_t*)(ss_slot[i]))[1];
 
 			if (curcnt != ss_cnt[i])
 			{
-				ss_cnt[i] = curcnt;
 				if (size) size = (size + 2) * 4;
 				if (size > 0 && size <= ss_size)
 				{
+					// Written on a worker, if the last write of the slot is still running try again later
+					*ss_sufx = i + '1';
+					if (!savestate_write(i, ss_name, ss_slot[i], size)) continue;
+
 					MenuHide();
 					Info("Saving the state", 500);
-
-					*ss_sufx = i + '1';
-					if (FileOpenEx(&f, ss_name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
-					{
-						int ret = FileWriteAdv(&f, base[i], size);
-						FileClose(&f);
-						printf("Wrote %d bytes to file: %s\n", ret, ss_name);
-					}
-					else
-					{
-						printf("Unable to create file: %s\n", ss_name);
-					}
 				}
+				ss_cnt[i] = curcnt;
 			}
 		}
 	}
@@ -1941,6 +2125,27 @@ int process_ss(const char *rom_name, int enable)
 	return 1;
 }
 
+int process_ss_rewind(int slot, int back)
+{
+	if (!ss_base || slot < 0 || slot >= 4 || !ss_slot[slot]) return 0;
+
+	// the slot write in flight may still add to the history
+	savestate_wait();
+
+	int ret = savestate_history_read(slot, back, ss_slot[slot], ss_size);
+	if (ret < 0)
+	{
+		printf("process_ss: slot %d has no history entry %d (%d saved)\n", slot + 1, back, savestate_history_count(slot));
+		return 0;
+	}
+
+	// keep the counter as seen so the restored state isn't saved again
+	*(uint32_t*)(ss_slot[slot]) = ss_cnt[slot];
+	printf("process_ss: slot %d rewound %d saves, %d bytes\n", slot + 1, back, ret);
+	Info("State rewound", 1000);
+	return 1;
+}
+
 void user_io_set_index(unsigned char index)
 {
 	EnableFpga();
@@ -1978,6 +2183,14 @@ void user_io_file_tx_data(const uint8_t *addr, uint32_t len)
 	DisableFpga();
 }
 
+void user_io_file_tx_datav(const struct iovec *iov, int cnt)
+{
+	EnableFpga();
+	spi8(FIO_FILE_TX_DAT);
+	for (int i = 0; i < cnt; i++) spi_write((const uint8_t *)iov[i].iov_base, iov[i].iov_len, fio_size);
+	DisableFpga();
+}
+
 void user_io_set_upload(unsigned char enable, int addr)
 {
 	EnableFpga();
@@ -2019,6 +2232,9 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	int len = strlen(name);
 	int img_type = 0; // disk image type (for C128 core): bit 0=dual sided, 1=raw GCR supported, 2=raw MFM supported, 3=high density
 
+	save_cache_unmount(index);
+	sd_cache_reset(index);
+	a2_dsk_reset(&sd_image[index]);
 	sd_image_cangrow[index] = (pre != 0);
 	sd_type[index] = SD_TYPE_DEFAULT ;
 	if (len)
@@ -2112,6 +2328,9 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	else
 	{
 		printf("Mount %s as %s on %d slot\n", name, writable ? "read-write" : "read-only", index);
+
+		// N64 mirrors its saves itself
+		if (pre && sd_type[index] == SD_TYPE_DEFAULT && !is_n64()) save_cache_mount(index, &sd_image[index], name);
 	}
 
 	user_io_sd_set_config();
@@ -2148,6 +2367,8 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 void user_io_bufferinvalidate(unsigned char index)
 {
 	buffer_lba[index] = -1;
+	sd_cache_reset(index);
+	a2_dsk_reset(&sd_image[index]);
 }
 
 static unsigned char col_attr[1025];
@@ -2390,9 +2611,60 @@ static int chr_parse(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const i
 	return true;
 }
 
+// Palettes and charsets in their upload form, kept in /tmp (RAM) by the
+// source path and checked against its size and time, so loading the next
+// tape or restarting the core skips the XML. Bump PCOLCHR_CACHE_VERSION when
+// the parsers change.
+#define PCOLCHR_CACHE_DIR     "/tmp/pcolchr_cache"
+#define PCOLCHR_CACHE_VERSION 1
+
+static int pcolchr_cache_key(const char *full, char *path, char *key, int keylen)
+{
+	struct stat64 st;
+	if (stat64(full, &st)) return 0;
+
+	snprintf(key, keylen, "%d\n%s\n%llu\n%llu\n", PCOLCHR_CACHE_VERSION, full,
+		(unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	sprintf(path, PCOLCHR_CACHE_DIR "/%08x", crc32_update(0, full, strlen(full)));
+	return 1;
+}
+
+static int pcolchr_cache_get(const char *path, const char *key, void *data, uint32_t size)
+{
+	char kbuf[1200];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	uint32_t klen = 0, dlen = 0;
+	int ok = read(fd, &klen, sizeof(klen)) == sizeof(klen) && klen == strlen(key) &&
+		read(fd, kbuf, klen) == (ssize_t)klen && !memcmp(kbuf, key, klen) &&
+		read(fd, &dlen, sizeof(dlen)) == sizeof(dlen) && dlen == size &&
+		read(fd, data, dlen) == (ssize_t)dlen;
+	close(fd);
+	return ok;
+}
+
+static void pcolchr_cache_put(const char *path, const char *key, const void *data, uint32_t size)
+{
+	char tmp[80];
+	mkdir(PCOLCHR_CACHE_DIR, 0777);
+
+	sprintf(tmp, "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return;
+
+	uint32_t klen = strlen(key);
+	int ok = write(fd, &klen, sizeof(klen)) == sizeof(klen) && write(fd, key, klen) == (ssize_t)klen &&
+		write(fd, &size, sizeof(size)) == sizeof(size) && write(fd, data, size) == (ssize_t)size;
+	close(fd);
+
+	if (!ok || rename(tmp, path)) unlink(tmp);
+}
+
 static void send_pcolchr(const char* name, unsigned char index, int type)
 {
-	static char full_path[1024];
+	char full_path[1024];
+	char cache_path[64], key[1200];
 
 	sprintf(full_path, "%s/%s", getRootDir(), name);
 
@@ -2400,28 +2672,36 @@ static void send_pcolchr(const char* name, unsigned char index, int type)
 	if (!p) p = full_path + strlen(full_path);
 	strcpy(p, type ? ".chr" : ".col");
 
-	if (type)
+	// no file, nothing to send
+	if (!pcolchr_cache_key(full_path, cache_path, key, sizeof(key))) return;
+
+	uint32_t size = type ? 1024 : 1025;
+	if (!pcolchr_cache_get(cache_path, key, col_attr, size))
 	{
-		memcpy(col_attr, defchars, sizeof(defchars));
-		memcpy(col_attr+sizeof(defchars), defchars, sizeof(defchars));
+		if (type)
+		{
+			memcpy(col_attr, defchars, sizeof(defchars));
+			memcpy(col_attr+sizeof(defchars), defchars, sizeof(defchars));
+		}
+		else memset(col_attr, 0, sizeof(col_attr));
+
+		SAX_Callbacks sax;
+		SAX_Callbacks_init(&sax);
+		sax.all_event = type ? chr_parse : col_parse;
+		if (!XMLDoc_parse_file_SAX(full_path, &sax, 0)) return;
+
+		pcolchr_cache_put(cache_path, key, col_attr, size);
 	}
-	else memset(col_attr, 0, sizeof(col_attr));
 
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-	sax.all_event = type ? chr_parse : col_parse;
-	if (XMLDoc_parse_file_SAX(full_path, &sax, 0))
-	{
-		printf("Send additional file %s\n", full_path);
+	printf("Send additional file %s\n", full_path);
 
-		//hexdump(col_attr, sizeof(col_attr));
+	//hexdump(col_attr, sizeof(col_attr));
 
-		user_io_set_index(index);
+	user_io_set_index(index);
 
-		user_io_set_download(1);
-		user_io_file_tx_data(col_attr, type ? 1024 : 1025);
-		user_io_set_download(0);
-	}
+	user_io_set_download(1);
+	user_io_file_tx_data(col_attr, size);
+	user_io_set_download(0);
 }
 
 static uint32_t file_crc;
@@ -2484,7 +2764,7 @@ int user_io_use_cheats()
 	return use_cheats;
 }
 
-static void check_status_change()
+static int check_status_change()
 {
 	static u_int8_t last_status_change = 0;
 	char stchg = spi_uio_cmd_cont(UIO_GET_STATUS);
@@ -2499,11 +2779,11 @@ static void check_status_change()
 		}
 		DisableIO();
 		user_io_status_set("[0]", 0);
+		return 1;
 	}
-	else
-	{
-		DisableIO();
-	}
+
+	DisableIO();
+	return 0;
 }
 
 static void show_core_info(int info_n)
@@ -2526,6 +2806,233 @@ static void show_core_info(int info_n)
 	}
 }
 
+// Pipelined file transfer.
+// Reader thread fills a ring of large buffers from storage (and runs the
+// format fixup and updates CRC) while the caller streams filled buffers to
+// the FPGA, so storage latency and SPI transfer time overlap instead of
+// adding up. Read size and ring depth come from the storage profile of the
+// file, slower storage gets larger and more reads in flight.
+#define TX_PIPE_SLOTS    8
+#define TX_PIPE_SLOT_SZ  (256 * 1024)
+#define TX_PIPE_CHUNK    (128 * 1024) // and 4 slots without a profile
+#define TX_PIPE_MIN_SIZE (256 * 1024)
+
+struct tx_pipe_t
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	pthread_t thread;
+	int threaded;       // 0: no reader thread, chunks are read on demand
+	int stop;
+	int eof;            // reader is through
+
+	fileTYPE *f;
+	tx_xform_t xform;   // format fixup, NULL if none
+	void *ctx;
+	uint8_t *keep;      // copy of the data for rom_ram, NULL if not kept
+	uint32_t remain;
+	uint32_t skip;
+	uint32_t crc;
+	int hash;
+
+	uint32_t chunk;
+	uint32_t slots;
+	uint32_t head, tail;
+	uint32_t len[TX_PIPE_SLOTS];
+};
+
+static uint8_t tx_pipe_buf[TX_PIPE_SLOTS][TX_PIPE_SLOT_SZ] __attribute__((aligned(16)));
+
+static uint32_t tx_pipe_fill(tx_pipe_t *p, uint8_t *buf)
+{
+	uint32_t chunk = (p->remain > p->chunk) ? p->chunk : p->remain;
+
+	int n = std::max(FileReadAdv(p->f, buf, chunk), 0);
+	if ((uint32_t)n < chunk) memset(buf + n, 0, chunk - n);
+	if (p->xform) p->xform(buf, chunk, p->ctx);
+	if (p->keep)
+	{
+		memcpy(p->keep, buf, chunk);
+		p->keep += chunk;
+	}
+	p->remain -= chunk;
+
+	if (p->hash)
+	{
+		if (p->skip >= chunk) p->skip -= chunk;
+		else
+		{
+			p->crc = crc32_update(p->crc, buf + p->skip, chunk - p->skip);
+			p->skip = 0;
+		}
+	}
+
+	return chunk;
+}
+
+static void *tx_pipe_reader(void *arg)
+{
+	tx_pipe_t *p = (tx_pipe_t*)arg;
+
+	while (p->remain)
+	{
+		pthread_mutex_lock(&p->lock);
+		while ((p->head - p->tail) == p->slots && !p->stop) pthread_cond_wait(&p->cond, &p->lock);
+		int stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (stop) break;
+
+		uint32_t slot = p->head % p->slots;
+		uint32_t chunk = tx_pipe_fill(p, tx_pipe_buf[slot]);
+
+		pthread_mutex_lock(&p->lock);
+		p->len[slot] = chunk;
+		p->head++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->eof = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+// crc NULL: no CRC needed. keep: where a copy of the data goes, or NULL.
+static tx_pipe_t *tx_pipe_open(fileTYPE *f, uint32_t size, uint32_t skip, uint32_t *crc, uint8_t *keep, tx_xform_t xform, void *ctx)
+{
+	tx_pipe_t *p = (tx_pipe_t*)calloc(1, sizeof(tx_pipe_t));
+	if (!p) return NULL;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->f = f;
+	p->xform = xform;
+	p->ctx = ctx;
+	p->keep = keep;
+	p->remain = size;
+	p->skip = skip;
+	p->crc = crc ? *crc : 0;
+	p->hash = crc != NULL;
+
+	int fd = f->filp ? fileno(f->filp) : -1;
+	p->chunk = std::min<uint32_t>(std::max<uint32_t>(storage_chunk(fd, TX_PIPE_CHUNK), 16 * 1024), TX_PIPE_SLOT_SZ);
+	p->slots = std::min(std::max(storage_depth(fd, 4), 2), TX_PIPE_SLOTS);
+
+	// reader stays off core #1 where main loop runs.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	p->threaded = !pthread_create(&p->thread, &attr, tx_pipe_reader, p);
+	pthread_attr_destroy(&attr);
+	if (!p->threaded) printf("tx_pipe: cannot start reader thread, reading inline.\n");
+	return p;
+}
+
+static const uint8_t *tx_pipe_next(tx_pipe_t *p, uint32_t *len)
+{
+	if (!p->threaded)
+	{
+		if (!p->remain) return NULL;
+		*len = tx_pipe_fill(p, tx_pipe_buf[0]);
+		return tx_pipe_buf[0];
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while (p->head == p->tail && !p->eof) pthread_cond_wait(&p->cond, &p->lock);
+	int empty = (p->head == p->tail);
+	uint32_t slot = p->tail % p->slots;
+	*len = p->len[slot];
+	pthread_mutex_unlock(&p->lock);
+
+	return empty ? NULL : tx_pipe_buf[slot];
+}
+
+static void tx_pipe_done(tx_pipe_t *p)
+{
+	if (!p->threaded) return;
+
+	pthread_mutex_lock(&p->lock);
+	p->tail++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void tx_pipe_close(tx_pipe_t *p, uint32_t *crc)
+{
+	if (!p) return;
+
+	if (p->threaded)
+	{
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->thread, NULL);
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	if (crc) *crc = p->crc;
+	free(p);
+}
+
+tx_pipe_t *user_io_tx_pipe_open(fileTYPE *f, uint32_t size, tx_xform_t xform, void *ctx)
+{
+	return tx_pipe_open(f, size, 0, NULL, NULL, xform, ctx);
+}
+
+const uint8_t *user_io_tx_pipe_next(tx_pipe_t *p, uint32_t *len)
+{
+	uint64_t t = trace_now_us();
+	const uint8_t *buf = tx_pipe_next(p, len);
+	load_phase_next(LOAD_READ, t);
+	return buf;
+}
+
+void user_io_tx_pipe_done(tx_pipe_t *p)
+{
+	tx_pipe_done(p);
+}
+
+void user_io_tx_pipe_close(tx_pipe_t *p)
+{
+	tx_pipe_close(p, NULL);
+}
+
+// returns 0 if the pipe could not be set up, caller falls back to the plain loop.
+// crc NULL: no CRC needed. keep: where a copy of the data goes, or NULL.
+static int user_io_file_tx_pipelined(fileTYPE *f, uint32_t bytes2send, uint32_t skip, uint32_t *crc, uint8_t *keep, tx_xform_t xform, void *ctx)
+{
+	tx_pipe_t *p = tx_pipe_open(f, bytes2send, skip, crc, keep, xform, ctx);
+	if (!p) return 0;
+
+	uint32_t sent = 0;
+	while (sent < bytes2send)
+	{
+		uint64_t t = trace_now_us();
+		uint32_t chunk;
+		const uint8_t *buf = tx_pipe_next(p, &chunk);
+		t = load_phase_next(LOAD_READ, t);
+		if (!buf) break;
+
+		user_io_file_tx_data(buf, chunk);
+		load_phase_next(LOAD_TX, t);
+		sent += chunk;
+		tx_pipe_done(p);
+
+		ProgressMessage("Loading", f->name, sent, bytes2send);
+	}
+
+	tx_pipe_close(p, crc);
+	return 1;
+}
+
 int user_io_file_tx_a(const char* name, uint16_t index)
 {
 	fileTYPE f = {};
@@ -2570,42 +3077,209 @@ int user_io_file_tx_a(const char* name, uint16_t index)
 	return 1;
 }
 
-int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
+int user_io_file_tx_mem(const char* name, const uint8_t *data, uint32_t size, unsigned char index)
 {
-	fileTYPE f = {};
-	static uint8_t buf[4096];
+	printf("Selected file %s with %u bytes to send for index %d.%d (from memory)\n", name, size, index & 0x3F, index >> 6);
 
-	if (!FileOpen(&f, name, mute)) return 0;
+	user_io_set_index(index);
 
-	uint32_t bytes2send = f.size;
+	const char *p = strrchr(name, '.');
+	user_io_file_info(p ? p : "");
 
-	if (composite)
-	{
-		if (!FileReadSec(&f, buf)) return 0;
-		if (memcmp(buf, "MiSTer", 6)) return 0;
+	user_io_set_download(1);
+	user_io_file_tx_data(data, size);
 
-		uint32_t off = 16 + *(uint32_t*)(((uint8_t*)buf) + 12);
-		bytes2send -= off;
+	// check if core requests some change while downloading
+	check_status_change();
 
-		FileSeek(&f, off, SEEK_SET);
-	}
+	user_io_set_download(0);
+	return 1;
+}
 
-	/* transmit the entire file using one transfer */
-	printf("Selected file %s with %u bytes to send for index %d.%d\n", name, bytes2send, index & 0x3F, index >> 6);
-	if(load_addr) printf("Load to address 0x%X\n", load_addr);
+int user_io_file_tx_fw(const char* name, unsigned char index)
+{
+	uint32_t size;
+	uint8_t *data = fw_cache_load(name, &size, FW_CACHE_SIZE / 4);
+	if (!data) return 0;
 
-	// set index byte (0=bios rom, 1-n=OSD entry index)
-	user_io_set_index(index);
+	user_io_file_tx_mem(name, data, size, index);
+	free(data);
+	return 1;
+}
 
-	int len = strlen(f.name);
-	char *p = strrchr(f.name, '.');
-	if (p == 0) {
-            // In case a '.' is not found, send all `NUL` characters.
-	    p = f.name + len;
-	}
-	user_io_file_info(p);
+static void user_io_file_tx_done(const char* name, unsigned char index, char opensave, uint32_t load_addr)
+{
+	// check if core requests some change while downloading
+	check_status_change();
 
-	// prepare transmission of new file
+	printf("Done.\n");
+	printf("CRC32: %08X\n", file_crc);
+
+	user_io_write_gameid(name, file_crc);
+
+	if (opensave)
+	{
+		char path[1024];
+		FileGenerateSavePath(name, path);
+		user_io_file_mount(path, 0, 1);
+	}
+
+	// signal end of transmission
+	user_io_set_download(0);
+	printf("\n");
+
+	if (is_zx81() && index)
+	{
+		send_pcolchr(name, (index & 0x1F) | 0x20, 0);
+		send_pcolchr(name, (index & 0x1F) | 0x60, 1);
+	}
+
+	ProgressMessage(0, 0, 0, 0);
+
+	if ((is_snes() || is_sgb()) && !load_addr)
+	{
+		// Setup MSU
+		snes_msu_init(name);
+	}
+}
+
+// Same as from the file, out of the copy rom_ram kept of it.
+static int user_io_file_tx_kept(const char* name, const rom_ram_t *kept, unsigned char index, char opensave, uint32_t load_addr)
+{
+	uint32_t size = kept->size;
+	printf("Selected file %s with %u bytes to send for index %d.%d (kept in RAM)\n", name, size, index & 0x3F, index >> 6);
+	if (load_addr) printf("Load to address 0x%X\n", load_addr);
+
+	user_io_set_index(index);
+
+	const char *fname = strrchr(name, '/');
+	fname = fname ? fname + 1 : name;
+	const char *ext = strrchr(fname, '.');
+	user_io_file_info(ext ? ext : "");
+
+	user_io_set_download(1, load_addr ? size : 0);
+	load_bytes(size);
+	ProgressMessage(0, 0, 0, 0);
+
+	if (ss_base && opensave) process_ss(name);
+
+	uint64_t t = trace_now_us();
+	if (load_addr >= 0x20000000 && (load_addr + size) <= 0x40000000)
+	{
+		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), size);
+		if (mem)
+		{
+			shmem_copy(mem, kept->data, size);
+			shmem_unmap(mem, size);
+		}
+	}
+	else
+	{
+		for (uint32_t pos = 0; pos < size; pos += 1024 * 1024)
+		{
+			user_io_file_tx_data(kept->data + pos, std::min<uint32_t>(size - pos, 1024 * 1024));
+			ProgressMessage("Loading", fname, pos, size);
+		}
+	}
+	load_phase_next(LOAD_TX, t);
+
+	// only DDR loads without cheats leave the CRC out
+	file_crc = kept->crc;
+	if (!file_crc && use_cheats)
+	{
+		uint32_t skip = size & 0x3FF;
+		file_crc = crc32_update(0, kept->data + skip, size - skip);
+	}
+
+	user_io_file_tx_done(name, index, opensave, load_addr);
+	return 1;
+}
+
+// IPS/BPS patch laid over a ROM on its way to the core
+struct tx_patch_t
+{
+	soft_patch *patch;
+	uint32_t pos;
+	int check;      // whole ROM sent and the patch has its CRC
+	uint32_t crc;
+};
+
+static void tx_patch_xform(uint8_t *buf, uint32_t len, void *ctx)
+{
+	tx_patch_t *tp = (tx_patch_t*)ctx;
+	soft_patch_apply(tp->patch, buf, tp->pos, len);
+	if (tp->check) tp->crc = crc32_update(tp->crc, buf, len);
+	tp->pos += len;
+}
+
+// past the end of the file is zero when patched, the patch may make it longer
+static void tx_read(fileTYPE *f, uint8_t *buf, uint32_t len, tx_patch_t *tp)
+{
+	int n = FileReadAdv(f, buf, len);
+	if (!tp) return;
+
+	n = std::max(n, 0);
+	if ((uint32_t)n < len) memset(buf + n, 0, len - n);
+	tx_patch_xform(buf, len, tp);
+}
+
+int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
+{
+	fileTYPE f = {};
+	static uint8_t buf[4096];
+
+	LOAD_SCOPE("rom", name);
+
+	// the file as is, sent again out of RAM (not the SNES header, GBA goomba or Electron UEF)
+	int keepable = !composite && !is_snes() && !is_electron() && !(is_gba() && ((index >> 6) == 1 || (index >> 6) == 2)) && !soft_patch_exists(name);
+	const rom_ram_t *kept = keepable ? rom_ram_get(name, ROM_RAM_PLAIN) : NULL;
+	if (kept) return user_io_file_tx_kept(name, kept, index, opensave, load_addr);
+
+	uint64_t t = trace_now_us();
+	int opened = FileOpen(&f, name, mute);
+	load_phase_add(LOAD_OPEN, trace_now_us() - t);
+	if (!opened)
+	{
+		load_failed();
+		return 0;
+	}
+
+	uint32_t bytes2send = f.size;
+
+	if (composite)
+	{
+		if (!FileReadSec(&f, buf) || memcmp(buf, "MiSTer", 6))
+		{
+			load_failed();
+			return 0;
+		}
+
+		uint32_t off = 16 + *(uint32_t*)(((uint8_t*)buf) + 12);
+		bytes2send -= off;
+
+		FileSeek(&f, off, SEEK_SET);
+	}
+
+	// sidecar .ips/.bps applied in the stream
+	soft_patch *patch = (!composite && !is_electron()) ? soft_patch_open(name, f.size) : NULL;
+	if (patch) bytes2send = soft_patch_size(patch);
+
+	/* transmit the entire file using one transfer */
+	printf("Selected file %s with %u bytes to send for index %d.%d\n", name, bytes2send, index & 0x3F, index >> 6);
+	if(load_addr) printf("Load to address 0x%X\n", load_addr);
+
+	// set index byte (0=bios rom, 1-n=OSD entry index)
+	user_io_set_index(index);
+
+	int len = strlen(f.name);
+	char *p = strrchr(f.name, '.');
+	if (p == 0) {
+            // In case a '.' is not found, send all `NUL` characters.
+	    p = f.name + len;
+	}
+	user_io_file_info(p);
+
+	// prepare transmission of new file
 	user_io_set_download(1, load_addr ? bytes2send : 0);
 
 	int dosend = 1;
@@ -2693,6 +3367,11 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 	file_crc = 0;
 	uint32_t skip = bytes2send & 0x3FF; // skip possible header up to 1023 bytes
+	load_bytes(bytes2send);
+
+	// A whole file sent as is has the CRC the background index keeps, no need to hash it again
+	rom_hash_t indexed;
+	int crc_indexed = !patch && !f.offset && bytes2send == f.size && !(is_snes() && (snes_file == SNES_FILE_BS)) && rom_hash_get(name, &indexed);
 
 	int use_progress = 1; // (bytes2send > (1024 * 1024)) ? 1 : 0;
 	int size = bytes2send;
@@ -2735,85 +3414,153 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 		}
 	}
 
+	// a big ROM doesn't push the menu's files out of the page cache
+	FileReadOnce(&f);
+
+	uint32_t patch_crc = 0;
+	tx_patch_t tp = { patch, (uint32_t)f.offset, patch && !f.offset && soft_patch_crc(patch, &patch_crc), 0 };
+	tx_patch_t *ptp = patch ? &tp : NULL;
+
+	rom_ram_t *keep = (keepable && dosend && !f.offset && bytes2send && bytes2send == f.size) ? rom_ram_begin(name, ROM_RAM_PLAIN, bytes2send) : NULL;
+	uint32_t kept_len = 0;
+
 	if (dosend && load_addr >= 0x20000000 && (load_addr + bytes2send) <= 0x40000000)
 	{
 		uint32_t map_size = bytes2send + ((is_snes() && load_addr < 0x22000000) ? 0x800000 : 0);
 		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), map_size);
 		if (mem)
 		{
+			// DDR mapping is uncached, so hash from the read buffer instead of reading it back
+			hash_stream *hs = (!is_snes() && use_cheats && !crc_indexed) ? hash_stream_open(HASH_CRC32, skip) : NULL;
+
 			while (bytes2send)
 			{
 				uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
+				uint8_t *dst = mem + size - bytes2send + gap;
+				uint32_t chunk;
 
-				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
-				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
-
-				if(!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
-				skip = 0;
+				t = trace_now_us();
+				if (hs)
+				{
+					chunk = (bytes2send > HASH_STREAM_CHUNK) ? HASH_STREAM_CHUNK : bytes2send;
+					uint8_t *hbuf = hash_stream_buffer(hs);
+					tx_read(&f, hbuf, chunk, ptp);
+					t = load_phase_next(LOAD_READ, t);
+					hash_stream_push(hs, chunk);
+					t = load_phase_next(LOAD_HASH, t);
+					memcpy(dst, hbuf, chunk);
+					if (keep) memcpy(keep->data + kept_len, hbuf, chunk);
+					load_phase_next(LOAD_TX, t);
+				}
+				else
+				{
+					// straight into DDR, counted as read
+					chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
+					if (keep)
+					{
+						FileReadAdv(&f, keep->data + kept_len, chunk);
+						shmem_copy(dst, keep->data + kept_len, chunk);
+					}
+					else tx_read(&f, dst, chunk, ptp);
+					load_phase_next(LOAD_READ, t);
+				}
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 				bytes2send -= chunk;
+				if (keep) kept_len += chunk;
 			}
 
 			shmem_unmap(mem, map_size);
+
+			if (hs)
+			{
+				LOAD_PHASE(LOAD_HASH);
+				hash_result res;
+				hash_stream_close(hs, &res);
+				file_crc = res.crc;
+			}
+			else if (!is_snes() && use_cheats && crc_indexed)
+			{
+				file_crc = indexed.crc_load;
+			}
 		}
 	}
 	else
 	{
+		// large plain transfers overlap storage reads with SPI transfer.
+		if (dosend && bytes2send >= TX_PIPE_MIN_SIZE && !(is_snes() && (snes_file == SNES_FILE_BS)) &&
+			user_io_file_tx_pipelined(&f, bytes2send, skip, crc_indexed ? NULL : &file_crc, keep ? keep->data : NULL, ptp ? tx_patch_xform : NULL, ptp))
+		{
+			kept_len = bytes2send;
+			bytes2send = 0;
+		}
+
+		hash_stream *hs = (dosend && bytes2send && !crc_indexed) ? hash_stream_open(HASH_CRC32, skip) : NULL;
 		while (dosend && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
+			uint8_t *tx = hs ? hash_stream_buffer(hs) : buf;
 
-			FileReadAdv(&f, buf, chunk);
-			if (is_snes() && (snes_file == SNES_FILE_BS)) snes_patch_bs_header(&f, buf);
-			user_io_file_tx_data(buf, chunk);
+			t = trace_now_us();
+			tx_read(&f, tx, chunk, ptp);
+			if (is_snes() && (snes_file == SNES_FILE_BS)) snes_patch_bs_header(&f, tx);
+			if (keep)
+			{
+				memcpy(keep->data + kept_len, tx, chunk);
+				kept_len += chunk;
+			}
+			t = load_phase_next(LOAD_READ, t);
+			if (hs) hash_stream_push(hs, chunk);
+			t = load_phase_next(LOAD_HASH, t);
+			user_io_file_tx_data(tx, chunk);
+			load_phase_next(LOAD_TX, t);
 
 			if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 			bytes2send -= chunk;
 
+			if (hs || crc_indexed) continue;
 			if (skip >= chunk) skip -= chunk;
 			else
 			{
-				file_crc = crc32(file_crc, buf + skip, chunk - skip);
+				file_crc = crc32_update(file_crc, buf + skip, chunk - skip);
 				skip = 0;
 			}
 		}
-	}
-
-	// check if core requests some change while downloading
-	check_status_change();
-
-	printf("Done.\n");
-	printf("CRC32: %08X\n", file_crc);
-
-	user_io_write_gameid(name, file_crc);
-
-	FileClose(&f);
 
-	if (opensave)
-	{
-		FileGenerateSavePath(name, (char*)buf);
-		user_io_file_mount((char*)buf, 0, 1);
+		if (hs)
+		{
+			LOAD_PHASE(LOAD_HASH);
+			hash_result res;
+			hash_stream_close(hs, &res);
+			file_crc = res.crc;
+		}
+		else if (dosend && crc_indexed)
+		{
+			file_crc = indexed.crc_load;
+		}
 	}
 
-	// signal end of transmission
-	user_io_set_download(0);
-	printf("\n");
+	LOAD_PHASE(LOAD_POST);
 
-	if (is_zx81() && index)
+	if (keep && kept_len == keep->size)
 	{
-		send_pcolchr(name, (index & 0x1F) | 0x20, 0);
-		send_pcolchr(name, (index & 0x1F) | 0x60, 1);
+		keep->crc = file_crc;
+		rom_ram_commit(keep);
 	}
+	else rom_ram_abort(keep);
 
-	ProgressMessage(0, 0, 0, 0);
-
-	if ((is_snes() || is_sgb()) && !load_addr)
+	if (patch)
 	{
-		// Setup MSU
-		snes_msu_init(name);
+		if (tp.check && tp.pos == soft_patch_size(patch) && tp.crc != patch_crc)
+		{
+			printf("soft_patch: CRC of the patched ROM is %08X, expected %08X\n", tp.crc, patch_crc);
+			Info("Patched ROM CRC mismatch!");
+		}
+		soft_patch_close(patch);
 	}
 
+	FileClose(&f);
+	user_io_file_tx_done(name, index, opensave, load_addr);
 	return 1;
 }
 
@@ -2982,6 +3729,7 @@ void diskled_on()
 static void kbd_reply(char code)
 {
 	printf("kbd_reply = 0x%02X\n", code);
+	user_io_kbd_flush();
 	spi_uio_cmd16(UIO_KEYBOARD, 0xFF00 | code);
 }
 
@@ -2994,6 +3742,37 @@ static void mouse_reply(char code)
 static uint8_t use_ps2ctl = 0;
 static unsigned long rtc_timer = 0;
 
+// Requests of the core polled less often while there are none. Every poll
+// without work doubles the interval up to max_us, one with work brings it
+// back to every turn. Disk and IDE requests stay within a millisecond, the
+// rarely used ones are allowed to wait longer.
+#define POLL_BACKOFF_MIN_US 50
+
+struct poll_backoff_t
+{
+	uint32_t max_us;
+	uint32_t interval_us;
+	uint64_t next_us;
+};
+
+static poll_backoff_t sd_backoff = { 1000, 0, 0 };
+static poll_backoff_t status_backoff = { 16000, 0, 0 };
+static poll_backoff_t upload_backoff = { 100000, 0, 0 };
+
+static int backoff_due(poll_backoff_t *b)
+{
+	return !b->interval_us || trace_now_us() >= b->next_us;
+}
+
+static void backoff_update(poll_backoff_t *b, int active)
+{
+	if (active) b->interval_us = 0;
+	else if (!b->interval_us) b->interval_us = POLL_BACKOFF_MIN_US;
+	else if ((b->interval_us *= 2) > b->max_us) b->interval_us = b->max_us;
+
+	b->next_us = trace_now_us() + b->interval_us;
+}
+
 void user_io_rtc_reset()
 {
 	rtc_timer = 0;
@@ -3003,10 +3782,44 @@ static int coldreset_req = 0;
 
 static uint32_t res_timer = 0;
 
-void user_io_poll()
+// Shared folder requests of the x86 and Minimig cores, served by the co_share task
+int user_io_share_poll()
+{
+	if (is_minimig()) return minimig_share_poll();
+	if (is_x86() || is_pcxt()) return x86_share_poll();
+	return 0;
+}
+
+// CD drive emulation, on its own scheduler task. Returns 0 when the core has no CD.
+int user_io_cd_poll()
 {
+	if (!is_megacd() && !is_pce() && !is_saturn() && !is_cdi() && !is_psx() && !is_neogeo_cd()) return 0;
+
 	PROFILE_FUNCTION();
 
+	// CD cores stream sectors on their own timing, never let them wait
+	scheduler_activity();
+
+	if (is_megacd()) mcd_poll();
+	if (is_pce()) pcecd_poll();
+	if (is_saturn()) saturn_poll();
+	if (is_cdi()) cdi_poll();
+	if (is_psx()) psx_poll();
+	if (is_neogeo_cd()) neocd_poll();
+	return 1;
+}
+
+void user_io_poll()
+{
+	PERF_FUNCTION();
+
+	ide_cache_poll();
+	user_io_screenshot_poll();
+	rom_hash_poll();
+	cd_set_poll();
+	cfg_store_poll();
+	if (is_arcade()) arcade_nvm_poll();
+
 	if ((core_type != CORE_TYPE_SHARPMZ) &&
 		(core_type != CORE_TYPE_8BIT))
 	{
@@ -3044,26 +3857,26 @@ void user_io_poll()
 			rtc_timer = GetTimer(60000);
 			send_rtc(1);
 		}
-
-		minimig_share_poll();
 	}
 
-	if (core_type == CORE_TYPE_8BIT && !is_menu())
+	if (core_type == CORE_TYPE_8BIT && !is_menu() && backoff_due(&status_backoff))
 	{
-		check_status_change();
+		backoff_update(&status_backoff, check_status_change());
 	}
 
 	// sd card emulation
 	if (is_x86() || is_pcxt())
 	{
-		x86_poll(0);
+		if (backoff_due(&sd_backoff)) backoff_update(&sd_backoff, x86_poll(0));
 	}
 	else if ((core_type == CORE_TYPE_8BIT) && !is_menu() && !is_minimig())
 	{
 		if (is_st()) tos_poll();
 		if (is_snes() || is_sgb()) snes_poll();
 
-		for (int i = 0; i < 4; i++)
+		int sd_due = backoff_due(&sd_backoff);
+		int sd_active = 0;
+		for (int i = 0; sd_due && i < 4; i++)
 		{
 			int disk = -1;
 			int ack = 0;
@@ -3074,13 +3887,14 @@ void user_io_poll()
 
 			if (is_uneon() && i == 3)
 			{
-				x86_poll(1);
+				if (x86_poll(1)) sd_active = 1;
 				break;
 			}
 
 			uint16_t c = spi_uio_cmd_cont(UIO_GET_SDSTAT);
 			if (c & 0x8000)
 			{
+				scheduler_activity();
 				disk = (c >> 2) & 0xF;
 				op = c & 3;
 				ack = disk << 8;
@@ -3148,6 +3962,7 @@ void user_io_poll()
 				blks = 1;
 			}
 			DisableIO();
+			if (op) sd_active = 1;
 			if ( sd_type[disk] == SD_TYPE_A2)
 			{
 				//if (op) printf("A2 %x %llu on %d\n", op,lba, disk);
@@ -3195,6 +4010,10 @@ void user_io_poll()
 						printf("Error in creating file: %s\n", sd_image[disk].path);
 					}
 				}
+				else if (is_st() && tos_floppy_write(disk, lba * blksz, buffer[disk], sz))
+				{
+					diskled_on();
+				}
 				else
 				{
 					// ... and write it to disk
@@ -3210,7 +4029,12 @@ void user_io_poll()
 								sz = (rem >= sz) ? sz : (int)rem;
 							}
 
-							if (sz) FileWriteAdv(&sd_image[disk], buffer[disk], sz);
+							if (sz)
+							{
+								// mirrored saves are written back later, in one go
+								if (!save_cache_write(disk, lba * blksz, buffer[disk], sz)) FileWriteAdv(&sd_image[disk], buffer[disk], sz);
+								sd_cache_write(disk, lba * blksz, buffer[disk], sz);
+							}
 						}
 					}
 				}
@@ -3237,9 +4061,28 @@ void user_io_poll()
 				//printf("SD RD (%llu,%d) on %d, WIDE=%d\n", lba, blksz, disk, fio_size);
 
 				int done = 0;
+				int cached = 0;
 				uint32_t offset;
 
-				if ((buffer_lba[disk] == -1LLU) || lba < buffer_lba[disk] || (lba + blks - buffer_lba[disk]) > buf_n)
+				// plain images go through the read cache, the special cases keep the single buffer
+				if (save_cache_read(disk, lba * blksz, sz, buffer[disk]))
+				{
+					cached = 1;
+				}
+				else if (sd_image[disk].size && sd_image[disk].type != 2 && !is_st() &&
+					!(blksz == 2352 && is_psx()) && !(blksz == (2352 + 24) && is_cdi()))
+				{
+					diskled_on();
+					cached = sd_cache_read(disk, &sd_image[disk], lba * blksz, sz, buffer[disk]);
+				}
+
+				if (cached)
+				{
+					buffer_lba[disk] = -1;
+					offset = 0;
+					done = 1;
+				}
+				else if ((buffer_lba[disk] == -1LLU) || lba < buffer_lba[disk] || (lba + blks - buffer_lba[disk]) > buf_n)
 				{
 					buffer_lba[disk] = -1;
 					if (blksz == 2352 && is_psx())
@@ -3256,6 +4099,11 @@ void user_io_poll()
 						done = 1;
 						buffer_lba[disk] = lba;
 					}
+					else if (is_st() && tos_floppy_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
+					{
+						done = 1;
+						buffer_lba[disk] = lba;
+					}
 					else if (sd_image[disk].size)
 					{
 						diskled_on();
@@ -3320,7 +4168,7 @@ void user_io_poll()
 				spi_block_write(buffer[disk] + offset, fio_size, sz);
 				DisableIO();
 
-				if (sd_image[disk].type == 2)
+				if (sd_image[disk].type == 2 || cached)
 				{
 					buffer_lba[disk] = -1;
 				}
@@ -3338,8 +4186,9 @@ void user_io_poll()
 						cdi_read_cd(buffer[disk], lba, buf_n);
 						buffer_lba[disk] = lba;
 					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
+					else if ((is_st() && tos_floppy_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk]))) ||
+						(FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
+						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk]))))
 					{
 						buffer_lba[disk] = lba;
 					}
@@ -3352,6 +4201,9 @@ void user_io_poll()
 			}
 			else break;
 		}
+
+		if (sd_due) backoff_update(&sd_backoff, sd_active);
+		save_cache_poll();
 	}
 
 	if (is_neogeo() && (!rtc_timer || CheckTimer(rtc_timer)))
@@ -3387,6 +4239,7 @@ void user_io_poll()
 				{
 				case 0xff:
 					ps2_kbd_scan_set = 2;
+					kbd_select();
 					kbd_reply(0xFA);
 					kbd_reply(0xAA);
 					break;
@@ -3405,6 +4258,7 @@ void user_io_poll()
 				case 0xf6: // set default parameters
 					kbd_reply(0xFA);
 					ps2_kbd_scan_set = 2;
+					kbd_select();
 					break;
 
 				case 0xf3: // set type rate
@@ -3449,7 +4303,11 @@ void user_io_poll()
 					{
 						kbd_reply(0xFA);
 						if (!kbd_ctl) kbd_reply(ps2_kbd_scan_set); // get
-						else ps2_kbd_scan_set = kbd_ctl; // set
+						else
+						{
+							ps2_kbd_scan_set = kbd_ctl; // set
+							kbd_select();
+						}
 					}
 					else
 					{
@@ -3642,43 +4500,28 @@ void user_io_poll()
 		diskled_is_on = 0;
 	}
 
-	if (is_megacd()) mcd_poll();
-	if (is_pce()) pcecd_poll();
-	if (is_saturn()) saturn_poll();
-	if (is_cdi()) cdi_poll();
-	if (is_psx()) psx_poll();
-	if (is_neogeo_cd()) neocd_poll();
 	if (is_n64()) n64_poll();
-	if (is_c64() || is_c128())
+	if ((is_c64() || is_c128()) && backoff_due(&upload_backoff))
 	{
 		uint16_t save_req = spi_uio_cmd(UIO_CHK_UPLOAD);
 		if (save_req) c64_save_cart(save_req >> 8);
+		backoff_update(&upload_backoff, save_req);
 	}
 	process_ss(0);
 }
 
 static void send_keycode(unsigned short key, int press)
 {
-	if (is_pcxt())
-	{
-		//WIN+... we override this hotkey in the core.
-		if (key == 125 || key == 126)
-		{
-			winkey_pressed = press;
-			return;
-		}
-		if (winkey_pressed)
-		{
-			return;
-		}
-	}
-	if (is_minimig())
+	if (!kbd_table || key > 255) return;
+
+	uint32_t code = kbd_table[key];
+	if (code == NONE) return;
+
+	switch (kbd_mode)
 	{
+	case KBD_AMIGA:
 		if (press > 1) return;
 
-		uint32_t code = get_amiga_code(key);
-		if (code == NONE) return;
-
 		if (code & CAPS_TOGGLE)
 		{
 			if (press)
@@ -3728,16 +4571,11 @@ static void send_keycode(unsigned short key, int press)
 		{
 			kbd_fifo_enqueue(code);
 		}
-		return;
-	}
+		break;
 
-	if (is_archie())
-	{
+	case KBD_ARCHIE:
 		if (press > 1) return;
 
-		uint32_t code = get_archie_code(key);
-		if (code == NONE) return;
-
 		//WIN+...
 		if (get_key_mod() & (RGUI | LGUI))
 		{
@@ -3763,13 +4601,22 @@ static void send_keycode(unsigned short key, int press)
 		}
 		if (!press) code |= 0x8000;
 		archie_kbd(code);
-		return;
-	}
+		break;
 
-	if (core_type == CORE_TYPE_8BIT)
-	{
-		uint32_t code = get_ps2_code(key);
-		if (code == NONE) return;
+	case KBD_PS2:
+		if (kbd_pcxt)
+		{
+			//WIN+... we override this hotkey in the core.
+			if (key == 125 || key == 126)
+			{
+				winkey_pressed = press;
+				return;
+			}
+			if (winkey_pressed)
+			{
+				return;
+			}
+		}
 
 		//pause
 		if ((code & 0xff) == 0xE1)
@@ -3778,97 +4625,60 @@ static void send_keycode(unsigned short key, int press)
 			if (press != 1)
 			{
 				// Pause key sends E11477E1F014E077
-				static const unsigned char c[] = { 0xe1, 0x14, 0x77, 0xe1, 0xf0, 0x14, 0xf0, 0x77, 0x00 };
-				static const unsigned char c_set1[] = { 0xe1, 0x1d, 0x45, 0xe1, 0x9d, 0xc5, 0x00 };
-				const unsigned char *p = (ps2_kbd_scan_set == 1) ? c_set1 : c;
-
-				spi_uio_cmd_cont(UIO_KEYBOARD);
-
-				printf("PS2 PAUSE CODE: ");
-				while (*p)
-				{
-					printf("%x ", *p);
-					spi8(*p++);
-				}
-				printf("\n");
+				static const uint8_t c[] = { 0xe1, 0x14, 0x77, 0xe1, 0xf0, 0x14, 0xf0, 0x77 };
+				static const uint8_t c_set1[] = { 0xe1, 0x1d, 0x45, 0xe1, 0x9d, 0xc5 };
 
-				DisableIO();
+				printf("PS2 PAUSE CODE\n");
+				if (ps2_kbd_scan_set == 1) kbd_batch_add(c_set1, sizeof(c_set1));
+				else kbd_batch_add(c, sizeof(c));
 			}
+			break;
 		}
+
 		// print screen
-		else if ((code & 0xff) == 0xE2)
+		if ((code & 0xff) == 0xE2)
 		{
 			if (press <= 1)
 			{
-				static const unsigned char c[2][8] = {
-					{ 0xE0, 0xF0, 0x7C, 0xE0, 0xF0, 0x12, 0x00, 0x00 },
-					{ 0xE0, 0x12, 0xE0, 0x7C, 0x00, 0x00, 0x00, 0x00 }
+				static const uint8_t c[2][6] = {
+					{ 0xE0, 0xF0, 0x7C, 0xE0, 0xF0, 0x12 },
+					{ 0xE0, 0x12, 0xE0, 0x7C }
 				};
-				static const unsigned char c_set1[2][8] = {
-					{ 0xE0, 0xB7, 0xE0, 0xAA, 0x00, 0x00, 0x00, 0x00 },
-					{ 0xE0, 0x2A, 0xE0, 0x37, 0x00, 0x00, 0x00, 0x00 }
+				static const uint8_t c_set1[2][4] = {
+					{ 0xE0, 0xB7, 0xE0, 0xAA },
+					{ 0xE0, 0x2A, 0xE0, 0x37 }
 				};
 
-				const unsigned char *p = (ps2_kbd_scan_set == 1) ? c_set1[press] : c[press];
-
-				spi_uio_cmd_cont(UIO_KEYBOARD);
-
-				printf("PS2 PRINT CODE: ");
-				while (*p)
-				{
-					printf("%x ", *p);
-					spi8(*p++);
-				}
-				printf("\n");
-
-				DisableIO();
+				printf("PS2 PRINT CODE\n");
+				if (ps2_kbd_scan_set == 1) kbd_batch_add(c_set1[press], 4);
+				else kbd_batch_add(c[press], press ? 4 : 6);
 			}
+			break;
 		}
-		else
-		{
-			if (press > 1 && !use_ps2ctl) return;
-
-			spi_uio_cmd_cont(UIO_KEYBOARD);
-
-			// prepend extended code flag if required
-			if (code & EXT) spi8(0xe0);
-
-			// prepend break code if required
-            if (!press)
-            {
-                if (ps2_kbd_scan_set == 1)
-                        code |= 0x80;
-                    else
-                        spi8(0xf0);
-            }
-			// send code itself
-			spi8(code & 0xff);
-
-			DisableIO();
-		}
-	}
-
-	if (core_type == CORE_TYPE_SHARPMZ)
-	{
-		uint32_t code = get_ps2_code(key);
-		if (code == NONE) return;
+		// fall through
 
+	case KBD_SHARPMZ:
 		{
 			if (press > 1 && !use_ps2ctl) return;
 
-			spi_uio_cmd_cont(UIO_KEYBOARD);
+			uint8_t buf[3];
+			int len = 0;
 
 			// prepend extended code flag if required
-			if (code & EXT) spi8(0xe0);
+			if (code & EXT) buf[len++] = 0xe0;
 
-			// prepend break code if required
-			if (!press) spi8(0xf0);
+			// break code: set 1 marks it in the msb, SharpMZ is always set 2
+			if (!press)
+			{
+				if (kbd_mode == KBD_PS2 && ps2_kbd_scan_set == 1) code |= 0x80;
+				else buf[len++] = 0xf0;
+			}
 
 			// send code itself
-			spi8(code & 0xff);
-
-			DisableIO();
+			buf[len++] = code & 0xff;
+			kbd_batch_add(buf, len);
 		}
+		break;
 	}
 }
 
@@ -4048,12 +4858,12 @@ void user_io_kbd(uint16_t key, int press)
 	else
 	if (key == 0xBE)
 	{
-		if (press) setBrightness(BRIGHTNESS_DOWN, 0);
+		if (press) sensors_set_brightness(BRIGHTNESS_DOWN, 0);
 	}
 	else
 	if (key == 0xBF)
 	{
-		if (press) setBrightness(BRIGHTNESS_UP, 0);
+		if (press) sensors_set_brightness(BRIGHTNESS_UP, 0);
 	}
 	else
 	if (key == KEY_F2 && osd_is_visible)
@@ -4202,38 +5012,104 @@ uint16_t user_io_get_sdram_cfg()
 	return sdram_cfg;
 }
 
-static struct { const char *fmtstr; Imlib_Load_Error errno; } err_strings[] = {
-  {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
-  {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
-  {"permission denied to read file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ},
-  {"no loader for the file format used in file '%s'", IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT},
-  {"path for file '%s' is too long", IMLIB_LOAD_ERROR_PATH_TOO_LONG},
-  {"a component of path '%s' does not exist", IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT},
-  {"a component of path '%s' is not a directory", IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY},
-  {"path '%s' has too many symbolic links", IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS},
-  {"ran out of file descriptors trying to access file '%s'", IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS},
-  {"denied write permission for file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE},
-  {"out of disk space writing to file '%s'", IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE},
-  {(const char *)NULL, (Imlib_Load_Error) 0}
-};
+// Screenshots are grabbed on the calling thread and encoded by an offload job,
+// the OSD message is shown from user_io_poll once the file is written.
+static struct
+{
+	uint8_t *frame;
+	int frame_size;
+	int width, height;
+	int out_width, out_height;
+	char path[1024];
+	char name[1024];
+	int ok;
+} shot = {};
 
-static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath) {
-  int i;
-  for (i = 0; err_strings[i].fmtstr != NULL; i++) {
-    if (err == err_strings[i].errno) {
-	printf("Screenshot Error (%d): ",err);
-	printf(err_strings[i].fmtstr,filepath);
-	printf("\n");
-      return ;
-    }
-  }
-  /* Unrecognised error */
-    printf("Screenshot Error (%d): unrecognized error accessing file '%s'\n",err,filepath);
-  return ;
+static OffloadHandle shot_job;
+static int shot_busy = 0;
+
+// Bilinear resize of packed RGB, 8 bit weights
+static void screenshot_resize(const uint8_t *src, int sw, int sh, uint8_t *dst, int dw, int dh)
+{
+	for (int y = 0; y < dh; y++)
+	{
+		uint32_t fy = (dh > 1) ? (uint32_t)(((uint64_t)y * (sh - 1) << 8) / (dh - 1)) : 0;
+		int y0 = fy >> 8, wy = fy & 0xFF;
+		int y1 = (y0 + 1 < sh) ? y0 + 1 : y0;
+		const uint8_t *r0 = src + y0 * sw * 3;
+		const uint8_t *r1 = src + y1 * sw * 3;
+
+		for (int x = 0; x < dw; x++)
+		{
+			uint32_t fx = (dw > 1) ? (uint32_t)(((uint64_t)x * (sw - 1) << 8) / (dw - 1)) : 0;
+			int x0 = (fx >> 8) * 3, wx = fx & 0xFF;
+			int x1 = ((int)(fx >> 8) + 1 < sw) ? x0 + 3 : x0;
+
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t top = r0[x0 + c] * (256 - wx) + r0[x1 + c] * wx;
+				uint32_t bot = r1[x0 + c] * (256 - wx) + r1[x1 + c] * wx;
+				*dst++ = (top * (256 - wy) + bot * wy + 32768) >> 16;
+			}
+		}
+	}
+}
+
+static void screenshot_encode()
+{
+	const uint8_t *img = shot.frame;
+	uint8_t *scaled = NULL;
+
+	shot.ok = 0;
+	if (shot.out_width != shot.width || shot.out_height != shot.height)
+	{
+		scaled = (uint8_t*)malloc(shot.out_width * shot.out_height * 3);
+		if (!scaled) return;
+		screenshot_resize(shot.frame, shot.width, shot.height, scaled, shot.out_width, shot.out_height);
+		img = scaled;
+	}
+
+	size_t len = 0;
+	void *png = tdefl_write_image_to_png_file_in_memory_ex(img, shot.out_width, shot.out_height, 3, &len, MZ_DEFAULT_LEVEL, 0);
+	free(scaled);
+	if (!png) return;
+
+	FILE *f = fopen(shot.path, "wb");
+	if (f)
+	{
+		shot.ok = (fwrite(png, 1, len, f) == len);
+		if (fclose(f)) shot.ok = 0;
+		if (!shot.ok) unlink(shot.path);
+	}
+	mz_free(png);
+}
+
+void user_io_screenshot_poll()
+{
+	if (!shot_busy || !shot_job.done()) return;
+	shot_busy = 0;
+	shot_job = OffloadHandle();
+
+	if (!shot.ok)
+	{
+		printf("Screenshot Error: cannot write %s\n", shot.path);
+		Info("error in saving png");
+		return;
+	}
+
+	char msg[1024];
+	snprintf(msg, 1024, "Screen saved to\n%s", shot.name + strlen(SCREENSHOT_DIR"/"));
+	Info(msg);
 }
 
 bool user_io_screenshot(const char *pngname, int rescale)
 {
+	if (shot_busy)
+	{
+		Info("Screenshot in progress");
+		return false;
+	}
+
 	mister_scaler *ms = mister_scaler_init();
 	if (ms == NULL)
 	{
@@ -4241,54 +5117,48 @@ bool user_io_screenshot(const char *pngname, int rescale)
 		Info("Scaler not compatible");
 		return false;
 	}
-	else
+
+	int scwidth = ms->output_width;
+	int scheight = ms->output_height;
+
+	if (video_get_rotated())
 	{
-    int scwidth = ms->output_width;
-    int scheight = ms->output_height;
+		//If the video is rotated, the scaled output resolution results in a squished image.
+		//Calculate the scaled output res using the original AR
+		scwidth = scheight * ((float)ms->width / ms->height);
+	}
 
-    if (video_get_rotated())
-    {
+	// Frame buffer is kept for the next screenshot
+	int size = ms->width * ms->height * 3;
+	if (size > shot.frame_size)
+	{
+		free(shot.frame);
+		shot.frame = (uint8_t*)malloc(size);
+		shot.frame_size = shot.frame ? size : 0;
+	}
 
-      //If the video is rotated, the scaled output resolution results in a squished image.
-      //Calculate the scaled output res using the original AR
-      scwidth = scheight * ((float)ms->width/ms->height);
-    }
+	int ok = shot.frame && !mister_scaler_read(ms, shot.frame);
+	shot.width = ms->width;
+	shot.height = ms->height;
+	mister_scaler_free(ms);
 
-		const char *basename = last_filename;
-		if( pngname && *pngname )
-			basename = pngname;
-		unsigned char *outputbuf = (unsigned char *)calloc(ms->width*ms->height * 4, 1);
-		// read the image into the outpubuf - RGBA format
-		mister_scaler_read_32(ms,outputbuf);
-		// using_data will keep a pointer and dispose of the outbuf
-		Imlib_Image im = imlib_create_image_using_data(ms->width,ms->height,(unsigned int *)outputbuf);
-		imlib_context_set_image(im);
-
-		static char filename[1024];
-		FileGenerateScreenshotName(basename, filename, 1024);
-
-		/* do we want to save a rescaled image? */
-		if (rescale)
-		{
-			Imlib_Image im_scaled=imlib_create_cropped_scaled_image(0,0,ms->width,ms->height,scwidth,scheight);
-			imlib_free_image_and_decache();
-			imlib_context_set_image(im_scaled);
-		}
-		Imlib_Load_Error error;
-		imlib_save_image_with_error_return(getFullPath(filename),&error);
-		if (error != IMLIB_LOAD_ERROR_NONE)
-		{
-			print_imlib_load_error (error, filename);
-			Info("error in saving png");
-			return false;
-		}
-		imlib_free_image_and_decache();
-		mister_scaler_free(ms);
-		free(outputbuf);
-		char msg[1024];
-		snprintf(msg, 1024, "Screen saved to\n%s", filename + strlen(SCREENSHOT_DIR"/"));
-		Info(msg);
+	if (!ok)
+	{
+		Info("error in saving png");
+		return false;
 	}
+
+	shot.out_width = (rescale && scwidth > 0) ? scwidth : shot.width;
+	shot.out_height = (rescale && scheight > 0) ? scheight : shot.height;
+
+	const char *basename = last_filename;
+	if (pngname && *pngname) basename = pngname;
+
+	FileGenerateScreenshotName(basename, shot.name, sizeof(shot.name));
+	snprintf(shot.path, sizeof(shot.path), "%s", getFullPath(shot.name));
+
+	shot_job = offload_submit(screenshot_encode, OFFLOAD_PRIO_BACKGROUND);
+	shot_busy = 1;
 	return true;
 }
 
@@ -7,6 +7,7 @@
 #define USER_IO_H
 
 #include <inttypes.h>
+#include <sys/uio.h>
 #include "file_io.h"
 
 #define UIO_STATUS      0x00
@@ -74,6 +75,7 @@
 #define UIO_GET_FB_PAR  0x40
 #define UIO_SET_YC_PAR  0x41
 #define UIO_GET_FR_CNT  0x42  // get frame counter
+#define UIO_JOY_FRAME   0x43  // all players' digital and analog joystick state in one transfer
 
 // codes as used by 8bit for file loading from OSD
 #define FIO_FILE_TX     0x53
@@ -166,6 +168,8 @@ void user_io_init(const char *path, const char *xml);
 unsigned char user_io_core_type();
 void user_io_read_core_name();
 void user_io_poll();
+int user_io_share_poll();
+int user_io_cd_poll();
 char user_io_menu_button();
 char user_io_user_button();
 void user_io_osd_key_enable(char);
@@ -181,6 +185,10 @@ uint32_t user_io_status_mask(const char *opt);
 uint32_t user_io_hd_mask(const char *opt);
 uint32_t user_io_status_get(const char *opt, int ex = 0);
 void user_io_status_set(const char *opt, uint32_t value, int ex = 0);
+// The status is only sent when it differs from what the core has. While held
+// the updates are collected and sent in one transfer when released, so don't
+// hold around pulses (bit set and cleared again) that have to reach the core.
+void user_io_status_hold(int hold);
 int user_io_status_save(const char *filename);
 void user_io_status_reset();
 
@@ -208,6 +216,8 @@ int user_io_get_joy_transl();
 void user_io_digital_joystick(unsigned char, uint64_t, int);
 void user_io_l_analog_joystick(unsigned char, char, char);
 void user_io_r_analog_joystick(unsigned char, char, char);
+void user_io_joy_flush();
+void user_io_kbd_flush();
 void user_io_set_joyswap(int swap);
 int user_io_get_joyswap();
 char user_io_osd_is_visible();
@@ -219,11 +229,29 @@ uint16_t user_io_get_sdram_cfg();
 
 int user_io_file_tx(const char* name, unsigned char index = 0, char opensave = 0, char mute = 0, char composite = 0, uint32_t load_addr = 0);
 int user_io_file_tx_a(const char* name, uint16_t index);
+// Firmware sent from the copy fw_cache keeps in RAM.
+int user_io_file_tx_fw(const char* name, unsigned char index);
+int user_io_file_tx_mem(const char* name, const uint8_t *data, uint32_t size, unsigned char index);
 unsigned char user_io_ext_idx(char *, char*);
 void user_io_set_index(unsigned char index);
 void user_io_set_aindex(uint16_t index);
 void user_io_set_download(unsigned char enable, int addr = 0);
 void user_io_file_tx_data(const uint8_t *addr, uint32_t len);
+// One data transfer from the pieces in iov (even sizes), no copy into a buffer first.
+void user_io_file_tx_datav(const struct iovec *iov, int cnt);
+
+// Read-ahead for loaders with their own transfer loop: a thread off the main
+// core reads the file in chunks sized for its storage and runs xform (format
+// fixup such as a byte swap, may be NULL) over every chunk before handing it
+// over, so the fixup needs no pass of its own. One pipe at a time.
+typedef void (*tx_xform_t)(uint8_t *buf, uint32_t len, void *ctx);
+struct tx_pipe_t;
+tx_pipe_t *user_io_tx_pipe_open(fileTYPE *f, uint32_t size, tx_xform_t xform, void *ctx);
+// Next chunk, valid until user_io_tx_pipe_done. NULL at the end.
+const uint8_t *user_io_tx_pipe_next(tx_pipe_t *p, uint32_t *len);
+void user_io_tx_pipe_done(tx_pipe_t *p);
+void user_io_tx_pipe_close(tx_pipe_t *p);
+
 void user_io_set_upload(unsigned char enable, int addr = 0);
 void user_io_file_rx_data(uint8_t *addr, uint32_t len);
 void user_io_file_info(const char *ext);
@@ -235,6 +263,7 @@ void user_io_rtc_reset();
 
 void user_io_screenshot_cmd(const char *cmd);
 bool user_io_screenshot(const char *pngname, int rescale);
+void user_io_screenshot_poll();
 
 const char* get_rbf_dir();
 const char* get_rbf_name();
@@ -258,9 +287,12 @@ int GetUARTbaud_idx(int mode);
 uint32_t ValidateUARTbaud(int mode, uint32_t baud);
 char * GetMidiLinkSoundfont();
 void user_io_store_filename(char *filename);
+const char *user_io_get_filename(); // last loaded file, no path or extension
 int user_io_use_cheats();
 
 int process_ss(const char *rom_name, int enable = 1);
+int process_ss_rewind(int slot, int back);
+uint32_t user_io_ss_count(int slot); // savestate counter of the slot, 0 if not mapped
 
 void diskled_on();
 #define DISKLED_ON  diskled_on()
@@ -11,6 +11,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
 
 #include "hardware.h"
 #include "user_io.h"
@@ -20,12 +25,17 @@
 #include "mat4x4.h"
 #include "menu.h"
 #include "video.h"
+#include "scheduler.h"
 #include "input.h"
 #include "shmem.h"
 #include "smbus.h"
 #include "str_util.h"
 #include "profiling.h"
 #include "offload.h"
+#include "table_cache.h"
+#include "memtrack.h"
+#include "fb_prim.h"
+#include "image_reduce.h"
 
 #include "support.h"
 #include "support/arcade/mra_loader.h"
@@ -33,6 +43,7 @@
 #include "lib/md5/md5.h"
 
 #define FB_SIZE  (1920*1080)
+#define FB_AUTO_FULL (1280*720) // largest full size frame buffer over a core with fb_size=0
 #define FB_ADDR  (0x20000000 + (32*1024*1024)) // 512mb + 32mb(Core's fb)
 
 /*
@@ -246,11 +257,26 @@ static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
 	return 0;
 }
 
-static void setPLL(double Fout, vmode_custom_t *v)
-{
-	PROFILE_FUNCTION();
+// PLL parameters per pixel clock. The table is filled with the standard modes
+// on init and with every other clock the first time it's used, so switching
+// between the modes of a core doesn't search again. Slots are picked by the
+// clock in kHz, only an exact clock match is a hit.
+#define PLL_CACHE_SIZE 64
 
+struct pll_par_t
+{
+	double Fout;
 	double Fpix;
+	uint32_t c, m, k;
+};
+
+static pll_par_t pll_cache[PLL_CACHE_SIZE] = {};
+
+static const pll_par_t *calcPLL(double Fout)
+{
+	pll_par_t *p = &pll_cache[(uint32_t)(Fout * 1000.f) % PLL_CACHE_SIZE];
+	if (p->Fout == Fout && p->c) return p;
+
 	double fvco, ko;
 	uint32_t m, c;
 
@@ -281,24 +307,43 @@ static void setPLL(double Fout, vmode_custom_t *v)
 
 	fvco = ko + m;
 	fvco *= 50.f;
-	Fpix = fvco / c;
 
-	printf("Fvco=%f, C=%d, M=%d, K=%f(%u) -> Fpix=%f\n", fvco, c, m, ko, k, Fpix);
+	p->Fout = Fout;
+	p->Fpix = fvco / c;
+	p->c = c;
+	p->m = m;
+	p->k = k;
+
+	printf("Fvco=%f, C=%d, M=%d, K=%f(%u) -> Fpix=%f\n", fvco, c, m, ko, k, p->Fpix);
+	return p;
+}
+
+static void initPLL()
+{
+	for (uint i = 0; i < VMODES_NUM; i++) calcPLL(vmodes[i].Fpix);
+	for (uint i = 0; i < sizeof(tvmodes) / sizeof(tvmodes[0]); i++) calcPLL(tvmodes[i].Fpix);
+}
+
+static void setPLL(double Fout, vmode_custom_t *v)
+{
+	PROFILE_FUNCTION();
+
+	const pll_par_t *p = calcPLL(Fout);
 
 	v->item[9]  = 4;
-	v->item[10] = getPLLdiv(m);
+	v->item[10] = getPLLdiv(p->m);
 	v->item[11] = 3;
 	v->item[12] = 0x10000;
 	v->item[13] = 5;
-	v->item[14] = getPLLdiv(c);
+	v->item[14] = getPLLdiv(p->c);
 	v->item[15] = 9;
 	v->item[16] = 2;
 	v->item[17] = 8;
 	v->item[18] = 7;
 	v->item[19] = 7;
-	v->item[20] = k;
+	v->item[20] = p->k;
 
-	v->Fpix = Fpix;
+	v->Fpix = p->Fpix;
 }
 
 struct ScalerFilter
@@ -360,11 +405,8 @@ static bool scale_phases(FilterPhase out_phases[N_PHASES], FilterPhase *in_phase
 	return true;
 }
 
-static bool read_video_filter(int type, VideoFilter *out)
+static bool parse_video_filter(fileTextReader *reader, VideoFilter *out, const char *name, bool verbose)
 {
-	PROFILE_FUNCTION();
-
-	fileTextReader reader = {};
 	FilterPhase phases[512];
 	int count = 0;
 	bool is_adaptive = false;
@@ -372,13 +414,10 @@ static bool read_video_filter(int type, VideoFilter *out)
 
 	memset(out, 0, sizeof(VideoFilter));
 
-	static char filename[1024];
-	snprintf(filename, sizeof(filename), COEFF_DIR"/%s", scaler_flt[type].filename);
-
-	if (FileOpenTextReader(&reader, filename))
+	if (reader)
 	{
 		const char *line;
-		while ((line = FileReadLine(&reader)))
+		while ((line = FileReadLine(reader)))
 		{
 			if (count == 0 && !strcasecmp(line, "adaptive"))
 			{
@@ -406,10 +445,13 @@ static bool read_video_filter(int type, VideoFilter *out)
 		}
 	}
 
-	printf( "Filter \'%s\', phases: %d adaptive: %s\n",
-			scaler_flt[type].filename,
-			is_adaptive ? count / 2 : count,
-			is_adaptive ? "true" : "false" );
+	if (verbose)
+	{
+		printf( "Filter \'%s\', phases: %d adaptive: %s\n",
+				name,
+				is_adaptive ? count / 2 : count,
+				is_adaptive ? "true" : "false" );
+	}
 
 	bool valid = false;
 	if (is_adaptive)
@@ -451,6 +493,175 @@ static bool read_video_filter(int type, VideoFilter *out)
 	return valid;
 }
 
+// Parsed filters, keyed by full path, mtime and size. Phases are always scaled
+// to N_PHASES so the target doesn't need to be part of the key.
+// Filled on use and by a background scan of the filters folder.
+static constexpr int FILTER_CACHE_SIZE = 64;
+
+struct VideoFilterCache
+{
+	char path[1024];
+	time_t mtime;
+	off_t size;
+	bool valid;
+	uint32_t used;
+	VideoFilter flt;
+};
+
+static VideoFilterCache *filter_cache = nullptr;
+static uint32_t filter_cache_tick = 0;
+static pthread_mutex_t filter_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool filter_cache_get(const char *path, const struct stat *st, VideoFilter *out, bool *valid)
+{
+	bool hit = false;
+	pthread_mutex_lock(&filter_cache_lock);
+	for (int i = 0; filter_cache && i < FILTER_CACHE_SIZE; i++)
+	{
+		VideoFilterCache *e = &filter_cache[i];
+		if (e->used && e->mtime == st->st_mtime && e->size == st->st_size && !strcmp(e->path, path))
+		{
+			if (out) memcpy(out, &e->flt, sizeof(VideoFilter));
+			if (valid) *valid = e->valid;
+			e->used = ++filter_cache_tick;
+			hit = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&filter_cache_lock);
+	return hit;
+}
+
+static void filter_cache_put(const char *path, const struct stat *st, const VideoFilter *flt, bool valid)
+{
+	pthread_mutex_lock(&filter_cache_lock);
+	if (!filter_cache) filter_cache = (VideoFilterCache *)calloc(FILTER_CACHE_SIZE, sizeof(VideoFilterCache));
+	if (filter_cache)
+	{
+		// Same path (older version) or least recently used
+		VideoFilterCache *e = &filter_cache[0];
+		for (int i = 0; i < FILTER_CACHE_SIZE; i++)
+		{
+			if (!strcmp(filter_cache[i].path, path)) { e = &filter_cache[i]; break; }
+			if (filter_cache[i].used < e->used) e = &filter_cache[i];
+		}
+
+		snprintf(e->path, sizeof(e->path), "%s", path);
+		e->mtime = st->st_mtime;
+		e->size = st->st_size;
+		e->valid = valid;
+		e->used = ++filter_cache_tick;
+		memcpy(&e->flt, flt, sizeof(VideoFilter));
+	}
+	pthread_mutex_unlock(&filter_cache_lock);
+}
+
+// Plain file access, usable off the main thread
+static bool load_video_filter(const char *path, VideoFilter *out, const char *name, bool verbose)
+{
+	fileTextReader reader = {};
+	bool loaded = false;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		struct stat st;
+		if (!fstat(fd, &st) && st.st_size > 0 && st.st_size < 1024 * 1024)
+		{
+			reader.buffer = (char *)calloc(st.st_size + 1, 1);
+			if (reader.buffer && read(fd, reader.buffer, st.st_size) == st.st_size)
+			{
+				reader.size = st.st_size;
+				reader.pos = reader.buffer;
+				loaded = true;
+			}
+		}
+		close(fd);
+	}
+
+	return parse_video_filter(loaded ? &reader : nullptr, out, name, verbose);
+}
+
+static void prefetch_filter_dir(const char *dir, int depth, int *budget)
+{
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	struct dirent *de;
+	while (*budget > 0 && (de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		struct stat st;
+		if (stat(path, &st)) continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (depth < 2) prefetch_filter_dir(path, depth + 1, budget);
+			continue;
+		}
+
+		int len = strlen(de->d_name);
+		if (len < 4 || strcasecmp(de->d_name + len - 4, ".txt")) continue;
+		if (filter_cache_get(path, &st, nullptr, nullptr)) continue;
+
+		VideoFilter *flt = (VideoFilter *)malloc(sizeof(VideoFilter));
+		if (!flt) break;
+		bool valid = load_video_filter(path, flt, de->d_name, false);
+		filter_cache_put(path, &st, flt, valid);
+		free(flt);
+		(*budget)--;
+	}
+
+	closedir(d);
+}
+
+static void prefetch_video_filters()
+{
+	static bool started = false;
+	if (started) return;
+	started = true;
+
+	std::string dir = getFullPath(COEFF_DIR);
+	offload_submit([dir]()
+	{
+		int budget = FILTER_CACHE_SIZE - 8; // leave room for the ones in use
+		prefetch_filter_dir(dir.c_str(), 0, &budget);
+	}, OFFLOAD_PRIO_BACKGROUND);
+}
+
+static bool read_video_filter(const char *name, VideoFilter *out)
+{
+	PROFILE_FUNCTION();
+
+	static char filename[1024];
+	snprintf(filename, sizeof(filename), "%s", getFullPath(COEFF_DIR));
+	strncat(filename, "/", sizeof(filename) - strlen(filename) - 1);
+	strncat(filename, name, sizeof(filename) - strlen(filename) - 1);
+
+	struct stat st;
+	if (stat(filename, &st) || !S_ISREG(st.st_mode)) return parse_video_filter(nullptr, out, name, true);
+
+	bool valid;
+	if (filter_cache_get(filename, &st, out, &valid))
+	{
+		printf("Filter \'%s\' (cached)\n", name);
+		return valid;
+	}
+
+	valid = load_video_filter(filename, out, name, true);
+	filter_cache_put(filename, &st, out, valid);
+	return valid;
+}
+
+static bool read_video_filter(int type, VideoFilter *out)
+{
+	return read_video_filter(scaler_flt[type].filename, out);
+}
+
 static void send_phases_legacy(int addr, const FilterPhase phases[N_PHASES])
 {
 	PROFILE_FUNCTION();
@@ -672,6 +883,8 @@ static void loadScalerCfg()
 		}
 	}
 
+	prefetch_video_filters();
+
 	if (!read_video_filter(VFILTER_HORZ, &scaler_flt_data[VFILTER_HORZ])) memset(&scaler_flt[VFILTER_HORZ], 0, sizeof(scaler_flt[VFILTER_HORZ]));
 	if (!read_video_filter(VFILTER_VERT, &scaler_flt_data[VFILTER_VERT])) memset(&scaler_flt[VFILTER_VERT], 0, sizeof(scaler_flt[VFILTER_VERT]));
 	if (!read_video_filter(VFILTER_SCAN, &scaler_flt_data[VFILTER_SCAN])) memset(&scaler_flt[VFILTER_SCAN], 0, sizeof(scaler_flt[VFILTER_SCAN]));
@@ -682,49 +895,57 @@ static char active_gamma_cfg[1024] = { 0 };
 static char gamma_cfg[1024] = { 0 };
 static char has_gamma = 0; // set in video_init
 
+static void parse_gamma(fileTextReader *reader, int, std::vector<uint16_t> &words)
+{
+	const char *line;
+	int index = 0;
+	while ((line = FileReadLine(reader)))
+	{
+		int c0, c1, c2;
+		int n = sscanf(line, "%d,%d,%d", &c0, &c1, &c2);
+		if (n == 1)
+		{
+			c1 = c0;
+			c2 = c0;
+			n = 3;
+		}
+
+		if (n == 3)
+		{
+			words.push_back((index << 8) | (c0 & 0xFF));
+			words.push_back((index << 8) | (c1 & 0xFF));
+			words.push_back((index << 8) | (c2 & 0xFF));
+
+			index++;
+			if (index >= 256) break;
+		}
+	}
+}
+
+// curve is NULL if the file couldn't be read, the core is left as it is then
+static void sendGamma(const std::vector<uint16_t> *curve)
+{
+	if (!curve) return;
+
+	spi_uio_cmd_cont(UIO_SET_GAMCURV);
+	table_send(curve);
+	DisableIO();
+	spi_uio_cmd8(UIO_SET_GAMMA, gamma_cfg[0]);
+}
+
 static void setGamma()
 {
 	PROFILE_FUNCTION();
 
 	if (!memcmp(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg))) return;
 
-	fileTextReader reader = {};
 	static char filename[1024];
 
 	if (!has_gamma) return;
 
 	snprintf(filename, sizeof(filename), GAMMA_DIR"/%s", gamma_cfg + 1);
 
-	if (FileOpenTextReader(&reader, filename))
-	{
-		spi_uio_cmd_cont(UIO_SET_GAMCURV);
-
-		const char *line;
-		int index = 0;
-		while ((line = FileReadLine(&reader)))
-		{
-			int c0, c1, c2;
-			int n = sscanf(line, "%d,%d,%d", &c0, &c1, &c2);
-			if (n == 1)
-			{
-				c1 = c0;
-				c2 = c0;
-				n = 3;
-			}
-
-			if (n == 3)
-			{
-				spi_w((index << 8) | (c0 & 0xFF));
-				spi_w((index << 8) | (c1 & 0xFF));
-				spi_w((index << 8) | (c2 & 0xFF));
-
-				index++;
-				if (index >= 256) break;
-			}
-		}
-		DisableIO();
-		spi_uio_cmd8(UIO_SET_GAMMA, gamma_cfg[0]);
-	}
+	sendGamma(table_get(filename, 0, parse_gamma));
 	memcpy(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg));
 }
 
@@ -810,109 +1031,119 @@ enum
 	SM_MODE_COUNT
 };
 
-static void setShadowMask()
+// arg is the vertical resolution, the last section for a resolution up to it is used
+static void parse_shadow_mask(fileTextReader *reader, int arg, std::vector<uint16_t> &words)
 {
-	PROFILE_FUNCTION();
-
-	static char filename[1024];
-	has_shadow_mask = 0;
-
-	if (!spi_uio_cmd_cont(UIO_SHADOWMASK))
-	{
-		DisableIO();
-		return;
-	}
-
-	has_shadow_mask = 1;
-	switch (video_get_shadow_mask_mode())
-	{
-		default: spi_w(SM_FLAG(0)); break;
-		case SM_MODE_1X: spi_w(SM_FLAG(SM_FLAG_ENABLED)); break;
-		case SM_MODE_2X: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X)); break;
-		case SM_MODE_1X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED)); break;
-		case SM_MODE_2X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X)); break;
-	}
-
-	int loaded = 0;
-	snprintf(filename, sizeof(filename), SMASK_DIR"/%s", shadow_mask_cfg + 1);
-
-	fileTextReader reader;
-	if (FileOpenTextReader(&reader, filename))
+	char *start_pos = reader->pos;
+	const char *line;
+	uint32_t res = 0;
+	while ((line = FileReadLine(reader)))
 	{
-		char *start_pos = reader.pos;
-		const char *line;
-		uint32_t res = 0;
-		while ((line = FileReadLine(&reader)))
+		if (!strncasecmp(line, "resolution=", 11))
 		{
-			if (!strncasecmp(line, "resolution=", 11))
+			if (sscanf(line + 11, "%u", &res))
 			{
-				if (sscanf(line + 11, "%u", &res))
+				if ((uint32_t)arg >= res)
 				{
-					if (v_cur.item[5] >= res)
-					{
-						start_pos = reader.pos;
-					}
+					start_pos = reader->pos;
 				}
 			}
 		}
+	}
 
-		int w = -1, h = -1;
-		int y = 0;
-		int v2 = 0;
+	int w = -1, h = -1;
+	int y = 0;
+	int v2 = 0;
 
-		reader.pos = start_pos;
-		while ((line = FileReadLine(&reader)))
+	reader->pos = start_pos;
+	while ((line = FileReadLine(reader)))
+	{
+		if (w == -1)
 		{
-			if (w == -1)
+			if (!strcasecmp(line, "v2"))
 			{
-				if (!strcasecmp(line, "v2"))
-				{
-					v2 = 1;
-					continue;
-				}
+				v2 = 1;
+				continue;
+			}
 
-				if (!strncasecmp(line, "resolution=", 11))
-				{
-					continue;
-				}
+			if (!strncasecmp(line, "resolution=", 11))
+			{
+				continue;
+			}
 
-				int n = sscanf(line, "%d,%d", &w, &h);
-				if ((n != 2) || (w <= 0) || (h <= 0) || (w > 16) || (h > 16))
-				{
-					break;
-				}
+			int n = sscanf(line, "%d,%d", &w, &h);
+			if ((n != 2) || (w <= 0) || (h <= 0) || (w > 16) || (h > 16))
+			{
+				break;
 			}
-			else
+		}
+		else
+		{
+			unsigned int p[16];
+			int n = sscanf(line, "%X,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x", p + 0, p + 1, p + 2, p + 3, p + 4, p + 5, p + 6, p + 7, p + 8, p + 9, p + 10, p + 11, p + 12, p + 13, p + 14, p + 15);
+			if (n != w)
 			{
-				unsigned int p[16];
-				int n = sscanf(line, "%X,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x", p + 0, p + 1, p + 2, p + 3, p + 4, p + 5, p + 6, p + 7, p + 8, p + 9, p + 10, p + 11, p + 12, p + 13, p + 14, p + 15);
-				if (n != w)
-				{
-					break;
-				}
+				break;
+			}
 
-				for (int x = 0; x < 16; x++) spi_w(SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A)));
-				y += 1;
+			for (int x = 0; x < 16; x++) words.push_back(SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A)));
+			y += 1;
 
-				if (y == h)
-				{
-					loaded = 1;
-					break;
-				}
-			}
+			if (y == h) break;
 		}
+	}
 
-		if (y == h)
-		{
-			spi_w(SM_HMAX(w - 1));
-			spi_w(SM_VMAX(h - 1));
-		}
+	if (y == h)
+	{
+		words.push_back(SM_HMAX(w - 1));
+		words.push_back(SM_VMAX(h - 1));
+	}
+	else
+	{
+		words.push_back(SM_FLAG(0));
+	}
+}
+
+static const std::vector<uint16_t> *getShadowMask()
+{
+	static char filename[1024];
+	snprintf(filename, sizeof(filename), SMASK_DIR"/%s", shadow_mask_cfg + 1);
+	return table_get(filename, v_cur.item[5], parse_shadow_mask);
+}
+
+// mask is NULL if the file couldn't be read
+static void sendShadowMask(const std::vector<uint16_t> *mask)
+{
+	has_shadow_mask = 0;
+
+	if (!spi_uio_cmd_cont(UIO_SHADOWMASK))
+	{
+		DisableIO();
+		return;
+	}
+
+	has_shadow_mask = 1;
+	switch (video_get_shadow_mask_mode())
+	{
+		default: spi_w(SM_FLAG(0)); break;
+		case SM_MODE_1X: spi_w(SM_FLAG(SM_FLAG_ENABLED)); break;
+		case SM_MODE_2X: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X)); break;
+		case SM_MODE_1X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED)); break;
+		case SM_MODE_2X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X)); break;
 	}
 
-	if (!loaded) spi_w(SM_FLAG(0));
+	if (mask) table_send(mask);
+	else spi_w(SM_FLAG(0));
 	DisableIO();
 }
 
+static void setShadowMask()
+{
+	PROFILE_FUNCTION();
+
+	sendShadowMask(getShadowMask());
+}
+
 int video_get_shadow_mask_mode()
 {
 	return has_shadow_mask ? shadow_mask_cfg[0] : -1;
@@ -1011,32 +1242,57 @@ static char* get_preset_arg(const char *str)
 	return par;
 }
 
-static void load_flt_pres(const char *str, int type)
+struct video_preset_t
+{
+	bool scaler_dirty;
+	bool mask_dirty;
+	bool gamma_dirty;
+
+	// settings as they are after the preset, including the ones it doesn't touch
+	ScalerFilter flt[4];
+	VideoFilter flt_data[4];
+	char gamma[1024];
+	char mask[1024];
+
+	// table words, copied since the table cache can drop them meanwhile
+	bool has_gamma_curve;
+	bool has_mask_table;
+	uint32_t mask_vres; // resolution the mask section was picked for
+	std::vector<uint16_t> gamma_curve;
+	std::vector<uint16_t> mask_table;
+};
+
+static void prepare_flt(video_preset_t *p, const char *str, int type)
 {
 	char *arg = get_preset_arg(str);
 	if (arg[0])
 	{
 		if (!strcasecmp(arg, "same") || !strcasecmp(arg, "off"))
 		{
-			video_apply_scaler_flt(type, 0);
+			p->flt[type].mode = 0;
 		}
 		else
 		{
-			video_apply_scaler_coeff(type, arg);
-			video_apply_scaler_flt(type, 1);
+			snprintf(p->flt[type].filename, sizeof(p->flt[type].filename), "%s", arg);
+			read_video_filter(arg, &p->flt_data[type]);
+			p->flt[type].mode = 1;
 		}
 	}
 }
 
-void video_loadPreset(char *name, bool save)
+video_preset_t *video_preset_prepare(const char *name)
 {
+	PROFILE_FUNCTION();
+
+	video_preset_t *p = new video_preset_t();
+	memcpy(p->flt, scaler_flt, sizeof(p->flt));
+	memcpy(p->flt_data, scaler_flt_data, sizeof(p->flt_data));
+	memcpy(p->gamma, gamma_cfg, sizeof(p->gamma));
+	memcpy(p->mask, shadow_mask_cfg, sizeof(p->mask));
+
 	char *arg;
 	fileTextReader reader;
 
-	bool scaler_dirty = false;
-	bool mask_dirty = false;
-	bool gamma_dirty = false;
-
 	if (FileOpenTextReader(&reader, name))
 	{
 		const char *line;
@@ -1044,84 +1300,274 @@ void video_loadPreset(char *name, bool save)
 		{
 			if (!strncasecmp(line, "hfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_HORZ);
-				scaler_dirty = true;
+				prepare_flt(p, line + 8, VFILTER_HORZ);
+				p->scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "vfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_VERT);
-				scaler_dirty = true;
+				prepare_flt(p, line + 8, VFILTER_VERT);
+				p->scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "sfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_SCAN);
-				scaler_dirty = true;
+				prepare_flt(p, line + 8, VFILTER_SCAN);
+				p->scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "ifilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_ILACE);
-				scaler_dirty = true;
+				prepare_flt(p, line + 8, VFILTER_ILACE);
+				p->scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "mask=", 5))
 			{
-				mask_dirty = true;
+				p->mask_dirty = true;
 				arg = get_preset_arg(line + 5);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_shadow_mask_mode(0);
-					else video_apply_shadow_mask(arg);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) p->mask[0] = 0;
+					else snprintf(p->mask + 1, sizeof(p->mask) - 1, "%s", arg);
 				}
 			}
 			else if (!strncasecmp(line, "maskmode=", 9))
 			{
-				mask_dirty = true;
+				p->mask_dirty = true;
 				arg = get_preset_arg(line + 9);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_shadow_mask_mode(0);
-					else if (!strcasecmp(arg, "1x")) video_apply_shadow_mask_mode(SM_MODE_1X);
-					else if (!strcasecmp(arg, "2x")) video_apply_shadow_mask_mode(SM_MODE_2X);
-					else if (!strcasecmp(arg, "1x rotated")) video_apply_shadow_mask_mode(SM_MODE_1X_ROTATED);
-					else if (!strcasecmp(arg, "2x rotated")) video_apply_shadow_mask_mode(SM_MODE_2X_ROTATED);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) p->mask[0] = 0;
+					else if (!strcasecmp(arg, "1x")) p->mask[0] = SM_MODE_1X;
+					else if (!strcasecmp(arg, "2x")) p->mask[0] = SM_MODE_2X;
+					else if (!strcasecmp(arg, "1x rotated")) p->mask[0] = SM_MODE_1X_ROTATED;
+					else if (!strcasecmp(arg, "2x rotated")) p->mask[0] = SM_MODE_2X_ROTATED;
 				}
 			}
 			else if (!strncasecmp(line, "gamma=", 6))
 			{
-				gamma_dirty = true;
+				p->gamma_dirty = true;
 				arg = get_preset_arg(line + 6);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_gamma_en(0);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) p->gamma[0] = 0;
 					else
 					{
-						video_apply_gamma_curve(arg);
-						video_apply_gamma_en(1);
+						snprintf(p->gamma + 1, sizeof(p->gamma) - 1, "%s", arg);
+						p->gamma[0] = 1;
 					}
 				}
 			}
 		}
 	}
 
+	static char filename[1024];
+	const std::vector<uint16_t> *words;
+
+	if (p->gamma_dirty && has_gamma)
+	{
+		snprintf(filename, sizeof(filename), GAMMA_DIR"/%s", p->gamma + 1);
+		words = table_get(filename, 0, parse_gamma);
+		p->has_gamma_curve = words != NULL;
+		if (words) p->gamma_curve = *words;
+	}
+
+	if (p->mask_dirty)
+	{
+		snprintf(filename, sizeof(filename), SMASK_DIR"/%s", p->mask + 1);
+		p->mask_vres = v_cur.item[5];
+		words = table_get(filename, p->mask_vres, parse_shadow_mask);
+		p->has_mask_table = words != NULL;
+		if (words) p->mask_table = *words;
+	}
+
+	return p;
+}
+
+void video_preset_commit(video_preset_t *p, bool save)
+{
+	PROFILE_FUNCTION();
+
+	if (p->scaler_dirty)
+	{
+		memcpy(scaler_flt, p->flt, sizeof(scaler_flt));
+		memcpy(scaler_flt_data, p->flt_data, sizeof(scaler_flt_data));
+	}
+	if (p->gamma_dirty) memcpy(gamma_cfg, p->gamma, sizeof(gamma_cfg));
+	if (p->mask_dirty) memcpy(shadow_mask_cfg, p->mask, sizeof(shadow_mask_cfg));
+
+	// everything is at hand, the uploads follow each other without any file access
+	if (p->scaler_dirty)
+	{
+		spi_uio_cmd8(UIO_SET_FLTNUM, scaler_flt[0].mode);
+		setScaler();
+	}
+
+	if (p->gamma_dirty && has_gamma && memcmp(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg)))
+	{
+		sendGamma(p->has_gamma_curve ? &p->gamma_curve : NULL);
+		memcpy(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg));
+	}
+
+	if (p->mask_dirty)
+	{
+		// video mode changed since, its section of the mask may be another one
+		if (p->mask_vres != v_cur.item[5]) setShadowMask();
+		else sendShadowMask(p->has_mask_table ? &p->mask_table : NULL);
+	}
+
+	if (p->scaler_dirty || p->gamma_dirty || p->mask_dirty) user_io_send_buttons(1);
+
 	if (save)
 	{
-		if (scaler_dirty) video_save_scaler_cfg();
-		if (mask_dirty) video_save_shadow_mask_cfg();
-		if (gamma_dirty) video_save_gamma_cfg();
+		if (p->scaler_dirty) video_save_scaler_cfg();
+		if (p->mask_dirty) video_save_shadow_mask_cfg();
+		if (p->gamma_dirty) video_save_gamma_cfg();
+	}
+}
+
+void video_preset_free(video_preset_t *p)
+{
+	delete p;
+}
+
+void video_loadPreset(char *name, bool save)
+{
+	video_preset_t *p = video_preset_prepare(name);
+	video_preset_commit(p, save);
+	video_preset_free(p);
+}
+
+// Shadow of the HDMI transmitter registers, main map and packet memory. Only
+// registers which differ from what was written last go over the bus, runs of
+// consecutive ones as a single block transfer.
+#define HDMI_I2C_MAIN   0x39
+#define HDMI_I2C_PACKET 0x38
+#define HDMI_I2C_BLOCK  32
+
+struct hdmi_shadow_t
+{
+	uint8_t val[256];
+	uint8_t known[256];
+};
+
+static hdmi_shadow_t hdmi_shadow_main, hdmi_shadow_packet;
+static bool hdmi_i2c_block = true; // cleared if the bus can't do block writes
+
+static hdmi_shadow_t *hdmi_shadow(int dev)
+{
+	return (dev == HDMI_I2C_PACKET) ? &hdmi_shadow_packet : &hdmi_shadow_main;
+}
+
+static bool hdmi_reg_same(hdmi_shadow_t *sh, int reg, uint8_t val)
+{
+	return sh->known[reg] && sh->val[reg] == val;
+}
+
+static bool hdmi_block_same(int dev, int reg, const uint8_t *data, int len)
+{
+	hdmi_shadow_t *sh = hdmi_shadow(dev);
+	for (int i = 0; i < len; i++) if (!hdmi_reg_same(sh, reg + i, data[i])) return false;
+	return true;
+}
+
+// address, value pairs
+static bool hdmi_list_same(int dev, const uint8_t *list, int size)
+{
+	hdmi_shadow_t *sh = hdmi_shadow(dev);
+	for (int i = 0; i < size; i += 2) if (!hdmi_reg_same(sh, list[i], list[i + 1])) return false;
+	return true;
+}
+
+static void hdmi_reg_set(hdmi_shadow_t *sh, int reg, uint8_t val, bool ok)
+{
+	sh->val[reg] = val;
+	sh->known[reg] = ok;
+}
+
+// Writes len registers from reg, the ones already holding their value are
+// skipped. Short gaps are written along rather than starting a new transfer.
+static void hdmi_block_write(int fd, int dev, int reg, const uint8_t *data, int len)
+{
+	hdmi_shadow_t *sh = hdmi_shadow(dev);
+
+	int i = 0;
+	while (i < len)
+	{
+		if (hdmi_reg_same(sh, reg + i, data[i]))
+		{
+			i++;
+			continue;
+		}
+
+		int end = i + 1;
+		for (int j = end; j < len && j - i < HDMI_I2C_BLOCK; j++)
+		{
+			if (!hdmi_reg_same(sh, reg + j, data[j])) end = j + 1;
+			else if (j + 1 - end > 2) break;
+		}
+
+		int res = -1;
+		if (end - i > 1 && hdmi_i2c_block)
+		{
+			res = i2c_smbus_write_i2c_block_data(fd, reg + i, end - i, data + i);
+			if (res < 0)
+			{
+				printf("i2c: block write error (%02X+%d): %d, using single writes.\n", reg + i, end - i, res);
+				hdmi_i2c_block = false;
+			}
+			else
+			{
+				for (int k = i; k < end; k++) hdmi_reg_set(sh, reg + k, data[k], true);
+			}
+		}
+
+		if (res < 0)
+		{
+			for (int k = i; k < end; k++)
+			{
+				res = i2c_smbus_write_byte_data(fd, reg + k, data[k]);
+				if (res < 0) printf("i2c: write error (%02X %02X): %d\n", reg + k, data[k], res);
+				hdmi_reg_set(sh, reg + k, data[k], res >= 0);
+			}
+		}
+
+		i = end;
+	}
+}
+
+// Writes address, value pairs in their order, pairs of consecutive addresses
+// are written as blocks.
+static void hdmi_list_write(int fd, int dev, const uint8_t *list, int size)
+{
+	uint8_t block[HDMI_I2C_BLOCK];
+
+	int i = 0;
+	while (i < size)
+	{
+		int reg = list[i];
+		int len = 0;
+		while (i < size && len < HDMI_I2C_BLOCK && list[i] == reg + len)
+		{
+			block[len++] = list[i + 1];
+			i += 2;
+		}
+
+		hdmi_block_write(fd, dev, reg, block, len);
 	}
 }
 
 static void hdmi_packet_enable(uint8_t mask, bool enable)
 {
-	int fd = i2c_open(0x39, 0);
+	hdmi_shadow_t *sh = hdmi_shadow(HDMI_I2C_MAIN);
+	if (sh->known[0x40] && ((sh->val[0x40] & mask) == (enable ? mask : 0))) return;
+
+	int fd = i2c_open(HDMI_I2C_MAIN, 0);
 	if (fd >= 0)
 	{
-		uint8_t packet_val = i2c_smbus_read_byte_data(fd, 0x40);
+		uint8_t packet_val = sh->known[0x40] ? sh->val[0x40] : i2c_smbus_read_byte_data(fd, 0x40);
 		if (enable)
 			packet_val |= mask;
 		else
 			packet_val &= ~mask;
-		int res = i2c_smbus_write_byte_data(fd, 0x40, packet_val);
-		if (res < 0) printf("i2c: write error (%02X %02X): %d\n", 0x40, packet_val, res);
+		hdmi_block_write(fd, HDMI_I2C_MAIN, 0x40, &packet_val, 1);
 		i2c_close(fd);
 	}
 }
@@ -1134,7 +1580,13 @@ static void hdmi_packet_set_data(uint8_t mask, uint8_t offset, uint8_t *data, in
 		return;
 	}
 
-	int fd = i2c_open(0x38, 0);
+	if (hdmi_block_same(HDMI_I2C_PACKET, offset, data, size))
+	{
+		hdmi_packet_enable(mask, 1);
+		return;
+	}
+
+	int fd = i2c_open(HDMI_I2C_PACKET, 0);
 	if (fd >= 0)
 	{
 		int res;
@@ -1147,11 +1599,7 @@ static void hdmi_packet_set_data(uint8_t mask, uint8_t offset, uint8_t *data, in
 		}
 		else
 		{
-			for (int i = 0; i < size; i++)
-			{
-				res = i2c_smbus_write_byte_data(fd, offset + i, data[i]);
-				if (res < 0) printf("i2c: SPD register write error (%02X %02x): %d\n", offset + i, data[i], res);
-			}
+			hdmi_block_write(fd, HDMI_I2C_PACKET, offset, data, size);
 
 			res = i2c_smbus_write_byte_data(fd, offset + 0x1F, 0x00);
 			if (res < 0) printf("i2c: Couldn't update packet change register (0x%02X, 0x00) %d\n", offset + 0x1F, res);
@@ -1385,15 +1833,12 @@ static void hdmi_config_set_csc()
 		0xC3, (uint8_t)(clipMax & 0xff)
 	};
 
-	int fd = i2c_open(0x39, 0);
+	if (hdmi_list_same(HDMI_I2C_MAIN, csc_data, sizeof(csc_data))) return;
+
+	int fd = i2c_open(HDMI_I2C_MAIN, 0);
 	if (fd >= 0)
 	{
-		for (uint i = 0; i < sizeof(csc_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, csc_data[i], csc_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", csc_data[i], csc_data[i + 1], res);
-		}
-
+		hdmi_list_write(fd, HDMI_I2C_MAIN, csc_data, sizeof(csc_data));
 		i2c_close(fd);
 	}
 	else
@@ -1543,15 +1988,14 @@ static void hdmi_config_init()
 		0x09, 0x0A,				//
 	};
 
-	int fd = i2c_open(0x39, 0);
+	// the chip is programmed from scratch, nothing is skipped
+	memset(&hdmi_shadow_main, 0, sizeof(hdmi_shadow_main));
+	memset(&hdmi_shadow_packet, 0, sizeof(hdmi_shadow_packet));
+
+	int fd = i2c_open(HDMI_I2C_MAIN, 0);
 	if (fd >= 0)
 	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
+		hdmi_list_write(fd, HDMI_I2C_MAIN, init_data, sizeof(init_data));
 		i2c_close(fd);
 	}
 	else
@@ -1626,10 +2070,6 @@ static void hdmi_config_set_hdr()
 	}
 }
 
-static uint8_t last_sync_invert = 0xff;
-static uint8_t last_pr_flags = 0xff;
-static uint8_t last_vic_mode = 0xff;
-
 static void hdmi_config_set_mode(vmode_custom_t *vm)
 {
 	PROFILE_FUNCTION();
@@ -1645,8 +2085,6 @@ static void hdmi_config_set_mode(vmode_custom_t *vm)
 	if (vm->param.hpol == 0) sync_invert |= 1 << 5;
 	if (vm->param.vpol == 0) sync_invert |= 1 << 6;
 
-	if (last_sync_invert == sync_invert && last_pr_flags == pr_flags && last_vic_mode == vic_mode) return;
-
 	// address, value
 	uint8_t init_data[] = {
 		0x17, (uint8_t)(0b00000010 | sync_invert),		// Aspect ratio 16:9 [1]=1, 4:3 [1]=0
@@ -1654,25 +2092,18 @@ static void hdmi_config_set_mode(vmode_custom_t *vm)
 		0x3C, vic_mode,			// VIC
 	};
 
-	int fd = i2c_open(0x39, 0);
+	if (hdmi_list_same(HDMI_I2C_MAIN, init_data, sizeof(init_data))) return;
+
+	int fd = i2c_open(HDMI_I2C_MAIN, 0);
 	if (fd >= 0)
 	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
+		hdmi_list_write(fd, HDMI_I2C_MAIN, init_data, sizeof(init_data));
 		i2c_close(fd);
 	}
 	else
 	{
 		printf("*** ADV7513 not found on i2c bus! HDMI won't be available!\n");
 	}
-
-	last_pr_flags = pr_flags;
-	last_sync_invert = sync_invert;
-	last_vic_mode = vic_mode;
 }
 
 static void edid_parse_cea_ext(uint8_t *cea)
@@ -1767,6 +2198,75 @@ static int is_edid_valid()
 	return !memcmp(edid, magic, sizeof(magic));
 }
 
+// The last EDID and the preferred mode derived from it are kept in /tmp, so a
+// core load (a new process) neither fetches the EDID again over I2C nor redoes
+// the PLL search. The ADV7513 latches a hot plug in its interrupt register, the
+// EDID is read again after one or if its checksums in the EDID memory differ.
+#define EDID_CACHE_FILE  "/tmp/edid.bin"
+#define EDID_CACHE_MAGIC 0x31444945 // EID1
+
+struct edid_cache_t
+{
+	uint32_t magic;
+	uint8_t edid[256];
+	int vmode;           // get_edid_vmode() result, -1: not derived yet
+	vmode_custom_t v;
+	int support_FHD;
+	int dvi_mode;        // picked for dvi_mode=2, -1: not reached
+};
+
+static edid_cache_t edid_cache = {};
+
+static void edid_cache_save()
+{
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", EDID_CACHE_FILE);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	int ok = write(fd, &edid_cache, sizeof(edid_cache)) == sizeof(edid_cache);
+	close(fd);
+
+	if (ok) rename(tmp, EDID_CACHE_FILE);
+	else unlink(tmp);
+}
+
+static int edid_cache_load()
+{
+	int fd = open(EDID_CACHE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = read(fd, &edid_cache, sizeof(edid_cache)) == sizeof(edid_cache) && edid_cache.magic == EDID_CACHE_MAGIC;
+	close(fd);
+
+	if (!ok) memset(&edid_cache, 0, sizeof(edid_cache));
+	return ok;
+}
+
+// Cached EDID if the monitor is still the same one: no hot plug since it was
+// read and the checksums of both blocks still match.
+static int edid_cache_check(int fd)
+{
+	int irq = i2c_smbus_read_byte_data(fd, 0x96);
+	if (irq < 0 || (irq & 0x80) || !edid_cache_load()) return 0;
+
+	int fd_edid = i2c_open(0x3f, 0);
+	if (fd_edid < 0) return 0;
+
+	int sum0 = i2c_smbus_read_byte_data(fd_edid, 0x7F);
+	int sum1 = i2c_smbus_read_byte_data(fd_edid, 0xFF);
+	i2c_close(fd_edid);
+
+	if (sum0 != edid_cache.edid[0x7F] || sum1 != edid_cache.edid[0xFF]) return 0;
+
+	memcpy(edid, edid_cache.edid, sizeof(edid));
+	if (!is_edid_valid()) return 0;
+
+	printf("EDID: using cached EDID.\n");
+	return 1;
+}
+
 static int get_active_edid()
 {
 	int fd = i2c_open(0x39, 0);
@@ -1784,6 +2284,15 @@ static int get_active_edid()
 		return 0;
 	}
 
+	if (edid_cache_check(fd))
+	{
+		i2c_close(fd);
+		return 1;
+	}
+
+	// clear the latched hot plug, the EDID read now is the one to compare against
+	i2c_smbus_write_byte_data(fd, 0x96, 0x80);
+
 
 	for (int i = 0; i < 10; i++)
 	{
@@ -1815,18 +2324,18 @@ static int get_active_edid()
 		bzero(edid, sizeof(edid));
 		return 0;
 	}
+
+	memset(&edid_cache, 0, sizeof(edid_cache));
+	edid_cache.magic = EDID_CACHE_MAGIC;
+	memcpy(edid_cache.edid, edid, sizeof(edid));
+	edid_cache.vmode = -1;
+	edid_cache.dvi_mode = -1;
+	edid_cache_save();
 	return 1;
 }
 
-static int get_edid_vmode(vmode_custom_t *v)
+static int edid_parse_vmode(vmode_custom_t *v)
 {
-	if (!is_edid_valid())
-	{
-		get_active_edid();
-	}
-
-	if (!is_edid_valid()) return 0;
-
 	int hact, vact, pixclk_khz, hfp, hsync, hbp, vfp, vsync, vbp, hbl, vbl;
 	uint8_t *x = edid + 0x36;
 
@@ -1937,9 +2446,46 @@ static int get_edid_vmode(vmode_custom_t *v)
 		}
 	}
 
-	v->param.rb = 2;
-	setPLL(v->Fpix, v);
-	return 1;
+	v->param.rb = 2;
+	setPLL(v->Fpix, v);
+	return 1;
+}
+
+static int get_edid_vmode(vmode_custom_t *v)
+{
+	if (!is_edid_valid())
+	{
+		get_active_edid();
+	}
+
+	if (!is_edid_valid()) return 0;
+
+	int dvi_auto = (cfg.dvi_mode == 2);
+	if (edid_cache.vmode >= 0 && !memcmp(edid_cache.edid, edid, sizeof(edid)))
+	{
+		if (dvi_auto && edid_cache.dvi_mode >= 0)
+		{
+			cfg.dvi_mode = edid_cache.dvi_mode;
+			if (cfg.dvi_mode == 1) printf("EDID: using DVI mode.\n");
+		}
+		support_FHD |= edid_cache.support_FHD;
+		if (edid_cache.vmode) *v = edid_cache.v;
+		printf("EDID: using cached preferred mode.\n");
+		return edid_cache.vmode;
+	}
+
+	int res = edid_parse_vmode(v);
+	if (!memcmp(edid_cache.edid, edid, sizeof(edid)))
+	{
+		// dvi_mode=2 is resolved on the way once the pixel clock is plausible
+		int pixclk_khz = (edid[0x36] + (edid[0x37] << 8)) * 10;
+		edid_cache.vmode = res;
+		edid_cache.v = *v;
+		edid_cache.support_FHD = support_FHD;
+		edid_cache.dvi_mode = (pixclk_khz < 10000) ? -1 : (edid[0x80] == 2 && edid[0x81] == 3 && (edid[0x83] & 0x40)) ? 0 : 1;
+		edid_cache_save();
+	}
+	return res;
 }
 
 static void set_vrr_mode()
@@ -2271,10 +2817,75 @@ static int parse_custom_video_mode(char* vcfg, vmode_custom_t *v)
 	return -2;
 }
 
+// Resolved video modes, timings and PLL parameters included. Each video_mode
+// string of the INI and each scaled mode video_resolution_adjust() makes for a
+// core resolution is worked out once, afterwards it's a lookup (the INI is
+// read again and the modes resolved on every resolution change of the core).
+// The key is the input in binary: the string with the flags it depends on,
+// or the base mode with the core's size.
+#define VMODE_CATALOG_SIZE 32
+
+struct vmode_catalog_t
+{
+	std::string key;
+	uint32_t used;
+	int ret;
+	vmode_custom_t v;
+};
+
+static vmode_catalog_t vmode_catalog[VMODE_CATALOG_SIZE];
+static uint32_t vmode_catalog_tick = 0;
+
+static const vmode_catalog_t *vmode_catalog_get(const std::string &key)
+{
+	for (auto &e : vmode_catalog)
+	{
+		if (e.used && e.key == key)
+		{
+			e.used = ++vmode_catalog_tick;
+			return &e;
+		}
+	}
+	return NULL;
+}
+
+static void vmode_catalog_put(const std::string &key, int ret, const vmode_custom_t *v)
+{
+	vmode_catalog_t *e = &vmode_catalog[0];
+	for (auto &c : vmode_catalog)
+	{
+		if (!c.used) { e = &c; break; }
+		if (c.used < e->used) e = &c;
+	}
+
+	e->key = key;
+	e->used = ++vmode_catalog_tick;
+	e->ret = ret;
+	e->v = *v;
+}
+
 static int store_custom_video_mode(char* vcfg, vmode_custom_t *v)
 {
+	std::string key = "S";
+	key += (char)('0' + support_FHD * 2 + supports_pr());
+	key += vcfg;
+
+	const vmode_catalog_t *e = vmode_catalog_get(key);
+	if (e)
+	{
+		*v = e->v;
+		return e->ret;
+	}
+
 	int ret = parse_custom_video_mode(vcfg, v);
-	if (ret == -2) return 1;
+	if (ret == -2)
+	{
+		vmode_catalog_put(key, 1, v);
+		return 1;
+	}
+
+	// errors are reported on each parse
+	bool cache = ret != -1 || !vcfg[0];
 
 	uint mode = (ret >= 0) ? ret : (support_FHD) ? 8 : 0;
 	if (mode >= VMODES_NUM) mode = 0;
@@ -2285,6 +2896,7 @@ static int store_custom_video_mode(char* vcfg, vmode_custom_t *v)
 	v->param.rb = 1;
 	setPLL(vmodes[mode].Fpix, v);
 
+	if (cache) vmode_catalog_put(key, ret >= 0, v);
 	return ret >= 0;
 }
 
@@ -2558,6 +3170,7 @@ void video_init()
 	yc_parse(yc_modes, sizeof(yc_modes) / sizeof(yc_modes[0]));
 
 	fb_init();
+	initPLL();
 	hdmi_config_init();
 	hdmi_config_set_hdr();
 	video_mode_load();
@@ -2714,15 +3327,8 @@ static void show_video_info(const VideoInfo *vi, const vmode_custom_t *vm)
 	}
 }
 
-static void video_resolution_adjust(const VideoInfo *vi, vmode_custom_t *vm)
+static void video_resolution_scale(vmode_custom_t *vm, int w, int h, uint32_t core_width, uint32_t core_height, int arx, int ary)
 {
-	if (cfg.vscale_mode < 4) return;
-
-	int w = vm->param.pr ? vm->param.hact * 2 : vm->param.hact;
-	int h = vm->param.vact;
-	const uint32_t core_height = vi->fb_en ? vi->fb_height : vi->rotated ? vi->width : vi->height;
-	const uint32_t core_width = vi->fb_en ? vi->fb_width : vi->rotated ? vi->height : vi->width;
-
 	if (w == 0 || h == 0 || core_height == 0 || core_width == 0)
 	{
 		printf("video_resolution_adjust: invalid core or display sizes. Not adjusting resolution.\n");
@@ -2736,8 +3342,6 @@ static void video_resolution_adjust(const VideoInfo *vi, vmode_custom_t *vm)
 		return;
 	}
 
-	int ary = vi->ary;
-	int arx = vi->arx;
 	if (!ary || !arx)
 	{
 		ary = h;
@@ -2783,6 +3387,32 @@ static void video_resolution_adjust(const VideoInfo *vi, vmode_custom_t *vm)
 	setPLL(vm->Fpix, vm);
 }
 
+static void video_resolution_adjust(const VideoInfo *vi, vmode_custom_t *vm)
+{
+	if (cfg.vscale_mode < 4) return;
+
+	int w = vm->param.pr ? vm->param.hact * 2 : vm->param.hact;
+	int h = vm->param.vact;
+	const uint32_t core_height = vi->fb_en ? vi->fb_height : vi->rotated ? vi->width : vi->height;
+	const uint32_t core_width = vi->fb_en ? vi->fb_width : vi->rotated ? vi->height : vi->width;
+
+	const uint32_t dims[] = { core_width, core_height, vi->arx, vi->ary, (uint32_t)cfg.vscale_mode };
+	std::string key = "A";
+	key.append((const char *)vm, sizeof(vmode_custom_t));
+	key.append((const char *)dims, sizeof(dims));
+
+	const vmode_catalog_t *e = vmode_catalog_get(key);
+	if (e)
+	{
+		printf("video_resolution_adjust: %dx%d (cached).\n", e->v.param.pr ? e->v.param.hact * 2 : e->v.param.hact, e->v.param.vact);
+		*vm = e->v;
+		return;
+	}
+
+	video_resolution_scale(vm, w, h, core_width, core_height, vi->arx, vi->ary);
+	vmode_catalog_put(key, 0, vm);
+}
+
 static void video_scaling_adjust(const VideoInfo *vi, const vmode_custom_t *vm)
 {
 	if (cfg.vscale_mode >= 4)
@@ -3019,13 +3649,133 @@ static void spd_config_update()
 	}
 }
 
+// Re-timing of the output (vsync_adjust, vscale_mode 4/5, VRR). A new core
+// resolution re-times right away. When only the frame time changed it's
+// measured again on each pass and the output is re-timed only once the last
+// VTIME_CONFIDENT measurements agree, and only if that frame time is more than
+// VTIME_HYSTERESIS away from the one the output runs at. Cores wobbling
+// around their rate don't make the display resync over and over this way.
+// If the measurements don't settle the median of the full history is used.
+#define VTIME_HISTORY        8
+#define VTIME_CONFIDENT      3
+#define VTIME_TOLERANCE_PPM  300
+#define VTIME_HYSTERESIS_PPM 1000
+
+enum
+{
+	VTIME_KEEP = 0,
+	VTIME_WAIT,
+	VTIME_RETIME
+};
+
+struct vtime_engine_t
+{
+	uint32_t hist[VTIME_HISTORY];
+	uint32_t count;
+	uint32_t timed;   // frame time the output was timed for
+	VideoInfo geo;    // and the rest of the video info then
+	bool settling;
+	uint32_t retimes;
+	uint32_t skipped;
+};
+
+static vtime_engine_t vtime_eng = {};
+
+static bool vtime_same_geometry(const VideoInfo *a, const VideoInfo *b)
+{
+	return a->width == b->width && a->height == b->height && a->interlaced == b->interlaced && a->rotated == b->rotated &&
+		a->pixrep == b->pixrep && a->de_h == b->de_h && a->de_v == b->de_v && a->arx == b->arx && a->ary == b->ary &&
+		a->fb_en == b->fb_en && a->fb_width == b->fb_width && a->fb_height == b->fb_height;
+}
+
+static uint32_t vtime_ppm(uint32_t a, uint32_t b)
+{
+	if (!b) return UINT32_MAX;
+	uint64_t d = (a > b) ? a - b : b - a;
+	return (uint32_t)(d * 1000000 / b);
+}
+
+static int vtime_update(const VideoInfo *vi, bool changed)
+{
+	if (changed && (!vtime_eng.timed || !vtime_same_geometry(vi, &vtime_eng.geo) || cfg_has_video_sections()))
+	{
+		// new mode (or INI sections depending on the rate): as measured
+		vtime_eng.settling = false;
+		vtime_eng.timed = vi->vtime;
+		vtime_eng.geo = *vi;
+		vtime_eng.retimes++;
+		return VTIME_RETIME;
+	}
+
+	if (changed && !vtime_eng.settling)
+	{
+		vtime_eng.settling = true;
+		vtime_eng.count = 0;
+	}
+
+	vtime_eng.hist[vtime_eng.count % VTIME_HISTORY] = vi->vtime;
+	vtime_eng.count++;
+	if (vtime_eng.count < VTIME_CONFIDENT) return VTIME_WAIT;
+
+	uint64_t sum = 0;
+	for (int i = 1; i <= VTIME_CONFIDENT; i++) sum += vtime_eng.hist[(vtime_eng.count - i) % VTIME_HISTORY];
+	uint32_t est = (uint32_t)(sum / VTIME_CONFIDENT);
+
+	bool confident = true;
+	for (int i = 1; i <= VTIME_CONFIDENT; i++)
+	{
+		if (vtime_ppm(vtime_eng.hist[(vtime_eng.count - i) % VTIME_HISTORY], est) > VTIME_TOLERANCE_PPM) confident = false;
+	}
+
+	if (!confident)
+	{
+		if (vtime_eng.count < VTIME_HISTORY) return VTIME_WAIT;
+
+		uint32_t sorted[VTIME_HISTORY];
+		memcpy(sorted, vtime_eng.hist, sizeof(sorted));
+		std::sort(sorted, sorted + VTIME_HISTORY);
+		est = sorted[VTIME_HISTORY / 2];
+		printf("vtime: no stable frame time, using median %u.\n", est);
+	}
+
+	vtime_eng.settling = false;
+	vtime_eng.geo = *vi;
+
+	// without vsync_adjust the frame time doesn't go into the mode at all
+	if (!cfg.vsync_adjust || vtime_ppm(est, vtime_eng.timed) < VTIME_HYSTERESIS_PPM)
+	{
+		printf("vtime: frame time %u close to %u, keeping the mode.\n", est, vtime_eng.timed);
+		vtime_eng.skipped++;
+		return VTIME_KEEP;
+	}
+
+	printf("vtime: frame time settled at %u (was %u), re-timing.\n", est, vtime_eng.timed);
+	vtime_eng.timed = est;
+	vtime_eng.retimes++;
+	return VTIME_RETIME;
+}
+
+void video_timing_description(char *str, size_t len)
+{
+	if (is_menu() || !(cfg.vsync_adjust || cfg.vscale_mode >= 4) || !vtime_eng.timed)
+	{
+		*str = 0;
+		return;
+	}
+
+	float hz = 100000000.f / vtime_eng.timed;
+	if (vtime_eng.settling) snprintf(str, len, "Sync %.2fHz, measuring %u", hz, vtime_eng.count);
+	else snprintf(str, len, "Sync %.2fHz, %u set %u kept", hz, vtime_eng.retimes, vtime_eng.skipped);
+}
+
 void video_mode_adjust()
 {
 	static bool force = false;
 
 	VideoInfo video_info;
 
-	const bool vid_changed = get_video_info(force, &video_info);
+	// the frame time is read on each pass while it settles
+	const bool vid_changed = get_video_info(force || vtime_eng.settling, &video_info);
 
 	if (vid_changed || force)
 	{
@@ -3041,18 +3791,22 @@ void video_mode_adjust()
 	if(menu != menu_now) spd_config_update();
 	menu = menu_now;
 
-	if (vid_changed && !is_menu())
+	if ((vid_changed || vtime_eng.settling) && !is_menu())
 	{
-		if (cfg_has_video_sections())
+		if (vid_changed && cfg_has_video_sections())
 		{
 			cfg_parse();
 			video_mode_load();
 			user_io_send_buttons(1);
 		}
 
-		if ((cfg.vsync_adjust || cfg.vscale_mode >= 4))
+		int timing = VTIME_KEEP;
+		if (cfg.vsync_adjust || cfg.vscale_mode >= 4) timing = vtime_update(&video_info, vid_changed);
+		else vtime_eng.settling = false;
+		if (timing == VTIME_RETIME)
 		{
-			const uint32_t vtime = video_info.vtime;
+			const uint32_t vtime = vtime_eng.timed;
+			current_video_info = video_info;
 
 			printf("\033[1;33madjust_video_mode(%u): vsync_adjust=%d vscale_mode=%d.\033[0m\n", vtime, cfg.vsync_adjust, cfg.vscale_mode);
 
@@ -3091,7 +3845,7 @@ void video_mode_adjust()
 			user_io_send_buttons(1);
 			force = true;
 		}
-		else if (cfg_has_video_sections()) // if we have video sections but aren't updating the resolution for other reasons, then do it here
+		else if (vid_changed && cfg_has_video_sections() && !(cfg.vsync_adjust || cfg.vscale_mode >= 4)) // if we have video sections but aren't updating the resolution for other reasons, then do it here
 		{
 			video_set_mode(&v_def, 0);
 			user_io_send_buttons(1);
@@ -3099,10 +3853,10 @@ void video_mode_adjust()
 		}
 		else
 		{
-			set_vfilter(1); // force update filters in case interlacing changed
+			set_vfilter(vid_changed); // force update filters in case interlacing changed
 		}
 
-		video_scaling_adjust(&video_info, &v_cur);
+		if (vid_changed || timing == VTIME_RETIME) video_scaling_adjust(&video_info, &v_cur);
 	}
 	else
 	{
@@ -3112,16 +3866,26 @@ void video_mode_adjust()
 
 static void fb_write_module_params()
 {
+	// offload workers may run jobs concurrently, only the latest request is written.
+	static std::atomic<uint32_t> seq(0);
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 	int width = fb_width;
 	int height = fb_height;
+	uint32_t id = ++seq;
 	offload_add_work([=]
 	{
-		FILE *fp = fopen("/sys/module/MiSTer_fb/parameters/mode", "wt");
-		if (fp)
+		pthread_mutex_lock(&lock);
+		if (id == seq)
 		{
-			fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
-			fclose(fp);
+			FILE *fp = fopen("/sys/module/MiSTer_fb/parameters/mode", "wt");
+			if (fp)
+			{
+				fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
+				fclose(fp);
+			}
 		}
+		pthread_mutex_unlock(&lock);
 	});
 }
 
@@ -3215,7 +3979,11 @@ static void video_fb_config()
 
 	if (fb_scale <= 1)
 	{
-		if (((v_cur.item[1] * v_cur.item[5]) > FB_SIZE))
+		// Automatic size is halved over a running core above 720p: the scaler
+		// reads the whole frame buffer from DDR every frame, competing with the
+		// core for the bandwidth. The hardware scaler brings it to full size.
+		if (((v_cur.item[1] * v_cur.item[5]) > FB_SIZE) ||
+			(!cfg.fb_size && !is_menu() && (v_cur.item[1] * v_cur.item[5]) > FB_AUTO_FULL))
 			fb_scale = 2;
 		else
 			fb_scale = 1;
@@ -3237,30 +4005,63 @@ static void video_fb_config()
 	fb_write_module_params();
 }
 
+// Cached line the patterns are built in before they're copied out.
+static uint32_t *draw_line(int n)
+{
+	static uint32_t *line = 0;
+	static int line_size = 0;
+	if (n > line_size)
+	{
+		free(line);
+		line = (uint32_t*)malloc(n * 4 + n);
+		line_size = line ? n : 0;
+	}
+	return line;
+}
+
+static uint32_t *draw_row(int y)
+{
+	return (uint32_t*)fb_base + (FB_SIZE*menu_bgn) + y * fb_width + brd_x;
+}
+
+static uint32_t draw_mask(int base_color)
+{
+	uint32_t mask = 0;
+	if (base_color & 4) mask |= 0x0000FF;
+	if (base_color & 2) mask |= 0x00FF00;
+	if (base_color & 1) mask |= 0xFF0000;
+	return mask;
+}
+
 static void draw_checkers()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	int width = fb_width - 2 * brd_x;
+	uint32_t *line = draw_line(width * 2);
+	if (!line) return;
 
 	uint32_t col1 = 0x888888;
 	uint32_t col2 = 0x666666;
 	int sz = fb_width / 128;
 
+	// both kinds of rows
+	for (int x = brd_x; x < fb_width - brd_x; x++)
+	{
+		int c2 = (x / sz) & 1;
+		line[x - brd_x] = c2 ? col2 : col1;
+		line[width + x - brd_x] = c2 ? col1 : col2;
+	}
+
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
 		int c1 = (y / sz) & 1;
-		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int c2 = c1 ^ ((x / sz) & 1);
-			buf[pos + x] = c2 ? col2 : col1;
-		}
+		fbp_copy(draw_row(y), line + (c1 ? width : 0), width);
 	}
 }
 
 static void draw_hbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
 	int height = fb_height - 2 * brd_y;
+	int width = fb_width - 2 * brd_x;
 
 	int old_base = 0;
 	int gray = 255;
@@ -3269,7 +4070,6 @@ static void draw_hbars1()
 
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
-		int pos = y * fb_width;
 		int base_color = ((7 * (y-brd_y)) / height) + 1;
 		if (old_base != base_color)
 		{
@@ -3279,14 +4079,7 @@ static void draw_hbars1()
 
 		gray = 255 * stp / sz;
 
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
-		}
+		fbp_fill(draw_row(y), width, (gray * 0x010101) & draw_mask(base_color));
 
 		stp--;
 		if (stp < 0) stp = 0;
@@ -3295,102 +4088,102 @@ static void draw_hbars1()
 
 static void draw_hbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
+	uint32_t *line = draw_line(width * 2);
+	if (!line) return;
+
+	// gray ramp and the inverted one
+	uint8_t *ramp = (uint8_t*)(line + width);
+	for (int x = 0; x < width; x++)
+	{
+		ramp[x] = (256 * x) / width;
+		ramp[width + x] = 255 - ramp[x];
+	}
 
+	int old_band = -1;
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
-		int pos = y * fb_width;
-		int base_color = ((14 * (y - brd_y)) / height);
-		int inv = base_color & 1;
-		base_color >>= 1;
-		base_color = (inv ? base_color : 6 - base_color) + 1;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int band = ((14 * (y - brd_y)) / height);
+		if (band != old_band)
 		{
-			int gray = (256 * (x - brd_x)) / width;
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+			int inv = band & 1;
+			int base_color = (inv ? (band >> 1) : 6 - (band >> 1)) + 1;
+			fbp_gray(line, ramp + (inv ? width : 0), width, draw_mask(base_color));
+			old_band = band;
 		}
+
+		fbp_copy(draw_row(y), line, width);
 	}
 }
 
 static void draw_vbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
 	int width = fb_width - 2 * brd_x;
+	uint32_t *line = draw_line(width);
+	if (!line) return;
 
 	int sz = width / 7;
 	int stp = 0;
+	int old_base = 0;
+	int gray = 255;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	// all rows are the same
+	for (int x = brd_x; x < fb_width - brd_x; x++)
 	{
-		int pos = y * fb_width;
-		int old_base = 0;
-		int gray = 255;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int base_color = ((7 * (x - brd_x)) / width) + 1;
+		if (old_base != base_color)
 		{
-			int base_color = ((7 * (x - brd_x)) / width) + 1;
-			if (old_base != base_color)
-			{
-				stp = sz;
-				old_base = base_color;
-			}
-
-			gray = 255 * stp / sz;
+			stp = sz;
+			old_base = base_color;
+		}
 
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+		gray = 255 * stp / sz;
+		line[x - brd_x] = (gray * 0x010101) & draw_mask(base_color);
 
-			stp--;
-			if (stp < 0) stp = 0;
-		}
+		stp--;
+		if (stp < 0) stp = 0;
 	}
+
+	for (int y = brd_y; y < fb_height - brd_y; y++) fbp_copy(draw_row(y), line, width);
 }
 
 static void draw_vbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
-		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int gray = ((256 * (y - brd_y)) / height);
-			int base_color = ((14 * (x - brd_x)) / width);
-			int inv = base_color & 1;
-			base_color >>= 1;
-			base_color = (inv ? base_color : 6 - base_color) + 1;
+		uint32_t *row = draw_row(y);
+		int gray = ((256 * (y - brd_y)) / height);
 
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+		// 14 bands of a single color each
+		int x = 0;
+		while (x < width)
+		{
+			int band = (14 * x) / width;
+			int end = x + 1;
+			while (end < width && (14 * end) / width == band) end++;
+
+			int inv = band & 1;
+			int base_color = (inv ? (band >> 1) : 6 - (band >> 1)) + 1;
+			uint32_t g = inv ? 255 - gray : gray;
+			fbp_fill(row + x, end - x, (g * 0x010101) & draw_mask(base_color));
+			x = end;
 		}
 	}
 }
 
 static void draw_spectrum()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
+	uint32_t *line = draw_line(width);
+	if (!line) return;
 
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
-		int pos = y * fb_width;
 		int blue = ((256 * (y - brd_y)) / height);
 		for (int x = brd_x; x < fb_width - brd_x; x++)
 		{
@@ -3399,20 +4192,16 @@ static void draw_spectrum()
 			if (red < 0) red = 0;
 			if (green < 0) green = 0;
 
-			buf[pos + x] = (red << 16) | (green << 8) | blue;
+			line[x - brd_x] = (red << 16) | (green << 8) | blue;
 		}
+
+		fbp_copy(draw_row(y), line, width);
 	}
 }
 
 static void draw_black()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
-
-	for (int y = 0; y < fb_height; y++)
-	{
-		int pos = y * fb_width;
-		for (int x = 0; x < fb_width; x++) buf[pos++] = 0;
-	}
+	fbp_fill((uint32_t*)fb_base + (FB_SIZE*menu_bgn), fb_width * fb_height, 0);
 }
 
 static uint64_t getus()
@@ -3475,7 +4264,7 @@ static char *get_file_fromdir(const char* dir, int num, int *count)
 	return name;
 }
 
-static Imlib_Image load_bg()
+static const char *pick_bg()
 {
 	const char* fname = "menu.png";
 	if (!FileExists(fname))
@@ -3514,8 +4303,38 @@ static Imlib_Image load_bg()
 		}
 	}
 
+	return fname;
+}
+
+// Pixels of an image kept for the menu, they stay until the process ends
+static void image_account(Imlib_Image img)
+{
+	if (!img) return;
+	imlib_context_set_image(img);
+	mem_account(MEM_IMAGE, (int64_t)imlib_image_get_width() * imlib_image_get_height() * 4);
+}
+
+static Imlib_Image load_bg(const char *fname)
+{
 	if (fname)
 	{
+		// PNG comes reduced to less than twice the screen size
+		int w, h, alpha;
+		uint32_t *pixels = image_reduce_load(getFullPath(fname), fb_width - 2 * brd_x, fb_height - 2 * brd_y, 0, &w, &h, &alpha);
+		if (pixels)
+		{
+			Imlib_Image img = imlib_create_image_using_copied_data(w, h, (DATA32*)pixels);
+			free(pixels);
+			if (img)
+			{
+				Imlib_Image cur = imlib_context_get_image();
+				imlib_context_set_image(img);
+				imlib_image_set_has_alpha(alpha);
+				imlib_context_set_image(cur);
+				return img;
+			}
+		}
+
 		Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
 		Imlib_Image img = imlib_load_image_with_error_return(getFullPath(fname), &error);
 		if (img) return img;
@@ -3525,9 +4344,90 @@ static Imlib_Image load_bg()
 	return NULL;
 }
 
+// Decoded and scaled pictures are kept in /tmp (RAM) as raw ARGB, so going back
+// to the menu (a new process) or redrawing the background is a plain read.
+#define BG_CACHE_FILE   "/tmp/menu_bg.raw"
+#define LOGO_CACHE_FILE "/tmp/menu_logo.raw"
+#define BG_CACHE_MAGIC  0x31434742 // BGC1
+
+struct bg_cache_hdr
+{
+	uint32_t magic;
+	uint32_t width, height; // 0 in a lookup key: any size
+	int32_t  brd_x, brd_y;
+	uint32_t rotate;
+	int64_t  mtime;
+	int64_t  size;
+	char     name[256];
+};
+
+static void bg_cache_key(bg_cache_hdr *key, const char *name, int64_t mtime, int64_t size)
+{
+	memset(key, 0, sizeof(*key));
+	key->magic = BG_CACHE_MAGIC;
+	key->mtime = mtime;
+	key->size = size;
+	snprintf(key->name, sizeof(key->name), "%s", name);
+}
+
+// dst NULL: malloc'ed, header of the cached picture in hdr
+static uint32_t *bg_cache_read(const char *path, const bg_cache_hdr *key, bg_cache_hdr *hdr, uint32_t *dst)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	uint32_t *res = NULL;
+	if (read(fd, hdr, sizeof(*hdr)) == sizeof(*hdr) && hdr->magic == key->magic &&
+		(!key->width || (hdr->width == key->width && hdr->height == key->height)) &&
+		hdr->brd_x == key->brd_x && hdr->brd_y == key->brd_y && hdr->rotate == key->rotate &&
+		hdr->mtime == key->mtime && hdr->size == key->size && !strcmp(hdr->name, key->name) &&
+		hdr->width <= 4096 && hdr->height <= 4096)
+	{
+		size_t len = hdr->width * hdr->height * 4;
+		res = dst ? dst : (uint32_t*)malloc(len);
+		if (res && (size_t)read(fd, res, len) != len)
+		{
+			if (!dst) free(res);
+			res = NULL;
+		}
+	}
+
+	close(fd);
+	return res;
+}
+
+static void bg_cache_write(const char *path, bg_cache_hdr *hdr, const uint32_t *data)
+{
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	size_t len = hdr->width * hdr->height * 4;
+	int ok = write(fd, hdr, sizeof(*hdr)) == sizeof(*hdr) && (size_t)write(fd, data, len) == len;
+	close(fd);
+
+	if (ok) rename(tmp, path);
+	else unlink(tmp);
+}
+
+// Imlib2 keeps its context in globals
+static pthread_mutex_t imlib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void video_imlib_lock()
+{
+	pthread_mutex_lock(&imlib_lock);
+}
+
+void video_imlib_unlock()
+{
+	pthread_mutex_unlock(&imlib_lock);
+}
+
 static int bg_has_picture = 0;
 extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
-void video_menu_bg(int n, int idle)
+static void menu_bg_draw(int n, int idle)
 {
 	bg_has_picture = 0;
 	menu_bg = n;
@@ -3538,6 +4438,25 @@ void video_menu_bg(int n, int idle)
 
 		Imlib_Load_Error error;
 		static Imlib_Image logo = 0;
+		if (!logo)
+		{
+			bg_cache_hdr key, hdr;
+			bg_cache_key(&key, "logo.png", 0, _binary_logo_png_end - _binary_logo_png_start);
+			key.rotate = cfg.osd_rotate;
+
+			uint32_t *data = bg_cache_read(LOGO_CACHE_FILE, &key, &hdr, NULL);
+			if (data)
+			{
+				logo = imlib_create_image_using_copied_data(hdr.width, hdr.height, data);
+				free(data);
+				if (logo)
+				{
+					imlib_context_set_image(logo);
+					imlib_image_set_has_alpha(1);
+				}
+			}
+		}
+
 		if (!logo)
 		{
 			unlink("/tmp/logo.png");
@@ -3558,11 +4477,23 @@ void video_menu_bg(int n, int idle)
 					vs_wait();
 				};
 
-				if (cfg.osd_rotate)
+				if (cfg.osd_rotate && logo)
 				{
 					imlib_context_set_image(logo);
 					imlib_image_orientate(cfg.osd_rotate == 1 ? 3 : 1);
 				}
+
+				if (logo)
+				{
+					bg_cache_hdr hdr;
+					bg_cache_key(&hdr, "logo.png", 0, _binary_logo_png_end - _binary_logo_png_start);
+					hdr.rotate = cfg.osd_rotate;
+
+					imlib_context_set_image(logo);
+					hdr.width = imlib_image_get_width();
+					hdr.height = imlib_image_get_height();
+					bg_cache_write(LOGO_CACHE_FILE, &hdr, imlib_image_get_data_for_reading_only());
+				}
 			}
 			else
 			{
@@ -3572,9 +4503,18 @@ void video_menu_bg(int n, int idle)
 			printf("Logo = %p\n", logo);
 		}
 
+		static int logo_accounted = 0;
+		if (logo && !logo_accounted)
+		{
+			image_account(logo);
+			logo_accounted = 1;
+		}
+
 		menu_bgn = (menu_bgn == 1) ? 2 : 1;
 
 		static Imlib_Image menubg = 0;
+		static const char *bg_name = 0;
+		static int bg_picked = 0;
 		static Imlib_Image bg1 = 0, bg2 = 0;
 		if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
 		if (!bg1) printf("Warning: bg1 is 0\n");
@@ -3584,21 +4524,6 @@ void video_menu_bg(int n, int idle)
 		Imlib_Image *bg = (menu_bgn == 1) ? &bg1 : &bg2;
 		//printf("*bg = %p\n", *bg);
 
-		static Imlib_Image curtain = 0;
-		if (!curtain)
-		{
-			curtain = imlib_create_image(fb_width, fb_height);
-			imlib_context_set_image(curtain);
-			imlib_image_set_has_alpha(1);
-
-			uint32_t *data = imlib_image_get_data();
-			int sz = fb_width * fb_height;
-			for (int i = 0; i < sz; i++)
-			{
-				*data++ = 0x9F000000;
-			}
-		}
-
 		draw_black();
 
 		if (idle < 3)
@@ -3606,16 +4531,44 @@ void video_menu_bg(int n, int idle)
 			switch (n)
 			{
 			case 1:
-				if (!menubg) menubg = load_bg();
-				if (menubg)
+				if (!bg_picked)
+				{
+					bg_name = pick_bg();
+					if (bg_name) bg_name = strdup(bg_name);
+					bg_picked = 1;
+				}
+
+				if (bg_name && *bg)
 				{
-					imlib_context_set_image(menubg);
-					int src_w = imlib_image_get_width();
-					int src_h = imlib_image_get_height();
-					//printf("menubg: src_w=%d, src_h=%d\n", src_w, src_h);
+					struct stat64 st;
+					bg_cache_hdr key, hdr;
+					if (stat64(getFullPath(bg_name), &st)) st.st_mtime = st.st_size = 0;
+					bg_cache_key(&key, bg_name, st.st_mtime, st.st_size);
+					key.width = fb_width;
+					key.height = fb_height;
+					key.brd_x = brd_x;
+					key.brd_y = brd_y;
+
+					if (bg_cache_read(BG_CACHE_FILE, &key, &hdr, (uint32_t*)(fb_base + (FB_SIZE * menu_bgn))))
+					{
+						bg_has_picture = 1;
+						break;
+					}
+
+					// a partly read picture may have covered the borders
+					draw_black();
 
-					if (*bg)
+					if (!menubg)
+					{
+						menubg = load_bg(bg_name);
+						image_account(menubg);
+					}
+					if (menubg)
 					{
+						imlib_context_set_image(menubg);
+						int src_w = imlib_image_get_width();
+						int src_h = imlib_image_get_height();
+
 						imlib_context_set_image(*bg);
 						imlib_blend_image_onto_image(menubg, 0,
 							0, 0,                           //int source_x, int source_y,
@@ -3624,12 +4577,14 @@ void video_menu_bg(int n, int idle)
 							fb_width - (brd_x * 2), fb_height - (brd_y * 2) //int destination_width, int destination_height
 						);
 						bg_has_picture = 1;
+
+						bg_cache_write(BG_CACHE_FILE, &key, (uint32_t*)(fb_base + (FB_SIZE * menu_bgn)));
 						break;
 					}
-					else
-					{
-						printf("*bg = 0!\n");
-					}
+				}
+				else if (!*bg)
+				{
+					printf("*bg = 0!\n");
 				}
 				draw_checkers();
 				break;
@@ -3709,22 +4664,10 @@ void video_menu_bg(int n, int idle)
 			}
 		}
 
-		if (curtain)
-		{
-			if (idle > 1 && *bg)
-			{
-				imlib_context_set_image(*bg);
-				imlib_blend_image_onto_image(curtain, 1,
-					0, 0,                //int source_x, int source_y,
-					fb_width, fb_height, //int source_width, int source_height,
-					0, 0,                //int destination_x, int destination_y,
-					fb_width, fb_height  //int destination_width, int destination_height
-				);
-			}
-		}
-		else
+		// dimmed when idle
+		if (idle > 1 && *bg)
 		{
-			printf("curtain = 0!\n");
+			fbp_blend_color((uint32_t*)fb_base + (FB_SIZE * menu_bgn), fb_width * fb_height, 0x9F000000);
 		}
 
 		//test the fb driver
@@ -3735,6 +4678,16 @@ void video_menu_bg(int n, int idle)
 	video_fb_enable(0);
 }
 
+void video_menu_bg(int n, int idle)
+{
+	video_imlib_lock();
+	menu_bg_draw(n, idle);
+	video_imlib_unlock();
+
+	// wallpaper decoding is long, let the poll loop catch up (never with imlib locked)
+	scheduler_checkpoint();
+}
+
 int video_bg_has_picture()
 {
 	return bg_has_picture;
@@ -4051,6 +5004,22 @@ static void video_calculate_cvt(int h_pixels, int v_lines, float refresh_rate, i
 
 
 
+int video_get_frame_ms()
+{
+	// vtime is in 100MHz clocks
+	return (current_video_info.vtime + 50000) / 100000;
+}
+
+int video_get_frame_us()
+{
+	return (current_video_info.vtime + 50) / 100;
+}
+
+const VideoInfo *video_get_info()
+{
+	return &current_video_info;
+}
+
 int video_get_rotated()
 {
   return current_video_info.rotated;
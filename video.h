@@ -50,7 +50,20 @@ char* video_get_shadow_mask(int only_name = 1);
 void  video_set_shadow_mask(const char *name);
 void  video_loadPreset(char *name, bool save);
 
+// A preset read with all its filters and tables parsed, so committing it is
+// only the uploads to the core back to back, without the in between states
+// of applying the settings one by one. Main thread only. A prepared preset
+// holds the complete resulting settings, the ones changed after preparing
+// it are overridden by the commit.
+struct video_preset_t;
+video_preset_t *video_preset_prepare(const char *name);
+void  video_preset_commit(video_preset_t *p, bool save);
+void  video_preset_free(video_preset_t *p);
+
 int   video_get_rotated();
+int   video_get_frame_ms(); // core frame time rounded, 0 if unknown
+int   video_get_frame_us(); // core frame time, 0 if unknown
+const VideoInfo *video_get_info(); // last mode read from the core
 
 void video_cfg_reset();
 
@@ -61,12 +74,17 @@ int   hasAPI1_5();
 void video_fb_enable(int enable, int n = 0);
 int video_fb_state();
 void video_menu_bg(int n, int idle = 0);
+
+// Hold around Imlib2 use outside of the main thread (e.g. offloaded decoding)
+void video_imlib_lock();
+void video_imlib_unlock();
 int video_bg_has_picture();
 int video_chvt(int num);
 void video_cmd(char *cmd);
 
 void video_core_description(char *str, size_t len);
 void video_scaler_description(char *str, size_t len);
+void video_timing_description(char *str, size_t len); // output re-timing state, empty if not re-timed
 char* video_get_core_mode_name(int with_vrefresh = 1);
 
 #endif // VIDEO_H
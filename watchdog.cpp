@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "watchdog.h"
+#include "scheduler.h"
+#include "profiling.h"
+#include "cfg.h"
+
+#define WATCHDOG_IO 64 // logged operations, power of 2
+
+struct wd_io_t
+{
+	const char *op;
+	char name[48];
+	int64_t pos;
+	uint32_t len;
+	int tid;
+	uint64_t begin_us;
+	uint64_t end_us;     // 0 while in progress
+};
+
+static wd_io_t io_log[WATCHDOG_IO];
+static uint32_t io_head = 0;
+static int enabled = 0;
+static uint64_t beat_us = 0;
+
+void watchdog_beat()
+{
+	__atomic_store_n(&beat_us, trace_now_us(), __ATOMIC_RELAXED);
+}
+
+uint32_t watchdog_io_begin(const char *op, const char *name, int64_t pos, uint32_t len)
+{
+	if (!enabled) return UINT32_MAX;
+
+	static __thread int tid = 0;
+	if (!tid) tid = (int)syscall(SYS_gettid);
+
+	uint32_t slot = __atomic_fetch_add(&io_head, 1, __ATOMIC_RELAXED);
+	wd_io_t *io = &io_log[slot % WATCHDOG_IO];
+	io->end_us = 0;
+	io->op = op;
+	strncpy(io->name, name ? name : "", sizeof(io->name) - 1);
+	io->name[sizeof(io->name) - 1] = 0;
+	io->pos = pos;
+	io->len = len;
+	io->tid = tid;
+	__atomic_store_n(&io->begin_us, trace_now_us(), __ATOMIC_RELEASE);
+	return slot;
+}
+
+void watchdog_io_end(uint32_t slot)
+{
+	if (slot == UINT32_MAX) return;
+
+	wd_io_t *io = &io_log[slot % WATCHDOG_IO];
+	__atomic_store_n(&io->end_us, trace_now_us(), __ATOMIC_RELEASE);
+}
+
+// Snapshot while main may still be stuck, entries being rewritten can come out mixed
+static void watchdog_record(uint64_t now, uint64_t stalled_us)
+{
+	FILE *f = fopen(WATCHDOG_FILE, "w");
+	if (!f) return;
+
+	uint64_t since_us = 0;
+	const char *task = scheduler_current_task(&since_us);
+	fprintf(f, "Poll task didn't run for %llu ms (limit %u ms).\n", (unsigned long long)(stalled_us / 1000), cfg.stall_watchdog);
+	if (task) fprintf(f, "Running task: %s, slice started %llu ms ago.\n", task, (unsigned long long)((now - since_us) / 1000));
+	else fprintf(f, "Running task: none (scheduler).\n");
+
+	fprintf(f, "\nLast file I/O, oldest first (age ms, thread, op, file, position, length, duration us):\n");
+	uint32_t head = __atomic_load_n(&io_head, __ATOMIC_ACQUIRE);
+	for (uint32_t i = (head > WATCHDOG_IO) ? head - WATCHDOG_IO : 0; i != head; i++)
+	{
+		const wd_io_t *io = &io_log[i % WATCHDOG_IO];
+		uint64_t begin = __atomic_load_n(&io->begin_us, __ATOMIC_ACQUIRE);
+		uint64_t end = __atomic_load_n(&io->end_us, __ATOMIC_ACQUIRE);
+		if (!begin || !io->op) continue;
+
+		fprintf(f, "%8llu %6d %-5s %-48s %12lld %8u ", (unsigned long long)((now - begin) / 1000), io->tid, io->op, io->name,
+			(long long)io->pos, io->len);
+		if (end >= begin) fprintf(f, "%llu\n", (unsigned long long)(end - begin));
+		else fprintf(f, "IN PROGRESS\n");
+	}
+
+	fprintf(f, "\nTrace rings: %s\n", WATCHDOG_TRACE);
+	fclose(f);
+
+	trace_dump(WATCHDOG_TRACE);
+}
+
+static void *watchdog_thread(void *)
+{
+	trace_thread_name("watchdog");
+
+	uint64_t limit_us = cfg.stall_watchdog * 1000ULL;
+	uint32_t check_us = limit_us / 4;
+	if (check_us < 1000) check_us = 1000;
+
+	uint32_t stalls = 0;
+	uint64_t stall_beat = 0;
+
+	for (;;)
+	{
+		usleep(check_us);
+
+		uint64_t beat = __atomic_load_n(&beat_us, __ATOMIC_RELAXED);
+		uint64_t now = trace_now_us();
+		if (!beat) continue;
+
+		if (stall_beat)
+		{
+			if (beat == stall_beat) continue;
+
+			FILE *f = fopen(WATCHDOG_FILE, "a");
+			if (f)
+			{
+				fprintf(f, "Stall ended after %llu ms.\n", (unsigned long long)((beat - stall_beat) / 1000));
+				fclose(f);
+			}
+			printf("watchdog: stall #%u ended after %llu ms.\n", stalls, (unsigned long long)((beat - stall_beat) / 1000));
+			stall_beat = 0;
+		}
+		else if (now > beat && now - beat > limit_us)
+		{
+			stall_beat = beat;
+			stalls++;
+			printf("watchdog: poll task stalled for %llu ms, recorded in %s\n", (unsigned long long)((now - beat) / 1000), WATCHDOG_FILE);
+			watchdog_record(now, now - beat);
+		}
+	}
+
+	return NULL;
+}
+
+void watchdog_init()
+{
+	if (!cfg.stall_watchdog) return;
+
+	enabled = 1;
+	watchdog_beat();
+
+	// Keep off core #1 since main runs there
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < cpus; i++) if (i != 1) CPU_SET(i, &set);
+	if (!CPU_COUNT(&set)) CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	if (!pthread_create(&thread, &attr, watchdog_thread, NULL)) pthread_detach(thread);
+	else enabled = 0;
+	pthread_attr_destroy(&attr);
+}
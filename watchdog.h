@@ -0,0 +1,40 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+
+// Stall watchdog (stall_watchdog option, ms).
+// A thread on the other core checks that the poll task keeps running. When
+// it hasn't for longer than the limit, the running scheduler task, the last
+// file I/O operations (also those still in progress) and the trace rings are
+// written to WATCHDOG_FILE and WATCHDOG_TRACE, and the stall length once it
+// ended. Catches the rare hold-ups that show up as audio pops or CD timeouts.
+
+#define WATCHDOG_FILE  "/tmp/mister_stall.txt"
+#define WATCHDOG_TRACE "/tmp/mister_stall.json"
+
+void watchdog_init();
+
+// Called by the poll task every round.
+void watchdog_beat();
+
+// File I/O log, a no-op while the watchdog is off.
+uint32_t watchdog_io_begin(const char *op, const char *name, int64_t pos, uint32_t len);
+void watchdog_io_end(uint32_t slot);
+
+struct WatchdogIo
+{
+	uint32_t slot;
+
+	WatchdogIo(const char *op, const char *name, int64_t pos, uint32_t len)
+	{
+		slot = watchdog_io_begin(op, name, pos, len);
+	}
+
+	~WatchdogIo()
+	{
+		watchdog_io_end(slot);
+	}
+};
+
+#endif